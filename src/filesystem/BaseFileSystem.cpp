@@ -300,6 +300,7 @@ CBaseFileSystem::CBaseFileSystem()
 #endif
 
 	m_iMapLoad = 0;
+	m_nVPKMissingFilesGeneration = 0;
 
 	Q_memset( m_PreloadData, 0, sizeof( m_PreloadData ) );
 
@@ -849,6 +850,8 @@ void CBaseFileSystem::AddVPKFile(char const* pszName, SearchPathAdd_t addType)
 
 #pragma message("What search path do we actually add to?")
 	sp->m_pPathIDInfo = FindOrAddPathIDInfo(g_PathIDTable.AddString("GAME"), -1);
+
+	ClearVPKMissingFiles();
 }
 
 void CBaseFileSystem::RemoveVPKFile(char const* pszName)
@@ -864,6 +867,8 @@ void CBaseFileSystem::RemoveVPKFile(char const* pszName)
 			m_SearchPaths.FindAndRemove(*pPath);
 		}
 	}
+
+	ClearVPKMissingFiles();
 }
 
 void CBaseFileSystem::GetVPKFileNames(CUtlVector<CUtlString>& destVector)
@@ -995,6 +1000,46 @@ CFileHandle *CPackFile::OpenFile( const char *pFileName, const char *pOptions )
 	return NULL;
 }
 
+//-----------------------------------------------------------------------------
+// 64 bit FNV-1a of a relative path with case and slashes folded, and repeated
+// slashes counted once, so lookups don't have to copy or fix up the name.
+//-----------------------------------------------------------------------------
+#define VPK_PATH_HASH_SEED		0xcbf29ce484222325ULL
+#define VPK_PATH_HASH_PRIME		0x100000001b3ULL
+
+static inline uint64 HashVPKPathChar( uint64 nHash, char c )
+{
+	if ( c == '\\' )
+	{
+		c = '/';
+	}
+	else if ( c >= 'A' && c <= 'Z' )
+	{
+		c += 'a' - 'A';
+	}
+	return ( nHash ^ (unsigned char)c ) * VPK_PATH_HASH_PRIME;
+}
+
+static uint64 HashVPKPathString( uint64 nHash, const char *pString )
+{
+	bool bLastWasSlash = false;
+	for ( ; *pString; pString++ )
+	{
+		bool bSlash = ( *pString == '/' || *pString == '\\' );
+		if ( !bSlash || !bLastWasSlash )
+		{
+			nHash = HashVPKPathChar( nHash, *pString );
+		}
+		bLastWasSlash = bSlash;
+	}
+	return nHash;
+}
+
+uint64 HashVPKPath( const char *pFilename )
+{
+	return HashVPKPathString( VPK_PATH_HASH_SEED, pFilename );
+}
+
 //-----------------------------------------------------------------------------
 //
 //-----------------------------------------------------------------------------
@@ -1057,6 +1102,9 @@ bool CVPKFile::Prepare(int64 fileLen, int64 nFileOfs)
 		char readbuffer[2] = "";
 		ReadUntilNullOrBreak(extension, readbuffer)
 
+		// " " stands for no extension and for the root directory
+		bool bHasExtension = V_strcmp(extension, " ") != 0;
+
 			CUtlStringMap<CUtlStringMap<CVPKFileEntry*>*>* pExtensionEntry;
 		UtlSymId_t i = m_Entries.Find(extension);
 		if (i != m_Entries.InvalidIndex())
@@ -1068,6 +1116,13 @@ bool CVPKFile::Prepare(int64 fileLen, int64 nFileOfs)
 		{
 			ReadUntilNullOrBreak(path, readbuffer)
 
+			uint64 nDirHash = VPK_PATH_HASH_SEED;
+			if (V_strcmp(path, " ") != 0)
+			{
+				nDirHash = HashVPKPathString(nDirHash, path);
+				nDirHash = HashVPKPathChar(nDirHash, '/');
+			}
+
 				CUtlStringMap<CVPKFileEntry*>* pPathEntry;
 			i = pExtensionEntry->Find(path);
 			if (i != pExtensionEntry->InvalidIndex())
@@ -1082,6 +1137,14 @@ bool CVPKFile::Prepare(int64 fileLen, int64 nFileOfs)
 				//Ok, so CVPKFileEntry is 20 bytes (because of aligment), but we do not want to read 2 extra bytes that are part of the next file name
 				m_fs->FS_fread(pFileEntry, 18, m_hPackFileHandle);
 				pPathEntry->operator[](filename) = pFileEntry;
+
+				uint64 nPathHash = HashVPKPathString(nDirHash, filename);
+				if (bHasExtension)
+				{
+					nPathHash = HashVPKPathChar(nPathHash, '.');
+					nPathHash = HashVPKPathString(nPathHash, extension);
+				}
+				m_PathTable.Insert(nPathHash, pFileEntry);
 				if (pFileEntry->PreloadBytes > 0)
 				{
 					m_fs->FS_fseek(m_hPackFileHandle, pFileEntry->PreloadBytes, FILESYSTEM_SEEK_CURRENT);
@@ -1090,6 +1153,9 @@ bool CVPKFile::Prepare(int64 fileLen, int64 nFileOfs)
 			continue;
 		}
 	}
+
+	// lookups only from here on
+	m_PathTable.Compact(false);
 	return true;
 }
 
@@ -1098,50 +1164,17 @@ bool CVPKFile::Prepare(int64 fileLen, int64 nFileOfs)
 //-----------------------------------------------------------------------------
 bool CVPKFile::FindFile(const char* pFilename, int& nIndex, int64& nOffset, int& nLength)
 {
-	//Extension
-	char extension[FILENAME_MAX];
-	Q_ExtractFileExtension(pFilename, extension, FILENAME_MAX);
-
-	//Path
-	char path[MAX_FILEPATH];
-	Q_ExtractFilePath(pFilename, path, MAX_FILEPATH);
-	if (path[0] == '\0')
-		Q_strcpy(path, " ");
-
-	V_FixSlashes(path, '/');
-	V_StripTrailingSlash(path);
-	V_StripTrailingSlash(path);
-	//File
-	char file[FILENAME_MAX];
-	strcpy(file, V_GetFileName(pFilename));
-	V_StripExtension(file, file, FILENAME_MAX);
-
-	CUtlStringMap<CUtlStringMap<CVPKFileEntry*>*>* pExtensionEntry;
-	UtlSymId_t i = m_Entries.Find(extension);
-	if (i != m_Entries.InvalidIndex())
-		pExtensionEntry = m_Entries[i];
-	else
-		return false;
-
-	CUtlStringMap<CVPKFileEntry*>* pPathEntry;
-	i = pExtensionEntry->Find(path);
-	if (i != pExtensionEntry->InvalidIndex())
-		pPathEntry = pExtensionEntry->operator[](i);
-	else
+	VPKPathTable_t::handle_t h = m_PathTable.Find(HashVPKPath(pFilename));
+	if (h == m_PathTable.InvalidHandle())
 		return false;
 
-	i = pPathEntry->Find(file);
-	if (i != pPathEntry->InvalidIndex())
-	{
-		CVPKFileEntry* pEntry = pPathEntry->operator[](i);
-		nIndex = i;
-		nOffset = pEntry->EntryOffset;
-		nLength = pEntry->EntryLength;
-		m_pLastRequest = pEntry;
+	CVPKFileEntry* pEntry = m_PathTable[h];
+	nIndex = h;
+	nOffset = pEntry->EntryOffset;
+	nLength = pEntry->EntryLength;
+	m_pLastRequest = pEntry;
 
-		return true;
-	}
-	return false;
+	return true;
 }
 
 bool CVPKFile::FindFirst(const char* pWildCard, WIN32_FIND_DATA* dat)
@@ -3102,8 +3135,15 @@ FileHandle_t CBaseFileSystem::FindFileInSearchPaths(
 	}
 
 	CSearchPathsIterator iter( this, &pFileName, pathID, pathFilter );
+
+	// don't ask each VPK about a file none of them have
+	bool bSkipVPKs = !V_IsAbsolutePath( pFileName ) && IsFileMissingFromVPKs( pFileName );
+
 	for ( CSearchPath *pSearchPath = iter.GetFirst(); pSearchPath != NULL; pSearchPath = iter.GetNext() )
 	{
+		if ( bSkipVPKs && pSearchPath->GetPackFile() && pSearchPath->GetPackFile()->m_bIsVPK )
+			continue;
+
 		FileHandle_t filehandle = FindFile( pSearchPath, pFileName, pOptions, flags, ppszResolvedFilename, bTrackCRCs );
 		if ( filehandle )
 			return filehandle;
@@ -3112,6 +3152,62 @@ FileHandle_t CBaseFileSystem::FindFileInSearchPaths(
 	return ( FileHandle_t )0;
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: True if none of the VPKs on the search path have the file. Each
+//			answer is remembered until the VPKs change; files that are found
+//			aren't, their lookups are cheap anyway.
+//-----------------------------------------------------------------------------
+#define VPK_MISSING_FILES_MAX	16384
+
+bool CBaseFileSystem::IsFileMissingFromVPKs( const char *pFileName )
+{
+	uint64 nPathHash = HashVPKPath( pFileName );
+
+	int nGeneration;
+	{
+		AUTO_LOCK_FM( m_VPKMissingFilesMutex );
+		if ( m_VPKMissingFiles.HasElement( nPathHash ) )
+			return true;
+		nGeneration = m_nVPKMissingFilesGeneration;
+	}
+
+	bool bMissing = true;
+	m_SearchPathsMutex.Lock();
+	for ( int i = 0; i < m_SearchPaths.Count() && bMissing; i++ )
+	{
+		CPackFile *pPackFile = m_SearchPaths[i].GetPackFile();
+		if ( pPackFile && pPackFile->m_bIsVPK && static_cast< CVPKFile * >( pPackFile )->HasFile( nPathHash ) )
+		{
+			bMissing = false;
+		}
+	}
+	m_SearchPathsMutex.Unlock();
+
+	if ( bMissing )
+	{
+		AUTO_LOCK_FM( m_VPKMissingFilesMutex );
+
+		// a VPK came or went while we were looking
+		if ( nGeneration != m_nVPKMissingFilesGeneration )
+			return false;
+
+		if ( m_VPKMissingFiles.Count() >= VPK_MISSING_FILES_MAX )
+		{
+			m_VPKMissingFiles.RemoveAll();
+		}
+		m_VPKMissingFiles.Insert( nPathHash );
+	}
+
+	return bMissing;
+}
+
+void CBaseFileSystem::ClearVPKMissingFiles()
+{
+	AUTO_LOCK_FM( m_VPKMissingFilesMutex );
+	m_VPKMissingFiles.RemoveAll();
+	m_nVPKMissingFilesGeneration++;
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: 
 //-----------------------------------------------------------------------------
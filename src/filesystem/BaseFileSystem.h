@@ -56,6 +56,7 @@
 #include "tier1/utllinkedlist.h"
 #include "tier1/utlstring.h"
 #include "tier1/UtlSortVector.h"
+#include "tier1/utlhashtable.h"
 #include "bspfile.h"
 #include "tier1/utldict.h"
 #include "tier1/tier1.h"
@@ -362,6 +363,20 @@ public:
 	unsigned short Dummy; //This is always = 0xffff;
 };
 
+//-----------------------------------------------------------------------------
+// VPK files are looked up by a 64 bit hash of the whole relative path, with
+// case and slashes folded (see HashVPKPath). The hash is good enough as is, so
+// the hash tables just take the low bits.
+//-----------------------------------------------------------------------------
+uint64 HashVPKPath( const char *pFilename );
+
+struct VPKPathHashFunctor
+{
+	unsigned int operator()( uint64 nPathHash ) const { return (unsigned int)nPathHash; }
+};
+
+typedef CUtlHashtable< uint64, CVPKFileEntry*, VPKPathHashFunctor > VPKPathTable_t;
+
 class CVPKFile : public CPackFile
 {
 public:
@@ -381,6 +396,8 @@ public:
 
 	inline bool	UsesVolumes() { return m_bVolumes; }
 
+	bool	HasFile( uint64 nPathHash ) const { return m_PathTable.Find( nPathHash ) != m_PathTable.InvalidHandle(); }
+
 private:
 	bool m_bVolumes;
 	unsigned int m_nVersion;
@@ -392,6 +409,9 @@ private:
 protected:
 	CUtlStringMap<CUtlStringMap<CUtlStringMap<CVPKFileEntry*>*>*> m_Entries;
 
+	// every entry by path hash, for FindFile. m_Entries is for FindFirst/FindNext.
+	VPKPathTable_t m_PathTable;
+
 };
 
 //There is no actual version 0, we just use this struct to determine the actual version
@@ -888,6 +908,14 @@ public:
 
 	CThreadMutex m_SearchPathsMutex;
 	CUtlVector< CSearchPath > m_SearchPaths;
+
+	// Path hashes of files that aren't in any of the VPKs on the search path, so
+	// opening them doesn't probe every pack. Cleared when VPKs come and go.
+	bool IsFileMissingFromVPKs( const char *pFileName );
+	void ClearVPKMissingFiles();
+	CThreadFastMutex m_VPKMissingFilesMutex;
+	CUtlHashtable< uint64, empty_t, VPKPathHashFunctor > m_VPKMissingFiles;
+	int m_nVPKMissingFilesGeneration;
 	CUtlVector<CPathIDInfo*> m_PathIDInfos;
 	CUtlLinkedList<FindData_t> m_FindData;
 
@@ -27,6 +27,8 @@
 #include "particle_parse.h"
 #include "model_types.h"
 #include "tier0/icommandline.h"
+#include "mathlib/ssemath.h"
+#include "bitvec.h"
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
 
@@ -72,8 +74,6 @@ static ConVar cl_particle_sim_fallback_base_multiplier( "cl_particle_sim_fallbac
 //
 //-----------------------------------------------------------------------------
 
-#define PARTICLE_SIZE	96
-
 CParticleMgr *ParticleMgr()
 {
 	static CParticleMgr s_ParticleMgr;
@@ -113,6 +113,188 @@ CParticleSubTexture::CParticleSubTexture()
 }
 
 
+//-----------------------------------------------------------------------------
+// CParticlePool.
+//-----------------------------------------------------------------------------
+
+CParticlePool::CParticlePool()
+{
+	m_pChunks = NULL;
+	m_pLastChunk = NULL;
+}
+
+
+CParticlePool::~CParticlePool()
+{
+	Purge();
+}
+
+
+void CParticlePool::LinkChunk( Chunk_t *pChunk, bool bHead )
+{
+	if ( bHead )
+	{
+		pChunk->m_pPrev = NULL;
+		pChunk->m_pNext = m_pChunks;
+		if ( m_pChunks )
+		{
+			m_pChunks->m_pPrev = pChunk;
+		}
+		else
+		{
+			m_pLastChunk = pChunk;
+		}
+		m_pChunks = pChunk;
+	}
+	else
+	{
+		pChunk->m_pNext = NULL;
+		pChunk->m_pPrev = m_pLastChunk;
+		if ( m_pLastChunk )
+		{
+			m_pLastChunk->m_pNext = pChunk;
+		}
+		else
+		{
+			m_pChunks = pChunk;
+		}
+		m_pLastChunk = pChunk;
+	}
+}
+
+
+void CParticlePool::UnlinkChunk( Chunk_t *pChunk )
+{
+	if ( pChunk->m_pPrev )
+	{
+		pChunk->m_pPrev->m_pNext = pChunk->m_pNext;
+	}
+	else
+	{
+		m_pChunks = pChunk->m_pNext;
+	}
+
+	if ( pChunk->m_pNext )
+	{
+		pChunk->m_pNext->m_pPrev = pChunk->m_pPrev;
+	}
+	else
+	{
+		m_pLastChunk = pChunk->m_pPrev;
+	}
+}
+
+
+Particle *CParticlePool::Alloc()
+{
+	Chunk_t *pChunk = m_pChunks;
+	if ( !pChunk || pChunk->m_nLiveMask == 0xFFFFFFFF )
+	{
+		// Every chunk is full.
+		pChunk = new Chunk_t;
+		pChunk->m_nLiveMask = 0;
+		for ( int i = 0; i < CHUNK_PARTICLES; i++ )
+		{
+			pChunk->m_Slots[i].m_pChunk = pChunk;
+		}
+		LinkChunk( pChunk, true );
+	}
+
+	int nSlot = FirstBitInWord( ~pChunk->m_nLiveMask, 0 );
+	pChunk->m_nLiveMask |= ( 1u << nSlot );
+	if ( pChunk->m_nLiveMask == 0xFFFFFFFF && pChunk != m_pLastChunk )
+	{
+		UnlinkChunk( pChunk );
+		LinkChunk( pChunk, false );
+	}
+	return (Particle *)pChunk->m_Slots[nSlot].m_Particle;
+}
+
+
+void CParticlePool::Free( Particle *pParticle )
+{
+	Slot_t *pSlot = GetSlot( pParticle );
+	Chunk_t *pChunk = pSlot->m_pChunk;
+	int nSlot = pSlot - pChunk->m_Slots;
+	Assert( nSlot >= 0 && nSlot < CHUNK_PARTICLES && ( pChunk->m_nLiveMask & ( 1u << nSlot ) ) );
+
+	bool bWasFull = ( pChunk->m_nLiveMask == 0xFFFFFFFF );
+	pChunk->m_nLiveMask &= ~( 1u << nSlot );
+
+	if ( pChunk->m_nLiveMask == 0 && ( pChunk->m_pPrev || pChunk->m_pNext ) )
+	{
+		// Give empty chunks back, but keep the last one around for the next particles.
+		UnlinkChunk( pChunk );
+		delete pChunk;
+	}
+	else if ( bWasFull && pChunk != m_pChunks )
+	{
+		UnlinkChunk( pChunk );
+		LinkChunk( pChunk, true );
+	}
+}
+
+
+void CParticlePool::Purge()
+{
+	Chunk_t *pNext;
+	for ( Chunk_t *pChunk = m_pChunks; pChunk; pChunk = pNext )
+	{
+		Assert( pChunk->m_nLiveMask == 0 );
+		pNext = pChunk->m_pNext;
+		delete pChunk;
+	}
+	m_pChunks = NULL;
+	m_pLastChunk = NULL;
+}
+
+
+bool CParticlePool::GrowBounds( Vector &bbMin, Vector &bbMax ) const
+{
+	fltx4 vMin = LoadUnaligned3SIMD( bbMin.Base() );
+	fltx4 vMax = LoadUnaligned3SIMD( bbMax.Base() );
+	bool bAny = false;
+
+	for ( Chunk_t *pChunk = m_pChunks; pChunk; pChunk = pChunk->m_pNext )
+	{
+		uint32 nLiveMask = pChunk->m_nLiveMask;
+		if ( !nLiveMask )
+			continue;
+		bAny = true;
+
+		if ( nLiveMask == 0xFFFFFFFF )
+		{
+			// Full chunk, no need to look at the mask.
+			for ( int i = 0; i < CHUNK_PARTICLES; i++ )
+			{
+				// m_Pos is followed by the rest of the particle, so the fourth lane is safe to read
+				fltx4 vPos = LoadUnalignedSIMD( GetParticle( pChunk, i )->m_Pos.Base() );
+				vMin = MinSIMD( vMin, vPos );
+				vMax = MaxSIMD( vMax, vPos );
+			}
+			continue;
+		}
+
+		while ( nLiveMask )
+		{
+			int i = FirstBitInWord( nLiveMask, 0 );
+			nLiveMask &= nLiveMask - 1;
+
+			fltx4 vPos = LoadUnalignedSIMD( GetParticle( pChunk, i )->m_Pos.Base() );
+			vMin = MinSIMD( vMin, vPos );
+			vMax = MaxSIMD( vMax, vPos );
+		}
+	}
+
+	if ( bAny )
+	{
+		StoreUnaligned3SIMD( bbMin.Base(), vMin );
+		StoreUnaligned3SIMD( bbMax.Base(), vMax );
+	}
+	return bAny;
+}
+
+
 //-----------------------------------------------------------------------------
 // CEffectMaterial.
 //-----------------------------------------------------------------------------
@@ -439,9 +621,9 @@ Particle* CParticleEffectBinding::AddParticle( int sizeInBytes, PMaterialHandle
 	
 	// Allocate the puppy. We are actually allocating space for the
 	// internals + the actual data
-	Particle* pParticle = m_pParticleMgr->AllocParticle( PARTICLE_SIZE );
-	if( !pParticle )
+	if ( !m_pParticleMgr->ReserveParticle() )
 		return NULL;
+	Particle* pParticle = m_Pool.Alloc();
 
 	// Link it in
 	CEffectMaterial *pEffectMat = GetEffectMaterial( hMaterial );
@@ -537,26 +719,48 @@ void CParticleEffectBinding::DetectChanges()
 }
 
 
-void CParticleEffectBinding::GrowBBoxFromParticlePositions( CEffectMaterial *pMaterial, bool &bboxSet, Vector &bbMin, Vector &bbMax )
+void CParticleEffectBinding::GrowBBoxFromParticlePositions( bool &bboxSet, Vector &bbMin, Vector &bbMax )
 {
 	// If its bbox is manually set, don't bother updating it here.
 	if ( !GetAutoUpdateBBox() )
 		return;
 
-	for( Particle *pCur=pMaterial->m_Particles.m_pNext; pCur != &pMaterial->m_Particles; pCur=pCur->m_pNext )
+	if ( m_Pool.GrowBounds( bbMin, bbMax ) )
 	{
-		// Update bounding box 
-		VectorMin( bbMin, pCur->m_Pos, bbMin );
-		VectorMax( bbMax, pCur->m_Pos, bbMax );
 		bboxSet = true;
 	}
 }
 
 
+bool CParticleEffectBinding::CheckFullBBoxUpdate()
+{
+	// slow the expensive update operation for particle systems that use auto-update-bbox
+	// auto update the bbox after N frames then randomly 1/N or after 2*N frames 
+	++m_UpdateBBoxCounter;
+	if ( ( m_UpdateBBoxCounter >= BBOX_UPDATE_EVERY_N && random->RandomInt( 0, BBOX_UPDATE_EVERY_N ) == 0 ) ||
+		 ( m_UpdateBBoxCounter >= 2*BBOX_UPDATE_EVERY_N ) )
+	{
+		// reset watchdog
+		m_UpdateBBoxCounter = 0;
+		return true;
+	}
+	return false;
+}
+
+
 //-----------------------------------------------------------------------------
 // Simulate particles
 //-----------------------------------------------------------------------------
 void CParticleEffectBinding::SimulateParticles( float flTimeDelta )
+{
+	if ( !m_pSim->ShouldSimulate() )
+		return;
+
+	SimulateParticles( flTimeDelta, !GetFlag( FLAGS_NEW_PARTICLE_SYSTEM ) && CheckFullBBoxUpdate() );
+}
+
+
+void CParticleEffectBinding::SimulateParticles( float flTimeDelta, bool bFullBBoxUpdate )
 {
 	if ( !m_pSim->ShouldSimulate() )
 		return;
@@ -574,19 +778,6 @@ void CParticleEffectBinding::SimulateParticles( float flTimeDelta )
 		Vector bbMin(0,0,0), bbMax(0,0,0);
 		bool bboxSet = false;
 
-		// slow the expensive update operation for particle systems that use auto-update-bbox
-		// auto update the bbox after N frames then randomly 1/N or after 2*N frames 
-		bool bFullBBoxUpdate = false;
-		++m_UpdateBBoxCounter;
-		if ( ( m_UpdateBBoxCounter >= BBOX_UPDATE_EVERY_N && random->RandomInt( 0, BBOX_UPDATE_EVERY_N ) == 0 ) ||
-			 ( m_UpdateBBoxCounter >= 2*BBOX_UPDATE_EVERY_N ) )
-		{
-			bFullBBoxUpdate = true;
-
-			// reset watchdog
-			m_UpdateBBoxCounter = 0;
-		}
-
 		if ( bFullBBoxUpdate )
 		{
 			BBoxCalcStart( bbMin, bbMax );
@@ -602,15 +793,11 @@ void CParticleEffectBinding::SimulateParticles( float flTimeDelta )
 			simulateIterator.m_flTimeDelta = flTimeDelta;
 
 			m_pSim->SimulateParticles( &simulateIterator );
-
-			// Update the bbox.
-			if ( bFullBBoxUpdate )
-			{
-				GrowBBoxFromParticlePositions( pMaterial, bboxSet, bbMin, bbMax );
-			}
 		}
 		if ( bFullBBoxUpdate )
 		{
+			// Update the bbox.
+			GrowBBoxFromParticlePositions( bboxSet, bbMin, bbMax );
 			BBoxCalcEnd( bboxSet, bbMin, bbMax );
 		}
 	}
@@ -855,6 +1042,7 @@ void CParticleEffectBinding::Term()
 		delete pMaterial;
 	}	
 	m_Materials.Purge();
+	m_Pool.Purge();
 
 	memset( m_EffectMaterialHash, 0, sizeof( m_EffectMaterialHash ) );
 }
@@ -872,7 +1060,8 @@ void CParticleEffectBinding::RemoveParticle( Particle *pParticle )
 	m_pSim->NotifyDestroyParticle(pParticle);
 
 	// Remove it from the list of particles and deallocate
-	m_pParticleMgr->FreeParticle(pParticle);
+	m_Pool.Free( pParticle );
+	m_pParticleMgr->ReleaseParticle();
 }
 
 
@@ -887,16 +1076,7 @@ bool CParticleEffectBinding::RecalculateBoundingBox()
 	Vector bbMin(  1e28,  1e28,  1e28 );
 	Vector bbMax( -1e28, -1e28, -1e28 );
 
-	FOR_EACH_LL( m_Materials, iMaterial )
-	{
-		CEffectMaterial *pMaterial = m_Materials[iMaterial];
-		
-		for( Particle *pCur=pMaterial->m_Particles.m_pNext; pCur != &pMaterial->m_Particles; pCur=pCur->m_pNext )
-		{
-			VectorMin( bbMin, pCur->m_Pos, bbMin );
-			VectorMax( bbMax, pCur->m_Pos, bbMax );
-		}
-	}
+	m_Pool.GrowBounds( bbMin, bbMax );
 
 	// Get the bbox into world space.
 	if ( m_bLocalSpaceTransformIdentity )
@@ -1046,26 +1226,21 @@ void CParticleMgr::LevelInit()
 }
 
 
-Particle *CParticleMgr::AllocParticle( int size )
+bool CParticleMgr::ReserveParticle()
 {
-	// Enforce max particle limit.
-	if ( m_nCurrentParticlesAllocated >= MAX_TOTAL_PARTICLES )
-		return NULL;
-		
-	Particle *pRet = (Particle *)malloc( size );
-	if ( pRet )
-		++m_nCurrentParticlesAllocated;
-
-	return pRet;
+	// Enforce max particle limit. Effects simulating in parallel can get here at the same time.
+	if ( ++m_nCurrentParticlesAllocated > MAX_TOTAL_PARTICLES )
+	{
+		--m_nCurrentParticlesAllocated;
+		return false;
+	}
+	return true;
 }
 
-void CParticleMgr::FreeParticle( Particle *pParticle )
+void CParticleMgr::ReleaseParticle()
 {
 	Assert( m_nCurrentParticlesAllocated > 0 );
-	if ( pParticle )
-		--m_nCurrentParticlesAllocated;
-	
-	free( pParticle );
+	--m_nCurrentParticlesAllocated;
 }
 
 
@@ -1856,6 +2031,13 @@ void CParticleMgr::UpdateNewEffects( float flTimeDelta )
 	}
 }
 
+static float s_flThreadedLegacyTimeStep;
+
+void CParticleMgr::SimulateLegacyEffect( LegacySimulateItem_t &item )
+{
+	item.m_pEffect->SimulateParticles( s_flThreadedLegacyTimeStep, item.m_bFullBBoxUpdate );
+}
+
 void CParticleMgr::UpdateAllEffects( float flTimeDelta )
 {
 	m_bUpdatingEffects = true;
@@ -1869,6 +2051,10 @@ void CParticleMgr::UpdateAllEffects( float flTimeDelta )
 	if( flTimeDelta > 0.1f )
 		flTimeDelta = 0.1f;
 
+	// Effects that only touch their own particles get simulated together after the loop.
+	CUtlVectorFixedGrowable< LegacySimulateItem_t, 128 > parallelSimulateList;
+	const bool bThreaded = r_threaded_particles.GetBool();
+
 	FOR_EACH_LL( m_Effects, iEffect )
 	{
 		CParticleEffectBinding *pEffect = m_Effects[iEffect];
@@ -1897,14 +2083,39 @@ void CParticleMgr::UpdateAllEffects( float flTimeDelta )
 		pEffect->m_pSim->Update( flTimeDelta );
 
 		if ( pEffect->GetFirstFrameFlag() )
+		{
 			pEffect->SetFirstFrameFlag( false );
+		}
+		else if ( bThreaded && pEffect->GetSimulateInParallel() && pEffect->m_pSim->ShouldSimulate() &&
+				  !pEffect->GetFlag( CParticleEffectBinding::FLAGS_NEW_PARTICLE_SYSTEM ) )
+		{
+			// the bbox decision uses the shared random stream, so make it here
+			LegacySimulateItem_t &item = parallelSimulateList[ parallelSimulateList.AddToTail() ];
+			item.m_pEffect = pEffect;
+			item.m_bFullBBoxUpdate = pEffect->CheckFullBBoxUpdate();
+			continue;
+		}
 		else
+		{
 			pEffect->SimulateParticles( flTimeDelta );
+		}
 
 		// Update its position in the leaf system if its bbox changed.
 		pEffect->DetectChanges();
 	}
 
+	if ( parallelSimulateList.Count() )
+	{
+		VPROF_BUDGET( "CParticleMgr::UpdateAllEffects parallel", "Particle Simulation" );
+		s_flThreadedLegacyTimeStep = flTimeDelta;
+		ParallelProcess( parallelSimulateList.Base(), parallelSimulateList.Count(), SimulateLegacyEffect, PreProcessPSystem, PostProcessPSystem );
+
+		for ( int i = 0; i < parallelSimulateList.Count(); i++ )
+		{
+			parallelSimulateList[i].m_pEffect->DetectChanges();
+		}
+	}
+
 	if ( g_bMeasureParticlePerformance )					// use fixed time step
 	{
 		for( float dt=0.0f; dt <= flTimeDelta ; dt+= 0.01f )
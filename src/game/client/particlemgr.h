@@ -117,6 +117,7 @@ entities. Each one is useful under different conditions.
 #include "iclientrenderable.h"
 #include "clientleafsystem.h"
 #include "tier0/fasttimer.h"
+#include "tier0/threadtools.h"
 #include "utllinkedlist.h"
 #include "UtlDict.h"
 #ifdef WIN32
@@ -175,6 +176,65 @@ struct Particle
 	Vector m_Pos;			// Position of the particle in world space
 };
 
+// Every particle gets a slot this big, whatever the size of its structure.
+#define PARTICLE_SIZE	96
+
+
+//-----------------------------------------------------------------------------
+// Particle slots for one effect. They're carved out of fixed size chunks so an
+// effect's particles sit together in memory, and allocating or freeing one
+// doesn't touch the heap or anything shared with other effects.
+//-----------------------------------------------------------------------------
+class CParticlePool
+{
+public:
+	CParticlePool();
+	~CParticlePool();
+
+	Particle	*Alloc();
+	void		Free( Particle *pParticle );
+
+	// Frees all the chunks. All the particles must have been freed.
+	void		Purge();
+
+	// Grows bbMin/bbMax to contain m_Pos of every live particle, walking the chunks
+	// rather than the material lists. Returns false if there aren't any.
+	bool		GrowBounds( Vector &bbMin, Vector &bbMax ) const;
+
+private:
+	enum
+	{
+		CHUNK_PARTICLES = 32,		// one bit each in m_nLiveMask
+	};
+
+	struct Chunk_t;
+
+	// Each slot knows its chunk, so freeing a particle doesn't have to look for it.
+	struct Slot_t
+	{
+		Chunk_t *m_pChunk;
+		byte m_Particle[PARTICLE_SIZE];
+	};
+
+	struct Chunk_t
+	{
+		Chunk_t *m_pNext;
+		Chunk_t *m_pPrev;
+		uint32 m_nLiveMask;
+		Slot_t m_Slots[CHUNK_PARTICLES];
+	};
+
+	static Slot_t *GetSlot( Particle *pParticle )	{ return (Slot_t *)( (byte *)pParticle - offsetof( Slot_t, m_Particle ) ); }
+	static const Particle *GetParticle( const Chunk_t *pChunk, int nSlot )	{ return (const Particle *)pChunk->m_Slots[nSlot].m_Particle; }
+
+	void LinkChunk( Chunk_t *pChunk, bool bHead );
+	void UnlinkChunk( Chunk_t *pChunk );
+
+	// Chunks with a free slot come before the full ones, so Alloc only looks at the head.
+	Chunk_t *m_pChunks;
+	Chunk_t *m_pLastChunk;
+};
+
 
 //-----------------------------------------------------------------------------
 // This is the CParticleMgr's reference to a material in the material system.
@@ -403,6 +463,15 @@ public:
 	void			SetAlwaysSimulate( int bAlwaysSimulate )		{ SetFlag( FLAGS_ALWAYSSIMULATE, bAlwaysSimulate ); }
 
 	void			SetIsNewParticleSystem( void )		{ SetFlag( FLAGS_NEW_PARTICLE_SYSTEM, 1 ); }
+
+	// Set this if the effect's SimulateParticles only touches its own particles and state, so the
+	// particle manager can simulate it on another thread alongside other effects. That rules out
+	// the shared random stream, so nothing that uses CParticleCollision qualifies. Update() and
+	// NotifyRemove() are still always called on the main thread.
+	// This flag is OFF by default.
+	int				GetSimulateInParallel() const					{ return GetFlag( FLAGS_SIMULATE_IN_PARALLEL ); }
+	void			SetSimulateInParallel( int bParallel )			{ SetFlag( FLAGS_SIMULATE_IN_PARALLEL, bParallel ); }
+
 	// Set if the effect was drawn the previous frame.
 	// This can be used by particle effect classes
 	// to decide whether or not they want to spawn
@@ -478,7 +547,11 @@ private:
 						bool bWireframe
 						 );
 
-	void			GrowBBoxFromParticlePositions( CEffectMaterial *pMaterial, bool &bboxSet, Vector &bbMin, Vector &bbMax );
+	void			GrowBBoxFromParticlePositions( bool &bboxSet, Vector &bbMin, Vector &bbMax );
+
+	// Decides whether this frame's simulation recalculates the bbox from all the particles.
+	bool			CheckFullBBoxUpdate();
+	void			SimulateParticles( float flTimeDelta, bool bFullBBoxUpdate );
 
 	void			RenderStart( VMatrix &mTempModel, VMatrix &mTempView );
 	void			RenderEnd( VMatrix &mModel, VMatrix &mView );
@@ -543,7 +616,8 @@ private:
 		FLAGS_DRAW_BEFORE_VIEW_MODEL=(1<<9),// Draw before the view model? If this is set, it assumes FLAGS_DRAW_THRU_LEAF_SYSTEM goes off.
 		FLAGS_AUTOAPPLYLOCALTRANSFORM=(1<<10), // Automatically apply the local transform to CParticleMgr::GetModelView()'s matrix.
 		FLAGS_FIRST_FRAME =         (1<<11),	// Cleared after the first frame that this system exists (so it can simulate after rendering once).
-		FLAGS_NEW_PARTICLE_SYSTEM=  (1<<12) // uses new particle system
+		FLAGS_NEW_PARTICLE_SYSTEM=  (1<<12), // uses new particle system
+		FLAGS_SIMULATE_IN_PARALLEL= (1<<13)	// See SetSimulateInParallel.
 	};
 
 
@@ -589,6 +663,9 @@ private:
 
 	// auto updates the bbox after N frames
 	unsigned short					m_UpdateBBoxCounter;
+
+	// Where the particles live.
+	CParticlePool					m_Pool;
 };
 
 
@@ -689,8 +766,9 @@ public:
 	// Returns the modelview matrix
 	VMatrix&		GetModelView();
 
-	Particle		*AllocParticle( int size );
-	void			FreeParticle( Particle * );
+	// Enforce the max particle limit. The particles themselves come from each effect's CParticlePool.
+	bool			ReserveParticle();
+	void			ReleaseParticle();
 
 	PMaterialHandle	GetPMaterial( const char *pMaterialName );
 	IMaterial*		PMaterialToIMaterial( PMaterialHandle hMaterial );
@@ -729,6 +807,12 @@ public:
 	CNonDrawingParticleSystem *CreateNonDrawingEffect( const char *pEffectName );
 
 private:
+	struct LegacySimulateItem_t
+	{
+		CParticleEffectBinding *m_pEffect;
+		bool m_bFullBBoxUpdate;
+	};
+
 	struct RetireInfo_t
 	{
 		CParticleCollection *m_pCollection;
@@ -741,6 +825,8 @@ private:
 
 	void UpdateNewEffects( float flTimeDelta );				// update new particle effects
 
+	static void SimulateLegacyEffect( LegacySimulateItem_t &item );
+
 	void SpewActiveParticleSystems( );
 
 	CParticleSubTextureGroup* FindOrAddSubTextureGroup( IMaterial *pPageMaterial );
@@ -755,7 +841,7 @@ private:
 
 private:
 
-	int m_nCurrentParticlesAllocated;
+	CInterlockedInt m_nCurrentParticlesAllocated;
 
 	// Directional lighting info.
 	CParticleLightInfo m_DirectionalLight;
@@ -237,6 +237,9 @@ CSmartPtr<CSimpleEmitter> CSimpleEmitter::Create( const char *pDebugName )
 {
 	CSimpleEmitter *pRet = new CSimpleEmitter( pDebugName );
 	pRet->SetDynamicallyAllocated( true );
+	// Derived classes can do anything in their Update* overrides, so only the plain emitter
+	// says its simulation is self contained.
+	pRet->GetBinding().SetSimulateInParallel( true );
 	return pRet;
 }
 
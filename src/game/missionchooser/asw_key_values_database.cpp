@@ -1,6 +1,7 @@
 #include "asw_key_values_database.h"
 #include "asw_system.h"
 #include "KeyValues.h"
+#include "tier1/kvcompiled.h"
 #include "vgui/ILocalize.h"
 #include "tier3/tier3.h"
 
@@ -59,8 +60,8 @@ void CASW_KeyValuesDatabase::LoadFilesInFolder( const char *pPath )
 				// load the mission spec
 				char fullFileName[256];
 				Q_snprintf(fullFileName, sizeof(fullFileName), "%s%s", pPath, filename);
-				KeyValues *pKeyValues = new KeyValues( filename );
-				if (pKeyValues->LoadFromFile(g_pFullFileSystem, fullFileName, "GAME"))
+				KeyValues *pKeyValues = LoadKeyValuesCached( g_pFullFileSystem, fullFileName, "GAME" );
+				if ( pKeyValues )
 				{
 					AddFile( pKeyValues, fullFileName );
 				}
@@ -92,8 +93,8 @@ KeyValues *CASW_KeyValuesDatabase::ReloadFile( const char *pFilename )
 	{
 		if ( !Q_stricmp( pFilename, m_Files[i].m_Filename ) )
 		{
-			KeyValues *pKeyValues = new KeyValues( pFilename );
-			if ( pKeyValues->LoadFromFile( g_pFullFileSystem, pFilename, "GAME" ) )
+			KeyValues *pKeyValues = LoadKeyValuesCached( g_pFullFileSystem, pFilename, "GAME" );
+			if ( pKeyValues )
 			{
 				m_Files[i].m_pKeyValues->deleteThis();
 				m_Files[i].m_pKeyValues = pKeyValues;
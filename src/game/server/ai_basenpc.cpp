@@ -297,26 +297,172 @@ CPostFrameNavigationHook *PostFrameNavigationSystem( void )
 	return &g_PostFrameNavigationHook;
 }
 
+ConVar ai_post_frame_navigation_budget( "ai_post_frame_navigation_budget", "0", 0, "Milliseconds after the game frame that deferred navigation queries can start in. Any that don't start in time wait for the next frame. 0 lets them start until the next frame does." );
+ConVar ai_post_frame_navigation_parallel( "ai_post_frame_navigation_parallel", "1", 0, "Run deferred navigation queries for different NPCs on several threads at once" );
+
 //-----------------------------------------------------------------------------
 // Purpose: 
 //-----------------------------------------------------------------------------
 bool CPostFrameNavigationHook::Init( void )
 {
-	m_Functors.Purge();
+	m_Queries.Purge();
+	m_RunningQueries.Purge();
+	m_QueryGroups.Purge();
+	m_QueryGroupIndex.Purge();
+	m_pQueryJob = NULL;
+	m_flQueryDeadline = 0.0;
+	m_bStopQueries = false;
 	m_bGameFrameRunning = false;
 	return true;
 }
 
-// Main query job
-CJob *g_pQueuedNavigationQueryJob = NULL;
+//-----------------------------------------------------------------------------
+// Purpose: Nothing carries over into the next level
+//-----------------------------------------------------------------------------
+void CPostFrameNavigationHook::LevelShutdownPreEntity( void )
+{
+	WaitForQueries();
 
-static void ProcessNavigationQueries( CFunctor **pData, unsigned int nCount )
+	for ( int i = 0; i < m_Queries.Count(); i++ )
+	{
+		m_Queries[i].m_pFunctor->Release();
+	}
+	m_Queries.RemoveAll();
+	m_bGameFrameRunning = false;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Sorts the queued queries into m_RunningQueries so each NPC's are
+//			together, keeping them in the order they were queued
+//-----------------------------------------------------------------------------
+void CPostFrameNavigationHook::BuildQueryGroups( void )
 {
-	// Run all queued navigation on a separate thread
-	for ( int i = 0; i < nCount; i++ )
+	m_QueryGroups.RemoveAll();
+	m_QueryGroupIndex.RemoveAll();
+
+	for ( int i = 0; i < m_Queries.Count(); i++ )
+	{
+		CAI_BaseNPC *pNPC = m_Queries[i].m_pNPC;
+		UtlHashHandle_t h = m_QueryGroupIndex.Find( pNPC );
+		if ( h == m_QueryGroupIndex.InvalidHandle() )
+		{
+			h = m_QueryGroupIndex.Insert( pNPC, m_QueryGroups.AddToTail() );
+
+			NavigationQueryGroup_t &group = m_QueryGroups.Tail();
+			group.m_pNPC = pNPC;
+			group.m_iFirst = 0;
+			group.m_nCount = 0;
+			group.m_nState = QUERY_GROUP_QUEUED;
+		}
+		m_QueryGroups[m_QueryGroupIndex[h]].m_nCount++;
+	}
+
+	int iFirst = 0;
+	for ( int i = 0; i < m_QueryGroups.Count(); i++ )
 	{
-		(*pData[i])();
+		m_QueryGroups[i].m_iFirst = iFirst;
+		iFirst += m_QueryGroups[i].m_nCount;
+		m_QueryGroups[i].m_nCount = 0;
+	}
+
+	m_RunningQueries.SetCount( m_Queries.Count() );
+	for ( int i = 0; i < m_Queries.Count(); i++ )
+	{
+		NavigationQueryGroup_t &group = m_QueryGroups[m_QueryGroupIndex[m_QueryGroupIndex.Find( m_Queries[i].m_pNPC )]];
+		m_RunningQueries[group.m_iFirst + group.m_nCount++] = m_Queries[i];
+	}
+
+	m_Queries.RemoveAll();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Runs one NPC's queries, unless it's too late to start them
+//-----------------------------------------------------------------------------
+void CPostFrameNavigationHook::ProcessQueryGroup( NavigationQueryGroup_t &group )
+{
+	if ( m_bStopQueries || ( m_flQueryDeadline != 0.0 && Plat_FloatTime() > m_flQueryDeadline ) )
+		return;
+
+	// The NPC may have been removed since the job started
+	if ( !ThreadInterlockedAssignIf( &group.m_nState, QUERY_GROUP_RUNNING, QUERY_GROUP_QUEUED ) )
+		return;
+
+	for ( int i = group.m_iFirst; i < group.m_iFirst + group.m_nCount; i++ )
+	{
+		(*m_RunningQueries[i].m_pFunctor)();
+	}
+
+	ThreadInterlockedExchange( &group.m_nState, QUERY_GROUP_DONE );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Main query job. The NPC groups are spread across the thread pool.
+//			Each NPC has its own navigator and pathfinder, but they all search
+//			the same network, links and dynamic links, and use the shared path
+//			cache:
+//			- The path cache and the network's nearest node cache have their
+//			  own mutexes, the search scratch is per thread and the stats are
+//			  interlocked.
+//			- Dynamic links are only changed from the game frame, which doesn't
+//			  run until FrameUpdatePreEntityThink has waited for the job.
+//			- Searches do write to the network: CAI_Pathfinder clears or re-arms
+//			  a link's stale flag, and locks and unlocks nodes. Those are plain
+//			  stores of values worked out from gpGlobals->curtime, so if two
+//			  NPCs race on the same link or node, the result is one some serial
+//			  order could have given.
+//-----------------------------------------------------------------------------
+void CPostFrameNavigationHook::ProcessQueries( void )
+{
+	int nMaxParallel = ai_post_frame_navigation_parallel.GetBool() ? INT_MAX : 0;
+	ParallelProcess( g_pThreadPool, m_QueryGroups.Base(), m_QueryGroups.Count(), this, &CPostFrameNavigationHook::ProcessQueryGroup, NULL, NULL, nMaxParallel );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Cleans up after the job, and carries over the queries it didn't get to
+//-----------------------------------------------------------------------------
+void CPostFrameNavigationHook::FinishQueries( void )
+{
+	Assert( !m_Queries.Count() );
+
+	for ( int i = 0; i < m_QueryGroups.Count(); i++ )
+	{
+		NavigationQueryGroup_t &group = m_QueryGroups[i];
+		for ( int j = group.m_iFirst; j < group.m_iFirst + group.m_nCount; j++ )
+		{
+			if ( group.m_nState == QUERY_GROUP_QUEUED )
+			{
+				m_Queries.AddToTail( m_RunningQueries[j] );
+			}
+			else if ( group.m_nState != QUERY_GROUP_CANCELLED )
+			{
+				m_RunningQueries[j].m_pFunctor->Release();
+			}
+		}
+
+		if ( group.m_nState == QUERY_GROUP_DONE )
+		{
+			group.m_pNPC->SetNavigationDeferred( false );
+		}
 	}
+
+	m_RunningQueries.RemoveAll();
+	m_QueryGroups.RemoveAll();
+	m_QueryGroupIndex.RemoveAll();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Stops the job starting any more queries and waits for the ones it's
+//			running
+//-----------------------------------------------------------------------------
+void CPostFrameNavigationHook::WaitForQueries( void )
+{
+	if ( !m_pQueryJob )
+		return;
+
+	m_bStopQueries = true;
+	m_pQueryJob->WaitForFinishAndRelease();
+	m_pQueryJob = NULL;
+	FinishQueries();
 }
 
 //-----------------------------------------------------------------------------
@@ -324,16 +470,22 @@ static void ProcessNavigationQueries( CFunctor **pData, unsigned int nCount )
 //-----------------------------------------------------------------------------
 void CPostFrameNavigationHook::FrameUpdatePreEntityThink( void )
 { 
-	// If the thread is executing, then wait for it to finish
-	if ( g_pQueuedNavigationQueryJob )
-	{
-		g_pQueuedNavigationQueryJob->WaitForFinishAndRelease();
-		g_pQueuedNavigationQueryJob = NULL;
-		m_Functors.Purge();
-	}
+	// If the job is still going, let it finish what it's started. Whatever
+	// it hasn't started waits for the next frame.
+	WaitForQueries();
 	
 	if ( ai_post_frame_navigation.GetBool() == false )
+	{
+		// Don't leave anything carried over stranded
+		for ( int i = 0; i < m_Queries.Count(); i++ )
+		{
+			(*m_Queries[i].m_pFunctor)();
+			m_Queries[i].m_pFunctor->Release();
+			m_Queries[i].m_pNPC->SetNavigationDeferred( false );
+		}
+		m_Queries.RemoveAll();
 		return;
+	}
 
 	SetGrameFrameRunning( true ); 
 }
@@ -349,8 +501,17 @@ void CPostFrameNavigationHook::FrameUpdatePostEntityThink( void )
 	// The guts of the NPC will check against this to decide whether or not to queue its navigation calls
 	SetGrameFrameRunning( false );
 
+	if ( !m_Queries.Count() )
+		return;
+
+	BuildQueryGroups();
+
+	float flBudget = ai_post_frame_navigation_budget.GetFloat();
+	m_flQueryDeadline = ( flBudget > 0.0f ) ? Plat_FloatTime() + flBudget * 0.001 : 0.0;
+	m_bStopQueries = false;
+
 	// Throw this off to a thread job
-	g_pQueuedNavigationQueryJob = ThreadExecute( &ProcessNavigationQueries, m_Functors.Base(), m_Functors.Count() );
+	m_pQueryJob = ThreadExecute( this, &CPostFrameNavigationHook::ProcessQueries );
 }
 
 //-----------------------------------------------------------------------------
@@ -361,10 +522,58 @@ void CPostFrameNavigationHook::EnqueueEntityNavigationQuery( CAI_BaseNPC *pNPC,
 	if ( ai_post_frame_navigation.GetBool() == false )
 		return;
 
-	m_Functors.AddToTail( pFunctor );
+	int i = m_Queries.AddToTail();
+	m_Queries[i].m_pNPC = pNPC;
+	m_Queries[i].m_pFunctor = pFunctor;
 	pNPC->SetNavigationDeferred( true );
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: 
+//-----------------------------------------------------------------------------
+void CPostFrameNavigationHook::CancelEntityNavigationQueries( CAI_BaseNPC *pNPC )
+{
+	if ( !pNPC->IsNavigationDeferred() )
+		return;
+
+	pNPC->SetNavigationDeferred( false );
+
+	if ( m_pQueryJob )
+	{
+		UtlHashHandle_t h = m_QueryGroupIndex.Find( pNPC );
+		if ( h != m_QueryGroupIndex.InvalidHandle() )
+		{
+			NavigationQueryGroup_t &group = m_QueryGroups[m_QueryGroupIndex[h]];
+			if ( !ThreadInterlockedAssignIf( &group.m_nState, QUERY_GROUP_CANCELLED, QUERY_GROUP_QUEUED ) )
+			{
+				// Too late, it's being run
+				while ( group.m_nState == QUERY_GROUP_RUNNING )
+				{
+					ThreadPause();
+				}
+
+				// The NPC won't be around when the job is cleaned up
+				group.m_nState = QUERY_GROUP_CANCELLED;
+			}
+
+			for ( int i = group.m_iFirst; i < group.m_iFirst + group.m_nCount; i++ )
+			{
+				m_RunningQueries[i].m_pFunctor->Release();
+			}
+		}
+	}
+
+	// And any it queued while the job was running
+	for ( int i = m_Queries.Count() - 1; i >= 0; i-- )
+	{
+		if ( m_Queries[i].m_pNPC == pNPC )
+		{
+			m_Queries[i].m_pFunctor->Release();
+			m_Queries.Remove( i );
+		}
+	}
+}
+
 //
 //	Deferred Navigation calls go here
 //
@@ -11581,6 +11790,8 @@ CAI_BaseNPC::~CAI_BaseNPC(void)
 {
 	g_AI_Manager.RemoveAI( this );
 
+	PostFrameNavigationSystem()->CancelEntityNavigationQueries( this );
+
 	delete m_pLockedBestSound;
 
 	RemoveMemory();
@@ -11599,6 +11810,9 @@ CAI_BaseNPC::~CAI_BaseNPC(void)
 //-----------------------------------------------------------------------------
 void CAI_BaseNPC::UpdateOnRemove(void)
 {
+	// Don't let a deferred navigation query run on us after we're gone
+	PostFrameNavigationSystem()->CancelEntityNavigationQueries( this );
+
 	if ( !m_bDidDeathCleanup )
 	{
 		if ( m_NPCState == NPC_STATE_DEAD )
@@ -36,6 +36,7 @@
 #include "soundent.h"
 #include "ai_navigator.h"
 #include "tier1/functors.h"
+#include "tier1/utlhashtable.h"
 
 
 #define PLAYER_SQUADNAME "player_squad"
@@ -3214,12 +3215,15 @@ public:
 
 extern ConVar ai_post_frame_navigation;
 
+class CJob;
+
 class CPostFrameNavigationHook : public CBaseGameSystemPerFrame
 {
 public:
 	virtual const char *Name( void ) { return "CPostFrameNavigationHook"; }
 
 	virtual bool Init( void );
+	virtual void LevelShutdownPreEntity( void );
 	virtual void FrameUpdatePostEntityThink( void );
 	virtual void FrameUpdatePreEntityThink( void );
 
@@ -3228,9 +3232,48 @@ public:
 	
 	void EnqueueEntityNavigationQuery( CAI_BaseNPC *pNPC, CFunctor *functor );
 
+	// Throws away the NPC's queued queries. If they're being run right now,
+	// waits for them to finish.
+	void CancelEntityNavigationQueries( CAI_BaseNPC *pNPC );
+
 private:
-	CUtlVector<CFunctor *>	m_Functors;
-	bool					m_bGameFrameRunning;
+	struct NavigationQuery_t
+	{
+		CAI_BaseNPC	*m_pNPC;
+		CFunctor	*m_pFunctor;
+	};
+
+	// One NPC's queries, which have to run in the order they were queued
+	struct NavigationQueryGroup_t
+	{
+		CAI_BaseNPC		*m_pNPC;
+		int				m_iFirst;
+		int				m_nCount;
+		int32 volatile	m_nState;
+	};
+
+	enum
+	{
+		QUERY_GROUP_QUEUED,
+		QUERY_GROUP_RUNNING,
+		QUERY_GROUP_DONE,
+		QUERY_GROUP_CANCELLED,
+	};
+
+	void BuildQueryGroups( void );
+	void ProcessQueries( void );
+	void ProcessQueryGroup( NavigationQueryGroup_t &group );
+	void FinishQueries( void );
+	void WaitForQueries( void );
+
+	CUtlVector<NavigationQuery_t>		m_Queries;			// Queued this frame, after any carried over from the last one
+	CUtlVector<NavigationQuery_t>		m_RunningQueries;	// The ones the job has, grouped by NPC
+	CUtlVector<NavigationQueryGroup_t>	m_QueryGroups;
+	CUtlHashtable<CAI_BaseNPC *, int, PointerHashFunctor, PointerEqualFunctor> m_QueryGroupIndex;	// NPC to group
+	CJob								*m_pQueryJob;
+	double								m_flQueryDeadline;	// Groups that haven't started by now wait for the next frame
+	volatile bool						m_bStopQueries;		// Set when the next frame starts, for the same
+	bool								m_bGameFrameRunning;
 };
 
 extern CPostFrameNavigationHook *PostFrameNavigationSystem( void );
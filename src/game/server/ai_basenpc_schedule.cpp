@@ -545,7 +545,9 @@ static bool ShouldStopProcessingTasks( CAI_BaseNPC *pNPC, int taskTime, int time
 		return true;
 #endif
 
-	// Always stop processing if we've queued up a navigation query on the last task
+	// Always stop processing if we've queued up a navigation query on the last task.
+	// EnqueueEntityNavigationQuery sets this straight away, and it stays set until
+	// the query has run, in FrameUpdatePreEntityThink of a later frame.
 	if ( pNPC->IsNavigationDeferred() )
 		return true;
 
@@ -790,7 +792,8 @@ void CAI_BaseNPC::MaintainSchedule ( void )
 					if ( GetTaskInterrupt() == 0 || TaskIsComplete() || HasCondition(COND_TASK_FAILED) )
 						break;
 
-					if ( ShouldUseEfficiency() && ShouldStopProcessingTasks( this, Plat_MSTime() - taskTime, timeLimit ) )
+					// don't run the task again before its deferred navigation query has run
+					if ( ( ShouldUseEfficiency() || IsNavigationDeferred() ) && ShouldStopProcessingTasks( this, Plat_MSTime() - taskTime, timeLimit ) )
 					{
 						bStopProcessing = true;
 						break;
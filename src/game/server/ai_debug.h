@@ -10,6 +10,8 @@
 
 #include "fmtstr.h"
 #include "ai_debug_shared.h"
+#include "tier0/fasttimer.h"
+#include "tier0/threadtools.h"
 
 #if defined( _WIN32 )
 #pragma once
@@ -45,6 +47,43 @@
 #define AI_PROFILE_SCOPE_( pszName ) 	((void)0)
 #endif
 
+//-----------------------------------------------------------------------------
+// Pathfinding counters, printed and reset by ai_pathfind_stats. Unlike the
+// profile scopes above these are always on; a query costs two clock reads.
+//-----------------------------------------------------------------------------
+struct AI_PathfindStats_t
+{
+	int32	m_nQueries;
+	int32	m_nFailed;
+	int64	m_nExpansions;
+	int64	m_nCycles;
+};
+
+extern AI_PathfindStats_t g_AIPathfindStats;
+
+class CAI_PathfindStatsScope
+{
+public:
+	CAI_PathfindStatsScope() : m_nExpansions( 0 ), m_bFailed( true ) { m_Timer.Start(); }
+	~CAI_PathfindStatsScope()
+	{
+		m_Timer.End();
+		ThreadInterlockedIncrement( &g_AIPathfindStats.m_nQueries );
+		if ( m_bFailed )
+			ThreadInterlockedIncrement( &g_AIPathfindStats.m_nFailed );
+		ThreadInterlockedExchangeAdd64( &g_AIPathfindStats.m_nExpansions, m_nExpansions );
+		ThreadInterlockedExchangeAdd64( &g_AIPathfindStats.m_nCycles, (int64)m_Timer.GetDuration().GetLongCycles() );
+	}
+
+	int			m_nExpansions;
+	bool		m_bFailed;
+
+private:
+	CFastTimer	m_Timer;
+};
+
+#define AI_PATHFIND_STATS_SCOPE( name )	CAI_PathfindStatsScope name
+
 
 enum AIMsgFlags
 {
@@ -15,6 +15,7 @@
 #include "ai_link.h"
 #include "ai_network.h"
 #include "ai_networkmanager.h"
+#include "ai_pathcache.h"
 #include "saverestore_utlvector.h"
 #include "editor_sendcommand.h"
 #include "bitstring.h"
@@ -497,6 +498,7 @@ void CAI_DynamicLink::SetLinkState(void)
 	}
 
 	pLink->m_pDynamicLink = this;
+	byte oldLinkInfo = pLink->m_LinkInfo;
 	if (m_nLinkState == LINK_OFF)
 	{
 		pLink->m_LinkInfo |=  bits_LINK_OFF;
@@ -506,6 +508,11 @@ void CAI_DynamicLink::SetLinkState(void)
 		pLink->m_LinkInfo &= ~bits_LINK_OFF;
 	}
 
+	if ( ( oldLinkInfo ^ pLink->m_LinkInfo ) & bits_LINK_OFF )
+	{
+		g_AIPathCache.Invalidate();
+	}
+
 	if ( m_bPreciseMovement )
 	{
 		pLink->m_LinkInfo |= bits_LINK_PRECISE_MOVEMENT;
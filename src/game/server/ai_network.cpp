@@ -292,7 +292,13 @@ int	CAI_Network::NearestNodeToPoint( CAI_BaseNPC *pNPC, const Vector &vecOrigin,
 
 		if ( cachedNode != NO_NODE && ( !pFilter || pFilter->IsValid( m_pAInode[cachedNode] ) ) )
 		{
-			m_NearestCache[cachePos].expiration	= gpGlobals->curtime + NEARNODE_CACHE_LIFE;
+			AUTO_LOCK_FM( m_NearestCacheMutex );
+
+			// Another thread may have reused the entry since we looked
+			if ( m_NearestCache[cachePos].node == cachedNode )
+			{
+				m_NearestCache[cachePos].expiration	= gpGlobals->curtime + NEARNODE_CACHE_LIFE;
+			}
 			return cachedNode;
 		}
 	}
@@ -396,6 +402,8 @@ int	CAI_Network::GetCachedNode(const Vector &checkPos, Hull_t nHull, int *pCache
 	if ( ai_no_node_cache.GetBool() )
 		return NOT_CACHED;
 
+	AUTO_LOCK_FM( m_NearestCacheMutex );
+
 	// Walk from newest to oldest.
 	int iNewest = m_iNearestCacheNext + 1;
 	for ( int i = 0; i < NEARNODE_CACHE_SIZE; i++ )
@@ -446,6 +454,8 @@ void CAI_Network::SetCachedNearestNode(const Vector &checkPos, int nodeID, Hull_
 	if ( ai_no_node_cache.GetBool() )
 		return;
 
+	AUTO_LOCK_FM( m_NearestCacheMutex );
+
 	m_NearestCache[m_iNearestCacheNext].vTestPosition	= checkPos;
 	m_NearestCache[m_iNearestCacheNext].node			= nodeID;
 	m_NearestCache[m_iNearestCacheNext].hull			= nHull;
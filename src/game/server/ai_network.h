@@ -14,6 +14,7 @@
 
 #include "ispatialpartition.h"
 #include "utlpriorityqueue.h"
+#include "tier0/threadtools.h"
 
 // ------------------------------------
 
@@ -190,6 +191,7 @@ private:
 
 	NearNodeCache_T		m_NearestCache[NEARNODE_CACHE_SIZE];	// Cache of nearest nodes
 	int					m_iNearestCacheNext;					// Oldest record in the cache
+	CThreadFastMutex	m_NearestCacheMutex;					// Deferred navigation queries look up nodes from several threads
 
 #ifdef AI_NODE_TREE
 	ISpatialPartition * m_pNodeTree;
@@ -24,6 +24,7 @@
 #include "ai_hull.h"
 #include "ndebugoverlay.h"
 #include "ai_hint.h"
+#include "ai_pathcache.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -849,6 +850,7 @@ void CAI_NetworkManager::DeleteAllAINetworks(void)
 	CAI_DynamicLink::gm_bInitialized = false;
 	gm_fNetworksLoaded = false;
 	g_pBigAINet = NULL;
+	g_AIPathCache.Reset();
 }
 
 
@@ -864,6 +866,7 @@ void CAI_NetworkManager::BuildNetworkGraph( void )
 
 	CAI_DynamicLink::gm_bInitialized = false;
 	g_AINetworkBuilder.Build( m_pNetwork );
+	g_AIPathCache.Reset();
 
 	// If I'm loading for the first time save.  Otherwise I'm 
 	// doing a wc edit and I don't want to save
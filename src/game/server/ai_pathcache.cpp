@@ -0,0 +1,303 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Server wide cache of the way NPCs route through the node graph
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "cbase.h"
+#include "ai_pathcache.h"
+#include "ai_network.h"
+#include "ai_node.h"
+#include "ai_link.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+// Nodes further than this from the first node of a cluster start a new one
+#define AI_CLUSTER_RADIUS	512.0f
+
+CAI_PathCache g_AIPathCache;
+
+//-----------------------------------------------------------------------------
+
+CAI_PathCache::CAI_PathCache()
+ :	m_pNetwork( NULL ),
+	m_nNetworkNodes( 0 ),
+	m_CoarseOpenSet( 0, 0, CoarseOpenLessPriority )
+{
+	V_memset( &m_Stats, 0, sizeof( m_Stats ) );
+}
+
+//-----------------------------------------------------------------------------
+
+bool CAI_PathCache::Update( CAI_Network *pNetwork )
+{
+	if ( !pNetwork || !pNetwork->NumNodes() )
+		return false;
+
+	if ( pNetwork != m_pNetwork || pNetwork->NumNodes() != m_nNetworkNodes )
+	{
+		AUTO_LOCK_FM( m_Mutex );
+		if ( pNetwork != m_pNetwork || pNetwork->NumNodes() != m_nNetworkNodes )
+		{
+			BuildClusters( pNetwork );
+		}
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Grows each cluster breadth first from the lowest numbered node not
+//			yet in a cluster, over links any hull can use, until it is full or
+//			runs out of nearby nodes.
+//-----------------------------------------------------------------------------
+void CAI_PathCache::BuildClusters( CAI_Network *pNetwork )
+{
+	int nNodes = pNetwork->NumNodes();
+	CAI_Node **pAInode = pNetwork->AccessNodes();
+
+	m_Corridors.RemoveAll();
+	m_CorridorClusters.RemoveAll();
+	m_Clusters.RemoveAll();
+	m_NodeClusters.SetCount( nNodes );
+	for ( int i = 0; i < nNodes; i++ )
+	{
+		m_NodeClusters[i] = 0xffff;
+	}
+
+	CUtlVector<int> open;
+	open.EnsureCapacity( MAX_CLUSTER_NODES );
+
+	for ( int iSeed = 0; iSeed < nNodes; iSeed++ )
+	{
+		if ( m_NodeClusters[iSeed] != 0xffff )
+			continue;
+
+		unsigned short iCluster = m_Clusters.AddToTail();
+		Cluster_t &cluster = m_Clusters[iCluster];
+		const Vector &vecSeed = pAInode[iSeed]->GetOrigin();
+
+		open.RemoveAll();
+		open.AddToTail( iSeed );
+		m_NodeClusters[iSeed] = iCluster;
+
+		cluster.vecCenter.Init();
+		for ( int iOpen = 0; iOpen < open.Count(); iOpen++ )
+		{
+			CAI_Node *pNode = pAInode[open[iOpen]];
+			cluster.vecCenter += pNode->GetOrigin();
+
+			for ( int link = 0; link < pNode->NumLinks() && open.Count() < MAX_CLUSTER_NODES; link++ )
+			{
+				CAI_Link *pLink = pNode->GetLinkByIndex( link );
+				int iDest = pLink->DestNodeID( open[iOpen] );
+				if ( m_NodeClusters[iDest] != 0xffff )
+					continue;
+
+				bool bUsable = false;
+				for ( int hull = 0; hull < NUM_HULLS; hull++ )
+				{
+					bUsable |= ( pLink->m_iAcceptedMoveTypes[hull] != 0 );
+				}
+
+				if ( !bUsable || pAInode[iDest]->GetOrigin().DistToSqr( vecSeed ) > AI_CLUSTER_RADIUS * AI_CLUSTER_RADIUS )
+					continue;
+
+				m_NodeClusters[iDest] = iCluster;
+				open.AddToTail( iDest );
+			}
+		}
+		cluster.vecCenter /= open.Count();
+	}
+
+	// Every node owns all its links, so looking at each node's links from
+	// its own side finds the portals in both directions.
+	for ( int iNode = 0; iNode < nNodes; iNode++ )
+	{
+		CAI_Node *pNode = pAInode[iNode];
+		Cluster_t &cluster = m_Clusters[m_NodeClusters[iNode]];
+
+		for ( int link = 0; link < pNode->NumLinks(); link++ )
+		{
+			CAI_Link *pLink = pNode->GetLinkByIndex( link );
+			unsigned short iDestCluster = m_NodeClusters[pLink->DestNodeID( iNode )];
+			if ( iDestCluster == m_NodeClusters[iNode] )
+				continue;
+
+			int iPortal;
+			for ( iPortal = 0; iPortal < cluster.portals.Count(); iPortal++ )
+			{
+				if ( cluster.portals[iPortal].iCluster == iDestCluster )
+					break;
+			}
+
+			if ( iPortal == cluster.portals.Count() )
+			{
+				iPortal = cluster.portals.AddToTail();
+				cluster.portals[iPortal].iCluster = iDestCluster;
+				V_memset( cluster.portals[iPortal].acceptedMoveTypes, 0, sizeof( cluster.portals[iPortal].acceptedMoveTypes ) );
+			}
+
+			for ( int hull = 0; hull < NUM_HULLS; hull++ )
+			{
+				cluster.portals[iPortal].acceptedMoveTypes[hull] |= pLink->m_iAcceptedMoveTypes[hull];
+			}
+		}
+	}
+
+	m_CoarseNodes.SetCount( m_Clusters.Count() );
+
+	m_pNetwork = pNetwork;
+	m_nNetworkNodes = nNodes;
+
+	DevMsg( 2, "AI path cache: %d nodes in %d clusters\n", nNodes, m_Clusters.Count() );
+}
+
+//-----------------------------------------------------------------------------
+
+uint64 CAI_PathCache::GetCorridorKey( Hull_t hull, int moveCaps, int iStartNode, int iGoalNode ) const
+{
+	return (uint64)hull | ( (uint64)( moveCaps & AI_MOVE_TYPE_BITS ) << 8 ) |
+		( (uint64)m_NodeClusters[iStartNode] << 16 ) | ( (uint64)m_NodeClusters[iGoalNode] << 32 );
+}
+
+//-----------------------------------------------------------------------------
+
+bool CAI_PathCache::GetCorridor( Hull_t hull, int moveCaps, int iStartNode, int iGoalNode, CUtlVector<unsigned short> &corridor )
+{
+	AUTO_LOCK_FM( m_Mutex );
+
+	UtlHashHandle_t h = m_Corridors.Find( GetCorridorKey( hull, moveCaps, iStartNode, iGoalNode ) );
+	if ( h != m_Corridors.InvalidHandle() )
+	{
+		const CachedCorridor_t &cached = m_Corridors.Element( h );
+		corridor.CopyArray( m_CorridorClusters.Base() + cached.iFirst, cached.nClusters );
+		return true;
+	}
+
+	FindCoarseCorridor( hull, moveCaps, m_NodeClusters[iStartNode], m_NodeClusters[iGoalNode], corridor );
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+
+void CAI_PathCache::StoreCorridor( Hull_t hull, int moveCaps, int iStartNode, int iGoalNode, const CUtlVector<unsigned short> &corridor )
+{
+	AUTO_LOCK_FM( m_Mutex );
+
+	if ( m_Corridors.Count() >= MAX_CACHED_CORRIDORS )
+	{
+		m_Corridors.RemoveAll();
+		m_CorridorClusters.RemoveAll();
+	}
+
+	CachedCorridor_t cached;
+	cached.iFirst = m_CorridorClusters.Count();
+	cached.nClusters = corridor.Count();
+	m_CorridorClusters.AddMultipleToTail( corridor.Count(), corridor.Base() );
+
+	bool bInserted;
+	UtlHashHandle_t h = m_Corridors.Insert( GetCorridorKey( hull, moveCaps, iStartNode, iGoalNode ), cached, &bInserted );
+	if ( !bInserted )
+	{
+		// another thread got here first
+		m_Corridors.Element( h ) = cached;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: A* over the cluster graph, from cluster center to cluster center,
+//			using only portals that the hull can move through
+//-----------------------------------------------------------------------------
+void CAI_PathCache::FindCoarseCorridor( Hull_t hull, int moveCaps, int iStartCluster, int iGoalCluster, CUtlVector<unsigned short> &corridor )
+{
+	corridor.RemoveAll();
+
+	for ( int i = 0; i < m_CoarseNodes.Count(); i++ )
+	{
+		m_CoarseNodes[i].g = FLT_MAX;
+		m_CoarseNodes[i].iParent = -1;
+		m_CoarseNodes[i].bClosed = false;
+	}
+
+	const Vector &vecGoal = m_Clusters[iGoalCluster].vecCenter;
+
+	m_CoarseOpenSet.RemoveAll();
+	m_CoarseNodes[iStartCluster].g = 0;
+
+	CoarseOpen_t open;
+	open.f = m_Clusters[iStartCluster].vecCenter.DistTo( vecGoal );
+	open.iCluster = iStartCluster;
+	m_CoarseOpenSet.Insert( open );
+
+	while ( m_CoarseOpenSet.Count() )
+	{
+		int iCluster = m_CoarseOpenSet.ElementAtHead().iCluster;
+		m_CoarseOpenSet.RemoveAtHead();
+
+		CoarseNode_t &node = m_CoarseNodes[iCluster];
+		if ( node.bClosed )
+			continue;
+		node.bClosed = true;
+
+		if ( iCluster == iGoalCluster )
+		{
+			for ( int i = iGoalCluster; i != -1; i = m_CoarseNodes[i].iParent )
+			{
+				corridor.AddToHead( i );
+			}
+			return;
+		}
+
+		const Cluster_t &cluster = m_Clusters[iCluster];
+		for ( int iPortal = 0; iPortal < cluster.portals.Count(); iPortal++ )
+		{
+			const ClusterPortal_t &portal = cluster.portals[iPortal];
+			if ( !( portal.acceptedMoveTypes[hull] & moveCaps ) )
+				continue;
+
+			CoarseNode_t &dest = m_CoarseNodes[portal.iCluster];
+			float g = node.g + cluster.vecCenter.DistTo( m_Clusters[portal.iCluster].vecCenter );
+			if ( dest.bClosed || g >= dest.g )
+				continue;
+
+			dest.g = g;
+			dest.iParent = iCluster;
+
+			open.f = g + m_Clusters[portal.iCluster].vecCenter.DistTo( vecGoal );
+			open.iCluster = portal.iCluster;
+			m_CoarseOpenSet.Insert( open );
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+void CAI_PathCache::Invalidate()
+{
+	AUTO_LOCK_FM( m_Mutex );
+
+	if ( m_Corridors.Count() )
+	{
+		m_Corridors.RemoveAll();
+		m_CorridorClusters.RemoveAll();
+		m_Stats.m_nInvalidations++;
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+void CAI_PathCache::Reset()
+{
+	AUTO_LOCK_FM( m_Mutex );
+
+	m_Corridors.RemoveAll();
+	m_CorridorClusters.RemoveAll();
+	m_Clusters.RemoveAll();
+	m_NodeClusters.RemoveAll();
+	m_CoarseNodes.RemoveAll();
+	m_pNetwork = NULL;
+	m_nNetworkNodes = 0;
+}
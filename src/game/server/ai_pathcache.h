@@ -0,0 +1,145 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Server wide cache of the way NPCs route through the node graph,
+//			so that crowds of NPCs heading to the same place (swarm hordes)
+//			don't each search the whole graph.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef AI_PATHCACHE_H
+#define AI_PATHCACHE_H
+
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "utlvector.h"
+#include "utlpriorityqueue.h"
+#include "tier1/utlhashtable.h"
+#include "tier1/generichash.h"
+#include "tier0/threadtools.h"
+#include "ai_hull.h"
+
+class CAI_Network;
+
+//-----------------------------------------------------------------------------
+// The node graph is split into clusters of nearby linked nodes, and the links
+// between clusters are the portals of a much smaller cluster graph. A path is
+// remembered as the clusters it passed through (its corridor), keyed by hull,
+// start cluster, goal cluster and movement capabilities.
+//
+// CAI_Pathfinder::FindBestPath only searches the nodes inside a corridor,
+// either a cached one or one found on the cluster graph. The search still
+// applies the NPC's own link and cost rules, so a corridor can make a route a
+// little longer but never hands out one the NPC couldn't take. If the corridor
+// search fails the whole graph is searched.
+//
+// Cluster building and the corridor table are guarded by a mutex. The node to
+// cluster map is read without it, which is fine because clusters only change
+// when the network itself does.
+//-----------------------------------------------------------------------------
+
+struct AI_PathCacheStats_t
+{
+	int32	m_nHits;			// searched a cached corridor
+	int32	m_nCoarse;			// searched a corridor from the cluster graph
+	int32	m_nFallbacks;		// corridor search failed or there was none
+	int32	m_nInvalidations;
+};
+
+class CAI_PathCache
+{
+public:
+	CAI_PathCache();
+
+	// Builds the clusters if the network has changed since they were built.
+	// Returns false if there is nothing to search.
+	bool	Update( CAI_Network *pNetwork );
+
+	int		NumClusters() const				{ return m_Clusters.Count(); }
+	int		GetNodeCluster( int iNode ) const	{ return m_NodeClusters[iNode]; }
+
+	// Fills in a corridor from iStartNode to iGoalNode. Returns true if it came
+	// from the cache; otherwise it was found on the cluster graph and is empty
+	// if the goal can't be reached at all.
+	bool	GetCorridor( Hull_t hull, int moveCaps, int iStartNode, int iGoalNode, CUtlVector<unsigned short> &corridor );
+
+	// Remembers the clusters of a route that was found
+	void	StoreCorridor( Hull_t hull, int moveCaps, int iStartNode, int iGoalNode, const CUtlVector<unsigned short> &corridor );
+
+	// Forgets every corridor. Called when a link is turned on or off or a door
+	// changes state.
+	void	Invalidate();
+
+	// Forgets the clusters too, for when the network is rebuilt or freed
+	void	Reset();
+
+	AI_PathCacheStats_t	m_Stats;
+
+private:
+	enum
+	{
+		MAX_CLUSTER_NODES		= 32,
+		MAX_CACHED_CORRIDORS	= 1024,
+	};
+
+	struct ClusterPortal_t
+	{
+		unsigned short	iCluster;
+		byte			acceptedMoveTypes[NUM_HULLS];	// of all the links to iCluster
+	};
+
+	struct Cluster_t
+	{
+		Vector						vecCenter;
+		CUtlVector<ClusterPortal_t>	portals;
+	};
+
+	struct CachedCorridor_t
+	{
+		int		iFirst;				// in m_CorridorClusters
+		int		nClusters;
+	};
+
+	struct CoarseOpen_t
+	{
+		float	f;
+		int		iCluster;
+	};
+
+	struct CoarseNode_t
+	{
+		float	g;
+		int		iParent;
+		bool	bClosed;
+	};
+
+	struct CorridorKeyHash
+	{
+		unsigned int operator()( uint64 nKey ) const { return HashItem( nKey ); }
+	};
+
+	static bool CoarseOpenLessPriority( CoarseOpen_t const &a, CoarseOpen_t const &b ) { return a.f > b.f; }
+
+	void	BuildClusters( CAI_Network *pNetwork );
+	uint64	GetCorridorKey( Hull_t hull, int moveCaps, int iStartNode, int iGoalNode ) const;
+	void	FindCoarseCorridor( Hull_t hull, int moveCaps, int iStartCluster, int iGoalCluster, CUtlVector<unsigned short> &corridor );
+
+	CThreadFastMutex		m_Mutex;
+
+	CAI_Network *			m_pNetwork;
+	int						m_nNetworkNodes;
+	CUtlVector<unsigned short>	m_NodeClusters;
+	CUtlVector<Cluster_t>	m_Clusters;
+
+	CUtlHashtable<uint64, CachedCorridor_t, CorridorKeyHash>	m_Corridors;
+	CUtlVector<unsigned short>	m_CorridorClusters;
+
+	CUtlVector<CoarseNode_t>	m_CoarseNodes;
+	CUtlPriorityQueue<CoarseOpen_t>	m_CoarseOpenSet;
+};
+
+extern CAI_PathCache g_AIPathCache;
+
+#endif // AI_PATHCACHE_H
@@ -19,9 +19,11 @@
 #include "ai_routedist.h"
 #include "ai_moveprobe.h"
 #include "ai_dynamiclink.h"
+#include "ai_pathcache.h"
 #include "ai_localnavigator.h"
 #include "ai_hint.h"
 #include "bitstring.h"
+#include "utlpriorityqueue.h"
 
 //@todo: bad dependency!
 #include "ai_navigator.h"
@@ -339,6 +341,155 @@ int CAI_Pathfinder::NearestNodeToPoint( const Vector &vecOrigin )
 	return GetNetwork()->NearestNodeToPoint( GetOuter(), vecOrigin );
 }
 
+//-----------------------------------------------------------------------------
+// A* state for FindBestPath, one per thread so searches never allocate once
+// the arrays have grown to the network's size. A node's entries are only
+// valid when its generation matches the current search's, so starting a
+// search doesn't have to clear anything.
+//-----------------------------------------------------------------------------
+struct AI_PathNodeState_t
+{
+	unsigned int	nGeneration;
+	float			g;				// best known cost from the start
+	float			h;				// estimated cost to the goal
+	bool			bClosed;		// expanded with its current g
+};
+
+struct AI_OpenNode_t
+{
+	float	f;
+	int		iNode;
+};
+
+static bool AI_OpenNodeLessPriority( AI_OpenNode_t const &a, AI_OpenNode_t const &b )
+{
+	// the head of the queue is the lowest f
+	return a.f > b.f;
+}
+
+class CAI_PathfindScratch
+{
+public:
+	CAI_PathfindScratch()
+		: m_OpenSet( 0, 0, AI_OpenNodeLessPriority ),
+		  m_nGeneration( 0 )
+	{
+	}
+
+	void BeginSearch( int nNodes )
+	{
+		if ( m_Nodes.Count() < nNodes )
+		{
+			int nOld = m_Nodes.Count();
+			m_Nodes.SetCount( nNodes );
+			m_Parents.SetCount( nNodes );
+			for ( int i = nOld; i < nNodes; i++ )
+			{
+				m_Nodes[i].nGeneration = 0;
+			}
+		}
+
+		if ( ++m_nGeneration == 0 )
+		{
+			// wrapped, forget everything
+			for ( int i = 0; i < m_Nodes.Count(); i++ )
+			{
+				m_Nodes[i].nGeneration = 0;
+			}
+			for ( int i = 0; i < m_CorridorGenerations.Count(); i++ )
+			{
+				m_CorridorGenerations[i] = 0;
+			}
+			m_nGeneration = 1;
+		}
+
+		m_OpenSet.RemoveAll();
+	}
+
+	// Limits the current search to the clusters in corridor
+	void SetCorridor( const CUtlVector<unsigned short> &corridor, int nClusters )
+	{
+		if ( m_CorridorGenerations.Count() < nClusters )
+		{
+			int nOld = m_CorridorGenerations.Count();
+			m_CorridorGenerations.SetCount( nClusters );
+			for ( int i = nOld; i < nClusters; i++ )
+			{
+				m_CorridorGenerations[i] = 0;
+			}
+		}
+
+		for ( int i = 0; i < corridor.Count(); i++ )
+		{
+			m_CorridorGenerations[corridor[i]] = m_nGeneration;
+		}
+	}
+
+	bool IsInCorridor( int iCluster ) const
+	{
+		return m_CorridorGenerations[iCluster] == m_nGeneration;
+	}
+
+	// Returns the node's state, resetting it if this search hasn't seen it yet
+	AI_PathNodeState_t &Node( int iNode )
+	{
+		AI_PathNodeState_t &node = m_Nodes[iNode];
+		if ( node.nGeneration != m_nGeneration )
+		{
+			node.nGeneration = m_nGeneration;
+			node.g = FLT_MAX;
+			node.h = -1.0f;
+			node.bClosed = false;
+			m_Parents[iNode] = NO_NODE;
+		}
+		return node;
+	}
+
+	CUtlVector<AI_PathNodeState_t>	m_Nodes;
+	CUtlVector<int>					m_Parents;	// for MakeRouteFromParents
+	CUtlPriorityQueue<AI_OpenNode_t> m_OpenSet;
+	unsigned int					m_nGeneration;
+
+	CUtlVector<unsigned int>		m_CorridorGenerations;	// by path cache cluster
+	CUtlVector<unsigned short>		m_Corridor;
+};
+
+static CTHREADLOCALPTR( CAI_PathfindScratch ) s_pPathfindScratch;
+
+static CAI_PathfindScratch *GetPathfindScratch()
+{
+	CAI_PathfindScratch *pScratch = s_pPathfindScratch;
+	if ( !pScratch )
+	{
+		// lives as long as the thread does
+		pScratch = new CAI_PathfindScratch;
+		s_pPathfindScratch = pScratch;
+	}
+	return pScratch;
+}
+
+AI_PathfindStats_t g_AIPathfindStats;
+
+CON_COMMAND( ai_pathfind_stats, "Prints how much work node graph path searches have done since the last ai_pathfind_stats, then resets the counts" )
+{
+	AI_PathfindStats_t stats = g_AIPathfindStats;
+	V_memset( &g_AIPathfindStats, 0, sizeof( g_AIPathfindStats ) );
+
+	double flMicroseconds = CCycleCount( (uint64)stats.m_nCycles ).GetMicrosecondsF();
+	int nQueries = MAX( stats.m_nQueries, 1 );
+	Msg( "%d path searches (%d failed), %lld node expansions\n", stats.m_nQueries, stats.m_nFailed, stats.m_nExpansions );
+	Msg( "%.1f expansions per search, %.1f us per search, %.1f ms total\n",
+		(double)stats.m_nExpansions / nQueries, flMicroseconds / nQueries, flMicroseconds / 1000.0 );
+
+	AI_PathCacheStats_t cacheStats = g_AIPathCache.m_Stats;
+	V_memset( &g_AIPathCache.m_Stats, 0, sizeof( g_AIPathCache.m_Stats ) );
+
+	Msg( "path cache: %d hits, %d cluster graph corridors, %d full searches, %d invalidations, %d clusters\n",
+		cacheStats.m_nHits, cacheStats.m_nCoarse, cacheStats.m_nFallbacks, cacheStats.m_nInvalidations, g_AIPathCache.NumClusters() );
+}
+
+ConVar ai_path_cache( "ai_path_cache", "1", FCVAR_CHEAT, "Search node graph paths through the clusters that earlier paths between the same places took" );
+
 //-----------------------------------------------------------------------------
 // Purpose: Build a path between two nodes
 //-----------------------------------------------------------------------------
@@ -351,42 +502,102 @@ AI_Waypoint_t *CAI_Pathfinder::FindBestPath(int startID, int endID)
 	if ( !GetNetwork()->NumNodes() )
 		return NULL;
 
+	AI_PATHFIND_STATS_SCOPE( stats );
+
 #ifdef AI_PERF_MON
 	m_nPerfStatPB++;
 #endif
 
+	if ( !ai_path_cache.GetBool() || !g_AIPathCache.Update( GetNetwork() ) )
+		return SearchNodeGraph( startID, endID, false, stats );
+
+	// Try the corridor first. Fall back to the whole graph if it was stale
+	// or the cluster graph was too optimistic for this NPC.
+	CAI_PathfindScratch *pScratch = GetPathfindScratch();
+	bool bCached = g_AIPathCache.GetCorridor( GetHullType(), CapabilitiesGet(), startID, endID, pScratch->m_Corridor );
+	AI_Waypoint_t *pRoute = NULL;
+	if ( pScratch->m_Corridor.Count() )
+	{
+		pRoute = SearchNodeGraph( startID, endID, true, stats );
+		if ( pRoute )
+		{
+			ThreadInterlockedIncrement( bCached ? &g_AIPathCache.m_Stats.m_nHits : &g_AIPathCache.m_Stats.m_nCoarse );
+			if ( bCached )
+				return pRoute;
+		}
+	}
+
+	if ( !pRoute )
+	{
+		ThreadInterlockedIncrement( &g_AIPathCache.m_Stats.m_nFallbacks );
+		pRoute = SearchNodeGraph( startID, endID, false, stats );
+		if ( !pRoute )
+			return NULL;
+	}
+
+	// Remember the clusters the route went through, goal first. The search's
+	// parents are still in the scratch state.
+	CUtlVector<unsigned short> &corridor = pScratch->m_Corridor;
+	corridor.RemoveAll();
+	for ( int iNode = endID; iNode != NO_NODE; iNode = pScratch->m_Parents[iNode] )
+	{
+		unsigned short iCluster = g_AIPathCache.GetNodeCluster( iNode );
+		if ( !corridor.Count() || corridor.Tail() != iCluster )
+		{
+			corridor.AddToTail( iCluster );
+		}
+	}
+	g_AIPathCache.StoreCorridor( GetHullType(), CapabilitiesGet(), startID, endID, corridor );
+
+	return pRoute;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: A* from startID to endID, only through the clusters in the
+//			thread's corridor if bInCorridor
+//-----------------------------------------------------------------------------
+AI_Waypoint_t *CAI_Pathfinder::SearchNodeGraph( int startID, int endID, bool bInCorridor, CAI_PathfindStatsScope &stats )
+{
 	int nNodes = GetNetwork()->NumNodes();
 	CAI_Node **pAInode = GetNetwork()->AccessNodes();
 
-	CVarBitVec	openBS(nNodes);
-	CVarBitVec	closeBS(nNodes);
-
 	// ------------- INITIALIZE ------------------------
-	float* nodeG = (float *)stackalloc( nNodes * sizeof(float) );
-	float* nodeH = (float *)stackalloc( nNodes * sizeof(float) );
-	float* nodeF = (float *)stackalloc( nNodes * sizeof(float) );
-	int*   nodeP = (int *)stackalloc( nNodes * sizeof(int) );		// Node parent 
-
-	for (int node=0;node<nNodes;node++)
+	CAI_PathfindScratch *pScratch = GetPathfindScratch();
+	pScratch->BeginSearch( nNodes );
+	if ( bInCorridor )
 	{
-		nodeG[node] = FLT_MAX;
-		nodeP[node] = -1;
+		pScratch->SetCorridor( pScratch->m_Corridor, g_AIPathCache.NumClusters() );
 	}
 
-	nodeG[startID] = 0;
+	// Every link costs at least the straight line distance it covers (see
+	// CAI_Navigator::MovementCost), so the straight line distance to the goal
+	// never overestimates. It's worked out once per node, when first reached.
+	Vector vecGoal = pAInode[endID]->GetPosition(GetHullType());
 
-	nodeH[startID] = 0.1*(pAInode[startID]->GetPosition(GetHullType())-pAInode[endID]->GetPosition(GetHullType())).Length(); // Don't want to over estimate
-	nodeF[startID] = nodeG[startID] + nodeH[startID];
+	AI_PathNodeState_t &start = pScratch->Node( startID );
+	start.g = 0;
+	start.h = (pAInode[startID]->GetPosition(GetHullType()) - vecGoal).Length();
 
-	openBS.Set(startID);
-	closeBS.Set( startID );
+	AI_OpenNode_t open;
+	open.f = start.g + start.h;
+	open.iNode = startID;
+	pScratch->m_OpenSet.Insert( open );
 
 	// --------------- FIND BEST PATH ------------------
-	while (!openBS.IsAllClear()) 
+	while ( pScratch->m_OpenSet.Count() ) 
 	{
-		int smallestID = CAI_Network::FindBSSmallest(&openBS,nodeF,nNodes);
-	
-		openBS.Clear(smallestID);
+		AI_OpenNode_t smallest = pScratch->m_OpenSet.ElementAtHead();
+		pScratch->m_OpenSet.RemoveAtHead();
+
+		int smallestID = smallest.iNode;
+		AI_PathNodeState_t &smallestState = pScratch->Node( smallestID );
+
+		// stale queue entry, the node was reached more cheaply since
+		if ( smallestState.bClosed || smallest.f > smallestState.g + smallestState.h )
+			continue;
+
+		smallestState.bClosed = true;
+		stats.m_nExpansions++;
 
 		CAI_Node *pSmallestNode = pAInode[smallestID];
 		
@@ -395,10 +606,14 @@ AI_Waypoint_t *CAI_Pathfinder::FindBestPath(int startID, int endID)
 
 		if (smallestID == endID) 
 		{
-			AI_Waypoint_t* route = MakeRouteFromParents(&nodeP[0], endID);
+			stats.m_bFailed = false;
+
+			AI_Waypoint_t* route = MakeRouteFromParents(pScratch->m_Parents.Base(), endID);
 			return route;
 		}
 
+		Vector r1 = pSmallestNode->GetPosition(GetHullType());
+
 		// Check this if the node is immediately in the path after the startNode 
 		// that it isn't blocked
 		for (int link=0; link < pSmallestNode->NumLinks();link++) 
@@ -412,7 +627,9 @@ AI_Waypoint_t *CAI_Pathfinder::FindBestPath(int startID, int endID)
 			int moveType = nodeLink->m_iAcceptedMoveTypes[GetHullType()] & CapabilitiesGet();
 			int testID	 = nodeLink->DestNodeID(smallestID);
 
-			Vector r1 = pSmallestNode->GetPosition(GetHullType());
+			if ( bInCorridor && !pScratch->IsInCorridor( g_AIPathCache.GetNodeCluster( testID ) ) )
+				continue;
+
 			Vector r2 = pAInode[testID]->GetPosition(GetHullType());
 
 			float dist   = GetOuter()->GetNavigator()->MovementCost( moveType, r1, r2 ); // MovementCost takes ref parameters!!
@@ -432,17 +649,24 @@ AI_Waypoint_t *CAI_Pathfinder::FindBestPath(int startID, int endID)
 				dist += s_pDangerDistFactor[ nodeLink->m_nDangerCount - 1 ];
 			}
 
-			float new_g  = nodeG[smallestID] + dist;
+			float new_g  = smallestState.g + dist;
 
-			if ( !closeBS.IsBitSet(testID) || (new_g < nodeG[testID]) ) 
+			AI_PathNodeState_t &test = pScratch->Node( testID );
+			if ( new_g < test.g ) 
 			{
-				nodeP[testID] = smallestID;
-				nodeG[testID] = new_g;
-				nodeH[testID] = (pAInode[testID]->GetPosition(GetHullType())-pAInode[endID]->GetPosition(GetHullType())).Length();
-				nodeF[testID] = nodeG[testID] + nodeH[testID];
+				// NPCs can make links cheaper than their length in MovementCost,
+				// so a closed node can still improve. Open it again if so.
+				pScratch->m_Parents[testID] = smallestID;
+				test.g = new_g;
+				test.bClosed = false;
+				if ( test.h < 0 )
+				{
+					test.h = (r2 - vecGoal).Length();
+				}
 
-				closeBS.Set( testID );
-				openBS.Set( testID );
+				open.f = test.g + test.h;
+				open.iNode = testID;
+				pScratch->m_OpenSet.Insert( open );
 			}
 		}
 	}
@@ -21,6 +21,7 @@ struct AI_Waypoint_t;
 class CAI_Link;
 class CAI_Network;
 class CAI_Node;
+class CAI_PathfindStatsScope;
 
 
 //-----------------------------------------------------------------------------
@@ -120,6 +121,7 @@ private:
 
 	//---------------------------------
 	
+	AI_Waypoint_t*	SearchNodeGraph( int startID, int endID, bool bInCorridor, CAI_PathfindStatsScope &stats );
 	AI_Waypoint_t*	MakeRouteFromParents(int *parentArray, int endID);
 	AI_Waypoint_t*	CreateNodeWaypoint( Hull_t hullType, int nodeID, int nodeFlags = 0 );
 	
@@ -73,7 +73,7 @@ public:
 	void			Look( int iDistance );// basic sight function for npcs
 
 	bool			ShouldSeeEntity( CBaseEntity *pEntity ); // logical query
-	bool			CanSeeEntity( CBaseEntity *pSightEnt ); // more expensive cone & raycast test
+	virtual bool	CanSeeEntity( CBaseEntity *pSightEnt ); // more expensive cone & raycast test
 
 	
 	bool			DidSeeEntity( CBaseEntity *pSightEnt ) const; //  a less expensive query that looks at cached results from recent conditionsa gathering
@@ -147,7 +147,8 @@ private:
 	AI_Waypoint_t *pNext;
 	AI_Waypoint_t *pPrev;
 
-	DECLARE_FIXEDSIZE_ALLOCATOR(AI_Waypoint_t);
+	// Routes are built by deferred navigation queries on the thread pool too
+	DECLARE_FIXEDSIZE_ALLOCATOR_MT(AI_Waypoint_t);
 
 public:
 	DECLARE_SIMPLE_DATADESC();
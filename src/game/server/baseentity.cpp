@@ -71,6 +71,7 @@
 #include "cellcoord.h"
 #include "sendprop_priorities.h"
 #include "videocfg/videocfg.h"
+#include "querycache.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -5014,7 +5015,23 @@ void CBaseEntity::Teleport( const Vector *newPosition, const QAngle *newAngles,
 	int i;
 	for ( i = 0; i < teleportList.Count(); i++)
 	{
+		CBaseEntity *pTeleport = teleportList[i].pEntity;
+		const bool bSolid = pTeleport->IsSolid();
+		Vector vecOldMins, vecOldMaxs;
+		if ( bSolid )
+		{
+			pTeleport->CollisionProp()->WorldSpaceAABB( &vecOldMins, &vecOldMaxs );
+		}
+
 		TeleportEntity( this, teleportList[i], newPosition, newAngles, newVelocity );
+
+		if ( bSolid )
+		{
+			// lines of sight cached across where it was or is now have to be traced again
+			Vector vecNewMins, vecNewMaxs;
+			pTeleport->CollisionProp()->WorldSpaceAABB( &vecNewMins, &vecNewMaxs );
+			QueryCacheNoteEntityMoved( vecOldMins, vecOldMaxs, vecNewMins, vecNewMaxs );
+		}
 	}
 
 	for (i = 0; i < teleportList.Count(); i++)
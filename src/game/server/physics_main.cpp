@@ -33,6 +33,7 @@
 #include "vphysicsupdateai.h"
 #include "pushentity.h"
 #include "igamemovement.h"
+#include "querycache.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -1437,6 +1438,14 @@ void CBaseEntity::PerformPush( float movetime )
 	g_pPushedEntities->BeginPush( this );
 	if (movetime > 0)
 	{
+		// remember where we were so cached lines of sight we swing across get retraced
+		Vector vecOldMins, vecOldMaxs;
+		const bool bSolid = IsSolid();
+		if ( bSolid )
+		{
+			CollisionProp()->WorldSpaceAABB( &vecOldMins, &vecOldMaxs );
+		}
+
 		if ( GetLocalAngularVelocity() != vec3_angle )
 		{
 			if ( GetLocalVelocity() != vec3_origin )
@@ -1493,6 +1502,16 @@ void CBaseEntity::PerformPush( float movetime )
 			Blocked( m_pBlocker );
 		}
 
+		if ( bSolid )
+		{
+			Vector vecNewMins, vecNewMaxs;
+			CollisionProp()->WorldSpaceAABB( &vecNewMins, &vecNewMaxs );
+			if ( vecNewMins != vecOldMins || vecNewMaxs != vecOldMaxs )
+			{
+				QueryCacheNoteEntityMoved( vecOldMins, vecOldMaxs, vecNewMins, vecNewMaxs );
+			}
+		}
+
 		// NOTE NOTE: This is here for brutal reasons.
 		// For MOVETYPE_PUSH objects with VPhysics shadow objects, the move done time
 		// is handled by CBaseEntity::VPhyicsUpdatePusher, which only gets called if
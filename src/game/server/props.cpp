@@ -9,6 +9,7 @@
 #include "cbase.h"
 #include "BasePropDoor.h"
 #include "ai_basenpc.h"
+#include "ai_pathcache.h"
 #include "npcevent.h"
 #include "engine/IEngineSound.h"
 #include "locksounds.h"
@@ -4461,6 +4462,7 @@ void CBasePropDoor::InputUnlock(inputdata_t &inputdata)
 void CBasePropDoor::Lock(void)
 {
 	m_bLocked = true;
+	g_AIPathCache.Invalidate();
 }
 
 
@@ -4476,6 +4478,7 @@ void CBasePropDoor::Unlock(void)
 	}
 
 	m_bLocked = false;
+	g_AIPathCache.Invalidate();
 }
 
 //-----------------------------------------------------------------------------
@@ -4559,6 +4562,7 @@ void CBasePropDoor::DoorOpen(CBaseEntity *pOpenAwayFrom)
 void CBasePropDoor::DoorOpenMoveDone(void)
 {
 	SetDoorBlocker( NULL );
+	g_AIPathCache.Invalidate();
 
 	if (!HasSpawnFlags(SF_DOOR_SILENT))
 	{
@@ -4680,6 +4684,7 @@ void CBasePropDoor::DoorClose(void)
 void CBasePropDoor::DoorCloseMoveDone(void)
 {
 	SetDoorBlocker( NULL );
+	g_AIPathCache.Invalidate();
 
 	if (!HasSpawnFlags(SF_DOOR_SILENT))
 	{
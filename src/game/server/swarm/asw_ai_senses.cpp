@@ -4,6 +4,7 @@
 #include "ai_basenpc.h"
 #include "saverestore_utlvector.h"
 #include "asw_shareddefs.h"
+#include "querycache.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -27,6 +28,12 @@ const float ASW_AI_SUPER_EFFICIENT_MARINE_SEARCH_TIME = .55;
 
 const float ASW_AI_MARINE_LOOK_HEIGHT = 128.0f;
 
+// how old a queued line of sight result can be before the alien does its own trace.
+// Results are traced the frame after they're asked for, so this allows a few frames of slack.
+const float ASW_AI_QUEUED_LOS_MAX_AGE = 0.15f;
+
+ConVar asw_alien_queued_los( "asw_alien_queued_los", "1", FCVAR_CHEAT, "Aliens use line of sight results traced in parallel by the query cache, up to 0.15 seconds old" );
+
 #pragma pack(push)
 #pragma pack(1)
 
@@ -114,6 +121,26 @@ void CASW_AI_Senses::PerformSensing()
 	SwarmSense(m_SwarmSenseDist);
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Same test as the base senses, but take the line of sight from the
+//			query cache when it traced it recently, queueing a refresh so the
+//			trace runs in the cache's parallel update instead of here.
+//-----------------------------------------------------------------------------
+bool CASW_AI_Senses::CanSeeEntity( CBaseEntity *pSightEnt )
+{
+	if ( !GetOuter()->FInViewCone( pSightEnt ) )
+		return false;
+
+	bool bClear;
+	if ( asw_alien_queued_los.GetBool() &&
+		 GetQueuedLineOfSightResult( GetOuter(), pSightEnt, MASK_BLOCKLOS, &bClear, ASW_AI_QUEUED_LOS_MAX_AGE ) )
+	{
+		return bClear;
+	}
+
+	return GetOuter()->FVisible( pSightEnt );
+}
+
 void CASW_AI_Senses::SwarmSense(int iDistance)
 {
 	IASW_Spawnable_NPC* pAlienOuter = dynamic_cast<IASW_Spawnable_NPC*>(GetOuter());
@@ -39,6 +39,7 @@ public:
 	DECLARE_SIMPLE_DATADESC();
 
 	virtual	void PerformSensing();
+	virtual bool CanSeeEntity( CBaseEntity *pSightEnt );
 
 	void SwarmSense(int iDistance);		// the swarm can sense marines through walls within a certain radius
 	int SwarmSenseMarines(int iDistance);
@@ -454,7 +454,7 @@ void CASW_Alien::UpdateSleepState(bool bInPVS)
 		if (m_hCine != NULL && GetSleepState() > AISS_AWAKE )
 			Wake();
 
-		bInPVS = MarineCanSee(384, 0.1f);
+		bInPVS = MarineCanSee(ASW_ALIEN_WAKE_PADDING, 0.1f);
 		if ( bInPVS )
 			SetCondition( COND_IN_PVS );
 		else
@@ -480,7 +480,7 @@ void CASW_Alien::UpdateSleepState(bool bInPVS)
 			if( m_fLastSleepCheckTime < gpGlobals->curtime + ASW_ALIEN_SLEEP_CHECK_INTERVAL )
 			{
 				//if (!GetEnemy() && !MarineNearby(1024.0f) )
-				if (!GetEnemy() && !MarineCanSee(384, 2.0f) )
+				if (!GetEnemy() && !MarineCanSee(ASW_ALIEN_WAKE_PADDING, 2.0f) )
 				{
 					SetSleepState( AISS_WAITING_FOR_PVS );
 
@@ -2436,7 +2436,7 @@ void CASW_Alien::UpdateEfficiency( bool bInPVS )
 	bool bInVisibilityPVS = ( UTIL_FindClientInVisibilityPVS( edict() ) != NULL );
 
 	//if ( bInPVS && MarineNearby(1024) ) 
-	if ( bInPVS && MarineCanSee(384, 1.0f) ) 
+	if ( bInPVS && MarineCanSee(ASW_ALIEN_WAKE_PADDING, 1.0f) ) 
 	{
 		SetMoveEfficiency( AIME_NORMAL );
 	}
@@ -2490,8 +2490,15 @@ bool CASW_Alien::MarineCanSee(int padding, float interval)
 {
 	if (gpGlobals->curtime >= m_fLastMarineCanSeeTime + interval)
 	{
-		bool bCorpseCanSee = false;
-		m_bLastMarineCanSee = (UTIL_ASW_AnyMarineCanSee(GetAbsOrigin(), padding, bCorpseCanSee) != NULL) || bCorpseCanSee;
+		if (padding == ASW_ALIEN_WAKE_PADDING)
+		{
+			m_bLastMarineCanSee = ASWMarineViews().CanSeeAlien(this);
+		}
+		else
+		{
+			bool bCorpseCanSee = false;
+			m_bLastMarineCanSee = (UTIL_ASW_AnyMarineCanSee(GetAbsOrigin(), padding, bCorpseCanSee) != NULL) || bCorpseCanSee;
+		}
 		m_fLastMarineCanSeeTime = gpGlobals->curtime;
 	}
 	return m_bLastMarineCanSee;
@@ -11,24 +11,121 @@
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
 
-CUtlVector<CASW_Lag_Compensation*>	g_LagCompensatingEntities;
 bool CASW_Lag_Compensation::s_bInLagCompensation = false;
 CBasePlayer* CASW_Lag_Compensation::s_pLagCompensatingPlayer = NULL;
+float CASW_Lag_Compensation::s_fLaggedTime = -1;
+CBaseEntity* CASW_Lag_Compensation::s_pLagCompensatingMarine = NULL;
 
 ConVar asw_alien_unlag("asw_alien_unlag", "1", 0, "Unlag alien positions by player's ping");
 extern ConVar sv_maxunlag;
 extern ConVar sv_showlagcompensation;
 
-CASW_Lag_Compensation::CASW_Lag_Compensation()
-{	
-	g_LagCompensatingEntities.AddToTail(this);
+//-----------------------------------------------------------------------------
+// Purpose: Position history of every lag compensating entity.  Each field has
+//			its own array indexed by history slot, so working out where
+//			everything was doesn't need to touch the entities themselves.
+//-----------------------------------------------------------------------------
+class CASW_Lag_History
+{
+public:
+	int AllocSlot( CASW_Lag_Compensation *pOwner );
+	void FreeSlot( int iSlot );
+	int NumSlots() const { return m_Owners.Count(); }
+
+	// finds the oldest sample that's just past the lagged time requested, or -1 if there are no samples
+	int FindSample( int iSlot, float fLaggedTime ) const;
+
+	CUtlVector<CASW_Lag_Compensation*> m_Owners;	// NULL if the slot is free
+	CUtlVector<int> m_FreeSlots;
+	CUtlVector<int> m_Tail;		// which sample is the current one
+
+	// indexed by [sample][slot]
+	CUtlVector<float> m_Time[ASW_LAG_NUM_POSITION_HISTORY_SAMPLES];
+	CUtlVector<Vector> m_Origin[ASW_LAG_NUM_POSITION_HISTORY_SAMPLES];
+	CUtlVector<Vector> m_Mins[ASW_LAG_NUM_POSITION_HISTORY_SAMPLES];		// surrounding bounds, relative to the origin
+	CUtlVector<Vector> m_Maxs[ASW_LAG_NUM_POSITION_HISTORY_SAMPLES];
+};
+
+static CASW_Lag_History g_LagHistory;
+
+// slots moved by the current lag compensation request
+static CUtlVector<int> g_LagCompensatedSlots;
 
-	m_iPositionHistoryTail = 0;
+struct LagCompensationStats_t
+{
+	int m_nRequests;
+	int m_nConsidered;
+	int m_nMoved;
+	int m_nSkippedStill;		// lagged position is where they are now
+	int m_nSkippedShot;			// shot couldn't hit them at either position
+};
+static LagCompensationStats_t g_LagCompensationStats;
+
+int CASW_Lag_History::AllocSlot( CASW_Lag_Compensation *pOwner )
+{
+	int iSlot;
+	if ( m_FreeSlots.Count() )
+	{
+		iSlot = m_FreeSlots.Tail();
+		m_FreeSlots.RemoveMultipleFromTail( 1 );
+	}
+	else
+	{
+		iSlot = m_Owners.AddToTail();
+		m_Tail.AddToTail();
+		for (int i=0;i<ASW_LAG_NUM_POSITION_HISTORY_SAMPLES;i++)
+		{
+			m_Time[i].AddToTail();
+			m_Origin[i].AddToTail();
+			m_Mins[i].AddToTail();
+			m_Maxs[i].AddToTail();
+		}
+	}
+
+	m_Owners[iSlot] = pOwner;
+	m_Tail[iSlot] = 0;
 	for (int i=0;i<ASW_LAG_NUM_POSITION_HISTORY_SAMPLES;i++)
 	{
-		m_vecPositionHistory[i] = Vector(0,0,0);
-		m_fPositionHistoryTime[i] = 0;
-	}	
+		m_Time[i][iSlot] = 0;
+		m_Origin[i][iSlot] = vec3_origin;
+		m_Mins[i][iSlot] = vec3_origin;
+		m_Maxs[i][iSlot] = vec3_origin;
+	}
+	return iSlot;
+}
+
+void CASW_Lag_History::FreeSlot( int iSlot )
+{
+	m_Owners[iSlot] = NULL;
+	m_FreeSlots.AddToTail( iSlot );
+}
+
+int CASW_Lag_History::FindSample( int iSlot, float fLaggedTime ) const
+{
+	int iCurrentIndex = m_Tail[iSlot];
+	int iChosenIndex = -1;
+	for (int i=0;i<ASW_LAG_NUM_POSITION_HISTORY_SAMPLES;i++)	// go through all our history samples and find the oldest one that's just past the lagged time requested
+	{
+		const float fSampleTime = m_Time[iCurrentIndex][iSlot];
+		if (fSampleTime == 0)	// this isn't a real index
+		{
+			break;
+		}
+		iChosenIndex = iCurrentIndex;					// it's a real sample, so we might use this one
+		if (fSampleTime <= fLaggedTime)		// if the sample is behind our lagged time, then stop, we'll use this one
+		{
+			break;
+		}
+		iCurrentIndex--;	// count the index back
+		if (iCurrentIndex == -1)		// loop around if we need to
+			iCurrentIndex = ASW_LAG_NUM_POSITION_HISTORY_SAMPLES-1;
+	}
+	return iChosenIndex;
+}
+
+CASW_Lag_Compensation::CASW_Lag_Compensation()
+{	
+	m_iHistorySlot = g_LagHistory.AllocSlot(this);
 	m_vecRealPosition = Vector(0,0,0);
 	m_bSetRealPosition = false;
 	m_fRealSimulationTime = 0;
@@ -37,7 +134,7 @@ CASW_Lag_Compensation::CASW_Lag_Compensation()
 
 CASW_Lag_Compensation::~CASW_Lag_Compensation()
 {
-	g_LagCompensatingEntities.FindAndRemove(this);
+	g_LagHistory.FreeSlot(m_iHistorySlot);
 }
 
 void CASW_Lag_Compensation::Init(CBaseAnimating *pOwner)
@@ -59,15 +156,50 @@ void CASW_Lag_Compensation::StorePositionHistory()
 		return;
 	if ( GetOwnerNPC() && GetOwnerNPC()->GetSleepState() != AISS_AWAKE )
 		return;
-	if (gpGlobals->curtime - m_fPositionHistoryTime[m_iPositionHistoryTail] < ASW_LAG_MIN_SAMPLE_TIME_DIFFERENCE)
+
+	const int iSlot = m_iHistorySlot;
+	int iTail = g_LagHistory.m_Tail[iSlot];
+	if (gpGlobals->curtime - g_LagHistory.m_Time[iTail][iSlot] < ASW_LAG_MIN_SAMPLE_TIME_DIFFERENCE)
 		return;
 	
-	m_iPositionHistoryTail++;
-	if ( m_iPositionHistoryTail >= ASW_LAG_NUM_POSITION_HISTORY_SAMPLES)
-		m_iPositionHistoryTail = 0;
+	iTail++;
+	if ( iTail >= ASW_LAG_NUM_POSITION_HISTORY_SAMPLES)
+		iTail = 0;
+	g_LagHistory.m_Tail[iSlot] = iTail;
+
+	const Vector &vecOrigin = m_hOwnerEntity->GetAbsOrigin();
+	Vector vecMins, vecMaxs;
+	m_hOwnerEntity->CollisionProp()->WorldSpaceSurroundingBounds( &vecMins, &vecMaxs );
+
+	g_LagHistory.m_Origin[iTail][iSlot] = vecOrigin;
+	g_LagHistory.m_Mins[iTail][iSlot] = vecMins - vecOrigin;
+	g_LagHistory.m_Maxs[iTail][iSlot] = vecMaxs - vecOrigin;
+	g_LagHistory.m_Time[iTail][iSlot] = gpGlobals->curtime;
+}
 
-	m_vecPositionHistory[m_iPositionHistoryTail] = m_hOwnerEntity->GetAbsOrigin();
-	m_fPositionHistoryTime[m_iPositionHistoryTail] = gpGlobals->curtime;
+//-----------------------------------------------------------------------------
+// Purpose: Works out where we were at the lagged time.  Returns false if
+//			there's no history to move us back with.
+//-----------------------------------------------------------------------------
+bool CASW_Lag_Compensation::GetLaggedOrigin( const float fLaggedTime, Vector &vecResult, int *pSample )
+{
+	const int iChosenIndex = g_LagHistory.FindSample( m_iHistorySlot, fLaggedTime );
+	if (iChosenIndex == -1)
+		return false;
+
+	// work out what % of the movement we need to do based on the difference between now and the lagged time
+	const float base = (gpGlobals->curtime - g_LagHistory.m_Time[iChosenIndex][m_iHistorySlot]);
+	if (base <= 0)	// if our only sample is 'now' then we can't do any lag compensation
+		return false;
+
+	const float fFraction = (gpGlobals->curtime - fLaggedTime) / base;
+	const Vector &vecOrigin = m_hOwnerEntity->GetAbsOrigin();
+	vecResult = vecOrigin + (g_LagHistory.m_Origin[iChosenIndex][m_iHistorySlot] - vecOrigin) * fFraction;
+	if ( pSample )
+	{
+		*pSample = iChosenIndex;
+	}
+	return true;
 }
 
 const Vector& CASW_Lag_Compensation::GetLaggedPosition( const float fLaggedTime )
@@ -77,34 +209,10 @@ const Vector& CASW_Lag_Compensation::GetLaggedPosition( const float fLaggedTime
 	if ( GetOwnerNPC() && GetOwnerNPC()->GetSleepState() != AISS_AWAKE )
 		return m_hOwnerEntity->GetAbsOrigin();
 
-	int iCurrentIndex = m_iPositionHistoryTail;
-	int iChosenIndex = -1;
-	for (int i=0;i<ASW_LAG_NUM_POSITION_HISTORY_SAMPLES;i++)	// go through all our history samples and find the oldest one that's just past the lagged time requested
-	{
-		if (m_fPositionHistoryTime[iCurrentIndex] == 0)	// this isn't a real index
-		{
-			break;
-		}
-		iChosenIndex = iCurrentIndex;					// it's a real sample, so we might use this one
-		if (m_fPositionHistoryTime[iCurrentIndex] <= fLaggedTime)		// if the sample is behind our lagged time, then stop, we'll use this one
-		{
-			break;
-		}
-		iCurrentIndex--;	// count the index back
-		if (iCurrentIndex == -1)		// loop around if we need to
-			iCurrentIndex = ASW_LAG_NUM_POSITION_HISTORY_SAMPLES-1;
-	}
-
 	static Vector vecResult;
-	vecResult = m_hOwnerEntity->GetAbsOrigin();
-	if (iChosenIndex != -1)		// if we found an index, then work out what % of the movement we need to do based on the difference between now and the lagged time
+	if ( !GetLaggedOrigin( fLaggedTime, vecResult ) )
 	{
-		const float base = (gpGlobals->curtime - m_fPositionHistoryTime[iChosenIndex]);
-		if (base <= 0)	// if our only sample is 'now' then we can't do any lag compensation
-			return vecResult;
-		const float fFraction = (gpGlobals->curtime - fLaggedTime) / base;
-		vecResult = m_hOwnerEntity->GetAbsOrigin() + 
-			(m_vecPositionHistory[iChosenIndex] - m_hOwnerEntity->GetAbsOrigin()) * fFraction;
+		vecResult = m_hOwnerEntity->GetAbsOrigin();
 	}
 	return vecResult;
 }
@@ -120,40 +228,21 @@ void CASW_Lag_Compensation::MoveToLaggedPosition(const float fLaggedTime)
 	if ( GetOwnerNPC() && GetOwnerNPC()->GetSleepState() != AISS_AWAKE )
 		return;
 
-	int iCurrentIndex = m_iPositionHistoryTail;
-	int iChosenIndex = -1;
-	for (int i=0;i<ASW_LAG_NUM_POSITION_HISTORY_SAMPLES;i++)	// go through all our history samples and find the oldest one that's just past the lagged time requested
-	{
-		if (m_fPositionHistoryTime[iCurrentIndex] == 0)	// this isn't a real index
-		{
-			break;
-		}
-		iChosenIndex = iCurrentIndex;					// it's a real sample, so we might use this one
-		if (m_fPositionHistoryTime[iCurrentIndex] <= fLaggedTime)		// if the sample is behind our lagged time, then stop, we'll use this one
-		{
-			break;
-		}
-		iCurrentIndex--;	// count the index back
-		if (iCurrentIndex == -1)		// loop around if we need to
-			iCurrentIndex = ASW_LAG_NUM_POSITION_HISTORY_SAMPLES-1;
-	}
+	Vector vecNewPos;
+	if ( !GetLaggedOrigin( fLaggedTime, vecNewPos ) )
+		return;
 
-	if (iChosenIndex != -1)		// if we found an index, then work out what % of the movement we need to do based on the difference between now and the lagged time
+	SetLaggedPosition( vecNewPos );
+}
+
+void CASW_Lag_Compensation::SetLaggedPosition( const Vector &vecNewPos )
+{
+	m_vecRealPosition = m_hOwnerEntity->GetAbsOrigin();	// store our real position, so we can restore it once lag compensation is done
+	m_fRealSimulationTime = m_hOwnerEntity->GetSimulationTime();
+	m_bSetRealPosition = true;
+	if (asw_alien_unlag.GetInt() < 2)
 	{
-		const float base = (gpGlobals->curtime - m_fPositionHistoryTime[iChosenIndex]);
-		if (base <= 0)	// if our only sample is 'now' then we can't do any lag compensation
-			return;
-		const float fFraction = (gpGlobals->curtime - fLaggedTime) / base;
-		m_vecRealPosition = m_hOwnerEntity->GetAbsOrigin();	// store our real position, so we can restore it once lag compensation is done
-		m_fRealSimulationTime = m_hOwnerEntity->GetSimulationTime();
-		const Vector vecNewPos = m_vecRealPosition + 
-							(m_vecPositionHistory[iChosenIndex] - m_vecRealPosition) * fFraction;
-		
-		m_bSetRealPosition = true;
-		if (asw_alien_unlag.GetInt() < 2)
-		{
-			m_hOwnerEntity->SetAbsOrigin(vecNewPos);			// move us to the lagged position
-		}
+		m_hOwnerEntity->SetAbsOrigin(vecNewPos);			// move us to the lagged position
 	}
 }
 
@@ -186,7 +275,71 @@ void CASW_Lag_Compensation::AllowLagCompensation(CBasePlayer *player)
 	s_pLagCompensatingPlayer = player;
 }
 
-void CASW_Lag_Compensation::RequestLagCompensation(CASW_Player *player, const CUserCmd *cmd )
+//-----------------------------------------------------------------------------
+// Purpose: A wedge on the ground that every bullet of a shot stays inside.
+//			It's 2D because penetrating bullets can be flattened after they go
+//			through an alien, which keeps their heading but not their pitch.
+//-----------------------------------------------------------------------------
+struct LagShotWedge_t
+{
+	Vector2D m_vecSrc;
+	Vector2D m_vecDir;
+	float m_flRange;
+	float m_flTangent;		// how far the wedge widens for each unit along it
+	float m_flSecant;
+};
+
+// returns false if the shot can go too wide for a wedge to be any use
+static bool GetShotWedge( const FireBulletsInfo_t &info, LagShotWedge_t &wedge )
+{
+	// widest angle the spread can turn a bullet by (see CASW_Marine::FireRegularBullets)
+	float flSpreadAngle;
+	if ( info.m_vecSpread[0] < 0 || ( info.m_nFlags & FIRE_BULLETS_ANGULAR_SPREAD ) )
+	{
+		flSpreadAngle = DEG2RAD( 0.5f * ( fabs( info.m_vecSpread[0] ) + fabs( info.m_vecSpread[1] ) + fabs( info.m_vecSpread[2] ) ) );
+	}
+	else
+	{
+		flSpreadAngle = atan( info.m_vecSpread.AsVector2D().Length() );
+	}
+	if ( flSpreadAngle >= M_PI_F * 0.5f )
+		return false;
+
+	Vector vecDir = info.m_vecDirShooting;
+	if ( VectorNormalize( vecDir ) == 0 )
+		return false;
+
+	// a bullet's direction is no further than this from the aim, so its heading on the ground can't turn by more
+	//  than the chord compared to how flat the aim is
+	const float flChord = 2.0f * sin( flSpreadAngle * 0.5f );
+	const float flFlat = vecDir.AsVector2D().Length();
+	if ( flFlat - flChord < 0.1f )		// shooting too steeply
+		return false;
+
+	wedge.m_vecSrc = info.m_vecSrc.AsVector2D();
+	wedge.m_vecDir = vecDir.AsVector2D() * ( 1.0f / flFlat );
+	wedge.m_flRange = info.m_flDistance;
+	wedge.m_flTangent = flChord / ( flFlat - flChord );
+	wedge.m_flSecant = sqrt( 1.0f + wedge.m_flTangent * wedge.m_flTangent );
+	return true;
+}
+
+static bool ShotCanHit( const LagShotWedge_t &wedge, const Vector &vecMins, const Vector &vecMaxs )
+{
+	const Vector2D vecCenter = ( vecMins.AsVector2D() + vecMaxs.AsVector2D() ) * 0.5f;
+	const float flRadius = ( vecMaxs.AsVector2D() - vecMins.AsVector2D() ).Length() * 0.5f + ASW_LAG_SHOT_TOLERANCE;
+
+	const Vector2D vecDelta = vecCenter - wedge.m_vecSrc;
+	const float flAlong = DotProduct2D( vecDelta, wedge.m_vecDir );
+	if ( flAlong < -flRadius || flAlong > wedge.m_flRange + flRadius )
+		return false;
+
+	const float flAcrossSqr = vecDelta.LengthSqr() - flAlong * flAlong;
+	const float flMaxAcross = MAX( flAlong, 0.0f ) * wedge.m_flTangent + flRadius * wedge.m_flSecant;
+	return flAcrossSqr <= flMaxAcross * flMaxAcross;
+}
+
+void CASW_Lag_Compensation::RequestLagCompensation(CASW_Player *player, const CUserCmd *cmd, const FireBulletsInfo_t *pShot )
 {	
 	if (player != s_pLagCompensatingPlayer)
 		return;
@@ -202,10 +355,16 @@ void CASW_Lag_Compensation::RequestLagCompensation(CASW_Player *player, const CU
 
 	if (s_bInLagCompensation)
 	{
+		// already worked out how far back to go for this usercmd, just move whatever this shot needs that isn't moved yet
+		if ( s_fLaggedTime >= 0 )
+		{
+			MoveEntitiesToLaggedPositions( pShot );
+		}
 		return;
 	}
 
 	s_bInLagCompensation = true;
+	s_fLaggedTime = -1;
 
 	// Get true latency
 
@@ -247,20 +406,74 @@ void CASW_Lag_Compensation::RequestLagCompensation(CASW_Player *player, const CU
 	if (gpGlobals->curtime - fLaggedTime < ASW_MIN_LAG_TIME)
 		return;
 
-	CASW_Marine *pMarine = player->GetMarine();
+	s_fLaggedTime = fLaggedTime;
+	s_pLagCompensatingMarine = player->GetMarine();
+	MoveEntitiesToLaggedPositions( pShot );
+}
+
+void CASW_Lag_Compensation::MoveEntitiesToLaggedPositions( const FireBulletsInfo_t *pShot )
+{
+	g_LagCompensationStats.m_nRequests++;
 
-	for (int i=0;i<g_LagCompensatingEntities.Count();i++)
+	LagShotWedge_t wedge;
+	const bool bCheckShot = pShot && GetShotWedge( *pShot, wedge );
+
+	for (int iSlot=0;iSlot<g_LagHistory.NumSlots();iSlot++)
 	{
-		if ( g_LagCompensatingEntities[i]->m_hOwnerEntity.Get() == pMarine )		// don't lag compensate my own marine
+		CASW_Lag_Compensation *pLag = g_LagHistory.m_Owners[iSlot];
+		if ( !pLag || pLag->m_bSetRealPosition )
+			continue;
+
+		CBaseAnimating *pEntity = pLag->m_hOwnerEntity.Get();
+		if ( !pEntity || pEntity == s_pLagCompensatingMarine )		// don't lag compensate my own marine
+			continue;
+		// if entity is attached to a marine, don't do lag compensation (fixes parasites detaching when the marine is shot)
+		if ( pEntity->GetMoveParent() && pEntity->GetMoveParent()->Classify() == CLASS_ASW_MARINE )
+			continue;
+		if ( pLag->GetOwnerNPC() && pLag->GetOwnerNPC()->GetSleepState() != AISS_AWAKE )
+			continue;
+
+		Vector vecLagged;
+		int iSample;
+		if ( !pLag->GetLaggedOrigin( s_fLaggedTime, vecLagged, &iSample ) )
 			continue;
 
-		g_LagCompensatingEntities[i]->MoveToLaggedPosition( fLaggedTime );
+		g_LagCompensationStats.m_nConsidered++;
+
+		const Vector &vecOrigin = pEntity->GetAbsOrigin();
+		if ( vecLagged.DistToSqr( vecOrigin ) < 0.01f )
+		{
+			g_LagCompensationStats.m_nSkippedStill++;
+			continue;
+		}
+
+		if ( bCheckShot )
+		{
+			// the shot has to miss us both where we are and where we're going, with whichever of our bounds now
+			//  and at the sample is bigger
+			Vector vecMins, vecMaxs;
+			pEntity->CollisionProp()->WorldSpaceSurroundingBounds( &vecMins, &vecMaxs );
+
+			Vector vecLaggedMins, vecLaggedMaxs;
+			VectorMin( vecMins - vecOrigin, g_LagHistory.m_Mins[iSample][iSlot], vecLaggedMins );
+			VectorMax( vecMaxs - vecOrigin, g_LagHistory.m_Maxs[iSample][iSlot], vecLaggedMaxs );
+			VectorMin( vecMins, vecLagged + vecLaggedMins, vecMins );
+			VectorMax( vecMaxs, vecLagged + vecLaggedMaxs, vecMaxs );
+
+			if ( !ShotCanHit( wedge, vecMins, vecMaxs ) )
+			{
+				g_LagCompensationStats.m_nSkippedShot++;
+				continue;
+			}
+		}
+
+		pLag->SetLaggedPosition( vecLagged );
+		g_LagCompensatedSlots.AddToTail( iSlot );
+		g_LagCompensationStats.m_nMoved++;
 
 		if( sv_showlagcompensation.GetInt() == 1)
 		{
-			CBaseAnimating *pAnim = g_LagCompensatingEntities[i]->m_hOwnerEntity.Get();
-			if (pAnim)
-				pAnim->DrawServerHitboxes(4, true);
+			pEntity->DrawServerHitboxes(4, true);
 		}
 	}
 }
@@ -273,8 +486,25 @@ void CASW_Lag_Compensation::FinishLagCompensation()
 	}
 	s_bInLagCompensation = false;
 	s_pLagCompensatingPlayer = NULL;
-	for (int i=0;i<g_LagCompensatingEntities.Count();i++)
+	s_pLagCompensatingMarine = NULL;
+	s_fLaggedTime = -1;
+	for (int i=0;i<g_LagCompensatedSlots.Count();i++)
 	{
-		g_LagCompensatingEntities[i]->UndoLaggedPosition();
+		CASW_Lag_Compensation *pLag = g_LagHistory.m_Owners[ g_LagCompensatedSlots[i] ];
+		if ( pLag )
+		{
+			pLag->UndoLaggedPosition();
+		}
 	}
-}
\ No newline at end of file
+	g_LagCompensatedSlots.RemoveAll();
+}
+
+CON_COMMAND( asw_alien_unlag_stats, "Prints how many entities lag compensation has moved since the last asw_alien_unlag_stats, then resets the counts" )
+{
+	LagCompensationStats_t stats = g_LagCompensationStats;
+	V_memset( &g_LagCompensationStats, 0, sizeof( g_LagCompensationStats ) );
+
+	Msg( "%d lag compensation requests, %d entities with history to rewind\n", stats.m_nRequests, stats.m_nConsidered );
+	Msg( "%d moved, %d hadn't moved since the lagged time, %d were out of the shot's way\n",
+		stats.m_nMoved, stats.m_nSkippedStill, stats.m_nSkippedShot );
+}
@@ -10,10 +10,13 @@
 #define	ASW_MIN_LAG_TIME 0.01
 // minimum amount of time between sample histories (extra samples within this time aren't stored)
 #define ASW_LAG_MIN_SAMPLE_TIME_DIFFERENCE 0.05
+// extra room given around entities when checking if a shot could hit them (bullets can be traced as small hulls)
+#define ASW_LAG_SHOT_TOLERANCE 8.0f
 
 class CBasePlayer;
 class CASW_Player;
 class CUserCmd;
+struct FireBulletsInfo_t;
 
 class CASW_Lag_Compensation
 {
@@ -31,10 +34,8 @@ public:
 	void UndoLaggedPosition();
 	Vector GetLagCompensationOffset();
 
-	// position history
-	Vector m_vecPositionHistory[ASW_LAG_NUM_POSITION_HISTORY_SAMPLES];
-	float m_fPositionHistoryTime[ASW_LAG_NUM_POSITION_HISTORY_SAMPLES];
-	int m_iPositionHistoryTail;	// which index in the above array is the current 
+	// position history is kept in the shared arrays of CASW_Lag_History, this is our index in them
+	int m_iHistorySlot;
 
 	// real position
 	Vector m_vecRealPosition;
@@ -47,13 +48,23 @@ public:
 	CAI_BaseNPC *GetOwnerNPC();
 
 	// moves all lag compensating entities
+	//  if pShot is passed in, only the entities that shot could hit are moved.  Requesting again in the same
+	//  usercmd moves any others the new shot could hit, and everything is put back by FinishLagCompensation
 	static void AllowLagCompensation(CBasePlayer *player);
-	static void RequestLagCompensation(CASW_Player *player, const CUserCmd *cmd );
+	static void RequestLagCompensation(CASW_Player *player, const CUserCmd *cmd, const FireBulletsInfo_t *pShot = NULL );
 	static void FinishLagCompensation();
 	static bool IsInLagCompensation() { return s_bInLagCompensation; }
 
 	static bool s_bInLagCompensation;
 	static CBasePlayer *s_pLagCompensatingPlayer;
+
+private:
+	bool GetLaggedOrigin( const float fLaggedTime, Vector &vecResult, int *pSample = NULL );
+	void SetLaggedPosition( const Vector &vecNewPos );
+	static void MoveEntitiesToLaggedPositions( const FireBulletsInfo_t *pShot );
+
+	static float s_fLaggedTime;		// time being rewound to, or -1 if nothing needs moving
+	static CBaseEntity *s_pLagCompensatingMarine;
 };
 
 #endif // _INCLUDED_ASW_LAG_COMPENSATION_H
\ No newline at end of file
@@ -16,6 +16,7 @@
 #include "triggers.h"
 #include "datacache/imdlcache.h"
 #include "ai_link.h"
+#include "ai_dynamiclink.h"
 #include "asw_alien.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
@@ -28,8 +29,8 @@ CASW_Spawn_Manager* ASWSpawnManager() { return &g_Spawn_Manager; }
 #define MARINE_NEAR_DISTANCE 740.0f
 
 extern ConVar asw_director_debug;
-ConVar asw_horde_min_distance("asw_horde_min_distance", "800", FCVAR_CHEAT, "Minimum distance away from the marines the horde can spawn" );
-ConVar asw_horde_max_distance("asw_horde_max_distance", "1500", FCVAR_CHEAT, "Maximum distance away from the marines the horde can spawn" );
+ConVar asw_horde_min_distance("asw_horde_min_distance", "800", FCVAR_CHEAT, "Minimum distance along the node graph away from the marines the horde can spawn" );
+ConVar asw_horde_max_distance("asw_horde_max_distance", "1500", FCVAR_CHEAT, "Maximum distance along the node graph away from the marines the horde can spawn" );
 ConVar asw_max_alien_batch("asw_max_alien_batch", "10", FCVAR_CHEAT, "Max number of aliens spawned in a horde batch" );
 ConVar asw_batch_interval("asw_batch_interval", "5", FCVAR_CHEAT, "Time between successive batches spawning in the same spot");
 ConVar asw_candidate_interval("asw_candidate_interval", "1.0", FCVAR_CHEAT, "Interval between updating candidate spawning nodes");
@@ -39,6 +40,7 @@ CASW_Spawn_Manager::CASW_Spawn_Manager()
 {
 	m_nAwakeAliens = 0;
 	m_nAwakeDrones = 0;
+	m_nDistanceLinkStateHash = 0;
 }
 
 CASW_Spawn_Manager::~CASW_Spawn_Manager()
@@ -107,6 +109,11 @@ void CASW_Spawn_Manager::LevelInitPostEntity()
 
 	m_northCandidateNodes.Purge();
 	m_southCandidateNodes.Purge();
+	m_NodeMarineDistance.Purge();
+	m_NodeNearestMarine.Purge();
+	m_DistanceMarines.Purge();
+	m_DistanceMarineNodes.Purge();
+	m_nDistanceLinkStateHash = 0;
 
 	FindEscapeTriggers();
 }
@@ -190,6 +197,9 @@ void CASW_Spawn_Manager::FindEscapeTriggers()
 		}
 	}
 	Msg("Spawn manager found %d escape triggers\n", m_EscapeTriggers.Count() );
+
+	// node flags are worked out once the network is loaded
+	m_bNodeInEscapeArea.Purge();
 }
 
 
@@ -283,12 +293,13 @@ bool CASW_Spawn_Manager::SpawnAlientAtRandomNode()
 		if ( !pNode )
 			continue;
 
-		float flDistance = 0;
-		CASW_Marine *pMarine = dynamic_cast<CASW_Marine*>(UTIL_ASW_NearestMarine( pNode->GetPosition( CANDIDATE_ALIEN_HULL ), flDistance ));
-		if ( !pMarine )
+		// candidate nodes all have a route to this marine through the node graph
+		CASW_Marine *pMarine = GetNearestMarine( candidateNodes[iChosen] );
+		if ( !pMarine || pMarine->GetHealth() <= 0 )
 			return false;
 
-		// check if there's a route from this node to the marine(s)
+		// check if there's a route from this node to the marine(s).  The distance field can be
+		// a little behind the current state of the graph, and it doesn't know about doors.
 		AI_Waypoint_t *pRoute = ASWPathUtils()->BuildRoute( pNode->GetPosition( CANDIDATE_ALIEN_HULL ), pMarine->GetAbsOrigin(), NULL, 100 );
 		if ( !pRoute )
 		{
@@ -412,6 +423,10 @@ void CASW_Spawn_Manager::UpdateCandidateNodes()
 	if ( vecSouthMarine == vec3_origin || vecNorthMarine == vec3_origin )		// no live marines
 		return;
 	
+	UpdateEscapeAreaNodes();
+	if ( !UpdateMarineDistances() )
+		return;
+
 	int iNumNodes = GetNetwork()->NumNodes();
 	m_northCandidateNodes.Purge();
 	m_southCandidateNodes.Purge();
@@ -421,30 +436,16 @@ void CASW_Spawn_Manager::UpdateCandidateNodes()
 		if ( !pNode || pNode->GetType() != NODE_GROUND )
 			continue;
 
-		Vector vecPos = pNode->GetPosition( CANDIDATE_ALIEN_HULL );
-		
-		// find the nearest marine to this node
-		float flDistance = 0;
-		CASW_Marine *pMarine = dynamic_cast<CASW_Marine*>(UTIL_ASW_NearestMarine( vecPos, flDistance ));
-		if ( !pMarine )
-			return;
-
+		// travel distance to the nearest marine
+		float flDistance = m_NodeMarineDistance[i];
 		if ( flDistance > asw_horde_max_distance.GetFloat() || flDistance < asw_horde_min_distance.GetFloat() )
 			continue;
 
 		// check node isn't in an exit trigger
-		bool bInsideEscapeArea = false;
-		for ( int d=0; d<m_EscapeTriggers.Count(); d++ )
-		{
-			if ( m_EscapeTriggers[d]->CollisionProp()->IsPointInBounds( vecPos ) )
-			{
-				bInsideEscapeArea = true;
-				break;
-			}
-		}
-		if ( bInsideEscapeArea )
+		if ( m_bNodeInEscapeArea[i] )
 			continue;
 
+		Vector vecPos = pNode->GetPosition( CANDIDATE_ALIEN_HULL );
 		if ( vecPos.y >= vecSouthMarine.y )
 		{
 			if ( asw_director_debug.GetInt() == 3 )
@@ -464,6 +465,151 @@ void CASW_Spawn_Manager::UpdateCandidateNodes()
 	}
 }
 
+// flags the nodes inside escape triggers, so candidate searches don't have to test every trigger
+void CASW_Spawn_Manager::UpdateEscapeAreaNodes()
+{
+	int iNumNodes = GetNetwork()->NumNodes();
+	if ( m_bNodeInEscapeArea.Count() == iNumNodes )
+		return;
+
+	m_bNodeInEscapeArea.SetCount( iNumNodes );
+	for ( int i=0 ; i<iNumNodes; i++ )
+	{
+		m_bNodeInEscapeArea[i] = false;
+
+		Vector vecPos = GetNetwork()->GetNode( i )->GetOrigin();
+		for ( int d=0; d<m_EscapeTriggers.Count(); d++ )
+		{
+			if ( m_EscapeTriggers[d].Get() && m_EscapeTriggers[d]->CollisionProp()->IsPointInBounds( vecPos ) )
+			{
+				m_bNodeInEscapeArea[i] = true;
+				break;
+			}
+		}
+	}
+}
+
+// Mixes together the on/off state of every dynamic link in the map (doors, breakable
+// walls and the like switch these), so the distance field can tell when it's out of date.
+unsigned int CASW_Spawn_Manager::HashDynamicLinkStates()
+{
+	unsigned int nHash = 0;
+	for ( CAI_DynamicLink *pLink = CAI_DynamicLink::m_pAllDynamicLinks; pLink; pLink = pLink->m_pNextDynamicLink )
+	{
+		nHash = nHash * 31 + ( pLink->m_nSrcID ^ ( pLink->m_nDestID << 16 ) );
+		nHash = nHash * 31 + ( unsigned int ) pLink->m_nLinkState;
+	}
+	return nHash;
+}
+
+// Multi-source Dijkstra from the node each live marine is standing at, over the links
+// the candidate hull can walk.  Only redone when the marines' nodes change or a dynamic link
+// opens or closes, so marines standing still or moving about inside the same node cost nothing.
+// Returns false if there are no live marines on the network.
+bool CASW_Spawn_Manager::UpdateMarineDistances()
+{
+	CASW_Game_Resource *pGameResource = ASWGameResource();
+	CAI_Network *pNetwork = GetNetwork();
+	int iNumNodes = pNetwork->NumNodes();
+
+	CUtlVector< CHandle<CASW_Marine> > marines;
+	CUtlVector<int> marineNodes;
+	for ( int i=0;i<pGameResource->GetMaxMarineResources();i++ )
+	{
+		CASW_Marine_Resource *pMR = pGameResource->GetMarineResource(i);
+		if ( !pMR )
+			continue;
+
+		CASW_Marine *pMarine = pMR->GetMarineEntity();
+		if ( !pMarine || pMarine->GetHealth() <= 0 )
+			continue;
+
+		int iNode = pNetwork->NearestNodeToPoint( pMarine->GetAbsOrigin(), false );
+		if ( iNode == NO_NODE )
+			continue;
+
+		marines.AddToTail( pMarine );
+		marineNodes.AddToTail( iNode );
+	}
+
+	if ( marines.Count() <= 0 )
+		return false;
+
+	// links switched on or off since the last rebuild change which nodes the marines can reach
+	unsigned int nLinkStateHash = HashDynamicLinkStates();
+
+	bool bChanged = ( m_NodeMarineDistance.Count() != iNumNodes || marines.Count() != m_DistanceMarines.Count() ||
+					  nLinkStateHash != m_nDistanceLinkStateHash );
+	for ( int i=0; !bChanged && i<marines.Count(); i++ )
+	{
+		bChanged = ( marines[i] != m_DistanceMarines[i] || marineNodes[i] != m_DistanceMarineNodes[i] );
+	}
+	if ( !bChanged )
+		return true;
+
+	m_nDistanceLinkStateHash = nLinkStateHash;
+	m_DistanceMarines.CopyArray( marines.Base(), marines.Count() );
+	m_DistanceMarineNodes.CopyArray( marineNodes.Base(), marineNodes.Count() );
+	m_NodeMarineDistance.SetCount( iNumNodes );
+	m_NodeNearestMarine.SetCount( iNumNodes );
+	for ( int i=0 ; i<iNumNodes; i++ )
+	{
+		m_NodeMarineDistance[i] = FLT_MAX;
+		m_NodeNearestMarine[i] = -1;
+	}
+
+	CNodeList open;
+	for ( int i=0; i<marines.Count(); i++ )
+	{
+		int iNode = marineNodes[i];
+		float flDistance = pNetwork->GetNode( iNode )->GetOrigin().DistTo( marines[i]->GetAbsOrigin() );
+		if ( flDistance < m_NodeMarineDistance[iNode] )
+		{
+			m_NodeMarineDistance[iNode] = flDistance;
+			m_NodeNearestMarine[iNode] = i;
+			open.Insert( AI_NearNode_t( iNode, flDistance ) );
+		}
+	}
+
+	while ( open.Count() )
+	{
+		AI_NearNode_t nearest = open.ElementAtHead();
+		open.RemoveAtHead();
+
+		// stale entry, this node was reached more cheaply since
+		if ( nearest.dist > m_NodeMarineDistance[nearest.nodeIndex] )
+			continue;
+
+		CAI_Node *pNode = pNetwork->GetNode( nearest.nodeIndex );
+		for ( int k = 0; k < pNode->NumLinks(); k++ )
+		{
+			CAI_Link *pLink = pNode->GetLinkByIndex( k );
+			if ( !( pLink->m_iAcceptedMoveTypes[CANDIDATE_ALIEN_HULL] & bits_CAP_MOVE_GROUND ) || ( pLink->m_LinkInfo & bits_LINK_OFF ) )
+				continue;
+
+			int iDest = pLink->DestNodeID( nearest.nodeIndex );
+			float flDistance = nearest.dist + pNode->GetOrigin().DistTo( pNetwork->GetNode( iDest )->GetOrigin() );
+			if ( flDistance < m_NodeMarineDistance[iDest] )
+			{
+				m_NodeMarineDistance[iDest] = flDistance;
+				m_NodeNearestMarine[iDest] = m_NodeNearestMarine[nearest.nodeIndex];
+				open.Insert( AI_NearNode_t( iDest, flDistance ) );
+			}
+		}
+	}
+
+	return true;
+}
+
+// the marine with the shortest travel distance to this node, as of the last UpdateMarineDistances
+CASW_Marine* CASW_Spawn_Manager::GetNearestMarine( int iNode )
+{
+	if ( iNode < 0 || iNode >= m_NodeNearestMarine.Count() || m_NodeNearestMarine[iNode] == -1 )
+		return NULL;
+
+	return m_DistanceMarines[ m_NodeNearestMarine[iNode] ].Get();
+}
+
 bool CASW_Spawn_Manager::FindHordePosition()
 {
 	// need to find a suitable place from which to spawn a horde
@@ -503,9 +649,9 @@ bool CASW_Spawn_Manager::FindHordePosition()
 		if ( !pNode )
 			continue;
 
-		float flDistance = 0;
-		CASW_Marine *pMarine = dynamic_cast<CASW_Marine*>(UTIL_ASW_NearestMarine( pNode->GetPosition( CANDIDATE_ALIEN_HULL ), flDistance ));
-		if ( !pMarine )
+		// candidate nodes all have a route to this marine through the node graph
+		CASW_Marine *pMarine = GetNearestMarine( candidateNodes[iChosen] );
+		if ( !pMarine || pMarine->GetHealth() <= 0 )
 		{
 			if ( asw_director_debug.GetBool() )
 			{
@@ -514,7 +660,8 @@ bool CASW_Spawn_Manager::FindHordePosition()
 			return false;
 		}
 
-		// check if there's a route from this node to the marine(s)
+		// check if there's a route from this node to the marine(s).  The distance field can be
+		// a little behind the current state of the graph, and it doesn't know about doors.
 		AI_Waypoint_t *pRoute = ASWPathUtils()->BuildRoute( pNode->GetPosition( CANDIDATE_ALIEN_HULL ), pMarine->GetAbsOrigin(), NULL, 100 );
 		if ( !pRoute )
 		{
@@ -939,6 +1086,8 @@ bool CASW_Spawn_Manager::SpawnRandomParasitePack( int nParasites )
 // heuristic to find reasonably open space - searches for areas with high node connectivity
 CASW_Open_Area* CASW_Spawn_Manager::FindNearbyOpenArea( const Vector &vecSearchOrigin, int nSearchHull )
 {
+	UpdateEscapeAreaNodes();
+
 	CBaseEntity *pStartEntity = gEntList.FindEntityByClassname( NULL, "info_player_start" );
 	int iNumNodes = g_pBigAINet->NumNodes();
 	CAI_Node *pHighestConnectivity = NULL;
@@ -959,16 +1108,7 @@ CASW_Open_Area* CASW_Spawn_Manager::FindNearbyOpenArea( const Vector &vecSearchO
 			continue;
 
 		// discard if node is inside an escape area
-		bool bInsideEscapeArea = false;
-		for ( int d=0; d<m_EscapeTriggers.Count(); d++ )
-		{
-			if ( m_EscapeTriggers[d]->CollisionProp()->IsPointInBounds( vecPos ) )
-			{
-				bInsideEscapeArea = true;
-				break;
-			}
-		}
-		if ( bInsideEscapeArea )
+		if ( m_bNodeInEscapeArea[i] )
 			continue;
 
 		// count links that drones could follow
@@ -1024,16 +1164,7 @@ CASW_Open_Area* CASW_Spawn_Manager::FindNearbyOpenArea( const Vector &vecSearchO
 			continue;
 
 		// discard if node is inside an escape area
-		bool bInsideEscapeArea = false;
-		for ( int d=0; d<m_EscapeTriggers.Count(); d++ )
-		{
-			if ( m_EscapeTriggers[d]->CollisionProp()->IsPointInBounds( vecPos ) )
-			{
-				bInsideEscapeArea = true;
-				break;
-			}
-		}
-		if ( bInsideEscapeArea )
+		if ( m_bNodeInEscapeArea[i] )
 			continue;
 
 		// count links that drones could follow
@@ -9,6 +9,7 @@ class CTriggerMultiple;
 struct AI_Waypoint_t;
 class CAI_Node;
 class CASW_Alien;
+class CASW_Marine;
 
 // The spawn manager can spawn aliens and groups of aliens
 
@@ -80,6 +81,10 @@ private:
 	CAI_Network* GetNetwork();
 	bool SpawnAlientAtRandomNode();
 	void FindEscapeTriggers();
+	void UpdateEscapeAreaNodes();
+	bool UpdateMarineDistances();
+	static unsigned int HashDynamicLinkStates();
+	CASW_Marine* GetNearestMarine( int iNode );
 	void DeleteRoute( AI_Waypoint_t *pWaypointList );
 
 	// finds an area with good node connectivity.  Caller should take ownership of the CASW_Open_Area instance.
@@ -101,6 +106,15 @@ private:
 
 	typedef CHandle<CTriggerMultiple> TriggerMultiple_t;
 	CUtlVector<TriggerMultiple_t> m_EscapeTriggers;
+	CUtlVector<bool> m_bNodeInEscapeArea;
+
+	// travel distance along the node graph from each node to the nearest live marine,
+	// rebuilt when the nodes the marines are standing at or the dynamic link states change
+	CUtlVector<float> m_NodeMarineDistance;
+	CUtlVector<int> m_NodeNearestMarine;			// index into m_DistanceMarines, -1 if no marine can reach the node
+	CUtlVector< CHandle<CASW_Marine> > m_DistanceMarines;
+	CUtlVector<int> m_DistanceMarineNodes;
+	unsigned int m_nDistanceLinkStateHash;
 };
 
 extern const int g_nDroneClassEntry;
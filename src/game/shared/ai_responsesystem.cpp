@@ -647,6 +647,22 @@ CON_COMMAND( rr_reloadresponsesystems, "Reload all response system scripts." )
 	defaultresponsesytem.ReloadAllResponseSystems();
 }
 
+CON_COMMAND( rr_benchmark_rules, "Times rule matching against criteria sets recorded with rr_recordcriteria. Usage: rr_benchmark_rules <file> [iterations]" )
+{
+#ifdef GAME_DLL
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+#endif
+
+	if ( args.ArgC() < 2 )
+	{
+		Msg( "Usage: rr_benchmark_rules <file> [iterations]\n" );
+		return;
+	}
+
+	defaultresponsesytem.BenchmarkRules( args[1], args.ArgC() >= 3 ? atoi( args[2] ) : 100 );
+}
+
 static short RESPONSESYSTEM_SAVE_RESTORE_VERSION = 1;
 
 // note:  this won't save/restore settings from instanced response systems.  Could add that with a CDefSaveRestoreOps implementation if needed
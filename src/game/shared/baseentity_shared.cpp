@@ -33,6 +33,7 @@
 	#include "GameStats.h"
 	#include "globalstate.h"
 	#include "world.h"
+	#include "querycache.h"
 
 #endif
 
@@ -1185,6 +1186,12 @@ void CBaseEntity::VPhysicsUpdate( IPhysicsObject *pPhysics )
 			}
 #ifndef CLIENT_DLL 
 			Vector prevOrigin = GetAbsOrigin();
+			const bool bSolid = IsSolid();
+			Vector vecOldMins, vecOldMaxs;
+			if ( bSolid )
+			{
+				CollisionProp()->WorldSpaceAABB( &vecOldMins, &vecOldMaxs );
+			}
 #endif
 
 			for ( int i = 0; i < 3; ++i )
@@ -1215,6 +1222,17 @@ void CBaseEntity::VPhysicsUpdate( IPhysicsObject *pPhysics )
 #ifndef CLIENT_DLL 
 			PhysicsTouchTriggers( &prevOrigin );
 			PhysicsRelinkChildren(gpGlobals->frametime);
+
+			if ( bSolid )
+			{
+				// lines of sight cached across where it was or is now have to be traced again
+				Vector vecNewMins, vecNewMaxs;
+				CollisionProp()->WorldSpaceAABB( &vecNewMins, &vecNewMaxs );
+				if ( vecNewMins != vecOldMins || vecNewMaxs != vecOldMaxs )
+				{
+					QueryCacheNoteEntityMoved( vecOldMins, vecOldMaxs, vecNewMins, vecNewMaxs );
+				}
+			}
 #endif
 		}
 	break;
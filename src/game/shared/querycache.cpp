@@ -8,9 +8,11 @@
 #include "cbase.h"
 #include "querycache.h"
 #include "tier0/vprof.h"
+#include "tier0/fasttimer.h"
 #include "tier1/utlintrusivelist.h"
 #include "datacache/imdlcache.h"
 #include "vstdlib/jobthread.h"
+#include "collisionutils.h"
 
 
 // memdbgon must be the last include file in a .cpp file!!!
@@ -18,11 +20,13 @@
 
 
 
-#define QUERYCACHE_SIZE 1024
+// entries are allocated in blocks of this many as they're needed, up to sv_querycache_max_entries
+#define QUERYCACHE_BLOCK_SIZE 256
 
-static QueryCacheEntry_t s_QCache[QUERYCACHE_SIZE];
+static CUtlVector<QueryCacheEntry_t *> s_QCacheBlocks;
+static int s_nQCacheEntries = 0;
 
-#define QUERYCACHE_HASH_SIZE ( QUERYCACHE_SIZE  * 2 )
+#define QUERYCACHE_HASH_SIZE 4096
 
 // elements available for cache reuse
 static CUtlIntrusiveDList<QueryCacheEntry_t> s_VictimList;
@@ -30,15 +34,41 @@ static CUtlIntrusiveDList<QueryCacheEntry_t> s_VictimList;
 
 static CUtlIntrusiveDList<QueryCacheEntry_t> s_HashChains[QUERYCACHE_HASH_SIZE];
 
+// entries waiting to be traced by the next UpdateQueryCache
+static CUtlVector<QueryCacheEntry_t *> s_QueuedEntries;
 
+// where solid entities that moved since the last UpdateQueryCache were and are
+struct QueryCacheMovedBounds_t
+{
+	Vector m_vecMins;
+	Vector m_vecMaxs;
+};
+static CUtlVector<QueryCacheMovedBounds_t> s_MovedBounds;
+
+#define QUERYCACHE_MAX_MOVED_BOUNDS 64
 
-static int s_nReplaceCtr = QUERYCACHE_SIZE - 1;
+
+static int s_nReplaceCtr = 0;
 static int s_nTimeStampCounter = 0 ;
 static int s_nNumCacheQueries = 0;
 static int s_nNumCacheMisses = 0;
 static int s_SuccessfulSpeculatives = 0;
 static int s_WastedSpeculativeUpdates = 0;
 
+struct QueryCacheStats_t
+{
+	int m_nQueuedRequests;
+	int m_nQueuedHits;
+	int m_nQueuedTraces;
+	int m_nEndpointInvalidations;
+	int m_nBrushInvalidations;
+	double m_flResultAge;						// sum over the hits, seconds
+	double m_flQueuedLatency;					// sum over the queued traces, seconds from queueing to result
+	int m_nUpdates;
+	CCycleCount m_UpdateTime;
+};
+static QueryCacheStats_t s_Stats;
+
 void QueryCacheKey_t::ComputeHashIndex( void )
 {
 	unsigned int ret = ( unsigned int ) m_Type;
@@ -54,47 +84,97 @@ void QueryCacheKey_t::ComputeHashIndex( void )
 
 
 ConVar	sv_disable_querycache("sv_disable_querycache", "0", FCVAR_CHEAT | FCVAR_REPLICATED | FCVAR_DEVELOPMENTONLY, "debug - disable trace query cache" );
+ConVar	sv_querycache_max_entries( "sv_querycache_max_entries", "4096", FCVAR_CHEAT | FCVAR_REPLICATED | FCVAR_DEVELOPMENTONLY, "Most trace query cache entries to allocate before old ones get reused" );
+ConVar	sv_querycache_move_tolerance( "sv_querycache_move_tolerance", "128", FCVAR_CHEAT | FCVAR_REPLICATED | FCVAR_DEVELOPMENTONLY, "How far either end of a cached line can move before its result is thrown away" );
 
-static QueryCacheEntry_t *FindOrAllocateCacheEntry( QueryCacheKey_t const &entry )
+static QueryCacheEntry_t *FindCacheEntry( QueryCacheKey_t const &entry )
 {
-	QueryCacheEntry_t *pFound = NULL;
-	// see if we find it
 	for( QueryCacheEntry_t *pNode = s_HashChains[entry.m_nHashIdx].m_pHead; pNode; pNode = pNode->m_pNext )
 	{
 		if ( pNode->m_QueryParams.Matches( &entry ) )
 		{
-			pFound = pNode;
-			break;
+			return pNode;
 		}
 	}
-	if (! pFound )
+	return NULL;
+}
+
+static void RemoveCacheEntry( QueryCacheEntry_t *pEntry )
+{
+	pEntry->m_QueryParams.m_Type = EQUERY_INVALID;
+	s_HashChains[pEntry->m_QueryParams.m_nHashIdx].RemoveNode( pEntry );
+	s_VictimList.AddToHead( pEntry );
+}
+
+static QueryCacheEntry_t *AllocateCacheEntry( QueryCacheKey_t const &entry )
+{
+	QueryCacheEntry_t *pFound = s_VictimList.RemoveHead();
+	if ( ! pFound )
 	{
-		pFound = s_VictimList.RemoveHead();
-		if ( ! pFound )
+		if ( s_nQCacheEntries < sv_querycache_max_entries.GetInt() )
+		{
+			// grow by a block and put the rest of it on the victim list
+			QueryCacheEntry_t *pBlock = new QueryCacheEntry_t[QUERYCACHE_BLOCK_SIZE];
+			V_memset( pBlock, 0, sizeof( QueryCacheEntry_t ) * QUERYCACHE_BLOCK_SIZE );
+			s_QCacheBlocks.AddToTail( pBlock );
+			s_nQCacheEntries += QUERYCACHE_BLOCK_SIZE;
+			for( int i = 1; i < QUERYCACHE_BLOCK_SIZE; i++ )
+			{
+				s_VictimList.AddToHead( pBlock + i );
+			}
+			pFound = pBlock;
+		}
+		else
 		{
 			// randomly replace one
-			pFound = s_QCache + s_nReplaceCtr;
 			s_nReplaceCtr--;
 			if ( s_nReplaceCtr < 0 )
-				s_nReplaceCtr = QUERYCACHE_SIZE - 1;
+				s_nReplaceCtr = s_nQCacheEntries - 1;
+			pFound = s_QCacheBlocks[s_nReplaceCtr / QUERYCACHE_BLOCK_SIZE] + ( s_nReplaceCtr % QUERYCACHE_BLOCK_SIZE );
 			if ( pFound->m_QueryParams.m_Type != EQUERY_INVALID )
 			{
 				s_HashChains[pFound->m_QueryParams.m_nHashIdx].RemoveNode( pFound );
 			}
 		}
-		pFound->m_QueryParams = entry;
-		s_HashChains[pFound->m_QueryParams.m_nHashIdx].AddToHead( pFound );
-		pFound->m_bSpeculativelyDone = false;
-		pFound->IssueQuery();
+	}
+	pFound->m_QueryParams = entry;
+	s_HashChains[pFound->m_QueryParams.m_nHashIdx].AddToHead( pFound );
+	pFound->m_bSpeculativelyDone = false;
+	pFound->m_bUsedSinceUpdated = false;
+	pFound->m_bHasResult = false;
+	pFound->m_bInvalidated = false;
+	pFound->m_bQueued = false;
+	pFound->m_flLastUsedTime = gpGlobals->curtime;
+	return pFound;
+}
+
+static QueryCacheEntry_t *FindOrAllocateCacheEntry( QueryCacheKey_t const &entry )
+{
+	QueryCacheEntry_t *pFound = FindCacheEntry( entry );
+	if (! pFound )
+	{
+		pFound = AllocateCacheEntry( entry );
+		s_nNumCacheMisses++;
+		if ( !pFound->IssueQuery() )
+		{
+			RemoveCacheEntry( pFound );
+			return NULL;
+		}
 	}
 	else
 	{
-		if ( sv_disable_querycache.GetInt() || 
+		if ( sv_disable_querycache.GetInt() || pFound->m_bInvalidated ||
 			 ( gpGlobals->curtime - pFound->m_flLastUpdateTime >= 
-			   pFound->m_QueryParams.m_flMinimumUpdateInterval ) )
+			   pFound->m_QueryParams.m_flMinimumUpdateInterval ) ||
+			 pFound->HasEndpointMoved() )
 		{
 			pFound->m_bSpeculativelyDone = false;
-			pFound->IssueQuery();
+			s_nNumCacheMisses++;
+			if ( !pFound->IssueQuery() )
+			{
+				RemoveCacheEntry( pFound );
+				return NULL;
+			}
 		}
 		else
 		{
@@ -169,10 +249,32 @@ struct QueryCacheUpdateRecord_t
 	int m_nStartHashChain;
 	int m_nNumHashChainsToUpdate;
 	CUtlIntrusiveDListWithTailPtr<QueryCacheEntry_t> m_KilledList;
+
+	// counted per work item and added up afterwards
+	int m_nTraces;
+	int m_nQueuedTraces;
+	int m_nBrushInvalidations;
+	int m_nWastedSpeculativeUpdates;
+	double m_flQueuedLatency;
 };
 
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Has a solid entity moved across the line since it was traced?
+//-----------------------------------------------------------------------------
+static bool IsCrossedByMovedEntity( QueryCacheEntry_t *pEntry )
+{
+	const Vector &vecStart = pEntry->m_QueryParams.m_Points[0];
+	const Vector vecDelta = pEntry->m_QueryParams.m_Points[1] - vecStart;
+	for( int i = 0; i < s_MovedBounds.Count(); i++ )
+	{
+		if ( IsBoxIntersectingRay( s_MovedBounds[i].m_vecMins, s_MovedBounds[i].m_vecMaxs, vecStart, vecDelta ) )
+			return true;
+	}
+	return false;
+}
+
 void ProcessQueryCacheUpdate( QueryCacheUpdateRecord_t &workItem )
 {
 	float flCurTime = gpGlobals->curtime;
@@ -183,13 +285,47 @@ void ProcessQueryCacheUpdate( QueryCacheUpdateRecord_t &workItem )
 		for( QueryCacheEntry_t *pEntry = s_HashChains[i + workItem.m_nStartHashChain].m_pHead ; pEntry; pEntry = pNext )
 		{
 			pNext = pEntry->m_pNext;
+
+			if ( s_MovedBounds.Count() && pEntry->m_bHasResult && !pEntry->m_bInvalidated && IsCrossedByMovedEntity( pEntry ) )
+			{
+				pEntry->m_bInvalidated = true;
+				workItem.m_nBrushInvalidations++;
+			}
+
+			if ( pEntry->m_QueryParams.m_Type == EQUERY_ENTITY_VISIBLE_CHECK )
+			{
+				if ( pEntry->m_bQueued )
+				{
+					// the points were worked out before the parallel update started
+					pEntry->TraceQuery();
+					pEntry->m_bQueued = false;
+					workItem.m_nQueuedTraces++;
+					workItem.m_flQueuedLatency += flCurTime - pEntry->m_flQueuedTime;
+				}
+				else if ( flCurTime - pEntry->m_flLastUsedTime > pEntry->m_QueryParams.m_flMinimumUpdateInterval )
+				{
+					// nobody has asked for it in a while
+					pEntry->m_QueryParams.m_Type = EQUERY_INVALID;
+					s_HashChains[pEntry->m_QueryParams.m_nHashIdx].RemoveNode( pEntry );
+					workItem.m_KilledList.AddToHead( pEntry );
+				}
+				continue;
+			}
+
 			if ( pEntry->m_bUsedSinceUpdated )
 			{
-				if ( flCurTime - pEntry->m_flLastUpdateTime >= 
+				if ( pEntry->m_bInvalidated || flCurTime - pEntry->m_flLastUpdateTime >= 
 					 pEntry->m_QueryParams.m_flMinimumUpdateInterval )
 				{
 					// don't bother updating if we have recently
-					pEntry->IssueQuery();
+					workItem.m_nTraces++;
+					if ( !pEntry->IssueQuery() )
+					{
+						pEntry->m_QueryParams.m_Type = EQUERY_INVALID;
+						s_HashChains[pEntry->m_QueryParams.m_nHashIdx].RemoveNode( pEntry );
+						workItem.m_KilledList.AddToHead( pEntry );
+						continue;
+					}
 					pEntry->m_bUsedSinceUpdated = false;
 					pEntry->m_bSpeculativelyDone = true;
 				}
@@ -200,7 +336,7 @@ void ProcessQueryCacheUpdate( QueryCacheUpdateRecord_t &workItem )
 				{
 					if ( pEntry->m_bSpeculativelyDone  && ( !pEntry->m_bUsedSinceUpdated ) )
 					{
-						s_WastedSpeculativeUpdates++;
+						workItem.m_nWastedSpeculativeUpdates++;
 					}
 					pEntry->m_QueryParams.m_Type = EQUERY_INVALID;
 					s_HashChains[pEntry->m_QueryParams.m_nHashIdx].RemoveNode( pEntry );
@@ -229,6 +365,23 @@ static void PostUpdateQueryCache()
 
 void UpdateQueryCache( void )
 {
+	CFastTimer timer;
+	timer.Start();
+
+	// work out where the queued checks go from and to here, so the parallel update only traces
+	for( int i = 0; i < s_QueuedEntries.Count(); i++ )
+	{
+		QueryCacheEntry_t *pEntry = s_QueuedEntries[i];
+		if ( pEntry->m_QueryParams.m_Type == EQUERY_INVALID || !pEntry->m_bQueued )
+			continue;
+		if ( !pEntry->CalculatePoints() )
+		{
+			pEntry->m_bQueued = false;
+			RemoveCacheEntry( pEntry );
+		}
+	}
+	s_QueuedEntries.RemoveAll();
+
 	// parallel process all hash chains
 	QueryCacheUpdateRecord_t workList[N_WAYS_TO_SPLIT_CACHE_UPDATE];
 	int nCurEntry = 0;
@@ -240,6 +393,11 @@ void UpdateQueryCache( void )
 		else
 			workList[i].m_nNumHashChainsToUpdate = ARRAYSIZE( s_HashChains ) - nCurEntry;
 		nCurEntry += ARRAYSIZE( s_HashChains ) / N_WAYS_TO_SPLIT_CACHE_UPDATE;
+		workList[i].m_nTraces = 0;
+		workList[i].m_nQueuedTraces = 0;
+		workList[i].m_nBrushInvalidations = 0;
+		workList[i].m_nWastedSpeculativeUpdates = 0;
+		workList[i].m_flQueuedLatency = 0;
 	}
 	ParallelProcess( workList, N_WAYS_TO_SPLIT_CACHE_UPDATE, ProcessQueryCacheUpdate, PreUpdateQueryCache, PostUpdateQueryCache, ( sv_disable_querycache.GetBool() ) ? 0 : INT_MAX );
 	// now, we need to take all of the obsolete cache entries each thread generated and add them to
@@ -247,49 +405,159 @@ void UpdateQueryCache( void )
 	for( int i = 0 ; i < N_WAYS_TO_SPLIT_CACHE_UPDATE; i++ )
 	{
 		PrependDListWithTailToDList( workList[i].m_KilledList, s_VictimList );
+		s_nNumCacheMisses += workList[i].m_nTraces;
+		s_WastedSpeculativeUpdates += workList[i].m_nWastedSpeculativeUpdates;
+		s_Stats.m_nQueuedTraces += workList[i].m_nQueuedTraces;
+		s_Stats.m_nBrushInvalidations += workList[i].m_nBrushInvalidations;
+		s_Stats.m_flQueuedLatency += workList[i].m_flQueuedLatency;
 	}
+	s_MovedBounds.RemoveAll();
+
+	timer.End();
+	s_Stats.m_nUpdates++;
+	s_Stats.m_UpdateTime += timer.GetDuration();
 }
 
 void InvalidateQueryCache( void )
 {
 	s_VictimList.RemoveAll();
+	s_QueuedEntries.RemoveAll();
+	s_MovedBounds.RemoveAll();
 	for( int i = 0; i < ARRAYSIZE( s_HashChains); i++ )
 		s_HashChains[i].RemoveAll();
 	// now, invalidate all cache entries and add them to the victims
-	for( int i = 0; i < ARRAYSIZE( s_QCache ); i++ )
+	for( int i = 0; i < s_QCacheBlocks.Count(); i++ )
+	{
+		for( int j = 0; j < QUERYCACHE_BLOCK_SIZE; j++ )
+		{
+			QueryCacheEntry_t *pEntry = s_QCacheBlocks[i] + j;
+			pEntry->m_QueryParams.m_Type = EQUERY_INVALID;
+			pEntry->m_bQueued = false;
+			s_VictimList.AddToHead( pEntry );
+		}
+	}
+}
+
+void QueryCacheNoteEntityMoved( const Vector &vecOldMins, const Vector &vecOldMaxs, const Vector &vecNewMins, const Vector &vecNewMaxs )
+{
+	if ( s_MovedBounds.Count() >= QUERYCACHE_MAX_MOVED_BOUNDS )
 	{
-		s_QCache[i].m_QueryParams.m_Type = EQUERY_INVALID;
-		s_VictimList.AddToHead( s_QCache + i );
+		// every cached line is tested against every box, so past this many moving things
+		// just grow the last box. That throws away more results, but never too few.
+		QueryCacheMovedBounds_t &bounds = s_MovedBounds.Tail();
+		VectorMin( bounds.m_vecMins, vecOldMins, bounds.m_vecMins );
+		VectorMin( bounds.m_vecMins, vecNewMins, bounds.m_vecMins );
+		VectorMax( bounds.m_vecMaxs, vecOldMaxs, bounds.m_vecMaxs );
+		VectorMax( bounds.m_vecMaxs, vecNewMaxs, bounds.m_vecMaxs );
+		return;
 	}
+
+	QueryCacheMovedBounds_t &bounds = s_MovedBounds[ s_MovedBounds.AddToTail() ];
+	VectorMin( vecOldMins, vecNewMins, bounds.m_vecMins );
+	VectorMax( vecOldMaxs, vecNewMaxs, bounds.m_vecMaxs );
 }
 
 
-void QueryCacheEntry_t::IssueQuery( void )
+bool QueryCacheEntry_t::CalculatePoints( void )
 {
 	for( int i = 0 ; i < m_QueryParams.m_nNumValidPoints; i++ )
 	{
 		CBaseEntity *pEntity = m_QueryParams.m_pEntities[i];
 		if (! pEntity )
-		{
-			m_QueryParams.m_Type = EQUERY_INVALID;
-			s_HashChains[m_QueryParams.m_nHashIdx].RemoveNode( this );
-			s_VictimList.AddToHead( this );
-			return;
-		}
+			return false;
 		CalculateOffsettedPosition( pEntity, m_QueryParams.m_nOffsetMode[i],
 									&( m_QueryParams.m_Points[i] ) );
 	}
-	CTraceFilterSimple filter( m_QueryParams.m_pEntities[2],
-							   m_QueryParams.m_nCollisionGroup,
-							   m_QueryParams.m_pTraceFilterFunction );
+
+#ifdef GAME_DLL
+	if ( m_QueryParams.m_Type == EQUERY_ENTITY_VISIBLE_CHECK )
+	{
+		m_pLooker = m_QueryParams.m_pEntities[0];
+		m_pTarget = m_QueryParams.m_pEntities[1];
+		m_bLookerIsPlayer = m_pLooker->IsPlayer();
+		m_pTargetVehicle = m_pTarget->IsPlayer() ? assert_cast<CBasePlayer*>( m_pTarget )->GetVehicleEntity() : NULL;
+	}
+#endif
+	return true;
+}
+
+bool QueryCacheEntry_t::HasEndpointMoved( void ) const
+{
+	float flToleranceSqr = sv_querycache_move_tolerance.GetFloat();
+	flToleranceSqr *= flToleranceSqr;
+	for( int i = 0 ; i < 2; i++ )
+	{
+		CBaseEntity *pEntity = m_QueryParams.m_pEntities[i];
+		if ( !pEntity )
+			return true;
+		Vector vecPoint;
+		CalculateOffsettedPosition( pEntity, m_QueryParams.m_nOffsetMode[i], &vecPoint );
+		if ( vecPoint.DistToSqr( m_QueryParams.m_Points[i] ) > flToleranceSqr )
+			return true;
+	}
+	return false;
+}
+
+#ifdef GAME_DLL
+extern ConVar ai_LOS_mode;
+#endif
+
+void QueryCacheEntry_t::TraceQuery( void )
+{
 	trace_t result;
-	s_nNumCacheMisses++;
-	UTIL_TraceLine( m_QueryParams.m_Points[0], m_QueryParams.m_Points[1],
-					m_QueryParams.m_nTraceMask, &filter, &result );
-	m_bResult = ! ( result.DidHit() );
+#ifdef GAME_DLL
+	if ( m_QueryParams.m_Type == EQUERY_ENTITY_VISIBLE_CHECK )
+	{
+		// the same trace CBaseEntity::FVisible does
+		CBaseEntity *pLooker = m_pLooker;
+		CBaseEntity *pTarget = m_pTarget;
+		unsigned int nTraceMask = m_QueryParams.m_nTraceMask;
+		if ( ai_LOS_mode.GetBool() )
+		{
+			UTIL_TraceLine( m_QueryParams.m_Points[0], m_QueryParams.m_Points[1], nTraceMask, pLooker, COLLISION_GROUP_NONE, &result );
+		}
+		else
+		{
+			if ( nTraceMask == MASK_BLOCKLOS )
+			{
+				nTraceMask = MASK_BLOCKLOS_AND_NPCS;
+			}
+			if ( m_bLookerIsPlayer )
+			{
+				nTraceMask &= ~CONTENTS_BLOCKLOS;
+			}
+			CTraceFilterLOS traceFilter( pLooker, COLLISION_GROUP_NONE, pTarget );
+			UTIL_TraceLine( m_QueryParams.m_Points[0], m_QueryParams.m_Points[1], nTraceMask, &traceFilter, &result );
+		}
+		m_bResult = ( result.fraction == 1.0 && !result.startsolid ) || result.m_pEnt == pTarget;
+		if ( !m_bResult && m_pTargetVehicle && result.m_pEnt == m_pTargetVehicle )
+		{
+			m_bResult = true;
+		}
+	}
+	else
+#endif
+	{
+		CTraceFilterSimple filter( m_QueryParams.m_pEntities[2],
+								   m_QueryParams.m_nCollisionGroup,
+								   m_QueryParams.m_pTraceFilterFunction );
+		UTIL_TraceLine( m_QueryParams.m_Points[0], m_QueryParams.m_Points[1],
+						m_QueryParams.m_nTraceMask, &filter, &result );
+		m_bResult = ! ( result.DidHit() );
+	}
+	m_bHasResult = true;
+	m_bInvalidated = false;
 	m_flLastUpdateTime = gpGlobals->curtime;
 }
 
+bool QueryCacheEntry_t::IssueQuery( void )
+{
+	if ( !CalculatePoints() )
+		return false;
+	TraceQuery();
+	return true;
+}
+
 
 bool IsLineOfSightBetweenTwoEntitiesClear( CBaseEntity *pSrcEntity,
 										   EEntityOffsetMode_t nSrcOffsetMode,
@@ -318,21 +586,106 @@ bool IsLineOfSightBetweenTwoEntitiesClear( CBaseEntity *pSrcEntity,
 
 	s_nNumCacheQueries++;
 	QueryCacheEntry_t *pNode = FindOrAllocateCacheEntry( entry );
+	if ( !pNode )
+		return false;
 	pNode->m_bUsedSinceUpdated = true;
 	return pNode->m_bResult;
 }
 
 
+#ifdef GAME_DLL
+bool GetQueuedLineOfSightResult( CBaseEntity *pSrcEntity,
+								 CBaseEntity *pDestEntity,
+								 unsigned int nTraceMask,
+								 bool *pbClear,
+								 float flMaxAge )
+{
+	if ( sv_disable_querycache.GetBool() || !pSrcEntity || !pDestEntity )
+		return false;
+
+	s_Stats.m_nQueuedRequests++;
+
+	QueryCacheKey_t entry;
+	entry.m_Type = EQUERY_ENTITY_VISIBLE_CHECK;
+	entry.m_pEntities[0] = pSrcEntity;
+	entry.m_pEntities[1] = pDestEntity;
+	entry.m_nOffsetMode[0] = EOFFSET_MODE_EYEPOSITION;
+	entry.m_nOffsetMode[1] = EOFFSET_MODE_EYEPOSITION;
+	entry.m_nTraceMask = nTraceMask;
+	entry.m_nNumValidPoints = 2;
+	entry.m_nCollisionGroup = COLLISION_GROUP_NONE;
+	entry.m_pTraceFilterFunction = NULL;
+	entry.m_flMinimumUpdateInterval = flMaxAge;
+	entry.ComputeHashIndex();
+
+	QueryCacheEntry_t *pNode = FindCacheEntry( entry );
+	if ( !pNode )
+	{
+		pNode = AllocateCacheEntry( entry );
+	}
+	pNode->m_flLastUsedTime = gpGlobals->curtime;
+
+	bool bUsable = false;
+	if ( pNode->m_bHasResult && !pNode->m_bInvalidated )
+	{
+		const float flAge = gpGlobals->curtime - pNode->m_flLastUpdateTime;
+		if ( flAge <= flMaxAge )
+		{
+			if ( pNode->HasEndpointMoved() )
+			{
+				s_Stats.m_nEndpointInvalidations++;
+				pNode->m_bInvalidated = true;
+			}
+			else
+			{
+				bUsable = true;
+				s_Stats.m_nQueuedHits++;
+				s_Stats.m_flResultAge += flAge;
+			}
+		}
+	}
+
+	// trace it again next update, unless it was done this frame
+	if ( !pNode->m_bQueued && ( !bUsable || pNode->m_flLastUpdateTime != gpGlobals->curtime ) )
+	{
+		pNode->m_bQueued = true;
+		pNode->m_flQueuedTime = gpGlobals->curtime;
+		s_QueuedEntries.AddToTail( pNode );
+	}
+
+	if ( !bUsable )
+		return false;
+
+	// FVisible never sees these, whatever the trace says
+	*pbClear = pNode->m_bResult && !( pDestEntity->GetFlags() & FL_NOTARGET );
+	return true;
+}
+#endif
+
+
 #if defined( CLIENT_DLL )
 CON_COMMAND_F( cl_querycache_stats, "Display status of the query cache (client only)", FCVAR_CHEAT )
 #else
 CON_COMMAND( sv_querycache_stats, "Display status of the query cache (client only)" )
 #endif
 {
-	Warning( "%d queries, %d misses (%d free) suc spec = %d wasted spec=%d\n",
-			 s_nNumCacheQueries, s_nNumCacheMisses, s_VictimList.Count(),
+	Warning( "%d queries, %d misses (%d free of %d) suc spec = %d wasted spec=%d\n",
+			 s_nNumCacheQueries, s_nNumCacheMisses, s_VictimList.Count(), s_nQCacheEntries,
 			 s_SuccessfulSpeculatives, s_WastedSpeculativeUpdates );
-}
-
-
 
+	QueryCacheStats_t stats = s_Stats;
+	V_memset( &s_Stats, 0, sizeof( s_Stats ) );
+
+	int nQueuedHits = MAX( stats.m_nQueuedHits, 1 );
+	int nQueuedTraces = MAX( stats.m_nQueuedTraces, 1 );
+	int nUpdates = MAX( stats.m_nUpdates, 1 );
+	Warning( "queued line of sight: %d requests, %d answered (%.1f%%), %.1f ms average result age\n",
+			 stats.m_nQueuedRequests, stats.m_nQueuedHits,
+			 stats.m_nQueuedRequests ? 100.0 * stats.m_nQueuedHits / stats.m_nQueuedRequests : 0.0,
+			 1000.0 * stats.m_flResultAge / nQueuedHits );
+	Warning( "%d queued traces, %.1f ms average from queueing to result, %d updates taking %.3f ms each\n",
+			 stats.m_nQueuedTraces, 1000.0 * stats.m_flQueuedLatency / nQueuedTraces,
+			 stats.m_nUpdates, stats.m_UpdateTime.GetMillisecondsF() / nUpdates );
+	Warning( "invalidated: %d by an end moving, %d by a solid entity moving across (counts reset)\n",
+			 stats.m_nEndpointInvalidations, stats.m_nBrushInvalidations );
+}
@@ -22,13 +22,19 @@
 // b. By updating the cache entries outside of the entity think functions, the update is done in a
 // fully multi-threaded fashion
 
+// c. Line of sight checks can be queued for the next update and their results read later, so the
+// traces for them are done in parallel rather than one at a time from think functions.
+
+// Cached lines are traced again when either end moves too far, or when a solid entity moves
+// across them, whether it's pushed (doors, trains...), simulated by vphysics or teleported.
+
 
 enum EQueryType_t
 {
 	EQUERY_INVALID = 0,									// an invalid or unused entry
 	EQUERY_TRACELINE,
 	EQUERY_ENTITY_LOS_CHECK,
-
+	EQUERY_ENTITY_VISIBLE_CHECK,						// same test as CBaseEntity::FVisible, queued
 };
 
 enum EEntityOffsetMode_t
@@ -70,9 +76,23 @@ struct QueryCacheEntry_t
 	bool m_bUsedSinceUpdated;								// was this cell referenced?
 	bool m_bSpeculativelyDone;
 	bool m_bResult;											// for queries with a boolean result
-
-	void IssueQuery( void );
-
+	bool m_bHasResult;
+	bool m_bInvalidated;									// something moved across the line since it was traced
+	bool m_bQueued;											// waiting to be traced by the next UpdateQueryCache
+	float m_flQueuedTime;
+	float m_flLastUsedTime;
+
+	// for EQUERY_ENTITY_VISIBLE_CHECK, looked up by CalculatePoints on the main thread so
+	// TraceQuery doesn't touch handles or entity state from the parallel update
+	CBaseEntity *m_pLooker;
+	CBaseEntity *m_pTarget;
+	CBaseEntity *m_pTargetVehicle;
+	bool m_bLookerIsPlayer;
+
+	bool IssueQuery( void );								// returns false if an entity has gone
+	bool CalculatePoints( void );
+	void TraceQuery( void );
+	bool HasEndpointMoved( void ) const;
 };
 
 
@@ -90,6 +110,23 @@ bool IsLineOfSightBetweenTwoEntitiesClear( CBaseEntity *pSrcEntity,
 
 
 
+#ifdef GAME_DLL
+// Gets the result of the last line of sight check between two entities, the same test as
+// pSrcEntity->FVisible( pDestEntity, nTraceMask ), and queues a new check for the next
+// UpdateQueryCache. Returns false if there's no result younger than flMaxAge, in which case
+// the caller has to do the test itself.
+bool GetQueuedLineOfSightResult( CBaseEntity *pSrcEntity,
+								 CBaseEntity *pDestEntity,
+								 unsigned int nTraceMask,
+								 bool *pbClear,
+								 float flMaxAge = 0.15
+	);
+#endif
+
+// call when a solid entity moves, so cached lines across where it was or where it is now are
+// traced again. Pushers, vphysics objects and teleports already call it.
+void QueryCacheNoteEntityMoved( const Vector &vecOldMins, const Vector &vecOldMaxs, const Vector &vecNewMins, const Vector &vecNewMaxs );
+
 // call during main loop for threaded update of the query cache
 void UpdateQueryCache( void );
 
@@ -18,6 +18,7 @@
 	#include "asw_button_area.h"
 	#include "fogcontroller.h"
 	#include "asw_point_camera.h"
+	#include "asw_alien.h"
 #else
 	#include "asw_gamerules.h"
 	#include "c_asw_drone_advanced.h"
@@ -61,6 +62,7 @@
 #endif
 #include "shake.h"
 #include "asw_util_shared.h"
+#include "mathlib/ssemath.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -819,24 +821,294 @@ CASW_Marine* UTIL_ASW_MarineCanSee(CASW_Marine_Resource* pMarineResource, const
 
 CASW_Marine* UTIL_ASW_AnyMarineCanSee(const Vector &pos, const int padding, bool &bCorpseCanSee, const int forward_limit)
 {
-	// find the closest marine
+#ifndef CLIENT_DLL
+	// test each marine on its own so the debug lines get drawn
+	if (asw_debug_marine_can_see.GetBool())
+	{
+		// find the closest marine
+		CASW_Game_Resource *pGameResource = ASWGameResource();
+		if (!pGameResource)
+			return NULL;
+
+		bCorpseCanSee = false;
+		for (int i=0;i<pGameResource->GetMaxMarineResources();i++)
+		{
+			CASW_Marine_Resource* pMarineResource = pGameResource->GetMarineResource(i);
+			bool bCorpse = false;
+			CASW_Marine *pMarine = (UTIL_ASW_MarineCanSee(pMarineResource, pos, padding, bCorpse, forward_limit));
+			bCorpseCanSee |= bCorpse;
+			if (pMarine)
+				return pMarine;
+		}
+		return NULL;
+	}
+#endif
+	return ASWMarineViews().AnyMarineCanSee(pos, padding, bCorpseCanSee, forward_limit);
+}
+
+static CASW_Marine_Views g_ASWMarineViews;
+
+CASW_Marine_Views &ASWMarineViews()
+{
+	return g_ASWMarineViews;
+}
+
+CASW_Marine_Views::CASW_Marine_Views()
+{
+	// same camera as UTIL_ASW_MarineCanSee
+	AngleVectors(QAngle(60, 90, 0), &m_vecCameraForward, &m_vecCameraRight, &m_vecCameraUp);
+	m_nUpdateFrame = -1;
+	m_flUpdateTime = -1;
+	m_flFogEndSqr = FLT_MAX;
+#ifdef GAME_DLL
+	m_nAlienFrame = -1;
+	m_flAlienTime = -1;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Gathers everything UTIL_ASW_MarineCanSee looks at for each marine
+//			resource, once per frame
+//-----------------------------------------------------------------------------
+void CASW_Marine_Views::Update()
+{
+	if (m_nUpdateFrame == gpGlobals->framecount && m_flUpdateTime == gpGlobals->curtime)
+		return;
+
+	m_nUpdateFrame = gpGlobals->framecount;
+	m_flUpdateTime = gpGlobals->curtime;
+	m_Views.RemoveAll();
+
+	m_flFogEndSqr = FLT_MAX;
+#ifdef CLIENT_DLL
+	C_ASW_Player *pPlayer = C_ASW_Player::GetLocalASWPlayer();
+	if (pPlayer && pPlayer->GetPlayerFog().m_hCtrl.Get() && pPlayer->GetPlayerFog().m_hCtrl->m_fog.enable)
+	{
+		float flFogEnd = pPlayer->GetPlayerFog().m_hCtrl->m_fog.end;
+		m_flFogEndSqr = flFogEnd < 0 ? -1.0f : flFogEnd * flFogEnd;
+	}
+#endif
+
 	CASW_Game_Resource *pGameResource = ASWGameResource();
 	if (!pGameResource)
-		return NULL;
+		return;
 
-	bCorpseCanSee = false;
 	for (int i=0;i<pGameResource->GetMaxMarineResources();i++)
 	{
 		CASW_Marine_Resource* pMarineResource = pGameResource->GetMarineResource(i);
-		bool bCorpse = false;
-		CASW_Marine *pMarine = (UTIL_ASW_MarineCanSee(pMarineResource, pos, padding, bCorpse, forward_limit));
-		bCorpseCanSee |= bCorpse;
-		if (pMarine)
-			return pMarine;
+		if (!pMarineResource)
+			continue;
+
+		MarineView_t view;
+		view.m_bCorpse = false;
+		view.m_bRemoteTurret = false;
+		view.m_bSecurityCam = false;
+
+		Vector vecMarinePos;
+		CASW_Marine* pMarine = NULL;
+#ifndef CLIENT_DLL
+		if (pMarineResource->GetHealthPercent() <=0 || !pMarineResource->IsAlive())
+		{
+			vecMarinePos = pMarineResource->m_vecDeathPosition;
+			view.m_bCorpse = true;
+		}
+		else
+#endif
+		{
+			pMarine = pMarineResource->GetMarineEntity();
+			if (!pMarine)
+				continue;
+
+			vecMarinePos = pMarine->GetAbsOrigin();
+		}
+
+		view.m_hMarine = pMarine;
+		view.m_vecCameraCenter = vecMarinePos - m_vecCameraForward * 405;
+
+		if (pMarine && pMarine->IsControllingTurret() && pMarine->GetRemoteTurret())
+		{
+			view.m_bRemoteTurret = true;
+			view.m_vecRemoteTurret = pMarine->GetRemoteTurret()->GetAbsOrigin();
+		}
+
+		if (pMarine && pMarine->m_hUsingEntity.Get())
+		{
+			CASW_Computer_Area *pComputer = dynamic_cast<CASW_Computer_Area*>(pMarine->m_hUsingEntity.Get());
+			if (pComputer && pComputer->m_iActiveCam == 1 && pComputer->m_hSecurityCam1.Get())
+			{
+				CPointCamera* pCam = dynamic_cast<CPointCamera*>(pComputer->m_hSecurityCam1.Get());
+				if (pCam)
+				{
+					view.m_bSecurityCam = true;
+					view.m_vecSecurityCam = pCam->GetAbsOrigin();
+					AngleVectors(pCam->GetAbsAngles(), &view.m_vecSecurityCamFacing);
+				}
+			}
+		}
+
+		m_Views.AddToTail(view);
 	}
-	return NULL;
 }
 
+CASW_Marine* CASW_Marine_Views::AnyMarineCanSee(const Vector &pos, const int padding, bool &bCorpseCanSee, const int forward_limit)
+{
+	CASW_Marine *pMarine = NULL;
+	AnyMarineCanSee(&pos, 1, padding, &pMarine, &bCorpseCanSee, forward_limit);
+	return pMarine;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: The same tests as CanFrustumSee and UTIL_ASW_MarineCanSee, done on
+//			four positions at a time
+//-----------------------------------------------------------------------------
+void CASW_Marine_Views::AnyMarineCanSee(const Vector *pPositions, int nCount, const int padding, CASW_Marine **ppMarines, bool *pbCorpseCanSee, const int forward_limit)
+{
+	Update();
+
+	for (int i=0;i<nCount;i++)
+	{
+		ppMarines[i] = NULL;
+		pbCorpseCanSee[i] = false;
+	}
+
+	if (m_Views.Count() == 0)
+		return;
+
+	// NOTE: assumes 75 fov and 4:3 ratio, like CanFrustumSee
+	const float fov_tangent = tan(DEG2RAD(75.0f) * 0.5f);
+	const fltx4 fl4FovTangent = ReplicateX4(fov_tangent);
+	const fltx4 fl4RightTangent = ReplicateX4(fov_tangent * (4.0f / 3.0f));
+	const fltx4 fl4Padding = ReplicateX4((float)padding);
+	const fltx4 fl4ForwardLimit = ReplicateX4(forward_limit > 0 ? (float)forward_limit : FLT_MAX);
+	const fltx4 fl4FogEndSqr = ReplicateX4(m_flFogEndSqr);
+	const fltx4 fl4RemoteDistSqr = ReplicateX4(1024.0f * 1024.0f);	// assume fog distance of 1024 when in first person
+
+	for (int nBase=0;nBase<nCount;nBase+=4)
+	{
+		int nLanes = MIN(4, nCount - nBase);
+		const Vector *pPos = pPositions + nBase;
+
+		// repeat the last position to fill the group
+		FourVectors vecPos;
+		vecPos.LoadAndSwizzle(pPos[0], pPos[MIN(1, nLanes - 1)], pPos[MIN(2, nLanes - 1)], pPos[MIN(3, nLanes - 1)]);
+
+		const int nAllLanes = (1 << nLanes) - 1;
+		int nFound = 0;
+
+		for (int v=0;v<m_Views.Count() && nFound != nAllLanes;v++)
+		{
+			const MarineView_t &view = m_Views[v];
+
+			FourVectors vecDiff = vecPos;
+			FourVectors vecCenter;
+			vecCenter.DuplicateVector(view.m_vecCameraCenter);
+			vecDiff -= vecCenter;
+
+			// beyond the fog plane?
+			fltx4 fl4InFog = CmpLeSIMD(vecDiff.length2(), fl4FogEndSqr);
+
+			// bring in the x and y coords by the padding
+			vecDiff.x = MaskedAssign(CmpLtSIMD(vecDiff.x, Four_Zeros), MinSIMD(AddSIMD(vecDiff.x, fl4Padding), Four_Zeros), MaxSIMD(SubSIMD(vecDiff.x, fl4Padding), Four_Zeros));
+			vecDiff.y = MaskedAssign(CmpLtSIMD(vecDiff.y, Four_Zeros), MinSIMD(AddSIMD(vecDiff.y, fl4Padding), Four_Zeros), MaxSIMD(SubSIMD(vecDiff.y, fl4Padding), Four_Zeros));
+
+			fltx4 fl4Forward = vecDiff * m_vecCameraForward;
+			fltx4 fl4MaxUp = MulSIMD(fl4Forward, fl4FovTangent);
+			fltx4 fl4MaxRight = MulSIMD(fl4Forward, fl4RightTangent);
+
+			fltx4 fl4CanSee = AndSIMD(CmpGeSIMD(fl4Forward, Four_Zeros), CmpLeSIMD(fl4Forward, fl4ForwardLimit));
+			fl4CanSee = AndSIMD(fl4CanSee, CmpInBoundsSIMD(vecDiff * m_vecCameraUp, fl4MaxUp));
+			fl4CanSee = AndSIMD(fl4CanSee, CmpInBoundsSIMD(vecDiff * m_vecCameraRight, fl4MaxRight));
+
+			if (view.m_bRemoteTurret)
+			{
+				FourVectors vecTurretDiff = vecPos;
+				FourVectors vecTurret;
+				vecTurret.DuplicateVector(view.m_vecRemoteTurret);
+				vecTurretDiff -= vecTurret;
+				fl4CanSee = OrSIMD(fl4CanSee, CmpLeSIMD(vecTurretDiff.length2(), fl4RemoteDistSqr));
+			}
+
+			if (view.m_bSecurityCam)
+			{
+				FourVectors vecCamDiff = vecPos;
+				FourVectors vecCam;
+				vecCam.DuplicateVector(view.m_vecSecurityCam);
+				vecCamDiff -= vecCam;
+				fltx4 fl4CamSee = AndSIMD(CmpGtSIMD(vecCamDiff * view.m_vecSecurityCamFacing, Four_Zeros), CmpLeSIMD(vecCamDiff.length2(), fl4RemoteDistSqr));
+				fl4CanSee = OrSIMD(fl4CanSee, fl4CamSee);
+			}
+
+			int nSeen = TestSignSIMD(AndSIMD(fl4CanSee, fl4InFog)) & nAllLanes & ~nFound;
+			if (!nSeen)
+				continue;
+
+			CASW_Marine *pMarine = view.m_bCorpse ? NULL : static_cast<CASW_Marine*>(view.m_hMarine.Get());
+			if (!view.m_bCorpse && !pMarine)
+				continue;
+
+			for (int i=0;i<nLanes;i++)
+			{
+				if (!(nSeen & (1 << i)))
+					continue;
+
+				if (view.m_bCorpse)
+				{
+					pbCorpseCanSee[nBase + i] = true;
+				}
+				else
+				{
+					ppMarines[nBase + i] = pMarine;
+					nFound |= (1 << i);
+				}
+			}
+		}
+	}
+}
+
+#ifdef GAME_DLL
+bool CASW_Marine_Views::CanSeeAlien(CASW_Alien *pAlien)
+{
+	if (m_nAlienFrame != gpGlobals->framecount || m_flAlienTime != gpGlobals->curtime)
+	{
+		m_nAlienFrame = gpGlobals->framecount;
+		m_flAlienTime = gpGlobals->curtime;
+
+		m_AlienPositions.RemoveAll();
+		m_AlienIndices.RemoveAll();
+		for (int i=0;i<IAlienAutoList::AutoList().Count();i++)
+		{
+			CASW_Alien *pOther = static_cast<CASW_Alien*>(IAlienAutoList::AutoList()[i]);
+			m_AlienPositions.AddToTail(pOther->GetAbsOrigin());
+			m_AlienIndices.AddToTail(pOther->entindex());
+		}
+
+		int nAliens = m_AlienPositions.Count();
+		m_AlienMarines.SetCount(nAliens);
+		m_AlienCorpses.SetCount(nAliens);
+		AnyMarineCanSee(m_AlienPositions.Base(), nAliens, ASW_ALIEN_WAKE_PADDING, m_AlienMarines.Base(), m_AlienCorpses.Base());
+
+		m_AliensTested.ClearAll();
+		m_AliensSeen.ClearAll();
+		for (int i=0;i<nAliens;i++)
+		{
+			m_AliensTested.Set(m_AlienIndices[i]);
+			if (m_AlienMarines[i] || m_AlienCorpses[i])
+				m_AliensSeen.Set(m_AlienIndices[i]);
+		}
+	}
+
+	int iIndex = pAlien->entindex();
+	if (!m_AliensTested.IsBitSet(iIndex))
+	{
+		// spawned since the batch was done
+		bool bCorpseCanSee = false;
+		return (AnyMarineCanSee(pAlien->GetAbsOrigin(), ASW_ALIEN_WAKE_PADDING, bCorpseCanSee) != NULL) || bCorpseCanSee;
+	}
+
+	return m_AliensSeen.IsBitSet(iIndex);
+}
+#endif
+
 bool UTIL_ASW_MarineViewCone(const Vector &pos)
 {
 	// find the closest marine
@@ -4,6 +4,7 @@
 
 #include "util_shared.h"
 #include "asw_shareddefs.h"
+#include "bitvec.h"
 
 #ifdef CLIENT_DLL
 #define CPointCamera C_PointCamera
@@ -14,6 +15,7 @@ class CASW_Player;
 class CASW_Marine;
 class CASW_Marine_Resource;
 class CPointCamera;
+class CASW_Alien;
 
 #ifdef CLIENT_DLL
 class CNewParticleEffect;
@@ -40,6 +42,74 @@ bool ASW_LineCircleIntersection(
 // is a marine nearby this spot?  i.e. can a player controlling this marine see this spot (bCorpseCanSee is set to true if a marine corpse can see this spot)
 CASW_Marine* UTIL_ASW_MarineCanSee(CASW_Marine_Resource* pMR, const Vector &pos, const int padding, bool &bCorpseCanSee, const int forward_limit = -1);
 CASW_Marine* UTIL_ASW_AnyMarineCanSee(const Vector &pos, const int padding, bool &bCorpseCanSee, const int forward_limit = -1);
+
+//-----------------------------------------------------------------------------
+// Purpose: What the marines' players can see this frame. Each marine (or
+//			corpse) has the camera frustum above it, and a marine may also be
+//			looking through a remote turret or a security camera. The views are
+//			worked out the first time they're used each frame, and positions are
+//			tested against all of them four at a time.
+//-----------------------------------------------------------------------------
+class CASW_Marine_Views
+{
+public:
+	CASW_Marine_Views();
+
+	// Same as UTIL_ASW_AnyMarineCanSee
+	CASW_Marine* AnyMarineCanSee( const Vector &pos, const int padding, bool &bCorpseCanSee, const int forward_limit = -1 );
+
+	// Tests nCount positions at once. For each, ppMarines gets the first marine
+	// that can see it (or NULL), and pbCorpseCanSee whether a corpse before that
+	// marine can, the same as calling UTIL_ASW_AnyMarineCanSee on each.
+	void AnyMarineCanSee( const Vector *pPositions, int nCount, const int padding, CASW_Marine **ppMarines, bool *pbCorpseCanSee, const int forward_limit = -1 );
+
+#ifdef GAME_DLL
+	// Whether a marine or corpse can see the alien, with ASW_ALIEN_WAKE_PADDING.
+	// Every alien is tested in one batch the first time this is called in a
+	// frame, from where it was then.
+	bool CanSeeAlien( CASW_Alien *pAlien );
+#endif
+
+private:
+	void Update();
+
+	struct MarineView_t
+	{
+		EHANDLE		m_hMarine;
+		bool		m_bCorpse;
+		Vector		m_vecCameraCenter;
+		bool		m_bRemoteTurret;
+		Vector		m_vecRemoteTurret;
+		bool		m_bSecurityCam;
+		Vector		m_vecSecurityCam;
+		Vector		m_vecSecurityCamFacing;
+	};
+
+	CUtlVector<MarineView_t>	m_Views;
+	Vector						m_vecCameraForward;
+	Vector						m_vecCameraRight;
+	Vector						m_vecCameraUp;
+	int							m_nUpdateFrame;
+	float						m_flUpdateTime;
+	float						m_flFogEndSqr;
+
+#ifdef GAME_DLL
+	CUtlVector<Vector>			m_AlienPositions;
+	CUtlVector<int>				m_AlienIndices;
+	CUtlVector<CASW_Marine*>	m_AlienMarines;
+	CUtlVector<bool>			m_AlienCorpses;
+	CBitVec<MAX_EDICTS>			m_AliensTested;
+	CBitVec<MAX_EDICTS>			m_AliensSeen;
+	int							m_nAlienFrame;
+	float						m_flAlienTime;
+#endif
+};
+
+CASW_Marine_Views &ASWMarineViews();
+
+// padding aliens use when checking if a marine can see them
+#define ASW_ALIEN_WAKE_PADDING 384
+
 // is a marine looking at this spot?
 bool UTIL_ASW_MarineViewCone(const Vector &pos);
 // default camera and dot values for the above function
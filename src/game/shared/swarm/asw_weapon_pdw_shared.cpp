@@ -137,13 +137,6 @@ void CASW_Weapon_PDW::PrimaryAttack()
 		// sets the animation on the marine holding this weapon
 		//pMarine->SetAnimation( PLAYER_ATTACK1 );
 
-#ifdef GAME_DLL	// check for turning on lag compensation
-		if (pPlayer && pMarine->IsInhabited())
-		{
-			CASW_Lag_Compensation::RequestLagCompensation( pPlayer, pPlayer->GetCurrentUserCommand() );
-		}
-#endif
-
 		FireBulletsInfo_t info;
 		info.m_vecSrc = pMarine->Weapon_ShootPosition( );
 		if ( pPlayer && pMarine->IsInhabited() )
@@ -220,6 +213,13 @@ void CASW_Weapon_PDW::PrimaryAttack()
 		info.m_flDamage *= pMarine->GetMarineResource()->OnFired_GetDamageScale();
 #endif
 
+#ifdef GAME_DLL	// check for turning on lag compensation, only moving what this shot could hit
+		if (pPlayer && pMarine->IsInhabited())
+		{
+			CASW_Lag_Compensation::RequestLagCompensation( pPlayer, pPlayer->GetCurrentUserCommand(), &info );
+		}
+#endif
+
 		pMarine->FireBullets( info );
 
 		// increment shooting stats
@@ -123,13 +123,6 @@ void CASW_Weapon_Pistol::PrimaryAttack( void )
 		// sets the animation on the marine holding this weapon
 		//pMarine->SetAnimation( PLAYER_ATTACK1 );
 
-#ifdef GAME_DLL	// check for turning on lag compensation
-		if (pPlayer && pMarine->IsInhabited())
-		{
-			CASW_Lag_Compensation::RequestLagCompensation( pPlayer, pPlayer->GetCurrentUserCommand() );
-		}
-#endif
-
 		//	if (asw_pistol_hitscan.GetBool())
 		if (true)
 		{
@@ -187,6 +180,13 @@ void CASW_Weapon_Pistol::PrimaryAttack( void )
 			info.m_flDamage *= pMarine->GetMarineResource()->OnFired_GetDamageScale();
 #endif
 
+#ifdef GAME_DLL	// check for turning on lag compensation, only moving what this shot could hit
+			if (pPlayer && pMarine->IsInhabited())
+			{
+				CASW_Lag_Compensation::RequestLagCompensation( pPlayer, pPlayer->GetCurrentUserCommand(), &info );
+			}
+#endif
+
 			pMarine->FireBullets( info );
 
 			//FireBulletsInfo_t info( 1, vecSrc, vecAiming, GetBulletSpread(), MAX_TRACE_LENGTH, m_iPrimaryAmmoType );
@@ -125,13 +125,6 @@ void CASW_Weapon_Sniper_Rifle::PrimaryAttack( void )
 	// sets the animation on the marine holding this weapon
 	//pMarine->SetAnimation( PLAYER_ATTACK1 );
 
-#ifdef GAME_DLL	// check for turning on lag compensation
-	if (pPlayer && pMarine->IsInhabited())
-	{
-		CASW_Lag_Compensation::RequestLagCompensation( pPlayer, pPlayer->GetCurrentUserCommand() );
-	}
-#endif
-
 	FireBulletsInfo_t info;
 	info.m_vecSrc = pMarine->Weapon_ShootPosition( );
 	if ( pPlayer && pMarine->IsInhabited() )
@@ -191,6 +184,14 @@ void CASW_Weapon_Sniper_Rifle::PrimaryAttack( void )
 	{
 		iPenetration = 3;
 	}
+
+#ifdef GAME_DLL	// check for turning on lag compensation, only moving what this shot could hit
+	if (pPlayer && pMarine->IsInhabited())
+	{
+		CASW_Lag_Compensation::RequestLagCompensation( pPlayer, pPlayer->GetCurrentUserCommand(), &info );
+	}
+#endif
+
 	pMarine->FirePenetratingBullets( info, iPenetration, 3.5f, 0, true, NULL, false  );
 
 	// increment shooting stats
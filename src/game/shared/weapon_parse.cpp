@@ -6,6 +6,7 @@
 //=============================================================================//
 #include "cbase.h"
 #include <KeyValues.h>
+#include "tier1/kvcompiled.h"
 #include <tier0/mem.h>
 #include "filesystem.h"
 #include "utldict.h"
@@ -201,14 +202,16 @@ KeyValues* ReadEncryptedKVFile( IFileSystem *filesystem, const char *szFilenameW
 
 	const char *pSearchPath = "GAME";
 
-	// Open the weapon data file, and abort if we can't
-	KeyValues *pKV = new KeyValues( "WeaponDatafile" );
-	pKV->UsesEscapeSequences( true );
-
 	Q_snprintf(szFullName,sizeof(szFullName), "%s.txt", szFilenameWithoutExtension);
 
-	if ( !pKV->LoadFromFile( filesystem, szFullName, pSearchPath ) ) // try to load the normal .txt file first
+	// try the normal .txt file first, through the compiled cache
+	KeyValues *pKV = LoadKeyValuesCached( filesystem, szFullName, pSearchPath, true );
+	if ( !pKV )
 	{
+		// Open the weapon data file, and abort if we can't
+		pKV = new KeyValues( "WeaponDatafile" );
+		pKV->UsesEscapeSequences( true );
+
 #ifndef _XBOX
 		if ( pICEKey )
 		{
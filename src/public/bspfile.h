@@ -385,6 +385,24 @@ struct lump_t
 	char	fourCC[4];		// default to ( char )0, ( char )0, ( char )0, ( char )0
 };
 
+// 360 only: compressed lumps (and game lumps) start with either an lzma_header_t
+// (see tier1/lzmaDecoder.h) or, for the lumps that are decoded on every map load,
+// this header followed by raw snappy data. Decode each lump independently.
+#if !defined( _X360 )
+#define SNAPPY_ID				(('Y'<<24)|('P'<<16)|('N'<<8)|('S'))
+#else
+#define SNAPPY_ID				(('S'<<24)|('N'<<16)|('P'<<8)|('Y'))
+#endif
+
+#pragma pack(1)
+struct snappy_header_t
+{
+	unsigned int	id;
+	unsigned int	actualSize;		// always little endian
+	unsigned int	snappySize;		// always little endian
+};
+#pragma pack()
+
 struct BSPHeader_t
 {
 	DECLARE_BYTESWAP_DATADESC();
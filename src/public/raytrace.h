@@ -41,6 +41,29 @@ public:
 
 };
 
+/// 8 rays stored as two FourRays, so that each half can be handed to the 4-wide code and to
+/// ITransparentTriangleCallback unchanged. The AVX tracer loads both halves into 8-wide registers.
+class EightRays
+{
+public:
+	FourRays m_Rays[2];
+
+	inline void Check(void) const
+	{
+		m_Rays[0].Check();
+		m_Rays[1].Check();
+	}
+
+	// returns direction sign mask for all 8 rays, or -1 if they can not be traced as one bundle.
+	int CalculateDirectionSignMask(void) const
+	{
+		int msk = m_Rays[0].CalculateDirectionSignMask();
+		if ( msk != m_Rays[1].CalculateDirectionSignMask() )
+			return -1;
+		return msk;
+	}
+};
+
 /// The format a triangle is stored in for intersections. size of this structure is important.
 /// This structure can be in one of two forms. Before the ray tracing environment is set up, the
 /// ProjectedEdgeEquations hold the coordinates of the 3 vertices, for facilitating bounding box
@@ -133,6 +156,10 @@ struct CacheOptimizedTriangle
 #define KDNODE_STATE_ZSPLIT 2								// this node is a zsplit
 #define KDNODE_STATE_LEAF 3									// this node is a leaf
 
+#define MAILBOX_HASH_SIZE 256
+#define MAX_TREE_DEPTH 21
+#define MAX_NODE_STACK_LEN (40*MAX_TREE_DEPTH)
+
 struct CacheOptimizedKDNode
 {
 	// this is the cache intensive data structure. "Tricks" are used to fit it into 8 bytes:
@@ -193,6 +220,30 @@ protected:
 };
 
 
+/// Node of the optional bounding volume hierarchy (RTE_FLAGS_USE_BVH). 32 bytes. Children of an
+/// interior node are stored next to each other, left (lower coordinates along the split axis) first.
+struct CacheOptimizedBVHNode
+{
+	float m_flMins[3];
+	int32 m_nChildOrFirstTri;								// interior: left child index. leaf: first
+	                                                        // entry in TriangleIndexList
+	float m_flMaxs[3];
+	int32 m_nTrianglesOrAxis;								// leaf: number of triangles (>=0).
+	                                                        // interior: -1-split axis
+
+	inline bool IsLeaf(void) const
+	{
+		return m_nTrianglesOrAxis >= 0;
+	}
+
+	inline int SplitAxis(void) const
+	{
+		assert(!IsLeaf());
+		return -1-m_nTrianglesOrAxis;
+	}
+};
+
+
 struct RayTracingSingleResult
 {
 	Vector surface_normal;									// surface normal at intersection
@@ -208,6 +259,11 @@ struct RayTracingResult
 	fltx4 HitDistance;										// distance to intersection
 };
 
+struct RayTracingResult8
+{
+	RayTracingResult m_Results[2];							// results for EightRays::m_Rays[0] and [1]
+};
+
 
 class RayTraceLight
 {
@@ -220,6 +276,7 @@ public:
 #define RTE_FLAGS_FAST_TREE_GENERATION 1
 #define RTE_FLAGS_DONT_STORE_TRIANGLE_COLORS 2				// saves memory if not needed
 #define RTE_FLAGS_DONT_STORE_TRIANGLE_MATERIALS 4
+#define RTE_FLAGS_USE_BVH 8									// build and trace a bvh instead of a kd-tree
 
 enum RayTraceLightingMode_t {
 	DIRECT_LIGHTING,										// just dot product lighting
@@ -232,9 +289,11 @@ class RayStream
 {
 	friend class RayTracingEnvironment;
 
-	RayTracingSingleResult *PendingStreamOutputs[8][4];
+	// rays are bucketed by direction octant and flushed RayTracingEnvironment::GetRayPacketWidth()
+	// (4 or 8) at a time
+	RayTracingSingleResult *PendingStreamOutputs[8][8];
 	int n_in_stream[8];
-	FourRays PendingRays[8];
+	EightRays PendingRays[8];
 
 public:
 	RayStream(void)
@@ -262,6 +321,7 @@ public:
 
 	FourVectors BackgroundColor;							//< color where no intersection
 	CUtlVector<CacheOptimizedKDNode> OptimizedKDTree;		//< the packed kdtree. root is 0
+	CUtlVector<CacheOptimizedBVHNode> OptimizedBVH;			//< the bvh if RTE_FLAGS_USE_BVH. root is 0
 	CUtlBlockVector<CacheOptimizedTriangle> OptimizedTriangleList; //< the packed triangles
 	CUtlVector<int32> TriangleIndexList;					//< the list of triangle indices.
 	CUtlVector<LightDesc_t> LightList;						//< the list of lights
@@ -294,8 +354,9 @@ public:
 										const Vector &color);
 
 
-	// SetupAccelerationStructure to prepare for tracing
-	void SetupAccelerationStructure(void);
+	// SetupAccelerationStructure to prepare for tracing. If pCacheFileName is given, the tree is
+	// read from that file when it was built from identical geometry, and written to it otherwise.
+	void SetupAccelerationStructure( const char *pCacheFileName = NULL );
 
 
 	// lowest level intersection routine - fire 4 rays through the scene. all 4 rays must pass the
@@ -310,6 +371,16 @@ public:
 					RayTracingResult *rslt_out,
 					int32 skip_id=-1, ITransparentTriangleCallback *pCallback = NULL);
 
+	// fire 8 rays through the scene. Uses the AVX packet tracer when the cpu supports it and both
+	// halves have the same direction sign mask; otherwise each half goes through Trace4Rays.
+	// ppCallbacks, if non-NULL, points at one callback per half.
+	void Trace8Rays(const EightRays &rays, fltx4 const TMin[2], fltx4 const TMax[2],
+					RayTracingResult8 *rslt_out,
+					int32 skip_id=-1, ITransparentTriangleCallback **ppCallbacks = NULL);
+
+	// number of rays traced per packet by the widest tracer this cpu can run (4 or 8).
+	static int GetRayPacketWidth(void);
+
 	// compute virtual light sources to model inter-reflection
 	void ComputeVirtualLightSources(void);
 
@@ -342,17 +413,27 @@ public:
 	void FinishRayStream(RayStream &s);
 
 
+	// AVX version of Trace4Rays for 8 rays with the same direction signs. lives in trace_avx.cpp.
+	void Trace8RaysAVX(const EightRays &rays, fltx4 const TMin[2], fltx4 const TMax[2],
+					   int DirectionSignMask, RayTracingResult8 *rslt_out,
+					   int32 skip_id, ITransparentTriangleCallback **ppCallbacks);
+
+	// Trace4Rays for RTE_FLAGS_USE_BVH
+	void Trace4RaysBVH(const FourRays &rays, fltx4 TMin, fltx4 TMax,int DirectionSignMask,
+					   RayTracingResult *rslt_out,
+					   int32 skip_id, ITransparentTriangleCallback *pCallback);
+
 	int MakeLeafNode(int first_tri, int last_tri);
 
+	// builders for SetupAccelerationStructure. The kd-tree build is spread over all cpus.
+	void BuildKDTree(void);
+	void BuildBVH(void);
+
+	// hash of all triangle data that affects the acceleration structure
+	uint32 ComputeGeometryHash(void);
+	bool LoadAccelerationStructure( const char *pFileName, uint32 nGeometryHash );
+	void SaveAccelerationStructure( const char *pFileName, uint32 nGeometryHash );
 
-	float CalculateCostsOfSplit(
-		int split_plane,int32 const *tri_list,int ntris,
-		Vector MinBound,Vector MaxBound, float &split_value,
-		int &nleft, int &nright, int &nboth);
-		
-	void RefineNode(int node_number,int32 const *tri_list,int ntris,
-						 Vector MinBound,Vector MaxBound, int depth);
-	
 	void CalculateTriangleListBounds(int32 const *tris,int ntris,
 									 Vector &minout, Vector &maxout);
 
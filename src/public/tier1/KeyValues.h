@@ -39,6 +39,7 @@ class CUtlBuffer;
 class Color;
 typedef void * FileHandle_t;
 class CKeyValuesGrowableStringTable;
+class CKeyValuesArena;
 
 //-----------------------------------------------------------------------------
 // Purpose: Simple recursive data access class
@@ -214,8 +215,8 @@ public:
 	bool WriteAsBinary( CUtlBuffer &buffer );
 	bool ReadAsBinary( CUtlBuffer &buffer, int nStackDepth = 0 );
 
-	// Allocate & create a new copy of the keys
-	KeyValues *MakeCopy( void ) const;
+	// Allocate & create a new copy of the keys, in pArena if it's given
+	KeyValues *MakeCopy( CKeyValuesArena *pArena = NULL ) const;
 
 	// Make a new copy of all subkeys, add them all to the passed-in keyvalues
 	void CopySubkeys( KeyValues *pParent ) const;
@@ -256,8 +257,14 @@ public:
 	void RecursiveMergeKeyValues( KeyValues *baseKV );
 
 private:
+	friend class CKeyValuesArena;
+
 	KeyValues( KeyValues& );	// prevent copy constructor being used
 
+	// Only CKeyValuesArena::CreateKeyValues can allocate from an arena
+	void *operator new( size_t iAllocSize, CKeyValuesArena *pArena );
+	void operator delete( void *pMem, CKeyValuesArena *pArena );
+
 	// prevent delete being called except through deleteThis()
 	~KeyValues();
 
@@ -302,6 +309,14 @@ private:
 	void FreeAllocatedValue();
 	void AllocateValueBlock(int size);
 
+	// New keys and values come from the same place as this key
+	CKeyValuesArena *GetArena() const;
+	KeyValues *CreateKeyValues( const char *setName ) const;
+	char *AllocString( int nChars ) const;
+	wchar_t *AllocWString( int nChars ) const;
+	void FreeString( char *pString ) const;
+	void FreeWString( wchar_t *pString ) const;
+
 	int m_iKeyName;	// keyname is a symbol defined in KeyValuesSystem
 
 	// These are needed out of the union because the API returns string pointers
@@ -320,7 +335,7 @@ private:
 	char	   m_iDataType;
 	char	   m_bHasEscapeSequences; // true, if while parsing this KeyValue, Escape Sequences are used (default false)
 	char	   m_bEvaluateConditionals; // true, if while parsing this KeyValue, conditionals blocks are evaluated (default true)
-	char	   unused[1];
+	unsigned char m_iArena;				// the CKeyValuesArena this was allocated from, 0 for the heap
 
 	KeyValues *m_pPeer;	// pointer to next key in list
 	KeyValues *m_pSub;	// pointer to Start of a new sub key list
@@ -349,6 +364,51 @@ public:
 
 typedef KeyValues::AutoDelete KeyValuesAD;
 
+//-----------------------------------------------------------------------------
+// Purpose: Allocates whole KeyValues trees from a few large blocks, so building
+//			one doesn't cost a heap allocation per key and value, and the whole
+//			tree is freed at once by FreeAll or the destructor. Keys and values
+//			created under a key from an arena, by FindKey, LoadFromBuffer,
+//			ReadAsBinary, CopySubkeys and operator=, come from the same arena,
+//			and deleteThis on them does nothing.
+//
+//			Nothing from the arena may be used after FreeAll. Like keys from the
+//			growable string table, keys from an arena can't be handed to another
+//			module, which would free them to its own heap. Keys from the heap
+//			added to an arena tree with AddSubKey or SetNextKey are leaked, since
+//			nothing walks the tree to free them. Not thread safe.
+//-----------------------------------------------------------------------------
+class CKeyValuesArena
+{
+public:
+	CKeyValuesArena( int nBlockSize = 32 * 1024 );
+	~CKeyValuesArena();
+
+	KeyValues *CreateKeyValues( const char *setName );
+
+	void *Alloc( int nBytes );
+
+	// Frees everything allocated from the arena, keeping one block for reuse
+	void FreeAll();
+
+	int GetBytesUsed() const { return m_nBytesUsed; }
+
+private:
+	friend class KeyValues;
+
+	static CKeyValuesArena *GetArena( int iArena );
+
+	byte *AllocBlock( int nBytes );
+
+	int			m_iArena;			// index in the table of arenas, 0 if it was full
+	int			m_nBlockSize;
+	int			m_nBytesUsed;
+	byte		*m_pNextAlloc;
+	byte		*m_pAllocLimit;
+	CUtlVector<byte *> m_Blocks;
+	CUtlVector<byte *> m_LargeBlocks;	// allocations too big to share a block
+};
+
 enum KeyValuesUnpackDestinationTypes_t
 {
 	UNPACK_TYPE_FLOAT,										// dest is a float
@@ -78,6 +78,18 @@ inline int BitByte( int bits )
 	return (bits + 7) >> 3;
 }
 
+#if defined( PLAT_LITTLE_ENDIAN )
+// Unaligned 64-bit load for reading two dwords at once. The buffers are
+// little endian, so on little endian machines a field that straddles two
+// dwords is a plain shift of the qword they make.
+FORCEINLINE uint64 LoadBitBufQWord( const void *p )
+{
+	uint64 n;
+	memcpy( &n, p, sizeof( n ) );
+	return n;
+}
+#endif
+
 //-----------------------------------------------------------------------------
 // namespaced helpers
 //-----------------------------------------------------------------------------
@@ -217,6 +229,18 @@ public:
 	void			WriteBitVec3Normal( const Vector& fa );
 	void			WriteBitAngles( const QAngle& fa );
 
+	// Write whole arrays. The bits are the same as writing the elements one
+	// at a time, but the room is checked once, up front, and the elements
+	// that fit even at their largest go through a CBitWriteAccumulator. Any
+	// after those are written one at a time, so overflow is handled the same.
+	void			WriteUBitLongArray( const uint32 *pData, int nCount, int numbits );
+	void			WriteVarInt32Array( const uint32 *pData, int nCount );
+	void			WriteSignedVarInt32Array( const int32 *pData, int nCount );
+	void			WriteBitCoordArray( const float *pData, int nCount );
+	void			WriteBitVec3CoordArray( const Vector *pData, int nCount );
+	void			WriteBitNormalArray( const float *pData, int nCount );
+	void			WriteBitVec3NormalArray( const Vector *pData, int nCount );
+
 
 // Byte functions.
 public:
@@ -413,6 +437,20 @@ BITBUF_INLINE void bf_write::WriteUBitLong( unsigned int curData, int numbits, b
 	int iDWord = m_iCurBit >> 5;
 	m_iCurBit += numbits;
 
+	// Most fields don't cross a dword, and only need the one read-modify-write.
+	// (A 64-bit one would be fewer instructions, but its load overlaps the last
+	// field's store and can't be forwarded from it. Runs of fields that want a
+	// 64-bit accumulator use CBitWriteAccumulator.)
+	if ( iCurBitMasked + numbits <= 32 )
+	{
+		extern unsigned long g_ExtraMasks[33];
+		unsigned long mask = g_ExtraMasks[numbits] << iCurBitMasked;
+		unsigned long dword = LoadLittleDWord( m_pData, iDWord );
+		dword ^= mask & ( ( curData << iCurBitMasked ) ^ dword );
+		StoreLittleDWord( m_pData, iDWord, dword );
+		return;
+	}
+
 	// Mask in a dword.
 	Assert( (iDWord*4 + sizeof(long)) <= (unsigned int)m_nDataBytes );
 	unsigned long * RESTRICT pOut = &m_pData[iDWord];
@@ -474,6 +512,51 @@ BITBUF_INLINE void bf_write::WriteBitFloat(float val)
 	WriteUBitLong( intVal, 32 );
 }
 
+//-----------------------------------------------------------------------------
+// Writes a run of fields to a bf_write through a 64-bit accumulator, which
+// moves whole dwords to the buffer. The bits are the same as WriteUBitLong's.
+// The room is checked once, for nMaxBits, the most the run can take. If that
+// might not fit, the fields go to WriteUBitLong one at a time instead, with
+// its usual overflow handling. Nothing else may use the buffer until Flush().
+//-----------------------------------------------------------------------------
+class CBitWriteAccumulator
+{
+public:
+	CBitWriteAccumulator( bf_write *pBuf, int nMaxBits );
+
+	void			Write( unsigned int nValue, int numbits );
+	void			WriteOneBit( int nValue )	{ Write( nValue ? 1 : 0, 1 ); }
+
+	// Stores the last partial dword and moves the buffer past the run
+	void			Flush();
+
+private:
+	bf_write		*m_pBuf;
+	uint64			m_nAccum;
+	int				m_nBits;
+	int				m_iDWord;
+	bool			m_bOneAtATime;
+};
+
+BITBUF_INLINE void CBitWriteAccumulator::Write( unsigned int nValue, int numbits )
+{
+	if ( m_bOneAtATime )
+	{
+		m_pBuf->WriteUBitLong( nValue, numbits, false );
+		return;
+	}
+
+	extern unsigned long g_ExtraMasks[33];
+	m_nAccum |= (uint64)( nValue & g_ExtraMasks[numbits] ) << m_nBits;
+	m_nBits += numbits;
+	if ( m_nBits >= 32 )
+	{
+		StoreLittleDWord( m_pBuf->m_pData, m_iDWord++, (unsigned long)m_nAccum );
+		m_nAccum >>= 32;
+		m_nBits -= 32;
+	}
+}
+
 //-----------------------------------------------------------------------------
 // This is useful if you just want a buffer to write into on the stack.
 //-----------------------------------------------------------------------------
@@ -592,6 +675,19 @@ public:
 	void			ReadBitVec3Normal( Vector& fa );
 	void			ReadBitAngles( QAngle& fa );
 
+	// Read whole arrays written by the bf_write array functions, or by
+	// writing the elements one at a time. The bits left are checked once, and
+	// the elements that are there even at their largest are read a dword at a
+	// time; any after those are read one at a time, with the usual overflow
+	// handling.
+	void			ReadUBitLongArray( uint32 *pOut, int nCount, int numbits );
+	void			ReadVarInt32Array( uint32 *pOut, int nCount );
+	void			ReadSignedVarInt32Array( int32 *pOut, int nCount );
+	void			ReadBitCoordArray( float *pOut, int nCount );
+	void			ReadBitVec3CoordArray( Vector *pOut, int nCount );
+	void			ReadBitNormalArray( float *pOut, int nCount );
+	void			ReadBitVec3NormalArray( Vector *pOut, int nCount );
+
 	// Faster for comparisons but do not fully decode float values
 	unsigned int	ReadBitCoordBits();
 	unsigned int	ReadBitCoordMPBits( bool bIntegral, bool bLowPrecision );
@@ -791,6 +887,14 @@ BITBUF_INLINE unsigned int bf_read::ReadUBitLong( int numbits ) RESTRICT
 	unsigned int bitmask = g_ExtraMasks[numbits];
 #endif
 
+#if defined( PLAT_LITTLE_ENDIAN )
+	// One 64-bit load covers both dwords if the second is in the buffer
+	if ( ( iWordOffset1 + 2 ) * 4 <= (unsigned int)m_nDataBytes )
+	{
+		return (unsigned int)( LoadBitBufQWord( m_pData + iWordOffset1 * 4 ) >> iStartBit ) & bitmask;
+	}
+#endif
+
 	unsigned int dw1 = LoadLittleDWord( (unsigned long* RESTRICT)m_pData, iWordOffset1 ) >> iStartBit;
 	unsigned int dw2 = LoadLittleDWord( (unsigned long* RESTRICT)m_pData, iWordOffset2 ) << (32 - iStartBit);
 
@@ -0,0 +1,132 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: KeyValues compiled into a flat, read only image that can be cached
+//			on disk and loaded again without tokenizing the text
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef KVCOMPILED_H
+#define KVCOMPILED_H
+
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "KeyValues.h"
+
+class CUtlBuffer;
+class IFileSystem;
+class CCompiledKeyValues;
+
+//-----------------------------------------------------------------------------
+// Purpose: A key in a CCompiledKeyValues. It is only a handle, so it's cheap
+//			to pass around, and it's good for as long as the image it came from.
+//			The accessors convert values the same way KeyValues does.
+//-----------------------------------------------------------------------------
+class CKeyValuesView
+{
+public:
+	CKeyValuesView() : m_pOwner( NULL ), m_iNode( 0 ) {}
+
+	bool IsValid() const { return m_pOwner != NULL; }
+
+	const char *GetName() const;
+	KeyValues::types_t GetDataType() const;
+
+	// Finds a subkey. "a/b" looks for b in the subkey a, like KeyValues::FindKey.
+	CKeyValuesView FindKey( const char *keyName ) const;
+
+	CKeyValuesView GetFirstSubKey() const;
+	CKeyValuesView GetNextKey() const;
+	CKeyValuesView GetFirstTrueSubKey() const;
+	CKeyValuesView GetNextTrueSubKey() const;
+	CKeyValuesView GetFirstValue() const;
+	CKeyValuesView GetNextValue() const;
+
+	// A NULL keyName means this key
+	const char *GetString( const char *keyName = NULL, const char *defaultValue = "" ) const;
+	int GetInt( const char *keyName = NULL, int defaultValue = 0 ) const;
+	uint64 GetUint64( const char *keyName = NULL, uint64 defaultValue = 0 ) const;
+	float GetFloat( const char *keyName = NULL, float defaultValue = 0.0f ) const;
+	bool GetBool( const char *keyName = NULL, bool defaultValue = false ) const;
+	bool IsEmpty( const char *keyName = NULL ) const;
+
+	// Builds a KeyValues of this key and everything under it
+	KeyValues *MakeKeyValues() const;
+
+private:
+	friend class CCompiledKeyValues;
+
+	CKeyValuesView( const CCompiledKeyValues *pOwner, int iNode ) : m_pOwner( pOwner ), m_iNode( iNode ) {}
+
+	void FillKeyValues( KeyValues *pKeyValues ) const;
+
+	const CCompiledKeyValues *m_pOwner;
+	int m_iNode;
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: A KeyValues file compiled into one block of memory. The image only
+//			holds offsets, never pointers, so it can be written to disk and read
+//			or mapped back in as it is. Keys are laid out breadth first, so the
+//			subkeys of a key are next to each other, and a key with more than a
+//			few subkeys also has a hash of their names so finding one doesn't
+//			walk the list.
+//-----------------------------------------------------------------------------
+class CCompiledKeyValues
+{
+public:
+	CCompiledKeyValues();
+	~CCompiledKeyValues();
+
+	// Compiles pKeyValues and the keys chained after it. Fails if it holds
+	// anything a text file can't, like pointers or wide strings.
+	bool Compile( KeyValues *pKeyValues );
+
+	bool Serialize( CUtlBuffer &buf ) const;
+
+	// Takes a copy of an image written by Serialize. Fails if it was written
+	// by a different version.
+	bool Unserialize( CUtlBuffer &buf );
+
+	void Purge();
+	bool IsValid() const { return m_pImage != NULL; }
+	int GetImageSize() const { return m_nImageSize; }
+
+	// The first key in the file. The other top level keys are its peers.
+	CKeyValuesView GetRoot() const;
+
+	// Loads a text KeyValues file. If a compiled copy in the kvcache folder of
+	// the write path was made from the same file, that is used instead, and
+	// otherwise one is made for next time. Files that use #include or #base
+	// are never cached, since a change to the included file wouldn't be seen.
+	// -nokvcache turns the cache off.
+	bool LoadFromFile( IFileSystem *pFileSystem, const char *resourceName, const char *pathID = NULL, bool bUsesEscapeSequences = false );
+
+private:
+	friend class CKeyValuesView;
+
+	struct Header_t;
+	struct Node_t;
+
+	const Header_t *GetHeader() const { return (const Header_t *)m_pImage; }
+	const Node_t *GetNode( int iNode ) const;
+	const char *GetString( uint32 nOffset ) const;
+	int FindChild( int iNode, const char *pszName ) const;
+	bool IsSibling( int iNode, int iSibling ) const;
+	bool IsSlotTableValid( const Node_t *pNode ) const;
+
+	void SetImage( const void *pImage, int nSize );
+
+	byte *	m_pImage;
+	int		m_nImageSize;
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: LoadFromFile through the cache for code that wants a KeyValues.
+//			Returns NULL if the file couldn't be loaded.
+//-----------------------------------------------------------------------------
+KeyValues *LoadKeyValuesCached( IFileSystem *pFileSystem, const char *resourceName, const char *pathID = NULL, bool bUsesEscapeSequences = false );
+
+#endif // KVCOMPILED_H
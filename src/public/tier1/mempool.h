@@ -106,26 +106,81 @@ protected:
 
 
 //-----------------------------------------------------------------------------
-// 
+// Thread safe pool. Each thread works out of one of a set of caches, each
+// holding up to two magazines (chains of free blocks). Full magazines are
+// traded through a lock free depot, so the mutex around the underlying pool
+// is only taken to cut new magazines from it. A thread never waits for a
+// cache: if its usual one is busy it tries a few others, and if they are all
+// busy too it goes straight to the pool.
+//
+// Blocks are at least two pointers in size and aligned for the depot.
 //-----------------------------------------------------------------------------
+struct MemoryPoolMTStats_t
+{
+	int		m_nCount;				// blocks allocated right now
+	int		m_nPeakCount;			// sampled whenever a magazine is refilled
+	int		m_nContended;			// had to wait for the pool mutex, or found no free cache
+	int		m_nCrossThreadFrees;	// frees through a cache that has freed more than it allocated
+	int		m_nDepotMagazines;		// full magazines in the depot
+};
+
 class CMemoryPoolMT : public CUtlMemoryPool
 {
 public:
-	CMemoryPoolMT(int blockSize, int numElements, int growMode = UTLMEMORYPOOL_GROW_FAST, const char *pszAllocOwner = NULL) : CUtlMemoryPool( blockSize, numElements, growMode, pszAllocOwner) {}
+	CMemoryPoolMT( int blockSize, int numElements, int growMode = UTLMEMORYPOOL_GROW_FAST, const char *pszAllocOwner = NULL, int nAlignment = 0 );
+	~CMemoryPoolMT();
 
+	void*		Alloc();
+	void*		Alloc( size_t amount );
+	void*		AllocZero();
+	void*		AllocZero( size_t amount );
+	void		Free( void *pMem );
+
+	// Frees everything. Nothing else may be using the pool.
+	void		Clear();
 
-	void*		Alloc()	{ AUTO_LOCK( m_mutex ); return CUtlMemoryPool::Alloc(); }
-	void*		Alloc( size_t amount )	{ AUTO_LOCK( m_mutex ); return CUtlMemoryPool::Alloc( amount ); }
-	void*		AllocZero()	{ AUTO_LOCK( m_mutex ); return CUtlMemoryPool::AllocZero(); }	
-	void*		AllocZero( size_t amount )	{ AUTO_LOCK( m_mutex ); return CUtlMemoryPool::AllocZero( amount ); }
-	void		Free(void *pMem) { AUTO_LOCK( m_mutex ); CUtlMemoryPool::Free( pMem ); }
+	// Exact when no other thread is using the pool
+	int			Count();
+	int			PeakCount();
+	void		GetStats( MemoryPoolMTStats_t &stats );
 
-	// Frees everything
-	void		Clear() { AUTO_LOCK( m_mutex ); return CUtlMemoryPool::Clear(); }
 private:
-	CThreadFastMutex m_mutex; // @TODO: Rework to use tslist (toml 7/6/2007)
-};
+	enum
+	{
+		MAGAZINE_SIZE		= 32,
+		MAX_THREAD_CACHES	= 32,
+		CACHE_PROBES		= 4,
+	};
 
+	struct ThreadCache_t
+	{
+		void	*m_pLoaded;
+		void	*m_pPrevious;
+		volatile int32	m_nLock;
+		int		m_nLoaded;
+		int		m_nPrevious;			// either 0 or MAGAZINE_SIZE
+		int		m_nAllocs;
+		int		m_nFrees;
+		int		m_nCrossThreadFrees;
+		byte	m_Pad[64 - 2 * sizeof( void * ) - 6 * sizeof( int )];	// one cache line each
+	};
+
+	ThreadCache_t *LockCache();
+	void		UnlockCache( ThreadCache_t *pCache );
+	void		RefillCache( ThreadCache_t *pCache );
+	void		PushMagazine( void *pMagazine );
+	void		*PopMagazine();
+	void		FreeMagazine( void *pMagazine );
+	void		Flush();
+	void		UpdatePeak();
+
+	ThreadCache_t		m_Caches[MAX_THREAD_CACHES];
+	CTSListBase			m_Depot;
+	CThreadFastMutex	m_mutex;
+	int					m_nUncachedCount;		// changed under m_mutex
+	CInterlockedInt		m_nPeakCount;
+	CInterlockedInt		m_nContended;
+};
 
 //-----------------------------------------------------------------------------
 // Wrapper macro to make an allocator that returns particular typed allocations
@@ -9,4 +9,15 @@ bool CheckMMXTechnology(void);
 bool CheckSSETechnology(void);
 bool CheckSSE2Technology(void);
 bool Check3DNowTechnology(void);
+bool CheckAVXTechnology(void);		// CPU and OS support for 256-bit ymm registers
 
+// Whether this compiler can build AVX code, which CheckAVXTechnology() then
+// decides may run. Files with AVX kernels get /arch:AVX from their vpc, but
+// msvc before VS2013 doesn't define __AVX__ for it, so that can't be tested;
+// gcc builds them with #pragma GCC target( "avx" ) instead.
+#if !defined( _X360 ) && ( defined( _MSC_VER ) || defined( __AVX__ ) || \
+	( defined( __GNUC__ ) && !defined( __clang__ ) && ( defined( __i386__ ) || defined( __x86_64__ ) ) ) )
+#define COMPILER_SUPPORTS_AVX 1
+#else
+#define COMPILER_SUPPORTS_AVX 0
+#endif
@@ -0,0 +1,567 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Open addressing hash tables that are drop in replacements for
+//			CUtlHash and CUtlHashFast
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef UTLFLATHASH_H
+#define UTLFLATHASH_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include <stdio.h>
+#include "tier1/utlvector.h"
+#include "tier1/utlhash.h"
+#include "tier1/generichash.h"
+#include "tier1/strtools.h"
+
+#ifndef _X360
+#include <emmintrin.h>
+#define UTLFLATHASH_SSE2
+#endif
+
+#ifdef COMPILER_MSVC
+#include <intrin.h>
+#endif
+
+//-----------------------------------------------------------------------------
+// CUtlFlatHash has CUtlHash's interface, but the elements live in one array
+// and are found through a table of slots probed sixteen at a time. Each slot
+// has a control byte holding 7 bits of the element's hash (or empty/deleted),
+// so a probe compares sixteen control bytes with one SSE2 compare and only
+// calls the compare function on the few slots whose bits match. A find is
+// usually one control group load and one element compare, against CUtlHash's
+// bucket vector, bucket array and a compare per element in the bucket.
+//
+// Differences from CUtlHash:
+//	- The bucket count is the number of elements to make room for up front,
+//	  and the table grows as needed, so it doesn't have to be a guess.
+//	  growCount and initCount are ignored.
+//	- Handles are indices into the element array, from 0 to Count() - 1.
+//	  Remove moves the last element into the hole, which changes its handle,
+//	  much as CUtlHash::Remove does to the last element of a bucket.
+//	- Insertion can move the elements, as it can in CUtlHash.
+//
+// The key function only has to return an unsigned int; it's mixed before
+// use, so sums or other cheap keys are fine.
+//-----------------------------------------------------------------------------
+template<class Data, typename C = bool (*)( Data const&, Data const& ), typename K = unsigned int (*)( Data const& ) >
+class CUtlFlatHash
+{
+public:
+	typedef C CompareFunc_t;
+	typedef K KeyFunc_t;
+
+	CUtlFlatHash( int bucketCount = 0, int growCount = 0, int initCount = 0,
+				  CompareFunc_t compareFunc = 0, KeyFunc_t keyFunc = 0 );
+	~CUtlFlatHash();
+
+	static UtlHashHandle_t InvalidHandle( void )  { return ( UtlHashHandle_t )~0; }
+	bool IsValidHandle( UtlHashHandle_t handle ) const	{ return handle < (UtlHashHandle_t)m_Data.Count(); }
+
+	int Count( void ) const		{ return m_Data.Count(); }
+
+	// Makes room for this many elements without growing
+	void EnsureCapacity( int nElements );
+
+	void Purge( void );
+
+	UtlHashHandle_t Insert( Data const &src );
+	UtlHashHandle_t Insert( Data const &src, bool *pDidInsert );
+	UtlHashHandle_t AllocEntryFromKey( Data const &src );
+
+	// Inserts without looking for an existing element with the same key
+	UtlHashHandle_t FastInsert( Data const &src );
+
+	void Remove( UtlHashHandle_t handle );
+	void RemoveAll();
+
+	UtlHashHandle_t Find( Data const &src ) const;
+
+	Data &Element( UtlHashHandle_t handle )						{ return m_Data[handle]; }
+	Data const &Element( UtlHashHandle_t handle ) const			{ return m_Data[handle]; }
+	Data &operator[]( UtlHashHandle_t handle )					{ return m_Data[handle]; }
+	Data const &operator[]( UtlHashHandle_t handle ) const		{ return m_Data[handle]; }
+
+	UtlHashHandle_t GetFirstHandle() const	{ return m_Data.Count() ? 0 : InvalidHandle(); }
+	UtlHashHandle_t GetNextHandle( UtlHashHandle_t h ) const	{ return ( h + 1 < (UtlHashHandle_t)m_Data.Count() ) ? h + 1 : InvalidHandle(); }
+
+	// Writes out the table size and probe lengths
+	void Log( const char *filename );
+
+protected:
+	enum
+	{
+		GROUP_WIDTH		= 16,
+		MIN_CAPACITY	= 16,
+		CTRL_EMPTY		= 0x80,
+		CTRL_DELETED	= 0xfe,
+	};
+
+	unsigned int Hash( Data const &src ) const	{ return HashIntAlternate( m_KeyFunc( src ) ); }
+	static unsigned int H1( unsigned int hash )	{ return hash >> 7; }
+	static uint8 H2( unsigned int hash )		{ return (uint8)( hash & 0x7f ); }
+	static int FirstBitInMask( unsigned int mask );
+
+	// Bit i is set if control byte i of the group starting at slot iSlot matches
+	unsigned int MatchGroup( int iSlot, uint8 h2 ) const;
+	unsigned int MatchEmptyGroup( int iSlot ) const;
+	unsigned int MatchEmptyOrDeletedGroup( int iSlot ) const;
+
+	int FindSlot( Data const &src, unsigned int hash ) const;
+	int FindSlotOfHandle( UtlHashHandle_t handle ) const;
+	int FindInsertSlot( unsigned int hash ) const;
+	void SetCtrl( int iSlot, uint8 ctrl );
+	UtlHashHandle_t InsertNew( Data const *pSrc, unsigned int hash );
+	void Rehash( int nCapacity );
+
+	CUtlVector<Data>	m_Data;
+	CUtlVector<uint8>	m_Ctrl;				// capacity + GROUP_WIDTH, the last group mirrors the first
+	CUtlVector<int>		m_Slots;			// index into m_Data
+	int					m_nCapacity;		// power of two
+	int					m_nGrowthLeft;		// inserts until 7/8 of the slots are used or deleted
+
+	CompareFunc_t		m_CompareFunc;
+	KeyFunc_t			m_KeyFunc;
+};
+
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+template<class Data, typename C, typename K>
+CUtlFlatHash<Data, C, K>::CUtlFlatHash( int bucketCount, int growCount, int initCount,
+										CompareFunc_t compareFunc, KeyFunc_t keyFunc ) :
+	m_nCapacity( 0 ),
+	m_nGrowthLeft( 0 ),
+	m_CompareFunc( compareFunc ),
+	m_KeyFunc( keyFunc )
+{
+	EnsureCapacity( bucketCount );
+}
+
+template<class Data, typename C, typename K>
+CUtlFlatHash<Data, C, K>::~CUtlFlatHash()
+{
+	Purge();
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+template<class Data, typename C, typename K>
+inline unsigned int CUtlFlatHash<Data, C, K>::MatchGroup( int iSlot, uint8 h2 ) const
+{
+#ifdef UTLFLATHASH_SSE2
+	__m128i group = _mm_loadu_si128( (const __m128i *)( m_Ctrl.Base() + iSlot ) );
+	return _mm_movemask_epi8( _mm_cmpeq_epi8( group, _mm_set1_epi8( (char)h2 ) ) );
+#else
+	unsigned int mask = 0;
+	const uint8 *pGroup = m_Ctrl.Base() + iSlot;
+	for ( int i = 0; i < GROUP_WIDTH; i++ )
+	{
+		mask |= ( pGroup[i] == h2 ) << i;
+	}
+	return mask;
+#endif
+}
+
+template<class Data, typename C, typename K>
+inline unsigned int CUtlFlatHash<Data, C, K>::MatchEmptyGroup( int iSlot ) const
+{
+	return MatchGroup( iSlot, CTRL_EMPTY );
+}
+
+template<class Data, typename C, typename K>
+inline unsigned int CUtlFlatHash<Data, C, K>::MatchEmptyOrDeletedGroup( int iSlot ) const
+{
+	// both have the top bit set, hashes never do
+#ifdef UTLFLATHASH_SSE2
+	return _mm_movemask_epi8( _mm_loadu_si128( (const __m128i *)( m_Ctrl.Base() + iSlot ) ) );
+#else
+	unsigned int mask = 0;
+	const uint8 *pGroup = m_Ctrl.Base() + iSlot;
+	for ( int i = 0; i < GROUP_WIDTH; i++ )
+	{
+		mask |= ( pGroup[i] >> 7 ) << i;
+	}
+	return mask;
+#endif
+}
+
+template<class Data, typename C, typename K>
+inline int CUtlFlatHash<Data, C, K>::FirstBitInMask( unsigned int mask )
+{
+	Assert( mask );
+#ifdef COMPILER_MSVC
+	unsigned long iBit;
+	_BitScanForward( &iBit, mask );
+	return iBit;
+#else
+	return __builtin_ctz( mask );
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Probes a group at a time, moving one group further on each time (so the
+// groups probed are triangular numbers apart, which visits every group of a
+// power of two table), until it finds the element or a group with an empty
+// slot in it.
+//-----------------------------------------------------------------------------
+template<class Data, typename C, typename K>
+inline int CUtlFlatHash<Data, C, K>::FindSlot( Data const &src, unsigned int hash ) const
+{
+	if ( !m_nCapacity )
+		return -1;
+
+	int mask = m_nCapacity - 1;
+	int iSlot = H1( hash ) & mask;
+	uint8 h2 = H2( hash );
+
+	for ( int nStride = GROUP_WIDTH; ; nStride += GROUP_WIDTH )
+	{
+		for ( unsigned int match = MatchGroup( iSlot, h2 ); match; match &= match - 1 )
+		{
+			int iMatch = ( iSlot + FirstBitInMask( match ) ) & mask;
+			if ( m_CompareFunc( m_Data[ m_Slots[iMatch] ], src ) )
+				return iMatch;
+		}
+
+		if ( MatchEmptyGroup( iSlot ) || nStride > m_nCapacity )
+			return -1;
+
+		iSlot = ( iSlot + nStride ) & mask;
+	}
+}
+
+template<class Data, typename C, typename K>
+inline int CUtlFlatHash<Data, C, K>::FindSlotOfHandle( UtlHashHandle_t handle ) const
+{
+	unsigned int hash = Hash( m_Data[handle] );
+	int mask = m_nCapacity - 1;
+	int iSlot = H1( hash ) & mask;
+	uint8 h2 = H2( hash );
+
+	for ( int nStride = GROUP_WIDTH; ; nStride += GROUP_WIDTH )
+	{
+		for ( unsigned int match = MatchGroup( iSlot, h2 ); match; match &= match - 1 )
+		{
+			int iMatch = ( iSlot + FirstBitInMask( match ) ) & mask;
+			if ( m_Slots[iMatch] == (int)handle )
+				return iMatch;
+		}
+
+		Assert( nStride <= m_nCapacity );
+		iSlot = ( iSlot + nStride ) & mask;
+	}
+}
+
+template<class Data, typename C, typename K>
+inline int CUtlFlatHash<Data, C, K>::FindInsertSlot( unsigned int hash ) const
+{
+	int mask = m_nCapacity - 1;
+	int iSlot = H1( hash ) & mask;
+
+	for ( int nStride = GROUP_WIDTH; ; nStride += GROUP_WIDTH )
+	{
+		unsigned int match = MatchEmptyOrDeletedGroup( iSlot );
+		if ( match )
+			return ( iSlot + FirstBitInMask( match ) ) & mask;
+
+		iSlot = ( iSlot + nStride ) & mask;
+	}
+}
+
+template<class Data, typename C, typename K>
+inline void CUtlFlatHash<Data, C, K>::SetCtrl( int iSlot, uint8 ctrl )
+{
+	m_Ctrl[iSlot] = ctrl;
+	if ( iSlot < GROUP_WIDTH )
+	{
+		m_Ctrl[m_nCapacity + iSlot] = ctrl;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Rebuilds the slot table at the given size, which also clears out deleted slots
+//-----------------------------------------------------------------------------
+template<class Data, typename C, typename K>
+void CUtlFlatHash<Data, C, K>::Rehash( int nCapacity )
+{
+	Assert( IsPowerOfTwo( nCapacity ) && nCapacity >= MIN_CAPACITY );
+
+	m_nCapacity = nCapacity;
+	m_Ctrl.SetCount( nCapacity + GROUP_WIDTH );
+	V_memset( m_Ctrl.Base(), CTRL_EMPTY, nCapacity + GROUP_WIDTH );
+	m_Slots.SetCount( nCapacity );
+	m_nGrowthLeft = nCapacity - nCapacity / 8 - m_Data.Count();
+
+	for ( int i = 0; i < m_Data.Count(); i++ )
+	{
+		unsigned int hash = Hash( m_Data[i] );
+		int iSlot = FindInsertSlot( hash );
+		SetCtrl( iSlot, H2( hash ) );
+		m_Slots[iSlot] = i;
+	}
+}
+
+template<class Data, typename C, typename K>
+void CUtlFlatHash<Data, C, K>::EnsureCapacity( int nElements )
+{
+	int nCapacity = m_nCapacity ? m_nCapacity : MIN_CAPACITY;
+	while ( nCapacity - nCapacity / 8 < nElements )
+	{
+		nCapacity *= 2;
+	}
+
+	if ( nCapacity != m_nCapacity )
+	{
+		m_Data.EnsureCapacity( nElements );
+		Rehash( nCapacity );
+	}
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+template<class Data, typename C, typename K>
+void CUtlFlatHash<Data, C, K>::Purge( void )
+{
+	m_Data.Purge();
+	m_Ctrl.Purge();
+	m_Slots.Purge();
+	m_nCapacity = 0;
+	m_nGrowthLeft = 0;
+}
+
+template<class Data, typename C, typename K>
+void CUtlFlatHash<Data, C, K>::RemoveAll()
+{
+	m_Data.RemoveAll();
+	if ( m_nCapacity )
+	{
+		Rehash( m_nCapacity );
+	}
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+template<class Data, typename C, typename K>
+inline UtlHashHandle_t CUtlFlatHash<Data, C, K>::Find( Data const &src ) const
+{
+	int iSlot = FindSlot( src, Hash( src ) );
+	return ( iSlot != -1 ) ? m_Slots[iSlot] : InvalidHandle();
+}
+
+//-----------------------------------------------------------------------------
+// Adds an element known not to be in the table. Copies *pSrc, or default
+// constructs the element if it's NULL.
+//-----------------------------------------------------------------------------
+template<class Data, typename C, typename K>
+UtlHashHandle_t CUtlFlatHash<Data, C, K>::InsertNew( Data const *pSrc, unsigned int hash )
+{
+	if ( m_nGrowthLeft <= 0 )
+	{
+		// only grow if the table is really full, not just full of deleted slots
+		int nCapacity = m_nCapacity ? m_nCapacity : MIN_CAPACITY;
+		if ( m_Data.Count() * 2 >= nCapacity - nCapacity / 8 )
+		{
+			nCapacity *= 2;
+		}
+		Rehash( nCapacity );
+	}
+
+	int iSlot = FindInsertSlot( hash );
+	if ( m_Ctrl[iSlot] == CTRL_EMPTY )
+	{
+		m_nGrowthLeft--;
+	}
+	SetCtrl( iSlot, H2( hash ) );
+
+	int iData = pSrc ? m_Data.AddToTail( *pSrc ) : m_Data.AddToTail();
+	m_Slots[iSlot] = iData;
+	return iData;
+}
+
+template<class Data, typename C, typename K>
+inline UtlHashHandle_t CUtlFlatHash<Data, C, K>::Insert( Data const &src )
+{
+	unsigned int hash = Hash( src );
+	int iSlot = FindSlot( src, hash );
+	if ( iSlot != -1 )
+		return m_Slots[iSlot];
+
+	return InsertNew( &src, hash );
+}
+
+template<class Data, typename C, typename K>
+inline UtlHashHandle_t CUtlFlatHash<Data, C, K>::Insert( Data const &src, bool *pDidInsert )
+{
+	unsigned int hash = Hash( src );
+	int iSlot = FindSlot( src, hash );
+	if ( iSlot != -1 )
+	{
+		*pDidInsert = false;
+		return m_Slots[iSlot];
+	}
+
+	*pDidInsert = true;
+	return InsertNew( &src, hash );
+}
+
+template<class Data, typename C, typename K>
+inline UtlHashHandle_t CUtlFlatHash<Data, C, K>::AllocEntryFromKey( Data const &src )
+{
+	unsigned int hash = Hash( src );
+	int iSlot = FindSlot( src, hash );
+	if ( iSlot != -1 )
+		return m_Slots[iSlot];
+
+	// like CUtlHash the caller fills in the key, which must hash the same as src
+	return InsertNew( NULL, hash );
+}
+
+template<class Data, typename C, typename K>
+inline UtlHashHandle_t CUtlFlatHash<Data, C, K>::FastInsert( Data const &src )
+{
+	return InsertNew( &src, Hash( src ) );
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+template<class Data, typename C, typename K>
+void CUtlFlatHash<Data, C, K>::Remove( UtlHashHandle_t handle )
+{
+	Assert( IsValidHandle( handle ) );
+
+	SetCtrl( FindSlotOfHandle( handle ), CTRL_DELETED );
+
+	// the last element fills the hole
+	int iLast = m_Data.Count() - 1;
+	if ( (int)handle != iLast )
+	{
+		m_Slots[ FindSlotOfHandle( iLast ) ] = handle;
+	}
+	m_Data.FastRemove( handle );
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+template<class Data, typename C, typename K>
+void CUtlFlatHash<Data, C, K>::Log( const char *filename )
+{
+	FILE *pDebugFp = fopen( filename, "w" );
+	if ( !pDebugFp )
+		return;
+
+	int nDeleted = 0;
+	for ( int i = 0; i < m_nCapacity; i++ )
+	{
+		nDeleted += ( m_Ctrl[i] == CTRL_DELETED );
+	}
+
+	// groups probed to find each element
+	int nTotalProbes = 0;
+	int nMaxProbes = 0;
+	for ( int i = 0; i < m_Data.Count(); i++ )
+	{
+		unsigned int hash = Hash( m_Data[i] );
+		int iSlot = H1( hash ) & ( m_nCapacity - 1 );
+		int iFound = FindSlotOfHandle( i );
+		int nProbes = 1;
+		for ( int nStride = GROUP_WIDTH; ( ( iFound - iSlot ) & ( m_nCapacity - 1 ) ) >= GROUP_WIDTH; nStride += GROUP_WIDTH )
+		{
+			iSlot = ( iSlot + nStride ) & ( m_nCapacity - 1 );
+			nProbes++;
+		}
+		nTotalProbes += nProbes;
+		nMaxProbes = MAX( nMaxProbes, nProbes );
+	}
+
+	fprintf( pDebugFp, "\n%d Slots\n", m_nCapacity );
+	fprintf( pDebugFp, "Elements: %d\n", m_Data.Count() );
+	fprintf( pDebugFp, "Deleted Slots: %d\n", nDeleted );
+	fprintf( pDebugFp, "Average Groups Probed: %.2f\n", m_Data.Count() ? (float)nTotalProbes / m_Data.Count() : 0.0f );
+	fprintf( pDebugFp, "Max Groups Probed: %d\n", nMaxProbes );
+
+	fclose( pDebugFp );
+}
+
+
+//=============================================================================
+//
+// CUtlHashFast's interface on a CUtlFlatHash. The bucket count passed to Init
+// no longer has to be a power of two or limit anything; it's just how many
+// elements to make room for. HashFuncs is only there so existing declarations
+// compile, since the key is mixed anyway.
+//
+template<class Data, class HashFuncs = CUtlHashFastNoHash >
+class CUtlFlatHashFast
+{
+public:
+	CUtlFlatHashFast() : m_Hash( 0, 0, 0, CompareFunc_t(), KeyFunc_t() ) {}
+
+	void Purge( void )								{ m_Hash.Purge(); }
+
+	static UtlHashFastHandle_t InvalidHandle( void )	{ return ( UtlHashFastHandle_t )~0; }
+
+	bool Init( int nBucketCount )					{ m_Hash.EnsureCapacity( nBucketCount ); return true; }
+
+	int Count( void )								{ return m_Hash.Count(); }
+
+	UtlHashFastHandle_t Insert( unsigned int uiKey, const Data &data )
+	{
+		UtlHashFastHandle_t hHash = Find( uiKey );
+		if ( hHash != InvalidHandle() )
+			return hHash;
+
+		return FastInsert( uiKey, data );
+	}
+
+	UtlHashFastHandle_t FastInsert( unsigned int uiKey, const Data &data )
+	{
+		HashFastData_t entry;
+		entry.m_uiKey = uiKey;
+		entry.m_Data = data;
+		return m_Hash.FastInsert( entry );
+	}
+
+	// Moves the last element into the removed one's handle
+	void Remove( UtlHashFastHandle_t hHash )		{ m_Hash.Remove( hHash ); }
+	void RemoveAll( void )							{ m_Hash.RemoveAll(); }
+
+	UtlHashFastHandle_t Find( unsigned int uiKey )
+	{
+		HashFastData_t entry;
+		entry.m_uiKey = uiKey;
+		UtlHashHandle_t h = m_Hash.Find( entry );
+		return ( h != m_Hash.InvalidHandle() ) ? (UtlHashFastHandle_t)h : InvalidHandle();
+	}
+
+	Data &Element( UtlHashFastHandle_t hHash )				{ return m_Hash[hHash].m_Data; }
+	Data const &Element( UtlHashFastHandle_t hHash ) const	{ return m_Hash[hHash].m_Data; }
+	Data &operator[]( UtlHashFastHandle_t hHash )			{ return m_Hash[hHash].m_Data; }
+	Data const &operator[]( UtlHashFastHandle_t hHash ) const	{ return m_Hash[hHash].m_Data; }
+
+private:
+	struct HashFastData_t
+	{
+		unsigned int	m_uiKey;
+		Data			m_Data;
+	};
+
+	struct CompareFunc_t
+	{
+		bool operator()( HashFastData_t const &a, HashFastData_t const &b ) const	{ return a.m_uiKey == b.m_uiKey; }
+	};
+
+	struct KeyFunc_t
+	{
+		unsigned int operator()( HashFastData_t const &a ) const	{ return a.m_uiKey; }
+	};
+
+	CUtlFlatHash<HashFastData_t, CompareFunc_t, KeyFunc_t>	m_Hash;
+};
+
+
+#endif // UTLFLATHASH_H
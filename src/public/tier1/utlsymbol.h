@@ -171,44 +171,117 @@ private:
 	friend class CLess;
 };
 
-class CUtlSymbolTableMT : private CUtlSymbolTable
+//-----------------------------------------------------------------------------
+// CUtlConcurrentSymbolTable:
+// description:
+//    An append only symbol table that any number of threads can read from
+//    without taking a lock. Symbols are dense ints starting at zero, and the
+//    strings never move, so the pointer String() returns is good until the
+//    table is cleared.
+//
+//    Strings hash to one of NUM_SHARDS shards, each an open addressing array
+//    of entry pointers, and adding a string only locks its shard. A full
+//    array is copied into one twice the size and published with a single
+//    pointer write. The old array is kept until RemoveAll in case a reader
+//    is still probing it.
+//-----------------------------------------------------------------------------
+
+class CUtlConcurrentSymbolTable
+{
+public:
+	CUtlConcurrentSymbolTable( int initSize = 32, bool caseInsensitive = false, int maxStrings = INT_MAX );
+	~CUtlConcurrentSymbolTable();
+
+	// Finds and/or creates a symbol based on the string. Returns -1 for NULL,
+	// or once the table holds maxStrings strings.
+	int AddString( const char *pString );
+
+	// Finds the symbol for pString, or -1
+	int Find( const char *pString ) const;
+
+	// Look up the string associated with a particular symbol
+	const char *String( int nSymbol ) const;
+
+	int GetNumStrings() const { return m_nStrings; }
+
+	// Remove all symbols in the table. Not thread safe.
+	void RemoveAll();
+
+private:
+	enum
+	{
+		SHARD_BITS			= 4,
+		NUM_SHARDS			= 1 << SHARD_BITS,
+		MIN_SHARD_SLOTS		= 16,
+		FIRST_SEGMENT_BITS	= 6,	// the symbol to string map is in segments of 64, 128, 256... strings
+		MAX_SEGMENTS		= 32 - FIRST_SEGMENT_BITS,
+		POOL_SIZE			= 4096,
+	};
+
+	struct Entry_t
+	{
+		unsigned int	m_nHash;
+		int				m_nSymbol;
+		char			m_String[1];
+	};
+
+	struct SlotTable_t
+	{
+		SlotTable_t *		m_pRetired;		// the table this one replaced
+		int					m_nMask;
+		Entry_t * volatile	m_pSlots[1];
+	};
+
+	struct Shard_t
+	{
+		SlotTable_t * volatile	m_pTable;
+		int						m_nUsed;
+		char *					m_pPool;	// the first word of each pool points at the one before
+		int						m_nPoolUsed;
+		CThreadFastMutex		m_mutex;
+	};
+
+	unsigned int HashString( const char *pString ) const;
+	Entry_t *FindEntry( SlotTable_t const *pTable, const char *pString, unsigned int nHash ) const;
+	Entry_t *AllocEntry( Shard_t &shard, int nLen );
+	static void InsertEntry( SlotTable_t *pTable, Entry_t *pEntry );
+	void SetSymbolString( int nSymbol, const char *pString );
+
+	Shard_t				m_Shards[NUM_SHARDS];
+	const char **		m_pSegments[MAX_SEGMENTS];
+	CInterlockedInt		m_nStrings;
+	int					m_nShardSlots;
+	int					m_nMaxStrings;
+	bool				m_bInsensitive;
+};
+
+class CUtlSymbolTableMT
 {
 public:
 	CUtlSymbolTableMT( int growSize = 0, int initSize = 32, bool caseInsensitive = false )
-		: CUtlSymbolTable( growSize, initSize, caseInsensitive )
+		: m_Table( initSize, caseInsensitive, UTL_INVAL_SYMBOL )
 	{
 	}
 
 	CUtlSymbol AddString( const char* pString )
 	{
-		m_lock.LockForWrite();
-		CUtlSymbol result = CUtlSymbolTable::AddString( pString );
-		m_lock.UnlockWrite();
-		return result;
+		int nSymbol = m_Table.AddString( pString );
+		return CUtlSymbol( ( nSymbol >= 0 ) ? (UtlSymId_t)nSymbol : UTL_INVAL_SYMBOL );
 	}
 
 	CUtlSymbol Find( const char* pString ) const
 	{
-		m_lock.LockForRead();
-		CUtlSymbol result = CUtlSymbolTable::Find( pString );
-		m_lock.UnlockRead();
-		return result;
+		int nSymbol = m_Table.Find( pString );
+		return CUtlSymbol( ( nSymbol >= 0 ) ? (UtlSymId_t)nSymbol : UTL_INVAL_SYMBOL );
 	}
 
 	const char* String( CUtlSymbol id ) const
 	{
-		m_lock.LockForRead();
-		const char *pszResult = CUtlSymbolTable::String( id );
-		m_lock.UnlockRead();
-		return pszResult;
+		return id.IsValid() ? m_Table.String( id ) : "";
 	}
 	
 private:
-#if defined(WIN32) || defined(_WIN32)
-	mutable CThreadSpinRWLock m_lock;
-#else
-	mutable CThreadRWLock m_lock;
-#endif
+	CUtlConcurrentSymbolTable m_Table;
 };
 
 
@@ -606,14 +606,12 @@ void CZipFile::ParseFromBuffer( void *buffer, int bufferlength )
 	// Throw away old data
 	Reset();
 
-	// Initialize a buffer
-	CUtlBuffer buf( 0, bufferlength +1  );					// +1 for null termination
+	// Read straight from the caller's memory, the file data is copied out below
+	CUtlBuffer buf( buffer, bufferlength, CUtlBuffer::READ_ONLY );
 
 	// need to swap bytes, so set the buffer opposite the machine's endian
 	buf.ActivateByteSwapping( m_Swap.IsSwappingBytes() );
 
-	buf.Put( buffer, bufferlength );
-
 	buf.SeekGet( CUtlBuffer::SEEK_TAIL, 0 );
 	unsigned int fileLen = buf.TellGet();
 
@@ -5,6 +5,13 @@
 #include <filesystem_tools.h>
 #include <cmdlib.h>
 #include <stdio.h>
+#include <tier1/processor_detect.h>
+#include <tier1/checksum_crc.h>
+#include <tier0/threadtools.h>
+#include <algorithm>
+
+// defined in trace_avx.cpp. false if that file was built without AVX code generation.
+extern bool RayTraceAVXKernelAvailable(void);
 
 static bool SameSign(float a, float b)
 {
@@ -255,10 +262,6 @@ int CacheOptimizedTriangle::ClassifyAgainstAxisSplit(int split_plane, float spli
 	return PLANECHECK_STRADDLING;
 }
 
-#define MAILBOX_HASH_SIZE 256
-#define MAX_TREE_DEPTH 21
-#define MAX_NODE_STACK_LEN (40*MAX_TREE_DEPTH)
-
 struct NodeToVisit {
 	CacheOptimizedKDNode const *node;
 	fltx4 TMin;
@@ -276,6 +279,104 @@ static float BoxSurfaceArea(Vector const &boxmin, Vector const &boxmax)
 	return 2.0*((boxdim[0]*boxdim[2])+(boxdim[0]*boxdim[1])+(boxdim[1]*boxdim[2]));
 }
 
+// intersect 4 rays with one triangle, updating rslt_out for any that hit it closer than their
+// current hit. Shared by the kd-tree and bvh traversals.
+static FORCEINLINE void IntersectTriangleWithRays( const FourRays &rays, TriIntersectData_t const *tri, int tnum,
+												   RayTracingResult *rslt_out, ITransparentTriangleCallback *pCallback )
+{
+	// compute plane intersection
+	FourVectors N;
+	N.x = ReplicateX4( tri->m_flNx );
+	N.y = ReplicateX4( tri->m_flNy );
+	N.z = ReplicateX4( tri->m_flNz );
+
+	fltx4 DDotN = rays.direction * N;
+	// mask off zero or near zero (ray parallel to surface)
+	fltx4 did_hit = OrSIMD( CmpGtSIMD( DDotN,FourEpsilons ),
+							CmpLtSIMD( DDotN, FourNegativeEpsilons ) );
+
+	fltx4 numerator=SubSIMD( ReplicateX4( tri->m_flD ), rays.origin * N );
+
+	fltx4 isect_t=DivSIMD( numerator,DDotN );
+	// now, we have the distance to the plane. lets update our mask
+	did_hit = AndSIMD( did_hit, CmpGtSIMD( isect_t, FourZeros ) );
+	//did_hit=AndSIMD(did_hit,CmpLtSIMD(isect_t,TMax));
+	did_hit = AndSIMD( did_hit, CmpLtSIMD( isect_t, rslt_out->HitDistance ) );
+
+	if ( ! IsAnyNegative( did_hit ) )
+		return;
+
+	// now, check 3 edges
+	fltx4 hitc1 = AddSIMD( rays.origin[tri->m_nCoordSelect0],
+						MulSIMD( isect_t, rays.direction[ tri->m_nCoordSelect0] ) );
+	fltx4 hitc2 = AddSIMD( rays.origin[tri->m_nCoordSelect1],
+						   MulSIMD( isect_t, rays.direction[tri->m_nCoordSelect1] ) );
+	
+	// do barycentric coordinate check
+	fltx4 B0 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[0] ), hitc1 );
+
+	B0 = AddSIMD(
+		B0,
+		MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[1] ), hitc2 ) );
+	B0 = AddSIMD(
+		B0, ReplicateX4( tri->m_ProjectedEdgeEquations[2] ) );
+
+	did_hit = AndSIMD( did_hit, CmpGeSIMD( B0, FourZeros ) );
+
+	fltx4 B1 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[3] ), hitc1 );
+	B1 = AddSIMD(
+		B1,
+		MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[4]), hitc2 ) );
+
+	B1 = AddSIMD(
+		B1, ReplicateX4( tri->m_ProjectedEdgeEquations[5] ) );
+	
+	did_hit = AndSIMD( did_hit, CmpGeSIMD( B1, FourZeros ) );
+
+	fltx4 B2 = AddSIMD( B1, B0 );
+	did_hit = AndSIMD( did_hit, CmpLeSIMD( B2, Four_Ones ) );
+
+	if ( ! IsAnyNegative( did_hit ) )
+		return;
+
+	// if the triangle is transparent
+	if ( tri->m_nFlags & FCACHETRI_TRANSPARENT )
+	{
+		if ( pCallback )
+		{
+			// assuming a triangle indexed as v0, v1, v2
+			// the projected edge equations are set up such that the vert opposite the first
+			// equation is v2, and the vert opposite the second equation is v0
+			// Therefore we pass them back in 1, 2, 0 order
+			// Also B2 is currently B1 + B0 and needs to be 1 - (B1+B0) in order to be a real
+			// barycentric coordinate.  Compute that now and pass it to the callback
+			fltx4 b2 = SubSIMD( Four_Ones, B2 );
+			if ( pCallback->VisitTriangle_ShouldContinue( *tri, rays, &did_hit, &B1, &b2, &B0, tnum ) )
+			{
+				did_hit = Four_Zeros;
+			}
+		}
+	}
+	// now, set the hit_id and closest_hit fields for any enabled rays
+	fltx4 replicated_n = ReplicateIX4(tnum);
+	StoreAlignedSIMD((float *) rslt_out->HitIds,
+				 OrSIMD(AndSIMD(replicated_n,did_hit),
+						   AndNotSIMD(did_hit,LoadAlignedSIMD(
+											 (float *) rslt_out->HitIds))));
+	rslt_out->HitDistance=OrSIMD(AndSIMD(isect_t,did_hit),
+					 AndNotSIMD(did_hit,rslt_out->HitDistance));
+
+	rslt_out->surface_normal.x=OrSIMD(
+		AndSIMD(N.x,did_hit),
+		AndNotSIMD(did_hit,rslt_out->surface_normal.x));
+	rslt_out->surface_normal.y=OrSIMD(
+		AndSIMD(N.y,did_hit),
+		AndNotSIMD(did_hit,rslt_out->surface_normal.y));
+	rslt_out->surface_normal.z=OrSIMD(
+		AndSIMD(N.z,did_hit),
+		AndNotSIMD(did_hit,rslt_out->surface_normal.z));
+}
+
 void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 TMax,
 									   RayTracingResult *rslt_out,
 									   int32 skip_id, ITransparentTriangleCallback *pCallback)
@@ -344,10 +445,50 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 }
 
 
+int RayTracingEnvironment::GetRayPacketWidth(void)
+{
+	static int s_nPacketWidth = 0;
+	if ( !s_nPacketWidth )
+	{
+		// harmless if several threads get here at once, they all compute the same answer
+		s_nPacketWidth = ( RayTraceAVXKernelAvailable() && CheckAVXTechnology() ) ? 8 : 4;
+	}
+	return s_nPacketWidth;
+}
+
+void RayTracingEnvironment::Trace8Rays(const EightRays &rays, fltx4 const TMin[2], fltx4 const TMax[2],
+									   RayTracingResult8 *rslt_out,
+									   int32 skip_id, ITransparentTriangleCallback **ppCallbacks)
+{
+	if ( ( GetRayPacketWidth() >= 8 ) && !( Flags & RTE_FLAGS_USE_BVH ) )
+	{
+		int msk=rays.CalculateDirectionSignMask();
+		if (msk!=-1)
+		{
+			Trace8RaysAVX(rays,TMin,TMax,msk,rslt_out,skip_id,ppCallbacks);
+			return;
+		}
+	}
+
+	// no wide tracer, or the two halves point into different octants
+	for(int h=0;h<2;h++)
+	{
+		Trace4Rays(rays.m_Rays[h],TMin[h],TMax[h],&rslt_out->m_Results[h],skip_id,
+				   ppCallbacks ? ppCallbacks[h] : NULL);
+	}
+}
+
+
 void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 TMax,
 									   int DirectionSignMask, RayTracingResult *rslt_out,
 									   int32 skip_id, ITransparentTriangleCallback *pCallback)
 {
+	if ( Flags & RTE_FLAGS_USE_BVH )
+	{
+		Trace4RaysBVH(rays,TMin,TMax,DirectionSignMask,rslt_out,skip_id,pCallback);
+		return;
+	}
+
 	rays.Check();
 
 	memset(rslt_out->HitIds,0xff,sizeof(rslt_out->HitIds));
@@ -478,100 +619,7 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 				{
 					n_intersection_calculations++;
 					mailboxids[mbox_slot] = tnum;
-					// compute plane intersection
-
-
-					FourVectors N;
-					N.x = ReplicateX4( tri->m_flNx );
-					N.y = ReplicateX4( tri->m_flNy );
-					N.z = ReplicateX4( tri->m_flNz );
-
-					fltx4 DDotN = rays.direction * N;
-					// mask off zero or near zero (ray parallel to surface)
-					fltx4 did_hit = OrSIMD( CmpGtSIMD( DDotN,FourEpsilons ),
-											CmpLtSIMD( DDotN, FourNegativeEpsilons ) );
-
-					fltx4 numerator=SubSIMD( ReplicateX4( tri->m_flD ), rays.origin * N );
-
-					fltx4 isect_t=DivSIMD( numerator,DDotN );
-					// now, we have the distance to the plane. lets update our mask
-					did_hit = AndSIMD( did_hit, CmpGtSIMD( isect_t, FourZeros ) );
-					//did_hit=AndSIMD(did_hit,CmpLtSIMD(isect_t,TMax));
-					did_hit = AndSIMD( did_hit, CmpLtSIMD( isect_t, rslt_out->HitDistance ) );
-
-					if ( ! IsAnyNegative( did_hit ) )
-						continue;
-
-					// now, check 3 edges
-					fltx4 hitc1 = AddSIMD( rays.origin[tri->m_nCoordSelect0],
-										MulSIMD( isect_t, rays.direction[ tri->m_nCoordSelect0] ) );
-					fltx4 hitc2 = AddSIMD( rays.origin[tri->m_nCoordSelect1],
-										   MulSIMD( isect_t, rays.direction[tri->m_nCoordSelect1] ) );
-					
-					// do barycentric coordinate check
-					fltx4 B0 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[0] ), hitc1 );
-
-					B0 = AddSIMD(
-						B0,
-						MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[1] ), hitc2 ) );
-					B0 = AddSIMD(
-						B0, ReplicateX4( tri->m_ProjectedEdgeEquations[2] ) );
-
-					did_hit = AndSIMD( did_hit, CmpGeSIMD( B0, FourZeros ) );
-
-					fltx4 B1 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[3] ), hitc1 );
-					B1 = AddSIMD(
-						B1,
-						MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[4]), hitc2 ) );
-
-					B1 = AddSIMD(
-						B1, ReplicateX4( tri->m_ProjectedEdgeEquations[5] ) );
-					
-					did_hit = AndSIMD( did_hit, CmpGeSIMD( B1, FourZeros ) );
-
-					fltx4 B2 = AddSIMD( B1, B0 );
-					did_hit = AndSIMD( did_hit, CmpLeSIMD( B2, Four_Ones ) );
-
-					if ( ! IsAnyNegative( did_hit ) )
-						continue;
-
-					// if the triangle is transparent
-					if ( tri->m_nFlags & FCACHETRI_TRANSPARENT )
-					{
-						if ( pCallback )
-						{
-							// assuming a triangle indexed as v0, v1, v2
-							// the projected edge equations are set up such that the vert opposite the first
-							// equation is v2, and the vert opposite the second equation is v0
-							// Therefore we pass them back in 1, 2, 0 order
-							// Also B2 is currently B1 + B0 and needs to be 1 - (B1+B0) in order to be a real
-							// barycentric coordinate.  Compute that now and pass it to the callback
-							fltx4 b2 = SubSIMD( Four_Ones, B2 );
-							if ( pCallback->VisitTriangle_ShouldContinue( *tri, rays, &did_hit, &B1, &b2, &B0, tnum ) )
-							{
-								did_hit = Four_Zeros;
-							}
-						}
-					}
-					// now, set the hit_id and closest_hit fields for any enabled rays
-					fltx4 replicated_n = ReplicateIX4(tnum);
-					StoreAlignedSIMD((float *) rslt_out->HitIds,
-								 OrSIMD(AndSIMD(replicated_n,did_hit),
-										   AndNotSIMD(did_hit,LoadAlignedSIMD(
-															 (float *) rslt_out->HitIds))));
-					rslt_out->HitDistance=OrSIMD(AndSIMD(isect_t,did_hit),
-									 AndNotSIMD(did_hit,rslt_out->HitDistance));
-
-					rslt_out->surface_normal.x=OrSIMD(
-						AndSIMD(N.x,did_hit),
-						AndNotSIMD(did_hit,rslt_out->surface_normal.x));
-					rslt_out->surface_normal.y=OrSIMD(
-						AndSIMD(N.y,did_hit),
-						AndNotSIMD(did_hit,rslt_out->surface_normal.y));
-					rslt_out->surface_normal.z=OrSIMD(
-						AndSIMD(N.z,did_hit),
-						AndNotSIMD(did_hit,rslt_out->surface_normal.z));
-					
+					IntersectTriangleWithRays( rays, tri, tnum, rslt_out, pCallback );
 				}
 			} while (--ntris);
 			// now, check if all rays have terminated
@@ -595,6 +643,78 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 }
 
 
+#define MAX_BVH_STACK_LEN 64
+
+void RayTracingEnvironment::Trace4RaysBVH(const FourRays &rays, fltx4 TMin, fltx4 TMax,
+										  int DirectionSignMask, RayTracingResult *rslt_out,
+										  int32 skip_id, ITransparentTriangleCallback *pCallback)
+{
+	rays.Check();
+
+	memset(rslt_out->HitIds,0xff,sizeof(rslt_out->HitIds));
+
+	rslt_out->HitDistance=ReplicateX4(1.0e23);
+
+	rslt_out->surface_normal.DuplicateVector(Vector(0.,0.,0.));
+	FourVectors OneOverRayDir=rays.direction;
+	OneOverRayDir.MakeReciprocalSaturate();
+
+	// every triangle is in exactly one leaf, so unlike the kd-tree no mailbox is needed
+	int NodeStack[MAX_BVH_STACK_LEN];
+	int stack_depth=0;
+	int node_number=0;
+	while(1)
+	{
+		CacheOptimizedBVHNode const *CurNode=&(OptimizedBVH[node_number]);
+
+		// slab test the node's box, against the part of each ray before its closest hit so far
+		fltx4 tnear=TMin;
+		fltx4 tfar=MinSIMD(TMax,rslt_out->HitDistance);
+		for(int c=0;c<3;c++)
+		{
+			fltx4 isect_min_t=
+				MulSIMD(SubSIMD(ReplicateX4(CurNode->m_flMins[c]),rays.origin[c]),OneOverRayDir[c]);
+			fltx4 isect_max_t=
+				MulSIMD(SubSIMD(ReplicateX4(CurNode->m_flMaxs[c]),rays.origin[c]),OneOverRayDir[c]);
+			tnear=MaxSIMD(tnear,MinSIMD(isect_min_t,isect_max_t));
+			tfar=MinSIMD(tfar,MaxSIMD(isect_min_t,isect_max_t));
+		}
+
+		if ( IsAnyNegative( CmpLeSIMD(tnear,tfar) ) )
+		{
+			if ( CurNode->IsLeaf() )
+			{
+				int32 const *tlist=TriangleIndexList.Base()+CurNode->m_nChildOrFirstTri;
+				for(int ntris=CurNode->m_nTrianglesOrAxis;ntris>0;ntris--)
+				{
+					int tnum=*(tlist++);
+					TriIntersectData_t const *tri = &( OptimizedTriangleList[tnum].m_Data.m_IntersectData );
+					if ( tri->m_nTriangleID != skip_id )
+					{
+						n_intersection_calculations++;
+						IntersectTriangleWithRays( rays, tri, tnum, rslt_out, pCallback );
+					}
+				}
+			}
+			else
+			{
+				// visit the child nearer the ray origins first, push the other one
+				int near_child=CurNode->m_nChildOrFirstTri+((DirectionSignMask>>CurNode->SplitAxis())&1);
+				int far_child=CurNode->m_nChildOrFirstTri+CurNode->m_nChildOrFirstTri+1-near_child;
+				assert(stack_depth<MAX_BVH_STACK_LEN);
+				NodeStack[stack_depth++]=far_child;
+				node_number=near_child;
+				continue;
+			}
+		}
+
+		if (!stack_depth)
+			return;
+		node_number=NodeStack[--stack_depth];
+	}
+}
+
+
 int RayTracingEnvironment::MakeLeafNode(int first_tri, int last_tri)
 {
 	CacheOptimizedKDNode ret;
@@ -625,7 +745,7 @@ void RayTracingEnvironment::CalculateTriangleListBounds(int32 const *tris,int nt
 }
 
 
-// Both the "quick" and regular kd tree building algorithms here use the "surface area heuristic":
+// The kd-tree and bvh builders here use the "surface area heuristic":
 // the relative probability of hitting the "left" subvolume (Vl) from a split is equal to that
 // subvolume's surface area divided by its parent's surface area (Vp) : P(Vl | V)=SA(Vl)/SA(Vp).
 // The same holds for the right subvolume, Vp. Nl is the number of triangles in the left volume,
@@ -639,250 +759,819 @@ void RayTracingEnvironment::CalculateTriangleListBounds(int32 const *tris,int nt
 //  This both provides a metric to minimize when computing how and where to split, and also a
 //  termination criterion.
 //
-// the "quick" method just splits down the middle, while the slow method splits at the best
-// discontinuity of the cost formula. The quick method splits along the longest axis ; the 
-// regular algorithm tries all 3 to find which one results in the minimum cost
-// 
-// both methods use the additional optimization of "growing" empty nodes - if the split results in
-// one side being devoid of triangles, the empty side is "grown" as much as possible.
+// Rather than trying triangle vertices as split candidates, the triangle bounds are binned into
+// KD_SAH_BINS buckets along each axis so that every split position can be costed in one pass over
+// the triangles. The kd-tree builder also tries cutting right at the edge of the triangles in the
+// node, which "grows" empty space off into its own node.
+//
+// The top of the kd-tree is built on the calling thread. Nodes below that with few enough triangles
+// become tasks which are built on all cpus into their own arrays, and then stitched back into
+// OptimizedKDTree in a fixed order, so the resulting tree doesn't depend on thread timing.
 //
 
 #define COST_OF_TRAVERSAL 75								// approximate #operations
 #define COST_OF_INTERSECTION 167							// approximate #operations
 
+#define KD_SAH_BINS 32
+#define KD_MIN_TRIS_PER_TASK 1024							// smaller subtrees aren't worth a task
 
-float RayTracingEnvironment::CalculateCostsOfSplit(
-	int split_plane,int32 const *tri_list,int ntris,
-	Vector MinBound,Vector MaxBound, float &split_value,
-	int &nleft, int &nright, int &nboth)
+struct TriBounds_t
 {
-	// determine the costs of splitting on a given axis, and label triangles with respect to
-	// that axis by storing the value in coordselect0. It will also return the number of
-	// tris in the left, right, and nboth groups, in order to facilitate memory
-	nleft=nboth=nright=0;
-	
-	// now, label each triangle. Since we have not converted the triangles into
-	// intersection fromat yet, we can use the CoordSelect0 field of each as a temp.
-	nleft=0;
-	nright=0;
-	nboth=0;
-	float min_coord=1.0e23,max_coord=-1.0e23;
+	float m_flMins[3];
+	float m_flMaxs[3];
+};
 
+static void CalculateTriBounds( RayTracingEnvironment *pEnv, CUtlVector<TriBounds_t> &bounds )
+{
+	int ntris=pEnv->OptimizedTriangleList.Count();
+	bounds.SetCount( ntris );
 	for(int t=0;t<ntris;t++)
 	{
-		CacheOptimizedTriangle &tri=OptimizedTriangleList[tri_list[t]];
-		// determine max and min coordinate values for later optimization
-		for(int v=0;v<3;v++)
+		CacheOptimizedTriangle const &tri=pEnv->OptimizedTriangleList[t];
+		for(int c=0;c<3;c++)
+		{
+			bounds[t].m_flMins[c]=MIN(tri.Vertex(0)[c],MIN(tri.Vertex(1)[c],tri.Vertex(2)[c]));
+			bounds[t].m_flMaxs[c]=MAX(tri.Vertex(0)[c],MAX(tri.Vertex(1)[c],tri.Vertex(2)[c]));
+		}
+	}
+}
+
+// surface area of a box whose size along split_plane is changed to len
+static FORCEINLINE float SplitBoxSurfaceArea(Vector const &boxdim, int split_plane, float len)
+{
+	float d1=boxdim[(split_plane+1)%3];
+	float d2=boxdim[(split_plane+2)%3];
+	return 2.0*(d1*d2+len*(d1+d2));
+}
+
+struct KDBuildTask_t
+{
+	int m_nNode;											// slot in OptimizedKDTree for the root
+	Vector m_MinBound;
+	Vector m_MaxBound;
+	int m_nDepth;
+	CUtlVector<int32> m_TriList;
+
+	// the subtree, with its root at 0
+	CUtlVector<CacheOptimizedKDNode> m_Nodes;
+	CUtlVector<int32> m_TriangleIndexList;
+};
+
+class CKDTreeBuilder
+{
+public:
+	CKDTreeBuilder( RayTracingEnvironment *pEnv ) : m_pEnv( pEnv ), m_nMinTrisPerTask( 0 ), m_nNextTask( 0 )
+	{
+	}
+
+	void Build(void);
+
+private:
+	float CalculateBestSplit(int32 const *tri_list,int ntris,Vector const &MinBound,Vector const &MaxBound,
+							 int &split_plane,float &split_value) const;
+	void RefineNode(CUtlVector<CacheOptimizedKDNode> &nodes,CUtlVector<int32> &triangle_index_list,
+					int node_number,int32 const *tri_list,int ntris,
+					Vector MinBound,Vector MaxBound,int depth,bool bCanMakeTasks);
+	void MakeLeaf(CUtlVector<CacheOptimizedKDNode> &nodes,CUtlVector<int32> &triangle_index_list,
+				  int node_number,int32 const *tri_list,int ntris,Vector const &MinBound,Vector const &MaxBound);
+	void MergeTask(KDBuildTask_t const &task);
+
+	static uintp BuildTasksThread( void *pParam );
+	void BuildTasks(void);
+
+	RayTracingEnvironment *m_pEnv;
+	CUtlVector<TriBounds_t> m_TriBounds;
+	int m_nMinTrisPerTask;
+	CUtlVector<KDBuildTask_t *> m_Tasks;					// in tree order
+	CUtlVector<KDBuildTask_t *> m_TaskQueue;				// largest first
+	volatile int32 m_nNextTask;
+};
+
+
+float CKDTreeBuilder::CalculateBestSplit(int32 const *tri_list,int ntris,
+										 Vector const &MinBound,Vector const &MaxBound,
+										 int &split_plane,float &split_value) const
+{
+	float best_cost=1.0e23;
+	Vector boxdim=MaxBound-MinBound;
+	float SA=BoxSurfaceArea(MinBound,MaxBound);
+	if (SA<=0)
+		return best_cost;
+	float ISA=1.0/SA;
+
+	for(int axis=0;axis<3;axis++)
+	{
+		float extent=boxdim[axis];
+		if (extent<=0)
+			continue;
+
+		// count how many triangles start and end in each bin along this axis
+		int nstart[KD_SAH_BINS];
+		int nend[KD_SAH_BINS];
+		memset(nstart,0,sizeof(nstart));
+		memset(nend,0,sizeof(nend));
+		float min_coord=1.0e23,max_coord=-1.0e23;
+		float scale=KD_SAH_BINS/extent;
+		for(int t=0;t<ntris;t++)
 		{
-			min_coord = MIN( min_coord, tri.Vertex(v)[split_plane] );
-			max_coord = MAX( max_coord, tri.Vertex(v)[split_plane] );
+			TriBounds_t const &b=m_TriBounds[tri_list[t]];
+			float lo=MAX(b.m_flMins[axis],MinBound[axis]);
+			float hi=MIN(b.m_flMaxs[axis],MaxBound[axis]);
+			min_coord=MIN(min_coord,lo);
+			max_coord=MAX(max_coord,hi);
+			int lobin=(int) ((lo-MinBound[axis])*scale);
+			int hibin=(int) ((hi-MinBound[axis])*scale);
+			nstart[clamp(lobin,0,KD_SAH_BINS-1)]++;
+			nend[clamp(hibin,0,KD_SAH_BINS-1)]++;
+		}
+
+		// sweep the planes between bins. a triangle that ends in a bin below the plane is
+		// entirely left of it, one that starts in a bin at or above it is entirely right of it.
+		int nleft=0,nnotright=0;
+		for(int b=1;b<KD_SAH_BINS;b++)
+		{
+			nleft+=nend[b-1];
+			nnotright+=nstart[b-1];
+			int nright=ntris-nnotright;
+			int nboth=ntris-nleft-nright;
+			float trial_value=MinBound[axis]+b*(extent/KD_SAH_BINS);
+			float cost=COST_OF_TRAVERSAL+COST_OF_INTERSECTION*(nboth+
+				ISA*(SplitBoxSurfaceArea(boxdim,axis,trial_value-MinBound[axis])*nleft+
+					 SplitBoxSurfaceArea(boxdim,axis,MaxBound[axis]-trial_value)*nright));
+			if (cost<best_cost)
+			{
+				best_cost=cost;
+				split_plane=axis;
+				split_value=trial_value;
+			}
+		}
+
+		// also try cutting off the empty space on either side
+		if (max_coord<MaxBound[axis])
+		{
+			float cost=COST_OF_TRAVERSAL+COST_OF_INTERSECTION*
+				ISA*SplitBoxSurfaceArea(boxdim,axis,max_coord-MinBound[axis])*ntris;
+			if (cost<best_cost)
+			{
+				best_cost=cost;
+				split_plane=axis;
+				split_value=max_coord;
+			}
+		}
+		if (min_coord>MinBound[axis])
+		{
+			float cost=COST_OF_TRAVERSAL+COST_OF_INTERSECTION*
+				ISA*SplitBoxSurfaceArea(boxdim,axis,MaxBound[axis]-min_coord)*ntris;
+			if (cost<best_cost)
+			{
+				best_cost=cost;
+				split_plane=axis;
+				split_value=min_coord;
+			}
 		}
-		switch(tri.ClassifyAgainstAxisSplit(split_plane,split_value))
+	}
+	return best_cost;
+}
+
+
+void CKDTreeBuilder::MakeLeaf(CUtlVector<CacheOptimizedKDNode> &nodes,CUtlVector<int32> &triangle_index_list,
+							  int node_number,int32 const *tri_list,int ntris,
+							  Vector const &MinBound,Vector const &MaxBound)
+{
+	nodes[node_number].Children=KDNODE_STATE_LEAF+(triangle_index_list.Count()<<2);
+	nodes[node_number].SetNumberOfTrianglesInLeafNode(ntris);
+#ifdef DEBUG_RAYTRACE
+	nodes[node_number].vecMins = MinBound;
+	nodes[node_number].vecMaxs = MaxBound;
+#endif
+	triangle_index_list.AddMultipleToTail(ntris,tri_list);
+}
+
+
+#define NEVER_SPLIT 0
+
+void CKDTreeBuilder::RefineNode(CUtlVector<CacheOptimizedKDNode> &nodes,CUtlVector<int32> &triangle_index_list,
+								int node_number,int32 const *tri_list,int ntris,
+								Vector MinBound,Vector MaxBound,int depth,bool bCanMakeTasks)
+{
+	if (ntris<3)											// never split empty lists
+	{
+		// no point in continuing
+		MakeLeaf(nodes,triangle_index_list,node_number,tri_list,ntris,MinBound,MaxBound);
+		return;
+	}
+
+	if (bCanMakeTasks && (ntris<m_nMinTrisPerTask))
+	{
+		// small enough to hand to a worker thread
+		KDBuildTask_t *task=new KDBuildTask_t;
+		task->m_nNode=node_number;
+		task->m_MinBound=MinBound;
+		task->m_MaxBound=MaxBound;
+		task->m_nDepth=depth;
+		task->m_TriList.CopyArray(tri_list,ntris);
+		m_Tasks.AddToTail(task);
+		return;
+	}
+
+	int split_plane=0;
+	float split_value=0;
+	float best_cost=CalculateBestSplit(tri_list,ntris,MinBound,MaxBound,split_plane,split_value);
+	float cost_of_no_split=COST_OF_INTERSECTION*ntris;
+	if ( (cost_of_no_split<=best_cost) || NEVER_SPLIT || (depth>MAX_TREE_DEPTH))
+	{
+		// no benefit to splitting. just make this a leaf node
+		MakeLeaf(nodes,triangle_index_list,node_number,tri_list,ntris,MinBound,MaxBound);
+		return;
+	}
+
+	// the bins only estimate the counts. classify for real, and make sure it still pays to split.
+	// we will achieve the splitting without sorting by using a selection algorithm.
+	int32 *new_triangle_list=new int32[ntris];
+	int nleft=0,nright=0,nboth=0;
+	for(int t=0;t<ntris;t++)
+	{
+		switch(m_pEnv->OptimizedTriangleList[tri_list[t]].ClassifyAgainstAxisSplit(split_plane,split_value))
 		{
 			case PLANECHECK_NEGATIVE:
 				nleft++;
-				tri.m_Data.m_GeometryData.m_nTmpData0 = PLANECHECK_NEGATIVE;
 				break;
-
 			case PLANECHECK_POSITIVE:
 				nright++;
-				tri.m_Data.m_GeometryData.m_nTmpData0 = PLANECHECK_POSITIVE;
 				break;
+		}
+	}
+	nboth=ntris-nleft-nright;
+
+	Vector boxdim=MaxBound-MinBound;
+	float exact_cost=COST_OF_TRAVERSAL+COST_OF_INTERSECTION*(nboth+
+		(SplitBoxSurfaceArea(boxdim,split_plane,split_value-MinBound[split_plane])*nleft+
+		 SplitBoxSurfaceArea(boxdim,split_plane,MaxBound[split_plane]-split_value)*nright)/
+		BoxSurfaceArea(MinBound,MaxBound));
+	if (cost_of_no_split<=exact_cost)
+	{
+		delete[] new_triangle_list;
+		MakeLeaf(nodes,triangle_index_list,node_number,tri_list,ntris,MinBound,MaxBound);
+		return;
+	}
 
+	int n_left_output=0;
+	int n_both_output=0;
+	int n_right_output=0;
+	for(int t=0;t<ntris;t++)
+	{
+		switch(m_pEnv->OptimizedTriangleList[tri_list[t]].ClassifyAgainstAxisSplit(split_plane,split_value))
+		{
+			case PLANECHECK_NEGATIVE:
+				new_triangle_list[n_left_output++]=tri_list[t];
+				break;
+			case PLANECHECK_POSITIVE:
+				n_right_output++;
+				new_triangle_list[ntris-n_right_output]=tri_list[t];
+				break;
 			case PLANECHECK_STRADDLING:
-				nboth++;
-				tri.m_Data.m_GeometryData.m_nTmpData0 = PLANECHECK_STRADDLING;
+				new_triangle_list[nleft+n_both_output]=tri_list[t];
+				n_both_output++;
 				break;
 		}
 	}
-	// now, if the split resulted in one half being empty, "grow" the empty half
-	if (nleft && (nboth==0) && (nright==0))
-		split_value=max_coord;
-	if (nright && (nboth==0) && (nleft==0))
-		split_value=min_coord;
 
-	// now, perform surface area/cost check to determine whether this split was worth it
 	Vector LeftMins=MinBound;
 	Vector LeftMaxes=MaxBound;
 	Vector RightMins=MinBound;
 	Vector RightMaxes=MaxBound;
 	LeftMaxes[split_plane]=split_value;
 	RightMins[split_plane]=split_value;
-	float SA_L=BoxSurfaceArea(LeftMins,LeftMaxes);
-	float SA_R=BoxSurfaceArea(RightMins,RightMaxes);
-	float ISA=1.0/BoxSurfaceArea(MinBound,MaxBound);
-	float cost_of_split=COST_OF_TRAVERSAL+COST_OF_INTERSECTION*(nboth+
-		(SA_L*ISA*(nleft))+(SA_R*ISA*(nright)));
-	return cost_of_split;
+
+	int left_child=nodes.Count();
+	int right_child=left_child+1;
+	CacheOptimizedKDNode newnode;
+	nodes.AddToTail(newnode);
+	nodes.AddToTail(newnode);
+	nodes[node_number].Children=split_plane+(left_child<<2);
+	nodes[node_number].SplittingPlaneValue=split_value;
+#ifdef DEBUG_RAYTRACE
+	nodes[node_number].vecMins = MinBound;
+	nodes[node_number].vecMaxs = MaxBound;
+#endif
+
+	// now, recurse!
+	if ( (ntris<20) && ((nleft==0) || (nright==0)) )
+		depth+=100;
+	RefineNode(nodes,triangle_index_list,left_child,new_triangle_list,nleft+nboth,
+			   LeftMins,LeftMaxes,depth+1,bCanMakeTasks);
+	RefineNode(nodes,triangle_index_list,right_child,new_triangle_list+nleft,nright+nboth,
+			   RightMins,RightMaxes,depth+1,bCanMakeTasks);
+	delete[] new_triangle_list;
 }
 
 
-#define NEVER_SPLIT 0
+uintp CKDTreeBuilder::BuildTasksThread( void *pParam )
+{
+	( (CKDTreeBuilder *)pParam )->BuildTasks();
+	return 0;
+}
 
-void RayTracingEnvironment::RefineNode(int node_number,int32 const *tri_list,int ntris,
-									   Vector MinBound,Vector MaxBound, int depth)
+void CKDTreeBuilder::BuildTasks(void)
 {
-	if (ntris<3)											// never split empty lists
+	for(;;)
 	{
-		// no point in continuing
-		OptimizedKDTree[node_number].Children=KDNODE_STATE_LEAF+(TriangleIndexList.Count()<<2);
-		OptimizedKDTree[node_number].SetNumberOfTrianglesInLeafNode(ntris);
+		int nTask=ThreadInterlockedIncrement(&m_nNextTask)-1;
+		if (nTask>=m_TaskQueue.Count())
+			return;
 
-#ifdef DEBUG_RAYTRACE
-		OptimizedKDTree[node_number].vecMins = MinBound;
-		OptimizedKDTree[node_number].vecMaxs = MaxBound;
-#endif
+		KDBuildTask_t *task=m_TaskQueue[nTask];
+		CacheOptimizedKDNode root;
+		task->m_Nodes.AddToTail(root);
+		RefineNode(task->m_Nodes,task->m_TriangleIndexList,0,task->m_TriList.Base(),task->m_TriList.Count(),
+				   task->m_MinBound,task->m_MaxBound,task->m_nDepth,false);
+	}
+}
 
-		for(int t=0;t<ntris;t++)
-			TriangleIndexList.AddToTail(tri_list[t]);
+static int __cdecl TaskSizeCompare( KDBuildTask_t * const *a, KDBuildTask_t * const *b )
+{
+	// largest first, tree order between equal sizes
+	int nDiff=(*b)->m_TriList.Count()-(*a)->m_TriList.Count();
+	if (nDiff)
+		return nDiff;
+	return (*a)->m_nNode-(*b)->m_nNode;
+}
+
+void CKDTreeBuilder::MergeTask(KDBuildTask_t const &task)
+{
+	// node i>0 of the subtree goes to node_base+i, its root goes in the slot its parent reserved
+	CUtlVector<CacheOptimizedKDNode> &tree=m_pEnv->OptimizedKDTree;
+	int node_base=tree.Count()-1;
+	int tri_base=m_pEnv->TriangleIndexList.Count();
+	for(int i=0;i<task.m_Nodes.Count();i++)
+	{
+		CacheOptimizedKDNode node=task.m_Nodes[i];
+		if (node.NodeType()==KDNODE_STATE_LEAF)
+			node.Children=KDNODE_STATE_LEAF+((node.TriangleIndexStart()+tri_base)<<2);
+		else
+			node.Children=node.NodeType()+((node.LeftChild()+node_base)<<2);
+		if (i==0)
+			tree[task.m_nNode]=node;
+		else
+			tree.AddToTail(node);
+	}
+	m_pEnv->TriangleIndexList.AddMultipleToTail(task.m_TriangleIndexList.Count(),task.m_TriangleIndexList.Base());
+}
+
+void CKDTreeBuilder::Build(void)
+{
+	int ntris=m_pEnv->OptimizedTriangleList.Count();
+	CalculateTriBounds(m_pEnv,m_TriBounds);
+
+	int nthreads=MAX(1,(int)GetCPUInformation().m_nLogicalProcessors);
+	m_nMinTrisPerTask=MAX(KD_MIN_TRIS_PER_TASK,ntris/(nthreads*8));
+
+	CacheOptimizedKDNode root;
+	m_pEnv->OptimizedKDTree.AddToTail(root);
+	int32 *root_triangle_list=new int32[ntris];
+	for(int t=0;t<ntris;t++)
+		root_triangle_list[t]=t;
+	m_pEnv->CalculateTriangleListBounds(root_triangle_list,ntris,m_pEnv->m_MinBound,m_pEnv->m_MaxBound);
+	RefineNode(m_pEnv->OptimizedKDTree,m_pEnv->TriangleIndexList,0,root_triangle_list,ntris,
+			   m_pEnv->m_MinBound,m_pEnv->m_MaxBound,0,nthreads>1);
+	delete[] root_triangle_list;
+
+	if (!m_Tasks.Count())
 		return;
+
+	// build the biggest subtrees first so no thread is left with a big one at the end
+	m_TaskQueue.CopyArray(m_Tasks.Base(),m_Tasks.Count());
+	m_TaskQueue.Sort(TaskSizeCompare);
+	m_nNextTask=0;
+
+	int nworkers=MIN(nthreads,m_Tasks.Count())-1;
+	CUtlVector<ThreadHandle_t> threads;
+	for(int i=0;i<nworkers;i++)
+		threads.AddToTail(CreateSimpleThread(BuildTasksThread,this));
+	BuildTasks();
+	for(int i=0;i<threads.Count();i++)
+	{
+		ThreadJoin(threads[i]);
+		ReleaseThreadHandle(threads[i]);
 	}
 
-	float best_cost=1.0e23;
-	int best_nleft=0,best_nright=0,best_nboth=0;
-	float best_splitvalue=0;
-	int split_plane=0;
+	for(int i=0;i<m_Tasks.Count();i++)
+	{
+		MergeTask(*m_Tasks[i]);
+		delete m_Tasks[i];
+	}
+	m_Tasks.Purge();
+}
+
+void RayTracingEnvironment::BuildKDTree(void)
+{
+	CKDTreeBuilder builder(this);
+	builder.Build();
+}
+
 
-	int tri_skip=1+(ntris/10);								// don't try all trinagles as split
-															// points when there are a lot of them
+#define BVH_SAH_BINS 16
+#define BVH_MAX_LEAF_TRIS 4
+#define BVH_MAX_DEPTH ( MAX_BVH_STACK_LEN - 4 )
+
+// orders triangle indices by their centroid along one axis
+struct BVHCentroidLess_t
+{
+	CUtlVector<TriBounds_t> const *m_pTriBounds;
+	int m_nAxis;
+
+	bool operator()(int32 a,int32 b) const
+	{
+		TriBounds_t const &ta=(*m_pTriBounds)[a];
+		TriBounds_t const &tb=(*m_pTriBounds)[b];
+		return ( ta.m_flMins[m_nAxis]+ta.m_flMaxs[m_nAxis] )<( tb.m_flMins[m_nAxis]+tb.m_flMaxs[m_nAxis] );
+	}
+};
+
+// recursively builds the bvh over TriangleIndexList[first..first+ntris), reordering it in place
+static void RefineBVHNode(RayTracingEnvironment *pEnv,CUtlVector<TriBounds_t> const &tri_bounds,
+						  int node_number,int first,int ntris,int depth)
+{
+	int32 *tri_list=pEnv->TriangleIndexList.Base()+first;
+
+	// node bounds, and bounds of the triangle centroids to bin over
+	Vector MinBound(1.0e23,1.0e23,1.0e23), MaxBound(-1.0e23,-1.0e23,-1.0e23);
+	Vector CMin=MinBound, CMax=MaxBound;
+	for(int t=0;t<ntris;t++)
+	{
+		TriBounds_t const &b=tri_bounds[tri_list[t]];
+		for(int c=0;c<3;c++)
+		{
+			MinBound[c]=MIN(MinBound[c],b.m_flMins[c]);
+			MaxBound[c]=MAX(MaxBound[c],b.m_flMaxs[c]);
+			float centroid=0.5*(b.m_flMins[c]+b.m_flMaxs[c]);
+			CMin[c]=MIN(CMin[c],centroid);
+			CMax[c]=MAX(CMax[c],centroid);
+		}
+	}
+
+	CacheOptimizedBVHNode &node=pEnv->OptimizedBVH[node_number];
+	for(int c=0;c<3;c++)
+	{
+		node.m_flMins[c]=MinBound[c];
+		node.m_flMaxs[c]=MaxBound[c];
+	}
+	node.m_nChildOrFirstTri=first;
+	node.m_nTrianglesOrAxis=ntris;
+	if ( (ntris<=BVH_MAX_LEAF_TRIS) || (depth>=BVH_MAX_DEPTH) )
+		return;
+
+	// find the cheapest split of the centroid bins
+	float best_cost=COST_OF_INTERSECTION*ntris;
+	int best_axis=-1;
+	int best_bin=0;
+	float SA=BoxSurfaceArea(MinBound,MaxBound);
 	for(int axis=0;axis<3;axis++)
 	{
-		for(int ts=-1;ts<ntris;ts+=tri_skip)
+		float extent=CMax[axis]-CMin[axis];
+		if ( (extent<=0) || (SA<=0) )
+			continue;
+		float scale=BVH_SAH_BINS*0.9999f/extent;
+
+		int bin_count[BVH_SAH_BINS];
+		Vector bin_min[BVH_SAH_BINS],bin_max[BVH_SAH_BINS];
+		for(int b=0;b<BVH_SAH_BINS;b++)
+		{
+			bin_count[b]=0;
+			bin_min[b].Init(1.0e23,1.0e23,1.0e23);
+			bin_max[b].Init(-1.0e23,-1.0e23,-1.0e23);
+		}
+		for(int t=0;t<ntris;t++)
 		{
-			for(int tv=0;tv<3;tv++)
+			TriBounds_t const &tb=tri_bounds[tri_list[t]];
+			float centroid=0.5*(tb.m_flMins[axis]+tb.m_flMaxs[axis]);
+			int b=clamp((int) ((centroid-CMin[axis])*scale),0,BVH_SAH_BINS-1);
+			bin_count[b]++;
+			for(int c=0;c<3;c++)
 			{
-				int trial_nleft,trial_nright,trial_nboth;
-				float trial_splitvalue;
-				if (ts==-1)
-					trial_splitvalue=0.5*(MinBound[axis]+MaxBound[axis]);
-				else
-				{
-					// else, split at the triangle vertex if possible
-					CacheOptimizedTriangle &tri=OptimizedTriangleList[tri_list[ts]];
-					trial_splitvalue = tri.Vertex(tv)[axis];
-					if ((trial_splitvalue>MaxBound[axis]) || (trial_splitvalue<MinBound[axis]))
-						continue;							// don't try this vertex - not inside
-					
-				}
-//				printf("ts=%d tv=%d tp=%f\n",ts,tv,trial_splitvalue);
-				float trial_cost=
-					CalculateCostsOfSplit(axis,tri_list,ntris,MinBound,MaxBound,trial_splitvalue,
-										  trial_nleft,trial_nright, trial_nboth);
-// 				printf("try %d cost=%f nl=%d nr=%d nb=%d sp=%f\n",axis,trial_cost,trial_nleft,trial_nright, trial_nboth,
-// 					   trial_splitvalue);
-				if (trial_cost<best_cost)
-				{
-					split_plane=axis;
-					best_cost=trial_cost;
-					best_nleft=trial_nleft;
-					best_nright=trial_nright;
-					best_nboth=trial_nboth;
-					best_splitvalue=trial_splitvalue;
-					// save away the axis classification of each triangle
-					for(int t=0 ; t < ntris; t++)
-					{
-						CacheOptimizedTriangle &tri=OptimizedTriangleList[tri_list[t]];
-						tri.m_Data.m_GeometryData.m_nTmpData1 = tri.m_Data.m_GeometryData.m_nTmpData0;
-					}
-				}
-				if (ts==-1)
-					break;
+				bin_min[b][c]=MIN(bin_min[b][c],tb.m_flMins[c]);
+				bin_max[b][c]=MAX(bin_max[b][c],tb.m_flMaxs[c]);
 			}
 		}
 
+		// sweep from the right to get the area and count right of every plane, then from the left
+		float right_area[BVH_SAH_BINS];
+		int right_count[BVH_SAH_BINS];
+		Vector rmin=bin_min[BVH_SAH_BINS-1],rmax=bin_max[BVH_SAH_BINS-1];
+		int rcount=0;
+		for(int b=BVH_SAH_BINS-1;b>0;b--)
+		{
+			rcount+=bin_count[b];
+			rmin=rmin.Min(bin_min[b]);
+			rmax=rmax.Max(bin_max[b]);
+			right_count[b]=rcount;
+			right_area[b]=rcount?BoxSurfaceArea(rmin,rmax):0;
+		}
+		Vector lmin=bin_min[0],lmax=bin_max[0];
+		int lcount=0;
+		for(int b=1;b<BVH_SAH_BINS;b++)
+		{
+			lcount+=bin_count[b-1];
+			lmin=lmin.Min(bin_min[b-1]);
+			lmax=lmax.Max(bin_max[b-1]);
+			if ( (!lcount) || (!right_count[b]) )
+				continue;
+			float cost=COST_OF_TRAVERSAL+COST_OF_INTERSECTION*
+				(BoxSurfaceArea(lmin,lmax)*lcount+right_area[b]*right_count[b])/SA;
+			if (cost<best_cost)
+			{
+				best_cost=cost;
+				best_axis=axis;
+				best_bin=b;
+			}
+		}
 	}
-	float cost_of_no_split=COST_OF_INTERSECTION*ntris;
-	if ( (cost_of_no_split<=best_cost) || NEVER_SPLIT || (depth>MAX_TREE_DEPTH))
+
+	int nleft;
+	if (best_axis!=-1)
 	{
-		// no benefit to splitting. just make this a leaf node
-		OptimizedKDTree[node_number].Children=KDNODE_STATE_LEAF+(TriangleIndexList.Count()<<2);
-		OptimizedKDTree[node_number].SetNumberOfTrianglesInLeafNode(ntris);
-#ifdef DEBUG_RAYTRACE
-		OptimizedKDTree[node_number].vecMins = MinBound;
-		OptimizedKDTree[node_number].vecMaxs = MaxBound;
-#endif
-		for(int t=0;t<ntris;t++)
-			TriangleIndexList.AddToTail(tri_list[t]);
+		// partition the triangle list around the winning plane
+		float scale=BVH_SAH_BINS*0.9999f/(CMax[best_axis]-CMin[best_axis]);
+		int i=0,j=ntris-1;
+		while(i<=j)
+		{
+			TriBounds_t const &tb=tri_bounds[tri_list[i]];
+			float centroid=0.5*(tb.m_flMins[best_axis]+tb.m_flMaxs[best_axis]);
+			if (clamp((int) ((centroid-CMin[best_axis])*scale),0,BVH_SAH_BINS-1)<best_bin)
+				i++;
+			else
+				V_swap(tri_list[i],tri_list[j--]);
+		}
+		nleft=i;
 	}
 	else
 	{
-// 		printf("best split was %d at %f (mid=%f,n=%d, sk=%d)\n",split_plane,best_splitvalue,
-// 			   0.5*(MinBound[split_plane]+MaxBound[split_plane]),ntris,tri_skip);
-		// its worth splitting!
-		// we will achieve the splitting without sorting by using a selection algorithm.
-		int32 *new_triangle_list;
-		new_triangle_list=new int32[ntris];
-
-		// now, perform surface area/cost check to determine whether this split was worth it
-		Vector LeftMins=MinBound;
-		Vector LeftMaxes=MaxBound;
-		Vector RightMins=MinBound;
-		Vector RightMaxes=MaxBound;
-		LeftMaxes[split_plane]=best_splitvalue;
-		RightMins[split_plane]=best_splitvalue;
-		
-		int n_left_output=0;
-		int n_both_output=0;
-		int n_right_output=0;
-		for(int t=0;t<ntris;t++)
+		// not worth splitting by cost. leafs that are too big are split at the median centroid
+		// along the widest axis anyway
+		if (ntris<=4*BVH_MAX_LEAF_TRIS)
+			return;
+		Vector cdim=CMax-CMin;
+		best_axis=(cdim.x>=cdim.y)?((cdim.x>=cdim.z)?0:2):((cdim.y>=cdim.z)?1:2);
+		nleft=ntris/2;
+		BVHCentroidLess_t less={&tri_bounds,best_axis};
+		std::nth_element(tri_list,tri_list+nleft,tri_list+ntris,less);
+	}
+
+	int left_child=pEnv->OptimizedBVH.Count();
+	CacheOptimizedBVHNode newnode;
+	pEnv->OptimizedBVH.AddToTail(newnode);
+	pEnv->OptimizedBVH.AddToTail(newnode);
+	pEnv->OptimizedBVH[node_number].m_nChildOrFirstTri=left_child;
+	pEnv->OptimizedBVH[node_number].m_nTrianglesOrAxis=-1-best_axis;
+	RefineBVHNode(pEnv,tri_bounds,left_child,first,nleft,depth+1);
+	RefineBVHNode(pEnv,tri_bounds,left_child+1,first+nleft,ntris-nleft,depth+1);
+}
+
+void RayTracingEnvironment::BuildBVH(void)
+{
+	int ntris=OptimizedTriangleList.Count();
+	CUtlVector<TriBounds_t> tri_bounds;
+	CalculateTriBounds(this,tri_bounds);
+
+	TriangleIndexList.SetCount(ntris);
+	for(int t=0;t<ntris;t++)
+		TriangleIndexList[t]=t;
+	CalculateTriangleListBounds(TriangleIndexList.Base(),ntris,m_MinBound,m_MaxBound);
+
+	CacheOptimizedBVHNode root;
+	OptimizedBVH.AddToTail(root);
+	RefineBVHNode(this,tri_bounds,0,0,ntris,0);
+}
+
+
+// cached acceleration structures start with this header, followed by the nodes and then the
+// triangle index list.
+#define RT_CACHE_MAGIC ( ( 'C' << 24 ) | ( 'T' << 16 ) | ( 'R' << 8 ) | 'V' )
+#define RT_CACHE_VERSION 2								// 2: median splits partition the triangles
+
+struct RayTraceCacheHeader_t
+{
+	uint32 m_nMagic;
+	uint32 m_nVersion;
+	uint32 m_nGeometryHash;
+	int32 m_nTriangles;
+	int32 m_bBVH;
+	int32 m_nNodeSize;										// changes with DEBUG_RAYTRACE
+	int32 m_nNodes;
+	int32 m_nTriangleIndices;
+	float m_MinBound[3];
+	float m_MaxBound[3];
+};
+
+// the traversal trusts the node and triangle indices, so check them before using a cache file:
+// children in range and after their parent (so there are no loops), every node reached once,
+// interior nodes shallow enough for the traversal stack, and leaves inside TriangleIndexList
+static bool IsCachedBVHValid(CUtlVector<CacheOptimizedBVHNode> const &nodes,
+							 CUtlVector<int32> const &tri_index_list,int ntris)
+{
+	CUtlVector<int> depth;
+	depth.SetCount(nodes.Count());
+	for(int n=0;n<nodes.Count();n++)
+		depth[n]=n ? -1 : 0;
+
+	for(int n=0;n<nodes.Count();n++)
+	{
+		CacheOptimizedBVHNode const &node=nodes[n];
+		if (depth[n]<0)
+			return false;
+		if (node.IsLeaf())
 		{
-			CacheOptimizedTriangle &tri=OptimizedTriangleList[tri_list[t]];
-			switch( tri.m_Data.m_GeometryData.m_nTmpData1 )
-			{
-				case PLANECHECK_NEGATIVE:
-//					printf("%d goes left\n",t);
-					new_triangle_list[n_left_output++]=tri_list[t];
-					break;
-				case PLANECHECK_POSITIVE:
-					n_right_output++;
-//					printf("%d goes right\n",t);
-					new_triangle_list[ntris-n_right_output]=tri_list[t];
-					break;
-				case PLANECHECK_STRADDLING:
-//					printf("%d goes both\n",t);
-					new_triangle_list[best_nleft+n_both_output]=tri_list[t];
-					n_both_output++;
-					break;
-
-					
-			}
+			if ( (node.m_nChildOrFirstTri<0) ||
+				 (node.m_nTrianglesOrAxis>tri_index_list.Count()-node.m_nChildOrFirstTri) )
+				return false;
 		}
-		int left_child=OptimizedKDTree.Count();
-		int right_child=left_child+1;
-// 		printf("node %d split on axis %d at %f, nl=%d nr=%d nb=%d lc=%d rc=%d\n",node_number,
-// 			   split_plane,best_splitvalue,best_nleft,best_nright,best_nboth,
-// 			   left_child,right_child);
-		OptimizedKDTree[node_number].Children=split_plane+(left_child<<2);
-		OptimizedKDTree[node_number].SplittingPlaneValue=best_splitvalue;
-#ifdef DEBUG_RAYTRACE
-		OptimizedKDTree[node_number].vecMins = MinBound;
-		OptimizedKDTree[node_number].vecMaxs = MaxBound;
-#endif
-		CacheOptimizedKDNode newnode;
-		OptimizedKDTree.AddToTail(newnode);
-		OptimizedKDTree.AddToTail(newnode);
-		// now, recurse!
-		if ( (ntris<20) && ((best_nleft==0) || (best_nright==0)) )
-			depth+=100;
-		RefineNode(left_child,new_triangle_list,best_nleft+best_nboth,LeftMins,LeftMaxes,depth+1);
-		RefineNode(right_child,new_triangle_list+best_nleft,best_nright+best_nboth,
-				   RightMins,RightMaxes,depth+1);
-		delete[] new_triangle_list;
-	}	
+		else
+		{
+			int child=node.m_nChildOrFirstTri;
+			if ( (node.SplitAxis()>2) || (child<=n) || (child>nodes.Count()-2) ||
+				 (depth[n]>=BVH_MAX_DEPTH) || (depth[child]>=0) || (depth[child+1]>=0) )
+				return false;
+			depth[child]=depth[child+1]=depth[n]+1;
+		}
+	}
+
+	for(int i=0;i<tri_index_list.Count();i++)
+	{
+		if ( (tri_index_list[i]<0) || (tri_index_list[i]>=ntris) )
+			return false;
+	}
+	return true;
 }
 
+// the same checks for the kd-tree. The builder also puts children after their parent, and
+// Trace4Rays/Trace8RaysAVX push at most one node per level, so an interior node's depth has to
+// stay below MAX_NODE_STACK_LEN
+static bool IsCachedKDTreeValid(CUtlVector<CacheOptimizedKDNode> const &nodes,
+								CUtlVector<int32> const &tri_index_list,int ntris)
+{
+	CUtlVector<int> depth;
+	depth.SetCount(nodes.Count());
+	for(int n=0;n<nodes.Count();n++)
+		depth[n]=n ? -1 : 0;
+
+	for(int n=0;n<nodes.Count();n++)
+	{
+		CacheOptimizedKDNode const &node=nodes[n];
+		if (depth[n]<0)
+			return false;
+		if (node.NodeType()==KDNODE_STATE_LEAF)
+		{
+			int start=node.TriangleIndexStart();
+			int count=node.NumberOfTrianglesInLeaf();
+			if ( (count<0) || (count && ( (start<0) || (count>tri_index_list.Count()-start) ) ) )
+				return false;
+		}
+		else
+		{
+			int child=node.LeftChild();
+			if ( (child<=n) || (child>nodes.Count()-2) ||
+				 (depth[n]>=MAX_NODE_STACK_LEN) || (depth[child]>=0) || (depth[child+1]>=0) )
+				return false;
+			depth[child]=depth[child+1]=depth[n]+1;
+		}
+	}
+
+	for(int i=0;i<tri_index_list.Count();i++)
+	{
+		if ( (tri_index_list[i]<0) || (tri_index_list[i]>=ntris) )
+			return false;
+	}
+	return true;
+}
 
-void RayTracingEnvironment::SetupAccelerationStructure(void)
+uint32 RayTracingEnvironment::ComputeGeometryHash(void)
 {
-	CacheOptimizedKDNode root;
-	OptimizedKDTree.AddToTail(root);
-	int32 *root_triangle_list=new int32[OptimizedTriangleList.Count()];
+	CRC32_t crc;
+	CRC32_Init(&crc);
+	int32 header[2]={OptimizedTriangleList.Count(),( Flags & RTE_FLAGS_USE_BVH ) != 0};
+	CRC32_ProcessBuffer(&crc,header,sizeof(header));
 	for(int t=0;t<OptimizedTriangleList.Count();t++)
-		root_triangle_list[t]=t;
-	CalculateTriangleListBounds(root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,
-								m_MaxBound);
-	RefineNode(0,root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,m_MaxBound,0);
-	delete[] root_triangle_list;
+	{
+		TriGeometryData_t const &geom=OptimizedTriangleList[t].m_Data.m_GeometryData;
+		CRC32_ProcessBuffer(&crc,&geom.m_nTriangleID,sizeof(geom.m_nTriangleID));
+		CRC32_ProcessBuffer(&crc,geom.m_VertexCoordData,sizeof(geom.m_VertexCoordData));
+		CRC32_ProcessBuffer(&crc,&geom.m_nFlags,sizeof(geom.m_nFlags));
+	}
+	CRC32_Final(&crc);
+	return crc;
+}
+
+bool RayTracingEnvironment::LoadAccelerationStructure( const char *pFileName, uint32 nGeometryHash )
+{
+	FILE *fp=fopen(pFileName,"rb");
+	if (!fp)
+		return false;
+
+	bool bBVH=( Flags & RTE_FLAGS_USE_BVH ) != 0;
+	RayTraceCacheHeader_t header;
+	bool bOk=( fread(&header,sizeof(header),1,fp)==1 ) &&
+		( header.m_nMagic==RT_CACHE_MAGIC ) &&
+		( header.m_nVersion==RT_CACHE_VERSION ) &&
+		( header.m_nGeometryHash==nGeometryHash ) &&
+		( header.m_nTriangles==OptimizedTriangleList.Count() ) &&
+		( header.m_bBVH==(int32)bBVH ) &&
+		( header.m_nNodeSize==(int32)( bBVH ? sizeof(CacheOptimizedBVHNode) : sizeof(CacheOptimizedKDNode) ) ) &&
+		( header.m_nNodes>0 ) && ( header.m_nTriangleIndices>=0 );
+
+	if (bOk)
+	{
+		void *pNodes;
+		if (bBVH)
+		{
+			OptimizedBVH.SetCount(header.m_nNodes);
+			pNodes=OptimizedBVH.Base();
+		}
+		else
+		{
+			OptimizedKDTree.SetCount(header.m_nNodes);
+			pNodes=OptimizedKDTree.Base();
+		}
+		TriangleIndexList.SetCount(header.m_nTriangleIndices);
+		bOk=( fread(pNodes,header.m_nNodeSize,header.m_nNodes,fp)==(size_t)header.m_nNodes ) &&
+			( fread(TriangleIndexList.Base(),sizeof(int32),header.m_nTriangleIndices,fp)==(size_t)header.m_nTriangleIndices );
+	}
+	fclose(fp);
+
+	if ( bOk && ( bBVH ? !IsCachedBVHValid(OptimizedBVH,TriangleIndexList,OptimizedTriangleList.Count()) :
+				  !IsCachedKDTreeValid(OptimizedKDTree,TriangleIndexList,OptimizedTriangleList.Count()) ) )
+	{
+		Warning("Ray trace cache %s is corrupt, rebuilding it\n",pFileName);
+		bOk=false;
+	}
+
+	if (!bOk)
+	{
+		OptimizedKDTree.Purge();
+		OptimizedBVH.Purge();
+		TriangleIndexList.Purge();
+		return false;
+	}
+
+	m_MinBound.Init(header.m_MinBound[0],header.m_MinBound[1],header.m_MinBound[2]);
+	m_MaxBound.Init(header.m_MaxBound[0],header.m_MaxBound[1],header.m_MaxBound[2]);
+	return true;
+}
+
+void RayTracingEnvironment::SaveAccelerationStructure( const char *pFileName, uint32 nGeometryHash )
+{
+	FILE *fp=fopen(pFileName,"wb");
+	if (!fp)
+	{
+		Warning("Unable to write ray trace cache %s\n",pFileName);
+		return;
+	}
+
+	bool bBVH=( Flags & RTE_FLAGS_USE_BVH ) != 0;
+	RayTraceCacheHeader_t header;
+	header.m_nMagic=RT_CACHE_MAGIC;
+	header.m_nVersion=RT_CACHE_VERSION;
+	header.m_nGeometryHash=nGeometryHash;
+	header.m_nTriangles=OptimizedTriangleList.Count();
+	header.m_bBVH=bBVH;
+	header.m_nNodeSize=bBVH ? sizeof(CacheOptimizedBVHNode) : sizeof(CacheOptimizedKDNode);
+	header.m_nNodes=bBVH ? OptimizedBVH.Count() : OptimizedKDTree.Count();
+	header.m_nTriangleIndices=TriangleIndexList.Count();
+	for(int c=0;c<3;c++)
+	{
+		header.m_MinBound[c]=m_MinBound[c];
+		header.m_MaxBound[c]=m_MaxBound[c];
+	}
+
+	fwrite(&header,sizeof(header),1,fp);
+	if (bBVH)
+		fwrite(OptimizedBVH.Base(),sizeof(CacheOptimizedBVHNode),OptimizedBVH.Count(),fp);
+	else
+		fwrite(OptimizedKDTree.Base(),sizeof(CacheOptimizedKDNode),OptimizedKDTree.Count(),fp);
+	fwrite(TriangleIndexList.Base(),sizeof(int32),TriangleIndexList.Count(),fp);
+	fclose(fp);
+}
+
+
+void RayTracingEnvironment::SetupAccelerationStructure( const char *pCacheFileName )
+{
+	uint32 nGeometryHash=0;
+	bool bLoaded=false;
+	if (pCacheFileName)
+	{
+		nGeometryHash=ComputeGeometryHash();
+		bLoaded=LoadAccelerationStructure(pCacheFileName,nGeometryHash);
+	}
+
+	if (!bLoaded)
+	{
+		if (Flags & RTE_FLAGS_USE_BVH)
+			BuildBVH();
+		else
+			BuildKDTree();
+
+		if (pCacheFileName)
+			SaveAccelerationStructure(pCacheFileName,nGeometryHash);
+	}
 
 	// now, convert all triangles to "intersection format"
 	for(int i=0;i<OptimizedTriangleList.Count();i++)
@@ -0,0 +1,326 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+// $Id$
+
+// 8-wide version of RayTracingEnvironment::Trace4Rays. This file is built with AVX code
+// generation, so nothing in it may be called unless CheckAVXTechnology() says the cpu and OS
+// support it. RayTracingEnvironment::GetRayPacketWidth() takes care of that.
+
+#include "raytrace.h"
+#include <cmdlib.h>
+#include <tier1/processor_detect.h>
+
+#if COMPILER_SUPPORTS_AVX
+
+#if defined( __GNUC__ ) && !defined( __AVX__ )
+#pragma GCC target( "avx" )
+#endif
+
+#include <immintrin.h>
+
+typedef __m256 fltx8;
+
+bool RayTraceAVXKernelAvailable(void)
+{
+	return true;
+}
+
+extern int n_intersection_calculations;
+
+struct NodeToVisit8 {
+	CacheOptimizedKDNode const *node;
+	fltx8 TMin;
+	fltx8 TMax;
+};
+
+static FORCEINLINE fltx8 CombineX8( const fltx4 &lo, const fltx4 &hi )
+{
+	return _mm256_insertf128_ps( _mm256_castps128_ps256( lo ), hi, 1 );
+}
+
+static FORCEINLINE fltx4 LowX4( const fltx8 &a )
+{
+	return _mm256_castps256_ps128( a );
+}
+
+static FORCEINLINE fltx4 HighX4( const fltx8 &a )
+{
+	return _mm256_extractf128_ps( a, 1 );
+}
+
+static FORCEINLINE bool IsAnyNegative8( const fltx8 &a )
+{
+	return _mm256_movemask_ps( a ) != 0;
+}
+
+static FORCEINLINE fltx8 Select8( const fltx8 &old, const fltx8 &newval, const fltx8 &mask )
+{
+	return _mm256_blendv_ps( old, newval, mask );
+}
+
+static FORCEINLINE fltx8 ReplicateX8( float f )
+{
+	return _mm256_set1_ps( f );
+}
+
+void RayTracingEnvironment::Trace8RaysAVX(const EightRays &rays, fltx4 const TMin4[2], fltx4 const TMax4[2],
+										  int DirectionSignMask, RayTracingResult8 *rslt_out,
+										  int32 skip_id, ITransparentTriangleCallback **ppCallbacks)
+{
+	rays.Check();
+
+	// same constants as raytrace.cpp
+	const fltx8 Eight_Epsilons = ReplicateX8( 1.0e-10 );
+	const fltx8 Eight_NegativeEpsilons = ReplicateX8( -1.0e-10 );
+	const fltx8 Eight_Zeros = ReplicateX8( 1.0e-10 );
+	const fltx8 Eight_Ones = ReplicateX8( 1.0 );
+
+	fltx8 Org[3], Dir[3], OneOverRayDir[3];
+	for(int c=0;c<3;c++)
+	{
+		Org[c]=CombineX8( rays.m_Rays[0].origin[c], rays.m_Rays[1].origin[c] );
+		Dir[c]=CombineX8( rays.m_Rays[0].direction[c], rays.m_Rays[1].direction[c] );
+	}
+
+	// use the sse reciprocal so results match Trace4Rays bit for bit
+	for(int h=0;h<2;h++)
+	{
+		FourVectors inv=rays.m_Rays[h].direction;
+		inv.MakeReciprocalSaturate();
+		for(int c=0;c<3;c++)
+		{
+			OneOverRayDir[c]=( h==0 ) ? _mm256_castps128_ps256( inv[c] ) :
+				_mm256_insertf128_ps( OneOverRayDir[c], inv[c], 1 );
+		}
+	}
+
+	fltx8 HitDistance=ReplicateX8( 1.0e23 );
+	fltx8 HitIds=_mm256_castsi256_ps( _mm256_set1_epi32( -1 ) );
+	fltx8 NormalX=_mm256_setzero_ps();
+	fltx8 NormalY=_mm256_setzero_ps();
+	fltx8 NormalZ=_mm256_setzero_ps();
+
+	fltx8 TMin=CombineX8( TMin4[0], TMin4[1] );
+	fltx8 TMax=CombineX8( TMax4[0], TMax4[1] );
+
+	// now, clip rays against bounding box
+	for(int c=0;c<3;c++)
+	{
+		fltx8 isect_min_t=
+			_mm256_mul_ps( _mm256_sub_ps( ReplicateX8( m_MinBound[c] ), Org[c] ), OneOverRayDir[c] );
+		fltx8 isect_max_t=
+			_mm256_mul_ps( _mm256_sub_ps( ReplicateX8( m_MaxBound[c] ), Org[c] ), OneOverRayDir[c] );
+		TMin=_mm256_max_ps( TMin, _mm256_min_ps( isect_min_t, isect_max_t ) );
+		TMax=_mm256_min_ps( TMax, _mm256_max_ps( isect_min_t, isect_max_t ) );
+	}
+
+	fltx8 active=_mm256_cmp_ps( TMin, TMax, _CMP_LE_OS );			// mask of which rays are active
+	if ( IsAnyNegative8( active ) )
+	{
+		int32 mailboxids[MAILBOX_HASH_SIZE];					// used to avoid redundant triangle tests
+		memset(mailboxids,0xff,sizeof(mailboxids));
+
+		int front_idx[3],back_idx[3];							// based on ray direction, whether to
+																// visit left or right node first
+		for(int c=0;c<3;c++)
+		{
+			if ( DirectionSignMask & ( 1 << c ) )
+			{
+				back_idx[c]=0;
+				front_idx[c]=1;
+			}
+			else
+			{
+				back_idx[c]=1;
+				front_idx[c]=0;
+			}
+		}
+
+		NodeToVisit8 NodeQueue[MAX_NODE_STACK_LEN];
+		CacheOptimizedKDNode const *CurNode=&(OptimizedKDTree[0]);
+		NodeToVisit8 *stack_ptr=&NodeQueue[MAX_NODE_STACK_LEN];
+		while(1)
+		{
+			while (CurNode->NodeType() != KDNODE_STATE_LEAF)		// traverse until next leaf
+			{
+				int split_plane_number=CurNode->NodeType();
+				CacheOptimizedKDNode const *FrontChild=&(OptimizedKDTree[CurNode->LeftChild()]);
+
+				fltx8 dist_to_sep_plane=						// dist=(split-org)/dir
+					_mm256_mul_ps(
+						_mm256_sub_ps( ReplicateX8( CurNode->SplittingPlaneValue ),
+									   Org[split_plane_number] ), OneOverRayDir[split_plane_number] );
+				fltx8 active=_mm256_cmp_ps( TMin, TMax, _CMP_LE_OS );
+
+				fltx8 hits_front=_mm256_and_ps( active, _mm256_cmp_ps( dist_to_sep_plane, TMin, _CMP_GE_OS ) );
+				if (! IsAnyNegative8( hits_front ) )
+				{
+					// missed the front. only traverse back
+					CurNode=FrontChild+back_idx[split_plane_number];
+					TMin=_mm256_max_ps( TMin, dist_to_sep_plane );
+				}
+				else
+				{
+					fltx8 hits_back=_mm256_and_ps( active, _mm256_cmp_ps( dist_to_sep_plane, TMax, _CMP_LE_OS ) );
+					if (! IsAnyNegative8( hits_back ) )
+					{
+						// missed the back - only need to traverse front node
+						CurNode=FrontChild+front_idx[split_plane_number];
+						TMax=_mm256_min_ps( TMax, dist_to_sep_plane );
+					}
+					else
+					{
+						// at least some rays hit both nodes.
+						// must push far, traverse near
+						assert(stack_ptr>NodeQueue);
+						--stack_ptr;
+						stack_ptr->node=FrontChild+back_idx[split_plane_number];
+						stack_ptr->TMin=_mm256_max_ps( TMin, dist_to_sep_plane );
+						stack_ptr->TMax=TMax;
+						CurNode=FrontChild+front_idx[split_plane_number];
+						TMax=_mm256_min_ps( TMax, dist_to_sep_plane );
+					}
+				}
+			}
+			// hit a leaf! must do intersection check
+			int ntris=CurNode->NumberOfTrianglesInLeaf();
+			if (ntris)
+			{
+				int32 const *tlist=&(TriangleIndexList[CurNode->TriangleIndexStart()]);
+				do
+				{
+					int tnum=*(tlist++);
+					// check mailbox
+					int mbox_slot=tnum & (MAILBOX_HASH_SIZE-1);
+					TriIntersectData_t const *tri = &( OptimizedTriangleList[tnum].m_Data.m_IntersectData );
+					if ( ( mailboxids[mbox_slot] == tnum ) || ( tri->m_nTriangleID == skip_id ) )
+						continue;
+
+					n_intersection_calculations++;
+					mailboxids[mbox_slot] = tnum;
+
+					// compute plane intersection
+					fltx8 Nx = ReplicateX8( tri->m_flNx );
+					fltx8 Ny = ReplicateX8( tri->m_flNy );
+					fltx8 Nz = ReplicateX8( tri->m_flNz );
+
+					fltx8 DDotN = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( Dir[0], Nx ), _mm256_mul_ps( Dir[1], Ny ) ),
+												 _mm256_mul_ps( Dir[2], Nz ) );
+					// mask off zero or near zero (ray parallel to surface)
+					fltx8 did_hit = _mm256_or_ps( _mm256_cmp_ps( DDotN, Eight_Epsilons, _CMP_GT_OS ),
+												  _mm256_cmp_ps( DDotN, Eight_NegativeEpsilons, _CMP_LT_OS ) );
+
+					fltx8 ODotN = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( Org[0], Nx ), _mm256_mul_ps( Org[1], Ny ) ),
+												 _mm256_mul_ps( Org[2], Nz ) );
+					fltx8 isect_t = _mm256_div_ps( _mm256_sub_ps( ReplicateX8( tri->m_flD ), ODotN ), DDotN );
+
+					// now, we have the distance to the plane. lets update our mask
+					did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( isect_t, Eight_Zeros, _CMP_GT_OS ) );
+					did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( isect_t, HitDistance, _CMP_LT_OS ) );
+
+					if ( ! IsAnyNegative8( did_hit ) )
+						continue;
+
+					// now, check 3 edges
+					fltx8 hitc1 = _mm256_add_ps( Org[tri->m_nCoordSelect0],
+												 _mm256_mul_ps( isect_t, Dir[tri->m_nCoordSelect0] ) );
+					fltx8 hitc2 = _mm256_add_ps( Org[tri->m_nCoordSelect1],
+												 _mm256_mul_ps( isect_t, Dir[tri->m_nCoordSelect1] ) );
+
+					// do barycentric coordinate check
+					fltx8 B0 = _mm256_add_ps(
+						_mm256_add_ps( _mm256_mul_ps( ReplicateX8( tri->m_ProjectedEdgeEquations[0] ), hitc1 ),
+									   _mm256_mul_ps( ReplicateX8( tri->m_ProjectedEdgeEquations[1] ), hitc2 ) ),
+						ReplicateX8( tri->m_ProjectedEdgeEquations[2] ) );
+
+					did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( B0, Eight_Zeros, _CMP_GE_OS ) );
+
+					fltx8 B1 = _mm256_add_ps(
+						_mm256_add_ps( _mm256_mul_ps( ReplicateX8( tri->m_ProjectedEdgeEquations[3] ), hitc1 ),
+									   _mm256_mul_ps( ReplicateX8( tri->m_ProjectedEdgeEquations[4] ), hitc2 ) ),
+						ReplicateX8( tri->m_ProjectedEdgeEquations[5] ) );
+
+					did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( B1, Eight_Zeros, _CMP_GE_OS ) );
+
+					fltx8 B2 = _mm256_add_ps( B1, B0 );
+					did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( B2, Eight_Ones, _CMP_LE_OS ) );
+
+					if ( ! IsAnyNegative8( did_hit ) )
+						continue;
+
+					// if the triangle is transparent, let the callback for each half decide
+					if ( ( tri->m_nFlags & FCACHETRI_TRANSPARENT ) && ppCallbacks )
+					{
+						fltx8 b2 = _mm256_sub_ps( Eight_Ones, B2 );
+						fltx4 hit4[2] = { LowX4( did_hit ), HighX4( did_hit ) };
+						fltx4 b0_4[2] = { LowX4( B0 ), HighX4( B0 ) };
+						fltx4 b1_4[2] = { LowX4( B1 ), HighX4( B1 ) };
+						fltx4 b2_4[2] = { LowX4( b2 ), HighX4( b2 ) };
+						for(int h=0;h<2;h++)
+						{
+							if ( !ppCallbacks[h] || !IsAnyNegative( hit4[h] ) )
+								continue;
+							// same 1, 2, 0 order as Trace4Rays
+							if ( ppCallbacks[h]->VisitTriangle_ShouldContinue( *tri, rays.m_Rays[h], &hit4[h], &b1_4[h], &b2_4[h], &b0_4[h], tnum ) )
+							{
+								hit4[h] = Four_Zeros;
+							}
+						}
+						did_hit = CombineX8( hit4[0], hit4[1] );
+					}
+
+					// now, set the hit_id and closest_hit fields for any enabled rays
+					HitIds = Select8( HitIds, _mm256_castsi256_ps( _mm256_set1_epi32( tnum ) ), did_hit );
+					HitDistance = Select8( HitDistance, isect_t, did_hit );
+					NormalX = Select8( NormalX, Nx, did_hit );
+					NormalY = Select8( NormalY, Ny, did_hit );
+					NormalZ = Select8( NormalZ, Nz, did_hit );
+				} while (--ntris);
+
+				// now, check if all rays have terminated
+				fltx8 raydone=_mm256_cmp_ps( TMax, HitDistance, _CMP_LE_OS );
+				if (! IsAnyNegative8( raydone ) )
+					break;
+			}
+
+			if (stack_ptr==&NodeQueue[MAX_NODE_STACK_LEN])
+				break;
+
+			// pop stack!
+			CurNode=stack_ptr->node;
+			TMin=stack_ptr->TMin;
+			TMax=stack_ptr->TMax;
+			stack_ptr++;
+		}
+	}
+
+	// split the results back into the two halves
+	for(int h=0;h<2;h++)
+	{
+		RayTracingResult &rslt=rslt_out->m_Results[h];
+		StoreAlignedSIMD( (float *) rslt.HitIds, h ? HighX4( HitIds ) : LowX4( HitIds ) );
+		rslt.HitDistance = h ? HighX4( HitDistance ) : LowX4( HitDistance );
+		rslt.surface_normal.x = h ? HighX4( NormalX ) : LowX4( NormalX );
+		rslt.surface_normal.y = h ? HighX4( NormalY ) : LowX4( NormalY );
+		rslt.surface_normal.z = h ? HighX4( NormalZ ) : LowX4( NormalZ );
+	}
+
+	// avoid the avx->sse transition penalty in the caller
+	_mm256_zeroupper();
+}
+
+#else // !COMPILER_SUPPORTS_AVX
+
+bool RayTraceAVXKernelAvailable(void)
+{
+	return false;
+}
+
+void RayTracingEnvironment::Trace8RaysAVX(const EightRays &rays, fltx4 const TMin[2], fltx4 const TMax[2],
+										  int DirectionSignMask, RayTracingResult8 *rslt_out,
+										  int32 skip_id, ITransparentTriangleCallback **ppCallbacks)
+{
+	// only reachable if GetRayPacketWidth() is wrong
+	Error( "Trace8RaysAVX called, but this compiler can't build AVX code\n" );
+}
+
+#endif // COMPILER_SUPPORTS_AVX
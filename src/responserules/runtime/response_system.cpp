@@ -84,6 +84,8 @@ ConVar rr_debugresponses( "rr_debugresponses", "0", FCVAR_NONE, "Show verbose ma
 ConVar rr_debugrule( "rr_debugrule", "", FCVAR_NONE, "If set to the name of the rule, that rule's score will be shown whenever a concept is passed into the response rules system.");
 ConVar rr_dumpresponses( "rr_dumpresponses", "0", FCVAR_NONE, "Dump all response_rules.txt and rules (requires restart)" );
 ConVar rr_debugresponseconcept( "rr_debugresponseconcept", "", FCVAR_NONE, "If set, rr_debugresponses will print only responses testing for the specified concept" );
+ConVar rr_compiledrules( "rr_compiledrules", "1", FCVAR_NONE, "Match rules with the compiled matcher rather than scoring every rule criterion by criterion" );
+ConVar rr_recordcriteria( "rr_recordcriteria", "", FCVAR_NONE, "If set, every criteria set passed to the response rules system is appended to this file, for rr_benchmark_rules" );
 #define RR_DEBUGRESPONSES_SPECIALCASE 4
 
 
@@ -184,6 +186,8 @@ CResponseSystem::CResponseSystem() :
 	token[0] = 0;
 	m_bUnget = false;
 	m_bCustomManagable = false;
+	m_bRulesCompiled = false;
+	m_nCompiledQuery = 0;
 
 	BuildDispatchTables();
 }
@@ -241,6 +245,7 @@ void CResponseSystem::Clear()
 	m_Criteria.RemoveAll();
 	m_RulePartitions.RemoveAll();
 	m_Enumerations.RemoveAll();
+	InvalidateCompiledRules();
 }
 
 //-----------------------------------------------------------------------------
@@ -1127,6 +1132,33 @@ bool CResponseSystem::GetBestResponse( ResponseSearchResult& searchResult, Rule
 	return bret;
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Picks one of the rules that tied for the best score
+//-----------------------------------------------------------------------------
+static ResponseRulePartition::tIndex SelectFromTiedRules( const CUtlVector< ResponseRulePartition::tIndex > &bestrules, float bestscore, bool verbose, float &scoreOfBestMatchingRule )
+{
+	int bestCount = bestrules.Count();
+	if ( bestCount <= 0 )
+		return ResponseRulePartition::InvalidIdx();
+
+	scoreOfBestMatchingRule = bestscore ;
+	if ( bestCount == 1 )
+	{
+		return bestrules[ 0 ] ;
+	}
+	else
+	{
+		// Randomly pick one of the tied matching rules
+		int idx = IEngineEmulator::Get()->GetRandomStream()->RandomInt( 0, bestCount - 1 );
+		if ( verbose )
+		{
+			DevMsg( "Found %i matching rules, selecting slot %i\n", bestCount, idx );
+		}
+		return bestrules[ idx ] ;
+	}
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: 
 // Input  : set - 
@@ -1136,6 +1168,19 @@ bool CResponseSystem::GetBestResponse( ResponseSearchResult& searchResult, Rule
 //          ResponseSystemImplementationCLI::FindAllRulesMatchingCriteria().
 //-----------------------------------------------------------------------------
 ResponseRulePartition::tIndex CResponseSystem::FindBestMatchingRule( const CriteriaSet& set, bool verbose, float &scoreOfBestMatchingRule )
+{
+	// the compiled matcher can't explain itself, so verbose and rr_debugrule use the old path
+	const char *pszDebugRule = rr_debugrule.GetString();
+	if ( !rr_compiledrules.GetBool() || verbose || ( pszDebugRule && pszDebugRule[0] ) )
+		return FindBestMatchingRuleUncompiled( set, verbose, scoreOfBestMatchingRule );
+
+	return FindBestMatchingRuleCompiled( set, scoreOfBestMatchingRule );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Scores every rule in the set's buckets criterion by criterion
+//-----------------------------------------------------------------------------
+ResponseRulePartition::tIndex CResponseSystem::FindBestMatchingRuleUncompiled( const CriteriaSet& set, bool verbose, float &scoreOfBestMatchingRule )
 {
 	CUtlVector< ResponseRulePartition::tIndex >	bestrules(16,4);
 	float bestscore = 0.001f;
@@ -1167,24 +1212,483 @@ ResponseRulePartition::tIndex CResponseSystem::FindBestMatchingRule( const Crite
 		}
 	}
 
-	int bestCount = bestrules.Count();
-	if ( bestCount <= 0 )
-		return m_RulePartitions.InvalidIdx();
+	return SelectFromTiedRules( bestrules, bestscore, verbose, scoreOfBestMatchingRule );
+}
 
-	scoreOfBestMatchingRule = bestscore ;
-	if ( bestCount == 1 )
+//-----------------------------------------------------------------------------
+// Purpose: Flattens the criteria and rules for FindBestMatchingRuleCompiled
+//-----------------------------------------------------------------------------
+void CResponseSystem::CompileRules()
+{
+	int nCriteria = m_Criteria.MaxElement();
+	m_CompiledCriteria.SetCount( nCriteria );
+	m_CompiledResults.SetCount( nCriteria );
+	m_CompiledChildren.RemoveAll();
+	m_CompiledSlotForSymbol.RemoveAll();
+	m_CompiledSlots.RemoveAll();
+	m_CompiledRules.RemoveAll();
+	m_CompiledRuleCriteria.RemoveAll();
+	m_nCompiledQuery = 0;
+
+	for ( int i = 0; i < nCriteria; i++ )
 	{
-		return bestrules[ 0 ] ;
+		m_CompiledResults[ i ].query = 0;
+	}
+
+	for ( int i = m_Criteria.First(); i != m_Criteria.InvalidIndex(); i = m_Criteria.Next( i ) )
+	{
+		Criteria *c = &m_Criteria[ i ];
+		CompiledCriterion_t &cc = m_CompiledCriteria[ i ];
+		V_memset( &cc, 0, sizeof( cc ) );
+
+		cc.slot = -1;
+		cc.weight = c->weight.GetFloat();
+		cc.required = c->required;
+		cc.firstchild = m_CompiledChildren.Count();
+		cc.numchildren = c->subcriteria.Count();
+		for ( int k = 0; k < c->subcriteria.Count(); k++ )
+		{
+			m_CompiledChildren.AddToTail( c->subcriteria[ k ] );
+		}
+
+		if ( c->IsSubCriteriaType() )
+			continue;
+
+		// criteria with the same name share a slot, so the set is only searched once per name
+		UtlSymId_t sym = c->nameSym;
+		while ( m_CompiledSlotForSymbol.Count() <= sym )
+		{
+			m_CompiledSlotForSymbol.AddToTail( -1 );
+		}
+		if ( m_CompiledSlotForSymbol[ sym ] == -1 )
+		{
+			int slot = m_CompiledSlots.AddToTail();
+			m_CompiledSlots[ slot ].query = 0;
+			m_CompiledSlots[ slot ].parsedquery = 0;
+			m_CompiledSlotForSymbol[ sym ] = slot;
+		}
+		cc.slot = m_CompiledSlotForSymbol[ sym ];
+
+		Matcher &m = c->matcher;
+		cc.valid = m.valid;
+		cc.isnumeric = m.isnumeric;
+		cc.notequal = m.notequal;
+		cc.usemin = m.usemin;
+		cc.minequals = m.minequals;
+		cc.usemax = m.usemax;
+		cc.maxequals = m.maxequals;
+		cc.minval = m.minval;
+		cc.maxval = m.maxval;
+		if ( m.valid )
+		{
+			cc.token = m.GetToken();
+			cc.tokenval = (float)atof( cc.token );
+			cc.tokenhash = HashStringCaseless( cc.token );
+		}
+	}
+
+	// How many rules test each criterion. A criterion that few rules share is more likely
+	// to fail than one like "concept" that every rule in a bucket has, so it's tested first.
+	CUtlVector< int > uses;
+	uses.SetCount( nCriteria );
+	V_memset( uses.Base(), 0, nCriteria * sizeof( int ) );
+
+	for ( int i = 0; i < ResponseRulePartition::N_RESPONSE_PARTITIONS; i++ )
+	{
+		m_CompiledBucketStart[ i ] = -1;
+	}
+
+	for ( ResponseRulePartition::tIndex idx = m_RulePartitions.First(); m_RulePartitions.IsValid( idx ); idx = m_RulePartitions.Next( idx ) )
+	{
+		int bucket = m_RulePartitions.BucketFromIdx( idx );
+		if ( m_CompiledBucketStart[ bucket ] == -1 )
+		{
+			m_CompiledBucketStart[ bucket ] = m_CompiledRules.Count();
+		}
+		Assert( m_CompiledRules.Count() - m_CompiledBucketStart[ bucket ] == (int)m_RulePartitions.PartFromIdx( idx ) );
+
+		CompiledRule_t &cr = m_CompiledRules[ m_CompiledRules.AddToTail() ];
+		cr.rule = &m_RulePartitions[ idx ];
+		cr.numcriteria = cr.rule->m_Criteria.Count();
+		for ( int k = 0; k < cr.numcriteria; k++ )
+		{
+			uses[ cr.rule->m_Criteria[ k ] ]++;
+		}
+	}
+
+	for ( int r = 0; r < m_CompiledRules.Count(); r++ )
+	{
+		CompiledRule_t &cr = m_CompiledRules[ r ];
+		Rule *rule = cr.rule;
+		cr.firstcriterion = m_CompiledRuleCriteria.Count();
+		cr.numrequired = 0;
+
+		// required criteria, leaves before subcriteria, then the least shared first
+		for ( int k = 0; k < rule->m_Criteria.Count(); k++ )
+		{
+			unsigned short icriterion = rule->m_Criteria[ k ];
+			if ( !m_CompiledCriteria[ icriterion ].required )
+				continue;
+
+			int sortkey = uses[ icriterion ] + ( m_CompiledCriteria[ icriterion ].slot == -1 ? nCriteria : 0 );
+			int insert = cr.firstcriterion + cr.numrequired;
+			while ( insert > cr.firstcriterion )
+			{
+				unsigned short iprev = m_CompiledRuleCriteria[ insert - 1 ];
+				int prevkey = uses[ iprev ] + ( m_CompiledCriteria[ iprev ].slot == -1 ? nCriteria : 0 );
+				if ( prevkey <= sortkey )
+					break;
+				--insert;
+			}
+			m_CompiledRuleCriteria.InsertBefore( insert, icriterion );
+			cr.numrequired++;
+		}
+
+		// and all of them in the rule's order, so scores add up exactly as they always have
+		for ( int k = 0; k < rule->m_Criteria.Count(); k++ )
+		{
+			m_CompiledRuleCriteria.AddToTail( rule->m_Criteria[ k ] );
+		}
+	}
+
+	m_bRulesCompiled = true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Starts a new query, forgetting the last one's results
+//-----------------------------------------------------------------------------
+void CResponseSystem::BeginCompiledQuery( const CriteriaSet& set )
+{
+	if ( m_nCompiledQuery == INT_MAX )
+	{
+		for ( int i = 0; i < m_CompiledSlots.Count(); i++ )
+		{
+			m_CompiledSlots[ i ].query = 0;
+			m_CompiledSlots[ i ].parsedquery = 0;
+		}
+		for ( int i = 0; i < m_CompiledResults.Count(); i++ )
+		{
+			m_CompiledResults[ i ].query = 0;
+		}
+		m_nCompiledQuery = 0;
+	}
+	++m_nCompiledQuery;
+
+	for ( int i = set.Head(); set.IsValidIndex( i ); i = set.Next( i ) )
+	{
+		UtlSymId_t sym = set.GetNameSymbol( i );
+		if ( sym >= m_CompiledSlotForSymbol.Count() || m_CompiledSlotForSymbol[ sym ] == -1 )
+			continue;
+
+		CompiledSlot_t &slot = m_CompiledSlots[ m_CompiledSlotForSymbol[ sym ] ];
+		slot.query = m_nCompiledQuery;
+		slot.setindex = i;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Same as ScoreCriteriaAgainstRuleCriteria, but each criterion is only
+//			tested once per query
+//-----------------------------------------------------------------------------
+float CResponseSystem::ScoreCompiledCriterion( const CriteriaSet& set, int icriterion, bool& exclude )
+{
+	CompiledResult_t &result = m_CompiledResults[ icriterion ];
+	if ( result.query == m_nCompiledQuery )
+	{
+		exclude = result.exclude;
+		return result.score;
+	}
+
+	const CompiledCriterion_t &c = m_CompiledCriteria[ icriterion ];
+	float score = 0.0f;
+
+	if ( c.slot == -1 )
+	{
+		for ( int k = 0; k < c.numchildren; k++ )
+		{
+			bool excludesubrule = false;
+			score += ScoreCompiledCriterion( set, m_CompiledChildren[ c.firstchild + k ], excludesubrule );
+		}
+
+		exclude = ( c.required && score == 0.0f ) ? true : false;
+		score *= c.weight;
 	}
 	else
 	{
-		// Randomly pick one of the tied matching rules
-		int idx = IEngineEmulator::Get()->GetRandomStream()->RandomInt( 0, bestCount - 1 );
-		if ( verbose )
+		CompiledSlot_t &slot = m_CompiledSlots[ c.slot ];
+		int setindex = ( slot.query == m_nCompiledQuery ) ? slot.setindex : -1;
+		const char *setValue = set.GetValue( setindex );
+
+		if ( slot.parsedquery != m_nCompiledQuery )
 		{
-			DevMsg( "Found %i matching rules, selecting slot %i\n", bestCount, idx );
+			slot.parsedquery = m_nCompiledQuery;
+			slot.value = (float)atof( setValue );
+			if ( setValue[0] == '[' )
+			{
+				bool found = false;
+				slot.value = LookupEnumeration( setValue, found );
+			}
+			slot.valuehash = HashStringCaseless( setValue );
+		}
+
+		// CompareUsingMatcher
+		float v = slot.value;
+		bool matched;
+		if ( !c.valid )
+		{
+			matched = false;
+		}
+		else if ( c.usemin || c.usemax )
+		{
+			matched = true;
+			if ( c.usemin )
+			{
+				matched = c.minequals ? !( v < c.minval ) : !( v <= c.minval );
+			}
+			if ( matched && c.usemax )
+			{
+				matched = c.maxequals ? !( v > c.maxval ) : !( v >= c.maxval );
+			}
+		}
+		else if ( c.notequal )
+		{
+			if ( c.isnumeric )
+			{
+				matched = ( v != c.tokenval );
+			}
+			else
+			{
+				matched = ( slot.valuehash != c.tokenhash || Q_stricmp( setValue, c.token ) );
+			}
+		}
+		else if ( c.isnumeric )
+		{
+			// If the setValue is "", the NPC doesn't have the key at all,
+			// in which case we shouldn't match "0".
+			matched = setValue[0] && ( v == c.tokenval );
+		}
+		else
+		{
+			matched = ( slot.valuehash == c.tokenhash && !Q_stricmp( setValue, c.token ) );
+		}
+
+		if ( matched )
+		{
+			score = set.GetWeight( setindex ) * c.weight;
+		}
+		exclude = ( !matched && c.required );
+	}
+
+	result.query = m_nCompiledQuery;
+	result.score = score;
+	result.exclude = exclude;
+	return score;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Same as ScoreCriteriaAgainstRule
+//-----------------------------------------------------------------------------
+float CResponseSystem::ScoreCompiledRule( const CriteriaSet& set, int icompiledrule )
+{
+	const CompiledRule_t &cr = m_CompiledRules[ icompiledrule ];
+	if ( !cr.rule->IsEnabled() )
+		return 0.0f;
+
+	const unsigned short *pCriteria = m_CompiledRuleCriteria.Base() + cr.firstcriterion;
+	for ( int i = 0; i < cr.numrequired; i++ )
+	{
+		bool exclude = false;
+		ScoreCompiledCriterion( set, pCriteria[ i ], exclude );
+		if ( exclude )
+			return 0.0f;
+	}
+
+	// nothing left can exclude the rule
+	pCriteria += cr.numrequired;
+	float score = 0.0f;
+	for ( int i = 0; i < cr.numcriteria; i++ )
+	{
+		bool exclude = false;
+		score += ScoreCompiledCriterion( set, pCriteria[ i ], exclude );
+	}
+
+	if ( cr.rule->m_nForceWeight > 0 )
+	{
+		return fsel( score - FLT_MIN, cr.rule->m_nForceWeight, 0 );
+	}
+	return score;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: FindBestMatchingRule using the compiled rules
+//-----------------------------------------------------------------------------
+ResponseRulePartition::tIndex CResponseSystem::FindBestMatchingRuleCompiled( const CriteriaSet& set, float &scoreOfBestMatchingRule )
+{
+	if ( !m_bRulesCompiled )
+	{
+		CompileRules();
+	}
+
+	BeginCompiledQuery( set );
+
+	CUtlVector< ResponseRulePartition::tIndex >	bestrules(16,4);
+	float bestscore = 0.001f;
+	scoreOfBestMatchingRule = 0;
+
+	CUtlVectorFixed< ResponseRulePartition::tRuleDict *, 2 > buckets( 0, 2 );
+	m_RulePartitions.GetDictsForCriteria( &buckets, set );
+	for ( int b = 0 ; b < buckets.Count() ; ++b )
+	{
+		ResponseRulePartition::tRuleDict *prules = buckets[b];
+		int c = prules->Count();
+		if ( c <= 0 )
+			continue;
+
+		int first = m_CompiledBucketStart[ m_RulePartitions.BucketFromIdx( m_RulePartitions.IndexFromDictElem( prules, 0 ) ) ];
+		Assert( first != -1 );
+		for ( int i = 0; i < c; i++ )
+		{
+			float score = ScoreCompiledRule( set, first + i );
+			if ( score >= bestscore )
+			{
+				if( score != bestscore )
+				{
+					bestscore = score;
+					bestrules.RemoveAll();
+				}
+				bestrules.AddToTail( m_RulePartitions.IndexFromDictElem( prules, i ) );
+			}
 		}
-		return bestrules[ idx ] ;
+	}
+
+	return SelectFromTiedRules( bestrules, bestscore, false, scoreOfBestMatchingRule );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Appends a criteria set to a file, one "name<tab>value<tab>weight"
+//			line per criterion and a blank line after the set
+//-----------------------------------------------------------------------------
+void CResponseSystem::RecordCriteria( const CriteriaSet& set, const char *pszFile )
+{
+	IFileSystem *pFileSystem = IEngineEmulator::Get()->GetFilesystem();
+	FileHandle_t fh = pFileSystem->Open( pszFile, "a", "DEFAULT_WRITE_PATH" );
+	if ( fh == FILESYSTEM_INVALID_HANDLE )
+		return;
+
+	for ( int i = set.Head(); set.IsValidIndex( i ); i = set.Next( i ) )
+	{
+		pFileSystem->FPrintf( fh, "%s\t%s\t%f\n", set.GetName( i ), set.GetValue( i ), set.GetWeight( i ) );
+	}
+	pFileSystem->FPrintf( fh, "\n" );
+	pFileSystem->Close( fh );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Replays criteria sets written by RecordCriteria through both the
+//			compiled and the uncompiled matchers, checks that they agree and
+//			reports how fast each one is
+//-----------------------------------------------------------------------------
+void CResponseSystem::BenchmarkRules( const char *pszFile, int nIterations )
+{
+	CUtlBuffer buf( 0, 0, CUtlBuffer::TEXT_BUFFER );
+	if ( !IEngineEmulator::Get()->GetFilesystem()->ReadFile( pszFile, "GAME", buf ) )
+	{
+		Warning( "rr_benchmark_rules: unable to load %s\n", pszFile );
+		return;
+	}
+
+	CUtlVector< CriteriaSet > sets;
+	bool bInSet = false;
+	char line[ 1024 ];
+	while ( buf.IsValid() )
+	{
+		buf.GetLine( line, sizeof( line ) );
+		int len = Q_strlen( line );
+		while ( len > 0 && ( line[ len - 1 ] == '\n' || line[ len - 1 ] == '\r' ) )
+		{
+			line[ --len ] = 0;
+		}
+
+		if ( !len )
+		{
+			bInSet = false;
+			continue;
+		}
+
+		char *pszValue = strchr( line, '\t' );
+		if ( !pszValue )
+			continue;
+		*pszValue++ = 0;
+
+		float flWeight = 1.0f;
+		char *pszWeight = strchr( pszValue, '\t' );
+		if ( pszWeight )
+		{
+			*pszWeight++ = 0;
+			flWeight = (float)atof( pszWeight );
+		}
+
+		if ( !bInSet )
+		{
+			sets.AddToTail();
+			bInSet = true;
+		}
+		sets.Tail().AppendCriteria( line, pszValue, flWeight );
+	}
+
+	if ( !sets.Count() )
+	{
+		Warning( "rr_benchmark_rules: no criteria sets in %s\n", pszFile );
+		return;
+	}
+
+	nIterations = MAX( nIterations, 1 );
+
+	// both matchers pick randomly between tied rules, so only the scores are compared
+	int nMismatches = 0;
+	for ( int i = 0; i < sets.Count(); i++ )
+	{
+		float flUncompiled, flCompiled;
+		FindBestMatchingRuleUncompiled( sets[ i ], false, flUncompiled );
+		FindBestMatchingRuleCompiled( sets[ i ], flCompiled );
+		if ( flUncompiled != flCompiled )
+		{
+			if ( !nMismatches )
+			{
+				Warning( "rr_benchmark_rules: set %d scored %f uncompiled, %f compiled\n", i, flUncompiled, flCompiled );
+			}
+			nMismatches++;
+		}
+	}
+
+	float flScore;
+	double flStart = Plat_FloatTime();
+	for ( int n = 0; n < nIterations; n++ )
+	{
+		for ( int i = 0; i < sets.Count(); i++ )
+		{
+			FindBestMatchingRuleUncompiled( sets[ i ], false, flScore );
+		}
+	}
+	double flUncompiled = Plat_FloatTime() - flStart;
+
+	flStart = Plat_FloatTime();
+	for ( int n = 0; n < nIterations; n++ )
+	{
+		for ( int i = 0; i < sets.Count(); i++ )
+		{
+			FindBestMatchingRuleCompiled( sets[ i ], flScore );
+		}
+	}
+	double flCompiled = Plat_FloatTime() - flStart;
+
+	int nQueries = sets.Count() * nIterations;
+	Msg( "%d criteria sets x %d iterations, %d rules\n", sets.Count(), nIterations, m_RulePartitions.Count() );
+	Msg( "  uncompiled: %.2f ms, %.0f queries/sec\n", flUncompiled * 1000.0, flUncompiled > 0 ? nQueries / flUncompiled : 0.0 );
+	Msg( "  compiled:   %.2f ms, %.0f queries/sec\n", flCompiled * 1000.0, flCompiled > 0 ? nQueries / flCompiled : 0.0 );
+	if ( nMismatches )
+	{
+		Warning( "  %d of %d sets scored differently!\n", nMismatches, sets.Count() );
 	}
 }
 
@@ -1197,6 +1701,11 @@ bool CResponseSystem::FindBestResponse( const CriteriaSet& set, CRR_Response& re
 {
 	bool valid = false;
 
+	if ( rr_recordcriteria.GetString()[0] )
+	{
+		RecordCriteria( set, rr_recordcriteria.GetString() );
+	}
+
 	int iDbgResponse = rr_debugresponses.GetInt();
 	bool showRules = ( iDbgResponse >= 2 && iDbgResponse < RR_DEBUGRESPONSES_SPECIALCASE );
 	bool showResult = ( iDbgResponse >= 1 && iDbgResponse < RR_DEBUGRESPONSES_SPECIALCASE );
@@ -2105,6 +2614,7 @@ void CResponseSystem::ParseRule( void )
 	if ( m_bParseRuleValid )
 	{
 		m_RulePartitions.GetDictForRule( this, newRule ).Insert( ruleName, newRule );
+		InvalidateCompiledRules();
 	}
 	else
 	{
@@ -2298,6 +2808,7 @@ void CResponseSystem::CopyRuleFrom( Rule *pSrcRule, ResponseRulePartition::tInde
 
 	// Add rule.
 	pCustomSystem->m_RulePartitions.GetDictForRule( this, dstRule ).Insert( m_RulePartitions.GetElementName( iRule ), dstRule );
+	pCustomSystem->InvalidateCompiledRules();
 }
 
 
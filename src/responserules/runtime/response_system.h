@@ -211,7 +211,23 @@ public:
 		float		LookupEnumeration( const char *name, bool& found );
 
 		ResponseRulePartition::tIndex FindBestMatchingRule( const CriteriaSet& set, bool verbose, float &scoreOfBestMatchingRule );
-		
+		ResponseRulePartition::tIndex FindBestMatchingRuleUncompiled( const CriteriaSet& set, bool verbose, float &scoreOfBestMatchingRule );
+		ResponseRulePartition::tIndex FindBestMatchingRuleCompiled( const CriteriaSet& set, float &scoreOfBestMatchingRule );
+
+		// The compiled matcher gives the same scores as ScoreCriteriaAgainstRule, but each
+		// criterion is tested at most once per query however many rules share it, set values
+		// are parsed once per query, and a rule's required criteria are tested first, most
+		// selective first, so most rules are rejected after one or two tests.
+		void		CompileRules();
+		inline void	InvalidateCompiledRules() { m_bRulesCompiled = false; }
+		void		BeginCompiledQuery( const CriteriaSet& set );
+		float		ScoreCompiledCriterion( const CriteriaSet& set, int icriterion, bool& exclude );
+		float		ScoreCompiledRule( const CriteriaSet& set, int icompiledrule );
+
+		// Criteria sets are written out by rr_recordcriteria and replayed by rr_benchmark_rules
+		void		RecordCriteria( const CriteriaSet& set, const char *pszFile );
+		void		BenchmarkRules( const char *pszFile, int nIterations );
+
 		float		ScoreCriteriaAgainstRule( const CriteriaSet& set, ResponseRulePartition::tRuleDict &dict, int irule, bool verbose = false );
 		float		RecursiveScoreSubcriteriaAgainstRule( const CriteriaSet& set, Criteria *parent, bool& exclude, bool verbose /*=false*/ );
 		float		ScoreCriteriaAgainstRuleCriteria( const CriteriaSet& set, int icriterion, bool& exclude, bool verbose = false );
@@ -251,6 +267,66 @@ public:
 		ResponseRulePartition m_RulePartitions;
 		CUtlDict< Enumeration, short > m_Enumerations;
 
+		struct CompiledCriterion_t
+		{
+			int			slot;				// index of the criterion's name in m_CompiledSlots, -1 for subcriteria
+			float		weight;
+			bool		required;
+
+			// the matcher, with its token pre-parsed
+			bool		valid;
+			bool		isnumeric;
+			bool		notequal;
+			bool		usemin;
+			bool		minequals;
+			bool		usemax;
+			bool		maxequals;
+			float		minval;
+			float		maxval;
+			float		tokenval;
+			const char	*token;
+			unsigned	tokenhash;			// HashStringCaseless( token )
+
+			int			firstchild;			// subcriteria, in m_CompiledChildren
+			int			numchildren;
+		};
+
+		struct CompiledRule_t
+		{
+			Rule		*rule;
+			int			firstcriterion;		// in m_CompiledRuleCriteria: the required criteria in test order, then all criteria in rule order
+			short		numrequired;
+			short		numcriteria;
+		};
+
+		// per query state, only valid when the query number matches
+		struct CompiledSlot_t
+		{
+			int			query;
+			int			setindex;
+			int			parsedquery;
+			float		value;
+			unsigned	valuehash;
+		};
+
+		struct CompiledResult_t
+		{
+			int			query;
+			float		score;
+			bool		exclude;
+		};
+
+		bool								m_bRulesCompiled;
+		CUtlVector< CompiledCriterion_t >	m_CompiledCriteria;		// by m_Criteria index
+		CUtlVector< unsigned short >		m_CompiledChildren;
+		CUtlVector< CompiledRule_t >		m_CompiledRules;		// in partition order
+		CUtlVector< unsigned short >		m_CompiledRuleCriteria;
+		int									m_CompiledBucketStart[ ResponseRulePartition::N_RESPONSE_PARTITIONS ];
+		CUtlVector< short >					m_CompiledSlotForSymbol;	// criterion name symbol -> slot
+		CUtlVector< CompiledSlot_t >		m_CompiledSlots;
+		CUtlVector< CompiledResult_t >		m_CompiledResults;		// by m_Criteria index
+		int									m_nCompiledQuery;
+
 		CUtlVector<int> m_FakedDepletes;
 
 		char		token[ 1204 ];
@@ -23,9 +23,11 @@
 #include <stdlib.h>
 #include "tier0/dbg.h"
 #include "tier0/mem.h"
+#include "tier0/threadtools.h"
 #include "utlvector.h"
 #include "utlbuffer.h"
 #include "utlhash.h"
+#include "utlsymbol.h"
 #include "UtlSortVector.h"
 #include "convar.h"
 
@@ -211,97 +213,35 @@ static CLeakTrack track;
 
 //-----------------------------------------------------------------------------
 // Purpose: An arbitrarily growable string table for KeyValues key names. 
-//	See the comment in the header for more info.
+//	See the comment in the header for more info. Looking up a key name that is
+//	already in the table doesn't take a lock, so threads parsing KeyValues at
+//	the same time don't queue up behind each other.
 //-----------------------------------------------------------------------------
 class CKeyValuesGrowableStringTable
 {
 public: 
 	// Constructor
-	CKeyValuesGrowableStringTable() :
-		#ifdef PLATFORM_64BITS
-			m_vecStrings( 0, 4 * 512 * 1024 )
-		#else
-			m_vecStrings( 0, 512 * 1024 )
-		#endif
-		, m_hashLookup( 2048, 0, 0, m_Functor, m_Functor )
+	CKeyValuesGrowableStringTable() : m_Table( 2048, true )
 	{
-		m_vecStrings.AddToTail( '\0' );
+		// Symbol 0 is the empty string, as it was when symbols were offsets
+		// into one big buffer
+		m_Table.AddString( "" );
 	}
 
 	// Translates a string to an index
 	int GetSymbolForString( const char *name, bool bCreate = true )
 	{
-		AUTO_LOCK( m_mutex );
-
-		// Put the current details into our hash functor
-		m_Functor.SetCurString( name );
-		m_Functor.SetCurStringBase( (const char *)m_vecStrings.Base() );
-
-		if ( bCreate )
-		{
-			bool bInserted = false;
-			UtlHashHandle_t hElement = m_hashLookup.Insert( -1, &bInserted );
-			if ( bInserted )
-			{
-				int iIndex = m_vecStrings.AddMultipleToTail( V_strlen( name ) + 1, name );
-				m_hashLookup[ hElement ] = iIndex;
-			}
-
-			return m_hashLookup[ hElement ];
-		}
-		else
-		{
-			UtlHashHandle_t hElement = m_hashLookup.Find( -1 );
-			if ( m_hashLookup.IsValidHandle( hElement ) )
-				return m_hashLookup[ hElement ];
-			else
-				return -1;
-		}
+		return bCreate ? m_Table.AddString( name ) : m_Table.Find( name );
 	}
 
 	// Translates an index back to a string
 	const char *GetStringForSymbol( int symbol )
 	{
-		return (const char *)m_vecStrings.Base() + symbol;
+		return m_Table.String( symbol );
 	}
 
 private:
-	
-	// A class plugged into CUtlHash that allows us to change the behavior of the table
-	// and store only the index in the table.
-	class CLookupFunctor
-	{
-	public:
-		CLookupFunctor() : m_pchCurString( NULL ), m_pchCurBase( NULL ) {}
-
-		// Sets what we are currently inserting or looking for.
-		void SetCurString( const char *pchCurString ) { m_pchCurString = pchCurString; }
-		void SetCurStringBase( const char *pchCurBase ) { m_pchCurBase = pchCurBase; }
-
-		// The compare function.
-		bool operator()( int nLhs, int nRhs ) const
-		{
-			const char *pchLhs = nLhs > 0 ? m_pchCurBase + nLhs : m_pchCurString;
-			const char *pchRhs = nRhs > 0 ? m_pchCurBase + nRhs : m_pchCurString;
-			
-			return ( 0 == V_stricmp( pchLhs, pchRhs ) );
-		}
-
-		// The hash function.
-		unsigned int operator()( int nItem ) const
-		{
-			return HashStringCaseless( m_pchCurString );
-		}
-
-	private:
-		const char *m_pchCurString;
-		const char *m_pchCurBase;
-	};
-
-	CThreadFastMutex m_mutex;
-	CLookupFunctor	m_Functor;
-	CUtlHash<int, CLookupFunctor &, CLookupFunctor &> m_hashLookup;
-	CUtlVector<char> m_vecStrings;
+	CUtlConcurrentSymbolTable m_Table;
 };
 
 
@@ -449,8 +389,7 @@ void KeyValues::Init()
 	m_bHasEscapeSequences = false;
 	m_bEvaluateConditionals = true;
 
-	// for future proof
-	memset( unused, 0, sizeof(unused) );
+	m_iArena = 0;
 }
 
 //-----------------------------------------------------------------------------
@@ -474,19 +413,19 @@ void KeyValues::RemoveEverything()
 	{
 		datNext = dat->m_pPeer;
 		dat->m_pPeer = NULL;
-		delete dat;
+		dat->deleteThis();
 	}
 
 	for ( dat = m_pPeer; dat && dat != this; dat = datNext )
 	{
 		datNext = dat->m_pPeer;
 		dat->m_pPeer = NULL;
-		delete dat;
+		dat->deleteThis();
 	}
 
-	delete [] m_sValue;
+	FreeString( m_sValue );
 	m_sValue = NULL;
-	delete [] m_wsValue;
+	FreeWString( m_wsValue );
 	m_wsValue = NULL;
 }
 
@@ -964,7 +903,7 @@ KeyValues *KeyValues::FindKey(const char *keyName, bool bCreate)
 		if (bCreate)
 		{
 			// we need to create a new key
-			dat = new KeyValues( searchStr );
+			dat = CreateKeyValues( searchStr );
 //			Assert(dat != NULL);
 
 			dat->UsesEscapeSequences( m_bHasEscapeSequences != 0 );	// use same format as parent
@@ -1044,7 +983,7 @@ KeyValues* KeyValues::CreateKey( const char *keyName )
 KeyValues* KeyValues::CreateKeyUsingKnownLastChild( const char *keyName, KeyValues *pLastChild )
 {
 	// Create a new key
-	KeyValues* dat = new KeyValues( keyName );
+	KeyValues* dat = CreateKeyValues( keyName );
 
 	dat->UsesEscapeSequences( m_bHasEscapeSequences != 0 ); // use same format as parent does
 	dat->UsesConditionals( m_bEvaluateConditionals != 0 );
@@ -1507,9 +1446,9 @@ void KeyValues::SetColor( const char *keyName, Color value)
 void KeyValues::SetStringValue( char const *strValue )
 {
 	// delete the old value
-	delete [] m_sValue;
+	FreeString( m_sValue );
 	// make sure we're not storing the WSTRING  - as we're converting over to STRING
-	delete [] m_wsValue;
+	FreeWString( m_wsValue );
 	m_wsValue = NULL;
 
 	if (!strValue)
@@ -1520,7 +1459,7 @@ void KeyValues::SetStringValue( char const *strValue )
 
 	// allocate memory for the new value and copy it in
 	int len = Q_strlen( strValue );
-	m_sValue = new char[len + 1];
+	m_sValue = AllocString( len + 1 );
 	Q_memcpy( m_sValue, strValue, len+1 );
 
 	m_iDataType = TYPE_STRING;
@@ -1541,9 +1480,9 @@ void KeyValues::SetString( const char *keyName, const char *value )
 		}
 
 		// delete the old value
-		delete [] dat->m_sValue;
+		dat->FreeString( dat->m_sValue );
 		// make sure we're not storing the WSTRING  - as we're converting over to STRING
-		delete [] dat->m_wsValue;
+		dat->FreeWString( dat->m_wsValue );
 		dat->m_wsValue = NULL;
 
 		if (!value)
@@ -1554,7 +1493,7 @@ void KeyValues::SetString( const char *keyName, const char *value )
 
 		// allocate memory for the new value and copy it in
 		int len = Q_strlen( value );
-		dat->m_sValue = new char[len + 1];
+		dat->m_sValue = dat->AllocString( len + 1 );
 		Q_memcpy( dat->m_sValue, value, len+1 );
 
 		dat->m_iDataType = TYPE_STRING;
@@ -1570,9 +1509,9 @@ void KeyValues::SetWString( const char *keyName, const wchar_t *value )
 	if ( dat )
 	{
 		// delete the old value
-		delete [] dat->m_wsValue;
+		dat->FreeWString( dat->m_wsValue );
 		// make sure we're not storing the STRING  - as we're converting over to WSTRING
-		delete [] dat->m_sValue;
+		dat->FreeString( dat->m_sValue );
 		dat->m_sValue = NULL;
 
 		if (!value)
@@ -1583,7 +1522,7 @@ void KeyValues::SetWString( const char *keyName, const wchar_t *value )
 
 		// allocate memory for the new value and copy it in
 		int len = wcslen( value );
-		dat->m_wsValue = new wchar_t[len + 1];
+		dat->m_wsValue = dat->AllocWString( len + 1 );
 		Q_memcpy( dat->m_wsValue, value, (len+1) * sizeof(wchar_t) );
 
 		dat->m_iDataType = TYPE_WSTRING;
@@ -1614,12 +1553,12 @@ void KeyValues::SetUint64( const char *keyName, uint64 value )
 	if ( dat )
 	{
 		// delete the old value
-		delete [] dat->m_sValue;
+		dat->FreeString( dat->m_sValue );
 		// make sure we're not storing the WSTRING  - as we're converting over to STRING
-		delete [] dat->m_wsValue;
+		dat->FreeWString( dat->m_wsValue );
 		dat->m_wsValue = NULL;
 
-		dat->m_sValue = new char[sizeof(uint64)];
+		dat->m_sValue = dat->AllocString( sizeof(uint64) );
 		*((uint64 *)dat->m_sValue) = value;
 		dat->m_iDataType = TYPE_UINT64;
 	}
@@ -1676,7 +1615,7 @@ void KeyValues::RecursiveCopyKeyValues( KeyValues& src )
 			if( src.m_sValue )
 			{
 				int len = Q_strlen(src.m_sValue) + 1;
-				m_sValue = new char[len];
+				m_sValue = AllocString( len );
 				Q_strncpy( m_sValue, src.m_sValue, len );
 			}
 			break;
@@ -1685,7 +1624,7 @@ void KeyValues::RecursiveCopyKeyValues( KeyValues& src )
 				m_iValue = src.m_iValue;
 				Q_snprintf( buf,sizeof(buf), "%d", m_iValue );
 				int len = Q_strlen(buf) + 1;
-				m_sValue = new char[len];
+				m_sValue = AllocString( len );
 				Q_strncpy( m_sValue, buf, len  );
 			}
 			break;
@@ -1694,7 +1633,7 @@ void KeyValues::RecursiveCopyKeyValues( KeyValues& src )
 				m_flValue = src.m_flValue;
 				Q_snprintf( buf,sizeof(buf), "%f", m_flValue );
 				int len = Q_strlen(buf) + 1;
-				m_sValue = new char[len];
+				m_sValue = AllocString( len );
 				Q_strncpy( m_sValue, buf, len );
 			}
 			break;
@@ -1705,7 +1644,7 @@ void KeyValues::RecursiveCopyKeyValues( KeyValues& src )
 			break;
 		case TYPE_UINT64:
 			{
-				m_sValue = new char[sizeof(uint64)];
+				m_sValue = AllocString( sizeof(uint64) );
 				Q_memcpy( m_sValue, src.m_sValue, sizeof(uint64) );
 			}
 			break;
@@ -1750,14 +1689,14 @@ void KeyValues::RecursiveCopyKeyValues( KeyValues& src )
 	// Handle the immediate child
 	if( src.m_pSub )
 	{
-		m_pSub = new KeyValues( NULL );
+		m_pSub = CreateKeyValues( NULL );
 		m_pSub->RecursiveCopyKeyValues( *src.m_pSub );
 	}
 
 	// Handle the immediate peer
 	if( src.m_pPeer )
 	{
-		m_pPeer = new KeyValues( NULL );
+		m_pPeer = CreateKeyValues( NULL );
 		m_pPeer->RecursiveCopyKeyValues( *src.m_pPeer );
 	}
 }
@@ -1765,7 +1704,9 @@ void KeyValues::RecursiveCopyKeyValues( KeyValues& src )
 KeyValues& KeyValues::operator=( KeyValues& src )
 {
 	RemoveEverything();
+	unsigned char iArena = m_iArena;
 	Init();	// reset all values
+	m_iArena = iArena;
 	RecursiveCopyKeyValues( src );
 	return *this;
 }
@@ -1782,7 +1723,7 @@ void KeyValues::CopySubkeys( KeyValues *pParent ) const
 	for ( KeyValues *sub = m_pSub; sub != NULL; sub = sub->m_pPeer )
 	{
 		// take a copy of the subkey
-		KeyValues *dat = sub->MakeCopy();
+		KeyValues *dat = sub->MakeCopy( pParent->GetArena() );
 		 
 		// add into subkey list
 		if (pPrev)
@@ -1802,9 +1743,9 @@ void KeyValues::CopySubkeys( KeyValues *pParent ) const
 //-----------------------------------------------------------------------------
 // Purpose: Makes a copy of the whole key-value pair set
 //-----------------------------------------------------------------------------
-KeyValues *KeyValues::MakeCopy( void ) const
+KeyValues *KeyValues::MakeCopy( CKeyValuesArena *pArena ) const
 {
-	KeyValues *newKeyValue = new KeyValues(GetName());
+	KeyValues *newKeyValue = pArena ? pArena->CreateKeyValues( GetName() ) : new KeyValues( GetName() );
 
 	newKeyValue->UsesEscapeSequences( m_bHasEscapeSequences != 0 );
 	newKeyValue->UsesConditionals( m_bEvaluateConditionals != 0 );
@@ -1819,7 +1760,7 @@ KeyValues *KeyValues::MakeCopy( void ) const
 			{
 				int len = Q_strlen( m_sValue );
 				Assert( !newKeyValue->m_sValue );
-				newKeyValue->m_sValue = new char[len + 1];
+				newKeyValue->m_sValue = newKeyValue->AllocString( len + 1 );
 				Q_memcpy( newKeyValue->m_sValue, m_sValue, len+1 );
 			}
 		}
@@ -1829,7 +1770,7 @@ KeyValues *KeyValues::MakeCopy( void ) const
 			if ( m_wsValue )
 			{
 				int len = wcslen( m_wsValue );
-				newKeyValue->m_wsValue = new wchar_t[len+1];
+				newKeyValue->m_wsValue = newKeyValue->AllocWString( len + 1 );
 				Q_memcpy( newKeyValue->m_wsValue, m_wsValue, (len+1)*sizeof(wchar_t));
 			}
 		}
@@ -1855,7 +1796,7 @@ KeyValues *KeyValues::MakeCopy( void ) const
 		break;
 
 	case TYPE_UINT64:
-		newKeyValue->m_sValue = new char[sizeof(uint64)];
+		newKeyValue->m_sValue = newKeyValue->AllocString( sizeof(uint64) );
 		Q_memcpy( newKeyValue->m_sValue, m_sValue, sizeof(uint64) );
 		break;
 	};
@@ -1886,7 +1827,10 @@ bool KeyValues::IsEmpty(const char *keyName)
 //-----------------------------------------------------------------------------
 void KeyValues::Clear( void )
 {
-	delete m_pSub;
+	if ( m_pSub )
+	{
+		m_pSub->deleteThis();
+	}
 	m_pSub = NULL;
 	m_iDataType = TYPE_NONE;
 }
@@ -1908,6 +1852,10 @@ KeyValues::types_t KeyValues::GetDataType(const char *keyName)
 //-----------------------------------------------------------------------------
 void KeyValues::deleteThis()
 {
+	// Keys from an arena go when the arena is freed
+	if ( m_iArena )
+		return;
+
 	delete this;
 }
 
@@ -1974,7 +1922,7 @@ void KeyValues::ParseIncludedKeys( char const *resourceName, const char *filetoi
 	// Append included file
 	Q_strncat( fullpath, filetoinclude, sizeof( fullpath ), COPY_ALL_CHARACTERS );
 
-	KeyValues *newKV = new KeyValues( fullpath );
+	KeyValues *newKV = CreateKeyValues( fullpath );
 
 	// CUtlSymbol save = s_CurrentFileSymbol;	// did that had any use ???
 
@@ -2142,7 +2090,7 @@ bool KeyValues::LoadFromBuffer( char const *resourceName, CUtlBuffer &buf, IBase
 
 		if ( !pCurrentKey )
 		{
-			pCurrentKey = new KeyValues( s );
+			pCurrentKey = CreateKeyValues( s );
 			Assert( pCurrentKey );
 
 			pCurrentKey->UsesEscapeSequences( m_bHasEscapeSequences != 0 ); // same format has parent use
@@ -2330,7 +2278,7 @@ void KeyValues::RecursiveLoadFromBuffer( char const *resourceName, CUtlBuffer &b
 			
 			if (dat->m_sValue)
 			{
-				delete[] dat->m_sValue;
+				dat->FreeString( dat->m_sValue );
 				dat->m_sValue = NULL;
 			}
 
@@ -2372,7 +2320,7 @@ void KeyValues::RecursiveLoadFromBuffer( char const *resourceName, CUtlBuffer &b
 							digit -= 'A' - ( '9' + 1 );
 					retVal = ( retVal * 16 ) + ( digit - '0' );
 				}
-				dat->m_sValue = new char[sizeof(uint64)];
+				dat->m_sValue = dat->AllocString( sizeof(uint64) );
 				*((uint64 *)dat->m_sValue) = retVal;
 				dat->m_iDataType = TYPE_UINT64;
 			}
@@ -2394,7 +2342,7 @@ void KeyValues::RecursiveLoadFromBuffer( char const *resourceName, CUtlBuffer &b
 			if (dat->m_iDataType == TYPE_STRING)
 			{
 				// copy in the string information
-				dat->m_sValue = new char[len+1];
+				dat->m_sValue = dat->AllocString( len + 1 );
 				Q_memcpy( dat->m_sValue, value, len+1 );
 			}
 
@@ -2536,7 +2484,9 @@ bool KeyValues::ReadAsBinary( CUtlBuffer &buffer, int nStackDepth )
 		return false;
 
 	RemoveEverything(); // remove current content
+	unsigned char iArena = m_iArena;
 	Init();	// reset
+	m_iArena = iArena;
 	
 	if ( nStackDepth > 100 )
 	{
@@ -2566,7 +2516,7 @@ bool KeyValues::ReadAsBinary( CUtlBuffer &buffer, int nStackDepth )
 		{
 		case TYPE_NONE:
 			{
-				dat->m_pSub = new KeyValues("");
+				dat->m_pSub = dat->CreateKeyValues( "" );
 				dat->m_pSub->ReadAsBinary( buffer, nStackDepth + 1 );
 				break;
 			}
@@ -2577,7 +2527,7 @@ bool KeyValues::ReadAsBinary( CUtlBuffer &buffer, int nStackDepth )
 				token[KEYVALUES_TOKEN_SIZE-1] = 0;
 
 				int len = Q_strlen( token );
-				dat->m_sValue = new char[len + 1];
+				dat->m_sValue = dat->AllocString( len + 1 );
 				Q_memcpy( dat->m_sValue, token, len+1 );
 								
 				break;
@@ -2596,7 +2546,7 @@ bool KeyValues::ReadAsBinary( CUtlBuffer &buffer, int nStackDepth )
 
 		case TYPE_UINT64:
 			{
-				dat->m_sValue = new char[sizeof(uint64)];
+				dat->m_sValue = dat->AllocString( sizeof(uint64) );
 				*((uint64 *)dat->m_sValue) = buffer.GetInt64();
 				break;
 			}
@@ -2632,7 +2582,7 @@ bool KeyValues::ReadAsBinary( CUtlBuffer &buffer, int nStackDepth )
 			break;
 
 		// new peer follows
-		dat->m_pPeer = new KeyValues("");
+		dat->m_pPeer = dat->CreateKeyValues( "" );
 		dat = dat->m_pPeer;
 	}
 
@@ -2671,6 +2621,181 @@ void KeyValues::operator delete( void *pMem, int nBlockUse, const char *pFileNam
 	KeyValuesSystem()->FreeKeyValuesMemory(pMem);
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: allocators for keys and values, which use the arena of this key
+//-----------------------------------------------------------------------------
+void *KeyValues::operator new( size_t iAllocSize, CKeyValuesArena *pArena )
+{
+	return pArena->Alloc( iAllocSize );
+}
+
+void KeyValues::operator delete( void *pMem, CKeyValuesArena *pArena )
+{
+}
+
+CKeyValuesArena *KeyValues::GetArena() const
+{
+	return m_iArena ? CKeyValuesArena::GetArena( m_iArena ) : NULL;
+}
+
+KeyValues *KeyValues::CreateKeyValues( const char *setName ) const
+{
+	if ( m_iArena )
+		return GetArena()->CreateKeyValues( setName );
+
+	return new KeyValues( setName );
+}
+
+char *KeyValues::AllocString( int nChars ) const
+{
+	if ( m_iArena )
+		return (char *)GetArena()->Alloc( nChars );
+
+	return new char[nChars];
+}
+
+wchar_t *KeyValues::AllocWString( int nChars ) const
+{
+	if ( m_iArena )
+		return (wchar_t *)GetArena()->Alloc( nChars * sizeof( wchar_t ) );
+
+	return new wchar_t[nChars];
+}
+
+void KeyValues::FreeString( char *pString ) const
+{
+	if ( !m_iArena )
+	{
+		delete [] pString;
+	}
+}
+
+void KeyValues::FreeWString( wchar_t *pString ) const
+{
+	if ( !m_iArena )
+	{
+		delete [] pString;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// CKeyValuesArena
+//-----------------------------------------------------------------------------
+
+#define KEYVALUES_ARENA_ALIGN	8
+#define KEYVALUES_MAX_ARENAS	256
+
+// Keys find their arena by index, since they only have a byte to spare
+static CKeyValuesArena * volatile s_pKeyValuesArenas[KEYVALUES_MAX_ARENAS];
+
+CKeyValuesArena::CKeyValuesArena( int nBlockSize ) :
+	m_iArena( 0 ),
+	m_nBlockSize( AlignValue( MAX( nBlockSize, 1024 ), KEYVALUES_ARENA_ALIGN ) ),
+	m_nBytesUsed( 0 ),
+	m_pNextAlloc( NULL ),
+	m_pAllocLimit( NULL )
+{
+	for ( int i = 1; i < KEYVALUES_MAX_ARENAS; i++ )
+	{
+		if ( !s_pKeyValuesArenas[i] && ThreadInterlockedAssignPointerIf( (void * volatile *)&s_pKeyValuesArenas[i], this, NULL ) )
+		{
+			m_iArena = i;
+			break;
+		}
+	}
+
+	if ( !m_iArena )
+	{
+		DevWarning( "CKeyValuesArena: more than %d arenas, keys will come from the heap\n", KEYVALUES_MAX_ARENAS - 1 );
+	}
+}
+
+CKeyValuesArena::~CKeyValuesArena()
+{
+	FreeAll();
+
+	for ( int i = 0; i < m_Blocks.Count(); i++ )
+	{
+		free( m_Blocks[i] );
+	}
+	m_Blocks.RemoveAll();
+
+	if ( m_iArena )
+	{
+		s_pKeyValuesArenas[m_iArena] = NULL;
+	}
+}
+
+CKeyValuesArena *CKeyValuesArena::GetArena( int iArena )
+{
+	Assert( iArena > 0 && iArena < KEYVALUES_MAX_ARENAS && s_pKeyValuesArenas[iArena] );
+	return s_pKeyValuesArenas[iArena];
+}
+
+KeyValues *CKeyValuesArena::CreateKeyValues( const char *setName )
+{
+	if ( !m_iArena )
+		return new KeyValues( setName );
+
+	KeyValues *pKeyValues = new ( this ) KeyValues( setName );
+	pKeyValues->m_iArena = m_iArena;
+	return pKeyValues;
+}
+
+byte *CKeyValuesArena::AllocBlock( int nBytes )
+{
+	MEM_ALLOC_CREDIT();
+	return (byte *)malloc( nBytes );
+}
+
+void *CKeyValuesArena::Alloc( int nBytes )
+{
+	nBytes = AlignValue( MAX( nBytes, 1 ), KEYVALUES_ARENA_ALIGN );
+	m_nBytesUsed += nBytes;
+
+	if ( m_pNextAlloc + nBytes > m_pAllocLimit )
+	{
+		// Big strings get a block of their own rather than wasting the rest of this one
+		if ( nBytes > m_nBlockSize / 4 )
+		{
+			byte *pLarge = AllocBlock( nBytes );
+			m_LargeBlocks.AddToTail( pLarge );
+			return pLarge;
+		}
+
+		m_pNextAlloc = AllocBlock( m_nBlockSize );
+		m_pAllocLimit = m_pNextAlloc + m_nBlockSize;
+		m_Blocks.AddToTail( m_pNextAlloc );
+	}
+
+	void *pResult = m_pNextAlloc;
+	m_pNextAlloc += nBytes;
+	return pResult;
+}
+
+void CKeyValuesArena::FreeAll()
+{
+	for ( int i = 0; i < m_LargeBlocks.Count(); i++ )
+	{
+		free( m_LargeBlocks[i] );
+	}
+	m_LargeBlocks.RemoveAll();
+
+	for ( int i = 1; i < m_Blocks.Count(); i++ )
+	{
+		free( m_Blocks[i] );
+	}
+
+	if ( m_Blocks.Count() )
+	{
+		m_Blocks.RemoveMultipleFromTail( m_Blocks.Count() - 1 );
+		m_pNextAlloc = m_Blocks[0];
+		m_pAllocLimit = m_pNextAlloc + m_nBlockSize;
+	}
+
+	m_nBytesUsed = 0;
+}
+
 void KeyValues::UnpackIntoStructure( KeyValuesUnpackStructure const *pUnpackTable, void *pDest, size_t DestSizeInBytes )
 {
 #ifdef DBGFLAG_ASSERT
@@ -119,6 +119,165 @@ public:
 static CBitWriteMasksInit g_BitWriteMasksInit;
 
 
+//-----------------------------------------------------------------------------
+// CBitWriteAccumulator
+//-----------------------------------------------------------------------------
+CBitWriteAccumulator::CBitWriteAccumulator( bf_write *pBuf, int nMaxBits ) : m_pBuf( pBuf )
+{
+	m_bOneAtATime = ( nMaxBits > pBuf->GetNumBitsLeft() );
+	m_iDWord = pBuf->m_iCurBit >> 5;
+	m_nBits = pBuf->m_iCurBit & 31;
+
+	// Keep what's already been written to the first dword
+	m_nAccum = ( m_nBits && !m_bOneAtATime ) ? ( LoadLittleDWord( pBuf->m_pData, m_iDWord ) & g_ExtraMasks[m_nBits] ) : 0;
+}
+
+void CBitWriteAccumulator::Flush()
+{
+	if ( m_bOneAtATime )
+		return;
+
+	// Store the last partial dword, keeping whatever is after the new bits
+	if ( m_nBits )
+	{
+		unsigned long dword = LoadLittleDWord( m_pBuf->m_pData, m_iDWord );
+		dword = ( dword & ~g_ExtraMasks[m_nBits] ) | (unsigned long)m_nAccum;
+		StoreLittleDWord( m_pBuf->m_pData, m_iDWord, dword );
+	}
+	m_pBuf->m_iCurBit = m_iDWord * 32 + m_nBits;
+}
+
+
+//-----------------------------------------------------------------------------
+// Reads fields through a 64-bit accumulator, loading a dword at a time, for
+// the array functions. It doesn't check for overflow; the caller makes sure
+// all the bits are in the buffer first.
+//-----------------------------------------------------------------------------
+class CBitReadAccumulator
+{
+public:
+	CBitReadAccumulator( bf_read *pBuf ) : m_pBuf( pBuf )
+	{
+		int nSkip = pBuf->m_iCurBit & 31;
+		m_iDWord = pBuf->m_iCurBit >> 5;
+		m_nAccum = LoadLittleDWord( (unsigned long *)pBuf->m_pData, m_iDWord++ ) >> nSkip;
+		m_nBits = 32 - nSkip;
+	}
+
+	FORCEINLINE unsigned int Read( int numbits )
+	{
+		if ( m_nBits < numbits )
+		{
+			m_nAccum |= (uint64)LoadLittleDWord( (unsigned long *)m_pBuf->m_pData, m_iDWord++ ) << m_nBits;
+			m_nBits += 32;
+		}
+
+		unsigned int nValue = (unsigned int)m_nAccum & g_ExtraMasks[numbits];
+		m_nAccum >>= numbits;
+		m_nBits -= numbits;
+		return nValue;
+	}
+
+	FORCEINLINE uint32 ReadVarInt32()
+	{
+		uint32 result = 0;
+		uint32 b;
+		int count = 0;
+		do
+		{
+			if ( count == bitbuf::kMaxVarint32Bytes )
+				break;
+			b = Read( 8 );
+			result |= ( b & 0x7F ) << ( 7 * count );
+			++count;
+		} while ( b & 0x80 );
+		return result;
+	}
+
+	void Finish()
+	{
+		m_pBuf->m_iCurBit = m_iDWord * 32 - m_nBits;
+	}
+
+private:
+	bf_read		*m_pBuf;
+	uint64		m_nAccum;
+	int			m_nBits;
+	int			m_iDWord;
+};
+
+// The most bits each kind of field can take
+#define MAX_VARINT32_BITS		( bitbuf::kMaxVarint32Bytes * 8 )
+#define MAX_BITCOORD_BITS		( 3 + COORD_INTEGER_BITS + COORD_FRACTIONAL_BITS )
+#define MAX_BITVEC3COORD_BITS	( 3 + 3 * MAX_BITCOORD_BITS )
+#define BITNORMAL_BITS			( 1 + NORMAL_FRACTIONAL_BITS )
+#define MAX_BITVEC3NORMAL_BITS	( 3 + 2 * BITNORMAL_BITS )
+
+//-----------------------------------------------------------------------------
+// Packs a coord into the bits WriteBitCoord would write, first bit lowest.
+// Returns how many bits there are.
+//-----------------------------------------------------------------------------
+static FORCEINLINE int PackBitCoord( float f, unsigned int &bits )
+{
+	int		signbit = (f <= -COORD_RESOLUTION);
+	int		intval = (int)abs(f);
+	int		fractval = abs((int)(f*COORD_DENOMINATOR)) & (COORD_DENOMINATOR-1);
+
+	bits = ( intval ? 1 : 0 ) | ( fractval ? 2 : 0 );
+	if ( !intval && !fractval )
+		return 2;
+
+	bits |= signbit << 2;
+	int numbits = 3;
+	if ( intval )
+	{
+		bits |= (unsigned int)( ( intval - 1 ) & g_ExtraMasks[COORD_INTEGER_BITS] ) << numbits;
+		numbits += COORD_INTEGER_BITS;
+	}
+	if ( fractval )
+	{
+		bits |= (unsigned int)fractval << numbits;
+		numbits += COORD_FRACTIONAL_BITS;
+	}
+	return numbits;
+}
+
+static FORCEINLINE unsigned int PackBitNormal( float f )
+{
+	int	signbit = (f <= -NORMAL_RESOLUTION);
+
+	// NOTE: Since +/-1 are valid values for a normal, I'm going to encode that as all ones
+	unsigned int fractval = abs( (int)(f*NORMAL_DENOMINATOR) );
+
+	// clamp..
+	if (fractval > NORMAL_DENOMINATOR)
+		fractval = NORMAL_DENOMINATOR;
+
+	return signbit | ( fractval << 1 );
+}
+
+static FORCEINLINE float ReadAccumulatedBitCoord( CBitReadAccumulator &acc )
+{
+	unsigned int flags = acc.Read( 2 );
+	if ( !flags )
+		return 0.0f;
+
+	int signbit = acc.Read( 1 );
+	int intval = ( flags & 1 ) ? acc.Read( COORD_INTEGER_BITS ) + 1 : 0;
+	int fractval = ( flags & 2 ) ? acc.Read( COORD_FRACTIONAL_BITS ) : 0;
+
+	float value = intval + ((float)fractval * COORD_RESOLUTION);
+	return signbit ? -value : value;
+}
+
+static FORCEINLINE float ReadAccumulatedBitNormal( CBitReadAccumulator &acc )
+{
+	int signbit = acc.Read( 1 );
+	float value = (float)acc.Read( NORMAL_FRACTIONAL_BITS ) * NORMAL_RESOLUTION;
+	return signbit ? -value : value;
+}
+
+
 // ---------------------------------------------------------------------------------------- //
 // bf_write
 // ---------------------------------------------------------------------------------------- //
@@ -716,6 +875,197 @@ void bf_write::WriteBitAngles( const QAngle& fa )
 	WriteBitVec3Coord( tmp );
 }
 
+//-----------------------------------------------------------------------------
+// The array functions check the room once: the elements that fit even at
+// their largest go through the accumulator, and any after that are written
+// or read one at a time, with the usual overflow handling.
+//-----------------------------------------------------------------------------
+static FORCEINLINE int GetAccumulatedCount( int nCount, int nBitsLeft, int nMaxBits )
+{
+	return MIN( nCount, nBitsLeft / nMaxBits );
+}
+
+void bf_write::WriteUBitLongArray( const uint32 *pData, int nCount, int numbits )
+{
+	Assert( numbits > 0 && numbits <= 32 );
+	int nAccumulated = ( numbits > 0 ) ? GetAccumulatedCount( nCount, GetNumBitsLeft(), numbits ) : 0;
+	if ( nAccumulated > 0 )
+	{
+		CBitWriteAccumulator acc( this, nAccumulated * numbits );
+		for ( int i = 0; i < nAccumulated; i++ )
+		{
+			acc.Write( pData[i], numbits );
+		}
+		acc.Flush();
+	}
+
+	for ( int i = MAX( nAccumulated, 0 ); i < nCount; i++ )
+	{
+		WriteUBitLong( pData[i], numbits );
+	}
+}
+
+void bf_write::WriteVarInt32Array( const uint32 *pData, int nCount )
+{
+	int nAccumulated = GetAccumulatedCount( nCount, GetNumBitsLeft(), MAX_VARINT32_BITS );
+	if ( nAccumulated > 0 )
+	{
+		CBitWriteAccumulator acc( this, nAccumulated * MAX_VARINT32_BITS );
+		for ( int i = 0; i < nAccumulated; i++ )
+		{
+			uint32 data = pData[i];
+			while ( data > 0x7F )
+			{
+				acc.Write( (data & 0x7F) | 0x80, 8 );
+				data >>= 7;
+			}
+			acc.Write( data, 8 );
+		}
+		acc.Flush();
+	}
+
+	for ( int i = MAX( nAccumulated, 0 ); i < nCount; i++ )
+	{
+		WriteVarInt32( pData[i] );
+	}
+}
+
+void bf_write::WriteSignedVarInt32Array( const int32 *pData, int nCount )
+{
+	int nAccumulated = GetAccumulatedCount( nCount, GetNumBitsLeft(), MAX_VARINT32_BITS );
+	if ( nAccumulated > 0 )
+	{
+		CBitWriteAccumulator acc( this, nAccumulated * MAX_VARINT32_BITS );
+		for ( int i = 0; i < nAccumulated; i++ )
+		{
+			uint32 data = bitbuf::ZigZagEncode32( pData[i] );
+			while ( data > 0x7F )
+			{
+				acc.Write( (data & 0x7F) | 0x80, 8 );
+				data >>= 7;
+			}
+			acc.Write( data, 8 );
+		}
+		acc.Flush();
+	}
+
+	for ( int i = MAX( nAccumulated, 0 ); i < nCount; i++ )
+	{
+		WriteSignedVarInt32( pData[i] );
+	}
+}
+
+void bf_write::WriteBitCoordArray( const float *pData, int nCount )
+{
+	int nAccumulated = GetAccumulatedCount( nCount, GetNumBitsLeft(), MAX_BITCOORD_BITS );
+	if ( nAccumulated > 0 )
+	{
+		CBitWriteAccumulator acc( this, nAccumulated * MAX_BITCOORD_BITS );
+		for ( int i = 0; i < nAccumulated; i++ )
+		{
+			unsigned int bits;
+			int numbits = PackBitCoord( pData[i], bits );
+			acc.Write( bits, numbits );
+		}
+		acc.Flush();
+	}
+
+	for ( int i = MAX( nAccumulated, 0 ); i < nCount; i++ )
+	{
+		WriteBitCoord( pData[i] );
+	}
+}
+
+void bf_write::WriteBitVec3CoordArray( const Vector *pData, int nCount )
+{
+	int nAccumulated = GetAccumulatedCount( nCount, GetNumBitsLeft(), MAX_BITVEC3COORD_BITS );
+	if ( nAccumulated > 0 )
+	{
+		CBitWriteAccumulator acc( this, nAccumulated * MAX_BITVEC3COORD_BITS );
+		for ( int i = 0; i < nAccumulated; i++ )
+		{
+			const Vector &fa = pData[i];
+			int xflag = (fa[0] >= COORD_RESOLUTION) || (fa[0] <= -COORD_RESOLUTION);
+			int yflag = (fa[1] >= COORD_RESOLUTION) || (fa[1] <= -COORD_RESOLUTION);
+			int zflag = (fa[2] >= COORD_RESOLUTION) || (fa[2] <= -COORD_RESOLUTION);
+			acc.Write( xflag | ( yflag << 1 ) | ( zflag << 2 ), 3 );
+
+			unsigned int bits;
+			int numbits;
+			if ( xflag )
+			{
+				numbits = PackBitCoord( fa[0], bits );
+				acc.Write( bits, numbits );
+			}
+			if ( yflag )
+			{
+				numbits = PackBitCoord( fa[1], bits );
+				acc.Write( bits, numbits );
+			}
+			if ( zflag )
+			{
+				numbits = PackBitCoord( fa[2], bits );
+				acc.Write( bits, numbits );
+			}
+		}
+		acc.Flush();
+	}
+
+	for ( int i = MAX( nAccumulated, 0 ); i < nCount; i++ )
+	{
+		WriteBitVec3Coord( pData[i] );
+	}
+}
+
+void bf_write::WriteBitNormalArray( const float *pData, int nCount )
+{
+	int nAccumulated = GetAccumulatedCount( nCount, GetNumBitsLeft(), BITNORMAL_BITS );
+	if ( nAccumulated > 0 )
+	{
+		CBitWriteAccumulator acc( this, nAccumulated * BITNORMAL_BITS );
+		for ( int i = 0; i < nAccumulated; i++ )
+		{
+			acc.Write( PackBitNormal( pData[i] ), BITNORMAL_BITS );
+		}
+		acc.Flush();
+	}
+
+	for ( int i = MAX( nAccumulated, 0 ); i < nCount; i++ )
+	{
+		WriteBitNormal( pData[i] );
+	}
+}
+
+void bf_write::WriteBitVec3NormalArray( const Vector *pData, int nCount )
+{
+	int nAccumulated = GetAccumulatedCount( nCount, GetNumBitsLeft(), MAX_BITVEC3NORMAL_BITS );
+	if ( nAccumulated > 0 )
+	{
+		CBitWriteAccumulator acc( this, nAccumulated * MAX_BITVEC3NORMAL_BITS );
+		for ( int i = 0; i < nAccumulated; i++ )
+		{
+			const Vector &fa = pData[i];
+			int xflag = (fa[0] >= NORMAL_RESOLUTION) || (fa[0] <= -NORMAL_RESOLUTION);
+			int yflag = (fa[1] >= NORMAL_RESOLUTION) || (fa[1] <= -NORMAL_RESOLUTION);
+			acc.Write( xflag | ( yflag << 1 ), 2 );
+
+			if ( xflag )
+				acc.Write( PackBitNormal( fa[0] ), BITNORMAL_BITS );
+			if ( yflag )
+				acc.Write( PackBitNormal( fa[1] ), BITNORMAL_BITS );
+
+			// z sign bit
+			acc.Write( fa[2] <= -NORMAL_RESOLUTION, 1 );
+		}
+		acc.Flush();
+	}
+
+	for ( int i = MAX( nAccumulated, 0 ); i < nCount; i++ )
+	{
+		WriteBitVec3Normal( pData[i] );
+	}
+}
+
 void bf_write::WriteChar(int val)
 {
 	WriteSBitLong(val, sizeof(char) << 3);
@@ -1341,6 +1691,158 @@ void bf_read::ReadBitAngles( QAngle& fa )
 	fa.Init( tmp.x, tmp.y, tmp.z );
 }
 
+void bf_read::ReadUBitLongArray( uint32 *pOut, int nCount, int numbits )
+{
+	Assert( numbits > 0 && numbits <= 32 );
+	int nAccumulated = ( numbits > 0 ) ? GetAccumulatedCount( nCount, GetNumBitsLeft(), numbits ) : 0;
+	if ( nAccumulated > 0 )
+	{
+		CBitReadAccumulator acc( this );
+		for ( int i = 0; i < nAccumulated; i++ )
+		{
+			pOut[i] = acc.Read( numbits );
+		}
+		acc.Finish();
+	}
+
+	for ( int i = MAX( nAccumulated, 0 ); i < nCount; i++ )
+	{
+		pOut[i] = ReadUBitLong( numbits );
+	}
+}
+
+void bf_read::ReadVarInt32Array( uint32 *pOut, int nCount )
+{
+	int nAccumulated = GetAccumulatedCount( nCount, GetNumBitsLeft(), MAX_VARINT32_BITS );
+	if ( nAccumulated > 0 )
+	{
+		CBitReadAccumulator acc( this );
+		for ( int i = 0; i < nAccumulated; i++ )
+		{
+			pOut[i] = acc.ReadVarInt32();
+		}
+		acc.Finish();
+	}
+
+	for ( int i = MAX( nAccumulated, 0 ); i < nCount; i++ )
+	{
+		pOut[i] = ReadVarInt32();
+	}
+}
+
+void bf_read::ReadSignedVarInt32Array( int32 *pOut, int nCount )
+{
+	int nAccumulated = GetAccumulatedCount( nCount, GetNumBitsLeft(), MAX_VARINT32_BITS );
+	if ( nAccumulated > 0 )
+	{
+		CBitReadAccumulator acc( this );
+		for ( int i = 0; i < nAccumulated; i++ )
+		{
+			pOut[i] = bitbuf::ZigZagDecode32( acc.ReadVarInt32() );
+		}
+		acc.Finish();
+	}
+
+	for ( int i = MAX( nAccumulated, 0 ); i < nCount; i++ )
+	{
+		pOut[i] = ReadSignedVarInt32();
+	}
+}
+
+void bf_read::ReadBitCoordArray( float *pOut, int nCount )
+{
+	int nAccumulated = GetAccumulatedCount( nCount, GetNumBitsLeft(), MAX_BITCOORD_BITS );
+	if ( nAccumulated > 0 )
+	{
+		CBitReadAccumulator acc( this );
+		for ( int i = 0; i < nAccumulated; i++ )
+		{
+			pOut[i] = ReadAccumulatedBitCoord( acc );
+		}
+		acc.Finish();
+	}
+
+	for ( int i = MAX( nAccumulated, 0 ); i < nCount; i++ )
+	{
+		pOut[i] = ReadBitCoord();
+	}
+}
+
+void bf_read::ReadBitVec3CoordArray( Vector *pOut, int nCount )
+{
+	int nAccumulated = GetAccumulatedCount( nCount, GetNumBitsLeft(), MAX_BITVEC3COORD_BITS );
+	if ( nAccumulated > 0 )
+	{
+		CBitReadAccumulator acc( this );
+		for ( int i = 0; i < nAccumulated; i++ )
+		{
+			unsigned int flags = acc.Read( 3 );
+			pOut[i].x = ( flags & 1 ) ? ReadAccumulatedBitCoord( acc ) : 0.0f;
+			pOut[i].y = ( flags & 2 ) ? ReadAccumulatedBitCoord( acc ) : 0.0f;
+			pOut[i].z = ( flags & 4 ) ? ReadAccumulatedBitCoord( acc ) : 0.0f;
+		}
+		acc.Finish();
+	}
+
+	for ( int i = MAX( nAccumulated, 0 ); i < nCount; i++ )
+	{
+		ReadBitVec3Coord( pOut[i] );
+	}
+}
+
+void bf_read::ReadBitNormalArray( float *pOut, int nCount )
+{
+	int nAccumulated = GetAccumulatedCount( nCount, GetNumBitsLeft(), BITNORMAL_BITS );
+	if ( nAccumulated > 0 )
+	{
+		CBitReadAccumulator acc( this );
+		for ( int i = 0; i < nAccumulated; i++ )
+		{
+			pOut[i] = ReadAccumulatedBitNormal( acc );
+		}
+		acc.Finish();
+	}
+
+	for ( int i = MAX( nAccumulated, 0 ); i < nCount; i++ )
+	{
+		pOut[i] = ReadBitNormal();
+	}
+}
+
+void bf_read::ReadBitVec3NormalArray( Vector *pOut, int nCount )
+{
+	int nAccumulated = GetAccumulatedCount( nCount, GetNumBitsLeft(), MAX_BITVEC3NORMAL_BITS );
+	if ( nAccumulated > 0 )
+	{
+		CBitReadAccumulator acc( this );
+		for ( int i = 0; i < nAccumulated; i++ )
+		{
+			Vector &fa = pOut[i];
+			unsigned int flags = acc.Read( 2 );
+			fa[0] = ( flags & 1 ) ? ReadAccumulatedBitNormal( acc ) : 0.0f;
+			fa[1] = ( flags & 2 ) ? ReadAccumulatedBitNormal( acc ) : 0.0f;
+
+			// The first two imply the third (but not its sign)
+			int znegative = acc.Read( 1 );
+
+			float fafafbfb = fa[0] * fa[0] + fa[1] * fa[1];
+			if (fafafbfb < 1.0f)
+				fa[2] = sqrt( 1.0f - fafafbfb );
+			else
+				fa[2] = 0.0f;
+
+			if (znegative)
+				fa[2] = -fa[2];
+		}
+		acc.Finish();
+	}
+
+	for ( int i = MAX( nAccumulated, 0 ); i < nCount; i++ )
+	{
+		ReadBitVec3Normal( pOut[i] );
+	}
+}
+
 int64 bf_read::ReadLongLong()
 {
 	int64 retval;
@@ -1488,3 +1990,4 @@ int bf_read::CompareBitsAt( int offset, bf_read * RESTRICT other, int otherOffse
 	x ^= LoadLittleDWord( (unsigned long*)pData2End, 0 ) << (32 - iStartBit2);
 	return x & g_ExtraMasks[ numbits ];
 }
+
@@ -0,0 +1,839 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: KeyValues compiled into a flat, read only image that can be cached
+//			on disk and loaded again without tokenizing the text
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "tier1/kvcompiled.h"
+#include "tier1/utlbuffer.h"
+#include "tier1/utldict.h"
+#include "tier1/generichash.h"
+#include "tier1/checksum_crc.h"
+#include "tier1/strtools.h"
+#include "tier0/icommandline.h"
+#include "filesystem.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+#define KVC_MAGIC			MAKEID( 'K', 'V', 'C', '1' )
+#define KVC_VERSION			1
+#define KVC_CACHE_PATH		"kvcache"
+
+// Keys with more subkeys than this get a hash of their names
+#define KVC_HASH_MIN_CHILDREN	8
+
+enum
+{
+	KVC_ESCAPE_SEQUENCES = 0x1,
+};
+
+struct CCompiledKeyValues::Header_t
+{
+	uint32	m_nMagic;
+	uint32	m_nVersion;
+	uint32	m_nFlags;
+	uint32	m_nSourceName;		// the file it was compiled from, in the string table
+	uint32	m_nSourceTime;
+	uint32	m_nSourceSize;
+	uint32	m_nSourceCRC;
+	uint32	m_nNodes;
+	uint32	m_nSlots;
+	uint32	m_nStringBytes;
+	// followed by the nodes, the slots and the strings
+};
+
+// Node 0 has the top level keys as its subkeys
+struct CCompiledKeyValues::Node_t
+{
+	uint32	m_nName;			// offset in the string table
+	uint32	m_nNameHash;		// HashStringCaselessConventional of the name
+	uint32	m_nString;			// the value as KeyValues::GetString would return it
+	uint32	m_iParent;
+	uint32	m_iFirstChild;		// subkeys are [m_iFirstChild, m_iFirstChild + m_nChildren)
+	uint32	m_nChildren;
+	uint32	m_iSlots;			// if m_nSlotMask isn't 0, the subkey name hash starts here
+	uint32	m_nSlotMask;
+	uint32	m_nType;			// KeyValues::types_t
+	uint32	m_Value[2];			// int, float or uint64
+};
+
+//-----------------------------------------------------------------------------
+// CCompiledKeyValues
+//-----------------------------------------------------------------------------
+
+CCompiledKeyValues::CCompiledKeyValues() : m_pImage( NULL ), m_nImageSize( 0 )
+{
+}
+
+CCompiledKeyValues::~CCompiledKeyValues()
+{
+	Purge();
+}
+
+void CCompiledKeyValues::Purge()
+{
+	delete [] m_pImage;
+	m_pImage = NULL;
+	m_nImageSize = 0;
+}
+
+void CCompiledKeyValues::SetImage( const void *pImage, int nSize )
+{
+	Purge();
+	m_pImage = new byte[nSize];
+	m_nImageSize = nSize;
+	V_memcpy( m_pImage, pImage, nSize );
+}
+
+inline const CCompiledKeyValues::Node_t *CCompiledKeyValues::GetNode( int iNode ) const
+{
+	Assert( iNode >= 0 && iNode < (int)GetHeader()->m_nNodes );
+	return (const Node_t *)( m_pImage + sizeof( Header_t ) ) + iNode;
+}
+
+inline const char *CCompiledKeyValues::GetString( uint32 nOffset ) const
+{
+	const Header_t *pHeader = GetHeader();
+	return (const char *)( m_pImage + sizeof( Header_t ) + pHeader->m_nNodes * sizeof( Node_t ) + pHeader->m_nSlots * sizeof( uint32 ) ) + nOffset;
+}
+
+inline bool CCompiledKeyValues::IsSibling( int iNode, int iSibling ) const
+{
+	const Node_t *pParent = GetNode( GetNode( iNode )->m_iParent );
+	return iSibling < (int)( pParent->m_iFirstChild + pParent->m_nChildren );
+}
+
+CKeyValuesView CCompiledKeyValues::GetRoot() const
+{
+	if ( !m_pImage || !GetNode( 0 )->m_nChildren )
+		return CKeyValuesView();
+
+	return CKeyValuesView( this, GetNode( 0 )->m_iFirstChild );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns the first subkey called pszName, or -1
+//-----------------------------------------------------------------------------
+int CCompiledKeyValues::FindChild( int iNode, const char *pszName ) const
+{
+	const Node_t *pNode = GetNode( iNode );
+	unsigned int nHash = HashStringCaselessConventional( pszName );
+
+	if ( pNode->m_nSlotMask )
+	{
+		// Subkeys went in in order, so a duplicate name is always found after the first one
+		const uint32 *pSlots = (const uint32 *)( m_pImage + sizeof( Header_t ) + GetHeader()->m_nNodes * sizeof( Node_t ) ) + pNode->m_iSlots;
+		for ( uint32 i = nHash & pNode->m_nSlotMask; pSlots[i]; i = ( i + 1 ) & pNode->m_nSlotMask )
+		{
+			const Node_t *pChild = GetNode( pSlots[i] );
+			if ( pChild->m_nNameHash == nHash && !V_stricmp( GetString( pChild->m_nName ), pszName ) )
+				return pSlots[i];
+		}
+		return -1;
+	}
+
+	for ( uint32 i = pNode->m_iFirstChild; i < pNode->m_iFirstChild + pNode->m_nChildren; i++ )
+	{
+		const Node_t *pChild = GetNode( i );
+		if ( pChild->m_nNameHash == nHash && !V_stricmp( GetString( pChild->m_nName ), pszName ) )
+			return i;
+	}
+	return -1;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Adds a string to the string table once
+//-----------------------------------------------------------------------------
+static uint32 AddCompiledString( CUtlVector<char> &strings, CUtlDict<uint32, int> &offsets, const char *pszString )
+{
+	int i = offsets.Find( pszString );
+	if ( i != offsets.InvalidIndex() )
+		return offsets[i];
+
+	uint32 nOffset = strings.AddMultipleToTail( V_strlen( pszString ) + 1, pszString );
+	offsets.Insert( pszString, nOffset );
+	return nOffset;
+}
+
+bool CCompiledKeyValues::Compile( KeyValues *pKeyValues )
+{
+	Purge();
+
+	if ( !pKeyValues )
+		return false;
+
+	// keys[i] becomes node i, and its subkeys are appended as it is reached
+	CUtlVector<KeyValues *> keys;
+	CUtlVector<int> parents;
+	CUtlVector<Node_t> nodes;
+	CUtlVector<uint32> slots;
+	CUtlVector<char> strings;
+	CUtlDict<uint32, int> offsets( k_eDictCompareTypeCaseSensitive );
+
+	strings.AddToTail( '\0' );
+	offsets.Insert( "", 0 );
+
+	keys.AddToTail( NULL );
+	parents.AddToTail( 0 );
+	for ( KeyValues *pKey = pKeyValues; pKey; pKey = pKey->GetNextKey() )
+	{
+		keys.AddToTail( pKey );
+		parents.AddToTail( 0 );
+	}
+
+	for ( int i = 0; i < keys.Count(); i++ )
+	{
+		Node_t node;
+		V_memset( &node, 0, sizeof( node ) );
+		node.m_iParent = parents[i];
+		node.m_nType = KeyValues::TYPE_NONE;
+
+		if ( i == 0 )
+		{
+			node.m_iFirstChild = 1;
+			node.m_nChildren = keys.Count() - 1;
+			nodes.AddToTail( node );
+			continue;
+		}
+
+		KeyValues *pKey = keys[i];
+		node.m_nName = AddCompiledString( strings, offsets, pKey->GetName() );
+		node.m_nNameHash = HashStringCaselessConventional( pKey->GetName() );
+		node.m_nType = pKey->GetDataType();
+
+		// GetString would turn numbers into strings, so those are printed here the same way
+		char szValue[64];
+		switch ( node.m_nType )
+		{
+		case KeyValues::TYPE_NONE:
+			break;
+		case KeyValues::TYPE_STRING:
+			node.m_nString = AddCompiledString( strings, offsets, pKey->GetString() );
+			break;
+		case KeyValues::TYPE_INT:
+			{
+				int nValue = pKey->GetInt();
+				V_memcpy( node.m_Value, &nValue, sizeof( nValue ) );
+				V_snprintf( szValue, sizeof( szValue ), "%d", nValue );
+				node.m_nString = AddCompiledString( strings, offsets, szValue );
+			}
+			break;
+		case KeyValues::TYPE_FLOAT:
+			{
+				float flValue = pKey->GetFloat();
+				V_memcpy( node.m_Value, &flValue, sizeof( flValue ) );
+				V_snprintf( szValue, sizeof( szValue ), "%f", flValue );
+				node.m_nString = AddCompiledString( strings, offsets, szValue );
+			}
+			break;
+		case KeyValues::TYPE_UINT64:
+			{
+				uint64 nValue = pKey->GetUint64();
+				V_memcpy( node.m_Value, &nValue, sizeof( nValue ) );
+				V_snprintf( szValue, sizeof( szValue ), "%llu", (unsigned long long)nValue );
+				node.m_nString = AddCompiledString( strings, offsets, szValue );
+			}
+			break;
+		default:
+			return false;
+		}
+
+		node.m_iFirstChild = keys.Count();
+		for ( KeyValues *pSubKey = pKey->GetFirstSubKey(); pSubKey; pSubKey = pSubKey->GetNextKey() )
+		{
+			keys.AddToTail( pSubKey );
+			parents.AddToTail( i );
+			node.m_nChildren++;
+		}
+
+		nodes.AddToTail( node );
+	}
+
+	// Hash the names of the subkeys of keys that have a lot of them, at most half full
+	for ( int i = 0; i < nodes.Count(); i++ )
+	{
+		Node_t &node = nodes[i];
+		if ( node.m_nChildren <= KVC_HASH_MIN_CHILDREN )
+			continue;
+
+		uint32 nSlots = KVC_HASH_MIN_CHILDREN * 2;
+		while ( nSlots < node.m_nChildren * 2 )
+		{
+			nSlots *= 2;
+		}
+
+		node.m_iSlots = slots.Count();
+		node.m_nSlotMask = nSlots - 1;
+		slots.AddMultipleToTail( nSlots );
+		uint32 *pSlots = slots.Base() + node.m_iSlots;
+		V_memset( pSlots, 0, nSlots * sizeof( uint32 ) );
+
+		for ( uint32 iChild = node.m_iFirstChild; iChild < node.m_iFirstChild + node.m_nChildren; iChild++ )
+		{
+			uint32 iSlot = nodes[iChild].m_nNameHash & node.m_nSlotMask;
+			while ( pSlots[iSlot] )
+			{
+				iSlot = ( iSlot + 1 ) & node.m_nSlotMask;
+			}
+			pSlots[iSlot] = iChild;
+		}
+	}
+
+	Header_t header;
+	V_memset( &header, 0, sizeof( header ) );
+	header.m_nMagic = KVC_MAGIC;
+	header.m_nVersion = KVC_VERSION;
+	header.m_nNodes = nodes.Count();
+	header.m_nSlots = slots.Count();
+	header.m_nStringBytes = strings.Count();
+
+	m_nImageSize = sizeof( Header_t ) + nodes.Count() * sizeof( Node_t ) + slots.Count() * sizeof( uint32 ) + strings.Count();
+	m_pImage = new byte[m_nImageSize];
+
+	byte *pDest = m_pImage;
+	V_memcpy( pDest, &header, sizeof( header ) );
+	pDest += sizeof( header );
+	V_memcpy( pDest, nodes.Base(), nodes.Count() * sizeof( Node_t ) );
+	pDest += nodes.Count() * sizeof( Node_t );
+	if ( slots.Count() )
+	{
+		V_memcpy( pDest, slots.Base(), slots.Count() * sizeof( uint32 ) );
+		pDest += slots.Count() * sizeof( uint32 );
+	}
+	V_memcpy( pDest, strings.Base(), strings.Count() );
+
+	return true;
+}
+
+bool CCompiledKeyValues::Serialize( CUtlBuffer &buf ) const
+{
+	if ( !m_pImage )
+		return false;
+
+	buf.Put( m_pImage, m_nImageSize );
+	return buf.IsValid();
+}
+
+static bool IsValidCompiledType( uint32 nType )
+{
+	switch ( nType )
+	{
+	case KeyValues::TYPE_NONE:
+	case KeyValues::TYPE_STRING:
+	case KeyValues::TYPE_INT:
+	case KeyValues::TYPE_FLOAT:
+	case KeyValues::TYPE_UINT64:
+		return true;
+	}
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: FindChild probes from the name hash until it hits an empty slot, so
+//			the table has to be a power of two in size, have an empty slot,
+//			and only hold the node's own subkeys
+//-----------------------------------------------------------------------------
+bool CCompiledKeyValues::IsSlotTableValid( const Node_t *pNode ) const
+{
+	uint32 nSlots = pNode->m_nSlotMask + 1;
+	if ( nSlots & pNode->m_nSlotMask )
+		return false;
+
+	const uint32 *pSlots = (const uint32 *)( m_pImage + sizeof( Header_t ) + GetHeader()->m_nNodes * sizeof( Node_t ) ) + pNode->m_iSlots;
+	bool bHasEmptySlot = false;
+	for ( uint32 i = 0; i < nSlots; i++ )
+	{
+		if ( !pSlots[i] )
+		{
+			bHasEmptySlot = true;
+		}
+		else if ( pSlots[i] < pNode->m_iFirstChild || pSlots[i] - pNode->m_iFirstChild >= pNode->m_nChildren )
+		{
+			return false;
+		}
+	}
+	return bHasEmptySlot;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Reads an image back in, checking every offset in it so a damaged
+//			cache file can't send a lookup off the end
+//-----------------------------------------------------------------------------
+bool CCompiledKeyValues::Unserialize( CUtlBuffer &buf )
+{
+	Purge();
+
+	int nSize = buf.GetBytesRemaining();
+	if ( nSize < (int)sizeof( Header_t ) )
+		return false;
+
+	const Header_t *pHeader = (const Header_t *)buf.PeekGet();
+	if ( pHeader->m_nMagic != KVC_MAGIC || pHeader->m_nVersion != KVC_VERSION || !pHeader->m_nNodes || !pHeader->m_nStringBytes )
+		return false;
+
+	uint64 nExpectedSize = sizeof( Header_t ) + (uint64)pHeader->m_nNodes * sizeof( Node_t ) + (uint64)pHeader->m_nSlots * sizeof( uint32 ) + pHeader->m_nStringBytes;
+	if ( nExpectedSize != (uint64)nSize )
+		return false;
+
+	SetImage( buf.PeekGet(), nSize );
+	buf.SeekGet( CUtlBuffer::SEEK_CURRENT, nSize );
+
+	pHeader = GetHeader();
+	bool bValid = ( GetString( 0 )[pHeader->m_nStringBytes - 1] == '\0' ) && ( pHeader->m_nSourceName < pHeader->m_nStringBytes );
+	for ( uint32 i = 0; bValid && i < pHeader->m_nNodes; i++ )
+	{
+		const Node_t *pNode = GetNode( i );
+		bValid = pNode->m_nName < pHeader->m_nStringBytes &&
+			pNode->m_nString < pHeader->m_nStringBytes &&
+			pNode->m_iParent < i + ( i == 0 ) &&
+			pNode->m_iFirstChild > i && ( (uint64)pNode->m_iFirstChild + pNode->m_nChildren ) <= pHeader->m_nNodes &&
+			( !pNode->m_nSlotMask || ( (uint64)pNode->m_iSlots + pNode->m_nSlotMask + 1 ) <= pHeader->m_nSlots ) &&
+			IsValidCompiledType( pNode->m_nType );
+
+		if ( bValid && pNode->m_nSlotMask )
+		{
+			bValid = IsSlotTableValid( pNode );
+		}
+	}
+
+	if ( !bValid )
+	{
+		Purge();
+		return false;
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Cached files are named by a hash of the path ID, the file name and
+//			the parsing options. The image holds the name too, in case two hash
+//			the same.
+//-----------------------------------------------------------------------------
+static void GetKeyValuesCacheFileName( const char *resourceName, const char *pathID, bool bUsesEscapeSequences, char *pszCacheFile, int nCacheFileSize )
+{
+	char szKey[MAX_PATH * 2];
+	V_snprintf( szKey, sizeof( szKey ), "%s:%s:%d", pathID ? pathID : "", resourceName, bUsesEscapeSequences );
+	V_FixSlashes( szKey, '/' );
+	V_strlower( szKey );
+
+	V_snprintf( pszCacheFile, nCacheFileSize, "%s/%08x.kvc", KVC_CACHE_PATH, CRC32_ProcessSingleBuffer( szKey, V_strlen( szKey ) ) );
+}
+
+bool CCompiledKeyValues::LoadFromFile( IFileSystem *pFileSystem, const char *resourceName, const char *pathID, bool bUsesEscapeSequences )
+{
+	Purge();
+
+	if ( !pFileSystem->FileExists( resourceName, pathID ) )
+		return false;
+
+	uint32 nSourceTime = (uint32)pFileSystem->GetFileTime( resourceName, pathID );
+	uint32 nSourceSize = pFileSystem->Size( resourceName, pathID );
+	bool bUseCache = !CommandLine()->FindParm( "-nokvcache" );
+
+	char szCacheFile[MAX_PATH];
+	GetKeyValuesCacheFileName( resourceName, pathID, bUsesEscapeSequences, szCacheFile, sizeof( szCacheFile ) );
+
+	if ( bUseCache )
+	{
+		CUtlBuffer cached;
+		if ( pFileSystem->ReadFile( szCacheFile, "DEFAULT_WRITE_PATH", cached ) && Unserialize( cached ) )
+		{
+			const Header_t *pHeader = GetHeader();
+			if ( V_stricmp( GetString( pHeader->m_nSourceName ), resourceName ) || pHeader->m_nSourceSize != nSourceSize )
+			{
+				Purge();
+			}
+			else if ( pHeader->m_nSourceTime == nSourceTime )
+			{
+				return true;
+			}
+		}
+	}
+
+	CUtlBuffer text;
+	if ( !pFileSystem->ReadFile( resourceName, pathID, text ) )
+	{
+		Purge();
+		return false;
+	}
+
+	uint32 nSourceCRC = CRC32_ProcessSingleBuffer( text.Base(), text.TellPut() );
+
+	// A sync or a touch changes the time without changing the text, so check
+	// the contents before recompiling
+	if ( m_pImage )
+	{
+		if ( GetHeader()->m_nSourceCRC == nSourceCRC )
+		{
+			( (Header_t *)m_pImage )->m_nSourceTime = nSourceTime;
+
+			CUtlBuffer cached( m_pImage, m_nImageSize, CUtlBuffer::READ_ONLY );
+			pFileSystem->WriteFile( szCacheFile, "DEFAULT_WRITE_PATH", cached );
+			return true;
+		}
+		Purge();
+	}
+
+	// LoadFromBuffer wants two terminators in case it's a unicode file
+	text.PutChar( '\0' );
+	text.PutChar( '\0' );
+
+	KeyValues *pKeyValues = new KeyValues( resourceName );
+	pKeyValues->UsesEscapeSequences( bUsesEscapeSequences );
+	bool bOK = pKeyValues->LoadFromBuffer( resourceName, (const char *)text.Base(), pFileSystem, pathID ) && Compile( pKeyValues );
+	pKeyValues->deleteThis();
+
+	if ( !bOK )
+	{
+		Purge();
+		return false;
+	}
+
+	// The name goes on the end of the string table, where Compile left no offsets
+	int nNameLen = V_strlen( resourceName ) + 1;
+	byte *pImage = new byte[m_nImageSize + nNameLen];
+	V_memcpy( pImage, m_pImage, m_nImageSize );
+	V_memcpy( pImage + m_nImageSize, resourceName, nNameLen );
+	delete [] m_pImage;
+	m_pImage = pImage;
+
+	Header_t *pHeader = (Header_t *)m_pImage;
+	pHeader->m_nFlags = bUsesEscapeSequences ? KVC_ESCAPE_SEQUENCES : 0;
+	pHeader->m_nSourceName = pHeader->m_nStringBytes;
+	pHeader->m_nSourceTime = nSourceTime;
+	pHeader->m_nSourceSize = nSourceSize;
+	pHeader->m_nSourceCRC = nSourceCRC;
+	pHeader->m_nStringBytes += nNameLen;
+	m_nImageSize += nNameLen;
+
+	const char *pszText = (const char *)text.Base();
+	if ( bUseCache && !V_stristr( pszText, "#include" ) && !V_stristr( pszText, "#base" ) )
+	{
+		pFileSystem->CreateDirHierarchy( KVC_CACHE_PATH, "DEFAULT_WRITE_PATH" );
+
+		CUtlBuffer cached( m_pImage, m_nImageSize, CUtlBuffer::READ_ONLY );
+		if ( !pFileSystem->WriteFile( szCacheFile, "DEFAULT_WRITE_PATH", cached ) )
+		{
+			DevMsg( "CCompiledKeyValues: couldn't write %s for %s\n", szCacheFile, resourceName );
+		}
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// CKeyValuesView
+//-----------------------------------------------------------------------------
+
+const char *CKeyValuesView::GetName() const
+{
+	if ( !m_pOwner )
+		return "";
+
+	return m_pOwner->GetString( m_pOwner->GetNode( m_iNode )->m_nName );
+}
+
+KeyValues::types_t CKeyValuesView::GetDataType() const
+{
+	if ( !m_pOwner )
+		return KeyValues::TYPE_NONE;
+
+	return (KeyValues::types_t)m_pOwner->GetNode( m_iNode )->m_nType;
+}
+
+CKeyValuesView CKeyValuesView::FindKey( const char *keyName ) const
+{
+	if ( !m_pOwner )
+		return CKeyValuesView();
+
+	if ( !keyName || !keyName[0] )
+		return *this;
+
+	// Walk down one '/' separated name at a time
+	int iNode = m_iNode;
+	char szName[256];
+	while ( keyName )
+	{
+		const char *pszSlash = strchr( keyName, '/' );
+		if ( pszSlash )
+		{
+			V_strncpy( szName, keyName, MIN( (int)( pszSlash - keyName ) + 1, (int)sizeof( szName ) ) );
+			keyName = pszSlash + 1;
+		}
+		else
+		{
+			V_strncpy( szName, keyName, sizeof( szName ) );
+			keyName = NULL;
+		}
+
+		iNode = m_pOwner->FindChild( iNode, szName );
+		if ( iNode < 0 )
+			return CKeyValuesView();
+	}
+
+	return CKeyValuesView( m_pOwner, iNode );
+}
+
+CKeyValuesView CKeyValuesView::GetFirstSubKey() const
+{
+	if ( !m_pOwner || !m_pOwner->GetNode( m_iNode )->m_nChildren )
+		return CKeyValuesView();
+
+	return CKeyValuesView( m_pOwner, m_pOwner->GetNode( m_iNode )->m_iFirstChild );
+}
+
+CKeyValuesView CKeyValuesView::GetNextKey() const
+{
+	if ( !m_pOwner || !m_pOwner->IsSibling( m_iNode, m_iNode + 1 ) )
+		return CKeyValuesView();
+
+	return CKeyValuesView( m_pOwner, m_iNode + 1 );
+}
+
+CKeyValuesView CKeyValuesView::GetFirstTrueSubKey() const
+{
+	CKeyValuesView subKey = GetFirstSubKey();
+	while ( subKey.IsValid() && subKey.GetDataType() != KeyValues::TYPE_NONE )
+	{
+		subKey = subKey.GetNextKey();
+	}
+	return subKey;
+}
+
+CKeyValuesView CKeyValuesView::GetNextTrueSubKey() const
+{
+	CKeyValuesView subKey = GetNextKey();
+	while ( subKey.IsValid() && subKey.GetDataType() != KeyValues::TYPE_NONE )
+	{
+		subKey = subKey.GetNextKey();
+	}
+	return subKey;
+}
+
+CKeyValuesView CKeyValuesView::GetFirstValue() const
+{
+	CKeyValuesView subKey = GetFirstSubKey();
+	while ( subKey.IsValid() && subKey.GetDataType() == KeyValues::TYPE_NONE )
+	{
+		subKey = subKey.GetNextKey();
+	}
+	return subKey;
+}
+
+CKeyValuesView CKeyValuesView::GetNextValue() const
+{
+	CKeyValuesView subKey = GetNextKey();
+	while ( subKey.IsValid() && subKey.GetDataType() == KeyValues::TYPE_NONE )
+	{
+		subKey = subKey.GetNextKey();
+	}
+	return subKey;
+}
+
+const char *CKeyValuesView::GetString( const char *keyName, const char *defaultValue ) const
+{
+	CKeyValuesView key = FindKey( keyName );
+	if ( !key.IsValid() || key.GetDataType() == KeyValues::TYPE_NONE )
+		return defaultValue;
+
+	return m_pOwner->GetString( m_pOwner->GetNode( key.m_iNode )->m_nString );
+}
+
+int CKeyValuesView::GetInt( const char *keyName, int defaultValue ) const
+{
+	CKeyValuesView key = FindKey( keyName );
+	if ( !key.IsValid() )
+		return defaultValue;
+
+	const CCompiledKeyValues::Node_t *pNode = m_pOwner->GetNode( key.m_iNode );
+	switch ( pNode->m_nType )
+	{
+	case KeyValues::TYPE_STRING:
+		return atoi( m_pOwner->GetString( pNode->m_nString ) );
+	case KeyValues::TYPE_FLOAT:
+		{
+			float flValue;
+			V_memcpy( &flValue, pNode->m_Value, sizeof( flValue ) );
+			return (int)flValue;
+		}
+	case KeyValues::TYPE_UINT64:
+		// can't convert, since it would lose data
+		Assert( 0 );
+		return 0;
+	case KeyValues::TYPE_INT:
+	default:
+		{
+			int nValue;
+			V_memcpy( &nValue, pNode->m_Value, sizeof( nValue ) );
+			return nValue;
+		}
+	}
+}
+
+uint64 CKeyValuesView::GetUint64( const char *keyName, uint64 defaultValue ) const
+{
+	CKeyValuesView key = FindKey( keyName );
+	if ( !key.IsValid() )
+		return defaultValue;
+
+	const CCompiledKeyValues::Node_t *pNode = m_pOwner->GetNode( key.m_iNode );
+	switch ( pNode->m_nType )
+	{
+	case KeyValues::TYPE_STRING:
+		return (uint64)V_atoi64( m_pOwner->GetString( pNode->m_nString ) );
+	case KeyValues::TYPE_FLOAT:
+		{
+			float flValue;
+			V_memcpy( &flValue, pNode->m_Value, sizeof( flValue ) );
+			return (int)flValue;
+		}
+	case KeyValues::TYPE_UINT64:
+		{
+			uint64 nValue;
+			V_memcpy( &nValue, pNode->m_Value, sizeof( nValue ) );
+			return nValue;
+		}
+	case KeyValues::TYPE_INT:
+	default:
+		{
+			int nValue;
+			V_memcpy( &nValue, pNode->m_Value, sizeof( nValue ) );
+			return nValue;
+		}
+	}
+}
+
+float CKeyValuesView::GetFloat( const char *keyName, float defaultValue ) const
+{
+	CKeyValuesView key = FindKey( keyName );
+	if ( !key.IsValid() )
+		return defaultValue;
+
+	const CCompiledKeyValues::Node_t *pNode = m_pOwner->GetNode( key.m_iNode );
+	switch ( pNode->m_nType )
+	{
+	case KeyValues::TYPE_STRING:
+		return (float)atof( m_pOwner->GetString( pNode->m_nString ) );
+	case KeyValues::TYPE_FLOAT:
+		{
+			float flValue;
+			V_memcpy( &flValue, pNode->m_Value, sizeof( flValue ) );
+			return flValue;
+		}
+	case KeyValues::TYPE_INT:
+		{
+			int nValue;
+			V_memcpy( &nValue, pNode->m_Value, sizeof( nValue ) );
+			return (float)nValue;
+		}
+	case KeyValues::TYPE_UINT64:
+		{
+			uint64 nValue;
+			V_memcpy( &nValue, pNode->m_Value, sizeof( nValue ) );
+			return (float)nValue;
+		}
+	default:
+		return 0.0f;
+	}
+}
+
+bool CKeyValuesView::GetBool( const char *keyName, bool defaultValue ) const
+{
+	if ( !FindKey( keyName ).IsValid() )
+		return defaultValue;
+
+	return 0 != GetInt( keyName, 0 );
+}
+
+bool CKeyValuesView::IsEmpty( const char *keyName ) const
+{
+	CKeyValuesView key = FindKey( keyName );
+	if ( !key.IsValid() )
+		return true;
+
+	return key.GetDataType() == KeyValues::TYPE_NONE && !key.GetFirstSubKey().IsValid();
+}
+
+void CKeyValuesView::FillKeyValues( KeyValues *pKeyValues ) const
+{
+	const CCompiledKeyValues::Node_t *pNode = m_pOwner->GetNode( m_iNode );
+	switch ( pNode->m_nType )
+	{
+	case KeyValues::TYPE_STRING:
+		pKeyValues->SetStringValue( m_pOwner->GetString( pNode->m_nString ) );
+		break;
+	case KeyValues::TYPE_INT:
+		pKeyValues->SetInt( NULL, GetInt() );
+		break;
+	case KeyValues::TYPE_FLOAT:
+		pKeyValues->SetFloat( NULL, GetFloat() );
+		break;
+	case KeyValues::TYPE_UINT64:
+		pKeyValues->SetUint64( NULL, GetUint64() );
+		break;
+	}
+
+	if ( m_pOwner->GetHeader()->m_nFlags & KVC_ESCAPE_SEQUENCES )
+	{
+		pKeyValues->UsesEscapeSequences( true );
+	}
+
+	// Chain the subkeys directly, AddSubKey would walk the list every time
+	KeyValues *pPrevious = NULL;
+	for ( CKeyValuesView subKey = GetFirstSubKey(); subKey.IsValid(); subKey = subKey.GetNextKey() )
+	{
+		KeyValues *pSubKey = new KeyValues( subKey.GetName() );
+		subKey.FillKeyValues( pSubKey );
+
+		if ( pPrevious )
+		{
+			pPrevious->SetNextKey( pSubKey );
+		}
+		else
+		{
+			pKeyValues->AddSubKey( pSubKey );
+		}
+		pPrevious = pSubKey;
+	}
+}
+
+KeyValues *CKeyValuesView::MakeKeyValues() const
+{
+	if ( !m_pOwner )
+		return NULL;
+
+	KeyValues *pKeyValues = new KeyValues( GetName() );
+	FillKeyValues( pKeyValues );
+	return pKeyValues;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: LoadFromFile through the cache for code that wants a KeyValues.
+//			The top level keys after the first are chained on as its peers, as
+//			KeyValues::LoadFromFile does.
+//-----------------------------------------------------------------------------
+KeyValues *LoadKeyValuesCached( IFileSystem *pFileSystem, const char *resourceName, const char *pathID, bool bUsesEscapeSequences )
+{
+	CCompiledKeyValues compiled;
+	if ( !compiled.LoadFromFile( pFileSystem, resourceName, pathID, bUsesEscapeSequences ) )
+		return NULL;
+
+	CKeyValuesView root = compiled.GetRoot();
+	if ( !root.IsValid() )
+		return NULL;
+
+	KeyValues *pKeyValues = root.MakeKeyValues();
+	KeyValues *pPrevious = pKeyValues;
+	for ( CKeyValuesView peer = root.GetNextKey(); peer.IsValid(); peer = peer.GetNextKey() )
+	{
+		KeyValues *pPeer = peer.MakeKeyValues();
+		pPrevious->SetNextKey( pPeer );
+		pPrevious = pPeer;
+	}
+
+	return pKeyValues;
+}
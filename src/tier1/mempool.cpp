@@ -310,3 +310,315 @@ void CUtlMemoryPool::Free( void *memBlock )
 }
 
 
+
+
+//-----------------------------------------------------------------------------
+// CMemoryPoolMT
+//
+// A magazine is a chain of free blocks linked through their first word. In the
+// depot the head block's first word is the list link, so the rest of the chain
+// hangs off its second word instead.
+//-----------------------------------------------------------------------------
+
+// Which cache each thread tries first, 1 based so that 0 means not assigned yet
+static CTHREADLOCALINT g_iMemoryPoolThread;
+static CInterlockedInt g_nMemoryPoolThreads;
+
+CMemoryPoolMT::CMemoryPoolMT( int blockSize, int numElements, int growMode, const char *pszAllocOwner, int nAlignment )
+ :	CUtlMemoryPool( MAX( blockSize, (int)( 2 * sizeof( void * ) ) ), numElements, growMode, pszAllocOwner, MAX( nAlignment, TSLIST_NODE_ALIGNMENT ) ),
+	m_nUncachedCount( 0 )
+{
+	COMPILE_TIME_ASSERT( sizeof( ThreadCache_t ) == 64 );
+	V_memset( m_Caches, 0, sizeof( m_Caches ) );
+}
+
+CMemoryPoolMT::~CMemoryPoolMT()
+{
+	// give the cached blocks back so the leak report is right
+	Flush();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Claims this thread's cache, or one near it if that's busy. Returns
+//			NULL rather than waiting if none of them are free.
+//-----------------------------------------------------------------------------
+CMemoryPoolMT::ThreadCache_t *CMemoryPoolMT::LockCache()
+{
+	int iThread = g_iMemoryPoolThread;
+	if ( !iThread )
+	{
+		iThread = ++g_nMemoryPoolThreads;
+		g_iMemoryPoolThread = iThread;
+	}
+
+	for ( int i = 0; i < CACHE_PROBES; i++ )
+	{
+		ThreadCache_t *pCache = &m_Caches[ (unsigned)( iThread - 1 + i ) % MAX_THREAD_CACHES ];
+		if ( !pCache->m_nLock && ThreadInterlockedAssignIf( &pCache->m_nLock, 1, 0 ) )
+		{
+			ThreadMemoryBarrier();
+			return pCache;
+		}
+	}
+
+	++m_nContended;
+	return NULL;
+}
+
+void CMemoryPoolMT::UnlockCache( ThreadCache_t *pCache )
+{
+	ThreadMemoryBarrier();
+	ThreadInterlockedExchange( &pCache->m_nLock, 0 );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Gives an empty cache a magazine, from the cache itself, the depot
+//			or, failing those, the pool
+//-----------------------------------------------------------------------------
+void CMemoryPoolMT::RefillCache( ThreadCache_t *pCache )
+{
+	Assert( !pCache->m_nLoaded );
+
+	if ( pCache->m_nPrevious )
+	{
+		pCache->m_pLoaded = pCache->m_pPrevious;
+		pCache->m_nLoaded = pCache->m_nPrevious;
+		pCache->m_pPrevious = NULL;
+		pCache->m_nPrevious = 0;
+		return;
+	}
+
+	void *pMagazine = PopMagazine();
+	if ( pMagazine )
+	{
+		pCache->m_pLoaded = pMagazine;
+		pCache->m_nLoaded = MAGAZINE_SIZE;
+	}
+	else
+	{
+		if ( !m_mutex.TryLock() )
+		{
+			++m_nContended;
+			m_mutex.Lock();
+		}
+
+		// this can come up short if the pool can't grow
+		while ( pCache->m_nLoaded < MAGAZINE_SIZE )
+		{
+			void *pBlock = CUtlMemoryPool::Alloc( m_BlockSize );
+			if ( !pBlock )
+				break;
+
+			*(void **)pBlock = pCache->m_pLoaded;
+			pCache->m_pLoaded = pBlock;
+			pCache->m_nLoaded++;
+		}
+
+		m_mutex.Unlock();
+	}
+
+	UpdatePeak();
+}
+
+void CMemoryPoolMT::PushMagazine( void *pMagazine )
+{
+	void **pHead = (void **)pMagazine;
+	pHead[1] = pHead[0];
+	m_Depot.Push( (TSLNodeBase_t *)pHead );
+}
+
+void *CMemoryPoolMT::PopMagazine()
+{
+	void **pHead = (void **)m_Depot.Pop();
+	if ( pHead )
+	{
+		pHead[0] = pHead[1];
+	}
+	return pHead;
+}
+
+// Call with m_mutex held
+void CMemoryPoolMT::FreeMagazine( void *pMagazine )
+{
+	while ( pMagazine )
+	{
+		void *pNext = *(void **)pMagazine;
+		CUtlMemoryPool::Free( pMagazine );
+		pMagazine = pNext;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns every cached block to the pool
+//-----------------------------------------------------------------------------
+void CMemoryPoolMT::Flush()
+{
+	AUTO_LOCK( m_mutex );
+
+	for ( int i = 0; i < MAX_THREAD_CACHES; i++ )
+	{
+		ThreadCache_t *pCache = &m_Caches[i];
+		FreeMagazine( pCache->m_pLoaded );
+		FreeMagazine( pCache->m_pPrevious );
+		pCache->m_pLoaded = pCache->m_pPrevious = NULL;
+		pCache->m_nLoaded = pCache->m_nPrevious = 0;
+	}
+
+	while ( void *pMagazine = PopMagazine() )
+	{
+		FreeMagazine( pMagazine );
+	}
+}
+
+void CMemoryPoolMT::UpdatePeak()
+{
+	int nCount = Count();
+	for (;;)
+	{
+		int nPeak = m_nPeakCount;
+		if ( nCount <= nPeak || m_nPeakCount.AssignIf( nPeak, nCount ) )
+			break;
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+void *CMemoryPoolMT::Alloc()
+{
+	return Alloc( m_BlockSize );
+}
+
+void *CMemoryPoolMT::AllocZero()
+{
+	return AllocZero( m_BlockSize );
+}
+
+void *CMemoryPoolMT::Alloc( size_t amount )
+{
+	if ( amount > (unsigned int)m_BlockSize )
+		return NULL;
+
+	ThreadCache_t *pCache = LockCache();
+	if ( !pCache )
+	{
+		AUTO_LOCK( m_mutex );
+		void *pBlock = CUtlMemoryPool::Alloc( amount );
+		if ( pBlock )
+		{
+			m_nUncachedCount++;
+		}
+		return pBlock;
+	}
+
+	if ( !pCache->m_nLoaded )
+	{
+		RefillCache( pCache );
+	}
+
+	void *pBlock = pCache->m_pLoaded;
+	if ( pBlock )
+	{
+		pCache->m_pLoaded = *(void **)pBlock;
+		pCache->m_nLoaded--;
+		pCache->m_nAllocs++;
+	}
+
+	UnlockCache( pCache );
+	return pBlock;
+}
+
+void *CMemoryPoolMT::AllocZero( size_t amount )
+{
+	void *mem = Alloc( amount );
+	if ( mem )
+	{
+		V_memset( mem, 0x00, amount );
+	}
+	return mem;
+}
+
+void CMemoryPoolMT::Free( void *pMem )
+{
+	if ( !pMem )
+		return;
+
+#ifdef _DEBUG
+	// invalidate the memory
+	memset( pMem, 0xDD, m_BlockSize );
+#endif
+
+	ThreadCache_t *pCache = LockCache();
+	if ( !pCache )
+	{
+		AUTO_LOCK( m_mutex );
+		CUtlMemoryPool::Free( pMem );
+		m_nUncachedCount--;
+		return;
+	}
+
+	if ( pCache->m_nLoaded == MAGAZINE_SIZE )
+	{
+		// keep the full one as the previous magazine, and if that was full
+		// already send it to the depot
+		if ( pCache->m_nPrevious )
+		{
+			PushMagazine( pCache->m_pPrevious );
+		}
+		pCache->m_pPrevious = pCache->m_pLoaded;
+		pCache->m_nPrevious = MAGAZINE_SIZE;
+		pCache->m_pLoaded = NULL;
+		pCache->m_nLoaded = 0;
+	}
+
+	if ( pCache->m_nFrees >= pCache->m_nAllocs )
+	{
+		pCache->m_nCrossThreadFrees++;
+	}
+
+	*(void **)pMem = pCache->m_pLoaded;
+	pCache->m_pLoaded = pMem;
+	pCache->m_nLoaded++;
+	pCache->m_nFrees++;
+
+	UnlockCache( pCache );
+}
+
+void CMemoryPoolMT::Clear()
+{
+	AUTO_LOCK( m_mutex );
+
+	V_memset( m_Caches, 0, sizeof( m_Caches ) );
+	m_Depot.Detach();
+	m_nUncachedCount = 0;
+	CUtlMemoryPool::Clear();
+}
+
+//-----------------------------------------------------------------------------
+
+int CMemoryPoolMT::Count()
+{
+	int nCount = m_nUncachedCount;
+	for ( int i = 0; i < MAX_THREAD_CACHES; i++ )
+	{
+		nCount += m_Caches[i].m_nAllocs - m_Caches[i].m_nFrees;
+	}
+	return nCount;
+}
+
+int CMemoryPoolMT::PeakCount()
+{
+	return m_nPeakCount;
+}
+
+void CMemoryPoolMT::GetStats( MemoryPoolMTStats_t &stats )
+{
+	stats.m_nCount = Count();
+	stats.m_nPeakCount = m_nPeakCount;
+	stats.m_nContended = m_nContended;
+	stats.m_nCrossThreadFrees = 0;
+	for ( int i = 0; i < MAX_THREAD_CACHES; i++ )
+	{
+		stats.m_nCrossThreadFrees += m_Caches[i].m_nCrossThreadFrees;
+	}
+	stats.m_nDepotMagazines = m_Depot.Count();
+}
@@ -12,6 +12,7 @@ bool CheckMMXTechnology(void) { return false; }
 bool CheckSSETechnology(void) { return false; }
 bool CheckSSE2Technology(void) { return false; }
 bool Check3DNowTechnology(void) { return false; }
+bool CheckAVXTechnology(void) { return false; }
 
 #elif defined( _WIN32 ) && !defined( _X360 )
 
@@ -269,6 +270,59 @@ bool Check3DNowTechnology(void)
     return retval;
 }
 
+bool CheckAVXTechnology(void)
+{
+    int retval = true;
+    unsigned int RegECX = 0;
+    unsigned int RegXCR0 = 0;
+
+#ifdef CPUID
+	_asm pushad;
+#endif
+
+	// Do we have support for the CPUID function?
+    __try
+	{
+        _asm
+		{
+            mov eax, 1				// set up CPUID to return processor version and features
+            CPUID					// code bytes = 0fh,  0a2h
+            mov RegECX, ecx			// AVX and OSXSAVE flags returned in ecx
+		}
+    } 
+	__except(EXCEPTION_EXECUTE_HANDLER) 
+	{ 
+		retval = false; 
+	}
+
+    if (retval)
+	{
+		// bit 28 is set for AVX, bit 27 is set if the OS enabled XSAVE/XGETBV
+		if ( ( RegECX & 0x18000000 ) == 0x18000000 )
+		{
+			// Make sure the OS saves the upper halves of the ymm registers on context switches
+			_asm
+			{
+				xor ecx, ecx		// XCR0
+				_emit 0x0f			// xgetbv
+				_emit 0x01
+				_emit 0xd0
+				mov RegXCR0, eax
+			}
+
+			if ( ( RegXCR0 & 0x6 ) != 0x6 )	// bit 1 = xmm state, bit 2 = ymm state
+				retval = false;
+		}
+		else
+			retval = false;
+	}
+#ifdef CPUID
+	_asm popad;
+#endif
+
+    return retval;
+}
+
 #pragma optimize( "", on )
 
 #endif // _WIN32
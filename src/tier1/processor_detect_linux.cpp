@@ -45,3 +45,18 @@ bool Check3DNowTechnology(void)
     }
     return false;
 }
+
+bool CheckAVXTechnology(void)
+{
+    unsigned long eax,ebx,ecx,edx;
+    cpuid(1,eax,ebx,ecx,edx);
+
+	// bit 28 is set for AVX, bit 27 is set if the OS enabled XSAVE/XGETBV
+	if ( ( ecx & 0x18000000 ) != 0x18000000 )
+		return false;
+
+	// Make sure the OS saves the xmm and ymm register state
+	unsigned long xcr0_lo, xcr0_hi;
+	asm(".byte 0x0f, 0x01, 0xd0" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+	return ( xcr0_lo & 0x6 ) == 0x6;
+}
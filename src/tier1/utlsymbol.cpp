@@ -14,6 +14,7 @@
 #include "tier0/memdbgon.h"
 #include "stringpool.h"
 #include "utlhashtable.h"
+#include "generichash.h"
 #include "utlstring.h"
 
 // Ensure that everybody has the right compiler version installed. The version
@@ -288,6 +289,302 @@ void CUtlSymbolTable::RemoveAll()
 }
 
 
+//-----------------------------------------------------------------------------
+// CUtlConcurrentSymbolTable
+//-----------------------------------------------------------------------------
+
+static inline int HighestBitSet( unsigned int n )
+{
+	Assert( n );
+#ifdef COMPILER_MSVC
+	unsigned long iBit;
+	_BitScanReverse( &iBit, n );
+	return iBit;
+#else
+	return 31 - __builtin_clz( n );
+#endif
+}
+
+CUtlConcurrentSymbolTable::CUtlConcurrentSymbolTable( int initSize, bool caseInsensitive, int maxStrings ) :
+	m_nMaxStrings( maxStrings ), m_bInsensitive( caseInsensitive )
+{
+	// Keep each shard at most half full
+	m_nShardSlots = MIN_SHARD_SLOTS;
+	while ( m_nShardSlots * NUM_SHARDS < initSize * 2 )
+	{
+		m_nShardSlots *= 2;
+	}
+
+	for ( int i = 0; i < NUM_SHARDS; i++ )
+	{
+		m_Shards[i].m_pTable = NULL;
+		m_Shards[i].m_nUsed = 0;
+		m_Shards[i].m_pPool = NULL;
+		m_Shards[i].m_nPoolUsed = 0;
+	}
+	memset( m_pSegments, 0, sizeof( m_pSegments ) );
+	m_nStrings = 0;
+}
+
+CUtlConcurrentSymbolTable::~CUtlConcurrentSymbolTable()
+{
+	RemoveAll();
+}
+
+//-----------------------------------------------------------------------------
+// HashString and HashStringCaseless only have 16 bits, and the shard comes from
+// the top ones, so this uses the 32 bit conventional hash and mixes it up.
+//-----------------------------------------------------------------------------
+inline unsigned int CUtlConcurrentSymbolTable::HashString( const char *pString ) const
+{
+	unsigned int nHash;
+	if ( m_bInsensitive )
+	{
+		nHash = HashStringCaselessConventional( pString );
+	}
+	else
+	{
+		nHash = 0xAAAAAAAA;
+		for ( ; *pString; pString++ )
+		{
+			nHash = ( ( nHash << 5 ) + nHash ) + (uint8)*pString;
+		}
+	}
+	return HashIntAlternate( nHash );
+}
+
+//-----------------------------------------------------------------------------
+// Probes one version of a shard's slots. An insert that races with this
+// either has published its entry pointer, and the entry is complete, or
+// hasn't and the probe stops at the empty slot.
+//-----------------------------------------------------------------------------
+CUtlConcurrentSymbolTable::Entry_t *CUtlConcurrentSymbolTable::FindEntry( SlotTable_t const *pTable, const char *pString, unsigned int nHash ) const
+{
+	if ( !pTable )
+		return NULL;
+
+	for ( int i = nHash & pTable->m_nMask; ; i = ( i + 1 ) & pTable->m_nMask )
+	{
+		Entry_t *pEntry = pTable->m_pSlots[i];
+		if ( !pEntry )
+			return NULL;
+
+		if ( pEntry->m_nHash == nHash &&
+			( m_bInsensitive ? !V_stricmp( pEntry->m_String, pString ) : !V_strcmp( pEntry->m_String, pString ) ) )
+			return pEntry;
+	}
+}
+
+int CUtlConcurrentSymbolTable::Find( const char *pString ) const
+{
+	if ( !pString )
+		return -1;
+
+	unsigned int nHash = HashString( pString );
+	Entry_t *pEntry = FindEntry( m_Shards[nHash >> ( 32 - SHARD_BITS )].m_pTable, pString, nHash );
+	return pEntry ? pEntry->m_nSymbol : -1;
+}
+
+//-----------------------------------------------------------------------------
+// Entries are carved out of the shard's pools, which are only freed by
+// RemoveAll. Called with the shard locked.
+//-----------------------------------------------------------------------------
+CUtlConcurrentSymbolTable::Entry_t *CUtlConcurrentSymbolTable::AllocEntry( Shard_t &shard, int nLen )
+{
+	int nSize = ( offsetof( Entry_t, m_String ) + nLen + 1 + 3 ) & ~3;
+
+	if ( nSize > POOL_SIZE - (int)sizeof( char * ) )
+	{
+		// Too big for a pool, so it gets its own, linked in behind the current one
+		char *pPool = (char *)malloc( sizeof( char * ) + nSize );
+		if ( shard.m_pPool )
+		{
+			*(char **)pPool = *(char **)shard.m_pPool;
+			*(char **)shard.m_pPool = pPool;
+		}
+		else
+		{
+			*(char **)pPool = NULL;
+			shard.m_pPool = pPool;
+			shard.m_nPoolUsed = POOL_SIZE;
+		}
+		return (Entry_t *)( pPool + sizeof( char * ) );
+	}
+
+	if ( !shard.m_pPool || shard.m_nPoolUsed + nSize > POOL_SIZE )
+	{
+		char *pPool = (char *)malloc( POOL_SIZE );
+		*(char **)pPool = shard.m_pPool;
+		shard.m_pPool = pPool;
+		shard.m_nPoolUsed = sizeof( char * );
+	}
+
+	Entry_t *pEntry = (Entry_t *)( shard.m_pPool + shard.m_nPoolUsed );
+	shard.m_nPoolUsed += nSize;
+	return pEntry;
+}
+
+void CUtlConcurrentSymbolTable::InsertEntry( SlotTable_t *pTable, Entry_t *pEntry )
+{
+	int i = pEntry->m_nHash & pTable->m_nMask;
+	while ( pTable->m_pSlots[i] )
+	{
+		i = ( i + 1 ) & pTable->m_nMask;
+	}
+	pTable->m_pSlots[i] = pEntry;
+}
+
+//-----------------------------------------------------------------------------
+// Segment n of the symbol to string map holds symbols [64 * (2^n - 1), 64 * (2^(n+1) - 1))
+//-----------------------------------------------------------------------------
+void CUtlConcurrentSymbolTable::SetSymbolString( int nSymbol, const char *pString )
+{
+	unsigned int n = (unsigned int)nSymbol + ( 1 << FIRST_SEGMENT_BITS );
+	int iHighBit = HighestBitSet( n );
+	int iSegment = iHighBit - FIRST_SEGMENT_BITS;
+
+	if ( !m_pSegments[iSegment] )
+	{
+		// Other shards may be adding the first string of this segment too
+		int nSize = ( 1 << iHighBit ) * sizeof( const char * );
+		const char **pSegment = (const char **)malloc( nSize );
+		memset( pSegment, 0, nSize );
+		if ( !ThreadInterlockedAssignPointerIf( (void * volatile *)&m_pSegments[iSegment], pSegment, NULL ) )
+		{
+			free( pSegment );
+		}
+	}
+
+	m_pSegments[iSegment][n - ( 1 << iHighBit )] = pString;
+}
+
+const char *CUtlConcurrentSymbolTable::String( int nSymbol ) const
+{
+	if ( nSymbol < 0 || nSymbol >= m_nStrings )
+		return "";
+
+	unsigned int n = (unsigned int)nSymbol + ( 1 << FIRST_SEGMENT_BITS );
+	int iHighBit = HighestBitSet( n );
+	const char *pString = m_pSegments[iHighBit - FIRST_SEGMENT_BITS][n - ( 1 << iHighBit )];
+	Assert( pString );
+	return pString ? pString : "";
+}
+
+//-----------------------------------------------------------------------------
+// Finds and/or creates a symbol based on the string
+//-----------------------------------------------------------------------------
+int CUtlConcurrentSymbolTable::AddString( const char *pString )
+{
+	if ( !pString )
+		return -1;
+
+	unsigned int nHash = HashString( pString );
+	Shard_t &shard = m_Shards[nHash >> ( 32 - SHARD_BITS )];
+
+	Entry_t *pEntry = FindEntry( shard.m_pTable, pString, nHash );
+	if ( pEntry )
+		return pEntry->m_nSymbol;
+
+	AUTO_LOCK_FM( shard.m_mutex );
+
+	// Someone may have added it while we waited for the lock
+	SlotTable_t *pTable = shard.m_pTable;
+	pEntry = FindEntry( pTable, pString, nHash );
+	if ( pEntry )
+		return pEntry->m_nSymbol;
+
+	int nSymbol;
+	do
+	{
+		nSymbol = m_nStrings;
+		if ( nSymbol >= m_nMaxStrings )
+		{
+			AssertMsg1( false, "Symbol table is full (%d strings)\n", m_nMaxStrings );
+			return -1;
+		}
+	} while ( !m_nStrings.AssignIf( nSymbol, nSymbol + 1 ) );
+
+	int nLen = V_strlen( pString );
+	pEntry = AllocEntry( shard, nLen );
+	pEntry->m_nHash = nHash;
+	pEntry->m_nSymbol = nSymbol;
+	memcpy( pEntry->m_String, pString, nLen + 1 );
+	SetSymbolString( nSymbol, pEntry->m_String );
+
+	if ( !pTable || ( shard.m_nUsed + 1 ) * 2 > pTable->m_nMask + 1 )
+	{
+		int nSlots = pTable ? ( pTable->m_nMask + 1 ) * 2 : m_nShardSlots;
+		int nSize = offsetof( SlotTable_t, m_pSlots ) + nSlots * sizeof( Entry_t * );
+		SlotTable_t *pNewTable = (SlotTable_t *)malloc( nSize );
+		memset( pNewTable, 0, nSize );
+		pNewTable->m_pRetired = pTable;
+		pNewTable->m_nMask = nSlots - 1;
+
+		if ( pTable )
+		{
+			for ( int i = 0; i <= pTable->m_nMask; i++ )
+			{
+				if ( pTable->m_pSlots[i] )
+				{
+					InsertEntry( pNewTable, pTable->m_pSlots[i] );
+				}
+			}
+		}
+		InsertEntry( pNewTable, pEntry );
+
+		ThreadMemoryBarrier();
+		shard.m_pTable = pNewTable;
+	}
+	else
+	{
+		// The entry and its symbol must be visible before the slot is
+		ThreadMemoryBarrier();
+		InsertEntry( pTable, pEntry );
+	}
+
+	shard.m_nUsed++;
+	return nSymbol;
+}
+
+//-----------------------------------------------------------------------------
+// Remove all symbols in the table.
+//-----------------------------------------------------------------------------
+void CUtlConcurrentSymbolTable::RemoveAll()
+{
+	for ( int i = 0; i < NUM_SHARDS; i++ )
+	{
+		Shard_t &shard = m_Shards[i];
+
+		SlotTable_t *pTable = shard.m_pTable;
+		while ( pTable )
+		{
+			SlotTable_t *pRetired = pTable->m_pRetired;
+			free( pTable );
+			pTable = pRetired;
+		}
+
+		char *pPool = shard.m_pPool;
+		while ( pPool )
+		{
+			char *pNext = *(char **)pPool;
+			free( pPool );
+			pPool = pNext;
+		}
+
+		shard.m_pTable = NULL;
+		shard.m_nUsed = 0;
+		shard.m_pPool = NULL;
+		shard.m_nPoolUsed = 0;
+	}
+
+	for ( int i = 0; i < MAX_SEGMENTS; i++ )
+	{
+		free( m_pSegments[i] );
+		m_pSegments[i] = NULL;
+	}
+
+	m_nStrings = 0;
+}
 
 class CUtlFilenameSymbolTable::HashTable : public CUtlStableHashtable<CUtlConstString>
 {
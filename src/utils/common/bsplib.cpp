@@ -6,6 +6,10 @@
 // $NoKeywords: $
 //=============================================================================//
 
+#include "tier0/platform.h"
+#ifdef IS_WINDOWS_PC
+#include <windows.h>
+#endif
 #include "cmdlib.h"
 #include "mathlib/mathlib.h"
 #include "bsplib.h"
@@ -26,6 +30,20 @@
 #include "tier0/dbg.h"
 #include "lumpfiles.h"
 #include "vtf/vtf.h"
+#include "tier0/threadtools.h"
+#include "tier1/lzmaDecoder.h"
+#include "tier1/snappy.h"
+
+#ifdef POSIX
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef MPI
+#include "vmpi.h"
+#endif
 
 //=============================================================================
 
@@ -712,6 +730,269 @@ CGameLump	g_GameLumps;
 
 static IZip *s_pakFile = 0;
 
+//-----------------------------------------------------------------------------
+// Memory mapped BSP files
+//
+// BSP files are mapped copy-on-write instead of being read into memory, so
+// lumps are paged in as they're copied out and writes (byte swapping in place,
+// for instance) go to private pages instead of the file. LoadBSPFile leaves the
+// lumps that tools only carry through to WriteBSPFile (the physics lumps and
+// unknown lumps) in the mapping, and the pak file is parsed straight from it.
+// They're copied to the heap by ReleaseMappedBSPFile, which WriteBSPFile calls
+// before the file can be overwritten.
+//-----------------------------------------------------------------------------
+static byte			*s_pMappedBSP = NULL;
+static unsigned int	s_nMappedBSPSize = 0;
+static bool			s_bMappedBSPHasViews = false;	// some lumps still point into the mapping
+
+#ifdef IS_WINDOWS_PC
+static HANDLE		s_hMappedBSPFile = INVALID_HANDLE_VALUE;
+static HANDLE		s_hMappedBSPMapping = NULL;
+#endif
+
+static bool IsMappedBSPData( const void *pData )
+{
+	return s_pMappedBSP && pData >= s_pMappedBSP && pData < s_pMappedBSP + s_nMappedBSPSize;
+}
+
+static void UnmapBSPFile( void )
+{
+	if ( !s_pMappedBSP )
+		return;
+
+#ifdef IS_WINDOWS_PC
+	UnmapViewOfFile( s_pMappedBSP );
+	CloseHandle( s_hMappedBSPMapping );
+	CloseHandle( s_hMappedBSPFile );
+	s_hMappedBSPMapping = NULL;
+	s_hMappedBSPFile = INVALID_HANDLE_VALUE;
+#elif POSIX
+	munmap( s_pMappedBSP, s_nMappedBSPSize );
+#endif
+
+	s_pMappedBSP = NULL;
+	s_nMappedBSPSize = 0;
+	s_bMappedBSPHasViews = false;
+}
+
+//-----------------------------------------------------------------------------
+// Maps the file for g_pBSPHeader. Returns false if the file has to be read
+// through the filesystem instead.
+//-----------------------------------------------------------------------------
+static bool MapBSPFile( const char *filename )
+{
+#ifdef MPI
+	// workers get their files from the master through the VMPI filesystem
+	if ( g_bUseMPI && !g_bMPIMaster )
+		return false;
+#endif
+
+	char fullPath[MAX_PATH];
+	if ( V_IsAbsolutePath( filename ) )
+	{
+		V_strncpy( fullPath, filename, sizeof( fullPath ) );
+	}
+	else if ( !g_pFullFileSystem || !g_pFullFileSystem->RelativePathToFullPath( filename, NULL, fullPath, sizeof( fullPath ), FILTER_CULLPACK ) )
+	{
+		return false;
+	}
+
+	Assert( !s_pMappedBSP );
+
+#ifdef IS_WINDOWS_PC
+	s_hMappedBSPFile = CreateFile( fullPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL );
+	if ( s_hMappedBSPFile == INVALID_HANDLE_VALUE )
+		return false;
+
+	DWORD nSizeHigh = 0;
+	DWORD nSize = GetFileSize( s_hMappedBSPFile, &nSizeHigh );
+	if ( nSizeHigh || nSize < sizeof( BSPHeader_t ) )
+	{
+		CloseHandle( s_hMappedBSPFile );
+		s_hMappedBSPFile = INVALID_HANDLE_VALUE;
+		return false;
+	}
+
+	s_hMappedBSPMapping = CreateFileMapping( s_hMappedBSPFile, NULL, PAGE_WRITECOPY, 0, 0, NULL );
+	if ( s_hMappedBSPMapping )
+	{
+		s_pMappedBSP = (byte *)MapViewOfFile( s_hMappedBSPMapping, FILE_MAP_COPY, 0, 0, 0 );
+	}
+	if ( !s_pMappedBSP )
+	{
+		// 32 bit tools can run out of address space on big maps, just read it
+		if ( s_hMappedBSPMapping )
+			CloseHandle( s_hMappedBSPMapping );
+		CloseHandle( s_hMappedBSPFile );
+		s_hMappedBSPMapping = NULL;
+		s_hMappedBSPFile = INVALID_HANDLE_VALUE;
+		return false;
+	}
+#elif POSIX
+	int fd = open( fullPath, O_RDONLY );
+	if ( fd < 0 )
+		return false;
+
+	struct stat st;
+	if ( fstat( fd, &st ) != 0 || st.st_size < (off_t)sizeof( BSPHeader_t ) || st.st_size > 0x7fffffff )
+	{
+		close( fd );
+		return false;
+	}
+
+	unsigned int nSize = (unsigned int)st.st_size;
+	void *pView = mmap( NULL, nSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+	close( fd );
+	if ( pView == MAP_FAILED )
+		return false;
+	s_pMappedBSP = (byte *)pView;
+#else
+	return false;
+#endif
+
+	s_nMappedBSPSize = nSize;
+	s_bMappedBSPHasViews = false;
+	g_pBSPHeader = (BSPHeader_t *)s_pMappedBSP;
+	return true;
+}
+
+// Returns pData, or a heap copy of it if it's in the mapping.
+static void *MaterializeMappedData( void *pData, int nSize )
+{
+	if ( !IsMappedBSPData( pData ) )
+		return pData;
+
+	void *pCopy = malloc( nSize );
+	memcpy( pCopy, pData, nSize );
+	return pCopy;
+}
+
+static void FreeLumpData( void *pData )
+{
+	if ( pData && !IsMappedBSPData( pData ) )
+	{
+		free( pData );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Copies everything that still points into the mapped file to the heap and
+// unmaps it. Must be called before the file is overwritten.
+//-----------------------------------------------------------------------------
+void ReleaseMappedBSPFile( void )
+{
+	if ( !s_pMappedBSP )
+		return;
+
+	g_pPhysCollide = (byte *)MaterializeMappedData( g_pPhysCollide, g_PhysCollideSize );
+	g_pPhysDisp = (byte *)MaterializeMappedData( g_pPhysDisp, g_PhysDispSize );
+	for ( int i = 0; i < HEADER_LUMPS; i++ )
+	{
+		g_Lumps.pLumps[i] = MaterializeMappedData( g_Lumps.pLumps[i], g_Lumps.size[i] );
+	}
+
+	// an OpenBSPFile without CloseBSPFile yet
+	g_pBSPHeader = (BSPHeader_t *)MaterializeMappedData( g_pBSPHeader, s_nMappedBSPSize );
+
+	UnmapBSPFile();
+}
+
+//-----------------------------------------------------------------------------
+// CompressGameLump ends the game lump directory with an all zero entry whose
+// offset marks the end of the last lump. Zero reads the same in either byte order.
+//-----------------------------------------------------------------------------
+static bool IsGameLumpTerminal( const dgamelump_t &lump )
+{
+	return !lump.id && !lump.flags && !lump.version && !lump.filelen;
+}
+
+//-----------------------------------------------------------------------------
+// True for a swapped (360) bsp written by CompressBSP
+//-----------------------------------------------------------------------------
+static bool IsCompressedBSPFile( const BSPHeader_t *pHeader, unsigned int nFileSize )
+{
+	if ( nFileSize < sizeof( BSPHeader_t ) || pHeader->ident != BigLong( IDBSPHEADER ) )
+		return false;
+
+	for ( int i = 0; i < HEADER_LUMPS; i++ )
+	{
+		if ( *((const unsigned int *)pHeader->lumps[i].fourCC) )
+			return true;
+	}
+
+	// no compressed lumps, but the game lump can still have gone through CompressGameLump
+	unsigned int gameLumpOfs = BigLong( pHeader->lumps[LUMP_GAME_LUMP].fileofs );
+	unsigned int gameLumpLen = BigLong( pHeader->lumps[LUMP_GAME_LUMP].filelen );
+	if ( !gameLumpLen || gameLumpOfs + sizeof( dgamelumpheader_t ) > nFileSize )
+		return false;
+
+	const dgamelumpheader_t *pGameLumpHeader = (const dgamelumpheader_t *)( (const byte *)pHeader + gameLumpOfs );
+	int lumpCount = BigLong( pGameLumpHeader->lumpCount );
+	if ( lumpCount <= 0 || gameLumpOfs + sizeof( dgamelumpheader_t ) + lumpCount * sizeof( dgamelump_t ) > nFileSize )
+		return false;
+
+	return IsGameLumpTerminal( ((const dgamelump_t *)( pGameLumpHeader + 1 ))[lumpCount - 1] );
+}
+
+//-----------------------------------------------------------------------------
+// Reads or maps filename into g_pBSPHeader. A compressed bsp is decompressed
+// onto the heap so the lump readers and SwapBSPFile see a plain one.
+//-----------------------------------------------------------------------------
+static void LoadBSPFileData( const char *filename )
+{
+	ReleaseMappedBSPFile();
+
+	unsigned int nFileSize;
+	if ( MapBSPFile( filename ) )
+	{
+		nFileSize = s_nMappedBSPSize;
+	}
+	else
+	{
+		nFileSize = LoadFile( filename, (void **)&g_pBSPHeader );
+	}
+
+	if ( !IsCompressedBSPFile( g_pBSPHeader, nFileSize ) )
+		return;
+
+	CUtlBuffer inputBuffer;
+	inputBuffer.SetExternalBuffer( g_pBSPHeader, nFileSize, nFileSize, CUtlBuffer::READ_ONLY );
+	CUtlBuffer outputBuffer;
+	if ( !DecompressBSP( inputBuffer, outputBuffer ) )
+	{
+		Error( "Failed to decompress %s\n", filename );
+	}
+
+	if ( IsMappedBSPData( g_pBSPHeader ) )
+	{
+		UnmapBSPFile();
+	}
+	else
+	{
+		free( g_pBSPHeader );
+	}
+
+	g_pBSPHeader = (BSPHeader_t *)malloc( outputBuffer.TellPut() );
+	V_memcpy( g_pBSPHeader, outputBuffer.Base(), outputBuffer.TellPut() );
+}
+
+static void FreeBSPFileData( void )
+{
+	if ( IsMappedBSPData( g_pBSPHeader ) )
+	{
+		// keep the mapping as long as lumps point into it
+		if ( !s_bMappedBSPHasViews )
+		{
+			UnmapBSPFile();
+		}
+	}
+	else
+	{
+		free( g_pBSPHeader );
+	}
+	g_pBSPHeader = NULL;
+}
+
 //-----------------------------------------------------------------------------
 // Keep the file position aligned to an arbitrary boundary.
 // Returns updated file position.
@@ -1771,6 +2052,17 @@ bool HasLump( int lump )
 	return g_pBSPHeader->lumps[lump].filelen > 0;
 }
 
+const void *GetLumpData( int lump, int elementSize, int &length, int forceVersion )
+{
+	Assert( g_pBSPHeader );
+	length = g_pBSPHeader->lumps[lump].filelen;
+	if ( !length )
+		return NULL;
+
+	ValidateLump( lump, length, elementSize, forceVersion );
+	return (byte *)g_pBSPHeader + g_pBSPHeader->lumps[lump].fileofs;
+}
+
 void ValidateLump( int lump, int length, int size, int forceVersion )
 {
 	if ( length % size )
@@ -1927,6 +2219,26 @@ int CopyVariableLump( int lump, void **dest, int forceVersion = -1 )
 	return CopyLumpInternal<T>( lump, (T*)*dest, forceVersion );
 }
 
+//-----------------------------------------------------------------------------
+//	Like CopyVariableLump for byte lumps, but lumps that don't need swapping are
+//	left in the mapped file. See ReleaseMappedBSPFile.
+//-----------------------------------------------------------------------------
+static int ReferenceVariableLump( int lump, void **dest )
+{
+	if ( g_bSwapOnLoad || !IsMappedBSPData( g_pBSPHeader ) )
+		return CopyVariableLump<byte>( FIELD_CHARACTER, lump, dest );
+
+	g_Lumps.bLumpParsed[lump] = true;
+
+	int length;
+	*dest = (void *)GetLumpView<byte>( lump, length );
+	if ( length )
+	{
+		s_bMappedBSPHasViews = true;
+	}
+	return length;
+}
+
 //-----------------------------------------------------------------------------
 //	Add/Write unknown lumps
 //-----------------------------------------------------------------------------
@@ -1938,7 +2250,7 @@ void Lumps_Parse( void )
 	{
 		if ( !g_Lumps.bLumpParsed[i] && g_pBSPHeader->lumps[i].filelen )
 		{
-			g_Lumps.size[i] = CopyVariableLump<byte>( FIELD_CHARACTER, i, &g_Lumps.pLumps[i], -1 );
+			g_Lumps.size[i] = ReferenceVariableLump( i, &g_Lumps.pLumps[i] );
 			Msg( "Reading unknown lump #%d (%d bytes)\n", i, g_Lumps.size[i] );
 		}
 	}
@@ -2124,7 +2436,7 @@ void OpenBSPFile( const char *filename )
 	Lumps_Init();
 
 	// load the file header
-	LoadFile( filename, (void **)&g_pBSPHeader );
+	LoadBSPFileData( filename );
 
 	if ( g_bSwapOnLoad )
 	{
@@ -2142,8 +2454,7 @@ void OpenBSPFile( const char *filename )
 //-----------------------------------------------------------------------------
 void CloseBSPFile( void )
 {
-	free( g_pBSPHeader );
-	g_pBSPHeader = NULL;
+	FreeBSPFileData();
 }
 
 //-----------------------------------------------------------------------------
@@ -2199,8 +2510,8 @@ void LoadBSPFile( const char *filename )
 	numworldlightsHDR = CopyLump( LUMP_WORLDLIGHTS_HDR, dworldlightsHDR );
 	
 	numleafwaterdata = CopyLump( LUMP_LEAFWATERDATA, dleafwaterdata );
-	g_PhysCollideSize = CopyVariableLump<byte>( FIELD_CHARACTER, LUMP_PHYSCOLLIDE, (void**)&g_pPhysCollide );
-	g_PhysDispSize = CopyVariableLump<byte>( FIELD_CHARACTER, LUMP_PHYSDISP, (void**)&g_pPhysDisp );
+	g_PhysCollideSize = ReferenceVariableLump( LUMP_PHYSCOLLIDE, (void**)&g_pPhysCollide );
+	g_PhysDispSize = ReferenceVariableLump( LUMP_PHYSDISP, (void**)&g_pPhysDisp );
 
 	g_numvertnormals = CopyLump( FIELD_VECTOR, LUMP_VERTNORMALS, (float*)g_vertnormals );
 	g_numvertnormalindices = CopyLump( FIELD_SHORT, LUMP_VERTNORMALINDICES, g_vertnormalindices );
@@ -2239,21 +2550,20 @@ void LoadBSPFile( const char *filename )
 	}
 	*/
 		
-	// Load PAK file lump into appropriate data structure
-	byte *pakbuffer = NULL;
-	int paksize = CopyVariableLump<byte>( FIELD_CHARACTER, LUMP_PAKFILE, ( void ** )&pakbuffer );
+	// Load PAK file lump into appropriate data structure, the zip copies what it needs
+	int paksize;
+	const byte *pakbuffer = GetLumpView<byte>( LUMP_PAKFILE, paksize );
+	g_Lumps.bLumpParsed[LUMP_PAKFILE] = true;
 	if ( paksize > 0 )
 	{
 		GetPakFile()->ActivateByteSwapping( IsX360() );
-		GetPakFile()->ParseFromBuffer( pakbuffer, paksize );
+		GetPakFile()->ParseFromBuffer( (void *)pakbuffer, paksize );
 	}
 	else
 	{
 		GetPakFile()->Reset();
 	}
 
-	free( pakbuffer );
-
 	g_GameLumps.ParseGameLump( g_pBSPHeader );
 
 	// NOTE: Do NOT call CopyLump after Lumps_Parse() it parses all un-Copied lumps
@@ -2328,18 +2638,12 @@ void UnloadBSPFile()
 
 	numleafwaterdata = 0;
 
-	if ( g_pPhysCollide )
-	{
-		free( g_pPhysCollide );
-		g_pPhysCollide = NULL;
-	}
+	FreeLumpData( g_pPhysCollide );
+	g_pPhysCollide = NULL;
 	g_PhysCollideSize = 0;
 
-	if ( g_pPhysDisp )
-	{
-		free( g_pPhysDisp );
-		g_pPhysDisp = NULL;
-	}
+	FreeLumpData( g_pPhysDisp );
+	g_pPhysDisp = NULL;
 	g_PhysDispSize = 0;
 
 	g_numvertnormals = 0;
@@ -2364,11 +2668,15 @@ void UnloadBSPFile()
 
 	for ( int i = 0; i < HEADER_LUMPS; i++ )
 	{
-		if ( g_Lumps.pLumps[i] )
-		{
-			free( g_Lumps.pLumps[i] );
-			g_Lumps.pLumps[i] = NULL;
-		}
+		FreeLumpData( g_Lumps.pLumps[i] );
+		g_Lumps.pLumps[i] = NULL;
+		g_Lumps.size[i] = 0;
+	}
+
+	// nothing points into the mapped file anymore
+	if ( !g_pBSPHeader )
+	{
+		UnmapBSPFile();
 	}
 
 	ReleasePakFileLumps();
@@ -2384,27 +2692,24 @@ void LoadBSPFile_FileSystemOnly( const char *filename )
 	//
 	// load the file header
 	//
-	LoadFile( filename, (void **)&g_pBSPHeader );
+	LoadBSPFileData( filename );
 
 	ValidateHeader( filename, g_pBSPHeader );
 
 	// Load PAK file lump into appropriate data structure
-	byte *pakbuffer = NULL;
-	int paksize = CopyVariableLump<byte>( FIELD_CHARACTER, LUMP_PAKFILE, ( void ** )&pakbuffer, 1 );
+	int paksize;
+	const byte *pakbuffer = GetLumpView<byte>( LUMP_PAKFILE, paksize, 1 );
 	if ( paksize > 0 )
 	{
-		GetPakFile()->ParseFromBuffer( pakbuffer, paksize );
+		GetPakFile()->ParseFromBuffer( (void *)pakbuffer, paksize );
 	}
 	else
 	{
 		GetPakFile()->Reset();
 	}
 
-	free( pakbuffer );
-
 	// everything has been copied out
-	free( g_pBSPHeader );
-	g_pBSPHeader = NULL;
+	FreeBSPFileData();
 }
 
 void ExtractZipFileFromBSP( char *pBSPFileName, char *pZipFileName )
@@ -2414,12 +2719,12 @@ void ExtractZipFileFromBSP( char *pBSPFileName, char *pZipFileName )
 	//
 	// load the file header
 	//
-	LoadFile( pBSPFileName, (void **)&g_pBSPHeader);
+	LoadBSPFileData( pBSPFileName );
 
 	ValidateHeader( pBSPFileName, g_pBSPHeader );
 
-	byte *pakbuffer = NULL;
-	int paksize = CopyVariableLump<byte>( FIELD_CHARACTER, LUMP_PAKFILE, ( void ** )&pakbuffer );
+	int paksize;
+	const byte *pakbuffer = GetLumpView<byte>( LUMP_PAKFILE, paksize );
 	if ( paksize > 0 )
 	{
 		FILE *fp;
@@ -2427,6 +2732,7 @@ void ExtractZipFileFromBSP( char *pBSPFileName, char *pZipFileName )
 		if( !fp )
 		{
 			fprintf( stderr, "can't open %s\n", pZipFileName );
+			FreeBSPFileData();
 			return;
 		}
 
@@ -2437,6 +2743,8 @@ void ExtractZipFileFromBSP( char *pBSPFileName, char *pZipFileName )
 	{		
 		fprintf( stderr, "zip file is zero length!\n" );
 	}
+
+	FreeBSPFileData();
 }
 
 /*
@@ -2570,6 +2878,9 @@ void WriteBSPFile( const char *filename, char *pUnused )
 		return;
 	}
 
+	// this is usually the file that was loaded
+	ReleaseMappedBSPFile();
+
 	BSPHeader_t outHeader;
 	g_pBSPHeader = &outHeader;
 	memset( g_pBSPHeader, 0, sizeof(BSPHeader_t) );
@@ -4408,65 +4719,260 @@ int SortLumpsByOffset( const SortedLump_t *pSortedLumpA, const SortedLump_t *pSo
 	return 0;
 }
 
-bool CompressGameLump( BSPHeader_t *pInBSPHeader, BSPHeader_t *pOutBSPHeader, CUtlBuffer &outputBuffer, CompressFunc_t pCompressFunc )
+//-----------------------------------------------------------------------------
+// Lump jobs. Each lump (and each game lump) is compressed or decompressed on
+// its own, on as many threads as there are cpus. The results are written out
+// afterwards in the input's lump order, so the output doesn't depend on which
+// thread finished first. Compress funcs get called from several threads at once.
+//-----------------------------------------------------------------------------
+typedef void (*LumpJobFunc_t)( void *pJobs, int iJob );
+
+struct LumpJobContext_t
+{
+	void			*m_pJobs;
+	int				m_nJobs;
+	LumpJobFunc_t	m_pJobFunc;
+	int32 volatile	m_nNextJob;
+};
+
+static uintp LumpJobThread( void *pParam )
+{
+	LumpJobContext_t *pContext = (LumpJobContext_t *)pParam;
+	for ( ;; )
+	{
+		int iJob = ThreadInterlockedIncrement( &pContext->m_nNextJob ) - 1;
+		if ( iJob >= pContext->m_nJobs )
+			break;
+
+		pContext->m_pJobFunc( pContext->m_pJobs, iJob );
+	}
+	return 0;
+}
+
+static void RunLumpJobs( void *pJobs, int nJobs, LumpJobFunc_t pJobFunc )
+{
+	LumpJobContext_t context;
+	context.m_pJobs = pJobs;
+	context.m_nJobs = nJobs;
+	context.m_pJobFunc = pJobFunc;
+	context.m_nNextJob = 0;
+
+	CUtlVector< ThreadHandle_t > threads;
+	int nThreads = MIN( (int)GetCPUInformation().m_nLogicalProcessors, nJobs ) - 1;
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		ThreadHandle_t hThread = CreateSimpleThread( LumpJobThread, &context );
+		if ( hThread )
+		{
+			threads.AddToTail( hThread );
+		}
+	}
+
+	// this thread takes jobs too
+	LumpJobThread( &context );
+
+	for ( int i = 0; i < threads.Count(); i++ )
+	{
+		ThreadJoin( threads[i] );
+		ReleaseThreadHandle( threads[i] );
+	}
+}
+
+struct LumpCompressJob_t
+{
+	const byte		*m_pData;
+	int				m_nSize;
+	CompressFunc_t	m_pCompressFunc;
+	CUtlBuffer		m_Compressed;
+	bool			m_bCompressed;
+};
+
+static void CompressLumpJob( void *pJobs, int iJob )
+{
+	LumpCompressJob_t *pJob = &((LumpCompressJob_t *)pJobs)[iJob];
+
+	CUtlBuffer inputBuffer;
+	inputBuffer.SetExternalBuffer( (void *)pJob->m_pData, pJob->m_nSize, pJob->m_nSize );
+	pJob->m_bCompressed = pJob->m_nSize && pJob->m_pCompressFunc( inputBuffer, pJob->m_Compressed );
+	if ( !pJob->m_bCompressed )
+	{
+		pJob->m_Compressed.Purge();
+	}
+}
+
+struct LumpDecompressJob_t
+{
+	const byte		*m_pData;
+	int				m_nSize;
+	unsigned int	m_nActualSize;
+	CUtlMemory< byte >	m_Decompressed;
+	bool			m_bDecompressed;
+};
+
+static void DecompressLumpJob( void *pJobs, int iJob )
+{
+	LumpDecompressJob_t *pJob = &((LumpDecompressJob_t *)pJobs)[iJob];
+
+	pJob->m_Decompressed.EnsureCapacity( pJob->m_nActualSize );
+	pJob->m_bDecompressed = DecompressLump( pJob->m_pData, pJob->m_nSize, pJob->m_Decompressed.Base(), pJob->m_nActualSize );
+}
+
+//-----------------------------------------------------------------------------
+// Lumps the engine needs decoded before a map load can go on. These get the
+// fast codec when CompressBSP is given one. The bulky lumps that are read
+// later or only in part (lighting, visibility, displacement samples, ...)
+// stay with the caller's codec, which compresses better.
+//-----------------------------------------------------------------------------
+static bool IsLumpHotAtLoad( int lumpNum )
+{
+	switch ( lumpNum )
+	{
+	case LUMP_ENTITIES:
+	case LUMP_PLANES:
+	case LUMP_TEXDATA:
+	case LUMP_VERTEXES:
+	case LUMP_NODES:
+	case LUMP_TEXINFO:
+	case LUMP_FACES:
+	case LUMP_LEAFS:
+	case LUMP_EDGES:
+	case LUMP_SURFEDGES:
+	case LUMP_MODELS:
+	case LUMP_LEAFFACES:
+	case LUMP_LEAFBRUSHES:
+	case LUMP_BRUSHES:
+	case LUMP_BRUSHSIDES:
+	case LUMP_PHYSCOLLIDE:
+	case LUMP_TEXDATA_STRING_DATA:
+	case LUMP_TEXDATA_STRING_TABLE:
+		return true;
+	}
+
+	return false;
+}
+
+static bool IsGameLumpHotAtLoad( GameLumpId_t id )
+{
+	return id == GAMELUMP_STATIC_PROPS;
+}
+
+//-----------------------------------------------------------------------------
+// The fast codec, as a CompressFunc_t so callers can pass it to SwapBSPFile.
+//-----------------------------------------------------------------------------
+bool CompressLumpSnappy( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer )
+{
+	int nInputSize = inputBuffer.TellPut();
+	CUtlMemory< char > compressed( 0, snappy::MaxCompressedLength( nInputSize ) );
+
+	size_t nCompressedSize = 0;
+	snappy::RawCompress( (const char *)inputBuffer.Base(), nInputSize, compressed.Base(), &nCompressedSize );
+	if ( sizeof( snappy_header_t ) + nCompressedSize >= (size_t)nInputSize )
+	{
+		// not worth it
+		return false;
+	}
+
+	snappy_header_t header;
+	header.id = SNAPPY_ID;
+	header.actualSize = LittleLong( nInputSize );
+	header.snappySize = LittleLong( (int)nCompressedSize );
+
+	outputBuffer.Put( &header, sizeof( header ) );
+	outputBuffer.Put( compressed.Base(), nCompressedSize );
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Decodes one lzma or snappy compressed lump. nOutputSize must be the lump's
+// uncompressed size.
+//-----------------------------------------------------------------------------
+bool DecompressLump( const void *pData, int nDataSize, void *pOutput, unsigned int nOutputSize )
+{
+	CLZMA lzma;
+	if ( nDataSize >= (int)sizeof( lzma_header_t ) && lzma.IsCompressed( (unsigned char *)pData ) )
+	{
+		if ( lzma.GetActualSize( (unsigned char *)pData ) != nOutputSize )
+			return false;
+
+		return lzma.Uncompress( (unsigned char *)pData, (unsigned char *)pOutput ) == nOutputSize;
+	}
+
+	const snappy_header_t *pHeader = (const snappy_header_t *)pData;
+	if ( nDataSize >= (int)sizeof( snappy_header_t ) && pHeader->id == SNAPPY_ID )
+	{
+		unsigned int nSnappySize = LittleLong( pHeader->snappySize );
+		if ( (unsigned int)LittleLong( pHeader->actualSize ) != nOutputSize || nSnappySize > nDataSize - sizeof( snappy_header_t ) )
+			return false;
+
+		const char *pSnappyData = (const char *)( pHeader + 1 );
+		size_t nSnappyOutputSize;
+		if ( !snappy::GetUncompressedLength( pSnappyData, nSnappySize, &nSnappyOutputSize ) || nSnappyOutputSize != nOutputSize )
+			return false;
+
+		return snappy::RawUncompress( pSnappyData, nSnappySize, (char *)pOutput );
+	}
+
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+// Writes the game lump's directory and the results of its compress jobs. The
+// input's game lump directory must already be in native byte order.
+//-----------------------------------------------------------------------------
+bool CompressGameLump( BSPHeader_t *pInBSPHeader, BSPHeader_t *pOutBSPHeader, CUtlBuffer &outputBuffer, LumpCompressJob_t *pJobs )
 {
 	CByteswap	byteSwap;
 
 	dgamelumpheader_t* pInGameLumpHeader = (dgamelumpheader_t*)(((byte *)pInBSPHeader) + pInBSPHeader->lumps[LUMP_GAME_LUMP].fileofs);
 	dgamelump_t* pInGameLump = (dgamelump_t*)(pInGameLumpHeader + 1);
 
-	byteSwap.ActivateByteSwapping( true );
-	byteSwap.SwapFieldsToTargetEndian( pInGameLumpHeader );
-	byteSwap.SwapFieldsToTargetEndian( pInGameLump, pInGameLumpHeader->lumpCount );
-
+	// the directory gets fixed up as the lumps are written, then swapped into place
 	unsigned int newOffset = outputBuffer.TellPut();
-	outputBuffer.Put( pInGameLumpHeader, sizeof( dgamelumpheader_t ) );
-	outputBuffer.Put( pInGameLump, pInGameLumpHeader->lumpCount * sizeof( dgamelump_t ) );
-
-	dgamelumpheader_t* pOutGameLumpHeader = (dgamelumpheader_t*)((byte *)outputBuffer.Base() + newOffset);
-	dgamelump_t* pOutGameLump = (dgamelump_t*)(pOutGameLumpHeader + 1);
+	dgamelumpheader_t outGameLumpHeader = *pInGameLumpHeader;
+	CUtlVector< dgamelump_t > outGameLumps;
+	outGameLumps.CopyArray( pInGameLump, pInGameLumpHeader->lumpCount );
 
 	// add a dummy terminal gamelump
 	// purposely NOT updating the .filelen to reflect the compressed size, but leaving as original size
 	// callers use the next entry offset to determine compressed size
-	pOutGameLumpHeader->lumpCount++;
+	outGameLumpHeader.lumpCount++;
 	dgamelump_t dummyLump = { 0 };
-	outputBuffer.Put( &dummyLump, sizeof( dgamelump_t ) );
+	outGameLumps.AddToTail( dummyLump );
+
+	outputBuffer.Put( &outGameLumpHeader, sizeof( dgamelumpheader_t ) );
+	outputBuffer.Put( outGameLumps.Base(), outGameLumps.Count() * sizeof( dgamelump_t ) );
 
 	for ( int i = 0; i < pInGameLumpHeader->lumpCount; i++ )
 	{
-		CUtlBuffer inputBuffer;
-		CUtlBuffer compressedBuffer;
-
-		pOutGameLump[i].fileofs = AlignBuffer( outputBuffer, 4 );
+		outGameLumps[i].fileofs = AlignBuffer( outputBuffer, 4 );
 
 		if ( pInGameLump[i].filelen )
 		{
-			inputBuffer.SetExternalBuffer( ((byte *)pInBSPHeader) + pInGameLump[i].fileofs, pInGameLump[i].filelen, pInGameLump[i].filelen );
-
-			bool bCompressed = pCompressFunc( inputBuffer, compressedBuffer );
-			if ( bCompressed )
+			if ( pJobs[i].m_bCompressed )
 			{
-				pOutGameLump[i].flags |= GAMELUMPFLAG_COMPRESSED;
-
-				outputBuffer.Put( compressedBuffer.Base(), compressedBuffer.TellPut() );
-				compressedBuffer.Purge();
+				outGameLumps[i].flags |= GAMELUMPFLAG_COMPRESSED;
+				outputBuffer.Put( pJobs[i].m_Compressed.Base(), pJobs[i].m_Compressed.TellPut() );
+				pJobs[i].m_Compressed.Purge();
 			}
 			else
 			{
 				// as is
-				outputBuffer.Put( inputBuffer.Base(), inputBuffer.TellPut() );
+				outputBuffer.Put( pJobs[i].m_pData, pJobs[i].m_nSize );
 			}
 		}
 	}
 
 	// fix the dummy terminal lump
-	int lastLump = pOutGameLumpHeader->lumpCount-1;
-	pOutGameLump[lastLump].fileofs = outputBuffer.TellPut();
+	outGameLumps.Tail().fileofs = outputBuffer.TellPut();
 
 	// fix the output for 360, swapping it back
-	byteSwap.SwapFieldsToTargetEndian( pOutGameLump, pOutGameLumpHeader->lumpCount );
-	byteSwap.SwapFieldsToTargetEndian( pOutGameLumpHeader );
+	byteSwap.ActivateByteSwapping( true );
+	byteSwap.SwapFieldsToTargetEndian( outGameLumps.Base(), outGameLumps.Count() );
+	byteSwap.SwapFieldsToTargetEndian( &outGameLumpHeader );
+
+	byte *pOutGameLumpDir = (byte *)outputBuffer.Base() + newOffset;
+	V_memcpy( pOutGameLumpDir, &outGameLumpHeader, sizeof( dgamelumpheader_t ) );
+	V_memcpy( pOutGameLumpDir + sizeof( dgamelumpheader_t ), outGameLumps.Base(), outGameLumps.Count() * sizeof( dgamelump_t ) );
 
 	pOutBSPHeader->lumps[LUMP_GAME_LUMP].fileofs = newOffset;
 	pOutBSPHeader->lumps[LUMP_GAME_LUMP].filelen = outputBuffer.TellPut() - newOffset;
@@ -4474,7 +4980,11 @@ bool CompressGameLump( BSPHeader_t *pInBSPHeader, BSPHeader_t *pOutBSPHeader, CU
 	return true;
 }
 
-bool CompressBSP( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer, CompressFunc_t pCompressFunc )
+//-----------------------------------------------------------------------------
+// Compresses every lump of a swapped (360) bsp but the pak file. Hot lumps use
+// pFastCompressFunc if there is one, everything else uses pCompressFunc.
+//-----------------------------------------------------------------------------
+bool CompressBSP( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer, CompressFunc_t pCompressFunc, CompressFunc_t pFastCompressFunc )
 {
 	CByteswap	byteSwap;
 
@@ -4485,15 +4995,64 @@ bool CompressBSP( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer, CompressFun
 		return false;
 	}
 
+	if ( !pFastCompressFunc )
+	{
+		pFastCompressFunc = pCompressFunc;
+	}
+
 	// bsp is 360, swap the header back
 	byteSwap.ActivateByteSwapping( true );
 	byteSwap.SwapFieldsToTargetEndian( pInBSPHeader );
 
+	// the game lump directory too, its lumps get compressed with everything else
+	dgamelumpheader_t *pInGameLumpHeader = NULL;
+	dgamelump_t *pInGameLump = NULL;
+	if ( pInBSPHeader->lumps[LUMP_GAME_LUMP].filelen )
+	{
+		pInGameLumpHeader = (dgamelumpheader_t*)(((byte *)pInBSPHeader) + pInBSPHeader->lumps[LUMP_GAME_LUMP].fileofs);
+		pInGameLump = (dgamelump_t*)(pInGameLumpHeader + 1);
+		byteSwap.SwapFieldsToTargetEndian( pInGameLumpHeader );
+		byteSwap.SwapFieldsToTargetEndian( pInGameLump, pInGameLumpHeader->lumpCount );
+	}
+
+	// compress all the lumps up front. the pak file is added as is, the game
+	// lump has to have each of its components individually compressed.
+	int nGameLumps = pInGameLumpHeader ? pInGameLumpHeader->lumpCount : 0;
+	CUtlVector< LumpCompressJob_t > jobs;
+	jobs.EnsureCapacity( HEADER_LUMPS + nGameLumps );
+
+	int lumpJobs[HEADER_LUMPS];
+	for ( int i = 0; i < HEADER_LUMPS; i++ )
+	{
+		lumpJobs[i] = -1;
+		if ( i == LUMP_PAKFILE || i == LUMP_GAME_LUMP || !pInBSPHeader->lumps[i].filelen )
+			continue;
+
+		lumpJobs[i] = jobs.AddToTail();
+		LumpCompressJob_t &job = jobs[lumpJobs[i]];
+		job.m_pData = ((byte *)pInBSPHeader) + pInBSPHeader->lumps[i].fileofs;
+		job.m_nSize = pInBSPHeader->lumps[i].filelen;
+		job.m_pCompressFunc = IsLumpHotAtLoad( i ) ? pFastCompressFunc : pCompressFunc;
+		job.m_bCompressed = false;
+	}
+
+	int firstGameLumpJob = jobs.Count();
+	for ( int i = 0; i < nGameLumps; i++ )
+	{
+		LumpCompressJob_t &job = jobs[jobs.AddToTail()];
+		job.m_pData = ((byte *)pInBSPHeader) + pInGameLump[i].fileofs;
+		job.m_nSize = pInGameLump[i].filelen;
+		job.m_pCompressFunc = IsGameLumpHotAtLoad( pInGameLump[i].id ) ? pFastCompressFunc : pCompressFunc;
+		job.m_bCompressed = false;
+	}
+
+	RunLumpJobs( jobs.Base(), jobs.Count(), CompressLumpJob );
+
 	// output will be smaller, use input size as upper bound
 	outputBuffer.EnsureCapacity( inputBuffer.TellMaxPut() );
 	outputBuffer.Put( pInBSPHeader, sizeof(BSPHeader_t) );
 
-	BSPHeader_t *pOutBSPHeader = (BSPHeader_t *)outputBuffer.Base();
+	BSPHeader_t outBSPHeader = *pInBSPHeader;
 
 	// must adhere to input lump's offset order and process according to that, NOT lump num
 	// sort by offset order
@@ -4515,7 +5074,7 @@ bool CompressBSP( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer, CompressFun
 		if ( !pSortedLump->pLump->filelen )
 		{
 			// degenerate
-			pOutBSPHeader->lumps[lumpNum].fileofs = 0;
+			outBSPHeader.lumps[lumpNum].fileofs = 0;
 		}
 		else
 		{
@@ -4527,48 +5086,202 @@ bool CompressBSP( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer, CompressFun
 			unsigned int newOffset = AlignBuffer( outputBuffer, alignment );
 
 			// only set by compressed lumps, hides the uncompressed size
-			*((unsigned int *)pOutBSPHeader->lumps[lumpNum].fourCC) = 0;
-
-			CUtlBuffer inputBuffer;
-			inputBuffer.SetExternalBuffer( ((byte *)pInBSPHeader) + pSortedLump->pLump->fileofs, pSortedLump->pLump->filelen, pSortedLump->pLump->filelen );
+			*((unsigned int *)outBSPHeader.lumps[lumpNum].fourCC) = 0;
 
 			if ( lumpNum == LUMP_GAME_LUMP )
 			{
-				// the game lump has to have each of its components individually compressed
-				CompressGameLump( pInBSPHeader, pOutBSPHeader, outputBuffer, pCompressFunc );
+				CompressGameLump( pInBSPHeader, &outBSPHeader, outputBuffer, jobs.Base() + firstGameLumpJob );
 			}
-			else if ( lumpNum == LUMP_PAKFILE )
+			else if ( lumpJobs[lumpNum] >= 0 && jobs[lumpJobs[lumpNum]].m_bCompressed )
 			{
-				// add as is
-				pOutBSPHeader->lumps[lumpNum].fileofs = newOffset;
-				outputBuffer.Put( inputBuffer.Base(), inputBuffer.TellPut() );
+				CUtlBuffer &compressedBuffer = jobs[lumpJobs[lumpNum]].m_Compressed;
+
+				// placing the uncompressed size in the unused fourCC, will decode at runtime
+				*((unsigned int *)outBSPHeader.lumps[lumpNum].fourCC) = BigLong( pSortedLump->pLump->filelen );
+				outBSPHeader.lumps[lumpNum].filelen = compressedBuffer.TellPut();
+				outBSPHeader.lumps[lumpNum].fileofs = newOffset;
+				outputBuffer.Put( compressedBuffer.Base(), compressedBuffer.TellPut() );
+				compressedBuffer.Purge();
 			}
 			else
 			{
-				CUtlBuffer compressedBuffer;
-				bool bCompressed = pCompressFunc( inputBuffer, compressedBuffer );
-				if ( bCompressed )
+				// add as is
+				outBSPHeader.lumps[lumpNum].fileofs = newOffset;
+				outputBuffer.Put( ((byte *)pInBSPHeader) + pSortedLump->pLump->fileofs, pSortedLump->pLump->filelen );
+			}
+		}
+	}
+
+	// fix the output for 360, swapping it back
+	byteSwap.SetTargetBigEndian( true );
+	byteSwap.SwapFieldsToTargetEndian( &outBSPHeader );
+	V_memcpy( outputBuffer.Base(), &outBSPHeader, sizeof( BSPHeader_t ) );
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Undoes CompressBSP, decoding every compressed lump and game lump on its own
+// thread. This is how a loader is expected to read a compressed bsp; the
+// output is a plain swapped (360) bsp. The input isn't modified.
+//-----------------------------------------------------------------------------
+bool DecompressBSP( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer )
+{
+	CByteswap	byteSwap;
+	byteSwap.ActivateByteSwapping( true );
+
+	const byte *pInBase = (const byte *)inputBuffer.Base();
+	BSPHeader_t inBSPHeader = *(const BSPHeader_t *)pInBase;
+	if ( inBSPHeader.ident != BigLong( IDBSPHEADER ) )
+	{
+		return false;
+	}
+	byteSwap.SwapFieldsToTargetEndian( &inBSPHeader );
+
+	// the game lump directory ends with the dummy lump CompressGameLump adds,
+	// which gets stripped again whether or not any game lump was compressed
+	dgamelumpheader_t gameLumpHeader = { 0 };
+	CUtlVector< dgamelump_t > gameLumps;
+	if ( inBSPHeader.lumps[LUMP_GAME_LUMP].filelen )
+	{
+		const byte *pGameLumpDir = pInBase + inBSPHeader.lumps[LUMP_GAME_LUMP].fileofs;
+		gameLumpHeader = *(const dgamelumpheader_t *)pGameLumpDir;
+		byteSwap.SwapFieldsToTargetEndian( &gameLumpHeader );
+		gameLumps.CopyArray( (const dgamelump_t *)( pGameLumpDir + sizeof( dgamelumpheader_t ) ), gameLumpHeader.lumpCount );
+		byteSwap.SwapFieldsToTargetEndian( gameLumps.Base(), gameLumps.Count() );
+	}
+	bool bHasTerminal = gameLumps.Count() && IsGameLumpTerminal( gameLumps.Tail() );
+	int nGameLumps = bHasTerminal ? gameLumps.Count() - 1 : gameLumps.Count();
+	for ( int i = 0; i < nGameLumps; i++ )
+	{
+		if ( !bHasTerminal && ( gameLumps[i].flags & GAMELUMPFLAG_COMPRESSED ) )
+		{
+			// can't size a compressed game lump without the terminal
+			Warning( "Error! Compressed game lump without a terminal entry!\n" );
+			return false;
+		}
+	}
+
+	CUtlVector< LumpDecompressJob_t > jobs;
+	jobs.EnsureCapacity( HEADER_LUMPS + nGameLumps );
+
+	int lumpJobs[HEADER_LUMPS];
+	for ( int i = 0; i < HEADER_LUMPS; i++ )
+	{
+		lumpJobs[i] = -1;
+		unsigned int actualSize = BigLong( *((unsigned int *)inBSPHeader.lumps[i].fourCC) );
+		if ( i == LUMP_GAME_LUMP || !inBSPHeader.lumps[i].filelen || !actualSize )
+			continue;
+
+		lumpJobs[i] = jobs.AddToTail();
+		LumpDecompressJob_t &job = jobs[lumpJobs[i]];
+		job.m_pData = pInBase + inBSPHeader.lumps[i].fileofs;
+		job.m_nSize = inBSPHeader.lumps[i].filelen;
+		job.m_nActualSize = actualSize;
+		job.m_bDecompressed = false;
+	}
+
+	CUtlVector< int > gameLumpJob;
+	gameLumpJob.SetCount( nGameLumps );
+	for ( int i = 0; i < nGameLumps; i++ )
+	{
+		gameLumpJob[i] = -1;
+		if ( !( gameLumps[i].flags & GAMELUMPFLAG_COMPRESSED ) || !gameLumps[i].filelen )
+			continue;
+
+		// compressed size comes from the next entry
+		gameLumpJob[i] = jobs.AddToTail();
+		LumpDecompressJob_t &job = jobs[gameLumpJob[i]];
+		job.m_pData = pInBase + gameLumps[i].fileofs;
+		job.m_nSize = gameLumps[i+1].fileofs - gameLumps[i].fileofs;
+		job.m_nActualSize = gameLumps[i].filelen;
+		job.m_bDecompressed = false;
+	}
+
+	RunLumpJobs( jobs.Base(), jobs.Count(), DecompressLumpJob );
+
+	for ( int i = 0; i < jobs.Count(); i++ )
+	{
+		if ( !jobs[i].m_bDecompressed )
+		{
+			Warning( "Error! Failed to decompress lump at offset %d!\n", (int)( jobs[i].m_pData - pInBase ) );
+			return false;
+		}
+	}
+
+	outputBuffer.Put( &inBSPHeader, sizeof( BSPHeader_t ) );
+	BSPHeader_t outBSPHeader = inBSPHeader;
+
+	CUtlVector< SortedLump_t > sortedLumps;
+	for ( int i = 0; i < HEADER_LUMPS; i++ )
+	{
+		int iIndex = sortedLumps.AddToTail();
+		sortedLumps[iIndex].lumpNum = i;
+		sortedLumps[iIndex].pLump = &inBSPHeader.lumps[i];
+	}
+	sortedLumps.Sort( SortLumpsByOffset );
+
+	for ( int i = 0; i < HEADER_LUMPS; ++i )
+	{
+		int lumpNum = sortedLumps[i].lumpNum;
+		const lump_t *pLump = sortedLumps[i].pLump;
+
+		*((unsigned int *)outBSPHeader.lumps[lumpNum].fourCC) = 0;
+		if ( !pLump->filelen )
+		{
+			outBSPHeader.lumps[lumpNum].fileofs = 0;
+			continue;
+		}
+
+		outBSPHeader.lumps[lumpNum].fileofs = AlignBuffer( outputBuffer, lumpNum == LUMP_PAKFILE ? 2048 : 4 );
+
+		if ( lumpNum == LUMP_GAME_LUMP )
+		{
+			dgamelumpheader_t outGameLumpHeader = gameLumpHeader;
+			outGameLumpHeader.lumpCount = nGameLumps;
+			CUtlVector< dgamelump_t > outGameLumps;
+			outGameLumps.CopyArray( gameLumps.Base(), nGameLumps );
+
+			int dirOffset = outputBuffer.TellPut();
+			outputBuffer.Put( &outGameLumpHeader, sizeof( dgamelumpheader_t ) );
+			outputBuffer.Put( outGameLumps.Base(), nGameLumps * sizeof( dgamelump_t ) );
+
+			for ( int j = 0; j < nGameLumps; j++ )
+			{
+				outGameLumps[j].fileofs = AlignBuffer( outputBuffer, 4 );
+				outGameLumps[j].flags &= ~GAMELUMPFLAG_COMPRESSED;
+				if ( gameLumpJob[j] >= 0 )
 				{
-					// placing the uncompressed size in the unused fourCC, will decode at runtime
-					*((unsigned int *)pOutBSPHeader->lumps[lumpNum].fourCC) = BigLong( inputBuffer.TellPut() );
-					pOutBSPHeader->lumps[lumpNum].filelen = compressedBuffer.TellPut();
-					pOutBSPHeader->lumps[lumpNum].fileofs = newOffset;
-					outputBuffer.Put( compressedBuffer.Base(), compressedBuffer.TellPut() );
-					compressedBuffer.Purge();
+					outputBuffer.Put( jobs[gameLumpJob[j]].m_Decompressed.Base(), jobs[gameLumpJob[j]].m_nActualSize );
 				}
 				else
 				{
-					// add as is
-					pOutBSPHeader->lumps[lumpNum].fileofs = newOffset;
-					outputBuffer.Put( inputBuffer.Base(), inputBuffer.TellPut() );
+					outputBuffer.Put( pInBase + gameLumps[j].fileofs, gameLumps[j].filelen );
 				}
 			}
+
+			byteSwap.SwapFieldsToTargetEndian( outGameLumps.Base(), outGameLumps.Count() );
+			byteSwap.SwapFieldsToTargetEndian( &outGameLumpHeader );
+			byte *pOutGameLumpDir = (byte *)outputBuffer.Base() + dirOffset;
+			V_memcpy( pOutGameLumpDir, &outGameLumpHeader, sizeof( dgamelumpheader_t ) );
+			V_memcpy( pOutGameLumpDir + sizeof( dgamelumpheader_t ), outGameLumps.Base(), outGameLumps.Count() * sizeof( dgamelump_t ) );
+
+			outBSPHeader.lumps[lumpNum].filelen = outputBuffer.TellPut() - outBSPHeader.lumps[lumpNum].fileofs;
+		}
+		else if ( lumpJobs[lumpNum] >= 0 )
+		{
+			LumpDecompressJob_t &job = jobs[lumpJobs[lumpNum]];
+			outBSPHeader.lumps[lumpNum].filelen = job.m_nActualSize;
+			outputBuffer.Put( job.m_Decompressed.Base(), job.m_nActualSize );
+		}
+		else
+		{
+			outputBuffer.Put( pInBase + pLump->fileofs, pLump->filelen );
 		}
 	}
 
-	// fix the output for 360, swapping it back
-	byteSwap.SetTargetBigEndian( true );
-	byteSwap.SwapFieldsToTargetEndian( pOutBSPHeader );
+	byteSwap.SwapFieldsToTargetEndian( &outBSPHeader );
+	V_memcpy( outputBuffer.Base(), &outBSPHeader, sizeof( BSPHeader_t ) );
 
 	return true;
 }
@@ -4580,7 +5293,7 @@ bool CompressBSP( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer, CompressFun
 //	NOTE: These lumps will be written to the file in exactly the order they appear here,
 //	so they can be shifted around if desired for file access optimization.
 //-----------------------------------------------------------------------------
-bool SwapBSPFile( const char *pInFilename, const char *pOutFilename, bool bSwapOnLoad, VTFConvertFunc_t pVTFConvertFunc, VHVFixupFunc_t pVHVFixupFunc, CompressFunc_t pCompressFunc )
+bool SwapBSPFile( const char *pInFilename, const char *pOutFilename, bool bSwapOnLoad, VTFConvertFunc_t pVTFConvertFunc, VHVFixupFunc_t pVHVFixupFunc, CompressFunc_t pCompressFunc, CompressFunc_t pFastCompressFunc )
 {
 	DevMsg( "Creating %s\n", pOutFilename );
 
@@ -4776,7 +5489,7 @@ bool SwapBSPFile( const char *pInFilename, const char *pOutFilename, bool bSwapO
 		}
 
 		CUtlBuffer outputBuffer;
-		if ( !CompressBSP( inputBuffer, outputBuffer, pCompressFunc ) )
+		if ( !CompressBSP( inputBuffer, outputBuffer, pCompressFunc, pFastCompressFunc ) )
 		{
 			Warning( "Error! Failed to compress BSP '%s'!\n", pOutFilename ); 
 			return false;
@@ -4796,6 +5509,19 @@ bool SwapBSPFile( const char *pInFilename, const char *pOutFilename, bool bSwapO
 	return true;
 }
 
+//-----------------------------------------------------------------------------
+// Only reads the ident
+//-----------------------------------------------------------------------------
+static bool IsBigEndianBSPFile( const char *pBSPFilename )
+{
+	int ident = 0;
+	FileHandle_t hFile = SafeOpenRead( pBSPFilename );
+	SafeRead( hFile, &ident, sizeof( ident ) );
+	g_pFileSystem->Close( hFile );
+
+	return ( ident == BigLong( IDBSPHEADER ) );
+}
+
 //-----------------------------------------------------------------------------
 // Get the pak lump from a BSP
 //-----------------------------------------------------------------------------
@@ -4811,10 +5537,7 @@ bool GetPakFileLump( const char *pBSPFilename, void **pPakData, int *pPakSize )
 	}
 
 	// determine endian nature
-	BSPHeader_t *pHeader;
-	LoadFile( pBSPFilename, (void **)&pHeader );
-	bool bSwap = ( pHeader->ident == BigLong( IDBSPHEADER ) );
-	free( pHeader );
+	bool bSwap = IsBigEndianBSPFile( pBSPFilename );
 
 	g_bSwapOnLoad = bSwap;
 	g_bSwapOnWrite = !bSwap;
@@ -4898,10 +5621,7 @@ bool SetPakFileLump( const char *pBSPFilename, const char *pNewFilename, void *p
 	}
 
 	// determine endian nature
-	BSPHeader_t *pHeader;
-	LoadFile( pBSPFilename, (void **)&pHeader );
-	bool bSwap = ( pHeader->ident == BigLong( IDBSPHEADER ) );
-	free( pHeader );
+	bool bSwap = IsBigEndianBSPFile( pBSPFilename );
 
 	g_bSwapOnLoad = bSwap;
 	g_bSwapOnWrite = bSwap;
@@ -4913,6 +5633,10 @@ bool SetPakFileLump( const char *pBSPFilename, const char *pNewFilename, void *p
 	BSPHeader_t oldHeader;
 	oldHeader = *g_pBSPHeader;
 
+	// the output can be the mapped file under another name (relative, absolute,
+	// a link...), and SafeOpenWrite would truncate it under the mapped lumps
+	ReleaseMappedBSPFile();
+
 	g_hBSPFile = SafeOpenWrite( pNewFilename );
 	if ( !g_hBSPFile )
 	{
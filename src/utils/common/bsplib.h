@@ -208,6 +208,15 @@ typedef bool (*CompressFunc_t)( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffe
 typedef bool (*VTFConvertFunc_t)( const char *pDebugName, CUtlBuffer &sourceBuf, CUtlBuffer &targetBuf, CompressFunc_t pCompressFunc );
 typedef bool (*VHVFixupFunc_t)( const char *pVhvFilename, const char *pModelName, CUtlBuffer &sourceBuf, CUtlBuffer &targetBuf );
 
+// Lumps are compressed in parallel, so compress funcs must be thread safe.
+// CompressLumpSnappy is the fast codec for the lumps that are decoded on every
+// map load. The engine's map loader only decodes lzma, so it is opt in: a
+// tool that wants it passes it to SwapBSPFile as pFastCompressFunc, and the
+// default NULL compresses everything with pCompressFunc.
+bool				CompressLumpSnappy( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer );
+bool				DecompressLump( const void *pData, int nDataSize, void *pOutput, unsigned int nOutputSize );
+bool				DecompressBSP( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer );
+
 //-----------------------------------------------------------------------------
 // Game lump memory storage
 //-----------------------------------------------------------------------------
@@ -288,6 +297,21 @@ int		CompressVis (byte *vis, byte *dest);
 
 void	OpenBSPFile( const char *filename );
 void	CloseBSPFile(void);
+void	ReleaseMappedBSPFile(void);
+
+// Zero-copy, read-only access to the lumps of the file opened by OpenBSPFile, valid
+// until CloseBSPFile. The data is in file byte order. Returns NULL for empty lumps.
+const void *GetLumpData( int lump, int elementSize, int &length, int forceVersion = -1 );
+
+template< class T >
+inline const T *GetLumpView( int lump, int &count, int forceVersion = -1 )
+{
+	int length;
+	const T *pData = (const T *)GetLumpData( lump, sizeof( T ), length, forceVersion );
+	count = length / sizeof( T );
+	return pData;
+}
+
 void	LoadBSPFile( const char *filename );
 void	LoadBSPFile_FileSystemOnly( const char *filename );
 void	LoadBSPFileTexinfo( const char *filename );
@@ -295,7 +319,7 @@ void	WriteBSPFile( const char *filename, char *pUnused = NULL );
 void	PrintBSPFileSizes(void);
 void	PrintBSPPackDirectory(void);
 void	ReleasePakFileLumps(void);
-bool	SwapBSPFile( const char *filename, const char *swapFilename, bool bSwapOnLoad, VTFConvertFunc_t pVTFConvertFunc, VHVFixupFunc_t pVHVFixupFunc, CompressFunc_t pCompressFunc );
+bool	SwapBSPFile( const char *filename, const char *swapFilename, bool bSwapOnLoad, VTFConvertFunc_t pVTFConvertFunc, VHVFixupFunc_t pVHVFixupFunc, CompressFunc_t pCompressFunc, CompressFunc_t pFastCompressFunc = NULL );
 bool	GetPakFileLump( const char *pBSPFilename, void **pPakData, int *pPakSize );
 bool	SetPakFileLump( const char *pBSPFilename, const char *pNewFilename, void *pPakData, int pakSize );
 void	WriteLumpToFile( char *filename, int lump );
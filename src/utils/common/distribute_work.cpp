@@ -0,0 +1,961 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Portable coordinator/worker distribution of tool work units over
+//			TCP, for when VMPI isn't available.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifdef _WIN32
+#define FD_SETSIZE 256
+#include <windows.h>
+#include <winsock.h>
+typedef int socklen_t;
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+typedef int SOCKET;
+#define INVALID_SOCKET -1
+#define SOCKET_ERROR -1
+#define closesocket close
+#endif
+
+#include "cmdlib.h"
+#include "threads.h"
+#include "pacifier.h"
+#include "distribute_work.h"
+#include "tier0/platform.h"
+#include "tier1/strtools.h"
+#include "utlvector.h"
+
+
+#define DW_PROTOCOL_VERSION		1
+
+#define DW_UNITS_PER_THREAD		8		// work units handed out per worker thread in one go
+#define DW_POLL_SECONDS			0.05
+#define DW_REISSUE_SECONDS		10.0	// idle workers get copies of units outstanding this long
+#define DW_MAX_MESSAGE_BYTES	( 512 * 1024 * 1024 )
+
+enum
+{
+	DW_MSG_HELLO = 1,		// worker -> coordinator. int version, int threads
+	DW_MSG_REQUEST,			// worker -> coordinator. uint64 work units in stage, int max units
+	DW_MSG_RESULT,			// worker -> coordinator. uint64 work unit, results
+	DW_MSG_WORK,			// coordinator -> worker. int done, int n, uint64 units[n],
+							//   int nshared, { uint64 unit, int len, results }[nshared]
+};
+
+// All messages start with this. Both ends are assumed to have the same byte order.
+struct DWMessageHeader_t
+{
+	uint32	m_nType;
+	uint32	m_nStage;
+	uint32	m_nBytes;		// following the header
+};
+
+enum
+{
+	DW_UNIT_PENDING = 0,
+	DW_UNIT_ASSIGNED,
+	DW_UNIT_DONE
+};
+
+#define DW_PRODUCER_LOCAL	-1
+
+
+struct DWStage_t
+{
+	uint64	m_nWorkUnits;
+	int		m_nFlags;
+
+	// coordinator only
+	CUtlVector<uint8>			m_UnitState;
+	CUtlVector<double>			m_AssignTime;
+	CUtlVector<int>				m_AssignedWorker;
+	CUtlVector<int>				m_Producer;
+	CUtlVector<CUtlBuffer *>	m_Results;
+	CUtlVector<uint64>			m_Completed;		// in the order they came in, for DW_SHARE_RESULTS
+	CUtlVector<uint64>			m_Retry;			// units taken back from workers that went away
+	uint64	m_nNextUnit;
+	uint64	m_nApplied;
+	bool	m_bFinished;
+};
+
+struct DWWorker_t
+{
+	SOCKET	m_Socket;
+	char	m_szName[64];
+	int		m_nThreads;
+	CUtlVector<byte>	m_RecvBuffer;
+
+	// unanswered request
+	int		m_nRequestStage;
+	int		m_nRequestUnits;
+
+	CUtlVector<uint64>	m_Assigned;			// units of the current stage
+	CUtlVector<int>		m_SharedCursor;		// per stage, how much of m_Completed it's been sent
+};
+
+
+static bool g_bDWCoordinator = false;
+static bool g_bDWWorker = false;
+static SOCKET g_DWSocket = INVALID_SOCKET;		// listen socket, or a worker's coordinator connection
+static CUtlVector<DWWorker_t *> g_DWWorkers;
+static CUtlVector<DWStage_t *> g_DWStages;
+static int g_nDWStage = 0;
+
+#ifdef _WIN32
+static CUtlVector<HANDLE> g_DWLocalProcesses;
+#else
+static CUtlVector<pid_t> g_DWLocalProcesses;
+#endif
+
+// the batch RunThreadsOnIndividual is working on
+static DWProcessFn g_pDWProcessFn;
+static CUtlVector<uint64> g_DWBatchUnits;
+static CUtlVector<CUtlBuffer *> g_DWBatchResults;
+
+
+//-----------------------------------------------------------------------------
+// Sockets
+//-----------------------------------------------------------------------------
+static bool DW_SendAll( SOCKET s, const void *pData, int nBytes )
+{
+	const char *pCur = (const char *)pData;
+	while ( nBytes > 0 )
+	{
+		int nSent = send( s, pCur, nBytes, 0 );
+		if ( nSent <= 0 )
+			return false;
+		pCur += nSent;
+		nBytes -= nSent;
+	}
+	return true;
+}
+
+static bool DW_RecvAll( SOCKET s, void *pData, int nBytes )
+{
+	char *pCur = (char *)pData;
+	while ( nBytes > 0 )
+	{
+		int nReceived = recv( s, pCur, nBytes, 0 );
+		if ( nReceived <= 0 )
+			return false;
+		pCur += nReceived;
+		nBytes -= nReceived;
+	}
+	return true;
+}
+
+static bool DW_SendMessage( SOCKET s, uint32 nType, uint32 nStage, const void *pPayload, int nBytes )
+{
+	DWMessageHeader_t header;
+	header.m_nType = nType;
+	header.m_nStage = nStage;
+	header.m_nBytes = nBytes;
+	return DW_SendAll( s, &header, sizeof( header ) ) && ( !nBytes || DW_SendAll( s, pPayload, nBytes ) );
+}
+
+static void DW_SetNoDelay( SOCKET s )
+{
+	int nOn = 1;
+	setsockopt( s, IPPROTO_TCP, TCP_NODELAY, (const char *)&nOn, sizeof( nOn ) );
+}
+
+
+//-----------------------------------------------------------------------------
+// Local worker processes
+//-----------------------------------------------------------------------------
+static void DW_SpawnLocalWorkers( int nWorkers, int nPort, int argc, char **argv )
+{
+	char szCoordinator[64];
+	Q_snprintf( szCoordinator, sizeof( szCoordinator ), "127.0.0.1:%d", nPort );
+
+	// split the cpus between the workers. a -threads on the original command line still wins.
+	char szThreads[16];
+	Q_snprintf( szThreads, sizeof( szThreads ), "%d", MAX( 1, GetCPUInformation().m_nLogicalProcessors / nWorkers ) );
+
+	CUtlVector<const char *> args;
+	args.AddToTail( argv[0] );
+	args.AddToTail( "-coordinator" );
+	args.AddToTail( szCoordinator );
+	args.AddToTail( "-threads" );
+	args.AddToTail( szThreads );
+	for ( int i = 1; i < argc; i++ )
+	{
+		args.AddToTail( argv[i] );
+	}
+
+#ifdef _WIN32
+	char szExe[MAX_PATH];
+	GetModuleFileName( NULL, szExe, sizeof( szExe ) );
+
+	CUtlVector<char> cmdLine;
+	for ( int i = 0; i < args.Count(); i++ )
+	{
+		const char *pArg = ( i == 0 ) ? szExe : args[i];
+		if ( i )
+			cmdLine.AddToTail( ' ' );
+		cmdLine.AddToTail( '"' );
+		cmdLine.AddMultipleToTail( V_strlen( pArg ), pArg );
+		cmdLine.AddToTail( '"' );
+	}
+	cmdLine.AddToTail( 0 );
+
+	for ( int i = 0; i < nWorkers; i++ )
+	{
+		STARTUPINFO si;
+		memset( &si, 0, sizeof( si ) );
+		si.cb = sizeof( si );
+		PROCESS_INFORMATION pi;
+		if ( !CreateProcess( szExe, cmdLine.Base(), NULL, NULL, FALSE, CREATE_NO_WINDOW | ( g_bLowPriorityThreads ? IDLE_PRIORITY_CLASS : 0 ),
+			NULL, NULL, &si, &pi ) )
+		{
+			Warning( "Unable to start local worker %d (error %d)\n", i, GetLastError() );
+			continue;
+		}
+		CloseHandle( pi.hThread );
+		g_DWLocalProcesses.AddToTail( pi.hProcess );
+	}
+#else
+	args.AddToTail( NULL );
+	for ( int i = 0; i < nWorkers; i++ )
+	{
+		pid_t pid = fork();
+		if ( pid == 0 )
+		{
+			// workers talk to the coordinator, not the console
+			int fd = open( "/dev/null", O_RDWR );
+			if ( fd >= 0 )
+			{
+				dup2( fd, 1 );
+				dup2( fd, 2 );
+			}
+			execvp( args[0], (char * const *)args.Base() );
+			_exit( 1 );
+		}
+		if ( pid < 0 )
+		{
+			Warning( "Unable to start local worker %d\n", i );
+			continue;
+		}
+		g_DWLocalProcesses.AddToTail( pid );
+	}
+#endif
+
+	Msg( "Started %d local workers\n", g_DWLocalProcesses.Count() );
+}
+
+
+//-----------------------------------------------------------------------------
+// Init / shutdown
+//-----------------------------------------------------------------------------
+static void DW_RemoveArgs( int &argc, char **argv, int iArg, int nArgs )
+{
+	for ( int i = iArg; i + nArgs < argc; i++ )
+	{
+		argv[i] = argv[i + nArgs];
+	}
+	argc -= nArgs;
+}
+
+bool DW_Init( int &argc, char **&argv )
+{
+	int nLocalWorkers = 0;
+	int nPort = -1;
+	const char *pCoordinator = NULL;
+
+	for ( int i = 1; i < argc; )
+	{
+		if ( !V_stricmp( argv[i], "-workers" ) && i + 1 < argc )
+		{
+			nLocalWorkers = MAX( 0, atoi( argv[i + 1] ) );
+			DW_RemoveArgs( argc, argv, i, 2 );
+		}
+		else if ( !V_stricmp( argv[i], "-workerport" ) && i + 1 < argc )
+		{
+			nPort = atoi( argv[i + 1] );
+			DW_RemoveArgs( argc, argv, i, 2 );
+		}
+		else if ( !V_stricmp( argv[i], "-coordinator" ) && i + 1 < argc )
+		{
+			pCoordinator = argv[i + 1];
+			DW_RemoveArgs( argc, argv, i, 2 );
+		}
+		else
+		{
+			i++;
+		}
+	}
+
+	if ( !pCoordinator && !nLocalWorkers && nPort < 0 )
+		return false;
+
+#ifdef _WIN32
+	WSADATA wsaData;
+	if ( WSAStartup( MAKEWORD( 1, 1 ), &wsaData ) != 0 )
+		Error( "WSAStartup failed\n" );
+#endif
+
+	CmdLib_AtCleanup( DW_Shutdown );
+
+	if ( pCoordinator )
+	{
+		char szHost[256];
+		V_strncpy( szHost, pCoordinator, sizeof( szHost ) );
+		char *pColon = strrchr( szHost, ':' );
+		if ( !pColon )
+			Error( "-coordinator expects host:port\n" );
+		*pColon = 0;
+		int nCoordinatorPort = atoi( pColon + 1 );
+
+		struct hostent *pHost = gethostbyname( szHost );
+		if ( !pHost )
+			Error( "Can't resolve coordinator %s\n", szHost );
+
+		sockaddr_in addr;
+		memset( &addr, 0, sizeof( addr ) );
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons( (unsigned short)nCoordinatorPort );
+		memcpy( &addr.sin_addr, pHost->h_addr, sizeof( addr.sin_addr ) );
+
+		g_DWSocket = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+		if ( g_DWSocket == INVALID_SOCKET || connect( g_DWSocket, (sockaddr *)&addr, sizeof( addr ) ) == SOCKET_ERROR )
+			Error( "Can't connect to coordinator %s\n", pCoordinator );
+		DW_SetNoDelay( g_DWSocket );
+
+		int hello[2] = { DW_PROTOCOL_VERSION, numthreads };
+		if ( !DW_SendMessage( g_DWSocket, DW_MSG_HELLO, 0, hello, sizeof( hello ) ) )
+			Error( "Lost connection to coordinator %s\n", pCoordinator );
+
+		g_bDWWorker = true;
+		Msg( "Working for coordinator %s\n", pCoordinator );
+		return true;
+	}
+
+	g_DWSocket = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+	if ( g_DWSocket == INVALID_SOCKET )
+		Error( "Can't create worker socket\n" );
+
+	sockaddr_in addr;
+	memset( &addr, 0, sizeof( addr ) );
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons( (unsigned short)MAX( nPort, 0 ) );
+	addr.sin_addr.s_addr = htonl( ( nPort >= 0 ) ? INADDR_ANY : INADDR_LOOPBACK );
+	if ( bind( g_DWSocket, (sockaddr *)&addr, sizeof( addr ) ) == SOCKET_ERROR || listen( g_DWSocket, 64 ) == SOCKET_ERROR )
+		Error( "Can't listen for workers on port %d\n", MAX( nPort, 0 ) );
+
+	socklen_t nAddrLen = sizeof( addr );
+	getsockname( g_DWSocket, (sockaddr *)&addr, &nAddrLen );
+	nPort = ntohs( addr.sin_port );
+
+	g_bDWCoordinator = true;
+	Msg( "Coordinating workers on port %d\n", nPort );
+
+	if ( nLocalWorkers )
+	{
+		DW_SpawnLocalWorkers( nLocalWorkers, nPort, argc, argv );
+	}
+	return true;
+}
+
+void DW_Shutdown()
+{
+	for ( int i = 0; i < g_DWWorkers.Count(); i++ )
+	{
+		if ( g_DWWorkers[i]->m_Socket != INVALID_SOCKET )
+			closesocket( g_DWWorkers[i]->m_Socket );
+	}
+	g_DWWorkers.PurgeAndDeleteElements();
+
+	if ( g_DWSocket != INVALID_SOCKET )
+	{
+		closesocket( g_DWSocket );
+		g_DWSocket = INVALID_SOCKET;
+	}
+
+	// local workers exit once their connection closes
+	for ( int i = 0; i < g_DWLocalProcesses.Count(); i++ )
+	{
+#ifdef _WIN32
+		WaitForSingleObject( g_DWLocalProcesses[i], 5000 );
+		CloseHandle( g_DWLocalProcesses[i] );
+#else
+		waitpid( g_DWLocalProcesses[i], NULL, 0 );
+#endif
+	}
+	g_DWLocalProcesses.Purge();
+
+	for ( int i = 0; i < g_DWStages.Count(); i++ )
+	{
+		g_DWStages[i]->m_Results.PurgeAndDeleteElements();
+	}
+	g_DWStages.PurgeAndDeleteElements();
+}
+
+bool DW_IsActive()
+{
+	return g_bDWCoordinator || g_bDWWorker;
+}
+
+bool DW_IsWorker()
+{
+	return g_bDWWorker;
+}
+
+void DW_FinishWorker()
+{
+	Assert( g_bDWWorker );
+	Msg( "Worker finished\n" );
+	CmdLib_Exit( 0 );
+}
+
+
+static void DW_PollWorkers( float flTimeout );
+static void DW_ServiceRequests();
+
+//-----------------------------------------------------------------------------
+// Runs g_pDWProcessFn over g_DWBatchUnits on all threads
+//-----------------------------------------------------------------------------
+static void DW_ProcessBatchItem( int iThread, int iItem )
+{
+	// The coordinator's first thread answers the workers between its units, so
+	// they aren't left waiting (and timing out) on the whole local batch. Only
+	// this thread touches the workers and stages while the batch runs; the
+	// units in the batch are still pending, so none of them can be handed out.
+	if ( g_bDWCoordinator && iThread == 0 )
+	{
+		DW_PollWorkers( 0.0f );
+		DW_ServiceRequests();
+	}
+
+	g_pDWProcessFn( iThread, g_DWBatchUnits[iItem], g_DWBatchResults[iItem] );
+}
+
+static void DW_ProcessBatch( DWProcessFn processFn, bool bKeepResults )
+{
+	g_pDWProcessFn = processFn;
+	g_DWBatchResults.SetCount( g_DWBatchUnits.Count() );
+	for ( int i = 0; i < g_DWBatchUnits.Count(); i++ )
+	{
+		g_DWBatchResults[i] = bKeepResults ? new CUtlBuffer : NULL;
+	}
+	RunThreadsOnIndividual( g_DWBatchUnits.Count(), false, DW_ProcessBatchItem );
+}
+
+
+//-----------------------------------------------------------------------------
+// Coordinator
+//-----------------------------------------------------------------------------
+static void DW_DropWorker( int iWorker, const char *pReason )
+{
+	DWWorker_t *pWorker = g_DWWorkers[iWorker];
+	if ( pWorker->m_Socket == INVALID_SOCKET )
+		return;
+
+	Warning( "Worker %s dropped: %s\n", pWorker->m_szName, pReason );
+	closesocket( pWorker->m_Socket );
+	pWorker->m_Socket = INVALID_SOCKET;
+	pWorker->m_nRequestStage = -1;
+
+	// give whatever it was working on to somebody else
+	if ( g_nDWStage < g_DWStages.Count() )
+	{
+		DWStage_t *pStage = g_DWStages[g_nDWStage];
+		for ( int i = 0; i < pWorker->m_Assigned.Count(); i++ )
+		{
+			uint64 iUnit = pWorker->m_Assigned[i];
+			if ( pStage->m_UnitState[iUnit] != DW_UNIT_DONE && pStage->m_AssignedWorker[iUnit] == iWorker )
+			{
+				pStage->m_UnitState[iUnit] = DW_UNIT_PENDING;
+				pStage->m_Retry.AddToTail( iUnit );
+			}
+		}
+	}
+	pWorker->m_Assigned.Purge();
+}
+
+static void DW_HandleMessage( int iWorker, const DWMessageHeader_t &header, const byte *pPayload )
+{
+	DWWorker_t *pWorker = g_DWWorkers[iWorker];
+	switch ( header.m_nType )
+	{
+		case DW_MSG_HELLO:
+		{
+			const int *pHello = (const int *)pPayload;
+			if ( header.m_nBytes != 2 * sizeof( int ) || pHello[0] != DW_PROTOCOL_VERSION )
+			{
+				DW_DropWorker( iWorker, "protocol mismatch" );
+				return;
+			}
+			pWorker->m_nThreads = MAX( 1, pHello[1] );
+			qprintf( "Worker %s connected with %d threads\n", pWorker->m_szName, pWorker->m_nThreads );
+			break;
+		}
+
+		case DW_MSG_REQUEST:
+		{
+			uint64 nWorkUnits;
+			memcpy( &nWorkUnits, pPayload, sizeof( nWorkUnits ) );
+			if ( (int)header.m_nStage < g_DWStages.Count() && g_DWStages[header.m_nStage]->m_nWorkUnits != nWorkUnits )
+			{
+				DW_DropWorker( iWorker, "work unit count mismatch (different map or options?)" );
+				return;
+			}
+			pWorker->m_nRequestStage = header.m_nStage;
+			memcpy( &pWorker->m_nRequestUnits, pPayload + sizeof( nWorkUnits ), sizeof( int ) );
+			break;
+		}
+
+		case DW_MSG_RESULT:
+		{
+			if ( header.m_nStage != (uint32)g_nDWStage || g_nDWStage >= g_DWStages.Count() )
+				break;
+
+			DWStage_t *pStage = g_DWStages[g_nDWStage];
+			uint64 iUnit;
+			memcpy( &iUnit, pPayload, sizeof( iUnit ) );
+			if ( iUnit >= pStage->m_nWorkUnits )
+			{
+				DW_DropWorker( iWorker, "bad work unit" );
+				return;
+			}
+			pWorker->m_Assigned.FindAndFastRemove( iUnit );
+
+			// first result for a unit wins
+			if ( pStage->m_UnitState[iUnit] == DW_UNIT_DONE )
+				break;
+
+			CUtlBuffer *pBuf = new CUtlBuffer;
+			pBuf->Put( pPayload + sizeof( iUnit ), header.m_nBytes - sizeof( iUnit ) );
+			pStage->m_Results[iUnit] = pBuf;
+			pStage->m_Producer[iUnit] = iWorker;
+			pStage->m_UnitState[iUnit] = DW_UNIT_DONE;
+			pStage->m_Completed.AddToTail( iUnit );
+			break;
+		}
+
+		default:
+			DW_DropWorker( iWorker, "bad message" );
+			break;
+	}
+}
+
+// Accepts new workers and reads whatever they've sent, waiting at most flTimeout.
+static void DW_PollWorkers( float flTimeout )
+{
+	fd_set readSet;
+	FD_ZERO( &readSet );
+	FD_SET( g_DWSocket, &readSet );
+	SOCKET maxSocket = g_DWSocket;
+	for ( int i = 0; i < g_DWWorkers.Count(); i++ )
+	{
+		SOCKET s = g_DWWorkers[i]->m_Socket;
+		if ( s != INVALID_SOCKET )
+		{
+			FD_SET( s, &readSet );
+			maxSocket = MAX( maxSocket, s );
+		}
+	}
+
+	timeval tv;
+	tv.tv_sec = 0;
+	tv.tv_usec = (int)( flTimeout * 1000000 );
+	if ( select( (int)maxSocket + 1, &readSet, NULL, NULL, &tv ) <= 0 )
+		return;
+
+	if ( FD_ISSET( g_DWSocket, &readSet ) )
+	{
+		sockaddr_in addr;
+		socklen_t nAddrLen = sizeof( addr );
+		SOCKET s = accept( g_DWSocket, (sockaddr *)&addr, &nAddrLen );
+		if ( s != INVALID_SOCKET )
+		{
+			DW_SetNoDelay( s );
+			DWWorker_t *pWorker = new DWWorker_t;
+			pWorker->m_Socket = s;
+			Q_snprintf( pWorker->m_szName, sizeof( pWorker->m_szName ), "%s:%d", inet_ntoa( addr.sin_addr ), ntohs( addr.sin_port ) );
+			pWorker->m_nThreads = 1;
+			pWorker->m_nRequestStage = -1;
+			pWorker->m_nRequestUnits = 0;
+			g_DWWorkers.AddToTail( pWorker );
+		}
+	}
+
+	for ( int i = 0; i < g_DWWorkers.Count(); i++ )
+	{
+		DWWorker_t *pWorker = g_DWWorkers[i];
+		if ( pWorker->m_Socket == INVALID_SOCKET || !FD_ISSET( pWorker->m_Socket, &readSet ) )
+			continue;
+
+		char buf[64 * 1024];
+		int nReceived = recv( pWorker->m_Socket, buf, sizeof( buf ), 0 );
+		if ( nReceived <= 0 )
+		{
+			DW_DropWorker( i, "disconnected" );
+			continue;
+		}
+		pWorker->m_RecvBuffer.AddMultipleToTail( nReceived, (const byte *)buf );
+
+		// handle every complete message
+		int nUsed = 0;
+		while ( pWorker->m_Socket != INVALID_SOCKET && pWorker->m_RecvBuffer.Count() - nUsed >= (int)sizeof( DWMessageHeader_t ) )
+		{
+			DWMessageHeader_t header;
+			memcpy( &header, pWorker->m_RecvBuffer.Base() + nUsed, sizeof( header ) );
+			if ( header.m_nBytes > DW_MAX_MESSAGE_BYTES ||
+				( header.m_nType == DW_MSG_REQUEST && header.m_nBytes != sizeof( uint64 ) + sizeof( int ) ) ||
+				( header.m_nType == DW_MSG_RESULT && header.m_nBytes < sizeof( uint64 ) ) )
+			{
+				DW_DropWorker( i, "bad message" );
+				break;
+			}
+			if ( pWorker->m_RecvBuffer.Count() - nUsed < (int)( sizeof( header ) + header.m_nBytes ) )
+				break;
+
+			DW_HandleMessage( i, header, pWorker->m_RecvBuffer.Base() + nUsed + sizeof( header ) );
+			nUsed += sizeof( header ) + header.m_nBytes;
+		}
+		if ( pWorker->m_Socket != INVALID_SOCKET )
+			pWorker->m_RecvBuffer.RemoveMultipleFromHead( nUsed );
+	}
+}
+
+// Appends the shared results the worker hasn't seen yet for a stage.
+static void DW_PutSharedResults( int iWorker, int iStage, CUtlBuffer &msg )
+{
+	DWWorker_t *pWorker = g_DWWorkers[iWorker];
+	DWStage_t *pStage = g_DWStages[iStage];
+	if ( !( pStage->m_nFlags & DW_SHARE_RESULTS ) )
+	{
+		msg.PutInt( 0 );
+		return;
+	}
+
+	while ( pWorker->m_SharedCursor.Count() <= iStage )
+	{
+		pWorker->m_SharedCursor.AddToTail( 0 );
+	}
+
+	int nCountPos = msg.TellPut();
+	msg.PutInt( 0 );
+	int nShared = 0;
+	for ( int &i = pWorker->m_SharedCursor[iStage]; i < pStage->m_Completed.Count(); i++ )
+	{
+		uint64 iUnit = pStage->m_Completed[i];
+		if ( pStage->m_Producer[iUnit] == iWorker )
+			continue;
+
+		CUtlBuffer *pResult = pStage->m_Results[iUnit];
+		msg.Put( &iUnit, sizeof( iUnit ) );
+		msg.PutInt( pResult->TellPut() );
+		msg.Put( pResult->Base(), pResult->TellPut() );
+		nShared++;
+	}
+	*(int *)( (byte *)msg.Base() + nCountPos ) = nShared;
+}
+
+// Picks up to nMax units for a worker. Returns false if there's nothing to give it right now.
+static bool DW_AssignUnits( int iWorker, DWStage_t *pStage, int nMax, CUtlVector<uint64> &units )
+{
+	double flNow = Plat_FloatTime();
+	while ( units.Count() < nMax && pStage->m_Retry.Count() )
+	{
+		uint64 iUnit = pStage->m_Retry.Tail();
+		pStage->m_Retry.RemoveMultipleFromTail( 1 );
+		if ( pStage->m_UnitState[iUnit] == DW_UNIT_PENDING )
+			units.AddToTail( iUnit );
+	}
+	while ( units.Count() < nMax && pStage->m_nNextUnit < pStage->m_nWorkUnits )
+	{
+		uint64 iUnit = pStage->m_nNextUnit++;
+		if ( pStage->m_UnitState[iUnit] == DW_UNIT_PENDING )
+			units.AddToTail( iUnit );
+	}
+
+	if ( !units.Count() )
+	{
+		// everything's handed out. give it a copy of the unit that's been out the longest, in
+		// case whoever has it is stuck.
+		int iOldest = -1;
+		for ( uint64 iUnit = pStage->m_nApplied; iUnit < pStage->m_nWorkUnits; iUnit++ )
+		{
+			if ( pStage->m_UnitState[iUnit] == DW_UNIT_ASSIGNED && pStage->m_AssignedWorker[iUnit] != iWorker &&
+				flNow - pStage->m_AssignTime[iUnit] > DW_REISSUE_SECONDS &&
+				( iOldest == -1 || pStage->m_AssignTime[iUnit] < pStage->m_AssignTime[iOldest] ) )
+			{
+				iOldest = (int)iUnit;
+			}
+		}
+		if ( iOldest != -1 )
+			units.AddToTail( iOldest );
+	}
+
+	for ( int i = 0; i < units.Count(); i++ )
+	{
+		uint64 iUnit = units[i];
+		pStage->m_UnitState[iUnit] = DW_UNIT_ASSIGNED;
+		pStage->m_AssignTime[iUnit] = flNow;
+		pStage->m_AssignedWorker[iUnit] = iWorker;
+		g_DWWorkers[iWorker]->m_Assigned.AddToTail( iUnit );
+	}
+	return units.Count() > 0;
+}
+
+// Answers the requests that can be answered.
+static void DW_ServiceRequests()
+{
+	for ( int i = 0; i < g_DWWorkers.Count(); i++ )
+	{
+		DWWorker_t *pWorker = g_DWWorkers[i];
+		int iStage = pWorker->m_nRequestStage;
+		if ( pWorker->m_Socket == INVALID_SOCKET || iStage < 0 || iStage >= g_DWStages.Count() )
+			continue;
+
+		DWStage_t *pStage = g_DWStages[iStage];
+		CUtlVector<uint64> units;
+		if ( !pStage->m_bFinished && !DW_AssignUnits( i, pStage, MAX( 1, pWorker->m_nRequestUnits ), units ) )
+			continue;
+
+		CUtlBuffer msg;
+		msg.PutInt( pStage->m_bFinished );
+		msg.PutInt( units.Count() );
+		msg.Put( units.Base(), units.Count() * sizeof( uint64 ) );
+		DW_PutSharedResults( i, iStage, msg );
+
+		pWorker->m_nRequestStage = -1;
+		if ( !DW_SendMessage( pWorker->m_Socket, DW_MSG_WORK, iStage, msg.Base(), msg.TellPut() ) )
+			DW_DropWorker( i, "disconnected" );
+	}
+}
+
+// Hands results to receiveFn in work unit order.
+static void DW_ApplyResults( DWStage_t *pStage, DWReceiveFn receiveFn )
+{
+	while ( pStage->m_nApplied < pStage->m_nWorkUnits && pStage->m_UnitState[pStage->m_nApplied] == DW_UNIT_DONE )
+	{
+		uint64 iUnit = pStage->m_nApplied++;
+		CUtlBuffer *pResult = pStage->m_Results[iUnit];
+		if ( pStage->m_Producer[iUnit] != DW_PRODUCER_LOCAL )
+		{
+			receiveFn( iUnit, *pResult, pStage->m_Producer[iUnit] );
+			pResult->SeekGet( CUtlBuffer::SEEK_HEAD, 0 );
+		}
+
+		// shared results have to stay around for workers that haven't seen them
+		if ( !( pStage->m_nFlags & DW_SHARE_RESULTS ) )
+		{
+			delete pResult;
+			pStage->m_Results[iUnit] = NULL;
+		}
+	}
+}
+
+// The coordinator does a batch of whatever the workers haven't taken.
+static void DW_ProcessLocally( DWStage_t *pStage, DWProcessFn processFn )
+{
+	g_DWBatchUnits.RemoveAll();
+	int nMax = numthreads * DW_UNITS_PER_THREAD;
+	while ( g_DWBatchUnits.Count() < nMax && pStage->m_Retry.Count() )
+	{
+		uint64 iUnit = pStage->m_Retry.Tail();
+		pStage->m_Retry.RemoveMultipleFromTail( 1 );
+		if ( pStage->m_UnitState[iUnit] == DW_UNIT_PENDING )
+			g_DWBatchUnits.AddToTail( iUnit );
+	}
+	while ( g_DWBatchUnits.Count() < nMax && pStage->m_nNextUnit < pStage->m_nWorkUnits )
+	{
+		uint64 iUnit = pStage->m_nNextUnit++;
+		if ( pStage->m_UnitState[iUnit] == DW_UNIT_PENDING )
+			g_DWBatchUnits.AddToTail( iUnit );
+	}
+	if ( !g_DWBatchUnits.Count() )
+		return;
+
+	// results are only needed to pass on to workers
+	bool bShare = ( pStage->m_nFlags & DW_SHARE_RESULTS ) != 0;
+	DW_ProcessBatch( processFn, bShare );
+	for ( int i = 0; i < g_DWBatchUnits.Count(); i++ )
+	{
+		// first result for a unit wins
+		uint64 iUnit = g_DWBatchUnits[i];
+		if ( pStage->m_UnitState[iUnit] == DW_UNIT_DONE )
+		{
+			delete g_DWBatchResults[i];
+			continue;
+		}
+
+		pStage->m_UnitState[iUnit] = DW_UNIT_DONE;
+		pStage->m_Producer[iUnit] = DW_PRODUCER_LOCAL;
+		pStage->m_Results[iUnit] = g_DWBatchResults[i];
+		if ( bShare )
+			pStage->m_Completed.AddToTail( iUnit );
+	}
+}
+
+static void DW_Coordinate( DWStage_t *pStage, DWProcessFn processFn, DWReceiveFn receiveFn )
+{
+	int nUnits = (int)pStage->m_nWorkUnits;
+	pStage->m_UnitState.SetCount( nUnits );
+	pStage->m_AssignTime.SetCount( nUnits );
+	pStage->m_AssignedWorker.SetCount( nUnits );
+	pStage->m_Producer.SetCount( nUnits );
+	pStage->m_Results.SetCount( nUnits );
+	for ( int i = 0; i < nUnits; i++ )
+	{
+		pStage->m_UnitState[i] = DW_UNIT_PENDING;
+		pStage->m_AssignedWorker[i] = -1;
+		pStage->m_Results[i] = NULL;
+	}
+	for ( int i = 0; i < g_DWWorkers.Count(); i++ )
+	{
+		g_DWWorkers[i]->m_Assigned.RemoveAll();
+	}
+
+	while ( pStage->m_nApplied < pStage->m_nWorkUnits )
+	{
+		// only wait on the workers once there's nothing left to do here
+		bool bLocalWork = pStage->m_Retry.Count() || pStage->m_nNextUnit < pStage->m_nWorkUnits;
+		DW_PollWorkers( bLocalWork ? 0.0f : DW_POLL_SECONDS );
+		DW_ServiceRequests();
+		DW_ProcessLocally( pStage, processFn );
+		DW_ApplyResults( pStage, receiveFn );
+
+		UpdatePacifier( (float)pStage->m_nApplied / MAX( nUnits, 1 ) );
+	}
+
+	// tell everybody waiting on this stage that it's done
+	pStage->m_bFinished = true;
+	DW_ServiceRequests();
+}
+
+
+//-----------------------------------------------------------------------------
+// Worker
+//-----------------------------------------------------------------------------
+static void DW_WorkerLost()
+{
+	// the coordinator finished or died, either way there's nothing left to do
+	Msg( "Lost connection to coordinator\n" );
+	CmdLib_Exit( 0 );
+}
+
+static void DW_Work( int iStage, DWStage_t *pStage, DWProcessFn processFn, DWReceiveFn receiveFn )
+{
+	bool bShare = ( pStage->m_nFlags & DW_SHARE_RESULTS ) != 0;
+	CUtlVector<bool> processedHere;
+	if ( bShare )
+	{
+		processedHere.SetCount( (int)pStage->m_nWorkUnits );
+		for ( int i = 0; i < processedHere.Count(); i++ )
+		{
+			processedHere[i] = false;
+		}
+	}
+
+	CUtlBuffer msg;
+	for ( ;; )
+	{
+		byte request[sizeof( uint64 ) + sizeof( int )];
+		int nMaxUnits = numthreads * DW_UNITS_PER_THREAD;
+		memcpy( request, &pStage->m_nWorkUnits, sizeof( uint64 ) );
+		memcpy( request + sizeof( uint64 ), &nMaxUnits, sizeof( int ) );
+		if ( !DW_SendMessage( g_DWSocket, DW_MSG_REQUEST, iStage, request, sizeof( request ) ) )
+			DW_WorkerLost();
+
+		DWMessageHeader_t header;
+		if ( !DW_RecvAll( g_DWSocket, &header, sizeof( header ) ) || header.m_nType != DW_MSG_WORK ||
+			header.m_nStage != (uint32)iStage || header.m_nBytes > DW_MAX_MESSAGE_BYTES )
+			DW_WorkerLost();
+
+		msg.Clear();
+		msg.EnsureCapacity( header.m_nBytes );
+		if ( !DW_RecvAll( g_DWSocket, msg.Base(), header.m_nBytes ) )
+			DW_WorkerLost();
+		msg.SeekPut( CUtlBuffer::SEEK_HEAD, header.m_nBytes );
+
+		bool bDone = msg.GetInt() != 0;
+		int nUnits = msg.GetInt();
+		g_DWBatchUnits.SetCount( nUnits );
+		msg.Get( g_DWBatchUnits.Base(), nUnits * sizeof( uint64 ) );
+
+		// the results other workers came up with
+		int nShared = msg.GetInt();
+		for ( int i = 0; i < nShared; i++ )
+		{
+			uint64 iUnit;
+			msg.Get( &iUnit, sizeof( iUnit ) );
+			int nBytes = msg.GetInt();
+			if ( !msg.IsValid() || iUnit >= pStage->m_nWorkUnits || nBytes < 0 || nBytes > msg.GetBytesRemaining() )
+				DW_WorkerLost();
+
+			if ( !processedHere[(int)iUnit] )
+			{
+				CUtlBuffer result( msg.PeekGet(), nBytes, CUtlBuffer::READ_ONLY );
+				receiveFn( iUnit, result, -1 );
+				processedHere[(int)iUnit] = true;
+			}
+			msg.SeekGet( CUtlBuffer::SEEK_CURRENT, nBytes );
+		}
+
+		if ( nUnits )
+		{
+			DW_ProcessBatch( processFn, true );
+			for ( int i = 0; i < nUnits; i++ )
+			{
+				uint64 iUnit = g_DWBatchUnits[i];
+				CUtlBuffer *pResult = g_DWBatchResults[i];
+
+				CUtlBuffer result;
+				result.Put( &iUnit, sizeof( iUnit ) );
+				result.Put( pResult->Base(), pResult->TellPut() );
+				delete pResult;
+
+				if ( !DW_SendMessage( g_DWSocket, DW_MSG_RESULT, iStage, result.Base(), result.TellPut() ) )
+					DW_WorkerLost();
+				if ( bShare )
+					processedHere[(int)iUnit] = true;
+			}
+		}
+
+		if ( bDone )
+			break;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// DW_DistributeWork
+//-----------------------------------------------------------------------------
+double DW_DistributeWork( uint64 nWorkUnits, DWProcessFn processFn, DWReceiveFn receiveFn, int nFlags )
+{
+	Assert( DW_IsActive() );
+	double flStart = Plat_FloatTime();
+
+	DWStage_t *pStage = new DWStage_t;
+	pStage->m_nWorkUnits = nWorkUnits;
+	pStage->m_nFlags = nFlags;
+	pStage->m_nNextUnit = 0;
+	pStage->m_nApplied = 0;
+	pStage->m_bFinished = false;
+	g_nDWStage = g_DWStages.AddToTail( pStage );
+
+	if ( g_bDWWorker )
+	{
+		DW_Work( g_nDWStage, pStage, processFn, receiveFn );
+	}
+	else
+	{
+		DW_Coordinate( pStage, processFn, receiveFn );
+	}
+
+	return Plat_FloatTime() - flStart;
+}
@@ -0,0 +1,71 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Portable coordinator/worker distribution of tool work units over
+//			TCP, for when VMPI isn't available.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef DISTRIBUTE_WORK_H
+#define DISTRIBUTE_WORK_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+
+#include "tier1/utlbuffer.h"
+
+
+//-----------------------------------------------------------------------------
+// The coordinator runs the tool normally and hands work units out to worker
+// processes at each DW_DistributeWork call. Workers run the same command line
+// (so they load the same map and go through the same stages) plus
+// -coordinator, and ask for work units whenever they reach a stage.
+//
+// Command line options, removed from argv by DW_Init:
+//   -workers <n>              coordinator; spawns n worker processes on this machine
+//   -workerport <port>        coordinator; accepts workers on this port (for other machines)
+//   -coordinator <host:port>  this process is a worker for the coordinator at host:port
+//
+// Workers on other machines must see the map and game files at the same paths.
+// Work units that a worker was holding when it disconnects are handed to
+// another worker, and units that are taking long are handed out a second time
+// to idle workers; whichever result arrives first is used. The coordinator
+// works through units itself in between servicing workers, and hands results
+// to the receive function in work unit order, so the output doesn't depend on
+// which worker did what.
+//-----------------------------------------------------------------------------
+
+// Parses and strips the options above and starts any local workers.
+// Returns true if this process is a coordinator or worker.
+bool	DW_Init( int &argc, char **&argv );
+
+// Closes all connections. Workers exit when their coordinator shuts down.
+void	DW_Shutdown();
+
+bool	DW_IsActive();
+bool	DW_IsWorker();
+
+// Workers call this once they're past the last distributed stage; everything
+// after that is done by the coordinator. Doesn't return.
+void	DW_FinishWorker();
+
+
+// Does the work for one unit. pBuf gets the results to send to the coordinator.
+// pBuf is NULL when the coordinator processes a unit itself and nobody else needs
+// the results.
+typedef void (*DWProcessFn)( int iThread, uint64 iWorkUnit, CUtlBuffer *pBuf );
+
+// Applies the results of a work unit that was processed by another process.
+typedef void (*DWReceiveFn)( uint64 iWorkUnit, CUtlBuffer &buf, int iWorker );
+
+// Flags for DW_DistributeWork.
+#define DW_SHARE_RESULTS	0x1		// workers also get everybody else's results, through receiveFn
+
+// Runs processFn on every work unit somewhere and receiveFn on the coordinator
+// for each result. The coordinator and workers must make the same sequence of
+// calls. Returns the time it took.
+double	DW_DistributeWork( uint64 nWorkUnits, DWProcessFn processFn, DWReceiveFn receiveFn, int nFlags = 0 );
+
+
+#endif // DISTRIBUTE_WORK_H
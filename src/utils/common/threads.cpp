@@ -18,8 +18,9 @@
 #define NO_THREAD_NAMES
 #include "threads.h"
 #include "pacifier.h"
+#include "tier0/threadtools.h"
+#include "tier1/utlvector.h"
 
-#define	MAX_THREADS	16
 
 
 class CRunThreadsData
@@ -30,7 +31,7 @@ public:
 	RunThreadsFn m_Fn;
 };
 
-CRunThreadsData g_RunThreadsData[MAX_THREADS];
+CUtlVector<CRunThreadsData> g_RunThreadsData;
 
 
 int		dispatch;
@@ -40,8 +41,196 @@ qboolean		pacifier;
 qboolean	threaded;
 bool g_bLowPriorityThreads = false;
 
-HANDLE g_ThreadHandles[MAX_THREADS];
+CUtlVector<HANDLE> g_ThreadHandles;
 
+// Index+1 of the tool thread running on this OS thread, or 0 outside of RunThreads_Start.
+static CTHREADLOCALINT g_iCurrentThreadPlusOne;
+
+
+/*
+===================================================================
+
+WORK-STEALING DISPATCH
+
+Each thread owns a range of work items [begin,end) packed into one 64-bit word
+so the owner (taking from the front) and thieves (taking from the back) can
+both claim items with a single compare-exchange. The owner copies a small chunk
+into its private m_iCur/m_iEnd and hands those out without touching shared state.
+
+===================================================================
+*/
+
+// Largest number of items a thread will claim from its own range at once.
+// Smaller chunks balance better on phases with very uneven item costs (facelights).
+#define MAX_WORK_CHUNK		16
+
+class CThreadWorkQueue
+{
+public:
+	volatile int64	m_Range;
+
+	// Only touched by the owning thread.
+	int				m_iCur;
+	int				m_iEnd;
+	bool			m_bFinished;
+	int				m_nItems;
+	int				m_nChunks;
+	int				m_nSteals;
+	double			m_flFinishTime;
+
+	// Keep each queue on its own cache line so owners don't fight over m_Range.
+	char			m_Pad[64];
+};
+
+static CUtlVector<CThreadWorkQueue> g_WorkQueues;
+static int g_nWorkQueues;
+static double g_flWorkStartTime;
+static volatile int32 g_nDispatched;
+static volatile int32 g_bPacifierBusy;
+static ThreadWorkStats_t g_LastWorkStats;
+
+static inline int64 PackRange( int iBegin, int iEnd )
+{
+	return (int64)( (uint64)(uint32)iBegin | ( (uint64)(uint32)iEnd << 32 ) );
+}
+
+static inline void UnpackRange( int64 range, int &iBegin, int &iEnd )
+{
+	iBegin = (int)(uint32)( (uint64)range & 0xFFFFFFFF );
+	iEnd = (int)(uint32)( (uint64)range >> 32 );
+}
+
+
+static void InitThreadWork( int nThreads, int nWorkItems )
+{
+	g_nWorkQueues = MAX( nThreads, 1 );
+	if ( g_WorkQueues.Count() < g_nWorkQueues )
+	{
+		g_WorkQueues.SetCount( g_nWorkQueues );
+	}
+	g_nDispatched = 0;
+	g_bPacifierBusy = 0;
+	g_flWorkStartTime = Plat_FloatTime();
+
+	// Give each thread an equal contiguous slice up front. Stealing evens things out later.
+	for ( int i=0; i < g_nWorkQueues; i++ )
+	{
+		CThreadWorkQueue *pQueue = &g_WorkQueues[i];
+		int iBegin = (int)( ( (int64)nWorkItems * i ) / g_nWorkQueues );
+		int iEnd = (int)( ( (int64)nWorkItems * (i+1) ) / g_nWorkQueues );
+
+		pQueue->m_Range = PackRange( iBegin, iEnd );
+		pQueue->m_iCur = pQueue->m_iEnd = 0;
+		pQueue->m_bFinished = false;
+		pQueue->m_nItems = pQueue->m_nChunks = pQueue->m_nSteals = 0;
+		pQueue->m_flFinishTime = g_flWorkStartTime;
+	}
+}
+
+
+// Claim a chunk from the front of our own range.
+static bool PopOwnChunk( CThreadWorkQueue *pQueue )
+{
+	for (;;)
+	{
+		int64 range = pQueue->m_Range;
+		int iBegin, iEnd;
+		UnpackRange( range, iBegin, iEnd );
+		if ( iBegin >= iEnd )
+			return false;
+
+		int nTake = clamp( ( iEnd - iBegin ) >> 3, 1, MAX_WORK_CHUNK );
+		if ( ThreadInterlockedAssignIf64( &pQueue->m_Range, PackRange( iBegin + nTake, iEnd ), range ) )
+		{
+			pQueue->m_iCur = iBegin;
+			pQueue->m_iEnd = iBegin + nTake;
+			++pQueue->m_nChunks;
+			return true;
+		}
+	}
+}
+
+
+// Steal the back half of the fullest queue and make it our own range.
+static bool StealWork( int iThread, CThreadWorkQueue *pQueue )
+{
+	for (;;)
+	{
+		int iVictim = -1;
+		int nMostLeft = 0;
+		int64 victimRange = 0;
+		for ( int i=0; i < g_nWorkQueues; i++ )
+		{
+			if ( i == iThread )
+				continue;
+
+			int64 range = g_WorkQueues[i].m_Range;
+			int iBegin, iEnd;
+			UnpackRange( range, iBegin, iEnd );
+			if ( iEnd - iBegin > nMostLeft )
+			{
+				nMostLeft = iEnd - iBegin;
+				iVictim = i;
+				victimRange = range;
+			}
+		}
+
+		if ( iVictim == -1 )
+			return false;
+
+		int iBegin, iEnd;
+		UnpackRange( victimRange, iBegin, iEnd );
+		int nSteal = ( nMostLeft + 1 ) / 2;
+		if ( !ThreadInterlockedAssignIf64( &g_WorkQueues[iVictim].m_Range, PackRange( iBegin, iEnd - nSteal ), victimRange ) )
+			continue;
+
+		// Our range is empty so nobody else will modify it; publish the stolen items
+		// so other idle threads can steal from us in turn.
+		ThreadInterlockedExchange64( &pQueue->m_Range, PackRange( iEnd - nSteal, iEnd ) );
+		++pQueue->m_nSteals;
+		return true;
+	}
+}
+
+
+static void UpdateThreadWorkPacifier()
+{
+	// Only one thread draws at a time; the others just skip the update.
+	if ( ThreadInterlockedAssignIf( &g_bPacifierBusy, 1, 0 ) )
+	{
+		UpdatePacifier( (float)g_nDispatched / workcount );
+		g_bPacifierBusy = 0;
+	}
+}
+
+
+static void FinishThreadWork()
+{
+	ThreadWorkStats_t &stats = g_LastWorkStats;
+	memset( &stats, 0, sizeof( stats ) );
+	stats.m_nThreads = g_nWorkQueues;
+	stats.m_nWorkItems = workcount;
+
+	double flLastFinish = g_flWorkStartTime;
+	double flBusyTime = 0;
+	for ( int i=0; i < g_nWorkQueues; i++ )
+	{
+		CThreadWorkQueue *pQueue = &g_WorkQueues[i];
+		stats.m_nChunks += pQueue->m_nChunks;
+		stats.m_nSteals += pQueue->m_nSteals;
+		flLastFinish = MAX( flLastFinish, pQueue->m_flFinishTime );
+		flBusyTime += pQueue->m_flFinishTime - g_flWorkStartTime;
+	}
+
+	stats.m_flWallTime = (float)( flLastFinish - g_flWorkStartTime );
+	stats.m_flUtilization = ( stats.m_flWallTime > 0 ) ? (float)( flBusyTime / ( stats.m_flWallTime * g_nWorkQueues ) ) : 1.0f;
+}
+
+
+void GetThreadWorkStats( ThreadWorkStats_t &stats )
+{
+	stats = g_LastWorkStats;
+}
 
 
 /*
@@ -52,23 +241,65 @@ GetThreadWork
 */
 int	GetThreadWork (void)
 {
-	int	r;
+	int iThread = g_iCurrentThreadPlusOne - 1;
+	if ( iThread < 0 || iThread >= g_nWorkQueues )
+	{
+		// Not one of our worker threads (or not threaded at all). Fall back to
+		// the old behavior of handing out one item under the lock.
+		int	r = -1;
 
-	ThreadLock ();
+		ThreadLock ();
+
+		for ( int i=0; i < g_nWorkQueues && r == -1; i++ )
+		{
+			for (;;)
+			{
+				int64 range = g_WorkQueues[i].m_Range;
+				int iBegin, iEnd;
+				UnpackRange( range, iBegin, iEnd );
+				if ( iBegin >= iEnd )
+					break;
+
+				if ( ThreadInterlockedAssignIf64( &g_WorkQueues[i].m_Range, PackRange( iBegin + 1, iEnd ), range ) )
+				{
+					r = iBegin;
+					break;
+				}
+			}
+		}
+
+		if ( r != -1 )
+		{
+			ThreadInterlockedIncrement( &g_nDispatched );
+			UpdatePacifier( (float)g_nDispatched / workcount );
+		}
 
-	if (dispatch == workcount)
-	{
 		ThreadUnlock ();
-		return -1;
+		return r;
 	}
 
-	UpdatePacifier( (float)dispatch / workcount );
+	CThreadWorkQueue *pQueue = &g_WorkQueues[iThread];
+	if ( pQueue->m_iCur >= pQueue->m_iEnd )
+	{
+		while ( !PopOwnChunk( pQueue ) )
+		{
+			if ( !StealWork( iThread, pQueue ) )
+			{
+				if ( !pQueue->m_bFinished )
+				{
+					pQueue->m_bFinished = true;
+					pQueue->m_flFinishTime = Plat_FloatTime();
+				}
+				return -1;
+			}
+		}
 
-	r = dispatch;
-	dispatch++;
-	ThreadUnlock ();
+		ThreadInterlockedExchangeAdd( &g_nDispatched, pQueue->m_iEnd - pQueue->m_iCur );
+		UpdateThreadWorkPacifier();
+	}
 
-	return r;
+	++pQueue->m_nItems;
+	return pQueue->m_iCur++;
 }
 
 
@@ -136,7 +367,7 @@ void ThreadSetDefault (void)
 	{
 		GetSystemInfo (&info);
 		numthreads = info.dwNumberOfProcessors;
-		if (numthreads < 1 || numthreads > 32)
+		if (numthreads < 1)
 			numthreads = 1;
 	}
 
@@ -169,7 +400,9 @@ void ThreadUnlock (void)
 DWORD WINAPI InternalRunThreadsFn( LPVOID pParameter )
 {
 	CRunThreadsData *pData = (CRunThreadsData*)pParameter;
+	g_iCurrentThreadPlusOne = pData->m_iThread + 1;
 	pData->m_Fn( pData->m_iThread, pData->m_pUserData );
+	g_iCurrentThreadPlusOne = 0;
 	return 0;
 }
 
@@ -179,9 +412,8 @@ void RunThreads_Start( RunThreadsFn fn, void *pUserData, ERunThreadsPriority ePr
 	Assert( numthreads > 0 );
 	threaded = true;
 
-	if ( numthreads > MAX_TOOL_THREADS )
-		numthreads = MAX_TOOL_THREADS;
-
+	g_RunThreadsData.SetCount( numthreads );
+	g_ThreadHandles.SetCount( numthreads );
 	for ( int i=0; i < numthreads ;i++ )
 	{
 		g_RunThreadsData[i].m_iThread = i;
@@ -212,9 +444,13 @@ void RunThreads_Start( RunThreadsFn fn, void *pUserData, ERunThreadsPriority ePr
 
 void RunThreads_End()
 {
-	WaitForMultipleObjects( numthreads, g_ThreadHandles, TRUE, INFINITE );
-	for ( int i=0; i < numthreads; i++ )
+	// WaitForMultipleObjects can only take MAXIMUM_WAIT_OBJECTS (64) handles at once.
+	for ( int i=0; i < g_ThreadHandles.Count(); i++ )
+	{
+		WaitForSingleObject( g_ThreadHandles[i], INFINITE );
 		CloseHandle( g_ThreadHandles[i] );
+	}
+	g_ThreadHandles.RemoveAll();
 
 	threaded = false;
 }
@@ -235,6 +471,8 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 	StartPacifier("");
 	pacifier = showpacifier;
 
+	InitThreadWork( numthreads, workcnt );
+
 #ifdef _PROFILE
 	threaded = false;
 	(*func)( 0 );
@@ -244,7 +482,7 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 	
 	RunThreads_Start( fn, pUserData );
 	RunThreads_End();
-
+	FinishThreadWork();
 
 	end = Plat_FloatTime();
 	if (pacifier)
@@ -252,6 +490,13 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 		EndPacifier(false);
 		printf (" (%i)\n", end-start);
 	}
+
+	if ( workcnt > 0 )
+	{
+		const ThreadWorkStats_t &stats = g_LastWorkStats;
+		qprintf( "    %d items on %d threads: %.1f%% utilization, %d chunks, %d steals\n",
+			stats.m_nWorkItems, stats.m_nThreads, stats.m_flUtilization * 100.0f, stats.m_nChunks, stats.m_nSteals );
+	}
 }
 
 
@@ -16,13 +16,19 @@
 #pragma once
 
 
-// Arrays that are indexed by thread should always be MAX_TOOL_THREADS+1
-// large so THREADINDEX_MAIN can be used from the main thread.
-#define MAX_TOOL_THREADS	16
-#define THREADINDEX_MAIN	(MAX_TOOL_THREADS)
+extern	int		numthreads;
 
+// There's no fixed limit on the number of threads; it defaults to the number of
+// processors in the machine. Arrays that are indexed by thread are allocated once
+// ThreadSetDefault has set numthreads, with GetThreadArraySize() entries so
+// THREADINDEX_MAIN can be used from the main thread. numthreads mustn't grow
+// after that.
+#define THREADINDEX_MAIN	(numthreads)
 
-extern	int		numthreads;
+inline int GetThreadArraySize( void )
+{
+	return numthreads + 1;
+}
 
 // If set to true, then all the threads that are created are low priority.
 extern bool	g_bLowPriorityThreads;
@@ -43,8 +49,28 @@ enum ERunThreadsPriority
 void SetLowPriority();
 
 void ThreadSetDefault (void);
+
+// Work items handed out by RunThreadsOn are split into contiguous ranges, one
+// per thread. Each thread takes small chunks off the front of its own range and
+// steals half of the largest remaining range from another thread when it runs dry,
+// so GetThreadWork only touches shared state once per chunk.
 int	GetThreadWork (void);
 
+
+// Utilization stats for the last RunThreadsOn call. These are printed after
+// each phase in -verbose mode.
+struct ThreadWorkStats_t
+{
+	int		m_nThreads;
+	int		m_nWorkItems;
+	int		m_nChunks;			// Chunks taken from a thread's own range.
+	int		m_nSteals;			// Ranges stolen from another thread.
+	float	m_flWallTime;		// Seconds from start to the last thread finishing.
+	float	m_flUtilization;	// Sum of per-thread busy time / ( m_nThreads * m_flWallTime ).
+};
+
+void GetThreadWorkStats( ThreadWorkStats_t &stats );
+
 void RunThreadsOnIndividual ( int workcnt, qboolean showpacifier, ThreadWorkerFn fn );
 
 void RunThreadsOn ( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pUserData=NULL );
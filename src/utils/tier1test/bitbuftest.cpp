@@ -0,0 +1,1129 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: bf_write/bf_read fields at every bit offset, the array functions
+//			and CBitWriteAccumulator against writing and reading the elements
+//			one at a time, and the timings of both against the two dword
+//			WriteUBitLong and ReadUBitLong
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "tier1test.h"
+#include "tier0/dbg.h"
+#include "tier1/bitbuf.h"
+#include "coordsize.h"
+#include "tier1/strtools.h"
+#include "mathlib/vector.h"
+
+#define BITBUF_TEST_DWORDS		6
+
+static uint32 s_nBitBufTestSeed = 0x1234567;
+
+static uint32 BitBufTestRandom()
+{
+	s_nBitBufTestSeed = s_nBitBufTestSeed * 1664525 + 1013904223;
+	return s_nBitBufTestSeed;
+}
+
+static FORCEINLINE int GetTestBit( const unsigned char *pData, int iBit )
+{
+	return ( pData[iBit >> 3] >> ( iBit & 7 ) ) & 1;
+}
+
+static void FillTestBytes( unsigned char *pData, int nBytes )
+{
+	for ( int i = 0; i < nBytes; i++ )
+	{
+		pData[i] = (unsigned char)( BitBufTestRandom() >> 24 );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// WriteUBitLong into a buffer of random bytes at every offset and width. The
+// field's bits must be the value's and every other bit must be unchanged,
+// whether the field fits in one dword or straddles two.
+//-----------------------------------------------------------------------------
+static void TestWriteUBitLong()
+{
+	const int nBytes = BITBUF_TEST_DWORDS * 4;
+	uint32 pData[BITBUF_TEST_DWORDS];
+	unsigned char pBefore[nBytes];
+	unsigned char *pBytes = (unsigned char *)pData;
+
+	bf_write buf( pData, nBytes );
+	for ( int numbits = 1; numbits <= 32; numbits++ )
+	{
+		for ( int iOffset = 0; iOffset + numbits <= nBytes * 8; iOffset++ )
+		{
+			FillTestBytes( pBytes, nBytes );
+			V_memcpy( pBefore, pBytes, nBytes );
+
+			unsigned int nValue = BitBufTestRandom() & ( numbits < 32 ? ( 1u << numbits ) - 1 : ~0u );
+			buf.SeekToBit( iOffset );
+			buf.WriteUBitLong( nValue, numbits );
+			TEST_CHECK( !buf.IsOverflowed() );
+			TEST_CHECK( buf.GetNumBitsWritten() == iOffset + numbits );
+
+			bool bMatches = true;
+			for ( int iBit = 0; iBit < nBytes * 8; iBit++ )
+			{
+				int nExpected = ( iBit >= iOffset && iBit < iOffset + numbits ) ?
+					( ( nValue >> ( iBit - iOffset ) ) & 1 ) : GetTestBit( pBefore, iBit );
+				bMatches = bMatches && ( GetTestBit( pBytes, iBit ) == nExpected );
+			}
+			TEST_CHECK( bMatches );
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// ReadUBitLong at every offset and width, against the bits one at a time.
+// The buffers are exactly their size on the heap, so the last fields in each
+// take the dword path instead of the 64-bit load, and a load past the end
+// would be caught by a memory checker.
+//-----------------------------------------------------------------------------
+static void TestReadUBitLong()
+{
+	for ( int nDWords = 1; nDWords <= BITBUF_TEST_DWORDS; nDWords++ )
+	{
+		int nBytes = nDWords * 4;
+		unsigned char *pData = new unsigned char[nBytes];
+		FillTestBytes( pData, nBytes );
+
+		bf_read buf( pData, nBytes );
+		for ( int numbits = 1; numbits <= 32; numbits++ )
+		{
+			for ( int iOffset = 0; iOffset + numbits <= nBytes * 8; iOffset++ )
+			{
+				unsigned int nExpected = 0;
+				for ( int i = 0; i < numbits; i++ )
+				{
+					nExpected |= (unsigned int)GetTestBit( pData, iOffset + i ) << i;
+				}
+
+				buf.Seek( iOffset );
+				TEST_CHECK( buf.ReadUBitLong( numbits ) == nExpected );
+				TEST_CHECK( buf.GetNumBitsRead() == iOffset + numbits );
+			}
+		}
+		TEST_CHECK( !buf.IsOverflowed() );
+
+		delete [] pData;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// A run of every kind of field, written after 0 to 63 bits of padding. Each
+// must read back the same as it does unpadded, and take the same bits.
+//-----------------------------------------------------------------------------
+#define BITBUF_TEST_FIELDS		64
+
+struct BitBufTestFields_t
+{
+	int			m_nWidth[BITBUF_TEST_FIELDS];
+	uint32		m_nUBitLong[BITBUF_TEST_FIELDS];
+	uint32		m_nVarInt[BITBUF_TEST_FIELDS];
+	int32		m_nSignedVarInt[BITBUF_TEST_FIELDS];
+	float		m_flCoord[BITBUF_TEST_FIELDS];
+	Vector		m_vecCoord[BITBUF_TEST_FIELDS];
+	float		m_flNormal[BITBUF_TEST_FIELDS];
+	Vector		m_vecNormal[BITBUF_TEST_FIELDS];
+};
+
+static void WriteTestFields( bf_write &buf, const BitBufTestFields_t &fields )
+{
+	for ( int i = 0; i < BITBUF_TEST_FIELDS; i++ )
+	{
+		buf.WriteUBitLong( fields.m_nUBitLong[i], fields.m_nWidth[i] );
+		buf.WriteVarInt32( fields.m_nVarInt[i] );
+		buf.WriteSignedVarInt32( fields.m_nSignedVarInt[i] );
+		buf.WriteBitCoord( fields.m_flCoord[i] );
+		buf.WriteBitVec3Coord( fields.m_vecCoord[i] );
+		buf.WriteBitNormal( fields.m_flNormal[i] );
+		buf.WriteBitVec3Normal( fields.m_vecNormal[i] );
+	}
+}
+
+static void ReadTestFields( bf_read &buf, BitBufTestFields_t &fields )
+{
+	for ( int i = 0; i < BITBUF_TEST_FIELDS; i++ )
+	{
+		fields.m_nUBitLong[i] = buf.ReadUBitLong( fields.m_nWidth[i] );
+		fields.m_nVarInt[i] = buf.ReadVarInt32();
+		fields.m_nSignedVarInt[i] = buf.ReadSignedVarInt32();
+		fields.m_flCoord[i] = buf.ReadBitCoord();
+		buf.ReadBitVec3Coord( fields.m_vecCoord[i] );
+		fields.m_flNormal[i] = buf.ReadBitNormal();
+		buf.ReadBitVec3Normal( fields.m_vecNormal[i] );
+	}
+}
+
+static bool TestFieldsMatch( const BitBufTestFields_t &a, const BitBufTestFields_t &b )
+{
+	for ( int i = 0; i < BITBUF_TEST_FIELDS; i++ )
+	{
+		if ( a.m_nUBitLong[i] != b.m_nUBitLong[i] ||
+			 a.m_nVarInt[i] != b.m_nVarInt[i] ||
+			 a.m_nSignedVarInt[i] != b.m_nSignedVarInt[i] ||
+			 a.m_flCoord[i] != b.m_flCoord[i] ||
+			 a.m_vecCoord[i] != b.m_vecCoord[i] ||
+			 a.m_flNormal[i] != b.m_flNormal[i] ||
+			 a.m_vecNormal[i] != b.m_vecNormal[i] )
+			return false;
+	}
+	return true;
+}
+
+static void TestMixedFields()
+{
+	BitBufTestFields_t fields;
+	for ( int i = 0; i < BITBUF_TEST_FIELDS; i++ )
+	{
+		uint32 nRandom = BitBufTestRandom();
+		fields.m_nWidth[i] = 1 + ( nRandom & 31 );
+		fields.m_nUBitLong[i] = BitBufTestRandom() >> ( 32 - fields.m_nWidth[i] );
+		fields.m_nVarInt[i] = BitBufTestRandom() >> ( nRandom >> 27 );
+		fields.m_nSignedVarInt[i] = (int32)BitBufTestRandom() >> ( ( nRandom >> 8 ) & 31 );
+		fields.m_flCoord[i] = ( i & 7 ) ? ( (int)( BitBufTestRandom() >> 16 ) - 32768 ) / 8.0f : 0.0f;
+		fields.m_vecCoord[i].Init( ( (int)( BitBufTestRandom() >> 16 ) - 32768 ) / 4.0f, ( i & 3 ) ? 0.0f : 0.03125f * i, -0.5f * ( nRandom & 0x7f ) );
+		fields.m_flNormal[i] = ( (int)( BitBufTestRandom() >> 20 ) - 2048 ) / 2048.0f;
+		fields.m_vecNormal[i].Init( ( (int)( BitBufTestRandom() >> 20 ) - 2048 ) / 4096.0f, ( i & 1 ) ? 0.0f : 0.5f, 0.0f );
+		fields.m_vecNormal[i].z = ( nRandom & 1 ) ? -0.5f : 0.5f;
+	}
+
+	// Room for the fields after the padding, with a few dwords to spare
+	const int nBytes = BITBUF_TEST_FIELDS * 48 + 16;
+	uint32 *pData = new uint32[nBytes / sizeof( uint32 )];
+	V_memset( pData, 0, nBytes );
+
+	// The fields unpadded give the bit count and the values the floats decode to
+	bf_write buf( pData, nBytes );
+	WriteTestFields( buf, fields );
+	TEST_CHECK( !buf.IsOverflowed() );
+	int nFieldBits = buf.GetNumBitsWritten();
+
+	BitBufTestFields_t decoded;
+	V_memcpy( decoded.m_nWidth, fields.m_nWidth, sizeof( decoded.m_nWidth ) );
+	bf_read in( pData, nBytes );
+	ReadTestFields( in, decoded );
+	TEST_CHECK( in.GetNumBitsRead() == nFieldBits );
+	for ( int i = 0; i < BITBUF_TEST_FIELDS; i++ )
+	{
+		TEST_CHECK( decoded.m_nUBitLong[i] == fields.m_nUBitLong[i] );
+		TEST_CHECK( decoded.m_nVarInt[i] == fields.m_nVarInt[i] );
+		TEST_CHECK( decoded.m_nSignedVarInt[i] == fields.m_nSignedVarInt[i] );
+		TEST_CHECK( fabs( decoded.m_flCoord[i] - fields.m_flCoord[i] ) <= COORD_RESOLUTION );
+		TEST_CHECK( fabs( decoded.m_flNormal[i] - fields.m_flNormal[i] ) <= NORMAL_RESOLUTION );
+	}
+
+	for ( int nPadding = 1; nPadding < 64; nPadding++ )
+	{
+		FillTestBytes( (unsigned char *)pData, nBytes );
+		uint32 nPaddingBits = BitBufTestRandom();
+
+		buf.Reset();
+		for ( int i = 0; i < nPadding; i++ )
+		{
+			buf.WriteOneBit( ( nPaddingBits >> ( i & 31 ) ) & 1 );
+		}
+		WriteTestFields( buf, fields );
+		TEST_CHECK( !buf.IsOverflowed() );
+		TEST_CHECK( buf.GetNumBitsWritten() == nPadding + nFieldBits );
+
+		BitBufTestFields_t padded;
+		V_memcpy( padded.m_nWidth, fields.m_nWidth, sizeof( padded.m_nWidth ) );
+		in.Seek( 0 );
+		bool bPaddingMatches = true;
+		for ( int i = 0; i < nPadding; i++ )
+		{
+			bPaddingMatches = bPaddingMatches && ( in.ReadOneBit() == (int)( ( nPaddingBits >> ( i & 31 ) ) & 1 ) );
+		}
+		ReadTestFields( in, padded );
+		TEST_CHECK( bPaddingMatches );
+		TEST_CHECK( !in.IsOverflowed() );
+		TEST_CHECK( in.GetNumBitsRead() == nPadding + nFieldBits );
+		TEST_CHECK( TestFieldsMatch( padded, decoded ) );
+	}
+
+	delete [] pData;
+}
+
+//-----------------------------------------------------------------------------
+// Writes past the end set the overflow flag and leave the bytes after the
+// buffer alone; reads past the end return 0 and set it
+//-----------------------------------------------------------------------------
+static void TestOverflow()
+{
+	uint32 pData[4];
+	unsigned char *pBytes = (unsigned char *)pData;
+	const int nBytes = 8;
+	V_memset( pData, 0xa5, sizeof( pData ) );
+
+	for ( int iOffset = 40; iOffset < nBytes * 8; iOffset++ )
+	{
+		bf_write buf( pData, nBytes );
+		buf.SetAssertOnOverflow( false );
+		buf.SeekToBit( iOffset );
+		buf.WriteUBitLong( 0, 32, false );
+		TEST_CHECK( buf.IsOverflowed() );
+
+		bool bUntouched = true;
+		for ( int i = nBytes; i < (int)sizeof( pData ); i++ )
+		{
+			bUntouched = bUntouched && ( pBytes[i] == 0xa5 );
+		}
+		TEST_CHECK( bUntouched );
+
+		bf_read in( pData, nBytes );
+		in.SetAssertOnOverflow( false );
+		in.Seek( iOffset );
+		TEST_CHECK( in.ReadUBitLong( 32 ) == 0 );
+		TEST_CHECK( in.IsOverflowed() );
+	}
+
+	// Exactly filling the buffer isn't an overflow
+	bf_write buf( pData, nBytes );
+	buf.SeekToBit( nBytes * 8 - 32 );
+	buf.WriteUBitLong( 0x89abcdef, 32, false );
+	TEST_CHECK( !buf.IsOverflowed() );
+	bf_read in( pData, nBytes );
+	in.Seek( nBytes * 8 - 32 );
+	TEST_CHECK( in.ReadUBitLong( 32 ) == 0x89abcdef );
+	TEST_CHECK( !in.IsOverflowed() );
+}
+
+//-----------------------------------------------------------------------------
+// The array functions, after 0 to 63 bits of padding. They must write the
+// same bits as the elements one at a time and leave the bits after them
+// alone. Reading them back, as arrays or one at a time, must give the same
+// values. The reads stop at the last bit of the array, so the last elements
+// go through the single field calls. Their heap buffers end at the last dword
+// with any of those bits, so a load past it would be caught by a memory
+// checker.
+//-----------------------------------------------------------------------------
+#define BITBUF_TEST_ARRAY		37
+
+enum BitBufTestArray_t
+{
+	TEST_ARRAY_UBITLONG = 0,
+	TEST_ARRAY_VARINT,
+	TEST_ARRAY_SIGNED_VARINT,
+	TEST_ARRAY_COORD,
+	TEST_ARRAY_VEC3_COORD,
+	TEST_ARRAY_NORMAL,
+	TEST_ARRAY_VEC3_NORMAL,
+
+	TEST_ARRAY_COUNT
+};
+
+struct BitBufTestArrays_t
+{
+	int			m_nWidth;
+	uint32		m_nUBitLong[BITBUF_TEST_ARRAY];
+	uint32		m_nVarInt[BITBUF_TEST_ARRAY];
+	int32		m_nSignedVarInt[BITBUF_TEST_ARRAY];
+	float		m_flCoord[BITBUF_TEST_ARRAY];
+	Vector		m_vecCoord[BITBUF_TEST_ARRAY];
+	float		m_flNormal[BITBUF_TEST_ARRAY];
+	Vector		m_vecNormal[BITBUF_TEST_ARRAY];
+};
+
+static void WriteTestArray( bf_write &buf, const BitBufTestArrays_t &arrays, int nArray, int nCount, bool bAsArray )
+{
+	switch ( nArray )
+	{
+	case TEST_ARRAY_UBITLONG:
+		if ( bAsArray )
+		{
+			buf.WriteUBitLongArray( arrays.m_nUBitLong, nCount, arrays.m_nWidth );
+			break;
+		}
+		for ( int i = 0; i < nCount; i++ )
+		{
+			buf.WriteUBitLong( arrays.m_nUBitLong[i], arrays.m_nWidth );
+		}
+		break;
+
+	case TEST_ARRAY_VARINT:
+		if ( bAsArray )
+		{
+			buf.WriteVarInt32Array( arrays.m_nVarInt, nCount );
+			break;
+		}
+		for ( int i = 0; i < nCount; i++ )
+		{
+			buf.WriteVarInt32( arrays.m_nVarInt[i] );
+		}
+		break;
+
+	case TEST_ARRAY_SIGNED_VARINT:
+		if ( bAsArray )
+		{
+			buf.WriteSignedVarInt32Array( arrays.m_nSignedVarInt, nCount );
+			break;
+		}
+		for ( int i = 0; i < nCount; i++ )
+		{
+			buf.WriteSignedVarInt32( arrays.m_nSignedVarInt[i] );
+		}
+		break;
+
+	case TEST_ARRAY_COORD:
+		if ( bAsArray )
+		{
+			buf.WriteBitCoordArray( arrays.m_flCoord, nCount );
+			break;
+		}
+		for ( int i = 0; i < nCount; i++ )
+		{
+			buf.WriteBitCoord( arrays.m_flCoord[i] );
+		}
+		break;
+
+	case TEST_ARRAY_VEC3_COORD:
+		if ( bAsArray )
+		{
+			buf.WriteBitVec3CoordArray( arrays.m_vecCoord, nCount );
+			break;
+		}
+		for ( int i = 0; i < nCount; i++ )
+		{
+			buf.WriteBitVec3Coord( arrays.m_vecCoord[i] );
+		}
+		break;
+
+	case TEST_ARRAY_NORMAL:
+		if ( bAsArray )
+		{
+			buf.WriteBitNormalArray( arrays.m_flNormal, nCount );
+			break;
+		}
+		for ( int i = 0; i < nCount; i++ )
+		{
+			buf.WriteBitNormal( arrays.m_flNormal[i] );
+		}
+		break;
+
+	case TEST_ARRAY_VEC3_NORMAL:
+		if ( bAsArray )
+		{
+			buf.WriteBitVec3NormalArray( arrays.m_vecNormal, nCount );
+			break;
+		}
+		for ( int i = 0; i < nCount; i++ )
+		{
+			buf.WriteBitVec3Normal( arrays.m_vecNormal[i] );
+		}
+		break;
+	}
+}
+
+static void ReadTestArray( bf_read &buf, BitBufTestArrays_t &arrays, int nArray, int nCount, bool bAsArray )
+{
+	switch ( nArray )
+	{
+	case TEST_ARRAY_UBITLONG:
+		if ( bAsArray )
+		{
+			buf.ReadUBitLongArray( arrays.m_nUBitLong, nCount, arrays.m_nWidth );
+			break;
+		}
+		for ( int i = 0; i < nCount; i++ )
+		{
+			arrays.m_nUBitLong[i] = buf.ReadUBitLong( arrays.m_nWidth );
+		}
+		break;
+
+	case TEST_ARRAY_VARINT:
+		if ( bAsArray )
+		{
+			buf.ReadVarInt32Array( arrays.m_nVarInt, nCount );
+			break;
+		}
+		for ( int i = 0; i < nCount; i++ )
+		{
+			arrays.m_nVarInt[i] = buf.ReadVarInt32();
+		}
+		break;
+
+	case TEST_ARRAY_SIGNED_VARINT:
+		if ( bAsArray )
+		{
+			buf.ReadSignedVarInt32Array( arrays.m_nSignedVarInt, nCount );
+			break;
+		}
+		for ( int i = 0; i < nCount; i++ )
+		{
+			arrays.m_nSignedVarInt[i] = buf.ReadSignedVarInt32();
+		}
+		break;
+
+	case TEST_ARRAY_COORD:
+		if ( bAsArray )
+		{
+			buf.ReadBitCoordArray( arrays.m_flCoord, nCount );
+			break;
+		}
+		for ( int i = 0; i < nCount; i++ )
+		{
+			arrays.m_flCoord[i] = buf.ReadBitCoord();
+		}
+		break;
+
+	case TEST_ARRAY_VEC3_COORD:
+		if ( bAsArray )
+		{
+			buf.ReadBitVec3CoordArray( arrays.m_vecCoord, nCount );
+			break;
+		}
+		for ( int i = 0; i < nCount; i++ )
+		{
+			buf.ReadBitVec3Coord( arrays.m_vecCoord[i] );
+		}
+		break;
+
+	case TEST_ARRAY_NORMAL:
+		if ( bAsArray )
+		{
+			buf.ReadBitNormalArray( arrays.m_flNormal, nCount );
+			break;
+		}
+		for ( int i = 0; i < nCount; i++ )
+		{
+			arrays.m_flNormal[i] = buf.ReadBitNormal();
+		}
+		break;
+
+	case TEST_ARRAY_VEC3_NORMAL:
+		if ( bAsArray )
+		{
+			buf.ReadBitVec3NormalArray( arrays.m_vecNormal, nCount );
+			break;
+		}
+		for ( int i = 0; i < nCount; i++ )
+		{
+			buf.ReadBitVec3Normal( arrays.m_vecNormal[i] );
+		}
+		break;
+	}
+}
+
+static void InitTestArrays( BitBufTestArrays_t &arrays )
+{
+	arrays.m_nWidth = 1 + ( BitBufTestRandom() >> 27 );
+	for ( int i = 0; i < BITBUF_TEST_ARRAY; i++ )
+	{
+		uint32 nRandom = BitBufTestRandom();
+		arrays.m_nUBitLong[i] = BitBufTestRandom() >> ( 32 - arrays.m_nWidth );
+		arrays.m_nVarInt[i] = BitBufTestRandom() >> ( nRandom >> 27 );
+		arrays.m_nSignedVarInt[i] = (int32)BitBufTestRandom() >> ( ( nRandom >> 8 ) & 31 );
+		arrays.m_flCoord[i] = ( i % 5 ) ? ( (int)( BitBufTestRandom() >> 16 ) - 32768 ) / 8.0f : 0.0f;
+		arrays.m_vecCoord[i].Init( ( (int)( BitBufTestRandom() >> 16 ) - 32768 ) / 4.0f, ( i & 3 ) ? 0.0f : 0.03125f * i, -0.5f * ( nRandom & 0x7f ) );
+		arrays.m_flNormal[i] = ( (int)( BitBufTestRandom() >> 20 ) - 2048 ) / 2048.0f;
+		arrays.m_vecNormal[i].Init( ( (int)( BitBufTestRandom() >> 20 ) - 2048 ) / 4096.0f, ( i & 1 ) ? 0.0f : 0.5f, ( nRandom & 1 ) ? -0.5f : 0.5f );
+	}
+}
+
+static void WriteTestPadding( bf_write &buf, int nPadding, uint32 nPaddingBits )
+{
+	for ( int i = 0; i < nPadding; i++ )
+	{
+		buf.WriteOneBit( ( nPaddingBits >> ( i & 31 ) ) & 1 );
+	}
+}
+
+static void TestArrays()
+{
+	// Room for the largest array after the padding, with a dword to spare
+	const int nBytes = BITBUF_TEST_ARRAY * 64 + 16;
+	uint32 *pSingle = new uint32[nBytes / sizeof( uint32 )];
+	uint32 *pArray = new uint32[nBytes / sizeof( uint32 )];
+	unsigned char *pBefore = new unsigned char[nBytes];
+
+	BitBufTestArrays_t arrays;
+	for ( int nArray = 0; nArray < TEST_ARRAY_COUNT; nArray++ )
+	{
+		for ( int nPadding = 0; nPadding < 64; nPadding++ )
+		{
+			InitTestArrays( arrays );
+			int nCount = ( nPadding & 7 ) ? BITBUF_TEST_ARRAY - ( nPadding & 7 ) : BITBUF_TEST_ARRAY;
+			uint32 nPaddingBits = BitBufTestRandom();
+
+			FillTestBytes( pBefore, nBytes );
+			V_memcpy( pSingle, pBefore, nBytes );
+			V_memcpy( pArray, pBefore, nBytes );
+
+			bf_write single( pSingle, nBytes );
+			WriteTestPadding( single, nPadding, nPaddingBits );
+			WriteTestArray( single, arrays, nArray, nCount, false );
+
+			bf_write array( pArray, nBytes );
+			WriteTestPadding( array, nPadding, nPaddingBits );
+			WriteTestArray( array, arrays, nArray, nCount, true );
+
+			int nBits = single.GetNumBitsWritten();
+			TEST_CHECK( !single.IsOverflowed() && !array.IsOverflowed() );
+			TEST_CHECK( array.GetNumBitsWritten() == nBits );
+			TEST_CHECK( !V_memcmp( pSingle, pArray, nBytes ) );
+
+			bool bRestUnchanged = true;
+			for ( int iBit = nBits; iBit < nBytes * 8; iBit++ )
+			{
+				bRestUnchanged = bRestUnchanged && ( GetTestBit( (unsigned char *)pArray, iBit ) == GetTestBit( pBefore, iBit ) );
+			}
+			TEST_CHECK( bRestUnchanged );
+
+			// Read back from a copy with only the dwords the bits are in
+			int nReadBytes = ( ( nBits + 31 ) >> 5 ) * 4;
+			unsigned char *pRead = new unsigned char[nReadBytes];
+			V_memcpy( pRead, pArray, nReadBytes );
+
+			BitBufTestArrays_t singleOut, arrayOut;
+			V_memset( &singleOut, 0, sizeof( singleOut ) );
+			V_memset( &arrayOut, 0, sizeof( arrayOut ) );
+			singleOut.m_nWidth = arrayOut.m_nWidth = arrays.m_nWidth;
+
+			bf_read singleIn( pRead, nReadBytes, nBits );
+			singleIn.Seek( nPadding );
+			ReadTestArray( singleIn, singleOut, nArray, nCount, false );
+
+			bf_read arrayIn( pRead, nReadBytes, nBits );
+			arrayIn.Seek( nPadding );
+			ReadTestArray( arrayIn, arrayOut, nArray, nCount, true );
+
+			TEST_CHECK( !singleIn.IsOverflowed() && !arrayIn.IsOverflowed() );
+			TEST_CHECK( singleIn.GetNumBitsRead() == nBits );
+			TEST_CHECK( arrayIn.GetNumBitsRead() == nBits );
+			TEST_CHECK( !V_memcmp( &singleOut, &arrayOut, sizeof( singleOut ) ) );
+
+			// The integers come back exactly
+			if ( nArray == TEST_ARRAY_UBITLONG )
+			{
+				TEST_CHECK( !V_memcmp( arrayOut.m_nUBitLong, arrays.m_nUBitLong, nCount * sizeof( uint32 ) ) );
+			}
+			else if ( nArray == TEST_ARRAY_VARINT )
+			{
+				TEST_CHECK( !V_memcmp( arrayOut.m_nVarInt, arrays.m_nVarInt, nCount * sizeof( uint32 ) ) );
+			}
+			else if ( nArray == TEST_ARRAY_SIGNED_VARINT )
+			{
+				TEST_CHECK( !V_memcmp( arrayOut.m_nSignedVarInt, arrays.m_nSignedVarInt, nCount * sizeof( int32 ) ) );
+			}
+
+			delete [] pRead;
+		}
+	}
+
+	delete [] pBefore;
+	delete [] pArray;
+	delete [] pSingle;
+}
+
+//-----------------------------------------------------------------------------
+// Arrays that run off the end of the buffer must overflow exactly like the
+// elements written or read one at a time, and not touch the bytes after it
+//-----------------------------------------------------------------------------
+static void TestArrayOverflow()
+{
+	const int nBytes = 64;
+	uint32 pSingle[nBytes / 4 + 4];
+	uint32 pArray[nBytes / 4 + 4];
+
+	BitBufTestArrays_t arrays;
+	for ( int nArray = 0; nArray < TEST_ARRAY_COUNT; nArray++ )
+	{
+		for ( int nPadding = 0; nPadding < nBytes * 8; nPadding += 29 )
+		{
+			InitTestArrays( arrays );
+			V_memset( pSingle, 0xa5, sizeof( pSingle ) );
+			V_memset( pArray, 0xa5, sizeof( pArray ) );
+
+			bf_write single( pSingle, nBytes );
+			single.SetAssertOnOverflow( false );
+			single.SeekToBit( nPadding );
+			WriteTestArray( single, arrays, nArray, BITBUF_TEST_ARRAY, false );
+
+			bf_write array( pArray, nBytes );
+			array.SetAssertOnOverflow( false );
+			array.SeekToBit( nPadding );
+			WriteTestArray( array, arrays, nArray, BITBUF_TEST_ARRAY, true );
+
+			TEST_CHECK( single.IsOverflowed() == array.IsOverflowed() );
+			TEST_CHECK( single.GetNumBitsWritten() == array.GetNumBitsWritten() );
+			TEST_CHECK( !V_memcmp( pSingle, pArray, sizeof( pSingle ) ) );
+
+			bool bUntouched = true;
+			for ( int i = nBytes; i < (int)sizeof( pArray ); i++ )
+			{
+				bUntouched = bUntouched && ( ( (unsigned char *)pArray )[i] == 0xa5 );
+			}
+			TEST_CHECK( bUntouched );
+
+			BitBufTestArrays_t singleOut, arrayOut;
+			V_memset( &singleOut, 0, sizeof( singleOut ) );
+			V_memset( &arrayOut, 0, sizeof( arrayOut ) );
+			singleOut.m_nWidth = arrayOut.m_nWidth = arrays.m_nWidth;
+
+			bf_read singleIn( pArray, nBytes );
+			singleIn.SetAssertOnOverflow( false );
+			singleIn.Seek( nPadding );
+			ReadTestArray( singleIn, singleOut, nArray, BITBUF_TEST_ARRAY, false );
+
+			bf_read arrayIn( pArray, nBytes );
+			arrayIn.SetAssertOnOverflow( false );
+			arrayIn.Seek( nPadding );
+			ReadTestArray( arrayIn, arrayOut, nArray, BITBUF_TEST_ARRAY, true );
+
+			TEST_CHECK( singleIn.IsOverflowed() == arrayIn.IsOverflowed() );
+			TEST_CHECK( singleIn.GetNumBitsRead() == arrayIn.GetNumBitsRead() );
+			TEST_CHECK( !V_memcmp( &singleOut, &arrayOut, sizeof( singleOut ) ) );
+		}
+	}
+
+	// An array that exactly fills the buffer takes the accumulator and doesn't overflow
+	uint32 pValues[nBytes / 4];
+	uint32 pValuesOut[nBytes / 4];
+	for ( int i = 0; i < nBytes / 4; i++ )
+	{
+		pValues[i] = BitBufTestRandom();
+	}
+	bf_write out( pArray, nBytes );
+	out.WriteUBitLongArray( pValues, nBytes / 4, 32 );
+	TEST_CHECK( !out.IsOverflowed() );
+	TEST_CHECK( out.GetNumBitsLeft() == 0 );
+	bf_read in( pArray, nBytes );
+	in.ReadUBitLongArray( pValuesOut, nBytes / 4, 32 );
+	TEST_CHECK( !in.IsOverflowed() );
+	TEST_CHECK( !V_memcmp( pValues, pValuesOut, sizeof( pValues ) ) );
+}
+
+//-----------------------------------------------------------------------------
+// Runs of fields of random widths through CBitWriteAccumulator, after 0 to
+// 63 bits of padding, must write the same bits as WriteUBitLong. Runs that
+// don't fit go one field at a time and overflow the same way.
+//-----------------------------------------------------------------------------
+static void TestWriteAccumulator()
+{
+	const int nBytes = 64;
+	const int nFields = 24;
+	uint32 pSingle[nBytes / 4 + 4];
+	uint32 pAccum[nBytes / 4 + 4];
+	uint32 pValues[nFields];
+	int pWidths[nFields];
+
+	for ( int nPadding = 0; nPadding < 64; nPadding++ )
+	{
+		for ( int nRun = 1; nRun <= nFields; nRun++ )
+		{
+			int nMaxBits = 0;
+			for ( int i = 0; i < nRun; i++ )
+			{
+				pWidths[i] = 1 + ( BitBufTestRandom() >> 27 );
+				pValues[i] = BitBufTestRandom();
+				nMaxBits += pWidths[i];
+			}
+			FillTestBytes( (unsigned char *)pSingle, sizeof( pSingle ) );
+			V_memcpy( pAccum, pSingle, sizeof( pSingle ) );
+
+			bf_write single( pSingle, nBytes );
+			single.SetAssertOnOverflow( false );
+			single.SeekToBit( nPadding );
+			for ( int i = 0; i < nRun; i++ )
+			{
+				single.WriteUBitLong( pValues[i] & ( pWidths[i] < 32 ? ( 1u << pWidths[i] ) - 1 : ~0u ), pWidths[i] );
+			}
+
+			bf_write accum( pAccum, nBytes );
+			accum.SetAssertOnOverflow( false );
+			accum.SeekToBit( nPadding );
+			CBitWriteAccumulator acc( &accum, nMaxBits );
+			for ( int i = 0; i < nRun; i++ )
+			{
+				acc.Write( pValues[i], pWidths[i] );
+			}
+			acc.Flush();
+
+			TEST_CHECK( single.IsOverflowed() == accum.IsOverflowed() );
+			TEST_CHECK( single.GetNumBitsWritten() == accum.GetNumBitsWritten() );
+			TEST_CHECK( !V_memcmp( pSingle, pAccum, sizeof( pSingle ) ) );
+		}
+	}
+}
+
+DEFINE_TIER1_TEST( bf_write )
+{
+	TestWriteUBitLong();
+	TestReadUBitLong();
+	TestMixedFields();
+	TestOverflow();
+	TestArrays();
+	TestArrayOverflow();
+	TestWriteAccumulator();
+}
+
+//-----------------------------------------------------------------------------
+// Timings
+//-----------------------------------------------------------------------------
+
+// WriteUBitLong and ReadUBitLong as they were before the single dword and
+// 64-bit paths, always two dwords, as a baseline
+static FORCEINLINE void DWordWriteUBitLong( bf_write &buf, unsigned int curData, int numbits )
+{
+	if ( buf.GetNumBitsLeft() < numbits )
+	{
+		buf.SetOverflowFlag();
+		return;
+	}
+
+	int iCurBitMasked = buf.m_iCurBit & 31;
+	int iDWord = buf.m_iCurBit >> 5;
+	buf.m_iCurBit += numbits;
+
+	unsigned long * RESTRICT pOut = &buf.m_pData[iDWord];
+	curData = (curData << iCurBitMasked) | (curData >> (32 - iCurBitMasked));
+
+	unsigned int temp = 1 << (numbits-1);
+	unsigned int mask1 = (temp*2-1) << iCurBitMasked;
+	unsigned int mask2 = (temp-1) >> (31 - iCurBitMasked);
+
+	int i = mask2 & 1;
+	unsigned long dword1 = LoadLittleDWord( pOut, 0 );
+	unsigned long dword2 = LoadLittleDWord( pOut, i );
+	dword1 ^= ( mask1 & ( curData ^ dword1 ) );
+	dword2 ^= ( mask2 & ( curData ^ dword2 ) );
+	StoreLittleDWord( pOut, i, dword2 );
+	StoreLittleDWord( pOut, 0, dword1 );
+}
+
+static FORCEINLINE unsigned int DWordReadUBitLong( bf_read &buf, int numbits )
+{
+	if ( buf.GetNumBitsLeft() < numbits )
+	{
+		buf.SetOverflowFlag();
+		return 0;
+	}
+
+	unsigned int iStartBit = buf.m_iCurBit & 31u;
+	unsigned int iWordOffset1 = buf.m_iCurBit >> 5;
+	unsigned int iWordOffset2 = ( buf.m_iCurBit + numbits - 1 ) >> 5;
+	buf.m_iCurBit += numbits;
+
+	unsigned int dw1 = LoadLittleDWord( (unsigned long *)buf.m_pData, iWordOffset1 ) >> iStartBit;
+	unsigned int dw2 = iStartBit ? ( LoadLittleDWord( (unsigned long *)buf.m_pData, iWordOffset2 ) << (32 - iStartBit) ) : 0;
+	return (dw1 | dw2) & ( numbits < 32 ? ( 1u << numbits ) - 1 : ~0u );
+}
+
+class CBitBufBenchTimer
+{
+public:
+	CBitBufBenchTimer( const char *pszName, int nFields ) : m_pszName( pszName ), m_nFields( nFields )
+	{
+		m_flStart = Plat_FloatTime();
+	}
+
+	~CBitBufBenchTimer()
+	{
+		double flTime = Plat_FloatTime() - m_flStart;
+		Msg( "  %-28s %8.2f ms  %6.2f ns/field\n", m_pszName, flTime * 1000.0, flTime * 1.0e9 / m_nFields );
+	}
+
+private:
+	const char	*m_pszName;
+	int			m_nFields;
+	double		m_flStart;
+};
+
+DEFINE_TIER1_BENCHMARK( bf_write )
+{
+	const int nFields = 4096;
+	const int nIterations = 1000;
+	const int nTotal = nFields * nIterations;
+
+	// Room for the largest fields, with a dword to spare
+	const int nBufferBytes = nFields * 32 + 4;
+	uint32 *pData = new uint32[nBufferBytes / sizeof( uint32 )];
+	V_memset( pData, 0, nBufferBytes );
+
+	uint32 *pUInts = new uint32[nFields];
+	int32 *pInts = new int32[nFields];
+	float *pFloats = new float[nFields];
+	Vector *pVectors = new Vector[nFields];
+	uint32 *pUIntsOut = new uint32[nFields];
+	int32 *pIntsOut = new int32[nFields];
+	float *pFloatsOut = new float[nFields];
+	Vector *pVectorsOut = new Vector[nFields];
+
+	bf_write out( pData, nBufferBytes );
+	bf_read in( pData, nBufferBytes );
+
+	// Sizes and values like the ones entity deltas send
+	for ( int i = 0; i < nFields; i++ )
+	{
+		uint32 nRandom = BitBufTestRandom();
+		pUInts[i] = ( nRandom >> 8 ) >> ( nRandom & 15 );
+		pInts[i] = (int32)nRandom >> ( nRandom & 31 );
+		pFloats[i] = ( (int)( nRandom >> 16 ) - 32768 ) / 256.0f;
+		pVectors[i].Init( pFloats[i], ( nRandom & 0xff ) * 0.75f, -( ( nRandom >> 24 ) & 0x7f ) * 0.5f );
+	}
+
+	Msg( "%d fields, %d times\n", nFields, nIterations );
+
+	{
+		CBitBufBenchTimer timer( "dword WriteUBitLong", nTotal );
+		for ( int n = 0; n < nIterations; n++ )
+		{
+			out.Reset();
+			for ( int i = 0; i < nFields; i++ )
+			{
+				DWordWriteUBitLong( out, pUInts[i] & 0x1ffff, 17 );
+			}
+		}
+	}
+	{
+		CBitBufBenchTimer timer( "WriteUBitLong", nTotal );
+		for ( int n = 0; n < nIterations; n++ )
+		{
+			out.Reset();
+			for ( int i = 0; i < nFields; i++ )
+			{
+				out.WriteUBitLong( pUInts[i] & 0x1ffff, 17 );
+			}
+		}
+	}
+	for ( int i = 0; i < nFields; i++ )
+	{
+		pUInts[i] &= 0x1ffff;
+	}
+	{
+		CBitBufBenchTimer timer( "WriteUBitLongArray", nTotal );
+		for ( int n = 0; n < nIterations; n++ )
+		{
+			out.Reset();
+			out.WriteUBitLongArray( pUInts, nFields, 17 );
+		}
+	}
+
+	uint32 nCheck = 0;
+	{
+		CBitBufBenchTimer timer( "dword ReadUBitLong", nTotal );
+		for ( int n = 0; n < nIterations; n++ )
+		{
+			in.Seek( 0 );
+			for ( int i = 0; i < nFields; i++ )
+			{
+				nCheck += DWordReadUBitLong( in, 17 );
+			}
+		}
+	}
+	{
+		CBitBufBenchTimer timer( "ReadUBitLong", nTotal );
+		for ( int n = 0; n < nIterations; n++ )
+		{
+			in.Seek( 0 );
+			for ( int i = 0; i < nFields; i++ )
+			{
+				nCheck -= in.ReadUBitLong( 17 );
+			}
+		}
+	}
+	{
+		CBitBufBenchTimer timer( "ReadUBitLongArray", nTotal );
+		for ( int n = 0; n < nIterations; n++ )
+		{
+			in.Seek( 0 );
+			in.ReadUBitLongArray( pUIntsOut, nFields, 17 );
+		}
+		nCheck += pUIntsOut[nFields - 1];
+	}
+
+	// After a bit, so the varints aren't byte aligned
+	{
+		CBitBufBenchTimer timer( "WriteSignedVarInt32", nTotal );
+		for ( int n = 0; n < nIterations; n++ )
+		{
+			out.Reset();
+			out.WriteOneBit( 1 );
+			for ( int i = 0; i < nFields; i++ )
+			{
+				out.WriteSignedVarInt32( pInts[i] );
+			}
+		}
+	}
+	{
+		CBitBufBenchTimer timer( "WriteSignedVarInt32Array", nTotal );
+		for ( int n = 0; n < nIterations; n++ )
+		{
+			out.Reset();
+			out.WriteOneBit( 1 );
+			out.WriteSignedVarInt32Array( pInts, nFields );
+		}
+	}
+	{
+		CBitBufBenchTimer timer( "ReadSignedVarInt32", nTotal );
+		for ( int n = 0; n < nIterations; n++ )
+		{
+			in.Seek( 1 );
+			for ( int i = 0; i < nFields; i++ )
+			{
+				nCheck += in.ReadSignedVarInt32() - pInts[i];
+			}
+		}
+	}
+	{
+		CBitBufBenchTimer timer( "ReadSignedVarInt32Array", nTotal );
+		for ( int n = 0; n < nIterations; n++ )
+		{
+			in.Seek( 1 );
+			in.ReadSignedVarInt32Array( pIntsOut, nFields );
+		}
+		nCheck += pIntsOut[nFields - 1];
+	}
+
+	{
+		CBitBufBenchTimer timer( "WriteBitCoord", nTotal );
+		for ( int n = 0; n < nIterations; n++ )
+		{
+			out.Reset();
+			for ( int i = 0; i < nFields; i++ )
+			{
+				out.WriteBitCoord( pFloats[i] );
+			}
+		}
+	}
+	{
+		CBitBufBenchTimer timer( "WriteBitCoordArray", nTotal );
+		for ( int n = 0; n < nIterations; n++ )
+		{
+			out.Reset();
+			out.WriteBitCoordArray( pFloats, nFields );
+		}
+	}
+	{
+		float flSum = 0.0f;
+		CBitBufBenchTimer timer( "ReadBitCoord", nTotal );
+		for ( int n = 0; n < nIterations; n++ )
+		{
+			in.Seek( 0 );
+			for ( int i = 0; i < nFields; i++ )
+			{
+				flSum += in.ReadBitCoord();
+			}
+		}
+		nCheck += ( flSum == 1.0f );
+	}
+	{
+		CBitBufBenchTimer timer( "ReadBitCoordArray", nTotal );
+		for ( int n = 0; n < nIterations; n++ )
+		{
+			in.Seek( 0 );
+			in.ReadBitCoordArray( pFloatsOut, nFields );
+		}
+		nCheck += ( pFloatsOut[nFields - 1] == 1.0f );
+	}
+
+	{
+		CBitBufBenchTimer timer( "WriteBitVec3Coord", nTotal );
+		for ( int n = 0; n < nIterations; n++ )
+		{
+			out.Reset();
+			for ( int i = 0; i < nFields; i++ )
+			{
+				out.WriteBitVec3Coord( pVectors[i] );
+			}
+		}
+	}
+	{
+		CBitBufBenchTimer timer( "WriteBitVec3CoordArray", nTotal );
+		for ( int n = 0; n < nIterations; n++ )
+		{
+			out.Reset();
+			out.WriteBitVec3CoordArray( pVectors, nFields );
+		}
+	}
+	{
+		Vector vecSum( 0.0f, 0.0f, 0.0f );
+		CBitBufBenchTimer timer( "ReadBitVec3Coord", nTotal );
+		for ( int n = 0; n < nIterations; n++ )
+		{
+			in.Seek( 0 );
+			for ( int i = 0; i < nFields; i++ )
+			{
+				Vector vec;
+				in.ReadBitVec3Coord( vec );
+				vecSum += vec;
+			}
+		}
+		nCheck += ( vecSum.x == 1.0f );
+	}
+	{
+		CBitBufBenchTimer timer( "ReadBitVec3CoordArray", nTotal );
+		for ( int n = 0; n < nIterations; n++ )
+		{
+			in.Seek( 0 );
+			in.ReadBitVec3CoordArray( pVectorsOut, nFields );
+		}
+		nCheck += ( pVectorsOut[nFields - 1].x == 1.0f );
+	}
+
+	for ( int i = 0; i < nFields; i++ )
+	{
+		pFloats[i] *= ( 1.0f / 128.0f );
+	}
+	{
+		CBitBufBenchTimer timer( "WriteBitNormal", nTotal );
+		for ( int n = 0; n < nIterations; n++ )
+		{
+			out.Reset();
+			for ( int i = 0; i < nFields; i++ )
+			{
+				out.WriteBitNormal( pFloats[i] );
+			}
+		}
+	}
+	{
+		CBitBufBenchTimer timer( "WriteBitNormalArray", nTotal );
+		for ( int n = 0; n < nIterations; n++ )
+		{
+			out.Reset();
+			out.WriteBitNormalArray( pFloats, nFields );
+		}
+	}
+	{
+		float flSum = 0.0f;
+		CBitBufBenchTimer timer( "ReadBitNormal", nTotal );
+		for ( int n = 0; n < nIterations; n++ )
+		{
+			in.Seek( 0 );
+			for ( int i = 0; i < nFields; i++ )
+			{
+				flSum += in.ReadBitNormal();
+			}
+		}
+		nCheck += ( flSum == 1.0f );
+	}
+	{
+		CBitBufBenchTimer timer( "ReadBitNormalArray", nTotal );
+		for ( int n = 0; n < nIterations; n++ )
+		{
+			in.Seek( 0 );
+			in.ReadBitNormalArray( pFloatsOut, nFields );
+		}
+		nCheck += ( pFloatsOut[nFields - 1] == 1.0f );
+	}
+
+	// Don't let the reads be optimized away
+	if ( nCheck == 0x12345678 )
+	{
+		Msg( "\n" );
+	}
+
+	delete [] pVectorsOut;
+	delete [] pFloatsOut;
+	delete [] pIntsOut;
+	delete [] pUIntsOut;
+	delete [] pVectors;
+	delete [] pFloats;
+	delete [] pInts;
+	delete [] pUInts;
+	delete [] pData;
+}
@@ -0,0 +1,311 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: KeyValues trees in a CKeyValuesArena against the same trees on the
+//			heap, and timings for both
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "tier1test.h"
+#include "tier0/dbg.h"
+#include "tier1/KeyValues.h"
+#include "tier1/utlbuffer.h"
+#include "tier1/strtools.h"
+
+//-----------------------------------------------------------------------------
+// A level layout, as the tests and timings both build it
+//-----------------------------------------------------------------------------
+static KeyValues *BuildBenchmarkTree( CKeyValuesArena *pArena, int nKeys )
+{
+	KeyValues *pRoot = pArena ? pArena->CreateKeyValues( "layout" ) : new KeyValues( "layout" );
+
+	// Linked by hand, since AddSubKey walks the list every time
+	KeyValues *pLast = NULL;
+	for ( int i = 0; i < nKeys; i += 8 )
+	{
+		char szName[32];
+		Q_snprintf( szName, sizeof( szName ), "room_%d", i );
+		KeyValues *pRoom = pArena ? pArena->CreateKeyValues( szName ) : new KeyValues( szName );
+		pRoom->SetString( "theme", "industrial" );
+		pRoom->SetString( "template", "tilegen/rooms/corridor_straight_long_01" );
+		pRoom->SetInt( "x", i );
+		pRoom->SetInt( "y", i * 2 );
+		pRoom->SetFloat( "rotation", 90.0f );
+		pRoom->SetString( "encounter", szName );
+		pRoom->SetInt( "difficulty", i & 7 );
+
+		if ( pLast )
+		{
+			pLast->SetNextKey( pRoom );
+		}
+		else
+		{
+			pRoot->AddSubKey( pRoom );
+		}
+		pLast = pRoom;
+	}
+
+	return pRoot;
+}
+
+//-----------------------------------------------------------------------------
+// Same names, types, values and keys in the same order
+//-----------------------------------------------------------------------------
+static bool KeyValuesMatch( KeyValues *pA, KeyValues *pB )
+{
+	if ( !pA || !pB )
+		return pA == pB;
+
+	if ( V_stricmp( pA->GetName(), pB->GetName() ) || pA->GetDataType() != pB->GetDataType() )
+		return false;
+
+	switch ( pA->GetDataType() )
+	{
+	case KeyValues::TYPE_NONE:
+		break;
+	case KeyValues::TYPE_INT:
+		if ( pA->GetInt() != pB->GetInt() )
+			return false;
+		break;
+	case KeyValues::TYPE_UINT64:
+		if ( pA->GetUint64() != pB->GetUint64() )
+			return false;
+		break;
+	case KeyValues::TYPE_FLOAT:
+		if ( pA->GetFloat() != pB->GetFloat() )
+			return false;
+		break;
+	case KeyValues::TYPE_PTR:
+		if ( pA->GetPtr() != pB->GetPtr() )
+			return false;
+		break;
+	case KeyValues::TYPE_STRING:
+		if ( V_strcmp( pA->GetString(), pB->GetString() ) )
+			return false;
+		break;
+	case KeyValues::TYPE_WSTRING:
+		if ( V_wcscmp( pA->GetWString(), pB->GetWString() ) )
+			return false;
+		break;
+	default:
+		// the getters for other types convert the value in place
+		return false;
+	}
+
+	KeyValues *pSubA = pA->GetFirstSubKey();
+	KeyValues *pSubB = pB->GetFirstSubKey();
+	for ( ; pSubA && pSubB; pSubA = pSubA->GetNextKey(), pSubB = pSubB->GetNextKey() )
+	{
+		if ( !KeyValuesMatch( pSubA, pSubB ) )
+			return false;
+	}
+	return !pSubA && !pSubB;
+}
+
+// Adds the kinds of value the layout doesn't have, including a string too
+// big to share a 4k arena block, but short enough to load from text
+static void AddOtherValues( KeyValues *pRoot )
+{
+	char szLong[3000];
+	for ( int i = 0; i < (int)sizeof( szLong ) - 1; i++ )
+	{
+		szLong[i] = 'a' + i % 26;
+	}
+	szLong[sizeof( szLong ) - 1] = 0;
+
+	pRoot->SetString( "settings/long", szLong );
+	pRoot->SetUint64( "settings/seed", 0x123456789abcdefull );
+	pRoot->SetWString( "settings/title", L"Landing Bay" );
+	pRoot->SetString( "settings/empty", "" );
+	pRoot->FindKey( "settings/nested/deeper", true )->SetInt( "depth", 3 );
+}
+
+DEFINE_TIER1_TEST( CKeyValuesArena )
+{
+	const int nKeys = 256;
+
+	KeyValues *pHeap = BuildBenchmarkTree( NULL, nKeys );
+	AddOtherValues( pHeap );
+
+	CKeyValuesArena arena( 4096 );
+
+	// built in the arena, with new keys made through FindKey and the setters
+	KeyValues *pBuilt = BuildBenchmarkTree( &arena, nKeys );
+	AddOtherValues( pBuilt );
+	TEST_CHECK( KeyValuesMatch( pHeap, pBuilt ) );
+	TEST_CHECK( arena.GetBytesUsed() > 0 );
+
+	// values replaced in place, and keys freed into the arena, leave the rest alone
+	pBuilt->SetString( "room_8/theme", "jungle" );
+	pBuilt->SetString( "room_8/theme", "industrial" );
+	pBuilt->FindKey( "room_16" )->SetInt( "x", 16 );
+	KeyValues *pTemp = pBuilt->FindKey( "settings/temp", true );
+	pTemp->SetString( "value", "gone" );
+	pBuilt->FindKey( "settings" )->RemoveSubKey( pTemp );
+	pTemp->deleteThis();
+	TEST_CHECK( KeyValuesMatch( pHeap, pBuilt ) );
+
+	// copies from the heap into the arena, and from the arena to the heap
+	KeyValues *pArenaCopy = pHeap->MakeCopy( &arena );
+	TEST_CHECK( KeyValuesMatch( pHeap, pArenaCopy ) );
+	KeyValues *pHeapCopy = pBuilt->MakeCopy();
+	TEST_CHECK( KeyValuesMatch( pHeap, pHeapCopy ) );
+
+	// operator= has never copied wide strings, so it gets the plain layout
+	KeyValues *pLayout = BuildBenchmarkTree( NULL, nKeys );
+	KeyValues *pAssigned = arena.CreateKeyValues( "other" );
+	*pAssigned = *pLayout;
+	TEST_CHECK( KeyValuesMatch( pLayout, pAssigned ) );
+	pLayout->deleteThis();
+
+	KeyValues *pSubkeys = arena.CreateKeyValues( pHeap->GetName() );
+	pHeap->CopySubkeys( pSubkeys );
+	TEST_CHECK( KeyValuesMatch( pHeap, pSubkeys ) );
+
+	// a copy into a second arena outlives the first one's FreeAll
+	CKeyValuesArena otherArena;
+	KeyValues *pOtherCopy = pBuilt->MakeCopy( &otherArena );
+
+	// loaded from text and from binary, into the arena and onto the heap
+	CUtlBuffer text( 0, 0, CUtlBuffer::TEXT_BUFFER );
+	pHeap->RecursiveSaveToFile( text, 0 );
+	text.PutChar( '\0' );
+	KeyValues *pTextHeap = new KeyValues( "layout" );
+	TEST_CHECK( pTextHeap->LoadFromBuffer( "test", (const char *)text.Base() ) );
+	KeyValues *pTextArena = arena.CreateKeyValues( "layout" );
+	TEST_CHECK( pTextArena->LoadFromBuffer( "test", (const char *)text.Base() ) );
+	TEST_CHECK( KeyValuesMatch( pTextHeap, pTextArena ) );
+	TEST_CHECK( pTextArena->GetInt( "room_248/x" ) == 248 && V_strlen( pTextArena->GetString( "settings/long" ) ) == 3000 - 1 );
+
+	// the binary format has no wide strings, which the text tree has as UTF-8
+	CUtlBuffer binary;
+	TEST_CHECK( pTextHeap->WriteAsBinary( binary ) );
+	KeyValues *pBinaryArena = arena.CreateKeyValues( "" );
+	TEST_CHECK( pBinaryArena->ReadAsBinary( binary ) );
+	TEST_CHECK( KeyValuesMatch( pTextHeap, pBinaryArena ) );
+
+	// deleteThis on arena keys leaves them to FreeAll
+	pArenaCopy->deleteThis();
+	pBuilt->deleteThis();
+
+	arena.FreeAll();
+	TEST_CHECK( arena.GetBytesUsed() == 0 );
+
+	// nothing the heap or the other arena holds came from this one
+	TEST_CHECK( KeyValuesMatch( pHeap, pHeapCopy ) );
+	TEST_CHECK( KeyValuesMatch( pHeapCopy, pOtherCopy ) );
+	TEST_CHECK( KeyValuesMatch( pTextHeap, pTextHeap->MakeCopy( &otherArena ) ) );
+
+	// FreeAll keeps its first block, so the same tree fits in the same memory again
+	void *pFirst = arena.Alloc( 8 );
+	arena.FreeAll();
+	TEST_CHECK( arena.Alloc( 8 ) == pFirst );
+	arena.FreeAll();
+	int nBytesUsed = 0;
+	for ( int i = 0; i < 10; i++ )
+	{
+		KeyValues *pAgain = BuildBenchmarkTree( &arena, nKeys );
+		AddOtherValues( pAgain );
+		TEST_CHECK( KeyValuesMatch( pHeap, pAgain ) );
+		TEST_CHECK( !i || arena.GetBytesUsed() == nBytesUsed );
+		nBytesUsed = arena.GetBytesUsed();
+		arena.FreeAll();
+	}
+
+	pHeap->deleteThis();
+	pHeapCopy->deleteThis();
+	pTextHeap->deleteThis();
+	otherArena.FreeAll();
+}
+
+//-----------------------------------------------------------------------------
+// Timings
+//-----------------------------------------------------------------------------
+static void PrintBenchmarkTime( const char *pszName, double flTime, int nTrees )
+{
+	Msg( "  %-28s %8.2f ms  %8.1f us/tree\n", pszName, flTime * 1000.0, flTime * 1.0e6 / nTrees );
+}
+
+DEFINE_TIER1_BENCHMARK( CKeyValuesArena )
+{
+	const int nTrees = 1000;
+	const int nKeysPerTree = 512;
+
+	Msg( "%d trees of %d keys\n", nTrees, nKeysPerTree );
+
+	CUtlVector<KeyValues *> trees;
+	trees.SetCount( nTrees );
+
+	CKeyValuesArena arena;
+	double flStart;
+
+	// Build
+	flStart = Plat_FloatTime();
+	for ( int i = 0; i < nTrees; i++ )
+	{
+		trees[i] = BuildBenchmarkTree( NULL, nKeysPerTree );
+	}
+	PrintBenchmarkTime( "heap build", Plat_FloatTime() - flStart, nTrees );
+
+	flStart = Plat_FloatTime();
+	for ( int i = 0; i < nTrees; i++ )
+	{
+		trees[i]->deleteThis();
+	}
+	PrintBenchmarkTime( "heap deleteThis", Plat_FloatTime() - flStart, nTrees );
+
+	flStart = Plat_FloatTime();
+	for ( int i = 0; i < nTrees; i++ )
+	{
+		trees[i] = BuildBenchmarkTree( &arena, nKeysPerTree );
+	}
+	PrintBenchmarkTime( "arena build", Plat_FloatTime() - flStart, nTrees );
+
+	Msg( "  arena holds %d bytes\n", arena.GetBytesUsed() );
+
+	flStart = Plat_FloatTime();
+	arena.FreeAll();
+	PrintBenchmarkTime( "arena FreeAll", Plat_FloatTime() - flStart, nTrees );
+
+	// Copy
+	KeyValues *pSource = BuildBenchmarkTree( NULL, nKeysPerTree );
+
+	flStart = Plat_FloatTime();
+	for ( int i = 0; i < nTrees; i++ )
+	{
+		pSource->MakeCopy()->deleteThis();
+	}
+	PrintBenchmarkTime( "heap MakeCopy + delete", Plat_FloatTime() - flStart, nTrees );
+
+	flStart = Plat_FloatTime();
+	for ( int i = 0; i < nTrees; i++ )
+	{
+		pSource->MakeCopy( &arena );
+		arena.FreeAll();
+	}
+	PrintBenchmarkTime( "arena MakeCopy + FreeAll", Plat_FloatTime() - flStart, nTrees );
+
+	// Load from text
+	CUtlBuffer text( 0, 0, CUtlBuffer::TEXT_BUFFER );
+	pSource->RecursiveSaveToFile( text, 0 );
+	text.PutChar( '\0' );
+	pSource->deleteThis();
+
+	flStart = Plat_FloatTime();
+	for ( int i = 0; i < nTrees; i++ )
+	{
+		KeyValues *pLoaded = new KeyValues( "layout" );
+		pLoaded->LoadFromBuffer( "benchmark", (const char *)text.Base() );
+		pLoaded->deleteThis();
+	}
+	PrintBenchmarkTime( "heap load + delete", Plat_FloatTime() - flStart, nTrees );
+
+	flStart = Plat_FloatTime();
+	for ( int i = 0; i < nTrees; i++ )
+	{
+		KeyValues *pLoaded = arena.CreateKeyValues( "layout" );
+		pLoaded->LoadFromBuffer( "benchmark", (const char *)text.Base() );
+		arena.FreeAll();
+	}
+	PrintBenchmarkTime( "arena load + FreeAll", Plat_FloatTime() - flStart, nTrees );
+}
@@ -0,0 +1,276 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: CMemoryPoolMT under contention, and its timings against a pool
+//			with one mutex around it
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "tier1test.h"
+#include "tier0/dbg.h"
+#include "tier0/threadtools.h"
+#include "tier1/mempool.h"
+#include "tier1/utlvector.h"
+
+#define POOL_TEST_BLOCK_SIZE	64
+#define POOL_TEST_BATCH			96			// more than a magazine, so magazines go through the depot
+
+//-----------------------------------------------------------------------------
+// What CMemoryPoolMT replaced, one mutex around the whole pool
+//-----------------------------------------------------------------------------
+class CMemoryPoolLockedMT : public CUtlMemoryPool
+{
+public:
+	CMemoryPoolLockedMT( int blockSize, int numElements, int growMode = UTLMEMORYPOOL_GROW_FAST, const char *pszAllocOwner = NULL ) : CUtlMemoryPool( blockSize, numElements, growMode, pszAllocOwner ) {}
+
+	void*		Alloc()	{ AUTO_LOCK( m_mutex ); return CUtlMemoryPool::Alloc(); }
+	void		Free( void *pMem ) { AUTO_LOCK( m_mutex ); CUtlMemoryPool::Free( pMem ); }
+
+private:
+	CThreadFastMutex m_mutex;
+};
+
+//-----------------------------------------------------------------------------
+// Contention test. Every thread stamps the blocks it gets with its own
+// values and checks them before freeing, so a block handed out twice, or
+// written by the pool while in use, shows up as a changed stamp. Half of
+// each batch goes through a shared list and is freed by whichever thread
+// takes it, so blocks go back through other threads' caches.
+//-----------------------------------------------------------------------------
+struct PoolTestShared_t
+{
+	CMemoryPoolMT		*m_pPool;
+	int					m_nBatches;
+	int					m_nAlignment;
+	volatile bool		m_bStart;
+
+	CThreadFastMutex	m_HandoffMutex;
+	CUtlVector<uint32 *> m_Handoff;
+};
+
+struct PoolTestThread_t
+{
+	PoolTestShared_t	*m_pShared;
+	uint32				m_nThread;
+};
+
+static void StampBlock( uint32 *pBlock, uint32 nStamp )
+{
+	for ( int i = 0; i < POOL_TEST_BLOCK_SIZE / (int)sizeof( uint32 ); i++ )
+	{
+		pBlock[i] = nStamp + i;
+	}
+}
+
+static bool CheckStamp( const uint32 *pBlock )
+{
+	for ( int i = 1; i < POOL_TEST_BLOCK_SIZE / (int)sizeof( uint32 ); i++ )
+	{
+		if ( pBlock[i] != pBlock[0] + i )
+			return false;
+	}
+	return true;
+}
+
+static uintp MemoryPoolTestThread( void *pParam )
+{
+	PoolTestThread_t *pThread = (PoolTestThread_t *)pParam;
+	PoolTestShared_t *pShared = pThread->m_pShared;
+	uint32 *pBlocks[POOL_TEST_BATCH];
+	uint32 nStamp = pThread->m_nThread << 24;
+
+	while ( !pShared->m_bStart )
+	{
+		ThreadPause();
+	}
+
+	for ( int nBatch = 0; nBatch < pShared->m_nBatches; nBatch++ )
+	{
+		// vary the batch size so the threads' caches go out of step
+		int nBlocks = POOL_TEST_BATCH / 2 + ( ( nBatch * 7 + pThread->m_nThread ) % ( POOL_TEST_BATCH / 2 ) );
+		for ( int i = 0; i < nBlocks; i++ )
+		{
+			pBlocks[i] = (uint32 *)pShared->m_pPool->Alloc();
+			TEST_CHECK( pBlocks[i] != NULL );
+			TEST_CHECK( !pShared->m_nAlignment || ( (uintp)pBlocks[i] & ( pShared->m_nAlignment - 1 ) ) == 0 );
+			StampBlock( pBlocks[i], nStamp );
+			nStamp += 256;
+		}
+
+		ThreadPause();
+
+		int nKeep = nBlocks / 2;
+		for ( int i = 0; i < nBlocks; i++ )
+		{
+			TEST_CHECK( CheckStamp( pBlocks[i] ) );
+		}
+		for ( int i = 0; i < nKeep; i++ )
+		{
+			pShared->m_pPool->Free( pBlocks[i] );
+		}
+
+		// trade the rest for blocks another thread allocated
+		CUtlVector<uint32 *> taken;
+		{
+			AUTO_LOCK( pShared->m_HandoffMutex );
+			pShared->m_Handoff.AddMultipleToTail( nBlocks - nKeep, pBlocks + nKeep );
+			int nTake = MIN( pShared->m_Handoff.Count(), nBlocks - nKeep );
+			taken.CopyArray( pShared->m_Handoff.Base(), nTake );
+			pShared->m_Handoff.RemoveMultipleFromHead( nTake );
+		}
+		for ( int i = 0; i < taken.Count(); i++ )
+		{
+			TEST_CHECK( CheckStamp( taken[i] ) );
+			pShared->m_pPool->Free( taken[i] );
+		}
+	}
+
+	return 0;
+}
+
+static void RunMemoryPoolTest( int nThreads, int nBatches, int nAlignment )
+{
+	CMemoryPoolMT pool( POOL_TEST_BLOCK_SIZE, 256, UTLMEMORYPOOL_GROW_SLOW, "MemoryPoolMT test", nAlignment );
+
+	PoolTestShared_t shared;
+	shared.m_pPool = &pool;
+	shared.m_nBatches = nBatches;
+	shared.m_nAlignment = nAlignment;
+	shared.m_bStart = false;
+
+	CUtlVector<PoolTestThread_t> threadArgs;
+	threadArgs.SetCount( nThreads );
+	CUtlVector<ThreadHandle_t> threads;
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		threadArgs[i].m_pShared = &shared;
+		threadArgs[i].m_nThread = i + 1;
+		threads.AddToTail( CreateSimpleThread( MemoryPoolTestThread, &threadArgs[i] ) );
+	}
+
+	shared.m_bStart = true;
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		ThreadJoin( threads[i] );
+		ReleaseThreadHandle( threads[i] );
+	}
+
+	for ( int i = 0; i < shared.m_Handoff.Count(); i++ )
+	{
+		TEST_CHECK( CheckStamp( shared.m_Handoff[i] ) );
+		pool.Free( shared.m_Handoff[i] );
+	}
+
+	// every block is back, and the pool can hand them all out again
+	TEST_CHECK( pool.Count() == 0 );
+	MemoryPoolMTStats_t stats;
+	pool.GetStats( stats );
+	TEST_CHECK( stats.m_nCount == 0 );
+	TEST_CHECK( stats.m_nPeakCount <= nThreads * POOL_TEST_BATCH + 64 * 32 );
+
+	pool.Clear();
+	TEST_CHECK( pool.Count() == 0 );
+}
+
+DEFINE_TIER1_TEST( CMemoryPoolMT )
+{
+	const CPUInformation &cpu = GetCPUInformation();
+	int nThreads = clamp( cpu.m_nLogicalProcessors * 2, 4, 64 );
+
+	RunMemoryPoolTest( 1, 2000, 0 );
+	RunMemoryPoolTest( nThreads, 2000, 0 );
+	RunMemoryPoolTest( nThreads, 500, 16 );
+}
+
+//-----------------------------------------------------------------------------
+// Timings
+//-----------------------------------------------------------------------------
+template < class POOL >
+struct MemoryPoolBenchmarkArgs_t
+{
+	POOL			*m_pPool;
+	int				m_nIterations;
+	volatile bool	*m_pbStart;
+};
+
+// Allocates more blocks than fit in a magazine and frees them again, so that
+// CMemoryPoolMT trades magazines with the depot as well as using its cache
+template < class POOL >
+static uintp MemoryPoolBenchmarkThread( void *pParam )
+{
+	const int nBatch = 64;
+	MemoryPoolBenchmarkArgs_t<POOL> *pArgs = (MemoryPoolBenchmarkArgs_t<POOL> *)pParam;
+	POOL *pPool = pArgs->m_pPool;
+	void *pBlocks[nBatch];
+
+	while ( !*pArgs->m_pbStart )
+	{
+		ThreadPause();
+	}
+
+	for ( int i = 0; i < pArgs->m_nIterations; i += nBatch )
+	{
+		for ( int j = 0; j < nBatch; j++ )
+		{
+			pBlocks[j] = pPool->Alloc();
+		}
+		for ( int j = 0; j < nBatch; j++ )
+		{
+			pPool->Free( pBlocks[j] );
+		}
+	}
+
+	return 0;
+}
+
+template < class POOL >
+static double TimeMemoryPool( POOL &pool, int nThreads, int nIterations )
+{
+	volatile bool bStart = false;
+	MemoryPoolBenchmarkArgs_t<POOL> args;
+	args.m_pPool = &pool;
+	args.m_nIterations = nIterations;
+	args.m_pbStart = &bStart;
+
+	CUtlVector<ThreadHandle_t> threads;
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		threads.AddToTail( CreateSimpleThread( MemoryPoolBenchmarkThread<POOL>, &args ) );
+	}
+
+	double flStart = Plat_FloatTime();
+	bStart = true;
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		ThreadJoin( threads[i] );
+		ReleaseThreadHandle( threads[i] );
+	}
+	return Plat_FloatTime() - flStart;
+}
+
+DEFINE_TIER1_BENCHMARK( CMemoryPoolMT )
+{
+	const int nMaxThreads = 32;
+	const int nIterations = 100000;
+	const int nBlockSize = 64;
+
+	Msg( "%d alloc/free pairs per thread, %d byte blocks\n", nIterations, nBlockSize );
+	Msg( "threads     locked Mops/s     cached Mops/s   contended  cross frees   peak\n" );
+
+	for ( int nThreads = 1; nThreads <= nMaxThreads; nThreads *= 2 )
+	{
+		CMemoryPoolLockedMT lockedPool( nBlockSize, 1024, UTLMEMORYPOOL_GROW_SLOW, "MemoryPoolMT benchmark" );
+		CMemoryPoolMT pool( nBlockSize, 1024, UTLMEMORYPOOL_GROW_SLOW, "MemoryPoolMT benchmark" );
+
+		double flLocked = TimeMemoryPool( lockedPool, nThreads, nIterations );
+		double flCached = TimeMemoryPool( pool, nThreads, nIterations );
+
+		MemoryPoolMTStats_t stats;
+		pool.GetStats( stats );
+
+		double flOps = 2.0 * nThreads * nIterations / 1000000.0;
+		Msg( "%7d  %16.2f  %16.2f  %10d  %11d  %5d\n", nThreads,
+			flLocked > 0 ? flOps / flLocked : 0.0, flCached > 0 ? flOps / flCached : 0.0,
+			stats.m_nContended, stats.m_nCrossThreadFrees, stats.m_nPeakCount );
+	}
+}
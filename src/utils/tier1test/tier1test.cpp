@@ -0,0 +1,88 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Runs the tier1 tests, or with -benchmark the tier1 timings.
+//			Usage: tier1test [-benchmark] [name ...]
+//			Exits with the number of failed checks.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include <stdio.h>
+#include "tier1test.h"
+#include "tier0/dbg.h"
+#include "tier0/threadtools.h"
+#include "tier1/strtools.h"
+
+CTier1Test *CTier1Test::s_pFirst = NULL;
+
+static CInterlockedInt s_nFailures;
+
+CTier1Test::CTier1Test( const char *pName, Tier1TestFunc_t pFunc, bool bBenchmark )
+{
+	m_pName = pName;
+	m_pFunc = pFunc;
+	m_bBenchmark = bBenchmark;
+	m_pNext = s_pFirst;
+	s_pFirst = this;
+}
+
+void Tier1Test_Fail( const char *pFile, int nLine, const char *pExpression )
+{
+	++s_nFailures;
+	Warning( "%s(%d): check failed: %s\n", pFile, nLine, pExpression );
+}
+
+static bool IsTestSelected( const char *pName, int argc, char **argv )
+{
+	bool bAnyNamed = false;
+	for ( int i = 1; i < argc; i++ )
+	{
+		if ( argv[i][0] == '-' )
+			continue;
+
+		bAnyNamed = true;
+		if ( !V_stricmp( argv[i], pName ) )
+			return true;
+	}
+	return !bAnyNamed;
+}
+
+int main( int argc, char **argv )
+{
+	bool bBenchmark = false;
+	for ( int i = 1; i < argc; i++ )
+	{
+		if ( !V_stricmp( argv[i], "-benchmark" ) )
+		{
+			bBenchmark = true;
+		}
+	}
+
+	int nRun = 0;
+	for ( CTier1Test *pTest = CTier1Test::s_pFirst; pTest; pTest = pTest->m_pNext )
+	{
+		if ( pTest->m_bBenchmark != bBenchmark || !IsTestSelected( pTest->m_pName, argc, argv ) )
+			continue;
+
+		int nFailuresBefore = s_nFailures;
+		Msg( "%s...\n", pTest->m_pName );
+		pTest->m_pFunc();
+		if ( !bBenchmark )
+		{
+			Msg( "%s: %s\n", pTest->m_pName, ( s_nFailures == nFailuresBefore ) ? "passed" : "FAILED" );
+		}
+		nRun++;
+	}
+
+	if ( !nRun )
+	{
+		Warning( "Usage: tier1test [-benchmark] [name ...]\n" );
+		return -1;
+	}
+
+	if ( !bBenchmark )
+	{
+		Msg( "%d %s, %d failed checks\n", nRun, ( nRun == 1 ) ? "test" : "tests", (int)s_nFailures );
+	}
+	return s_nFailures;
+}
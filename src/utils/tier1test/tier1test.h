@@ -0,0 +1,52 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Correctness tests and timings for tier1 code, kept out of the
+//			shipping libraries. Each test file registers its tests with the
+//			macros below; tier1test runs them all, or the ones named on the
+//			command line.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef TIER1TEST_H
+#define TIER1TEST_H
+
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "tier0/platform.h"
+
+typedef void (*Tier1TestFunc_t)();
+
+class CTier1Test
+{
+public:
+	CTier1Test( const char *pName, Tier1TestFunc_t pFunc, bool bBenchmark );
+
+	const char			*m_pName;
+	Tier1TestFunc_t		m_pFunc;
+	bool				m_bBenchmark;
+	CTier1Test			*m_pNext;
+
+	static CTier1Test	*s_pFirst;
+};
+
+// Tests run by default. A failed TEST_CHECK is reported and the test goes on.
+#define DEFINE_TIER1_TEST( name ) \
+	static void name##_Test(); \
+	static CTier1Test s_##name##_Test( #name, name##_Test, false ); \
+	static void name##_Test()
+
+// Timings only run with -benchmark
+#define DEFINE_TIER1_BENCHMARK( name ) \
+	static void name##_Benchmark(); \
+	static CTier1Test s_##name##_Benchmark( #name, name##_Benchmark, true ); \
+	static void name##_Benchmark()
+
+void Tier1Test_Fail( const char *pFile, int nLine, const char *pExpression );
+
+#define TEST_CHECK( expression ) \
+	( ( expression ) ? (void)0 : Tier1Test_Fail( __FILE__, __LINE__, #expression ) )
+
+#endif // TIER1TEST_H
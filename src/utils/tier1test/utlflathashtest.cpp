@@ -0,0 +1,575 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: CUtlFlatHash against a plain array, and its timings against the
+//			other tier1 containers
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "tier1test.h"
+#include "tier1/utlflathash.h"
+#include "tier1/utlhashtable.h"
+#include "tier1/utldict.h"
+#include "tier1/utlrbtree.h"
+#include "tier0/platform.h"
+#include "tier0/dbg.h"
+
+#define FLATHASH_TEST_KEYS		4096
+
+struct FlatHashTestItem_t
+{
+	uint32	m_nKey;
+	int		m_nValue;
+};
+
+static bool FlatHashTestItem_Compare( FlatHashTestItem_t const &a, FlatHashTestItem_t const &b )
+{
+	return a.m_nKey == b.m_nKey;
+}
+
+static unsigned int FlatHashTestItem_Key( FlatHashTestItem_t const &item )
+{
+	return item.m_nKey;
+}
+
+// Every key hashes the same, so every find probes past all the others
+static unsigned int FlatHashTestItem_SameKey( FlatHashTestItem_t const &item )
+{
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Lets the tests see the slot table
+//-----------------------------------------------------------------------------
+class CFlatHashTest : public CUtlFlatHash<FlatHashTestItem_t>
+{
+public:
+	CFlatHashTest( KeyFunc_t keyFunc ) : CUtlFlatHash<FlatHashTestItem_t>( 0, 0, 0, FlatHashTestItem_Compare, keyFunc ) {}
+
+	int Capacity() const	{ return m_nCapacity; }
+	int GrowthLeft() const	{ return m_nGrowthLeft; }
+
+	int DeletedSlots() const
+	{
+		int nDeleted = 0;
+		for ( int i = 0; i < m_nCapacity; i++ )
+		{
+			nDeleted += ( m_Ctrl[i] == CTRL_DELETED );
+		}
+		return nDeleted;
+	}
+
+	// Every element is in exactly one slot, and the mirrored group matches
+	bool IsSlotTableValid() const
+	{
+		CUtlVector<int> slotsOfElement;
+		slotsOfElement.SetCount( Count() );
+		V_memset( slotsOfElement.Base(), 0, Count() * sizeof( int ) );
+		for ( int i = 0; i < m_nCapacity; i++ )
+		{
+			if ( m_Ctrl[i] & CTRL_EMPTY )
+				continue;
+			if ( m_Slots[i] < 0 || m_Slots[i] >= Count() || m_Ctrl[i] != H2( Hash( m_Data[ m_Slots[i] ] ) ) )
+				return false;
+			slotsOfElement[ m_Slots[i] ]++;
+		}
+		for ( int i = 0; i < Count(); i++ )
+		{
+			if ( slotsOfElement[i] != 1 )
+				return false;
+		}
+		for ( int i = 0; m_nCapacity && i < GROUP_WIDTH; i++ )
+		{
+			if ( m_Ctrl[i] != m_Ctrl[m_nCapacity + i] )
+				return false;
+		}
+		return true;
+	}
+
+	FlatHashTestItem_t *FindKey( uint32 nKey )
+	{
+		FlatHashTestItem_t item;
+		item.m_nKey = nKey;
+		UtlHashHandle_t h = Find( item );
+		return ( h != InvalidHandle() ) ? &Element( h ) : NULL;
+	}
+
+	bool InsertKey( uint32 nKey, int nValue )
+	{
+		FlatHashTestItem_t item;
+		item.m_nKey = nKey;
+		item.m_nValue = nValue;
+		bool bDidInsert;
+		Insert( item, &bDidInsert );
+		return bDidInsert;
+	}
+
+	bool RemoveKey( uint32 nKey )
+	{
+		FlatHashTestItem_t item;
+		item.m_nKey = nKey;
+		UtlHashHandle_t h = Find( item );
+		if ( h == InvalidHandle() )
+			return false;
+		Remove( h );
+		return true;
+	}
+};
+
+//-----------------------------------------------------------------------------
+// Random inserts, removes and finds, checked against an array of the values
+// each key should have (or -1)
+//-----------------------------------------------------------------------------
+static void TestFlatHashRandom( CFlatHashTest::KeyFunc_t keyFunc, int nKeys, int nOps )
+{
+	CFlatHashTest hash( keyFunc );
+	CUtlVector<int> values;
+	values.SetCount( nKeys );
+	for ( int i = 0; i < nKeys; i++ )
+	{
+		values[i] = -1;
+	}
+
+	int nCount = 0;
+	uint32 nSeed = 12345;
+	for ( int nOp = 0; nOp < nOps; nOp++ )
+	{
+		nSeed = nSeed * 1664525 + 1013904223;
+		uint32 nKey = ( nSeed >> 8 ) % nKeys;
+
+		// insert a bit more often than remove, so the table fills and grows
+		switch ( nSeed >> 29 )
+		{
+		case 0: case 1: case 2: case 3:
+			TEST_CHECK( hash.InsertKey( nKey, nOp ) == ( values[nKey] == -1 ) );
+			if ( values[nKey] == -1 )
+			{
+				values[nKey] = nOp;
+				nCount++;
+			}
+			break;
+
+		case 4: case 5: case 6:
+			TEST_CHECK( hash.RemoveKey( nKey ) == ( values[nKey] != -1 ) );
+			if ( values[nKey] != -1 )
+			{
+				values[nKey] = -1;
+				nCount--;
+			}
+			break;
+
+		default:
+			{
+				FlatHashTestItem_t *pItem = hash.FindKey( nKey );
+				TEST_CHECK( ( pItem != NULL ) == ( values[nKey] != -1 ) );
+				TEST_CHECK( !pItem || pItem->m_nValue == values[nKey] );
+			}
+			break;
+		}
+
+		TEST_CHECK( hash.Count() == nCount );
+	}
+
+	TEST_CHECK( hash.IsSlotTableValid() );
+	for ( int i = 0; i < nKeys; i++ )
+	{
+		FlatHashTestItem_t *pItem = hash.FindKey( i );
+		TEST_CHECK( ( pItem != NULL ) == ( values[i] != -1 ) );
+		TEST_CHECK( !pItem || pItem->m_nValue == values[i] );
+	}
+
+	// handles run from 0 to Count() - 1
+	int nHandles = 0;
+	for ( UtlHashHandle_t h = hash.GetFirstHandle(); h != hash.InvalidHandle(); h = hash.GetNextHandle( h ) )
+	{
+		TEST_CHECK( hash.IsValidHandle( h ) && values[ hash[h].m_nKey ] == hash[h].m_nValue );
+		nHandles++;
+	}
+	TEST_CHECK( nHandles == nCount );
+}
+
+//-----------------------------------------------------------------------------
+// Removing and inserting leaves deleted slots, which inserts reuse; they
+// mustn't make the table grow when it isn't any fuller
+//-----------------------------------------------------------------------------
+static void TestFlatHashDeletedSlots( CFlatHashTest::KeyFunc_t keyFunc )
+{
+	const int nLive = 100;
+	CFlatHashTest hash( keyFunc );
+
+	// less than half full, so running out of never used slots rehashes in place
+	hash.EnsureCapacity( nLive * 2 );
+	int nCapacity = hash.Capacity();
+	for ( int i = 0; i < nLive; i++ )
+	{
+		hash.InsertKey( i, i );
+	}
+
+	// putting back the key just removed reuses its slot
+	int nGrowthLeft = hash.GrowthLeft();
+	TEST_CHECK( hash.RemoveKey( nLive / 2 ) );
+	TEST_CHECK( hash.DeletedSlots() == 1 );
+	TEST_CHECK( !hash.FindKey( nLive / 2 ) );
+	TEST_CHECK( hash.InsertKey( nLive / 2, nLive / 2 ) );
+	TEST_CHECK( hash.DeletedSlots() == 0 );
+	TEST_CHECK( hash.GrowthLeft() == nGrowthLeft );
+
+	// churn through many more keys than there are slots
+	for ( int i = nLive; i < nLive + 50 * nCapacity; i++ )
+	{
+		TEST_CHECK( hash.RemoveKey( i - nLive ) );
+		TEST_CHECK( hash.InsertKey( i, i ) );
+		TEST_CHECK( hash.Capacity() == nCapacity );
+	}
+
+	TEST_CHECK( hash.Count() == nLive );
+	TEST_CHECK( hash.IsSlotTableValid() );
+	for ( int i = 0; i < nLive + 50 * nCapacity; i++ )
+	{
+		FlatHashTestItem_t *pItem = hash.FindKey( i );
+		bool bLive = ( i >= 50 * nCapacity );
+		TEST_CHECK( ( pItem != NULL ) == bLive );
+		TEST_CHECK( !pItem || pItem->m_nValue == i );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Growing, EnsureCapacity and RemoveAll rebuild the slot table
+//-----------------------------------------------------------------------------
+static void TestFlatHashRehash( CFlatHashTest::KeyFunc_t keyFunc, int nKeys )
+{
+	CFlatHashTest hash( keyFunc );
+	int nCapacity = hash.Capacity();
+	int nGrew = 0;
+	for ( int i = 0; i < nKeys; i++ )
+	{
+		hash.InsertKey( i, i );
+		if ( hash.Capacity() != nCapacity )
+		{
+			TEST_CHECK( hash.Capacity() > nCapacity && IsPowerOfTwo( hash.Capacity() ) );
+			TEST_CHECK( hash.Count() <= hash.Capacity() - hash.Capacity() / 8 );
+			TEST_CHECK( hash.IsSlotTableValid() );
+			nCapacity = hash.Capacity();
+			nGrew++;
+		}
+	}
+	TEST_CHECK( nGrew > 0 );
+	for ( int i = 0; i < nKeys; i++ )
+	{
+		FlatHashTestItem_t *pItem = hash.FindKey( i );
+		TEST_CHECK( pItem && pItem->m_nValue == i );
+	}
+
+	// made room for, so no growing on the way there
+	hash.EnsureCapacity( nKeys * 4 );
+	nCapacity = hash.Capacity();
+	TEST_CHECK( hash.IsSlotTableValid() );
+	for ( int i = nKeys; i < nKeys * 4; i++ )
+	{
+		hash.InsertKey( i, i );
+	}
+	TEST_CHECK( hash.Capacity() == nCapacity );
+	TEST_CHECK( hash.Count() == nKeys * 4 );
+
+	hash.RemoveAll();
+	TEST_CHECK( hash.Count() == 0 && hash.Capacity() == nCapacity && hash.DeletedSlots() == 0 );
+	TEST_CHECK( !hash.FindKey( 0 ) && !hash.FindKey( nKeys ) );
+	TEST_CHECK( hash.InsertKey( 7, 7 ) && hash.FindKey( 7 ) );
+
+	hash.Purge();
+	TEST_CHECK( hash.Count() == 0 && hash.Capacity() == 0 );
+	TEST_CHECK( !hash.FindKey( 7 ) );
+	TEST_CHECK( hash.InsertKey( 7, 7 ) && hash.FindKey( 7 ) );
+}
+
+DEFINE_TIER1_TEST( CUtlFlatHash )
+{
+	TestFlatHashRandom( FlatHashTestItem_Key, FLATHASH_TEST_KEYS, 200000 );
+	TestFlatHashRandom( FlatHashTestItem_SameKey, 200, 20000 );
+	TestFlatHashDeletedSlots( FlatHashTestItem_Key );
+	TestFlatHashDeletedSlots( FlatHashTestItem_SameKey );
+	TestFlatHashRehash( FlatHashTestItem_Key, FLATHASH_TEST_KEYS * 4 );
+	TestFlatHashRehash( FlatHashTestItem_SameKey, 200 );
+}
+
+//-----------------------------------------------------------------------------
+// Timings
+//-----------------------------------------------------------------------------
+
+struct HashBenchItem_t
+{
+	uint32	m_nKey;
+	int		m_nValue;
+};
+
+static bool HashBenchItem_Compare( HashBenchItem_t const &a, HashBenchItem_t const &b )
+{
+	return a.m_nKey == b.m_nKey;
+}
+
+static unsigned int HashBenchItem_Key( HashBenchItem_t const &item )
+{
+	return item.m_nKey;
+}
+
+struct HashBenchString_t
+{
+	const char	*m_pszKey;
+	int			m_nValue;
+};
+
+static bool HashBenchString_Compare( HashBenchString_t const &a, HashBenchString_t const &b )
+{
+	return !V_stricmp( a.m_pszKey, b.m_pszKey );
+}
+
+static unsigned int HashBenchString_Key( HashBenchString_t const &item )
+{
+	return HashStringCaseless( item.m_pszKey );
+}
+
+//-----------------------------------------------------------------------------
+
+class CHashBenchTimer
+{
+public:
+	CHashBenchTimer( const char *pszName, int nOps, int &nFound ) : m_pszName( pszName ), m_nOps( nOps ), m_nFound( nFound )
+	{
+		m_nFound = 0;
+		m_flStart = Plat_FloatTime();
+	}
+
+	~CHashBenchTimer()
+	{
+		double flTime = Plat_FloatTime() - m_flStart;
+		Msg( "  %-28s %8.2f ms  %7.1f ns/op  (%d found)\n", m_pszName, flTime * 1000.0, flTime * 1.0e9 / m_nOps, m_nFound );
+	}
+
+private:
+	const char	*m_pszName;
+	int			m_nOps;
+	int			&m_nFound;
+	double		m_flStart;
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: Inserts nElements random keys into each container, then looks up
+//			nLookups keys that are there and nLookups that aren't
+//-----------------------------------------------------------------------------
+DEFINE_TIER1_BENCHMARK( CUtlFlatHash )
+{
+	const int nElements = 100000;
+	const int nLookups = 1000000;
+
+	// HashIntAlternate is a bijection, so these are all different
+	CUtlVector<uint32> keys;
+	CUtlVector<uint32> missingKeys;
+	keys.SetCount( nElements );
+	missingKeys.SetCount( nElements );
+	for ( int i = 0; i < nElements; i++ )
+	{
+		keys[i] = HashIntAlternate( i );
+		missingKeys[i] = HashIntAlternate( i + nElements );
+	}
+
+	int nFound;
+	HashBenchItem_t item;
+	item.m_nValue = 0;
+
+	Msg( "%d integer keys, %d hits and %d misses\n", nElements, nLookups, nLookups );
+
+	{
+		// CUtlHash handles only have 16 bits each for the bucket and the index
+		int nBuckets = 1;
+		while ( nBuckets < nElements && nBuckets < 65536 )
+		{
+			nBuckets *= 2;
+		}
+		CUtlHash<HashBenchItem_t> hash( nBuckets, 0, 0, HashBenchItem_Compare, HashBenchItem_Key );
+		{
+			CHashBenchTimer timer( "CUtlHash insert", nElements, nFound );
+			for ( int i = 0; i < nElements; i++ )
+			{
+				item.m_nKey = keys[i];
+				hash.Insert( item );
+			}
+		}
+		{
+			CHashBenchTimer timer( "CUtlHash hit", nLookups, nFound );
+			for ( int i = 0; i < nLookups; i++ )
+			{
+				item.m_nKey = keys[i % nElements];
+				nFound += ( hash.Find( item ) != hash.InvalidHandle() );
+			}
+		}
+		{
+			CHashBenchTimer timer( "CUtlHash miss", nLookups, nFound );
+			for ( int i = 0; i < nLookups; i++ )
+			{
+				item.m_nKey = missingKeys[i % nElements];
+				nFound += ( hash.Find( item ) != hash.InvalidHandle() );
+			}
+		}
+	}
+
+	{
+		CUtlHashtable<uint32, int> hash;
+		{
+			CHashBenchTimer timer( "CUtlHashtable insert", nElements, nFound );
+			for ( int i = 0; i < nElements; i++ )
+			{
+				hash.Insert( keys[i], i );
+			}
+		}
+		{
+			CHashBenchTimer timer( "CUtlHashtable hit", nLookups, nFound );
+			for ( int i = 0; i < nLookups; i++ )
+			{
+				nFound += ( hash.Find( keys[i % nElements] ) != hash.InvalidHandle() );
+			}
+		}
+		{
+			CHashBenchTimer timer( "CUtlHashtable miss", nLookups, nFound );
+			for ( int i = 0; i < nLookups; i++ )
+			{
+				nFound += ( hash.Find( missingKeys[i % nElements] ) != hash.InvalidHandle() );
+			}
+		}
+	}
+
+	{
+		CUtlRBTree<uint32, int> tree( 0, 0, DefLessFunc( uint32 ) );
+		{
+			CHashBenchTimer timer( "CUtlRBTree insert", nElements, nFound );
+			for ( int i = 0; i < nElements; i++ )
+			{
+				tree.Insert( keys[i] );
+			}
+		}
+		{
+			CHashBenchTimer timer( "CUtlRBTree hit", nLookups, nFound );
+			for ( int i = 0; i < nLookups; i++ )
+			{
+				nFound += ( tree.Find( keys[i % nElements] ) != tree.InvalidIndex() );
+			}
+		}
+		{
+			CHashBenchTimer timer( "CUtlRBTree miss", nLookups, nFound );
+			for ( int i = 0; i < nLookups; i++ )
+			{
+				nFound += ( tree.Find( missingKeys[i % nElements] ) != tree.InvalidIndex() );
+			}
+		}
+	}
+
+	{
+		CUtlFlatHash<HashBenchItem_t> hash( 0, 0, 0, HashBenchItem_Compare, HashBenchItem_Key );
+		{
+			CHashBenchTimer timer( "CUtlFlatHash insert", nElements, nFound );
+			for ( int i = 0; i < nElements; i++ )
+			{
+				item.m_nKey = keys[i];
+				hash.Insert( item );
+			}
+		}
+		{
+			CHashBenchTimer timer( "CUtlFlatHash hit", nLookups, nFound );
+			for ( int i = 0; i < nLookups; i++ )
+			{
+				item.m_nKey = keys[i % nElements];
+				nFound += ( hash.Find( item ) != hash.InvalidHandle() );
+			}
+		}
+		{
+			CHashBenchTimer timer( "CUtlFlatHash miss", nLookups, nFound );
+			for ( int i = 0; i < nLookups; i++ )
+			{
+				item.m_nKey = missingKeys[i % nElements];
+				nFound += ( hash.Find( item ) != hash.InvalidHandle() );
+			}
+		}
+		{
+			CHashBenchTimer timer( "CUtlFlatHash remove", nElements, nFound );
+			for ( int i = 0; i < nElements; i++ )
+			{
+				item.m_nKey = keys[i];
+				UtlHashHandle_t h = hash.Find( item );
+				if ( h != hash.InvalidHandle() )
+				{
+					hash.Remove( h );
+					nFound++;
+				}
+			}
+		}
+	}
+
+	// The same keys as strings
+	CUtlVector<char> names;
+	CUtlVector<int> nameOffsets;
+	CUtlVector<int> missingNameOffsets;
+	for ( int i = 0; i < nElements * 2; i++ )
+	{
+		char szName[32];
+		V_snprintf( szName, sizeof( szName ), "item_%08x", ( i < nElements ) ? keys[i] : missingKeys[i - nElements] );
+		( ( i < nElements ) ? nameOffsets : missingNameOffsets ).AddToTail( names.Count() );
+		names.AddMultipleToTail( V_strlen( szName ) + 1, szName );
+	}
+
+	Msg( "%d string keys, %d hits and %d misses\n", nElements, nLookups, nLookups );
+
+	{
+		CUtlDict<int, int> dict;
+		{
+			CHashBenchTimer timer( "CUtlDict insert", nElements, nFound );
+			for ( int i = 0; i < nElements; i++ )
+			{
+				dict.Insert( names.Base() + nameOffsets[i], i );
+			}
+		}
+		{
+			CHashBenchTimer timer( "CUtlDict hit", nLookups, nFound );
+			for ( int i = 0; i < nLookups; i++ )
+			{
+				nFound += ( dict.Find( names.Base() + nameOffsets[i % nElements] ) != dict.InvalidIndex() );
+			}
+		}
+		{
+			CHashBenchTimer timer( "CUtlDict miss", nLookups, nFound );
+			for ( int i = 0; i < nLookups; i++ )
+			{
+				nFound += ( dict.Find( names.Base() + missingNameOffsets[i % nElements] ) != dict.InvalidIndex() );
+			}
+		}
+	}
+
+	{
+		HashBenchString_t stringItem;
+		stringItem.m_nValue = 0;
+
+		CUtlFlatHash<HashBenchString_t> hash( 0, 0, 0, HashBenchString_Compare, HashBenchString_Key );
+		{
+			CHashBenchTimer timer( "CUtlFlatHash insert", nElements, nFound );
+			for ( int i = 0; i < nElements; i++ )
+			{
+				stringItem.m_pszKey = names.Base() + nameOffsets[i];
+				hash.Insert( stringItem );
+			}
+		}
+		{
+			CHashBenchTimer timer( "CUtlFlatHash hit", nLookups, nFound );
+			for ( int i = 0; i < nLookups; i++ )
+			{
+				stringItem.m_pszKey = names.Base() + nameOffsets[i % nElements];
+				nFound += ( hash.Find( stringItem ) != hash.InvalidHandle() );
+			}
+		}
+		{
+			CHashBenchTimer timer( "CUtlFlatHash miss", nLookups, nFound );
+			for ( int i = 0; i < nLookups; i++ )
+			{
+				stringItem.m_pszKey = names.Base() + missingNameOffsets[i % nElements];
+				nFound += ( hash.Find( stringItem ) != hash.InvalidHandle() );
+			}
+		}
+	}
+}
@@ -0,0 +1,339 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: CUtlConcurrentSymbolTable with many threads adding and finding the
+//			same strings, and its timings against a locked CUtlSymbolTable
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "tier1test.h"
+#include "tier0/dbg.h"
+#include "tier0/threadtools.h"
+#include "tier1/utlsymbol.h"
+#include "tier1/utlvector.h"
+#include "tier1/strtools.h"
+
+#define SYMBOL_TEST_NAMES		8192
+
+//-----------------------------------------------------------------------------
+// Every thread adds all the names, each in its own order, so several threads
+// race to add each one and the shards grow while others are probing them.
+// The first symbol any thread gets for a name is recorded, and every thread
+// has to get the same one. Between adds, threads find names that may or may
+// not have been added yet.
+//-----------------------------------------------------------------------------
+struct SymbolTestShared_t
+{
+	CUtlConcurrentSymbolTable	*m_pTable;
+	const char					*m_pNames;
+	const int					*m_pOffsets;
+	int32 volatile				*m_pSymbols;		// -1 until a thread has added the name
+	bool						m_bInsensitive;
+	volatile bool				m_bStart;
+};
+
+struct SymbolTestThread_t
+{
+	SymbolTestShared_t	*m_pShared;
+	int					m_nThread;
+};
+
+static bool SymbolStringMatches( SymbolTestShared_t *pShared, int nSymbol, const char *pName )
+{
+	const char *pString = pShared->m_pTable->String( nSymbol );
+	return pShared->m_bInsensitive ? !V_stricmp( pString, pName ) : !V_strcmp( pString, pName );
+}
+
+static uintp SymbolTestThread( void *pParam )
+{
+	SymbolTestThread_t *pThread = (SymbolTestThread_t *)pParam;
+	SymbolTestShared_t *pShared = pThread->m_pShared;
+	CUtlConcurrentSymbolTable *pTable = pShared->m_pTable;
+
+	while ( !pShared->m_bStart )
+	{
+		ThreadPause();
+	}
+
+	// an odd step visits every name once, starting somewhere different in each thread
+	int nStep = ( pThread->m_nThread * 2 + 1 ) % SYMBOL_TEST_NAMES;
+	int iName = ( pThread->m_nThread * 997 ) % SYMBOL_TEST_NAMES;
+	for ( int i = 0; i < SYMBOL_TEST_NAMES; i++, iName = ( iName + nStep ) % SYMBOL_TEST_NAMES )
+	{
+		const char *pName = pShared->m_pNames + pShared->m_pOffsets[iName];
+		int nSymbol = pTable->AddString( pName );
+		TEST_CHECK( nSymbol >= 0 && nSymbol < SYMBOL_TEST_NAMES );
+		TEST_CHECK( SymbolStringMatches( pShared, nSymbol, pName ) );
+		TEST_CHECK( pTable->Find( pName ) == nSymbol );
+
+		if ( !ThreadInterlockedAssignIf( &pShared->m_pSymbols[iName], nSymbol, -1 ) )
+		{
+			TEST_CHECK( pShared->m_pSymbols[iName] == nSymbol );
+		}
+
+		// a name further on, which another thread may be adding right now
+		int iOther = ( iName * 31 + i ) % SYMBOL_TEST_NAMES;
+		const char *pOther = pShared->m_pNames + pShared->m_pOffsets[iOther];
+		int nOther = pTable->Find( pOther );
+		TEST_CHECK( nOther == -1 || SymbolStringMatches( pShared, nOther, pOther ) );
+		TEST_CHECK( nOther == -1 || pShared->m_pSymbols[iOther] == -1 || pShared->m_pSymbols[iOther] == nOther );
+	}
+
+	return 0;
+}
+
+static void TestConcurrentSymbolTable( int nThreads, bool bInsensitive )
+{
+	// the odd names are looked up but never added
+	CUtlVector<char> names;
+	CUtlVector<int> offsets;
+	for ( int i = 0; i < SYMBOL_TEST_NAMES * 2; i++ )
+	{
+		char szName[64];
+		V_snprintf( szName, sizeof( szName ), "%s_%d", ( i & 1 ) ? "missing" : "symbol", i / 2 );
+		offsets.AddToTail( names.Count() );
+		names.AddMultipleToTail( V_strlen( szName ) + 1, szName );
+	}
+	CUtlVector<int> addOffsets;
+	for ( int i = 0; i < SYMBOL_TEST_NAMES; i++ )
+	{
+		addOffsets.AddToTail( offsets[i * 2] );
+	}
+
+	CUtlVector<int32> symbols;
+	symbols.SetCount( SYMBOL_TEST_NAMES );
+	for ( int i = 0; i < SYMBOL_TEST_NAMES; i++ )
+	{
+		symbols[i] = -1;
+	}
+
+	// start small, so every shard grows several times during the test
+	CUtlConcurrentSymbolTable table( 16, bInsensitive );
+
+	SymbolTestShared_t shared;
+	shared.m_pTable = &table;
+	shared.m_pNames = names.Base();
+	shared.m_pOffsets = addOffsets.Base();
+	shared.m_pSymbols = symbols.Base();
+	shared.m_bInsensitive = bInsensitive;
+	shared.m_bStart = false;
+
+	CUtlVector<SymbolTestThread_t> threadArgs;
+	threadArgs.SetCount( nThreads );
+	CUtlVector<ThreadHandle_t> threads;
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		threadArgs[i].m_pShared = &shared;
+		threadArgs[i].m_nThread = i;
+		threads.AddToTail( CreateSimpleThread( SymbolTestThread, &threadArgs[i] ) );
+	}
+
+	shared.m_bStart = true;
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		ThreadJoin( threads[i] );
+		ReleaseThreadHandle( threads[i] );
+	}
+
+	// each name has its own symbol, and together they are 0 to N - 1
+	TEST_CHECK( table.GetNumStrings() == SYMBOL_TEST_NAMES );
+	CUtlVector<int> namesOfSymbol;
+	namesOfSymbol.SetCount( SYMBOL_TEST_NAMES );
+	V_memset( namesOfSymbol.Base(), 0, SYMBOL_TEST_NAMES * sizeof( int ) );
+	for ( int i = 0; i < SYMBOL_TEST_NAMES; i++ )
+	{
+		const char *pName = names.Base() + offsets[i * 2];
+		int nSymbol = table.Find( pName );
+		TEST_CHECK( nSymbol >= 0 && nSymbol < SYMBOL_TEST_NAMES && nSymbol == symbols[i] );
+		TEST_CHECK( SymbolStringMatches( &shared, nSymbol, pName ) );
+		if ( nSymbol >= 0 && nSymbol < SYMBOL_TEST_NAMES )
+		{
+			namesOfSymbol[nSymbol]++;
+		}
+
+		TEST_CHECK( table.Find( names.Base() + offsets[i * 2 + 1] ) == -1 );
+	}
+	for ( int i = 0; i < SYMBOL_TEST_NAMES; i++ )
+	{
+		TEST_CHECK( namesOfSymbol[i] == 1 );
+	}
+
+	if ( bInsensitive )
+	{
+		char szUpper[64];
+		V_strncpy( szUpper, names.Base() + offsets[0], sizeof( szUpper ) );
+		V_strupr( szUpper );
+		TEST_CHECK( table.Find( szUpper ) == symbols[0] );
+		TEST_CHECK( table.AddString( szUpper ) == symbols[0] );
+	}
+
+	TEST_CHECK( table.Find( NULL ) == -1 && table.AddString( NULL ) == -1 );
+	TEST_CHECK( table.String( -1 )[0] == 0 && table.String( SYMBOL_TEST_NAMES )[0] == 0 );
+
+	table.RemoveAll();
+	TEST_CHECK( table.GetNumStrings() == 0 );
+	TEST_CHECK( table.Find( names.Base() + offsets[0] ) == -1 );
+	TEST_CHECK( table.AddString( names.Base() + offsets[2] ) == 0 );
+	TEST_CHECK( table.Find( names.Base() + offsets[2] ) == 0 );
+}
+
+DEFINE_TIER1_TEST( CUtlConcurrentSymbolTable )
+{
+	int nThreads = clamp( GetCPUInformation().m_nLogicalProcessors * 2, 4, 32 );
+
+	TestConcurrentSymbolTable( 1, false );
+	TestConcurrentSymbolTable( nThreads, false );
+	TestConcurrentSymbolTable( nThreads, true );
+}
+
+//-----------------------------------------------------------------------------
+// Timings
+//-----------------------------------------------------------------------------
+
+// CUtlSymbolTableMT as it was, for comparison
+class CUtlSymbolTableLocked : private CUtlSymbolTable
+{
+public:
+	CUtlSymbolTableLocked() : CUtlSymbolTable( 0, 32, true ) {}
+
+	CUtlSymbol AddString( const char* pString )
+	{
+		m_lock.LockForWrite();
+		CUtlSymbol result = CUtlSymbolTable::AddString( pString );
+		m_lock.UnlockWrite();
+		return result;
+	}
+
+	int Find( const char* pString ) const
+	{
+		m_lock.LockForRead();
+		CUtlSymbol result = CUtlSymbolTable::Find( pString );
+		m_lock.UnlockRead();
+		return result.IsValid() ? (int)(UtlSymId_t)result : -1;
+	}
+
+private:
+#if defined(WIN32) || defined(_WIN32)
+	mutable CThreadSpinRWLock m_lock;
+#else
+	mutable CThreadRWLock m_lock;
+#endif
+};
+
+template < class TABLE >
+struct SymbolTableBenchmarkArgs_t
+{
+	TABLE *					m_pTable;
+	const char *			m_pNames;
+	const int *				m_pOffsets;
+	int						m_nNames;
+	int						m_nLookups;
+	CInterlockedInt			m_nThreads;
+	CInterlockedInt			m_nFound;
+	volatile bool *			m_pbStart;
+};
+
+template < class TABLE >
+static uintp SymbolTableBenchmarkThread( void *pParam )
+{
+	SymbolTableBenchmarkArgs_t<TABLE> *pArgs = (SymbolTableBenchmarkArgs_t<TABLE> *)pParam;
+
+	while ( !*pArgs->m_pbStart )
+	{
+		ThreadPause();
+	}
+
+	// Start each thread somewhere different so they aren't all on the same strings
+	int iName = ( pArgs->m_nThreads++ * 997 ) % pArgs->m_nNames;
+	int nFound = 0;
+	for ( int i = 0; i < pArgs->m_nLookups; i++ )
+	{
+		nFound += ( pArgs->m_pTable->Find( pArgs->m_pNames + pArgs->m_pOffsets[iName] ) >= 0 );
+		if ( ++iName == pArgs->m_nNames )
+		{
+			iName = 0;
+		}
+	}
+
+	pArgs->m_nFound += nFound;
+	return 0;
+}
+
+template < class TABLE >
+static double TimeSymbolTable( TABLE &table, const CUtlVector<char> &names, const CUtlVector<int> &offsets, int nThreads, int nLookups, int &nFound )
+{
+	volatile bool bStart = false;
+	SymbolTableBenchmarkArgs_t<TABLE> args;
+	args.m_pTable = &table;
+	args.m_pNames = names.Base();
+	args.m_pOffsets = offsets.Base();
+	args.m_nNames = offsets.Count();
+	args.m_nLookups = nLookups;
+	args.m_pbStart = &bStart;
+
+	CUtlVector<ThreadHandle_t> threads;
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		threads.AddToTail( CreateSimpleThread( SymbolTableBenchmarkThread<TABLE>, &args ) );
+	}
+
+	double flStart = Plat_FloatTime();
+	bStart = true;
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		ThreadJoin( threads[i] );
+		ReleaseThreadHandle( threads[i] );
+	}
+	double flTime = Plat_FloatTime() - flStart;
+
+	nFound = args.m_nFound;
+	return flTime;
+}
+
+DEFINE_TIER1_BENCHMARK( CUtlConcurrentSymbolTable )
+{
+	const int nMaxThreads = 32;
+	const int nLookups = 1000000;
+	static const char *s_pszWords[] = { "origin", "angles", "model", "targetname", "speed", "damage", "sound", "effect" };
+	const int nNames = 4096;
+
+	// Every other name goes in the tables, so half the lookups miss. The names
+	// are copies so nothing can match on the pointer.
+	CUtlVector<char> names;
+	CUtlVector<int> offsets;
+	CUtlSymbolTableLocked lockedTable;
+	CUtlConcurrentSymbolTable table( nNames / 2, true );
+	for ( int i = 0; i < nNames; i++ )
+	{
+		char szName[64];
+		V_snprintf( szName, sizeof( szName ), "%s_%d", s_pszWords[i % ARRAYSIZE( s_pszWords )], i / 2 );
+		if ( i & 1 )
+		{
+			szName[0] = 'X';
+		}
+		else
+		{
+			lockedTable.AddString( szName );
+			table.AddString( szName );
+		}
+		offsets.AddToTail( names.Count() );
+		names.AddMultipleToTail( V_strlen( szName ) + 1, szName );
+	}
+
+	Msg( "%d lookups per thread, %d strings, half of the lookups miss\n", nLookups, nNames / 2 );
+	Msg( "threads     locked Mfinds/s   lock free Mfinds/s   locked found   lock free found\n" );
+
+	for ( int nThreads = 1; nThreads <= nMaxThreads; nThreads *= 2 )
+	{
+		int nLockedFound, nFound;
+		double flLocked = TimeSymbolTable( lockedTable, names, offsets, nThreads, nLookups, nLockedFound );
+		double flLockFree = TimeSymbolTable( table, names, offsets, nThreads, nLookups, nFound );
+
+		// CUtlSymbolTable::Find keeps the string it is looking for in the table,
+		// so readers sharing the read lock can compare against each other's
+		// strings. The locked found count can be off with more than one thread.
+		double flOps = (double)nThreads * nLookups / 1000000.0;
+		Msg( "%7d  %16.2f  %19.2f  %13d  %16d\n", nThreads, flLocked > 0 ? flOps / flLocked : 0.0, flLockFree > 0 ? flOps / flLockFree : 0.0,
+			nLockedFound, nFound );
+	}
+}
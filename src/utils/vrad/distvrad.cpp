@@ -0,0 +1,181 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: vrad stages run through DW_DistributeWork (see distribute_work.h).
+//			These mirror the VMPI versions in mpivrad.cpp.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "vrad.h"
+#include "lightmap.h"
+#include "vismat.h"
+#include "transferstore.h"
+#include "facelightcache.h"
+#include "pacifier.h"
+#include "distribute_work.h"
+#include "distvrad.h"
+
+
+extern int total_transfer;
+extern int max_transfer;
+
+extern void BuildPatchLights( int facenum );
+
+
+//-----------------------------------------------------------------------------
+// BuildFacelights
+//-----------------------------------------------------------------------------
+template<class T> static void GetValues( CUtlBuffer &buf, T *pDest, int nNumValues )
+{
+	buf.Get( pDest, sizeof( pDest[0] ) * nNumValues );
+	if ( !buf.IsValid() )
+		Error( "Invalid results from worker" );
+}
+
+static void DW_ProcessFaces( int iThread, uint64 iWorkUnit, CUtlBuffer *pBuf )
+{
+	BuildFacelights( iThread, iWorkUnit );
+
+	if ( pBuf )
+	{
+		pBuf->Put( &g_pFaces[iWorkUnit], sizeof( dface_t ) );
+		SerializeFaceLight( *pBuf, iWorkUnit );
+	}
+}
+
+static void DW_ReceiveFaceResults( uint64 iWorkUnit, CUtlBuffer &buf, int iWorker )
+{
+	GetValues( buf, &g_pFaces[iWorkUnit], 1 );
+	if ( !UnSerializeFaceLight( buf, iWorkUnit ) )
+		Error( "Invalid face results from worker" );
+
+	// workers don't write the cache
+	g_FaceLightCache.StoreFace( iWorkUnit );
+}
+
+void DW_RunBuildFacelights()
+{
+	Msg( "%-20s ", "BuildFaceLights:" );
+	if ( !DW_IsWorker() )
+	{
+		StartPacifier( "" );
+	}
+
+	double elapsed = DW_DistributeWork( numfaces, DW_ProcessFaces, DW_ReceiveFaceResults );
+
+	if ( !DW_IsWorker() )
+	{
+		EndPacifier( false );
+		Msg( " (%d)\n", (int)elapsed );
+
+		// BuildFacelights leaves this to the coordinator when distributing, since
+		// it needs the facelights of every face
+		for ( int i = 0; i < numfaces; ++i )
+		{
+			BuildPatchLights( i );
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// BuildVisLeafs
+//-----------------------------------------------------------------------------
+struct DWVisLeafsData_t
+{
+	CUtlBuffer *m_pBuf;
+	int m_nPatchesInCluster;
+	transfer_t *m_pBuildVisLeafsTransfers;
+};
+
+static CUtlVector<DWVisLeafsData_t> g_DWVisLeafsData;
+
+// Called by BuildVisLeafs_Cluster after MakeScales has normalized a patch's transfers.
+static void DW_AddPatchData( int iThread, int patchnum, CPatch *patch )
+{
+	DWVisLeafsData_t *pData = &g_DWVisLeafsData[iThread];
+	if ( pData->m_pBuf )
+	{
+		++pData->m_nPatchesInCluster;
+		pData->m_pBuf->PutInt( patchnum );
+		pData->m_pBuf->PutInt( patch->numtransfers );
+		pData->m_pBuf->Put( pData->m_pBuildVisLeafsTransfers, patch->numtransfers * sizeof( transfer_t ) );
+	}
+}
+
+static void DW_ProcessVisLeafs( int iThread, uint64 iWorkUnit, CUtlBuffer *pBuf )
+{
+	DWVisLeafsData_t *pData = &g_DWVisLeafsData[iThread];
+	pData->m_nPatchesInCluster = 0;
+	pData->m_pBuf = pBuf;
+
+	int nCountPos = 0;
+	if ( pBuf )
+	{
+		nCountPos = pBuf->TellPut();
+		pBuf->PutInt( 0 );
+	}
+
+	BuildVisLeafs_Cluster( iThread, pData->m_pBuildVisLeafsTransfers, (int)iWorkUnit, DW_AddPatchData );
+
+	if ( pBuf )
+	{
+		*(int *)( (byte *)pBuf->Base() + nCountPos ) = pData->m_nPatchesInCluster;
+		pData->m_pBuf = NULL;
+	}
+}
+
+static void DW_ReceiveVisLeafsResults( uint64 iWorkUnit, CUtlBuffer &buf, int iWorker )
+{
+	CUtlVector<transfer_t> transfers;
+
+	int patchesInCluster = buf.GetInt();
+	for ( int k = 0; k < patchesInCluster; ++k )
+	{
+		int patchnum = buf.GetInt();
+		int numtransfers = buf.GetInt();
+		if ( !buf.IsValid() || patchnum < 0 || patchnum >= g_Patches.Count() || numtransfers < 0 || numtransfers > MAX_PATCHES )
+			Error( "Invalid vis leaf results from worker" );
+
+		g_Patches[patchnum].numtransfers = numtransfers;
+		if ( numtransfers )
+		{
+			transfers.SetCount( numtransfers );
+			GetValues( buf, transfers.Base(), numtransfers );
+			g_TransferStore.AddRow( patchnum, transfers.Base(), numtransfers );
+		}
+
+		total_transfer += numtransfers;
+		if ( max_transfer < numtransfers )
+			max_transfer = numtransfers;
+	}
+}
+
+void DW_RunBuildVisLeafs()
+{
+	Msg( "%-20s ", "BuildVisLeafs  :" );
+	if ( !DW_IsWorker() )
+	{
+		StartPacifier( "" );
+	}
+
+	g_DWVisLeafsData.SetCount( GetThreadArraySize() );
+	memset( g_DWVisLeafsData.Base(), 0, g_DWVisLeafsData.Count() * sizeof( DWVisLeafsData_t ) );
+	for ( int i = 0; i < numthreads; i++ )
+	{
+		g_DWVisLeafsData[i].m_pBuildVisLeafsTransfers = BuildVisLeafs_Start();
+	}
+
+	double elapsed = DW_DistributeWork( dvis->numclusters, DW_ProcessVisLeafs, DW_ReceiveVisLeafsResults );
+
+	for ( int i = 0; i < numthreads; i++ )
+	{
+		BuildVisLeafs_End( g_DWVisLeafsData[i].m_pBuildVisLeafsTransfers );
+	}
+
+	if ( !DW_IsWorker() )
+	{
+		EndPacifier( false );
+		Msg( " (%d)\n", (int)elapsed );
+	}
+}
@@ -0,0 +1,19 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: vrad stages run through DW_DistributeWork (see distribute_work.h).
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef DISTVRAD_H
+#define DISTVRAD_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+
+void		DW_RunBuildFacelights();
+void		DW_RunBuildVisLeafs();
+
+
+#endif // DISTVRAD_H
@@ -0,0 +1,644 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Keeps the direct lighting of each face between compiles so that
+//			faces whose inputs haven't changed don't have to be relit.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "vrad.h"
+#include "lightmap.h"
+#include "facelightcache.h"
+#include "distribute_work.h"
+#include "worldsize.h"
+
+
+#define FACELIGHTCACHE_MAGIC		MAKEID( 'V', 'F', 'L', 'C' )
+#define FACELIGHTCACHE_VERSION		1
+
+#define OCCLUDER_CELL_SIZE			256.0f
+#define OCCLUDER_MAX_CELLS			64		// per axis
+
+// how far the samples and luxels of a face can be from its polygon, on top of a luxel
+#define FACE_BOUNDS_EPSILON			4.0f
+
+
+struct FaceLightCacheHeader_t
+{
+	int32	m_nMagic;
+	int32	m_nVersion;
+	int32	m_nEntries;
+	int32	m_nFaceLightSize;		// 32 and 64 bit builds can't share a cache
+	int32	m_nSampleSize;
+};
+
+// Everything on the command line that changes BuildFacelights' results.
+struct FaceLightCacheSettings_t
+{
+	int32	m_bExtra;
+	int32	m_bFast;
+	int32	m_bCenterSamples;
+	int32	m_nExtraPasses;
+	int32	m_bDebugExtra;
+	int32	m_nDLightMap;
+	int32	m_bHDR;
+	int32	m_bTextureShadows;
+	int32	m_bStaticPropPolys;
+	int32	m_bDisablePropSelfShadowing;
+	int32	m_bLargeDispSampleRadius;
+	int32	m_bNoSkyRecurse;
+	float	m_flSmoothingThreshold;
+	float	m_flDLightThreshold;
+	float	m_flLightScale;
+	float	m_flSunAngularExtent;
+	float	m_flSkySampleScale;
+	float	m_flMaxDispSampleSize;
+};
+
+
+CFaceLightCache g_FaceLightCache;
+
+
+//-----------------------------------------------------------------------------
+// Hashing helpers
+//-----------------------------------------------------------------------------
+template<class T> static FORCEINLINE void HashValue( MD5Context_t &ctx, const T &value )
+{
+	MD5Update( &ctx, (const unsigned char *)&value, sizeof( value ) );
+}
+
+static uint64 KeyToMapKey( const MD5Value_t &key )
+{
+	uint64 nMapKey;
+	memcpy( &nMapKey, key.bits, sizeof( nMapKey ) );
+	return nMapKey;
+}
+
+static void AddLeafClustersInBox( int iNode, const Vector &vecMins, const Vector &vecMaxs, CUtlVector<int> &clusters )
+{
+	Vector vecCenter = ( vecMins + vecMaxs ) * 0.5f;
+	Vector vecExtents = vecMaxs - vecCenter;
+
+	while ( iNode >= 0 )
+	{
+		dnode_t *node = &dnodes[iNode];
+		dplane_t *plane = &dplanes[node->planenum];
+
+		float flDist = DotProduct( vecCenter, plane->normal ) - plane->dist;
+		float flRadius = fabs( vecExtents.x * plane->normal.x ) + fabs( vecExtents.y * plane->normal.y ) + fabs( vecExtents.z * plane->normal.z );
+		if ( flDist > flRadius )
+		{
+			iNode = node->children[0];
+		}
+		else if ( flDist < -flRadius )
+		{
+			iNode = node->children[1];
+		}
+		else
+		{
+			AddLeafClustersInBox( node->children[0], vecMins, vecMaxs, clusters );
+			iNode = node->children[1];
+		}
+	}
+
+	int cluster = dleafs[-1 - iNode].cluster;
+	if ( clusters.Find( cluster ) == -1 )
+	{
+		clusters.AddToTail( cluster );
+	}
+}
+
+static void HashDispVerts( MD5Context_t &ctx, int iDisp )
+{
+	const ddispinfo_t &disp = g_dispinfo[iDisp];
+	HashValue( ctx, disp.startPosition );
+	HashValue( ctx, disp.power );
+	HashValue( ctx, disp.smoothingAngle );
+	HashValue( ctx, disp.contents );
+	MD5Update( &ctx, (const unsigned char *)&g_DispVerts[disp.m_iDispVertStart], disp.NumVerts() * sizeof( CDispVert ) );
+}
+
+
+//-----------------------------------------------------------------------------
+// CFaceLightCache
+//-----------------------------------------------------------------------------
+CFaceLightCache::CFaceLightCache() : m_OldEntryMap( DefLessFunc( uint64 ) )
+{
+	m_bActive = false;
+	m_bSaveResults = false;
+	m_szFileName[0] = 0;
+	m_nCells[0] = m_nCells[1] = m_nCells[2] = 0;
+	m_nRestored = 0;
+}
+
+CFaceLightCache::~CFaceLightCache()
+{
+	Shutdown();
+}
+
+void CFaceLightCache::BuildOccluderGrid( RayTracingEnvironment &rtEnv )
+{
+	int nTriangles = rtEnv.OptimizedTriangleList.Count();
+	m_GridSums.Purge();
+	if ( !nTriangles )
+		return;
+
+	m_vecGridMins.Init( FLT_MAX, FLT_MAX, FLT_MAX );
+	m_vecGridMaxs.Init( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+	for ( int t = 0; t < nTriangles; t++ )
+	{
+		const CacheOptimizedTriangle &tri = rtEnv.OptimizedTriangleList[t];
+		for ( int v = 0; v < 3; v++ )
+		{
+			VectorMin( tri.Vertex( v ), m_vecGridMins, m_vecGridMins );
+			VectorMax( tri.Vertex( v ), m_vecGridMaxs, m_vecGridMaxs );
+		}
+	}
+
+	for ( int i = 0; i < 3; i++ )
+	{
+		float flExtent = MAX( m_vecGridMaxs[i] - m_vecGridMins[i], 1.0f );
+		m_nCells[i] = clamp( (int)ceil( flExtent / OCCLUDER_CELL_SIZE ), 1, OCCLUDER_MAX_CELLS );
+		m_vecCellSize[i] = flExtent / m_nCells[i];
+	}
+
+	// each cell gets the sum of the hashes of the triangles that touch it
+	int nCells = m_nCells[0] * m_nCells[1] * m_nCells[2];
+	CUtlVector<uint64> cells;
+	cells.SetCount( nCells );
+	memset( cells.Base(), 0, nCells * sizeof( uint64 ) );
+
+	bool bColors = rtEnv.TriangleColors.Count() == nTriangles;
+	bool bMaterials = g_bTextureShadows && rtEnv.TriangleMaterials.Count() == nTriangles;
+	for ( int t = 0; t < nTriangles; t++ )
+	{
+		const TriGeometryData_t &geom = rtEnv.OptimizedTriangleList[t].m_Data.m_GeometryData;
+
+		// the triangle IDs are face and prop indices, which change with unrelated edits
+		MD5Context_t ctx;
+		MD5Init( &ctx );
+		HashValue( ctx, geom.m_VertexCoordData );
+		HashValue( ctx, geom.m_nFlags );
+		if ( bColors )
+			HashValue( ctx, rtEnv.TriangleColors[t] );
+		if ( bMaterials )
+			HashValue( ctx, rtEnv.TriangleMaterials[t] );
+		MD5Value_t triHash;
+		MD5Final( triHash.bits, &ctx );
+		uint64 nTriHash = KeyToMapKey( triHash );
+
+		Vector vecMins, vecMaxs;
+		vecMins = vecMaxs = rtEnv.OptimizedTriangleList[t].Vertex( 0 );
+		for ( int v = 1; v < 3; v++ )
+		{
+			VectorMin( rtEnv.OptimizedTriangleList[t].Vertex( v ), vecMins, vecMins );
+			VectorMax( rtEnv.OptimizedTriangleList[t].Vertex( v ), vecMaxs, vecMaxs );
+		}
+
+		int nMin[3], nMax[3];
+		for ( int i = 0; i < 3; i++ )
+		{
+			nMin[i] = clamp( (int)( ( vecMins[i] - m_vecGridMins[i] ) / m_vecCellSize[i] ), 0, m_nCells[i] - 1 );
+			nMax[i] = clamp( (int)( ( vecMaxs[i] - m_vecGridMins[i] ) / m_vecCellSize[i] ), 0, m_nCells[i] - 1 );
+		}
+		for ( int z = nMin[2]; z <= nMax[2]; z++ )
+		{
+			for ( int y = nMin[1]; y <= nMax[1]; y++ )
+			{
+				for ( int x = nMin[0]; x <= nMax[0]; x++ )
+				{
+					cells[( z * m_nCells[1] + y ) * m_nCells[0] + x] += nTriHash;
+				}
+			}
+		}
+	}
+
+	// Summed area table. Wrapping arithmetic is fine since regions are only
+	// ever compared with themselves.
+	int nSx = m_nCells[0] + 1;
+	int nSy = m_nCells[1] + 1;
+	int nSz = m_nCells[2] + 1;
+	m_GridSums.SetCount( nSx * nSy * nSz );
+	memset( m_GridSums.Base(), 0, m_GridSums.Count() * sizeof( uint64 ) );
+
+	#define SUM( x, y, z )	m_GridSums[( (z) * nSy + (y) ) * nSx + (x)]
+	for ( int z = 1; z < nSz; z++ )
+	{
+		for ( int y = 1; y < nSy; y++ )
+		{
+			for ( int x = 1; x < nSx; x++ )
+			{
+				SUM( x, y, z ) = cells[( ( z - 1 ) * m_nCells[1] + ( y - 1 ) ) * m_nCells[0] + ( x - 1 )]
+					+ SUM( x - 1, y, z ) + SUM( x, y - 1, z ) + SUM( x, y, z - 1 )
+					- SUM( x - 1, y - 1, z ) - SUM( x - 1, y, z - 1 ) - SUM( x, y - 1, z - 1 )
+					+ SUM( x - 1, y - 1, z - 1 );
+			}
+		}
+	}
+	#undef SUM
+
+	qprintf( "Face light cache: %d triangles in a %dx%dx%d occluder grid\n", nTriangles, m_nCells[0], m_nCells[1], m_nCells[2] );
+}
+
+uint64 CFaceLightCache::GetRegionHash( const Vector &vecMins, const Vector &vecMaxs ) const
+{
+	if ( !m_GridSums.Count() )
+		return 0;
+
+	int nMin[3], nMax[3];
+	for ( int i = 0; i < 3; i++ )
+	{
+		nMin[i] = clamp( (int)( ( vecMins[i] - m_vecGridMins[i] ) / m_vecCellSize[i] ), 0, m_nCells[i] - 1 );
+		nMax[i] = clamp( (int)( ( vecMaxs[i] - m_vecGridMins[i] ) / m_vecCellSize[i] ), 0, m_nCells[i] - 1 ) + 1;
+	}
+
+	int nSx = m_nCells[0] + 1;
+	int nSy = m_nCells[1] + 1;
+	#define SUM( x, y, z )	m_GridSums[( (z) * nSy + (y) ) * nSx + (x)]
+	uint64 nSum = SUM( nMax[0], nMax[1], nMax[2] )
+		- SUM( nMin[0], nMax[1], nMax[2] ) - SUM( nMax[0], nMin[1], nMax[2] ) - SUM( nMax[0], nMax[1], nMin[2] )
+		+ SUM( nMin[0], nMin[1], nMax[2] ) + SUM( nMin[0], nMax[1], nMin[2] ) + SUM( nMax[0], nMin[1], nMin[2] )
+		- SUM( nMin[0], nMin[1], nMin[2] );
+	#undef SUM
+	return nSum;
+}
+
+void CFaceLightCache::ComputeFaceKey( int facenum, MD5Value_t &key ) const
+{
+	dface_t *f = &g_pFaces[facenum];
+	texinfo_t *pTexInfo = &texinfo[f->texinfo];
+	dtexdata_t *pTexData = &dtexdata[pTexInfo->texdata];
+
+	MD5Context_t ctx;
+	MD5Init( &ctx );
+	HashValue( ctx, m_SettingsHash );
+
+	// face geometry and lightmap layout
+	HashValue( ctx, dplanes[f->planenum].normal );
+	HashValue( ctx, dplanes[f->planenum].dist );
+	HashValue( ctx, f->side );
+	HashValue( ctx, f->numedges );
+	HashValue( ctx, f->smoothingGroups );
+	HashValue( ctx, f->m_LightmapTextureMinsInLuxels );
+	HashValue( ctx, f->m_LightmapTextureSizeInLuxels );
+	HashValue( ctx, face_offset[facenum] );
+
+	Vector vecMins( FLT_MAX, FLT_MAX, FLT_MAX );
+	Vector vecMaxs( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+	for ( int i = 0; i < f->numedges; i++ )
+	{
+		int edge = dsurfedges[f->firstedge + i];
+		int v = ( edge >= 0 ) ? dedges[edge].v[0] : dedges[-edge].v[1];
+		Vector vecPos = dvertexes[v].point + face_offset[facenum];
+		HashValue( ctx, vecPos );
+		VectorMin( vecPos, vecMins, vecMins );
+		VectorMax( vecPos, vecMaxs, vecMaxs );
+	}
+
+	// smoothing pulls in the neighbors' normals
+	faceneighbor_t *fn = &faceneighbor[facenum];
+	HashValue( ctx, fn->facenormal );
+	if ( fn->normal )
+	{
+		MD5Update( &ctx, (const unsigned char *)fn->normal, f->numedges * sizeof( Vector ) );
+	}
+
+	HashValue( ctx, pTexInfo->textureVecsTexelsPerWorldUnits );
+	HashValue( ctx, pTexInfo->lightmapVecsLuxelsPerWorldUnits );
+	HashValue( ctx, pTexInfo->flags );
+	HashValue( ctx, pTexData->reflectivity );
+	HashValue( ctx, pTexData->width );
+	HashValue( ctx, pTexData->height );
+	const char *pTexName = TexDataStringTable_GetString( pTexData->nameStringTableID );
+	MD5Update( &ctx, (const unsigned char *)pTexName, V_strlen( pTexName ) );
+
+	float flExpand = FACE_BOUNDS_EPSILON;
+	for ( int i = 0; i < 2; i++ )
+	{
+		const float *pVec = pTexInfo->lightmapVecsLuxelsPerWorldUnits[i];
+		float flLuxelsPerUnit = VectorLength( Vector( pVec[0], pVec[1], pVec[2] ) );
+		if ( flLuxelsPerUnit > 0.0f )
+			flExpand = MAX( flExpand, FACE_BOUNDS_EPSILON + 1.0f / flLuxelsPerUnit );
+	}
+
+	// displacements are lit with their neighbors' normals
+	if ( f->dispinfo != -1 )
+	{
+		const ddispinfo_t &disp = g_dispinfo[f->dispinfo];
+		HashDispVerts( ctx, f->dispinfo );
+		for ( int i = 0; i < disp.NumVerts(); i++ )
+		{
+			const CDispVert &vert = g_DispVerts[disp.m_iDispVertStart + i];
+			flExpand = MAX( flExpand, FACE_BOUNDS_EPSILON + fabs( vert.m_flDist ) * VectorLength( vert.m_vVector ) );
+		}
+
+		for ( int i = 0; i < 4; i++ )
+		{
+			for ( int j = 0; j < 2; j++ )
+			{
+				const CDispSubNeighbor &sub = disp.m_EdgeNeighbors[i].m_SubNeighbors[j];
+				if ( !sub.IsValid() )
+					continue;
+				HashValue( ctx, sub.m_NeighborOrientation );
+				HashValue( ctx, sub.m_Span );
+				HashValue( ctx, sub.m_NeighborSpan );
+				HashDispVerts( ctx, sub.GetNeighborIndex() );
+			}
+
+			const CDispCornerNeighbors &corner = disp.m_CornerNeighbors[i];
+			for ( int j = 0; j < corner.m_nNeighbors; j++ )
+			{
+				HashDispVerts( ctx, corner.m_Neighbors[j] );
+			}
+		}
+	}
+
+	vecMins -= Vector( flExpand, flExpand, flExpand );
+	vecMaxs += Vector( flExpand, flExpand, flExpand );
+
+	CUtlVector<int> clusters;
+	AddLeafClustersInBox( 0, vecMins, vecMaxs, clusters );
+
+	uint64 nWorldHash = GetRegionHash( m_vecGridMins, m_vecGridMaxs );
+	bool bSkyRecurse = !g_bNoSkyRecurse && num_sky_cameras > 0;
+
+	// the lights that can reach the face, and what's between them and the face
+	for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next )
+	{
+		bool bVisible = false;
+		for ( int i = 0; i < clusters.Count() && !bVisible; i++ )
+		{
+			bVisible = PVSCheck( dl->pvs, clusters[i] ) != 0;
+		}
+		if ( !bVisible )
+			continue;
+
+		uint64 nRegionHash;
+		switch ( dl->light.type )
+		{
+			case emit_skyambient:
+				nRegionHash = nWorldHash;
+				break;
+
+			case emit_skylight:
+				if ( g_SunAngularExtent > 0.0f || bSkyRecurse )
+				{
+					nRegionHash = nWorldHash;
+				}
+				else
+				{
+					Vector vecSunOffset = dl->light.normal * -MAX_TRACE_LENGTH;
+					Vector vecRegionMins, vecRegionMaxs;
+					VectorMin( vecMins, vecMins + vecSunOffset, vecRegionMins );
+					VectorMax( vecMaxs, vecMaxs + vecSunOffset, vecRegionMaxs );
+					nRegionHash = GetRegionHash( vecRegionMins, vecRegionMaxs );
+				}
+				break;
+
+			default:
+			{
+				// lights with a hard falloff can be out of range
+				if ( dl->m_flEndFadeDistance > dl->m_flStartFadeDistance )
+				{
+					Vector vecClosest;
+					VectorMax( vecMins, dl->light.origin, vecClosest );
+					VectorMin( vecMaxs, vecClosest, vecClosest );
+					if ( vecClosest.DistTo( dl->light.origin ) > dl->m_flEndFadeDistance )
+						continue;
+				}
+
+				Vector vecRegionMins, vecRegionMaxs;
+				VectorMin( vecMins, dl->light.origin, vecRegionMins );
+				VectorMax( vecMaxs, dl->light.origin, vecRegionMaxs );
+				nRegionHash = GetRegionHash( vecRegionMins, vecRegionMaxs );
+				break;
+			}
+		}
+
+		HashValue( ctx, dl->light.type );
+		HashValue( ctx, dl->light.style );
+		HashValue( ctx, dl->light.origin );
+		HashValue( ctx, dl->light.intensity );
+		HashValue( ctx, dl->light.normal );
+		HashValue( ctx, dl->light.stopdot );
+		HashValue( ctx, dl->light.stopdot2 );
+		HashValue( ctx, dl->light.exponent );
+		HashValue( ctx, dl->light.constant_attn );
+		HashValue( ctx, dl->light.linear_attn );
+		HashValue( ctx, dl->light.quadratic_attn );
+		HashValue( ctx, dl->light.flags );
+		HashValue( ctx, dl->m_flStartFadeDistance );
+		HashValue( ctx, dl->m_flEndFadeDistance );
+		HashValue( ctx, dl->m_flCapDist );
+		HashValue( ctx, nRegionHash );
+	}
+
+	MD5Final( key.bits, &ctx );
+}
+
+void CFaceLightCache::ComputeFaceKeyThread( int iThread, int facenum )
+{
+	g_FaceLightCache.ComputeFaceKey( facenum, g_FaceLightCache.m_FaceKeys[facenum] );
+}
+
+void CFaceLightCache::LoadFile()
+{
+	FILE *fp = fopen( m_szFileName, "rb" );
+	if ( !fp )
+		return;
+
+	fseek( fp, 0, SEEK_END );
+	int nSize = ftell( fp );
+	fseek( fp, 0, SEEK_SET );
+
+	m_OldData.EnsureCapacity( nSize );
+	bool bOk = nSize >= (int)sizeof( FaceLightCacheHeader_t ) && fread( m_OldData.Base(), nSize, 1, fp ) == 1;
+	fclose( fp );
+	if ( !bOk )
+		return;
+	m_OldData.SeekPut( CUtlBuffer::SEEK_HEAD, nSize );
+
+	FaceLightCacheHeader_t header;
+	m_OldData.Get( &header, sizeof( header ) );
+	if ( header.m_nMagic != FACELIGHTCACHE_MAGIC || header.m_nVersion != FACELIGHTCACHE_VERSION ||
+		header.m_nFaceLightSize != sizeof( facelight_t ) || header.m_nSampleSize != sizeof( sample_t ) )
+	{
+		Warning( "Ignoring out of date face light cache %s\n", m_szFileName );
+		return;
+	}
+
+	for ( int i = 0; i < header.m_nEntries; i++ )
+	{
+		Entry_t entry;
+		m_OldData.Get( &entry.m_Key, sizeof( entry.m_Key ) );
+		entry.m_nBytes = m_OldData.GetInt();
+		entry.m_nOffset = m_OldData.TellGet();
+		if ( !m_OldData.IsValid() || entry.m_nBytes < 0 || entry.m_nBytes > m_OldData.GetBytesRemaining() )
+		{
+			Warning( "Face light cache %s is truncated\n", m_szFileName );
+			break;
+		}
+		m_OldData.SeekGet( CUtlBuffer::SEEK_CURRENT, entry.m_nBytes );
+
+		uint64 nMapKey = KeyToMapKey( entry.m_Key );
+		if ( m_OldEntryMap.Find( nMapKey ) == m_OldEntryMap.InvalidIndex() )
+		{
+			m_OldEntryMap.Insert( nMapKey, m_OldEntries.AddToTail( entry ) );
+		}
+	}
+}
+
+void CFaceLightCache::Init( const char *pFileName )
+{
+	Shutdown();
+
+	V_strncpy( m_szFileName, pFileName, sizeof( m_szFileName ) );
+	m_bActive = true;
+
+	// only the coordinator has all the results
+	m_bSaveResults = !DW_IsWorker();
+
+	FaceLightCacheSettings_t settings;
+	memset( &settings, 0, sizeof( settings ) );
+	settings.m_bExtra = do_extra;
+	settings.m_bFast = do_fast;
+	settings.m_bCenterSamples = do_centersamples;
+	settings.m_nExtraPasses = extrapasses;
+	settings.m_bDebugExtra = debug_extra;
+	settings.m_nDLightMap = dlight_map;
+	settings.m_bHDR = g_bHDR;
+	settings.m_bTextureShadows = g_bTextureShadows;
+	settings.m_bStaticPropPolys = g_bStaticPropPolys;
+	settings.m_bDisablePropSelfShadowing = g_bDisablePropSelfShadowing;
+	settings.m_bLargeDispSampleRadius = g_bLargeDispSampleRadius;
+	settings.m_bNoSkyRecurse = g_bNoSkyRecurse;
+	settings.m_flSmoothingThreshold = smoothing_threshold;
+	settings.m_flDLightThreshold = dlight_threshold;
+	settings.m_flLightScale = lightscale;
+	settings.m_flSunAngularExtent = g_SunAngularExtent;
+	settings.m_flSkySampleScale = g_flSkySampleScale;
+	settings.m_flMaxDispSampleSize = g_flMaxDispSampleSize;
+	MD5_ProcessSingleBuffer( &settings, sizeof( settings ), m_SettingsHash );
+
+	LoadFile();
+
+	m_FaceKeys.SetCount( numfaces );
+	m_FaceRestored.SetCount( numfaces );
+	m_FaceResults.SetCount( numfaces );
+	for ( int i = 0; i < numfaces; i++ )
+	{
+		m_FaceRestored[i] = -1;
+		m_FaceResults[i] = NULL;
+	}
+	RunThreadsOnIndividual( numfaces, false, ComputeFaceKeyThread );
+
+	qprintf( "Face light cache: %d faces in %s\n", m_OldEntries.Count(), m_szFileName );
+}
+
+void CFaceLightCache::Shutdown()
+{
+	m_bActive = false;
+	m_OldData.Purge();
+	m_OldEntries.Purge();
+	m_OldEntryMap.Purge();
+	m_FaceKeys.Purge();
+	m_FaceRestored.Purge();
+	m_FaceResults.PurgeAndDeleteElements();
+	m_nRestored = 0;
+}
+
+bool CFaceLightCache::RestoreFace( int facenum )
+{
+	if ( !m_bActive )
+		return false;
+
+	const MD5Value_t &key = m_FaceKeys[facenum];
+	int iMap = m_OldEntryMap.Find( KeyToMapKey( key ) );
+	if ( iMap == m_OldEntryMap.InvalidIndex() )
+		return false;
+
+	int iEntry = m_OldEntryMap[iMap];
+	const Entry_t &entry = m_OldEntries[iEntry];
+	if ( entry.m_Key != key )
+		return false;
+
+	CUtlBuffer buf( (const byte *)m_OldData.Base() + entry.m_nOffset, entry.m_nBytes, CUtlBuffer::READ_ONLY );
+	dface_t *f = &g_pFaces[facenum];
+	buf.Get( f->styles, sizeof( f->styles ) );
+	if ( !buf.IsValid() || !UnSerializeFaceLight( buf, facenum ) )
+	{
+		for ( int i = 0; i < MAXLIGHTMAPS; i++ )
+		{
+			f->styles[i] = 255;
+		}
+		return false;
+	}
+
+	m_FaceRestored[facenum] = iEntry;
+	ThreadInterlockedIncrement( &m_nRestored );
+	return true;
+}
+
+void CFaceLightCache::StoreFace( int facenum )
+{
+	if ( !m_bActive || !m_bSaveResults || m_FaceRestored[facenum] != -1 )
+		return;
+
+	CUtlBuffer *pBuf = new CUtlBuffer;
+	pBuf->Put( g_pFaces[facenum].styles, sizeof( g_pFaces[facenum].styles ) );
+	SerializeFaceLight( *pBuf, facenum );
+
+	delete m_FaceResults[facenum];
+	m_FaceResults[facenum] = pBuf;
+}
+
+void CFaceLightCache::Save()
+{
+	if ( !m_bActive || !m_bSaveResults )
+		return;
+
+	FILE *fp = fopen( m_szFileName, "wb" );
+	if ( !fp )
+	{
+		Warning( "Can't write face light cache %s\n", m_szFileName );
+		return;
+	}
+
+	FaceLightCacheHeader_t header;
+	header.m_nMagic = FACELIGHTCACHE_MAGIC;
+	header.m_nVersion = FACELIGHTCACHE_VERSION;
+	header.m_nEntries = 0;
+	header.m_nFaceLightSize = sizeof( facelight_t );
+	header.m_nSampleSize = sizeof( sample_t );
+	fwrite( &header, sizeof( header ), 1, fp );
+
+	for ( int i = 0; i < numfaces; i++ )
+	{
+		const void *pData;
+		int nBytes;
+		if ( m_FaceResults[i] )
+		{
+			pData = m_FaceResults[i]->Base();
+			nBytes = m_FaceResults[i]->TellPut();
+		}
+		else if ( m_FaceRestored[i] != -1 )
+		{
+			const Entry_t &entry = m_OldEntries[m_FaceRestored[i]];
+			pData = (const byte *)m_OldData.Base() + entry.m_nOffset;
+			nBytes = entry.m_nBytes;
+		}
+		else
+		{
+			continue;
+		}
+
+		fwrite( &m_FaceKeys[i], sizeof( MD5Value_t ), 1, fp );
+		fwrite( &nBytes, sizeof( nBytes ), 1, fp );
+		fwrite( pData, nBytes, 1, fp );
+		header.m_nEntries++;
+	}
+
+	fseek( fp, 0, SEEK_SET );
+	fwrite( &header, sizeof( header ), 1, fp );
+	fclose( fp );
+}
@@ -0,0 +1,106 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Keeps the direct lighting of each face between compiles so that
+//			faces whose inputs haven't changed don't have to be relit.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef FACELIGHTCACHE_H
+#define FACELIGHTCACHE_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "utlvector.h"
+#include "utlmap.h"
+#include "utlbuffer.h"
+#include "tier1/checksum_md5.h"
+
+
+class RayTracingEnvironment;
+
+
+//-----------------------------------------------------------------------------
+// Each face's BuildFacelights results are saved under a key hashed from
+// everything they depend on: the face's geometry, texture and lightmap layout,
+// the smoothed vertex normals, every light that can reach the face, and the
+// ray trace triangles in the region between the face and each of those
+// lights. The key doesn't include the face index, so faces keep their cached
+// lighting when other edits renumber them.
+//
+// Occluders are looked up in a coarse grid of summed triangle hashes, so the
+// hash of any box of cells takes eight lookups. Sky ambient (and the sun with
+// -softsun or a 3D skybox) can see the whole map, so any geometry change
+// relights every face that light reaches.
+//-----------------------------------------------------------------------------
+class CFaceLightCache
+{
+public:
+	CFaceLightCache();
+	~CFaceLightCache();
+
+	// Call once all the geometry has been added to rtEnv and before
+	// SetupAccelerationStructure, which throws the triangle vertices away.
+	void	BuildOccluderGrid( RayTracingEnvironment &rtEnv );
+
+	// Loads the last compile's results and computes the key of every face. Call
+	// once the direct lights are set up, right before BuildFacelights.
+	void	Init( const char *pFileName );
+	void	Shutdown();
+
+	bool	IsActive() const	{ return m_bActive; }
+
+	// Called by BuildFacelights. RestoreFace fills in the face's styles and
+	// facelight_t and returns true if the face's key is in the cache. StoreFace
+	// keeps the face's results to be saved.
+	bool	RestoreFace( int facenum );
+	void	StoreFace( int facenum );
+
+	// Writes the results of this compile, which replace the old file.
+	void	Save();
+
+	int		GetNumRestored() const	{ return m_nRestored; }
+
+private:
+	struct Entry_t
+	{
+		MD5Value_t	m_Key;
+		int			m_nOffset;		// of the face's data in m_OldData
+		int			m_nBytes;
+	};
+
+	void	LoadFile();
+	uint64	GetRegionHash( const Vector &vecMins, const Vector &vecMaxs ) const;
+	void	ComputeFaceKey( int facenum, MD5Value_t &key ) const;
+
+	static void ComputeFaceKeyThread( int iThread, int facenum );
+
+	bool	m_bActive;
+	bool	m_bSaveResults;
+	char	m_szFileName[MAX_PATH];
+	MD5Value_t	m_SettingsHash;
+
+	// Summed area table of the grid cells' triangle hashes, with a row of
+	// zeros in front of each axis.
+	Vector	m_vecGridMins;
+	Vector	m_vecGridMaxs;
+	Vector	m_vecCellSize;
+	int		m_nCells[3];
+	CUtlVector<uint64>	m_GridSums;
+
+	// The last compile's results, by the first 8 bytes of the key.
+	CUtlBuffer	m_OldData;
+	CUtlVector<Entry_t>	m_OldEntries;
+	CUtlMap<uint64, int, int>	m_OldEntryMap;
+
+	CUtlVector<MD5Value_t>	m_FaceKeys;
+	CUtlVector<int>			m_FaceRestored;		// m_OldEntries index, -1 if the face was lit
+	CUtlVector<CUtlBuffer *>	m_FaceResults;
+	int32	m_nRestored;
+};
+
+extern CFaceLightCache g_FaceLightCache;
+
+
+#endif // FACELIGHTCACHE_H
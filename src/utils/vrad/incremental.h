@@ -64,7 +64,7 @@ public:
 	// This is the light for which m_LightFaces was built.
 	dworldlight_t	m_Light;
 
-	CLightFace		*m_pCachedFaces[MAX_TOOL_THREADS+1];
+	CUtlVector<CLightFace*>	m_pCachedFaces;				// GetThreadArraySize() entries
 
 	// The list of faces that this light contributes to.
 	CUtlLinkedList<CLightFace*, unsigned short>	m_LightFaces;
@@ -12,6 +12,8 @@
 #include "mathlib/bumpvects.h"
 #include "tier1/utlvector.h"
 #include "vmpi.h"
+#include "distribute_work.h"
+#include "facelightcache.h"
 #include "mathlib/anorms.h"
 #include "map_utils.h"
 #include "mathlib/halton.h"
@@ -822,6 +824,79 @@ void FreeSampleWindings( facelight_t *fl )
 	}
 }
 
+void SerializeFaceLight( CUtlBuffer &buf, int facenum )
+{
+	facelight_t *fl = &facelight[facenum];
+
+	buf.Put( fl, sizeof( facelight_t ) );
+	buf.Put( fl->sample, sizeof( sample_t ) * fl->numsamples );
+
+	for ( int i = 0; i < MAXLIGHTMAPS; ++i )
+	{
+		for ( int n = 0; n < NUM_BUMP_VECTS + 1; ++n )
+		{
+			if ( fl->light[i][n] )
+			{
+				buf.Put( fl->light[i][n], sizeof( LightingValue_t ) * fl->numsamples );
+			}
+		}
+	}
+
+	if ( fl->luxel )
+		buf.Put( fl->luxel, sizeof( Vector ) * fl->numluxels );
+
+	if ( fl->luxelNormals )
+		buf.Put( fl->luxelNormals, sizeof( Vector ) * fl->numluxels );
+}
+
+// The pointers in the facelight_t that comes out of the buffer only say which
+// arrays follow it.
+bool UnSerializeFaceLight( CUtlBuffer &buf, int facenum )
+{
+	facelight_t *fl = &facelight[facenum];
+
+	buf.Get( fl, sizeof( facelight_t ) );
+	if ( !buf.IsValid() || fl->numsamples < 0 || fl->numluxels < 0 ||
+		buf.GetBytesRemaining() < fl->numsamples * (int)sizeof( sample_t ) )
+	{
+		memset( fl, 0, sizeof( facelight_t ) );
+		return false;
+	}
+
+	fl->sample = (sample_t *)calloc( fl->numsamples, sizeof( sample_t ) );
+	buf.Get( fl->sample, sizeof( sample_t ) * fl->numsamples );
+	for ( int i = 0; i < fl->numsamples; ++i )
+	{
+		fl->sample[i].w = NULL;
+	}
+
+	for ( int i = 0; i < MAXLIGHTMAPS; ++i )
+	{
+		for ( int n = 0; n < NUM_BUMP_VECTS + 1; ++n )
+		{
+			if ( fl->light[i][n] )
+			{
+				fl->light[i][n] = (LightingValue_t *)calloc( fl->numsamples, sizeof( LightingValue_t ) );
+				buf.Get( fl->light[i][n], sizeof( LightingValue_t ) * fl->numsamples );
+			}
+		}
+	}
+
+	if ( fl->luxel )
+	{
+		fl->luxel = (Vector *)calloc( fl->numluxels, sizeof( Vector ) );
+		buf.Get( fl->luxel, sizeof( Vector ) * fl->numluxels );
+	}
+
+	if ( fl->luxelNormals )
+	{
+		fl->luxelNormals = (Vector *)calloc( fl->numluxels, sizeof( Vector ) );
+		buf.Get( fl->luxelNormals, sizeof( Vector ) * fl->numluxels );
+	}
+
+	return buf.IsValid();
+}
+
 
 
 //-----------------------------------------------------------------------------
@@ -1699,7 +1774,9 @@ void GatherSampleSkyLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, i
 	}
 
 	fltx4 totalFractionVisible = Four_Zeros;
-	fltx4 fractionVisible = Four_Zeros;
+	fltx4 fractionVisible[NSAMPLES_SUN_AREA_LIGHT];
+	FourVectors starts[NSAMPLES_SUN_AREA_LIGHT];
+	FourVectors stops[NSAMPLES_SUN_AREA_LIGHT];
 
 	DirectionalSampler_t sampler;
 
@@ -1716,13 +1793,17 @@ void GatherSampleSkyLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, i
 			ofs *= MAX_TRACE_LENGTH * g_SunAngularExtent;
 			delta += ofs;
 		}
-		FourVectors delta4;
-		delta4.DuplicateVector ( delta );
-		delta4 += pos;
+		starts[d] = pos;
+		stops[d].DuplicateVector ( delta );
+		stops[d] += pos;
+	}
 
-		TestLine_DoesHitSky ( pos, delta4, &fractionVisible, true, static_prop_index_to_ignore );
+	// trace all the samples together so they can be packed into wide ray packets
+	TestLines_DoesHitSky ( starts, stops, nsamples, fractionVisible, true, static_prop_index_to_ignore );
 
-		totalFractionVisible = AddSIMD ( totalFractionVisible, fractionVisible );
+	for ( int d = 0; d < nsamples; d++ )
+	{
+		totalFractionVisible = AddSIMD ( totalFractionVisible, fractionVisible[d] );
 	}
 
 	fltx4 seeAmount = MulSIMD ( totalFractionVisible, ReplicateX4 ( 1.0f / nsamples ) );
@@ -1741,6 +1822,31 @@ void GatherSampleSkyLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, i
 	}
 }
 
+#define AMBIENT_SKY_BATCH_SIZE	32
+
+// Traces a batch of ambient sky samples and adds their visible contribution
+static void AccumulateAmbientSkyBatch( FourVectors const *pStarts, FourVectors const *pStops,
+									  fltx4 (*pDots)[NUM_BUMP_VECTS+1], int nSamples, int normalCount,
+									  fltx4 *ambient_intensity, int static_prop_index_to_ignore )
+{
+	fltx4 fractionVisible[AMBIENT_SKY_BATCH_SIZE];
+	for ( int s = 0; s < nSamples; s++ )
+	{
+		fractionVisible[s] = Four_Ones;
+	}
+
+	TestLines_DoesHitSky( pStarts, pStops, nSamples, fractionVisible, true, static_prop_index_to_ignore );
+
+	for ( int s = 0; s < nSamples; s++ )
+	{
+		for ( int i = 0; i < normalCount; i++ )
+		{
+			fltx4 addedAmount = MulSIMD( fractionVisible[s], pDots[s][i] );
+			ambient_intensity[i] = AddSIMD( ambient_intensity[i], addedAmount );
+		}
+	}
+}
+
 // Helper function - gathers light from ambient sky light
 void GatherSampleAmbientSkySSE( SSE_sampleLightOutput_t &out, directlight_t *dl, int facenum, 
 							   FourVectors const& pos, FourVectors *pNormals, int normalCount, int iThread,
@@ -1769,6 +1875,12 @@ void GatherSampleAmbientSkySSE( SSE_sampleLightOutput_t &out, directlight_t *dl,
 	else
 		nsky_samples *= g_flSkySampleScale;
 
+	// visible samples are traced in batches so TestLines_DoesHitSky can pair them up by direction
+	FourVectors batchStarts[AMBIENT_SKY_BATCH_SIZE];
+	FourVectors batchStops[AMBIENT_SKY_BATCH_SIZE];
+	fltx4 batchDots[AMBIENT_SKY_BATCH_SIZE][NUM_BUMP_VECTS+1];
+	int nBatch = 0;
+
 	for (int j = 0; j < nsky_samples; j++)
 	{
 		FourVectors anorm;
@@ -1801,22 +1913,31 @@ void GatherSampleAmbientSkySSE( SSE_sampleLightOutput_t &out, directlight_t *dl,
 		}
 
 		// search back to see if we can hit a sky brush
-		FourVectors delta = anorm;
+		FourVectors &delta = batchStops[nBatch];
+		delta = anorm;
 		delta *= -MAX_TRACE_LENGTH;
 		delta += pos;
-		FourVectors surfacePos = pos;
+		FourVectors &surfacePos = batchStarts[nBatch];
+		surfacePos = pos;
 		FourVectors offset = anorm;
 		offset *= -flEpsilon;
 		surfacePos -= offset;
 
-		fltx4 fractionVisible = Four_Ones;
-		TestLine_DoesHitSky( surfacePos, delta, &fractionVisible, true, static_prop_index_to_ignore );
 		for ( int i = 0; i < normalCount; i++ )
 		{
-			fltx4 addedAmount = MulSIMD( fractionVisible, dots[i] );
-			ambient_intensity[i] = AddSIMD( ambient_intensity[i], addedAmount );
+			batchDots[nBatch][i] = dots[i];
+		}
+
+		if ( ++nBatch == AMBIENT_SKY_BATCH_SIZE )
+		{
+			AccumulateAmbientSkyBatch( batchStarts, batchStops, batchDots, nBatch, normalCount, ambient_intensity, static_prop_index_to_ignore );
+			nBatch = 0;
 		}
+	}
 
+	if ( nBatch )
+	{
+		AccumulateAmbientSkyBatch( batchStarts, batchStops, batchDots, nBatch, normalCount, ambient_intensity, static_prop_index_to_ignore );
 	}
 
 	out.m_flFalloff = Four_Ones;
@@ -3102,6 +3223,16 @@ void BuildFacelights (int iThread, int facenum)
 
 	fl = &facelight[facenum];
 
+	// Reuse the last compile's results if nothing that lights this face has changed
+	if ( g_FaceLightCache.RestoreFace( facenum ) )
+	{
+		if ( !g_bUseMPI && !DW_IsActive() )
+		{
+			BuildPatchLights( facenum );
+		}
+		return;
+	}
+
 	InitLightinfo( &l, facenum );
 	CalcPoints( &l, fl, facenum );
 	InitSampleInfo( l, iThread, sampleInfo );
@@ -3174,7 +3305,7 @@ void BuildFacelights (int iThread, int facenum)
 		}
 	}
 
-	if (!g_bUseMPI) 
+	if ( !g_bUseMPI && !DW_IsActive() )
 	{
 		//
 		// This is done on the master node when MPI is used
@@ -3191,6 +3322,7 @@ void BuildFacelights (int iThread, int facenum)
 		FreeSampleWindings( fl );
 	}
 
+	g_FaceLightCache.StoreFace( facenum );
 }
 
 void BuildPatchLights( int facenum )
@@ -137,5 +137,12 @@ void FreeDLights();
 
 void ExportDirectLightsToWorldLights();
 
+// Copies a face's facelight_t and the arrays it points to into and out of a
+// buffer. The sample windings aren't copied. UnSerializeFaceLight returns
+// false if the buffer runs out.
+class CUtlBuffer;
+void SerializeFaceLight( CUtlBuffer &buf, int facenum );
+bool UnSerializeFaceLight( CUtlBuffer &buf, int facenum );
+
 
 #endif // LIGHTMAP_H
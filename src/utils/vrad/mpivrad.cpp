@@ -22,6 +22,7 @@
 #include "bsplib.h"
 #include "consolewnd.h"
 #include "vismat.h"
+#include "transferstore.h"
 #include "vmpi_filesystem.h"
 #include "vmpi_dispatch.h"
 #include "utllinkedlist.h"
@@ -295,8 +296,10 @@ void MPI_ReceiveVisLeafsResults( uint64 iWorkUnit, MessageBuffer *pBuf, int iWor
 		patch->numtransfers = numtransfers;
 		if (numtransfers) 
 		{
-			patch->transfers = new transfer_t[numtransfers];
-			pBuf->read(patch->transfers, numtransfers * sizeof(transfer_t));
+			CUtlVector<transfer_t> transfers;
+			transfers.SetCount( numtransfers );
+			pBuf->read( transfers.Base(), numtransfers * sizeof(transfer_t) );
+			g_TransferStore.AddRow( patchnum, transfers.Base(), numtransfers );
 		}
 		
 		total_transfer += numtransfers;
@@ -316,7 +319,7 @@ public:
 	transfer_t *m_pBuildVisLeafsTransfers;
 };
 
-CVMPIVisLeafsData g_VMPIVisLeafsData[MAX_TOOL_THREADS+1];
+CUtlVector<CVMPIVisLeafsData> g_VMPIVisLeafsData;
 
 
 
@@ -331,7 +334,8 @@ void MPI_AddPatchData( int iThread, int patchnum, CPatch *patch )
 		++pData->m_nPatchesInCluster;
 		pData->m_pVisLeafsMB->write(&patchnum, sizeof(patchnum));
 		pData->m_pVisLeafsMB->write(&patch->numtransfers, sizeof(patch->numtransfers));
-		pData->m_pVisLeafsMB->write( patch->transfers, patch->numtransfers * sizeof(transfer_t) );
+		// MakeScales has just normalized this patch's transfers in the thread's build buffer
+		pData->m_pVisLeafsMB->write( pData->m_pBuildVisLeafsTransfers, patch->numtransfers * sizeof(transfer_t) );
 	}
 }
 
@@ -379,7 +383,8 @@ void RunMPIBuildVisLeafs()
 		StartPacifier("");
 	}
 
-	memset( g_VMPIVisLeafsData, 0, sizeof( g_VMPIVisLeafsData ) );
+	g_VMPIVisLeafsData.SetCount( GetThreadArraySize() );
+	memset( g_VMPIVisLeafsData.Base(), 0, g_VMPIVisLeafsData.Count() * sizeof( CVMPIVisLeafsData ) );
 	if ( !g_bMPIMaster || VMPI_GetActiveWorkUnitDistributor() == k_eWorkUnitDistributor_SDK )
 	{
 		// Allocate space for the transfers for each thread.
@@ -31,14 +31,15 @@ bool SampleData_CompareFunc( SampleData_t const &src1, SampleData_t const &src2
 //-----------------------------------------------------------------------------
 unsigned int SampleData_KeyFunc( SampleData_t const &src )
 {
-	return ( src.x + src.y + src.z );
+	// x + y + z put whole planes of voxels in the same bucket
+	return ( (unsigned int)src.x * 73856093u ) ^ ( (unsigned int)src.y * 19349663u ) ^ ( (unsigned int)src.z * 83492791u );
 }
 
 
-CUtlHash<SampleData_t> g_SampleHashTable( SAMPLEHASH_NUM_BUCKETS, 
-										  SAMPLEHASH_GROW_SIZE, 
-										  SAMPLEHASH_INIT_SIZE, 
-										  SampleData_CompareFunc, SampleData_KeyFunc );
+CUtlFlatHash<SampleData_t> g_SampleHashTable( SAMPLEHASH_NUM_BUCKETS, 
+											  SAMPLEHASH_GROW_SIZE, 
+											  SAMPLEHASH_INIT_SIZE, 
+											  SampleData_CompareFunc, SampleData_KeyFunc );
 
 
 
@@ -135,14 +136,14 @@ bool PatchSampleData_CompareFunc( PatchSampleData_t const &src1, PatchSampleData
 //-----------------------------------------------------------------------------
 unsigned int PatchSampleData_KeyFunc( PatchSampleData_t const &src )
 {
-	return ( src.x + src.y + src.z );
+	return ( (unsigned int)src.x * 73856093u ) ^ ( (unsigned int)src.y * 19349663u ) ^ ( (unsigned int)src.z * 83492791u );
 }
 
 
-CUtlHash<PatchSampleData_t>	g_PatchSampleHashTable( SAMPLEHASH_NUM_BUCKETS,
-												    SAMPLEHASH_GROW_SIZE,
-													SAMPLEHASH_INIT_SIZE,
-													PatchSampleData_CompareFunc, PatchSampleData_KeyFunc );
+CUtlFlatHash<PatchSampleData_t>	g_PatchSampleHashTable( SAMPLEHASH_NUM_BUCKETS,
+														SAMPLEHASH_GROW_SIZE,
+														SAMPLEHASH_INIT_SIZE,
+														PatchSampleData_CompareFunc, PatchSampleData_KeyFunc );
 
 void GetPatchSampleHashXYZ( const Vector &vOrigin, int &x, int &y, int &z )
 {
@@ -81,7 +81,7 @@ float TraceLeafBrushes( int leafIndex, const Vector &start, const Vector &end, C
 	return 1.0f;
 }
 
-DispTested_t s_DispTested[MAX_TOOL_THREADS+1];
+CUtlVector<DispTested_t> s_DispTested;
 
 // this just uses the average coverage for the triangle
 class CCoverageCount : public ITransparentTriangleCallback
@@ -349,25 +349,12 @@ void DM_ClipBoxToBrush( CToolTrace *trace, const Vector& mins, const Vector& max
 	}
 }
 
-void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
+// Turns the result of tracing start->stop into sky visibility, recursing into the 3D skybox
+// for rays that hit sky.
+static void ComputeSkyVisibility( FourVectors const& start, FourVectors const& stop, fltx4 const& len,
+	RayTracingResult const& rt_result, CCoverageCountTexture &coverageCallback,
 	fltx4 *pFractionVisible, bool canRecurse, int static_prop_to_skip, bool bDoDebug )
 {
-	FourRays myrays;
-	myrays.origin = start;
-	myrays.direction = stop;
-	myrays.direction -= myrays.origin;
-	fltx4 len = myrays.direction.length();
-	myrays.direction *= ReciprocalSIMD( len );
-	RayTracingResult rt_result;
-	CCoverageCountTexture coverageCallback;
-
-	g_RtEnv.Trace4Rays(myrays, Four_Zeros, len, &rt_result, TRACE_ID_STATICPROP | static_prop_to_skip, g_bTextureShadows? &coverageCallback : 0);
-
-	if ( bDoDebug )
-	{
-		WriteTrace( "trace.txt", myrays, rt_result );
-	}
-
 	float aOcclusion[4];
 	for ( int i = 0; i < 4; i++ )
 	{
@@ -428,6 +415,104 @@ void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
 	*pFractionVisible = SubSIMD( Four_Ones, occlusion );
 }
 
+void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
+	fltx4 *pFractionVisible, bool canRecurse, int static_prop_to_skip, bool bDoDebug )
+{
+	FourRays myrays;
+	myrays.origin = start;
+	myrays.direction = stop;
+	myrays.direction -= myrays.origin;
+	fltx4 len = myrays.direction.length();
+	myrays.direction *= ReciprocalSIMD( len );
+	RayTracingResult rt_result;
+	CCoverageCountTexture coverageCallback;
+
+	g_RtEnv.Trace4Rays(myrays, Four_Zeros, len, &rt_result, TRACE_ID_STATICPROP | static_prop_to_skip, g_bTextureShadows? &coverageCallback : 0);
+
+	if ( bDoDebug )
+	{
+		WriteTrace( "trace.txt", myrays, rt_result );
+	}
+
+	ComputeSkyVisibility( start, stop, len, rt_result, coverageCallback, pFractionVisible, canRecurse, static_prop_to_skip, bDoDebug );
+}
+
+
+#define SKY_TEST_BATCH_SIZE		32
+
+void TestLines_DoesHitSky( FourVectors const *pStarts, FourVectors const *pStops, int nLines,
+	fltx4 *pFractionVisible, bool canRecurse, int static_prop_to_skip )
+{
+	if ( RayTracingEnvironment::GetRayPacketWidth() < 8 )
+	{
+		for ( int i = 0; i < nLines; i++ )
+		{
+			TestLine_DoesHitSky( pStarts[i], pStops[i], &pFractionVisible[i], canRecurse, static_prop_to_skip );
+		}
+		return;
+	}
+
+	FourRays rays[SKY_TEST_BATCH_SIZE];
+	fltx4 len[SKY_TEST_BATCH_SIZE];
+	int nSignMask[SKY_TEST_BATCH_SIZE];
+	int order[SKY_TEST_BATCH_SIZE];
+
+	for ( int iBase = 0; iBase < nLines; iBase += SKY_TEST_BATCH_SIZE )
+	{
+		int nBatch = MIN( SKY_TEST_BATCH_SIZE, nLines - iBase );
+		for ( int i = 0; i < nBatch; i++ )
+		{
+			rays[i].origin = pStarts[iBase + i];
+			rays[i].direction = pStops[iBase + i];
+			rays[i].direction -= rays[i].origin;
+			len[i] = rays[i].direction.length();
+			rays[i].direction *= ReciprocalSIMD( len[i] );
+
+			// packets whose rays don't share an octant sort last and get split up by Trace4Rays
+			nSignMask[i] = rays[i].CalculateDirectionSignMask();
+			if ( nSignMask[i] < 0 )
+				nSignMask[i] = 8;
+
+			// insertion sort by octant so neighbouring packets can be traced 8 wide
+			int j = i;
+			while ( j > 0 && nSignMask[order[j-1]] > nSignMask[i] )
+			{
+				order[j] = order[j-1];
+				--j;
+			}
+			order[j] = i;
+		}
+
+		for ( int k = 0; k < nBatch; k += 2 )
+		{
+			int i0 = order[k];
+			if ( k + 1 == nBatch )
+			{
+				TestLine_DoesHitSky( pStarts[iBase + i0], pStops[iBase + i0], &pFractionVisible[iBase + i0], canRecurse, static_prop_to_skip );
+				break;
+			}
+
+			int i1 = order[k+1];
+			EightRays myrays;
+			myrays.m_Rays[0] = rays[i0];
+			myrays.m_Rays[1] = rays[i1];
+			fltx4 tmin[2] = { Four_Zeros, Four_Zeros };
+			fltx4 tmax[2] = { len[i0], len[i1] };
+
+			CCoverageCountTexture coverageCallback[2];
+			ITransparentTriangleCallback *pCallbacks[2] = { &coverageCallback[0], &coverageCallback[1] };
+
+			RayTracingResult8 rt_result;
+			g_RtEnv.Trace8Rays( myrays, tmin, tmax, &rt_result, TRACE_ID_STATICPROP | static_prop_to_skip, g_bTextureShadows ? pCallbacks : NULL );
+
+			ComputeSkyVisibility( pStarts[iBase + i0], pStops[iBase + i0], len[i0], rt_result.m_Results[0], coverageCallback[0],
+				&pFractionVisible[iBase + i0], canRecurse, static_prop_to_skip, false );
+			ComputeSkyVisibility( pStarts[iBase + i1], pStops[iBase + i1], len[i1], rt_result.m_Results[1], coverageCallback[1],
+				&pFractionVisible[iBase + i1], canRecurse, static_prop_to_skip, false );
+		}
+	}
+}
+
 
 
 //-----------------------------------------------------------------------------
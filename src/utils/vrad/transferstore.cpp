@@ -0,0 +1,270 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Compressed, optionally disk backed storage for the patch to patch
+//			transfer lists built by BuildVisMatrix.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "vrad.h"
+#include "transferstore.h"
+
+
+#define TRANSFER_BLOCK_SIZE		( 16 * 1024 * 1024 )
+
+// row header is a varint count and the float scale, each transfer is a varint
+// patch delta (patch indices fit in 3 bytes) and a 16 bit quantized transfer
+#define MAX_ROW_HEADER_BYTES	( 5 + sizeof( float ) )
+#define MAX_TRANSFER_BYTES		( 3 + sizeof( uint16 ) )
+
+ASSERT_INVARIANT( MAX_ROW_HEADER_BYTES + MAX_PATCHES * MAX_TRANSFER_BYTES <= TRANSFER_BLOCK_SIZE );
+
+
+CTransferStore g_TransferStore;
+
+
+//-----------------------------------------------------------------------------
+// Row encoding
+//-----------------------------------------------------------------------------
+static FORCEINLINE byte *WriteVarInt( byte *pOut, unsigned int nValue )
+{
+	while ( nValue >= 0x80 )
+	{
+		*pOut++ = (byte)( nValue | 0x80 );
+		nValue >>= 7;
+	}
+	*pOut++ = (byte)nValue;
+	return pOut;
+}
+
+static FORCEINLINE const byte *ReadVarInt( const byte *pIn, unsigned int &nValue )
+{
+	nValue = 0;
+	int nShift = 0;
+	byte b;
+	do
+	{
+		b = *pIn++;
+		nValue |= (unsigned int)( b & 0x7f ) << nShift;
+		nShift += 7;
+	} while ( b & 0x80 );
+	return pIn;
+}
+
+static int __cdecl TransferPatchCompare( const void *a, const void *b )
+{
+	return ( (const transfer_t *)a )->patch - ( (const transfer_t *)b )->patch;
+}
+
+// Returns the number of bytes written to pOut, which needs room for
+// MAX_ROW_HEADER_BYTES + nTransfers * MAX_TRANSFER_BYTES.
+static int EncodeRow( transfer_t *pTransfers, int nTransfers, byte *pOut )
+{
+	qsort( pTransfers, nTransfers, sizeof( transfer_t ), TransferPatchCompare );
+
+	float flScale = 0.0f;
+	for ( int i = 0; i < nTransfers; i++ )
+	{
+		flScale = MAX( flScale, pTransfers[i].transfer );
+	}
+
+	byte *pCur = WriteVarInt( pOut, nTransfers );
+	memcpy( pCur, &flScale, sizeof( flScale ) );
+	pCur += sizeof( flScale );
+
+	float flQuantize = ( flScale > 0.0f ) ? 65535.0f / flScale : 0.0f;
+	int nPrevPatch = 0;
+	for ( int i = 0; i < nTransfers; i++ )
+	{
+		pCur = WriteVarInt( pCur, pTransfers[i].patch - nPrevPatch );
+		nPrevPatch = pTransfers[i].patch;
+
+		uint16 nQuantized = (uint16)MIN( pTransfers[i].transfer * flQuantize + 0.5f, 65535.0f );
+		pCur[0] = (byte)nQuantized;
+		pCur[1] = (byte)( nQuantized >> 8 );
+		pCur += 2;
+	}
+	return pCur - pOut;
+}
+
+static int DecodeRow( const byte *pIn, transfer_t *pOut )
+{
+	unsigned int nTransfers;
+	pIn = ReadVarInt( pIn, nTransfers );
+	float flScale;
+	memcpy( &flScale, pIn, sizeof( flScale ) );
+	pIn += sizeof( flScale );
+
+	float flDequantize = flScale * ( 1.0f / 65535.0f );
+	int nPatch = 0;
+	for ( unsigned int i = 0; i < nTransfers; i++ )
+	{
+		unsigned int nDelta;
+		pIn = ReadVarInt( pIn, nDelta );
+		nPatch += nDelta;
+		pOut[i].patch = nPatch;
+		pOut[i].transfer = ( pIn[0] | ( pIn[1] << 8 ) ) * flDequantize;
+		pIn += 2;
+	}
+	return nTransfers;
+}
+
+
+//-----------------------------------------------------------------------------
+// CTransferStore
+//-----------------------------------------------------------------------------
+CTransferStore::CTransferStore()
+{
+	m_nBlockUsed = TRANSFER_BLOCK_SIZE;
+	m_nMemoryBytes = 0;
+	m_nMemoryBudget = 0;
+	m_szSpillFileName[0] = 0;
+	m_hSpillFile = INVALID_HANDLE_VALUE;
+	m_hSpillMapping = NULL;
+	m_pSpillView = NULL;
+	m_nSpillBytes = 0;
+}
+
+CTransferStore::~CTransferStore()
+{
+	Shutdown();
+}
+
+void CTransferStore::Init( int nPatches, int nMemoryBudgetMB, const char *pSpillFileName )
+{
+	Shutdown();
+
+	Row_t emptyRow;
+	emptyRow.m_nOffset = 0;
+	emptyRow.m_nBytes = 0;
+	emptyRow.m_bSpilled = false;
+	m_Rows.SetCount( nPatches );
+	for ( int i = 0; i < nPatches; i++ )
+	{
+		m_Rows[i] = emptyRow;
+	}
+
+	m_nMemoryBudget = ( nMemoryBudgetMB > 0 ) ? (int64)nMemoryBudgetMB * 1024 * 1024 : 0;
+	Q_strncpy( m_szSpillFileName, pSpillFileName, sizeof( m_szSpillFileName ) );
+}
+
+void CTransferStore::Shutdown()
+{
+	if ( m_pSpillView )
+	{
+		UnmapViewOfFile( m_pSpillView );
+		m_pSpillView = NULL;
+	}
+	if ( m_hSpillMapping )
+	{
+		CloseHandle( m_hSpillMapping );
+		m_hSpillMapping = NULL;
+	}
+	if ( m_hSpillFile != INVALID_HANDLE_VALUE )
+	{
+		CloseHandle( m_hSpillFile );
+		m_hSpillFile = INVALID_HANDLE_VALUE;
+	}
+	m_nSpillBytes = 0;
+
+	for ( int i = 0; i < m_Blocks.Count(); i++ )
+	{
+		free( m_Blocks[i] );
+	}
+	m_Blocks.Purge();
+	m_nBlockUsed = TRANSFER_BLOCK_SIZE;
+	m_nMemoryBytes = 0;
+
+	m_Rows.Purge();
+}
+
+void CTransferStore::AddRow( int ndxPatch, transfer_t *pTransfers, int nTransfers )
+{
+	if ( !nTransfers )
+		return;
+
+	CUtlVector<byte> encoded;
+	encoded.SetCount( MAX_ROW_HEADER_BYTES + nTransfers * MAX_TRANSFER_BYTES );
+	int nBytes = EncodeRow( pTransfers, nTransfers, encoded.Base() );
+
+	AUTO_LOCK_FM( m_Mutex );
+
+	Row_t &row = m_Rows[ndxPatch];
+	Assert( !row.m_nBytes );
+	row.m_nBytes = nBytes;
+
+	if ( !m_nMemoryBudget || m_nMemoryBytes + nBytes <= m_nMemoryBudget )
+	{
+		if ( m_nBlockUsed + nBytes > TRANSFER_BLOCK_SIZE )
+		{
+			byte *pBlock = (byte *)malloc( TRANSFER_BLOCK_SIZE );
+			if ( !pBlock )
+				Error( "Memory allocation failure" );
+			m_Blocks.AddToTail( pBlock );
+			m_nBlockUsed = 0;
+		}
+		row.m_nOffset = (int64)( m_Blocks.Count() - 1 ) * TRANSFER_BLOCK_SIZE + m_nBlockUsed;
+		row.m_bSpilled = false;
+		memcpy( m_Blocks.Tail() + m_nBlockUsed, encoded.Base(), nBytes );
+		m_nBlockUsed += nBytes;
+		m_nMemoryBytes += nBytes;
+		return;
+	}
+
+	// over budget, append it to the spill file
+	if ( m_hSpillFile == INVALID_HANDLE_VALUE )
+	{
+		m_hSpillFile = CreateFile( m_szSpillFileName, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+			FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE | FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+		if ( m_hSpillFile == INVALID_HANDLE_VALUE )
+			Error( "Can't create transfer spill file %s\n", m_szSpillFileName );
+	}
+
+	DWORD nWritten = 0;
+	if ( !WriteFile( m_hSpillFile, encoded.Base(), nBytes, &nWritten, NULL ) || (int)nWritten != nBytes )
+		Error( "Error writing transfer spill file %s (disk full?)\n", m_szSpillFileName );
+
+	row.m_nOffset = m_nSpillBytes;
+	row.m_bSpilled = true;
+	m_nSpillBytes += nBytes;
+}
+
+void CTransferStore::FinishBuild()
+{
+	if ( m_nSpillBytes )
+	{
+		MapSpillFile();
+	}
+}
+
+void CTransferStore::MapSpillFile()
+{
+	m_hSpillMapping = CreateFileMapping( m_hSpillFile, NULL, PAGE_READONLY, 0, 0, NULL );
+	if ( m_hSpillMapping )
+	{
+		m_pSpillView = (const byte *)MapViewOfFile( m_hSpillMapping, FILE_MAP_READ, 0, 0, 0 );
+	}
+	if ( !m_pSpillView )
+	{
+		// a 32 bit process can't map more than a gig or so
+		Error( "Can't map %.1f MB transfer spill file %s. Use the 64 bit vrad or raise -transfermem.\n",
+			(float)m_nSpillBytes / ( 1024 * 1024 ), m_szSpillFileName );
+	}
+}
+
+const byte *CTransferStore::GetRowData( const Row_t &row ) const
+{
+	if ( row.m_bSpilled )
+		return m_pSpillView + row.m_nOffset;
+
+	return m_Blocks[row.m_nOffset / TRANSFER_BLOCK_SIZE] + ( row.m_nOffset % TRANSFER_BLOCK_SIZE );
+}
+
+int CTransferStore::GetRow( int ndxPatch, transfer_t *pOut ) const
+{
+	const Row_t &row = m_Rows[ndxPatch];
+	if ( !row.m_nBytes )
+		return 0;
+
+	return DecodeRow( GetRowData( row ), pOut );
+}
@@ -0,0 +1,85 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Compressed, optionally disk backed storage for the patch to patch
+//			transfer lists built by BuildVisMatrix.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef TRANSFERSTORE_H
+#define TRANSFERSTORE_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "utlvector.h"
+#include "tier0/threadtools.h"
+#include "vrad.h"
+
+
+//-----------------------------------------------------------------------------
+// Each patch's transfer list is stored as a row sorted by patch index. The
+// patch indices are delta coded and the transfers are quantized to 16 bits
+// relative to the largest transfer in the row, which takes about 3 bytes a
+// transfer instead of 8. Once the rows kept in memory reach the memory budget
+// the rest are appended to a spill file, which is mapped back in for the
+// bounces so that the OS only keeps the pages GatherLight is using resident.
+//-----------------------------------------------------------------------------
+class CTransferStore
+{
+public:
+	CTransferStore();
+	~CTransferStore();
+
+	// nMemoryBudgetMB <= 0 keeps every row in memory.
+	void	Init( int nPatches, int nMemoryBudgetMB, const char *pSpillFileName );
+	void	Shutdown();
+
+	// Compresses and stores the transfers for a patch. Sorts pTransfers in place.
+	// Can be called from multiple threads.
+	void	AddRow( int ndxPatch, transfer_t *pTransfers, int nTransfers );
+
+	// Call after the last AddRow and before the first GetRow.
+	void	FinishBuild();
+
+	// Decompresses the row of a patch into pOut, which must have room for the
+	// patch's numtransfers entries. Returns the number of transfers written.
+	// Can be called from multiple threads.
+	int		GetRow( int ndxPatch, transfer_t *pOut ) const;
+
+	int64	GetMemoryBytes() const	{ return m_nMemoryBytes; }
+	int64	GetSpillBytes() const	{ return m_nSpillBytes; }
+
+private:
+	struct Row_t
+	{
+		int64	m_nOffset;		// into the spill file or the in memory blocks
+		int		m_nBytes;		// 0 if the patch has no row
+		bool	m_bSpilled;
+	};
+
+	const byte *GetRowData( const Row_t &row ) const;
+	void	MapSpillFile();
+
+	CUtlVector<Row_t>	m_Rows;
+
+	// Rows kept in memory are packed into fixed size blocks; a row never
+	// straddles two blocks.
+	CUtlVector<byte *>	m_Blocks;
+	int		m_nBlockUsed;
+	int64	m_nMemoryBytes;
+	int64	m_nMemoryBudget;
+
+	char	m_szSpillFileName[MAX_PATH];
+	HANDLE	m_hSpillFile;			// deleted when closed
+	HANDLE	m_hSpillMapping;
+	const byte *m_pSpillView;
+	int64	m_nSpillBytes;
+
+	CThreadFastMutex	m_Mutex;
+};
+
+extern CTransferStore g_TransferStore;
+
+
+#endif // TRANSFERSTORE_H
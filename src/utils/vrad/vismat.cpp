@@ -8,6 +8,8 @@
 
 #include "vrad.h"
 #include "vmpi.h"
+#include "distribute_work.h"
+#include "distvrad.h"
 #ifdef MPI
 #include "messbuf.h"
 static MessageBuffer mb;
@@ -471,6 +473,10 @@ void BuildVisMatrix (void)
 	{
 		RunMPIBuildVisLeafs();
 	}
+	else if ( DW_IsActive() )
+	{
+		DW_RunBuildVisLeafs();
+	}
 	else 
 	{
 		RunThreadsOn (dvis->numclusters, true, BuildVisLeafs);
@@ -19,6 +19,10 @@
 #include "tools_minidump.h"
 #include "loadcmdline.h"
 #include "byteswap.h"
+#include "transferstore.h"
+#include "distribute_work.h"
+#include "distvrad.h"
+#include "facelightcache.h"
 
 #define ALLOWDEBUGOPTIONS (0 || _DEBUG)
 
@@ -57,6 +61,9 @@ float		g_MaxDispPatchRadius = 1500.0f;			// Maximum radius allowed for displacem
 qboolean	g_bDumpPatches;
 bool	    bDumpNormals = false;
 bool		g_bDumpRtEnv = false;
+bool		g_bRtCache = false;
+bool		g_bLightCache = false;
+int			g_nTransferMemoryMB = 0;	// budget for compressed transfers before they go to disk, 0 for no limit
 bool		bRed2Black = true;
 bool		g_bFastAmbient = false;
 bool        g_bNoSkyRecurse = false;
@@ -1202,7 +1209,7 @@ void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 {
 	int		j;
 	float	total;
-	transfer_t	*t, *t2;
+	transfer_t	*t;
 	total = 0;
 
 	if( ndxPatch == g_Patches.InvalidIndex() )
@@ -1212,23 +1219,13 @@ void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 	// copy the transfers out
 	if (patch->numtransfers)
 	{
-		if (patch->numtransfers > max_transfer)
-		{
-			max_transfer = patch->numtransfers;
-		}
-
-
-		patch->transfers = ( transfer_t* )calloc (1, patch->numtransfers * sizeof(transfer_t));
-		if (!patch->transfers)
-			Error ("Memory allocation failure");
-
 		// get total transfer energy
-		t2 = all_transfers;
+		t = all_transfers;
 
 		// overflow check!
-		for (j=0 ; j<patch->numtransfers ; j++, t2++)
+		for (j=0 ; j<patch->numtransfers ; j++, t++)
 		{
-			total += t2->transfer;
+			total += t->transfer;
 		}
 
 		// the total transfer should be PI, but we need to correct errors due to overlaping surfaces
@@ -1237,16 +1234,17 @@ void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 		else	
 			total = 1.0f/M_PI;
 
-		t = patch->transfers;
-		t2 = all_transfers;
-		for (j=0 ; j<patch->numtransfers ; j++, t++, t2++)
+		t = all_transfers;
+		for (j=0 ; j<patch->numtransfers ; j++, t++)
 		{
-			t->transfer = t2->transfer*total;
-			t->patch = t2->patch;
+			t->transfer *= total;
 		}
-		if (patch->numtransfers > max_transfer)
+
+		// distributed workers send the row to the coordinator instead (see
+		// DW_AddPatchData), and exit before the bounces that would read it
+		if ( !DW_IsWorker() )
 		{
-			max_transfer = patch->numtransfers;
+			g_TransferStore.AddRow( ndxPatch, all_transfers, patch->numtransfers );
 		}
 	}
 	else
@@ -1257,6 +1255,10 @@ void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 
 	ThreadLock ();
 	total_transfer += patch->numtransfers;
+	if (patch->numtransfers > max_transfer)
+	{
+		max_transfer = patch->numtransfers;
+	}
 	ThreadUnlock ();
 }
 
@@ -1539,6 +1541,10 @@ void GatherLight (int threadnum, void *pUserData)
 	CPatch		*patch;
 	Vector		sum, v;
 
+	// rows are decompressed from g_TransferStore into here
+	CUtlVector<transfer_t> rowTransfers;
+	rowTransfers.SetCount( max_transfer );
+
 	while (1)
 	{
 		j = GetThreadWork ();
@@ -1547,8 +1553,8 @@ void GatherLight (int threadnum, void *pUserData)
 
 		patch = &g_Patches[j];
 
-		trans = patch->transfers;
-		num = patch->numtransfers;
+		num = g_TransferStore.GetRow( j, rowTransfers.Base() );
+		trans = rowTransfers.Base();
 		if ( patch->needsBumpmap )
 		{
 			Vector delta;
@@ -1923,16 +1929,25 @@ void BuildFacesVisibleToLights( bool bAllVisible )
 
 void MakeAllScales (void)
 {
+	char spillFile[_MAX_PATH];
+	Q_snprintf( spillFile, sizeof( spillFile ), "%s.transfers", source );
+	// stays empty on distributed workers, MakeScales doesn't store their rows
+	g_TransferStore.Init( g_Patches.Count(), g_nTransferMemoryMB, spillFile );
+
 	// determine visibility between patches
 	BuildVisMatrix ();
 	
 	// release visibility matrix
 	FreeVisMatrix ();
 
+	g_TransferStore.FinishBuild();
+
 	Msg("transfers %d, max %d\n", total_transfer, max_transfer );
 
-	qprintf ("transfer lists: %5.1f megs\n"
-		, (float)total_transfer * sizeof(transfer_t) / (1024*1024));
+	qprintf ("transfer lists: %5.1f megs uncompressed, %5.1f megs in memory, %5.1f megs on disk\n"
+		, (float)total_transfer * sizeof(transfer_t) / (1024*1024)
+		, (float)g_TransferStore.GetMemoryBytes() / (1024*1024)
+		, (float)g_TransferStore.GetSpillBytes() / (1024*1024));
 }
 
 
@@ -2018,12 +2033,24 @@ bool RadWorld_Go()
 		BuildFacesVisibleToLights( true );
 	}
 
+	// Pick up the last compile's results for the faces whose inputs haven't changed
+	if ( g_bLightCache && !g_pIncremental && !g_bUseMPI )
+	{
+		char lightCacheFile[_MAX_PATH];
+		Q_snprintf( lightCacheFile, sizeof( lightCacheFile ), "%s.%s.lightcache", source, g_bHDR ? "hdr" : "ldr" );
+		g_FaceLightCache.Init( lightCacheFile );
+	}
+
 	// build initial facelights
 	if (g_bUseMPI) 
 	{
 		// RunThreadsOnIndividual (numfaces, true, BuildFacelights);
 		RunMPIBuildFacelights();
 	}
+	else if ( DW_IsActive() )
+	{
+		DW_RunBuildFacelights();
+	}
 	else 
 	{
 		RunThreadsOnIndividual (numfaces, true, BuildFacelights);
@@ -2033,8 +2060,19 @@ bool RadWorld_Go()
 	if( g_pIncremental && (g_iCurFace != numfaces) )
 		return false;
 
+	if ( g_FaceLightCache.IsActive() )
+	{
+		Msg( "Face light cache: reused %d of %d faces\n", g_FaceLightCache.GetNumRestored(), numfaces );
+		g_FaceLightCache.Save();
+		g_FaceLightCache.Shutdown();
+	}
+
 	// Figure out the offset into lightmap data for each face.
 	PrecompLightmapOffsets();
+
+	// Workers are done once the coordinator has everything they can help with.
+	if ( DW_IsWorker() && ( g_pIncremental || numbounce == 0 ) )
+		DW_FinishWorker();
 	
 	// If we're doing incremental lighting, stop here.
 	if( g_pIncremental )
@@ -2066,8 +2104,13 @@ bool RadWorld_Go()
 
 			MakeAllScales ();
 
+			if ( DW_IsWorker() )
+				DW_FinishWorker();
+
 			// spread light around
 			BounceLight ();
+
+			g_TransferStore.Shutdown();
 		}
 
 		//
@@ -2124,6 +2167,13 @@ void VRAD_LoadBSP( char const *pFilename )
 {
 	ThreadSetDefault ();
 
+	while ( s_DispTested.Count() < GetThreadArraySize() )
+	{
+		DispTested_t &dispTested = s_DispTested[s_DispTested.AddToTail()];
+		dispTested.m_Enum = 0;
+		dispTested.m_pTested = NULL;
+	}
+
 	g_flStartTime = Plat_FloatTime();
 
 	if( g_bLowPriority )
@@ -2141,7 +2191,7 @@ void VRAD_LoadBSP( char const *pFilename )
 	// so we prepend qdir here.
 	strcpy( source, ExpandPath( source ) );
 
-	if ( !g_bUseMPI )
+	if ( !g_bUseMPI && !DW_IsWorker() )
 	{
 		// Setup the logfile.
 		char logFile[512];
@@ -2254,10 +2304,23 @@ void VRAD_LoadBSP( char const *pFilename )
 	if ( g_bDumpRtEnv )
 		WriteRTEnv("trace.txt");
 
+	// The face light cache needs the triangles before they're converted for intersection
+	if ( g_bLightCache )
+		g_FaceLightCache.BuildOccluderGrid( g_RtEnv );
+
 	// Build acceleration structure
 	printf ( "Setting up ray-trace acceleration structure... ");
 	float start = Plat_FloatTime();
-	g_RtEnv.SetupAccelerationStructure();
+	if ( g_bRtCache && !DW_IsWorker() )
+	{
+		char rtCacheFile[_MAX_PATH];
+		Q_snprintf( rtCacheFile, sizeof( rtCacheFile ), "%s.rtcache", source );
+		g_RtEnv.SetupAccelerationStructure( rtCacheFile );
+	}
+	else
+	{
+		g_RtEnv.SetupAccelerationStructure();
+	}
 	float end = Plat_FloatTime();
 	printf ( "Done (%.2f seconds)\n", end-start );
 
@@ -2422,6 +2485,23 @@ int ParseCommandLine( int argc, char **argv, bool *onlydetail )
 				return 1;
 			}
 		}
+		else if (!Q_stricmp(argv[i],"-transfermem"))
+		{
+			if ( ++i < argc )
+			{
+				g_nTransferMemoryMB = atoi (argv[i]);
+				if ( g_nTransferMemoryMB < 0 )
+				{
+					Warning("Error: expected non-negative value after '-transfermem'\n" );
+					return 1;
+				}
+			}
+			else
+			{
+				Warning("Error: expected a value after '-transfermem'\n" );
+				return 1;
+			}
+		}
 		else if (!Q_stricmp(argv[i],"-verbose") || !Q_stricmp(argv[i],"-v"))
 		{
 			verbose = true;
@@ -2475,6 +2555,18 @@ int ParseCommandLine( int argc, char **argv, bool *onlydetail )
 		{
 			g_bNoSkyRecurse = true;
 		}
+		else if (!Q_stricmp(argv[i],"-rtcache"))
+		{
+			g_bRtCache = true;
+		}
+		else if (!Q_stricmp(argv[i],"-lightcache"))
+		{
+			g_bLightCache = true;
+		}
+		else if (!Q_stricmp(argv[i],"-bvh"))
+		{
+			g_RtEnv.Flags |= RTE_FLAGS_USE_BVH;
+		}
 		else if (!Q_stricmp(argv[i],"-final"))
 		{
 			g_flSkySampleScale = 16.0;
@@ -2782,6 +2874,9 @@ void PrintUsage( int argc, char **argv )
 		"  -extrasky n     : trace N times as many rays for indirect light and sky ambient.\n"
 		"  -low            : Run as an idle-priority process.\n"
 		"  -mpi            : Use VMPI to distribute computations.\n"
+		"  -workers #      : Split the work between # worker processes on this machine.\n"
+		"  -workerport #   : Also accept workers from other machines on this port. Run\n"
+		"                    them with -coordinator <host>:<port> and the same options.\n"
 		"  -rederror       : Show errors in red.\n"
 		"\n"
 		"  -vproject <directory> : Override the VPROJECT environment variable.\n"
@@ -2830,6 +2925,13 @@ void PrintUsage( int argc, char **argv )
 		"  -textureshadows : Allows texture alpha channels to block light - rays intersecting alpha surfaces will sample the texture\n"
 		"  -noskyboxrecurse : Turn off recursion into 3d skybox (skybox shadows on world)\n"
 		"  -nossprops      : Globally disable self-shadowing on static props\n"
+		"  -rtcache        : Save the ray-trace acceleration structure next to the bsp and reuse\n"
+		"                    it on later runs if the geometry hasn't changed\n"
+		"  -lightcache     : Keep each face's direct lighting in <mapname>.<ldr|hdr>.lightcache and\n"
+		"                    only relight faces whose geometry, lights or occluders changed\n"
+		"  -bvh            : Trace rays against a bounding volume hierarchy instead of a kd-tree\n"
+		"  -transfermem #  : Megabytes of compressed bounce transfers to keep in memory. The rest\n"
+		"                    are written to <mapname>.transfers (default: 0, keep everything in memory)\n"
 		"\n"
 #if 1 // Disabled for the initial SDK release with VMPI so we can get feedback from selected users.
 		);
@@ -2911,6 +3013,9 @@ int VRAD_Main(int argc, char **argv)
 	// This must come first.
 	VRAD_SetupMPI( argc, argv );
 
+	if ( DW_Init( argc, argv ) && g_bUseMPI )
+		Error( "-workers, -workerport and -coordinator can't be used with -mpi.\n" );
+
 	// Initialize the filesystem, so additional commandline options can be loaded
 	Q_StripExtension( argv[ argc - 1 ], source, sizeof( source ) );
 	CmdLib_InitFileSystem( argv[ argc - 1 ] );
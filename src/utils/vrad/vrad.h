@@ -27,6 +27,7 @@
 #include "VRAD_DispColl.h"
 #include "UtlMemory.h"
 #include "UtlHash.h"
+#include "tier1/utlflathash.h"
 #include "utlvector.h"
 #include "iincremental.h"
 #include "raytrace.h"
@@ -236,8 +237,7 @@ struct CPatch
 //	struct		patch_s		*nextparent;		    // next in face
 //	struct		patch_s		*nextclusterchild;		// next terminal child in cluster
 
-	int			numtransfers;
-	transfer_t	*transfers;
+	int			numtransfers;		// the transfers themselves are in g_TransferStore
 
 	short		indices[3];				// displacement use these for subdivision
 };
@@ -386,6 +386,11 @@ void TestLine( FourVectors const& start, FourVectors const& stop, fltx4 *pFracti
 void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
                           fltx4 *pFractionVisible, bool canRecurse = true, int static_prop_to_skip=-1, bool bDoDebug = false );
 
+// TestLine_DoesHitSky for many lines at once. Lines are regrouped by direction so pairs of them can
+// be traced 8 wide on cpus with AVX.
+void TestLines_DoesHitSky( FourVectors const *pStarts, FourVectors const *pStops, int nLines,
+                           fltx4 *pFractionVisible, bool canRecurse = true, int static_prop_to_skip=-1 );
+
 // converts any marked brush entities to triangles for shadow casting
 void ExtractBrushEntityShadowCasters ( void );
 void AddBrushesForRayTrace ( void );
@@ -565,8 +570,8 @@ void PatchSampleData_AddSample( CPatch *pPatch, int ndxPatch );
 unsigned short IncrementPatchIterationKey();
 void SampleData_Log( void );
 
-extern CUtlHash<SampleData_t>		g_SampleHashTable;
-extern CUtlHash<PatchSampleData_t>	g_PatchSampleHashTable;
+extern CUtlFlatHash<SampleData_t>		g_SampleHashTable;
+extern CUtlFlatHash<PatchSampleData_t>	g_PatchSampleHashTable;
 
 extern int samplesAdded;
 extern int patchSamplesAdded;
@@ -600,8 +605,8 @@ public:
 	virtual void AddPolysForRayTrace() = 0;
 };
 
-//extern PropTested_t s_PropTested[MAX_TOOL_THREADS+1];
-extern DispTested_t s_DispTested[MAX_TOOL_THREADS+1];
+//extern CUtlVector<PropTested_t> s_PropTested;
+extern CUtlVector<DispTested_t> s_DispTested;		// GetThreadArraySize() entries, set up by VRAD_LoadBSP
 
 IVradStaticPropMgr* StaticPropMgr();
 
@@ -0,0 +1,117 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: vvis stages run through DW_DistributeWork (see distribute_work.h).
+//			These mirror the VMPI versions in mpivis.cpp, except that the
+//			results are shared with the workers by the coordinator instead of
+//			through a virtual file and multicast.
+//
+//=============================================================================//
+
+#include "vis.h"
+#include "threads.h"
+#include "pacifier.h"
+#include "distribute_work.h"
+#include "distvis.h"
+
+
+//-----------------------------------------------------------------------------
+// BasePortalVis. Every worker needs every portal's front and flood bits for
+// PortalFlow, so the results are shared.
+//-----------------------------------------------------------------------------
+static void DW_ProcessBasePortalVis( int iThread, uint64 iPortal, CUtlBuffer *pBuf )
+{
+	BasePortalVis( iThread, iPortal );
+
+	if ( pBuf )
+	{
+		portal_t * p = &portals[iPortal];
+		pBuf->Put( p->portalfront, portalbytes );
+		pBuf->Put( p->portalflood, portalbytes );
+	}
+}
+
+static void DW_ReceiveBasePortalVis( uint64 iWorkUnit, CUtlBuffer &buf, int iWorker )
+{
+	portal_t * p = &portals[iWorkUnit];
+	if ( p->portalflood != 0 || p->portalfront != 0 || p->portalvis != 0 )
+	{
+		Msg( "Duplicate portal %llu\n", iWorkUnit );
+	}
+
+	if ( buf.GetBytesRemaining() != portalbytes*2 )
+		Error( "Invalid results in DW_ReceiveBasePortalVis." );
+
+	p->portalfront = (byte*)malloc( portalbytes );
+	buf.Get( p->portalfront, portalbytes );
+
+	p->portalflood = (byte*)malloc( portalbytes );
+	buf.Get( p->portalflood, portalbytes );
+
+	p->portalvis = (byte*)malloc( portalbytes );
+	memset( p->portalvis, 0, portalbytes );
+
+	p->nummightsee = CountBits( p->portalflood, g_numportals*2 );
+}
+
+void DW_RunBasePortalVis()
+{
+	Msg( "%-20s ", "BasePortalVis:" );
+	if ( !DW_IsWorker() )
+	{
+		StartPacifier( "" );
+	}
+
+	double elapsed = DW_DistributeWork( g_numportals*2, DW_ProcessBasePortalVis, DW_ReceiveBasePortalVis, DW_SHARE_RESULTS );
+
+	if ( !DW_IsWorker() )
+	{
+		EndPacifier( false );
+	}
+	Msg( " (%d)\n", (int)elapsed );
+}
+
+
+//-----------------------------------------------------------------------------
+// PortalFlow. Workers use the finished portals they're sent to cut their
+// own flows short, same as the VMPI multicast.
+//-----------------------------------------------------------------------------
+static void DW_ProcessPortalFlow( int iThread, uint64 iPortal, CUtlBuffer *pBuf )
+{
+	PortalFlow( iThread, iPortal );
+
+	if ( pBuf )
+	{
+		portal_t * p = sorted_portals[iPortal];
+		pBuf->Put( p->portalvis, portalbytes );
+	}
+}
+
+static void DW_ReceivePortalFlow( uint64 iWorkUnit, CUtlBuffer &buf, int iWorker )
+{
+	portal_t *p = sorted_portals[iWorkUnit];
+	if ( buf.GetBytesRemaining() != portalbytes )
+		Error( "Invalid results in DW_ReceivePortalFlow." );
+
+	if ( p->status != stat_done )
+	{
+		buf.Get( p->portalvis, portalbytes );
+		p->status = stat_done;
+	}
+}
+
+void DW_RunPortalFlow()
+{
+	Msg( "%-20s ", "PortalFlow:" );
+	if ( !DW_IsWorker() )
+	{
+		StartPacifier( "" );
+	}
+
+	double elapsed = DW_DistributeWork( g_numportals*2, DW_ProcessPortalFlow, DW_ReceivePortalFlow, DW_SHARE_RESULTS );
+
+	if ( !DW_IsWorker() )
+	{
+		EndPacifier( false );
+	}
+	Msg( " (%d)\n", (int)elapsed );
+}
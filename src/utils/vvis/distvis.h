@@ -0,0 +1,18 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: vvis stages run through DW_DistributeWork (see distribute_work.h).
+//
+//=============================================================================//
+
+#ifndef DISTVIS_H
+#define DISTVIS_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+
+void DW_RunBasePortalVis();
+void DW_RunPortalFlow();
+
+
+#endif // DISTVIS_H
@@ -7,6 +7,10 @@
 //=============================================================================//
 #include "vis.h"
 #include "vmpi.h"
+#include "mathlib/ssemath.h"
+#include "tier1/processor_detect.h"
+#include "tier0/threadtools.h"
+#include <emmintrin.h>
 
 int g_TraceClusterStart = -1;
 int g_TraceClusterStop = -1;
@@ -29,13 +33,26 @@ int g_TraceClusterStop = -1;
   void CalcMightSee (leaf_t *leaf, 
 */
 
+static FORCEINLINE int CountBits32 (uint32 v)
+{
+	v = v - ((v >> 1) & 0x55555555);
+	v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+	return (((v + (v >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+}
+
 int CountBits (byte *bits, int numbits)
 {
 	int		i;
 	int		c;
+	uint32	word;
 
 	c = 0;
-	for (i=0 ; i<numbits ; i++)
+	for (i=0 ; i+32<=numbits ; i+=32)
+	{
+		memcpy (&word, bits + (i>>3), sizeof(word));
+		c += CountBits32 (word);
+	}
+	for ( ; i<numbits ; i++)
 		if ( CheckBit( bits, i ) )
 			c++;
 
@@ -52,6 +69,149 @@ int		active;
 
 extern bool g_bVMPIEarlyExit;
 
+// totals of the threaddata_t early out counters
+static int64	g_nFlowChains, g_nFlowMightSkip, g_nFlowNewSkip, g_nFlowPlaneSkip, g_nFlowClipSkip, g_nFlowEmptySkip;
+
+
+/*
+===============================================================================
+
+Flow kernel
+
+The bit strings are processed a PORTAL_BLOCK_BITS block at a time, either
+with SSE2 or, when the cpu has it, AVX (flow_avx.cpp).
+
+might = prev & test over the blocks [first, last).  Returns true if might has
+any bits that aren't in vis yet.  first and last are narrowed down to the
+blocks of might that have bits set, so deeper levels of the recursion only
+look at the part of the bit string that is still alive.
+
+===============================================================================
+*/
+
+typedef bool (*FlowBitsFn_t) (const byte *prev, const byte *test, const byte *vis, byte *might, int &first, int &last);
+
+extern bool FlowAVXKernelAvailable (void);
+extern bool FlowBitsAVX (const byte *prev, const byte *test, const byte *vis, byte *might, int &first, int &last);
+
+ASSERT_INVARIANT( PORTAL_BLOCK_BYTES == 2 * sizeof( __m128i ) );
+ASSERT_INVARIANT( ( 1 << PORTAL_BLOCK_SHIFT ) == PORTAL_BLOCK_BITS );
+
+static bool FlowBitsSSE2 (const byte *prev, const byte *test, const byte *vis, byte *might, int &first, int &last)
+{
+	__m128i	zero = _mm_setzero_si128();
+	__m128i	more = zero;
+	int		newfirst = -1;
+	int		newlast = 0;
+
+	for (int b=first ; b<last ; b++)
+	{
+		int ofs = b * PORTAL_BLOCK_BYTES;
+		__m128i m0 = _mm_and_si128( _mm_loadu_si128( (const __m128i *)(prev + ofs) ), _mm_loadu_si128( (const __m128i *)(test + ofs) ) );
+		__m128i m1 = _mm_and_si128( _mm_loadu_si128( (const __m128i *)(prev + ofs + 16) ), _mm_loadu_si128( (const __m128i *)(test + ofs + 16) ) );
+		_mm_storeu_si128( (__m128i *)(might + ofs), m0 );
+		_mm_storeu_si128( (__m128i *)(might + ofs + 16), m1 );
+
+		if ( _mm_movemask_epi8( _mm_cmpeq_epi8( _mm_or_si128( m0, m1 ), zero ) ) == 0xffff )
+			continue;
+
+		if (newfirst < 0)
+			newfirst = b;
+		newlast = b + 1;
+
+		more = _mm_or_si128( more, _mm_andnot_si128( _mm_loadu_si128( (const __m128i *)(vis + ofs) ), m0 ) );
+		more = _mm_or_si128( more, _mm_andnot_si128( _mm_loadu_si128( (const __m128i *)(vis + ofs + 16) ), m1 ) );
+	}
+
+	if (newfirst < 0)
+		newfirst = newlast = 0;
+	first = newfirst;
+	last = newlast;
+
+	return _mm_movemask_epi8( _mm_cmpeq_epi8( more, zero ) ) != 0xffff;
+}
+
+static FlowBitsFn_t s_pFlowBits = FlowBitsSSE2;
+
+/*
+==============
+InitPortalFlow
+
+Call once the portals are loaded
+==============
+*/
+void InitPortalFlow (void)
+{
+	if ( FlowAVXKernelAvailable() && CheckAVXTechnology() )
+	{
+		s_pFlowBits = FlowBitsAVX;
+		qprintf ("portal flow: AVX\n");
+	}
+	else
+	{
+		s_pFlowBits = FlowBitsSSE2;
+		qprintf ("portal flow: SSE2\n");
+	}
+
+	g_nFlowChains = g_nFlowMightSkip = g_nFlowNewSkip = g_nFlowPlaneSkip = g_nFlowClipSkip = g_nFlowEmptySkip = 0;
+}
+
+void PrintPortalFlowStats (void)
+{
+	Msg ("portal flow (%s): %lld chains\n", s_pFlowBits == FlowBitsSSE2 ? "SSE2" : "AVX", g_nFlowChains);
+	Msg ("  skipped: %lld not in mightsee, %lld nothing new, %lld wrong side, %lld clipped, %lld nothing behind\n",
+		g_nFlowMightSkip, g_nFlowNewSkip, g_nFlowPlaneSkip, g_nFlowClipSkip, g_nFlowEmptySkip);
+}
+
+
+/*
+===============================================================================
+
+Windings transposed four points at a time, so that distances to a plane are
+computed four at a time.  The last group is padded with copies of the last
+point.
+
+===============================================================================
+*/
+
+struct soawinding_t
+{
+	int			numpoints;
+	FourVectors	points[(MAX_POINTS_ON_WINDING+3)/4];
+};
+
+static FORCEINLINE void LoadWindingGroup (const winding_t *w, int i, FourVectors &out)
+{
+	int last = w->numpoints - 1;
+	out.LoadAndSwizzle( w->points[i], w->points[MIN(i+1, last)], w->points[MIN(i+2, last)], w->points[MIN(i+3, last)] );
+}
+
+static void LoadSoAWinding (const winding_t *w, soawinding_t &out)
+{
+	out.numpoints = w->numpoints;
+	for (int i=0 ; i<w->numpoints ; i+=4)
+		LoadWindingGroup (w, i, out.points[i>>2]);
+}
+
+// dists needs room for numpoints rounded up to a multiple of 4
+static FORCEINLINE void SoAPlaneDists (const soawinding_t &w, const plane_t &plane, float *dists)
+{
+	fltx4 planedist = ReplicateX4( plane.dist );
+	for (int i=0 ; i<w.numpoints ; i+=4)
+		StoreUnalignedSIMD( dists + i, SubSIMD( w.points[i>>2] * plane.normal, planedist ) );
+}
+
+static FORCEINLINE void WindingPlaneDists (const winding_t *w, const plane_t &plane, float *dists)
+{
+	fltx4 planedist = ReplicateX4( plane.dist );
+	FourVectors group;
+	for (int i=0 ; i<w->numpoints ; i+=4)
+	{
+		LoadWindingGroup (w, i, group);
+		StoreUnalignedSIMD( dists + i, SubSIMD( group * plane.normal, planedist ) );
+	}
+}
+
 
 void CheckStack (leaf_t *leaf, threaddata_t *thread)
 {
@@ -126,11 +286,10 @@ winding_t	*ChopWinding (winding_t *in, pstack_t *stack, plane_t *split)
 	counts[0] = counts[1] = counts[2] = 0;
 
 // determine sides for each point
+	WindingPlaneDists (in, *split, dists);
 	for (i=0 ; i<in->numpoints ; i++)
 	{
-		dot = DotProduct (in->points[i], split->normal);
-		dot -= split->dist;
-		dists[i] = dot;
+		dot = dists[i];
 		if (dot > ON_VIS_EPSILON)
 			sides[i] = SIDE_FRONT;
 		else if (dot < -ON_VIS_EPSILON)
@@ -232,9 +391,12 @@ If target is totally clipped away, that portal can not be seen through.
 Normal clip keeps target on the same side as pass, which is correct if the
 order goes source, pass, target.  If the order goes pass, source, target then
 flipclip should be set.
+
+soasource and soapass are the transposed source and pass, which are used to
+test each candidate plane against all of their points at once.
 ==============
 */
-winding_t	*ClipToSeperators (winding_t *source, winding_t *pass, winding_t *target, bool flipclip, pstack_t *stack)
+winding_t	*ClipToSeperators (winding_t *source, const soawinding_t &soasource, winding_t *pass, const soawinding_t &soapass, winding_t *target, bool flipclip, pstack_t *stack)
 {
 	int			i, j, k, l;
 	plane_t		plane;
@@ -243,6 +405,8 @@ winding_t	*ClipToSeperators (winding_t *source, winding_t *pass, winding_t *targ
 	vec_t		length;
 	int			counts[3];
 	bool		fliptest;
+	float		sourcedists[MAX_POINTS_ON_WINDING+4];
+	float		passdists[MAX_POINTS_ON_WINDING+4];
 
 // check all combinations	
 	for (i=0 ; i<source->numpoints ; i++)
@@ -283,12 +447,13 @@ winding_t	*ClipToSeperators (winding_t *source, winding_t *pass, winding_t *targ
 		// source portal
 		//
 #if 1
+			SoAPlaneDists (soasource, plane, sourcedists);
 			fliptest = false;
 			for (k=0 ; k<source->numpoints ; k++)
 			{
 				if (k == i || k == l)
 					continue;
-				d = DotProduct (source->points[k], plane.normal) - plane.dist;
+				d = sourcedists[k];
 				if (d < -ON_VIS_EPSILON)
 				{	// source is on the negative side, so we want all
 					// pass and target on the positive side
@@ -320,12 +485,13 @@ winding_t	*ClipToSeperators (winding_t *source, winding_t *pass, winding_t *targ
 		// if all of the pass portal points are now on the positive side,
 		// this is the seperating plane
 		//
+			SoAPlaneDists (soapass, plane, passdists);
 			counts[0] = counts[1] = counts[2] = 0;
 			for (k=0 ; k<pass->numpoints ; k++)
 			{
 				if (k==j)
 					continue;
-				d = DotProduct (pass->points[k], plane.normal) - plane.dist;
+				d = passdists[k];
 				if (d < -ON_VIS_EPSILON)
 					break;
 				else if (d > ON_VIS_EPSILON)
@@ -481,9 +647,12 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 	portal_t	*p;
 	plane_t		backplane;
 	leaf_t 		*leaf;
-	int			i, j;
-	long		*test, *might, *vis, more;
-	int			pnum;
+	int			i;
+	byte		*test;
+	bool		more;
+	int			pnum, block;
+	soawinding_t	soasource, soaprevpass;
+	bool		prevpassloaded;
 
 	// Early-out if we're a VMPI worker that's told to exit. If we don't do this here, then the
 	// worker might spin its wheels for a while on an expensive work unit and not be available to the pool.
@@ -506,8 +675,7 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 	stack.leaf = leaf;
 	stack.portal = NULL;
 
-	might = (long *)stack.mightsee;
-	vis = (long *)thread->base->portalvis;
+	prevpassloaded = false;
 	
 	// check all portals for flowing into other leafs	
 	for (i=0 ; i<leaf->portals.Count() ; i++)
@@ -516,30 +684,30 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 		p = leaf->portals[i];
 		pnum = p - portals;
 
-		if ( ! (prevstack->mightsee[pnum >> 3] & (1<<(pnum&7)) ) )
+		block = pnum >> PORTAL_BLOCK_SHIFT;
+		if ( block < prevstack->mightfirst || block >= prevstack->mightlast || !CheckBit( prevstack->mightsee, pnum ) )
 		{
+			thread->c_mightskip++;
 			continue;	// can't possibly see it
 		}
 
 		// if the portal can't see anything we haven't allready seen, skip it
 		if (p->status == stat_done)
 		{
-			test = (long *)p->portalvis;
+			test = p->portalvis;
 		}
 		else
 		{
-			test = (long *)p->portalflood;
+			test = p->portalflood;
 		}
 
-		more = 0;
-		for (j=0 ; j<portallongs ; j++)
-		{
-			might[j] = ((long *)prevstack->mightsee)[j] & test[j];
-			more |= (might[j] & ~vis[j]);
-		}
+		stack.mightfirst = prevstack->mightfirst;
+		stack.mightlast = prevstack->mightlast;
+		more = s_pFlowBits (prevstack->mightsee, test, thread->base->portalvis, stack.mightsee, stack.mightfirst, stack.mightlast);
 		
 		if ( !more && CheckBit( thread->base->portalvis, pnum ) )
 		{	// can't see anything new
+			thread->c_newskip++;
 			continue;
 		}
 
@@ -558,6 +726,7 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 		d -= thread->pstack_head.portalplane.dist;
 		if (d < -p->radius)
 		{
+			thread->c_planeskip++;
 			continue;
 		}
 		else if (d > p->radius)
@@ -568,7 +737,10 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 		{
 			stack.pass = ChopWinding (p->winding, &stack, &thread->pstack_head.portalplane);
 			if (!stack.pass)
+			{
+				thread->c_planeskip++;
 				continue;
+			}
 		}
 
 
@@ -576,6 +748,7 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 		d -= p->plane.dist;
 		if (d > thread->base->radius)
 		{
+			thread->c_planeskip++;
 			continue;
 		}
 		else if (d < -thread->base->radius)
@@ -586,31 +759,49 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 		{
 			stack.source = ChopWinding (prevstack->source, &stack, &backplane);
 			if (!stack.source)
+			{
+				thread->c_planeskip++;
 				continue;
+			}
 		}
 
 
-		if (!prevstack->pass)
-		{	// the second leaf can only be blocked if coplanar
-
-			// mark the portal as visible
-			SetBit( thread->base->portalvis, pnum );
+		if (prevstack->pass)
+		{
+			if (!prevpassloaded)
+			{
+				LoadSoAWinding (prevstack->pass, soaprevpass);
+				prevpassloaded = true;
+			}
+			LoadSoAWinding (stack.source, soasource);
 
-			RecursiveLeafFlow (p->leaf, thread, &stack);
-			continue;
+			stack.pass = ClipToSeperators (stack.source, soasource, prevstack->pass, soaprevpass, stack.pass, false, &stack);
+			if (!stack.pass)
+			{
+				thread->c_clipskip++;
+				continue;
+			}
+			
+			stack.pass = ClipToSeperators (prevstack->pass, soaprevpass, stack.source, soasource, stack.pass, true, &stack);
+			if (!stack.pass)
+			{
+				thread->c_clipskip++;
+				continue;
+			}
 		}
-
-		stack.pass = ClipToSeperators (stack.source, prevstack->pass, stack.pass, false, &stack);
-		if (!stack.pass)
-			continue;
-		
-		stack.pass = ClipToSeperators (prevstack->pass, stack.source, stack.pass, true, &stack);
-		if (!stack.pass)
-			continue;
+		// else the second leaf can only be blocked if coplanar
 
 		// mark the portal as visible
 		SetBit( thread->base->portalvis, pnum );
 
+		// with nothing left in mightsee the next leaf can't flow anywhere, but
+		// a trace still has to check whether it reached the stop cluster
+		if ( stack.mightfirst == stack.mightlast && g_TraceClusterStop < 0 )
+		{
+			thread->c_emptyskip++;
+			continue;
+		}
+
 		// flow through it for real
 		RecursiveLeafFlow (p->leaf, thread, &stack);
 	}	
@@ -627,7 +818,6 @@ generates the portalvis bit vector
 void PortalFlow (int iThread, int portalnum)
 {
 	threaddata_t	data;
-	int				i;
 	portal_t		*p;
 	int				c_might, c_can;
 
@@ -642,8 +832,11 @@ void PortalFlow (int iThread, int portalnum)
 	data.pstack_head.portal = p;
 	data.pstack_head.source = p->winding;
 	data.pstack_head.portalplane = p->plane;
-	for (i=0 ; i<portallongs ; i++)
-		((long *)data.pstack_head.mightsee)[i] = ((long *)p->portalflood)[i];
+
+	// copy portalflood into the head's mightsee and find the blocks that have bits set
+	data.pstack_head.mightfirst = 0;
+	data.pstack_head.mightlast = portalblocks;
+	s_pFlowBits (p->portalflood, p->portalflood, p->portalvis, data.pstack_head.mightsee, data.pstack_head.mightfirst, data.pstack_head.mightlast);
 
 	RecursiveLeafFlow (p->leaf, &data, &data.pstack_head);
 
@@ -654,6 +847,13 @@ void PortalFlow (int iThread, int portalnum)
 
 	qprintf ("portal:%4i  mightsee:%4i  cansee:%4i (%i chains)\n", 
 		(int)(p - portals),	c_might, c_can, data.c_chains);
+
+	ThreadInterlockedExchangeAdd64 (&g_nFlowChains, data.c_chains);
+	ThreadInterlockedExchangeAdd64 (&g_nFlowMightSkip, data.c_mightskip);
+	ThreadInterlockedExchangeAdd64 (&g_nFlowNewSkip, data.c_newskip);
+	ThreadInterlockedExchangeAdd64 (&g_nFlowPlaneSkip, data.c_planeskip);
+	ThreadInterlockedExchangeAdd64 (&g_nFlowClipSkip, data.c_clipskip);
+	ThreadInterlockedExchangeAdd64 (&g_nFlowEmptySkip, data.c_emptyskip);
 }
 
 
@@ -715,6 +915,7 @@ void BasePortalVis (int iThread, int portalnum)
 	winding_t	*w;
 	Vector		segment;
 	double		dist2, minDist2;
+	float		dists[MAX_POINTS_ON_WINDING+4];
 
 	// get the portal
 	p = portals+portalnum;
@@ -740,14 +941,25 @@ void BasePortalVis (int iThread, int portalnum)
 		if (j == portalnum)
 			continue;
 
+		//
+		// trivially reject with the bounding spheres before looking at the points
+		//
+		d = DotProduct (tp->origin, p->plane.normal) - p->plane.dist;
+		if (d < -tp->radius)
+			continue;	// no points on front
+
+		d = DotProduct (p->origin, tp->plane.normal) - tp->plane.dist;
+		if (d > p->radius)
+			continue;	// no points on back
+
 		//
 		//
 		//
 		w = tp->winding;
+		WindingPlaneDists (w, p->plane, dists);
 		for (k=0 ; k<w->numpoints ; k++)
 		{
-			d = DotProduct (w->points[k], p->plane.normal) - p->plane.dist;
-			if (d > ON_VIS_EPSILON)
+			if (dists[k] > ON_VIS_EPSILON)
 				break;
 		}
 		if (k == w->numpoints)
@@ -757,10 +969,10 @@ void BasePortalVis (int iThread, int portalnum)
 		//
 		//
 		w = p->winding;
+		WindingPlaneDists (w, tp->plane, dists);
 		for (k=0 ; k<w->numpoints ; k++)
 		{
-			d = DotProduct (w->points[k], tp->plane.normal) - tp->plane.dist;
-			if (d < -ON_VIS_EPSILON)
+			if (dists[k] < -ON_VIS_EPSILON)
 				break;
 		}
 		if (k == w->numpoints)
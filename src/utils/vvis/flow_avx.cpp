@@ -0,0 +1,80 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: 256 bit version of the portal flow kernel in flow.cpp. This file is
+//			built with AVX code generation, so nothing in it may be called
+//			unless CheckAVXTechnology() says the cpu and OS support it.
+//			InitPortalFlow takes care of that.
+//
+// $NoKeywords: $
+//=============================================================================//
+#include "vis.h"
+#include "tier1/processor_detect.h"
+
+#if COMPILER_SUPPORTS_AVX
+
+#if defined( __GNUC__ ) && !defined( __AVX__ )
+#pragma GCC target( "avx" )
+#endif
+
+#include <immintrin.h>
+
+bool FlowAVXKernelAvailable (void)
+{
+	return true;
+}
+
+ASSERT_INVARIANT( PORTAL_BLOCK_BYTES == sizeof( __m256 ) );
+
+// AVX has no 256 bit integer ops, but the float and/andnot/or are plain bitwise
+// ops and vptest works on the whole register.
+bool FlowBitsAVX (const byte *prev, const byte *test, const byte *vis, byte *might, int &first, int &last)
+{
+	__m256	more = _mm256_setzero_ps();
+	int		newfirst = -1;
+	int		newlast = 0;
+
+	for (int b=first ; b<last ; b++)
+	{
+		int ofs = b * PORTAL_BLOCK_BYTES;
+		__m256 m = _mm256_and_ps( _mm256_loadu_ps( (const float *)(prev + ofs) ), _mm256_loadu_ps( (const float *)(test + ofs) ) );
+		_mm256_storeu_ps( (float *)(might + ofs), m );
+
+		__m256i mi = _mm256_castps_si256( m );
+		if ( _mm256_testz_si256( mi, mi ) )
+			continue;
+
+		if (newfirst < 0)
+			newfirst = b;
+		newlast = b + 1;
+
+		more = _mm256_or_ps( more, _mm256_andnot_ps( _mm256_loadu_ps( (const float *)(vis + ofs) ), m ) );
+	}
+
+	if (newfirst < 0)
+		newfirst = newlast = 0;
+	first = newfirst;
+	last = newlast;
+
+	__m256i morei = _mm256_castps_si256( more );
+	bool bMore = !_mm256_testz_si256( morei, morei );
+
+	// avoid the avx->sse transition penalty in the caller
+	_mm256_zeroupper();
+	return bMore;
+}
+
+#else // !COMPILER_SUPPORTS_AVX
+
+bool FlowAVXKernelAvailable (void)
+{
+	return false;
+}
+
+bool FlowBitsAVX (const byte *prev, const byte *test, const byte *vis, byte *might, int &first, int &last)
+{
+	// only reachable if InitPortalFlow is wrong
+	Error ("FlowBitsAVX called, but this compiler can't build AVX code\n");
+	return false;
+}
+
+#endif // COMPILER_SUPPORTS_AVX
@@ -64,9 +64,16 @@ struct leaf_t
 };
 
 	
+// Portal bit strings are padded to whole blocks, which is what the flow kernel
+// works on at a time.
+#define PORTAL_BLOCK_BITS	256
+#define PORTAL_BLOCK_BYTES	(PORTAL_BLOCK_BITS/8)
+#define PORTAL_BLOCK_SHIFT	8
+
 struct pstack_t
 {
 	byte		mightsee[MAX_PORTALS/8];		// bit string
+	int			mightfirst, mightlast;			// blocks of mightsee that can have bits set, the rest are garbage
 	pstack_t	*next;
 	leaf_t		*leaf;
 	portal_t	*portal;	// portal exiting
@@ -84,6 +91,13 @@ struct threaddata_t
 	portal_t	*base;
 	int			c_chains;
 	pstack_t	pstack_head;
+
+	// early outs taken by RecursiveLeafFlow
+	int			c_mightskip;	// portal not in mightsee
+	int			c_newskip;		// portal can't see anything new
+	int			c_planeskip;	// portal or source on the wrong side
+	int			c_clipskip;		// clipped away by the seperating planes
+	int			c_emptyskip;	// visible, but nothing to flow into
 };
 
 extern	int			g_numportals;
@@ -104,7 +118,7 @@ extern	int			testlevel;
 extern	byte		*uncompressed;
 
 extern	int		leafbytes, leaflongs;
-extern	int		portalbytes, portallongs;
+extern	int		portalbytes, portallongs, portalblocks;
 
 
 void LeafFlow (int leafnum);
@@ -113,6 +127,8 @@ void LeafFlow (int leafnum);
 void BasePortalVis (int iThread, int portalnum);
 void BetterPortalVis (int portalnum);
 void PortalFlow (int iThread, int portalnum);
+void InitPortalFlow (void);
+void PrintPortalFlowStats (void);
 void WritePortalTrace( const char *source );
 
 extern	portal_t	*sorted_portals[MAX_MAP_PORTALS*2];
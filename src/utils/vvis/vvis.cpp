@@ -14,6 +14,8 @@
 #include "pacifier.h"
 #include "vmpi.h"
 #include "mpivis.h"
+#include "distribute_work.h"
+#include "distvis.h"
 #include "tier1/strtools.h"
 #include "collisionutils.h"
 #include "tier0/icommandline.h"
@@ -42,10 +44,13 @@ int			originalvismapsize;
 int			leafbytes;				// (portalclusters+63)>>3
 int			leaflongs;
 
-int			portalbytes, portallongs;
+int			portalbytes, portallongs, portalblocks;
 
 bool		fastvis;
 bool		nosort;
+bool		g_bBench = false;
+
+double		g_flBasePortalVisTime, g_flPortalFlowTime;
 
 int			totalvis;
 
@@ -306,6 +311,10 @@ void CalcPortalVis (void)
 	{
  		RunMPIPortalFlow();
 	}
+	else if ( DW_IsActive() )
+	{
+		DW_RunPortalFlow();
+	}
 	else 
 	{
 		RunThreadsOnIndividual (g_numportals*2, true, PortalFlow);
@@ -330,19 +339,32 @@ CalcVis
 void CalcVis (void)
 {
 	int		i;
+	double	start;
 
+	start = Plat_FloatTime();
 	if (g_bUseMPI) 
 	{
 		RunMPIBasePortalVis();
 	}
+	else if ( DW_IsActive() )
+	{
+		DW_RunBasePortalVis();
+	}
 	else 
 	{
 	    RunThreadsOnIndividual (g_numportals*2, true, BasePortalVis);
 	}
+	g_flBasePortalVisTime = Plat_FloatTime() - start;
 
 	SortPortals ();
 
+	start = Plat_FloatTime();
 	CalcPortalVis ();
+	g_flPortalFlowTime = Plat_FloatTime() - start;
+
+	// the coordinator does the rest
+	if ( DW_IsWorker() )
+		DW_FinishWorker();
 
 	//
 	// assemble the leaf vis lists by oring the portal lists
@@ -472,8 +494,10 @@ void LoadPortals (char *name)
 	leafbytes = ((portalclusters+63)&~63)>>3;
 	leaflongs = leafbytes/sizeof(long);
 	
-	portalbytes = ((g_numportals*2+63)&~63)>>3;
+	// portal bit strings are padded to the flow kernel's block size
+	portalbytes = ((g_numportals*2+PORTAL_BLOCK_BITS-1)&~(PORTAL_BLOCK_BITS-1))>>3;
 	portallongs = portalbytes/sizeof(long);
+	portalblocks = portalbytes/PORTAL_BLOCK_BYTES;
 
 // each file portal is split into two memory portals
 	portals = (portal_t*)malloc(2*g_numportals*sizeof(portal_t));
@@ -921,6 +945,11 @@ int ParseCommandLine( int argc, char **argv )
 			Msg ("fastvis = true\n");
 			fastvis = true;
 		}
+		else if (!Q_stricmp(argv[i], "-bench"))
+		{
+			Msg ("bench = true\n");
+			g_bBench = true;
+		}
 		else if (!Q_stricmp(argv[i], "-v") || !Q_stricmp(argv[i], "-verbose"))
 		{
 			Msg ("verbose = true\n");
@@ -1017,6 +1046,9 @@ void PrintUsage( int argc, char **argv )
 		"  -v (or -verbose): Turn on verbose output (also shows more command\n"
 		"  -fast           : Only do first quick pass on vis calculations.\n"
 		"  -mpi            : Use VMPI to distribute computations.\n"
+		"  -workers #      : Split the work between # worker processes on this machine.\n"
+		"  -workerport #   : Also accept workers from other machines on this port. Run\n"
+		"                    them with -coordinator <host>:<port> and the same options.\n"
 		"  -low            : Run as an idle-priority process.\n"
 		"                    env_fog_controller specifies one.\n"
 		"\n"
@@ -1030,6 +1062,7 @@ void PrintUsage( int argc, char **argv )
 		"  -threads        : Control the number of threads vbsp uses (defaults to the #\n"
 		"                    or processors on your machine).\n"
 		"  -nosort         : Don't sort portals (sorting is an optimization).\n"
+		"  -bench          : Time the vis passes and report portals/sec without writing the bsp.\n"
 		"  -tmpin          : Make portals come from \\tmp\\<mapname>.\n"
 		"  -tmpout         : Make portals come from \\tmp\\<mapname>.\n"
 		"  -trace <start cluster> <end cluster> : Writes a linefile that traces the vis from one cluster to another for debugging map vis.\n"
@@ -1101,7 +1134,7 @@ int RunVVis( int argc, char **argv )
 	start = Plat_FloatTime();
 
 
-	if (!g_bUseMPI)
+	if ( !g_bUseMPI && !DW_IsWorker() )
 	{
 		// Setup the logfile.
 		char logFile[512];
@@ -1154,9 +1187,24 @@ int RunVVis( int argc, char **argv )
 	
 	Msg ("reading %s\n", portalfile);
 	LoadPortals (portalfile);
+	InitPortalFlow ();
 
 	// don't write out results when simply doing a trace
-	if ( g_TraceClusterStart < 0 )
+	if ( g_TraceClusterStart < 0 && g_bBench )
+	{
+		CalcVis ();
+
+		int nPortals = g_numportals * 2;
+		Msg ("BasePortalVis: %d portals in %.2f seconds (%.0f portals/sec)\n", nPortals, g_flBasePortalVisTime,
+			nPortals / MAX( g_flBasePortalVisTime, 0.001 ) );
+		Msg ("PortalFlow:    %d portals in %.2f seconds (%.0f portals/sec)\n", nPortals, g_flPortalFlowTime,
+			nPortals / MAX( g_flPortalFlowTime, 0.001 ) );
+		if ( !g_bUseMPI && !DW_IsActive() )
+		{
+			PrintPortalFlowStats ();
+		}
+	}
+	else if ( g_TraceClusterStart < 0 )
 	{
 		CalcVis ();
 		CalcPAS ();
@@ -1180,7 +1228,7 @@ int RunVVis( int argc, char **argv )
 		{
 			Error("Invalid cluster trace: %d to %d, valid range is 0 to %d\n", g_TraceClusterStart, g_TraceClusterStop, portalclusters-1 );
 		}
-		if ( g_bUseMPI )
+		if ( g_bUseMPI || DW_IsActive() )
 		{
 			Warning("Can't compile trace in MPI mode\n");
 		}
@@ -1216,6 +1264,9 @@ int main (int argc, char **argv)
 
 	VVIS_SetupMPI( argc, argv );
 
+	if ( DW_Init( argc, argv ) && g_bUseMPI )
+		Error( "-workers, -workerport and -coordinator can't be used with -mpi.\n" );
+
 	// Install an exception handler.
 	if ( g_bUseMPI && !g_bMPIMaster )
 		SetupToolsMinidumpHandler( VMPI_ExceptionFilter );